@@ -30,6 +30,7 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <netdb.h>
@@ -49,6 +50,7 @@
 #include <termios.h>
 
 #include <boost/shared_ptr.hpp>
+#include <boost/intrusive_ptr.hpp>
 #include <boost/scoped_array.hpp>
 #include <boost/scoped_ptr.hpp>
 
@@ -61,6 +63,25 @@
 #ifdef IS_LINUX
 #define HAS_EPOLL
 #include <sys/epoll.h>
+
+// recvmmsg takes a batch of datagrams off a socket in one call
+#define HAS_RECVMMSG
+
+// eventfd is a cheaper way than a pipe for one thread to wake up another's poll loop
+#define HAS_EVENTFD
+#include <sys/eventfd.h>
+
+// io_uring support needs kernel headers new enough for buffer rings and multishot accept (5.19)
+// Whether the running kernel supports it is checked at runtime
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#ifdef IORING_ACCEPT_MULTISHOT
+#define HAS_IOURING
+#endif
+#endif
+#endif
+
 #endif
 
 #include <poll.h>
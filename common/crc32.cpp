@@ -0,0 +1,273 @@
+/*
+   Copyright 2011 John Selbie
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "commonincludes.hpp"
+#include "crc32.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAS_CRC32_CLMUL
+#include <immintrin.h>
+#endif
+
+
+// bit reflected form of 0x04C11DB7
+static const uint32_t c_crc32Polynomial = 0xEDB88320;
+
+typedef uint32_t (*Crc32Function)(uint32_t crc, const uint8_t* pData, size_t length);
+
+// g_crcTable[0] is the classic byte-at-a-time table.  g_crcTable[k][n] is the CRC of byte n
+// followed by k zero bytes, which is what lets slicing-by-8 look up 8 bytes independently
+static uint32_t g_crcTable[8][256];
+static Crc32Function g_pfnCrc32 = NULL;
+static pthread_once_t g_crcInitOnce = PTHREAD_ONCE_INIT;
+
+
+// all of the internal functions below work on the inverted crc value
+
+static uint32_t Crc32Bytes(uint32_t crc, const uint8_t* pData, size_t length)
+{
+    while (length > 0)
+    {
+        crc = g_crcTable[0][(crc ^ *pData) & 0xff] ^ (crc >> 8);
+        pData++;
+        length--;
+    }
+    return crc;
+}
+
+static uint32_t Crc32Slice8Internal(uint32_t crc, const uint8_t* pData, size_t length)
+{
+    while (length >= 8)
+    {
+        // assembled byte by byte so it's the same on any byte order (compiles to a single load on little endian)
+        uint32_t one = crc ^ ((uint32_t)pData[0] | ((uint32_t)pData[1] << 8) | ((uint32_t)pData[2] << 16) | ((uint32_t)pData[3] << 24));
+        uint32_t two = (uint32_t)pData[4] | ((uint32_t)pData[5] << 8) | ((uint32_t)pData[6] << 16) | ((uint32_t)pData[7] << 24);
+        
+        crc = g_crcTable[7][one & 0xff] ^
+              g_crcTable[6][(one >> 8) & 0xff] ^
+              g_crcTable[5][(one >> 16) & 0xff] ^
+              g_crcTable[4][one >> 24] ^
+              g_crcTable[3][two & 0xff] ^
+              g_crcTable[2][(two >> 8) & 0xff] ^
+              g_crcTable[1][(two >> 16) & 0xff] ^
+              g_crcTable[0][two >> 24];
+        
+        pData += 8;
+        length -= 8;
+    }
+    
+    return Crc32Bytes(crc, pData, length);
+}
+
+
+#ifdef HAS_CRC32_CLMUL
+
+// Folding with carry-less multiplies, from Intel's "Fast CRC Computation for Generic Polynomials
+// Using PCLMULQDQ Instruction".  The constants are the bit reflected x^n mod P(x) values
+// from the end of the paper (the same ones zlib and Chromium use).
+//    Four 128 bit lanes are folded forward 64 bytes at a time, then combined into one lane,
+//    then reduced to 32 bits with a Barrett reduction.
+//    length must be at least 64 and a multiple of 16
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t Crc32ClmulBlocks(uint32_t crc, const uint8_t* pData, size_t length)
+{
+    static const uint64_t c_k1k2[2] = {0x0154442bd4ULL, 0x01c6e41596ULL};
+    static const uint64_t c_k3k4[2] = {0x01751997d0ULL, 0x00ccaa009eULL};
+    static const uint64_t c_k5k0[2] = {0x0163cd6124ULL, 0x0000000000ULL};
+    static const uint64_t c_poly[2] = {0x01db710641ULL, 0x01f7011641ULL};
+    
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+    
+    ASSERT(length >= 64);
+    ASSERT((length % 16) == 0);
+    
+    x1 = _mm_loadu_si128((const __m128i*)(pData + 0x00));
+    x2 = _mm_loadu_si128((const __m128i*)(pData + 0x10));
+    x3 = _mm_loadu_si128((const __m128i*)(pData + 0x20));
+    x4 = _mm_loadu_si128((const __m128i*)(pData + 0x30));
+    
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)crc));
+    
+    x0 = _mm_loadu_si128((const __m128i*)c_k1k2);
+    
+    pData += 64;
+    length -= 64;
+    
+    // fold 64 bytes at a time
+    while (length >= 64)
+    {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+        
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+        
+        y5 = _mm_loadu_si128((const __m128i*)(pData + 0x00));
+        y6 = _mm_loadu_si128((const __m128i*)(pData + 0x10));
+        y7 = _mm_loadu_si128((const __m128i*)(pData + 0x20));
+        y8 = _mm_loadu_si128((const __m128i*)(pData + 0x30));
+        
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+        
+        pData += 64;
+        length -= 64;
+    }
+    
+    // fold the four lanes into one
+    x0 = _mm_loadu_si128((const __m128i*)c_k3k4);
+    
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+    
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+    
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+    
+    // then whatever 16 byte blocks are left
+    while (length >= 16)
+    {
+        x2 = _mm_loadu_si128((const __m128i*)pData);
+        
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+        
+        pData += 16;
+        length -= 16;
+    }
+    
+    // 128 bits down to 64
+    x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+    x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+    x1 = _mm_srli_si128(x1, 8);
+    x1 = _mm_xor_si128(x1, x2);
+    
+    x0 = _mm_loadl_epi64((const __m128i*)c_k5k0);
+    
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, x3);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+    
+    // Barrett reduction down to 32
+    x0 = _mm_loadu_si128((const __m128i*)c_poly);
+    
+    x2 = _mm_and_si128(x1, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+    x2 = _mm_and_si128(x2, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+    
+    return (uint32_t)_mm_extract_epi32(x1, 1);
+}
+
+static uint32_t Crc32ClmulInternal(uint32_t crc, const uint8_t* pData, size_t length)
+{
+    // short messages (most STUN messages) aren't worth the setup cost of the folding
+    if (length >= 64)
+    {
+        size_t blocks = length & ~(size_t)15;
+        crc = Crc32ClmulBlocks(crc, pData, blocks);
+        pData += blocks;
+        length -= blocks;
+    }
+    
+    return Crc32Slice8Internal(crc, pData, length);
+}
+
+#endif // HAS_CRC32_CLMUL
+
+
+static void InitCrc32()
+{
+    for (uint32_t index = 0; index < 256; index++)
+    {
+        uint32_t crc = index;
+        for (int bit = 0; bit < 8; bit++)
+        {
+            crc = (crc & 1) ? ((crc >> 1) ^ c_crc32Polynomial) : (crc >> 1);
+        }
+        g_crcTable[0][index] = crc;
+    }
+    
+    for (uint32_t index = 0; index < 256; index++)
+    {
+        for (int slice = 1; slice < 8; slice++)
+        {
+            uint32_t prev = g_crcTable[slice-1][index];
+            g_crcTable[slice][index] = (prev >> 8) ^ g_crcTable[0][prev & 0xff];
+        }
+    }
+    
+    g_pfnCrc32 = Crc32Slice8Internal;
+    
+#ifdef HAS_CRC32_CLMUL
+    if (Crc32HasClmul())
+    {
+        g_pfnCrc32 = Crc32ClmulInternal;
+    }
+#endif
+}
+
+bool Crc32HasClmul()
+{
+#ifdef HAS_CRC32_CLMUL
+    __builtin_cpu_init();
+    return (__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1"));
+#else
+    return false;
+#endif
+}
+
+uint32_t Crc32Update(uint32_t crc, const void* pData, size_t length)
+{
+    pthread_once(&g_crcInitOnce, InitCrc32);
+    return ~g_pfnCrc32(~crc, (const uint8_t*)pData, length);
+}
+
+uint32_t Crc32(const void* pData, size_t length)
+{
+    return Crc32Update(0, pData, length);
+}
+
+uint32_t Crc32Slice8(uint32_t crc, const void* pData, size_t length)
+{
+    pthread_once(&g_crcInitOnce, InitCrc32);
+    return ~Crc32Slice8Internal(~crc, (const uint8_t*)pData, length);
+}
+
+uint32_t Crc32Clmul(uint32_t crc, const void* pData, size_t length)
+{
+#ifdef HAS_CRC32_CLMUL
+    pthread_once(&g_crcInitOnce, InitCrc32);
+    return ~Crc32ClmulInternal(~crc, (const uint8_t*)pData, length);
+#else
+    ASSERT(false);
+    return Crc32Slice8(crc, pData, length);
+#endif
+}
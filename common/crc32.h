@@ -0,0 +1,36 @@
+/*
+   Copyright 2011 John Selbie
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef CRC32_H
+#define CRC32_H
+
+// CRC-32 with the IEEE 802.3 polynomial - the same checksum as zlib's crc32 and boost::crc_32_type,
+// and the one the STUN FINGERPRINT attribute is based on.
+//    Crc32 picks the fastest implementation the CPU supports the first time it's called:
+//    carry-less multiply folding (PCLMULQDQ) on x86, slicing-by-8 tables everywhere else.
+//    Crc32Update continues a checksum over data that arrives in pieces.
+//    Crc32Update(0, ...) is the same as Crc32(...)
+
+uint32_t Crc32(const void* pData, size_t length);
+uint32_t Crc32Update(uint32_t crc, const void* pData, size_t length);
+
+// The individual implementations, for test and benchmark code.
+// Crc32Clmul is only valid to call when Crc32HasClmul returns true
+uint32_t Crc32Slice8(uint32_t crc, const void* pData, size_t length);
+uint32_t Crc32Clmul(uint32_t crc, const void* pData, size_t length);
+bool Crc32HasClmul();
+
+#endif	/* CRC32_H */
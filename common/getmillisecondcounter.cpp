@@ -17,6 +17,7 @@
 
 #include "commonincludes.hpp"
 #include "oshelper.h"
+#include <time.h>
 
 
 static uint32_t GetMillisecondCounterUnix()
@@ -38,3 +39,17 @@ uint32_t GetMillisecondCounter()
     return GetMillisecondCounterUnix();    
 #endif
 }
+
+uint64_t GetMonotonicMilliseconds()
+{
+#ifdef CLOCK_MONOTONIC
+    timespec ts = {};
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+    {
+        return (ts.tv_sec * (uint64_t)1000) + (ts.tv_nsec / 1000000);
+    }
+#endif
+    timeval tv = {};
+    gettimeofday(&tv, NULL);
+    return (tv.tv_sec * (uint64_t)1000) + (tv.tv_usec / 1000);
+}
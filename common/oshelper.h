@@ -20,6 +20,9 @@
 
 uint32_t GetMillisecondCounter();
 
+// milliseconds from a monotonic clock - unaffected by wall clock changes and doesn't wrap
+uint64_t GetMonotonicMilliseconds();
+
 size_t GetConsoleWidth();
 
 
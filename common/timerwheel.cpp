@@ -0,0 +1,267 @@
+/*
+   Copyright 2011 John Selbie
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+
+#include "commonincludes.hpp"
+#include "timerwheel.h"
+#include <limits.h>
+
+
+CTimerWheel::CTimerWheel() :
+_tickMilliseconds(1),
+_tickCurrent(0),
+_count(0)
+{
+    for (uint32_t level = 0; level < c_levels; level++)
+    {
+        for (uint32_t slot = 0; slot < c_slotsPerLevel; slot++)
+        {
+            ListInit(&_slots[level][slot]);
+        }
+    }
+    ListInit(&_listExpired);
+}
+
+void CTimerWheel::InitNode(TimerWheelNode* pNode, void* pContext)
+{
+    pNode->pNext = NULL;
+    pNode->pPrev = NULL;
+    pNode->tickExpire = 0;
+    pNode->pContext = pContext;
+}
+
+HRESULT CTimerWheel::Init(uint32_t tickMilliseconds, uint64_t timeNow)
+{
+    HRESULT hr = S_OK;
+
+    ChkIfA(tickMilliseconds == 0, E_INVALIDARG);
+
+    // re-initializing a wheel that still has timers on it would leave those nodes dangling
+    ChkIfA(_count != 0, E_UNEXPECTED);
+
+    _tickMilliseconds = tickMilliseconds;
+    _tickCurrent = timeNow / tickMilliseconds;
+
+Cleanup:
+    return hr;
+}
+
+void CTimerWheel::ListInit(TimerWheelNode* pHead)
+{
+    pHead->pNext = pHead;
+    pHead->pPrev = pHead;
+    pHead->tickExpire = 0;
+    pHead->pContext = NULL;
+}
+
+bool CTimerWheel::ListIsEmpty(const TimerWheelNode* pHead)
+{
+    return (pHead->pNext == pHead);
+}
+
+void CTimerWheel::ListAppend(TimerWheelNode* pHead, TimerWheelNode* pNode)
+{
+    pNode->pPrev = pHead->pPrev;
+    pNode->pNext = pHead;
+    pHead->pPrev->pNext = pNode;
+    pHead->pPrev = pNode;
+}
+
+void CTimerWheel::ListUnlink(TimerWheelNode* pNode)
+{
+    pNode->pPrev->pNext = pNode->pNext;
+    pNode->pNext->pPrev = pNode->pPrev;
+    pNode->pNext = NULL;
+    pNode->pPrev = NULL;
+}
+
+bool CTimerWheel::IsScheduled(const TimerWheelNode* pNode)
+{
+    return (pNode->pNext != NULL);
+}
+
+void CTimerWheel::Place(TimerWheelNode* pNode)
+{
+    uint64_t tick = pNode->tickExpire;
+    uint64_t delta;
+    uint32_t level;
+    uint32_t slot;
+
+    // anything already due goes into the slot that gets processed next
+    if (tick < _tickCurrent)
+    {
+        tick = _tickCurrent;
+    }
+
+    delta = tick - _tickCurrent;
+
+    for (level = 0; level < c_levels; level++)
+    {
+        if (delta < (((uint64_t)1) << (c_bitsPerLevel * (level + 1))))
+        {
+            break;
+        }
+    }
+
+    if (level >= c_levels)
+    {
+        // further out than the wheel can represent - park it in the furthest slot of the top level
+        // it will get re-placed (with its real expiration tick) when that slot cascades
+        level = c_levels - 1;
+        tick = _tickCurrent + (((uint64_t)1) << (c_bitsPerLevel * c_levels)) - 1;
+    }
+
+    slot = (uint32_t)(tick >> (c_bitsPerLevel * level)) & c_slotMask;
+    ListAppend(&_slots[level][slot], pNode);
+}
+
+void CTimerWheel::Cascade(uint32_t level)
+{
+    uint32_t slot = (uint32_t)(_tickCurrent >> (c_bitsPerLevel * level)) & c_slotMask;
+    TimerWheelNode* pHead = &_slots[level][slot];
+    TimerWheelNode listTemp;
+
+    if (ListIsEmpty(pHead))
+    {
+        return;
+    }
+
+    // move the whole slot to a temp list first, as Place could conceivably put a node back into the same slot
+    ListInit(&listTemp);
+    listTemp.pNext = pHead->pNext;
+    listTemp.pPrev = pHead->pPrev;
+    listTemp.pNext->pPrev = &listTemp;
+    listTemp.pPrev->pNext = &listTemp;
+    ListInit(pHead);
+
+    while (ListIsEmpty(&listTemp) == false)
+    {
+        TimerWheelNode* pNode = listTemp.pNext;
+        ListUnlink(pNode);
+        Place(pNode);
+    }
+}
+
+void CTimerWheel::AdvanceOneTick()
+{
+    uint32_t slot = (uint32_t)(_tickCurrent & c_slotMask);
+    TimerWheelNode* pHead;
+
+    // when the lowest level wraps around, pull the next batch of timers down from the level above (and so on up the hierarchy)
+    if (slot == 0)
+    {
+        for (uint32_t level = 1; level < c_levels; level++)
+        {
+            Cascade(level);
+            if (((_tickCurrent >> (c_bitsPerLevel * level)) & c_slotMask) != 0)
+            {
+                break;
+            }
+        }
+    }
+
+    pHead = &_slots[0][slot];
+    while (ListIsEmpty(pHead) == false)
+    {
+        TimerWheelNode* pNode = pHead->pNext;
+        ListUnlink(pNode);
+        ListAppend(&_listExpired, pNode);
+    }
+
+    _tickCurrent++;
+}
+
+void CTimerWheel::Schedule(TimerWheelNode* pNode, uint64_t timeExpire)
+{
+    Cancel(pNode);
+
+    // round up so that a timer never fires before its expiration time
+    pNode->tickExpire = (timeExpire + _tickMilliseconds - 1) / _tickMilliseconds;
+    Place(pNode);
+    _count++;
+}
+
+void CTimerWheel::Cancel(TimerWheelNode* pNode)
+{
+    if (IsScheduled(pNode))
+    {
+        ListUnlink(pNode);
+        ASSERT(_count > 0);
+        _count--;
+    }
+}
+
+TimerWheelNode* CTimerWheel::PopExpired(uint64_t timeNow)
+{
+    uint64_t tickNow = timeNow / _tickMilliseconds;
+    TimerWheelNode* pNode = NULL;
+
+    while (ListIsEmpty(&_listExpired))
+    {
+        if (_count == 0)
+        {
+            // nothing pending, no reason to walk the wheel one tick at a time
+            if (_tickCurrent <= tickNow)
+            {
+                _tickCurrent = tickNow + 1;
+            }
+            return NULL;
+        }
+
+        if (_tickCurrent > tickNow)
+        {
+            return NULL;
+        }
+
+        AdvanceOneTick();
+    }
+
+    pNode = _listExpired.pNext;
+    ListUnlink(pNode);
+    _count--;
+
+    return pNode;
+}
+
+int CTimerWheel::GetMillisecondsToNextTick(uint64_t timeNow)
+{
+    uint64_t timeNextTick;
+    uint64_t delta;
+
+    if (_count == 0)
+    {
+        return -1;
+    }
+
+    if (ListIsEmpty(&_listExpired) == false)
+    {
+        return 0;
+    }
+
+    timeNextTick = _tickCurrent * _tickMilliseconds;
+    if (timeNextTick <= timeNow)
+    {
+        return 0;
+    }
+
+    delta = timeNextTick - timeNow;
+    return (delta > (uint64_t)INT_MAX) ? INT_MAX : (int)delta;
+}
+
+size_t CTimerWheel::GetCount()
+{
+    return _count;
+}
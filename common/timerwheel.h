@@ -0,0 +1,91 @@
+/*
+   Copyright 2011 John Selbie
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+// CTimerWheel is a hierarchical timing wheel for tracking a large number of timeouts
+//    Scheduling and cancelling a timer are O(1) regardless of how many timers are pending
+//    Expired timers are handed back one at a time by PopExpired, so the caller decides
+//    how much expiration work gets done per iteration of its event loop
+//    Timers are intrusive - the caller embeds a TimerWheelNode in its own struct,
+//    so the wheel never allocates memory after Init
+//    All times are absolute millisecond values from a monotonic clock (see GetMonotonicMilliseconds)
+//    Timers never fire early, but may fire up to one tick late
+
+
+struct TimerWheelNode
+{
+    TimerWheelNode* pNext;
+    TimerWheelNode* pPrev;
+    uint64_t tickExpire;
+    void* pContext;   // opaque to the wheel - typically points back to the owning struct
+};
+
+
+class CTimerWheel
+{
+public:
+    static const uint32_t c_bitsPerLevel = 6;
+    static const uint32_t c_slotsPerLevel = (1 << c_bitsPerLevel);
+    static const uint32_t c_slotMask = (c_slotsPerLevel - 1);
+    static const uint32_t c_levels = 4; // 64^4 ticks before a timer has to be re-cascaded from the top
+
+private:
+    uint32_t _tickMilliseconds;
+    uint64_t _tickCurrent; // the next tick to be processed
+    size_t _count;
+
+    // each slot is the sentinel head of a circular doubly linked list
+    TimerWheelNode _slots[c_levels][c_slotsPerLevel];
+    TimerWheelNode _listExpired;
+
+    static void ListInit(TimerWheelNode* pHead);
+    static bool ListIsEmpty(const TimerWheelNode* pHead);
+    static void ListAppend(TimerWheelNode* pHead, TimerWheelNode* pNode);
+    static void ListUnlink(TimerWheelNode* pNode);
+
+    void Place(TimerWheelNode* pNode);
+    void Cascade(uint32_t level);
+    void AdvanceOneTick();
+
+    // disable copy constructor and assignment
+    CTimerWheel(const CTimerWheel&);
+    CTimerWheel& operator=(const CTimerWheel&);
+
+public:
+    CTimerWheel();
+
+    static void InitNode(TimerWheelNode* pNode, void* pContext);
+
+    HRESULT Init(uint32_t tickMilliseconds, uint64_t timeNow);
+
+    // Schedule (or reschedule) a node to expire at the absolute time specified
+    void Schedule(TimerWheelNode* pNode, uint64_t timeExpire);
+    void Cancel(TimerWheelNode* pNode);
+    static bool IsScheduled(const TimerWheelNode* pNode);
+
+    // returns a single expired node (already removed from the wheel), or NULL when nothing else has expired as of timeNow
+    TimerWheelNode* PopExpired(uint64_t timeNow);
+
+    // how long the caller can sleep before it should call PopExpired again (-1 means no timers are pending)
+    int GetMillisecondsToNextTick(uint64_t timeNow);
+
+    size_t GetCount();
+};
+
+
+#endif	/* TIMERWHEEL_H */
@@ -16,13 +16,66 @@
 
 #include "commonincludes.hpp"
 #include "polling.h"
-#include "fasthash.h"
+#include "uring.h"
+#include "oshelper.h"
+
+#include <algorithm>
+
+#ifdef HAS_EPOLL
+#include <sys/timerfd.h>
+#endif
 
 
 // --------------------------------------------------------------------------
 
 #ifdef HAS_EPOLL
 
+// The epoll and io_uring implementations back each timer with a timerfd, so
+// that a timer is just one more file descriptor to wait on
+
+static HRESULT SetTimerFd(int fd, uint32_t milliseconds, bool fPeriodic)
+{
+    itimerspec spec = {};
+    
+    spec.it_value.tv_sec = milliseconds / 1000;
+    spec.it_value.tv_nsec = (long)(milliseconds % 1000) * 1000000;
+    if (fPeriodic)
+    {
+        spec.it_interval = spec.it_value;
+    }
+    
+    // resets the expiration count too, so an expiration from before the change doesn't get reported
+    return (::timerfd_settime(fd, 0, &spec, NULL) == -1) ? ERRNOHR : S_OK;
+}
+
+static HRESULT CreateTimerFd(uint32_t milliseconds, bool fPeriodic, int* pFD)
+{
+    HRESULT hr = S_OK;
+    int fd = ::timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    
+    ChkIf(fd == -1, ERRNOHR);
+    Chk(SetTimerFd(fd, milliseconds, fPeriodic));
+    
+    *pFD = fd;
+    fd = -1;
+    
+Cleanup:
+    if (fd != -1)
+    {
+        close(fd);
+    }
+    return hr;
+}
+
+// returns true if the timer expired since the last call (and clears the readable state)
+// false means the timer got changed after the event came in
+static bool ConsumeTimerFd(int fd)
+{
+    uint64_t expirations = 0;
+    return (::read(fd, &expirations, sizeof(expirations)) == (ssize_t)sizeof(expirations)) && (expirations > 0);
+}
+
+
 class CEpoll : 
     public CBasicRefCount,
     public CObjectFactory<CEpoll>,
@@ -36,7 +89,10 @@ private:
     size_t _pendingCount;      // number of valid events in _events
     size_t _currentEventIndex; // which one to process next
     
-    
+    // the event data for a socket is just the fd.  For a timer, it's the timerfd plus this bit
+    static const uint64_t c_timerTag = 0x100000000ULL;
+    static const uint64_t c_staleEvent = 0xffffffffffffffffULL;
+    std::vector<int> _timers;
     
     uint32_t ToNativeFlags(uint32_t eventflags);
     uint32_t FromNativeFlags(uint32_t eventflags);
@@ -48,6 +104,9 @@ public:
     virtual HRESULT Remove(int fd);
     virtual HRESULT ChangeEventSet(int fd, uint32_t eventflags);
     virtual HRESULT WaitForNextEvent(PollEvent* pPollEvent, int timeoutMilliseconds);
+    virtual HRESULT AddTimer(uint32_t milliseconds, bool fPeriodic, int* pTimerId);
+    virtual HRESULT ChangeTimer(int timerId, uint32_t milliseconds, bool fPeriodic);
+    virtual HRESULT RemoveTimer(int timerId);
     
     CEpoll();
     ~CEpoll();
@@ -149,6 +208,12 @@ HRESULT CEpoll::Close()
     _pendingCount = 0;
     _currentEventIndex = 0;
     
+    for (size_t index = 0; index < _timers.size(); index++)
+    {
+        close(_timers[index]);
+    }
+    _timers.clear();
+    
     return S_OK;
 }
 
@@ -162,7 +227,7 @@ HRESULT CEpoll::Add(int fd, uint32_t eventflags)
     ChkIfA(_epollfd==-1, E_UNEXPECTED);    
 
     
-    ev.data.fd = fd;
+    ev.data.u64 = (uint32_t)fd;
     ev.events = ToNativeFlags(eventflags);
     
     ChkIfA(epoll_ctl(_epollfd, EPOLL_CTL_ADD, fd, &ev) == -1, ERRNOHR);
@@ -197,7 +262,7 @@ HRESULT CEpoll::ChangeEventSet(int fd, uint32_t eventflags)
     ChkIfA(fd == -1, E_INVALIDARG);
     ChkIfA(_epollfd==-1, E_UNEXPECTED);    
     
-    ev.data.fd = fd;
+    ev.data.u64 = (uint32_t)fd;
     ev.events = ToNativeFlags(eventflags);
     
     ChkIfA(epoll_ctl(_epollfd, EPOLL_CTL_MOD, fd, &ev) == -1, ERRNOHR);
@@ -211,28 +276,111 @@ HRESULT CEpoll::WaitForNextEvent(PollEvent* pPollEvent, int timeoutMilliseconds)
     HRESULT hr = S_OK;
     epoll_event *pEvent = NULL;
     int ret = 0;
+    bool fWaited = false;
     
     ChkIfA(_epollfd==-1, E_UNEXPECTED);   
     
-    if (_currentEventIndex >= _pendingCount)
+    while (true)
     {
-        _currentEventIndex = 0;
-        _pendingCount = 0;
+        if (_currentEventIndex >= _pendingCount)
+        {
+            // everything from the last wait turned out to be stale. That's reported the same as a timeout.
+            ChkIf(fWaited, S_FALSE);
+            
+            _currentEventIndex = 0;
+            _pendingCount = 0;
+            
+            ret = ::epoll_wait(_epollfd, _events, _sizeEvents, timeoutMilliseconds);
+            ChkIf(ret <= -1, ERRNOHR);
+            ChkIf(ret == 0, S_FALSE);
+            
+            _pendingCount = (size_t)ret;
+            fWaited = true;
+        }
+        
         
-        ret = ::epoll_wait(_epollfd, _events, _sizeEvents, timeoutMilliseconds);
-        ChkIf(ret <= -1, ERRNOHR);
-        ChkIf(ret == 0, S_FALSE);
+        pEvent = &_events[_currentEventIndex];
+        _currentEventIndex++;
+        
+        if ((pEvent->data.u64 & c_timerTag) == 0)
+        {
+            pPollEvent->fd = (int)(uint32_t)pEvent->data.u64;
+            pPollEvent->eventflags = FromNativeFlags(pEvent->events);
+            break;
+        }
         
-        _pendingCount = (size_t)ret;
+        // a timer - unless it got removed or changed since the wait
+        if ((pEvent->data.u64 != c_staleEvent) && ConsumeTimerFd((int)(uint32_t)pEvent->data.u64))
+        {
+            pPollEvent->fd = (int)(uint32_t)pEvent->data.u64;
+            pPollEvent->eventflags = IPOLLING_TIMER;
+            break;
+        }
     }
     
+Cleanup:
+    return hr;
+}
+
+HRESULT CEpoll::AddTimer(uint32_t milliseconds, bool fPeriodic, int* pTimerId)
+{
+    HRESULT hr = S_OK;
+    epoll_event ev = {};
+    int fd = -1;
+    
+    ChkIfA(pTimerId == NULL, E_INVALIDARG);
+    ChkIfA(_epollfd==-1, E_UNEXPECTED);
+    
+    Chk(CreateTimerFd(milliseconds, fPeriodic, &fd));
+    
+    ev.data.u64 = (uint32_t)fd | c_timerTag;
+    ev.events = EPOLLIN;
+    ChkIfA(epoll_ctl(_epollfd, EPOLL_CTL_ADD, fd, &ev) == -1, ERRNOHR);
+    
+    _timers.push_back(fd);
+    *pTimerId = fd;
+    fd = -1;
+    
+Cleanup:
+    if (fd != -1)
+    {
+        close(fd);
+    }
+    return hr;
+}
+
+HRESULT CEpoll::ChangeTimer(int timerId, uint32_t milliseconds, bool fPeriodic)
+{
+    HRESULT hr = S_OK;
+    
+    ChkIfA(std::find(_timers.begin(), _timers.end(), timerId) == _timers.end(), E_INVALIDARG);
+    Chk(SetTimerFd(timerId, milliseconds, fPeriodic));
     
-    pEvent = &_events[_currentEventIndex];
-    _currentEventIndex++;
+Cleanup:
+    return hr;
+}
+
+HRESULT CEpoll::RemoveTimer(int timerId)
+{
+    HRESULT hr = S_OK;
+    epoll_event ev = {};
+    std::vector<int>::iterator itor = std::find(_timers.begin(), _timers.end(), timerId);
+    
+    ChkIfA(itor == _timers.end(), E_INVALIDARG);
     
+    epoll_ctl(_epollfd, EPOLL_CTL_DEL, timerId, &ev);
+    close(timerId);
+    _timers.erase(itor);
     
-    pPollEvent->fd = pEvent->data.fd;
-    pPollEvent->eventflags = FromNativeFlags(pEvent->events);
+    // Unlike a socket, the timerfd gets closed here.  An event for it that hasn't been handed out yet
+    // can't be allowed to read from whatever gets that fd number next.
+    for (size_t index = _currentEventIndex; index < _pendingCount; index++)
+    {
+        if (_events[index].data.u64 == ((uint32_t)timerId | c_timerTag))
+        {
+            _events[index].data.u64 = c_staleEvent;
+        }
+    }
     
 Cleanup:
     return hr;
@@ -242,6 +390,506 @@ Cleanup:
 
 // ------------------------------------------------------------------------------
 
+#ifdef HAS_IOURING
+
+// CUringPoll implements IPolling with io_uring poll requests.  Add, Remove, and ChangeEventSet
+// don't make a system call of their own the way epoll_ctl does.  They just queue up
+// requests, and all of those go to the kernel along with the wait, in one io_uring_enter.
+// Poll requests are one shot, and get re-armed after the event has been handed out.
+// That keeps the level triggered behavior callers of IPolling count on (a multishot poll
+// only fires again on a new wakeup, not because there's still unread data).
+
+class CUringPoll : 
+    public CBasicRefCount,
+    public CObjectFactory<CUringPoll>,
+    public IPolling
+{
+private:
+    // high bit of the user data marks the completion of a poll removal, which is of no interest
+    static const uint64_t c_removeTag = 0x8000000000000000ULL;
+    static const uint32_t c_generationMask = 0x7fffffff;
+    
+    struct PollEntry
+    {
+        uint32_t eventflags;
+        uint32_t generation; // bumped on every change, so completions of replaced or removed requests can be recognized
+        bool fInUse;
+        bool fArmed;         // a poll request for this generation is with the kernel (or queued to go)
+        bool fQueued;        // on the _armQueue list
+        bool fTimer;         // the fd is a timerfd owned by this instance
+    };
+    
+    struct ReadyEvent
+    {
+        int fd;
+        uint32_t generation;
+        uint32_t eventflags;
+    };
+    
+    CUring _ring;
+    std::vector<PollEntry> _entries;      // indexed directly by fd
+    std::vector<int> _armQueue;           // fds waiting on a poll request to be queued
+    std::vector<ReadyEvent> _ready;       // events reaped from the completion queue, not handed out yet
+    size_t _readyIndex;
+    
+    static uint64_t MakeUserData(int fd, uint32_t generation);
+    
+    uint32_t ToNativeFlags(uint32_t eventflags);
+    uint32_t FromNativeFlags(uint32_t eventflags);
+    
+    PollEntry* GetEntry(int fd);
+    void QueueArm(int fd);
+    HRESULT QueueRemove(int fd, uint32_t generation);
+    HRESULT SubmitArmQueue();
+    void ReapCompletions();
+    bool PopReadyEvent(PollEvent* pPollEvent);
+    
+public:
+    virtual HRESULT Initialize(size_t maxSockets);
+    virtual HRESULT Close();
+    virtual HRESULT Add(int fd, uint32_t eventflags);
+    virtual HRESULT Remove(int fd);
+    virtual HRESULT ChangeEventSet(int fd, uint32_t eventflags);
+    virtual HRESULT WaitForNextEvent(PollEvent* pPollEvent, int timeoutMilliseconds);
+    virtual HRESULT AddTimer(uint32_t milliseconds, bool fPeriodic, int* pTimerId);
+    virtual HRESULT ChangeTimer(int timerId, uint32_t milliseconds, bool fPeriodic);
+    virtual HRESULT RemoveTimer(int timerId);
+    
+    CUringPoll();
+    ~CUringPoll();
+    
+    ADDREF_AND_RELEASE_IMPL();
+};
+
+CUringPoll::CUringPoll() :
+_readyIndex(0)
+{
+    
+}
+
+CUringPoll::~CUringPoll()
+{
+    Close();
+}
+
+uint64_t CUringPoll::MakeUserData(int fd, uint32_t generation)
+{
+    return (((uint64_t)(generation & c_generationMask)) << 32) | (uint32_t)fd;
+}
+
+uint32_t CUringPoll::ToNativeFlags(uint32_t eventflags)
+{
+    uint32_t result = 0;
+    
+    // IPOLLING_EDGETRIGGER has no equivalent - a one shot poll request is level triggered
+    if (eventflags & IPOLLING_READ)        result |= POLLIN;
+    if (eventflags & IPOLLING_WRITE)       result |= POLLOUT;
+#ifdef POLLRDHUP
+    if (eventflags & IPOLLING_RDHUP)       result |= POLLRDHUP;
+#endif
+    if (eventflags & IPOLLING_HUP)         result |= POLLHUP;
+    if (eventflags & IPOLLING_PRI)         result |= POLLPRI;
+    if (eventflags & IPOLLING_ERROR)       result |= POLLERR;
+    
+    return result;
+}
+
+uint32_t CUringPoll::FromNativeFlags(uint32_t eventflags)
+{
+    uint32_t result = 0;
+    
+    if (eventflags & POLLIN)    result |= IPOLLING_READ;
+    if (eventflags & POLLOUT)   result |= IPOLLING_WRITE;
+#ifdef POLLRDHUP    
+    if (eventflags & POLLRDHUP) result |= IPOLLING_RDHUP;
+#endif
+    if (eventflags & POLLHUP)   result |= IPOLLING_HUP;
+    if (eventflags & POLLPRI)   result |= IPOLLING_PRI;
+    if (eventflags & POLLERR)   result |= IPOLLING_ERROR;
+    
+    return result;
+}
+
+HRESULT CUringPoll::Initialize(size_t maxSockets)
+{
+    HRESULT hr = S_OK;
+    uint32_t completionEntries = 512;
+    
+    Close();
+    
+    // Each socket has at most one poll request and one removal in flight.  The submission
+    // queue doesn't need to be that big, since a full queue just gets flushed early.
+    while ((completionEntries < 65536) && (completionEntries < maxSockets * 2))
+    {
+        completionEntries *= 2;
+    }
+    
+    Chk(_ring.Init(256, completionEntries));
+    ChkIf(_ring.IsOpSupported(IORING_OP_POLL_ADD) == false, E_NOTIMPL);
+    ChkIf(_ring.IsOpSupported(IORING_OP_POLL_REMOVE) == false, E_NOTIMPL);
+    
+    _entries.resize(maxSockets + 64);
+    _armQueue.reserve(maxSockets);
+    _ready.reserve(completionEntries);
+    
+Cleanup:
+    if (FAILED(hr))
+    {
+        Close();
+    }
+    return hr;
+}
+
+HRESULT CUringPoll::Close()
+{
+    _ring.Close();
+    for (size_t index = 0; index < _entries.size(); index++)
+    {
+        if (_entries[index].fInUse && _entries[index].fTimer)
+        {
+            close((int)index);
+        }
+    }
+    _entries.clear();
+    _armQueue.clear();
+    _ready.clear();
+    _readyIndex = 0;
+    return S_OK;
+}
+
+CUringPoll::PollEntry* CUringPoll::GetEntry(int fd)
+{
+    PollEntry entryEmpty = {};
+    
+    if (fd < 0)
+    {
+        return NULL;
+    }
+    
+    if ((size_t)fd >= _entries.size())
+    {
+        _entries.resize((size_t)fd * 2, entryEmpty);
+    }
+    
+    return &_entries[fd];
+}
+
+void CUringPoll::QueueArm(int fd)
+{
+    PollEntry* pEntry = &_entries[fd];
+    
+    if (pEntry->fQueued == false)
+    {
+        pEntry->fQueued = true;
+        _armQueue.push_back(fd);
+    }
+}
+
+HRESULT CUringPoll::QueueRemove(int fd, uint32_t generation)
+{
+    HRESULT hr = S_OK;
+    io_uring_sqe* pSqe = _ring.GetSqe();
+    
+    ChkIf(pSqe == NULL, E_FAIL);
+    
+    pSqe->opcode = IORING_OP_POLL_REMOVE;
+    pSqe->fd = -1;
+    pSqe->addr = MakeUserData(fd, generation);
+    pSqe->user_data = c_removeTag;
+    
+Cleanup:
+    return hr;
+}
+
+HRESULT CUringPoll::Add(int fd, uint32_t eventflags)
+{
+    HRESULT hr = S_OK;
+    PollEntry* pEntry = NULL;
+    
+    ChkIfA(fd == -1, E_INVALIDARG);
+    ChkIfA(_ring.IsValid() == false, E_UNEXPECTED);
+    
+    pEntry = GetEntry(fd);
+    ChkIfA(pEntry->fInUse, E_UNEXPECTED);
+    
+    pEntry->fInUse = true;
+    pEntry->fArmed = false;
+    pEntry->fTimer = false;
+    pEntry->eventflags = eventflags;
+    pEntry->generation = (pEntry->generation + 1) & c_generationMask;
+    QueueArm(fd);
+    
+Cleanup:
+    return hr;
+}
+
+HRESULT CUringPoll::Remove(int fd)
+{
+    HRESULT hr = S_OK;
+    PollEntry* pEntry = NULL;
+    
+    ChkIfA(fd == -1, E_INVALIDARG);
+    ChkIfA(_ring.IsValid() == false, E_UNEXPECTED);
+    
+    pEntry = GetEntry(fd);
+    ChkIfA(pEntry->fInUse == false, E_FAIL);
+    
+    // The caller is free to close the socket as soon as this returns.  The poll request
+    // holds its own reference to the socket until the removal reaches the kernel.
+    if (pEntry->fArmed)
+    {
+        Chk(QueueRemove(fd, pEntry->generation));
+    }
+    
+    // any event for this socket that hasn't been handed out yet is now stale
+    pEntry->fInUse = false;
+    pEntry->fArmed = false;
+    pEntry->generation = (pEntry->generation + 1) & c_generationMask;
+    
+Cleanup:
+    return hr;
+}
+
+HRESULT CUringPoll::ChangeEventSet(int fd, uint32_t eventflags)
+{
+    HRESULT hr = S_OK;
+    PollEntry* pEntry = NULL;
+    
+    ChkIfA(fd == -1, E_INVALIDARG);
+    ChkIfA(_ring.IsValid() == false, E_UNEXPECTED);
+    
+    pEntry = GetEntry(fd);
+    ChkIfA(pEntry->fInUse == false, E_FAIL);
+    
+    if (pEntry->eventflags == eventflags)
+    {
+        return S_OK;
+    }
+    
+    // replace the outstanding request with one for the new event set
+    if (pEntry->fArmed)
+    {
+        Chk(QueueRemove(fd, pEntry->generation));
+        pEntry->fArmed = false;
+    }
+    
+    pEntry->eventflags = eventflags;
+    pEntry->generation = (pEntry->generation + 1) & c_generationMask;
+    QueueArm(fd);
+    
+Cleanup:
+    return hr;
+}
+
+HRESULT CUringPoll::SubmitArmQueue()
+{
+    HRESULT hr = S_OK;
+    size_t index = 0;
+    
+    for (index = 0; index < _armQueue.size(); index++)
+    {
+        int fd = _armQueue[index];
+        PollEntry* pEntry = &_entries[fd];
+        io_uring_sqe* pSqe = NULL;
+        
+        // removed (or already armed) since it was queued
+        if ((pEntry->fInUse == false) || pEntry->fArmed)
+        {
+            pEntry->fQueued = false;
+            continue;
+        }
+        
+        pSqe = _ring.GetSqe();
+        ChkIf(pSqe == NULL, E_FAIL);
+        
+        pSqe->opcode = IORING_OP_POLL_ADD;
+        pSqe->fd = fd;
+        pSqe->poll32_events = ToNativeFlags(pEntry->eventflags);
+        pSqe->user_data = MakeUserData(fd, pEntry->generation);
+        
+        pEntry->fArmed = true;
+        pEntry->fQueued = false;
+    }
+    
+Cleanup:
+    // anything that didn't make it stays queued for the next attempt
+    _armQueue.erase(_armQueue.begin(), _armQueue.begin() + index);
+    return hr;
+}
+
+void CUringPoll::ReapCompletions()
+{
+    io_uring_cqe* pCqe = NULL;
+    
+    _ready.clear();
+    _readyIndex = 0;
+    
+    while ((pCqe = _ring.PeekCqe()) != NULL)
+    {
+        uint64_t userdata = pCqe->user_data;
+        int result = pCqe->res;
+        int fd = (int)(uint32_t)userdata;
+        uint32_t generation = (uint32_t)(userdata >> 32);
+        PollEntry* pEntry = NULL;
+        ReadyEvent ev;
+        
+        _ring.AdvanceCq();
+        
+        if (userdata & c_removeTag)
+        {
+            continue;
+        }
+        
+        if ((fd < 0) || ((size_t)fd >= _entries.size()))
+        {
+            continue;
+        }
+        
+        // a request that got removed or replaced completes with -ECANCELED, or may have fired just before
+        pEntry = &_entries[fd];
+        if ((pEntry->fInUse == false) || (pEntry->generation != generation))
+        {
+            continue;
+        }
+        
+        pEntry->fArmed = false;
+        
+        ev.fd = fd;
+        ev.generation = generation;
+        
+        if (result < 0)
+        {
+            // the request itself failed (typically a bad fd). Report it, but don't re-arm a request that will just fail again
+            ev.eventflags = IPOLLING_ERROR;
+        }
+        else
+        {
+            ev.eventflags = FromNativeFlags((uint32_t)result);
+            
+            // It goes out again with the next submission, which can't happen until the caller has
+            // handled this event (and whatever else came in with it). If the condition still holds
+            // by then, the new request completes right away - just like level triggered epoll.
+            QueueArm(fd);
+        }
+        
+        _ready.push_back(ev);
+    }
+}
+
+bool CUringPoll::PopReadyEvent(PollEvent* pPollEvent)
+{
+    while (_readyIndex < _ready.size())
+    {
+        const ReadyEvent& ev = _ready[_readyIndex];
+        const PollEntry& entry = _entries[ev.fd];
+        
+        _readyIndex++;
+        
+        // skip anything the caller removed or changed after it was reaped
+        if ((entry.fInUse == false) || (entry.generation != ev.generation))
+        {
+            continue;
+        }
+        
+        if (entry.fTimer)
+        {
+            // the timer might have been changed after the event came in
+            if ((ev.eventflags & IPOLLING_READ) && ConsumeTimerFd(ev.fd))
+            {
+                pPollEvent->fd = ev.fd;
+                pPollEvent->eventflags = IPOLLING_TIMER;
+                return true;
+            }
+            continue;
+        }
+        
+        pPollEvent->fd = ev.fd;
+        pPollEvent->eventflags = ev.eventflags;
+        return true;
+    }
+    
+    return false;
+}
+
+HRESULT CUringPoll::WaitForNextEvent(PollEvent* pPollEvent, int timeoutMilliseconds)
+{
+    HRESULT hr = S_OK;
+    
+    ChkIfA(_ring.IsValid() == false, E_UNEXPECTED);
+    ChkIfA(pPollEvent == NULL, E_INVALIDARG);
+    
+    if (PopReadyEvent(pPollEvent))
+    {
+        return S_OK;
+    }
+    
+    // one system call submits every add, remove, change, and re-arm queued since the last call, and waits
+    Chk(SubmitArmQueue());
+    Chk(_ring.Enter(1, timeoutMilliseconds));
+    
+    ReapCompletions();
+    
+    // everything reaped might have been stale. That's reported the same as a timeout.
+    hr = PopReadyEvent(pPollEvent) ? S_OK : S_FALSE;
+    
+Cleanup:
+    return hr;
+}
+
+HRESULT CUringPoll::AddTimer(uint32_t milliseconds, bool fPeriodic, int* pTimerId)
+{
+    HRESULT hr = S_OK;
+    int fd = -1;
+    
+    ChkIfA(pTimerId == NULL, E_INVALIDARG);
+    ChkIfA(_ring.IsValid() == false, E_UNEXPECTED);
+    
+    Chk(CreateTimerFd(milliseconds, fPeriodic, &fd));
+    Chk(Add(fd, IPOLLING_READ));
+    _entries[fd].fTimer = true;
+    
+    *pTimerId = fd;
+    fd = -1;
+    
+Cleanup:
+    if (fd != -1)
+    {
+        close(fd);
+    }
+    return hr;
+}
+
+HRESULT CUringPoll::ChangeTimer(int timerId, uint32_t milliseconds, bool fPeriodic)
+{
+    HRESULT hr = S_OK;
+    PollEntry* pEntry = GetEntry(timerId);
+    
+    ChkIfA((pEntry == NULL) || (pEntry->fInUse == false) || (pEntry->fTimer == false), E_INVALIDARG);
+    Chk(SetTimerFd(timerId, milliseconds, fPeriodic));
+    
+Cleanup:
+    return hr;
+}
+
+HRESULT CUringPoll::RemoveTimer(int timerId)
+{
+    HRESULT hr = S_OK;
+    PollEntry* pEntry = GetEntry(timerId);
+    
+    ChkIfA((pEntry == NULL) || (pEntry->fInUse == false) || (pEntry->fTimer == false), E_INVALIDARG);
+    
+    Chk(Remove(timerId));
+    pEntry->fTimer = false;
+    close(timerId);
+    
+Cleanup:
+    return hr;
+}
+
+#endif // HAS_IOURING
+
+// ------------------------------------------------------------------------------
+
 class CPoll : 
     public CBasicRefCount,
     public CObjectFactory<CPoll>,
@@ -253,15 +901,44 @@ private:
     uint32_t _unreadcount;
     bool _fInitialized;
     
-    FastHashDynamic<int, size_t> _hashtable; // maps socket to position in fds
+    // maps socket to its position in _fds (-1 when not added).  Socket handles are small
+    // integers handed out lowest first, so the table is indexed directly by socket
+    std::vector<int> _positions;
     
-    void Reindex();
+    // Timers are kept in a heap ordered by deadline.  Changing or removing a timer doesn't
+    // search the heap, it bumps the timer's generation and the old entry gets skipped.
+    struct TimerEntry
+    {
+        uint64_t deadline;   // zero when disarmed
+        uint32_t period;     // zero for a one shot timer
+        uint32_t generation;
+        bool fInUse;
+    };
+    
+    struct TimerDeadline
+    {
+        uint64_t deadline;
+        int timerId;
+        uint32_t generation;
+        
+        // std::push_heap and std::pop_heap make a max heap - this puts the earliest deadline on top
+        bool operator<(const TimerDeadline& other) const {return deadline > other.deadline;}
+    };
+    
+    std::vector<TimerEntry> _timers;          // indexed by timer id
+    std::vector<TimerDeadline> _deadlines;    // heap
+    
+    int GetPosition(int fd);
     
     uint32_t ToNativeFlags(uint32_t eventflags);
     uint32_t FromNativeFlags(uint32_t eventflags);
     
     bool FindNextEvent(PollEvent* pEvent);
     
+    void ScheduleTimer(int timerId, uint64_t deadline);
+    bool PopExpiredTimer(uint64_t timeNow, PollEvent* pEvent);
+    int GetTimerWait(uint64_t timeNow, int timeoutMilliseconds);
+    
 public:
     virtual HRESULT Initialize(size_t maxSockets);
     virtual HRESULT Close();
@@ -269,6 +946,9 @@ public:
     virtual HRESULT Remove(int fd);
     virtual HRESULT ChangeEventSet(int fd, uint32_t eventflags);
     virtual HRESULT WaitForNextEvent(PollEvent* pPollEvent, int timeoutMilliseconds);
+    virtual HRESULT AddTimer(uint32_t milliseconds, bool fPeriodic, int* pTimerId);
+    virtual HRESULT ChangeTimer(int timerId, uint32_t milliseconds, bool fPeriodic);
+    virtual HRESULT RemoveTimer(int timerId);
     
     CPoll();
     ~CPoll();
@@ -329,7 +1009,8 @@ HRESULT CPoll::Initialize(size_t maxSockets)
     _rotation = 0;
     _unreadcount = 0;
     
-    _hashtable.InitTable(maxSockets, 0);
+    // grows on demand if a socket handle comes back larger than this
+    _positions.assign(maxSockets + 64, -1);
     
     _fInitialized = true;
 
@@ -339,71 +1020,81 @@ HRESULT CPoll::Initialize(size_t maxSockets)
 HRESULT CPoll::Close()
 {
    _fds.clear();
+   _positions.clear();
+   _rotation = 0;
+   _unreadcount = 0;
+   _timers.clear();
+   _deadlines.clear();
    _fInitialized = false;
 
    return S_OK;
 }
 
+int CPoll::GetPosition(int fd)
+{
+    int pos;
+    
+    if ((fd < 0) || ((size_t)fd >= _positions.size()))
+    {
+        return -1;
+    }
+    
+    pos = _positions[fd];
+    ASSERT((pos == -1) || (_fds[pos].fd == fd));
+    
+    return pos;
+}
+
 HRESULT CPoll::Add(int fd, uint32_t eventflags)
 {
     HRESULT hr = S_OK;
-    size_t pos = _fds.size();
     pollfd pfd;
     
     ChkIfA(_fInitialized == false, E_FAIL);
+    ChkIfA(fd < 0, E_INVALIDARG);
     
-    ChkIfA(_hashtable.Lookup(fd)!=NULL, E_UNEXPECTED);
+    ChkIfA(GetPosition(fd) != -1, E_UNEXPECTED);
+    
+    if ((size_t)fd >= _positions.size())
+    {
+        _positions.resize((size_t)fd * 2, -1);
+    }
     
     pfd.events = ToNativeFlags(eventflags);
     pfd.fd = fd;
     pfd.revents = 0;
+    _positions[fd] = (int)_fds.size();
     _fds.push_back(pfd);
-    _hashtable.Insert(fd, pos);
 Cleanup:    
     return hr;
 }
 
 HRESULT CPoll::Remove(int fd)
 {
-    
-    // See notes below why pPos is declared volatile.  Gets around a compiler bug
-    volatile size_t* pPos = NULL;
-    
-    size_t size = _fds.size();
-    size_t pos;
     HRESULT hr = S_OK;
+    int pos;
+    int last = (int)_fds.size() - 1;
 
     ChkIfA(_fInitialized == false, E_FAIL);
-
-    ASSERT(_hashtable.Size() == size);
-    
-    ChkIf(size == 0, E_FAIL);
     
-    pPos = _hashtable.Lookup(fd);
+    pos = GetPosition(fd);
+    ChkIfA(pos == -1, E_FAIL);
     
-    ChkIfA(pPos == NULL, E_FAIL);
-    
-    pos = *pPos;
-    
-    ChkIfA(pos >= size, E_FAIL);
-    
-    ChkIfA(_fds[pos].fd != fd, E_FAIL);
+    // an event from the last poll() call that hasn't been handed out yet never will be
+    if (_fds[pos].revents)
+    {
+        ASSERT(_unreadcount > 0);
+        _unreadcount--;
+    }
     
-    if (pos != (size-1))
+    // the last entry moves into the hole, so only its position changes
+    if (pos != last)
     {
-        _fds[pos] = _fds[size-1];
-        pPos = _hashtable.Lookup(_fds[pos].fd);
-        
-        ASSERT(pPos != NULL);
-       
-        // If the volatile declaration above was not made, this block of code
-        // gets over-optimized on older GCC compilers (g++ 4.2.1 on BSD) with with -O2
-        // The following line would essentially not get executed.
-        // There are multiple workarounds, but "volatile" seems to work.
-        *pPos = pos;
+        _fds[pos] = _fds[last];
+        _positions[_fds[pos].fd] = pos;
     }
     
-    _hashtable.Remove(fd);
+    _positions[fd] = -1;
     _fds.pop_back();
     
 Cleanup:
@@ -412,21 +1103,13 @@ Cleanup:
 
 HRESULT CPoll::ChangeEventSet(int fd, uint32_t eventflags)
 {
-    size_t* pPos = NULL;
-    size_t pos;
     HRESULT hr = S_OK;
-    size_t size = _fds.size();
+    int pos;
     
     ChkIfA(_fInitialized == false, E_FAIL);    
     
-    ASSERT(_hashtable.Size() == size);
-    ChkIf(size == 0, E_FAIL);
-    
-    pPos = _hashtable.Lookup(fd);
-    ChkIfA(pPos == NULL, E_FAIL);
-    pos = *pPos;
-    ChkIfA(pos >= size, E_FAIL);
-    ChkIfA(_fds[pos].fd != fd, E_FAIL);
+    pos = GetPosition(fd);
+    ChkIfA(pos == -1, E_FAIL);
     _fds[pos].events = ToNativeFlags(eventflags);
     
 Cleanup:
@@ -440,16 +1123,27 @@ HRESULT CPoll::WaitForNextEvent(PollEvent* pPollEvent, int timeoutMilliseconds)
     size_t size = _fds.size();
     pollfd* list = NULL;
     bool fFound = false;
+    uint64_t timeNow = 0;
     
     ChkIfA(_fInitialized == false, E_FAIL);    
     
     ChkIfA(pPollEvent == NULL, E_INVALIDARG);
     pPollEvent->eventflags = 0;
     
-    ChkIf(size == 0, S_FALSE);
+    ChkIf((size == 0) && _deadlines.empty(), S_FALSE);
+    
+    // timers that have come due go ahead of socket events
+    if (_deadlines.size() > 0)
+    {
+        timeNow = GetMonotonicMilliseconds();
+        fFound = PopExpiredTimer(timeNow, pPollEvent);
+    }
 
     // check first to see if there is a pending event from the last poll() call
-    fFound = FindNextEvent(pPollEvent);
+    if (fFound == false)
+    {
+        fFound = FindNextEvent(pPollEvent);
+    }
     
     if (fFound == false)
     {
@@ -457,17 +1151,24 @@ HRESULT CPoll::WaitForNextEvent(PollEvent* pPollEvent, int timeoutMilliseconds)
         
         _unreadcount = 0;
         
-        list = &_fds.front();
+        list = (size > 0) ? &_fds.front() : NULL;
     
-        ret = poll(list, size, timeoutMilliseconds);
+        ret = poll(list, size, GetTimerWait(timeNow, timeoutMilliseconds));
     
         ChkIfA(ret < 0, ERRNOHR); // error
-        ChkIf(ret == 0, S_FALSE); // no data, we timed out
         
-        _unreadcount = (uint32_t)ret;
-        
-        fFound = FindNextEvent(pPollEvent);
-        ASSERT(fFound); // poll returned a positive value, but we didn't find anything?
+        if (ret > 0)
+        {
+            _unreadcount = (uint32_t)ret;
+            
+            fFound = FindNextEvent(pPollEvent);
+            ASSERT(fFound); // poll returned a positive value, but we didn't find anything?
+        }
+        else if (_deadlines.size() > 0)
+        {
+            // no data - either the caller's timeout or a timer's deadline came first
+            fFound = PopExpiredTimer(GetMonotonicMilliseconds(), pPollEvent);
+        }
     }
     
     hr = fFound ? S_OK : S_FALSE;
@@ -479,8 +1180,7 @@ Cleanup:
 bool CPoll::FindNextEvent(PollEvent* pEvent)
 {
     size_t size = _fds.size();
-    ASSERT(size > 0);
-    pollfd* list = &_fds.front();
+    pollfd* list = NULL;
     bool fFound = false;
     
     if (_unreadcount == 0)
@@ -488,6 +1188,9 @@ bool CPoll::FindNextEvent(PollEvent* pEvent)
         return false;
     }
     
+    ASSERT(size > 0);
+    list = &_fds.front();
+    
     if (_rotation >= size)
     {
         _rotation = 0;
@@ -516,6 +1219,159 @@ bool CPoll::FindNextEvent(PollEvent* pEvent)
 
 
 
+void CPoll::ScheduleTimer(int timerId, uint64_t deadline)
+{
+    TimerEntry& entry = _timers[timerId];
+    TimerDeadline item;
+    
+    entry.generation++;
+    entry.deadline = deadline;
+    
+    if (deadline == 0)
+    {
+        return;
+    }
+    
+    // Timers that keep getting changed before they fire leave stale entries behind.
+    // Sweep those out before they outnumber the real ones.
+    if (_deadlines.size() >= (2 * _timers.size() + 16))
+    {
+        std::vector<TimerDeadline> live;
+        for (size_t index = 0; index < _deadlines.size(); index++)
+        {
+            const TimerEntry& other = _timers[_deadlines[index].timerId];
+            if (other.fInUse && (other.generation == _deadlines[index].generation))
+            {
+                live.push_back(_deadlines[index]);
+            }
+        }
+        _deadlines.swap(live);
+        std::make_heap(_deadlines.begin(), _deadlines.end());
+    }
+    
+    item.deadline = deadline;
+    item.timerId = timerId;
+    item.generation = entry.generation;
+    _deadlines.push_back(item);
+    std::push_heap(_deadlines.begin(), _deadlines.end());
+}
+
+bool CPoll::PopExpiredTimer(uint64_t timeNow, PollEvent* pEvent)
+{
+    while (_deadlines.size() > 0)
+    {
+        TimerDeadline top = _deadlines.front();
+        
+        if (top.deadline > timeNow)
+        {
+            return false;
+        }
+        
+        std::pop_heap(_deadlines.begin(), _deadlines.end());
+        _deadlines.pop_back();
+        
+        TimerEntry& entry = _timers[top.timerId];
+        if ((entry.fInUse == false) || (entry.generation != top.generation))
+        {
+            continue; // changed or removed since it was scheduled
+        }
+        
+        if (entry.period > 0)
+        {
+            // expirations missed while the caller was busy are reported once
+            uint64_t deadline = top.deadline + entry.period;
+            ScheduleTimer(top.timerId, (deadline > timeNow) ? deadline : (timeNow + entry.period));
+        }
+        else
+        {
+            entry.deadline = 0;
+        }
+        
+        pEvent->fd = top.timerId;
+        pEvent->eventflags = IPOLLING_TIMER;
+        return true;
+    }
+    
+    return false;
+}
+
+// the poll() timeout - the caller's, or the time to the next timer deadline if that's sooner
+int CPoll::GetTimerWait(uint64_t timeNow, int timeoutMilliseconds)
+{
+    uint64_t delta;
+    
+    if (_deadlines.empty())
+    {
+        return timeoutMilliseconds;
+    }
+    
+    delta = (_deadlines.front().deadline > timeNow) ? (_deadlines.front().deadline - timeNow) : 0;
+    
+    if ((timeoutMilliseconds < 0) || (delta < (uint64_t)timeoutMilliseconds))
+    {
+        return (int)delta;
+    }
+    
+    return timeoutMilliseconds;
+}
+
+HRESULT CPoll::AddTimer(uint32_t milliseconds, bool fPeriodic, int* pTimerId)
+{
+    HRESULT hr = S_OK;
+    TimerEntry entryEmpty = {};
+    size_t timerId = 0;
+    
+    ChkIfA(_fInitialized == false, E_FAIL);
+    ChkIfA(pTimerId == NULL, E_INVALIDARG);
+    
+    while ((timerId < _timers.size()) && _timers[timerId].fInUse)
+    {
+        timerId++;
+    }
+    if (timerId == _timers.size())
+    {
+        _timers.push_back(entryEmpty);
+    }
+    
+    _timers[timerId].fInUse = true;
+    *pTimerId = (int)timerId;
+    
+    Chk(ChangeTimer((int)timerId, milliseconds, fPeriodic));
+    
+Cleanup:
+    return hr;
+}
+
+HRESULT CPoll::ChangeTimer(int timerId, uint32_t milliseconds, bool fPeriodic)
+{
+    HRESULT hr = S_OK;
+    
+    ChkIfA(_fInitialized == false, E_FAIL);
+    ChkIfA((timerId < 0) || ((size_t)timerId >= _timers.size()) || (_timers[timerId].fInUse == false), E_INVALIDARG);
+    
+    _timers[timerId].period = fPeriodic ? milliseconds : 0;
+    ScheduleTimer(timerId, (milliseconds > 0) ? (GetMonotonicMilliseconds() + milliseconds) : 0);
+    
+Cleanup:
+    return hr;
+}
+
+HRESULT CPoll::RemoveTimer(int timerId)
+{
+    HRESULT hr = S_OK;
+    
+    ChkIfA(_fInitialized == false, E_FAIL);
+    ChkIfA((timerId < 0) || ((size_t)timerId >= _timers.size()) || (_timers[timerId].fInUse == false), E_INVALIDARG);
+    
+    // whatever is left in the heap for it gets skipped
+    ScheduleTimer(timerId, 0);
+    _timers[timerId].fInUse = false;
+    
+Cleanup:
+    return hr;
+}
+
+
 HRESULT CreatePollingInstance(uint32_t type, size_t maxSockets, IPolling** ppPolling)
 {
     HRESULT hr = S_OK;
@@ -547,6 +1403,19 @@ HRESULT CreatePollingInstance(uint32_t type, size_t maxSockets, IPolling** ppPol
     {
         ChkA(CPoll::CreateInstance(maxSockets, ppPolling));
     }
+    else if (type == IPOLLING_TYPE_URING)
+    {
+        HRESULT hrUring = E_NOTIMPL;
+#ifdef HAS_IOURING
+        hrUring = CUringPoll::CreateInstance(maxSockets, ppPolling);
+#endif
+        if (FAILED(hrUring))
+        {
+            // not compiled in, or the kernel doesn't have it (or has it disabled)
+            Logging::LogMsg(LL_DEBUG, "io_uring polling is not available (hr == %x), using the default polling instead", hrUring);
+            Chk(CreatePollingInstance(IPOLLING_TYPE_BEST, maxSockets, ppPolling));
+        }
+    }
     else
     {
         ChkA(E_FAIL); // unknown type
@@ -33,6 +33,7 @@ const uint32_t IPOLLING_RDHUP =        0x01 << 3;
 const uint32_t IPOLLING_HUP =          0x01 << 4;
 const uint32_t IPOLLING_PRI =          0x01 << 5;
 const uint32_t IPOLLING_ERROR =        0x01 << 6;
+const uint32_t IPOLLING_TIMER =        0x01 << 7; // a timer fired - PollEvent::fd is the timer id, not a file descriptor
 
 
 class IPolling : public IRefCounted
@@ -44,12 +45,22 @@ public:
     virtual HRESULT Remove(int fd) = 0;
     virtual HRESULT ChangeEventSet(int fd, uint32_t eventflags) = 0;
     virtual HRESULT WaitForNextEvent(PollEvent* pPollEvent, int timeoutMilliseconds) = 0;
+    
+    // Timers fire milliseconds after being set, and then every milliseconds if fPeriodic.
+    // They come back from WaitForNextEvent as an IPOLLING_TIMER event, so periodic work
+    // doesn't need a wait timeout or a clock check after every event.  Expirations that
+    // pile up before the event is handed out are reported once.
+    // A milliseconds value of zero leaves the timer disarmed (AddTimer) or disarms it (ChangeTimer).
+    virtual HRESULT AddTimer(uint32_t milliseconds, bool fPeriodic, int* pTimerId) = 0;
+    virtual HRESULT ChangeTimer(int timerId, uint32_t milliseconds, bool fPeriodic) = 0;
+    virtual HRESULT RemoveTimer(int timerId) = 0;
 };
 
 
 const uint32_t IPOLLING_TYPE_BEST  = 0x01 << 0;
 const uint32_t IPOLLING_TYPE_EPOLL = 0x01 << 1;
 const uint32_t IPOLLING_TYPE_POLL  = 0x01 << 2;
+const uint32_t IPOLLING_TYPE_URING = 0x01 << 3; // io_uring poll requests.  Falls back to epoll where io_uring isn't available
 
 HRESULT CreatePollingInstance(uint32_t type, size_t maxSockets, IPolling** ppPolling);
 
@@ -18,6 +18,7 @@
 
 #include "commonincludes.hpp"
 #include "socketaddress.h"
+#include "recvfromex.h"
 
 
 static void InitSocketAddress(int family, CSocketAddress* pAddr)
@@ -41,6 +42,58 @@ static void InitSocketAddress(int family, CSocketAddress* pAddr)
 }
 
 
+// fills in pDstAddr with the local address a datagram arrived on (from the IP_PKTINFO/IPV6_PKTINFO control data)
+static void GetDestinationAddress(msghdr* pHdr, int family, CSocketAddress* pDstAddr)
+{
+    struct cmsghdr* pCmsg = NULL;
+
+    InitSocketAddress(family, pDstAddr);
+
+    for (pCmsg = CMSG_FIRSTHDR(pHdr); pCmsg != NULL; pCmsg = CMSG_NXTHDR(pHdr, pCmsg))
+    {
+        // IPV6 address ----------------------------------------------------------
+        if ((pCmsg->cmsg_level == IPPROTO_IPV6) && (pCmsg->cmsg_type == IPV6_PKTINFO) && CMSG_DATA(pCmsg))
+        {
+            struct in6_pktinfo* pInfo = (in6_pktinfo*)CMSG_DATA(pCmsg);
+            sockaddr_in6 addr = {};
+            addr.sin6_family = AF_INET6;
+            addr.sin6_addr = pInfo->ipi6_addr;
+            *pDstAddr = CSocketAddress(addr);
+            break;
+        }
+
+
+        // IPV4 address ----------------------------------------------------------
+        // if you change the ifdef's below, make sure you it's matched with the same logic in stunsocket.cpp
+        // Might be worthwhile to just use IP_RECVORIGDSTADDR and IP_ORIGDSTADDR so we can merge with the bsd code
+
+#ifdef IP_PKTINFO
+        if ((pCmsg->cmsg_level == IPPROTO_IP) && (pCmsg->cmsg_type==IP_PKTINFO) && CMSG_DATA(pCmsg))
+        {
+            struct in_pktinfo* pInfo = (in_pktinfo*)CMSG_DATA(pCmsg);
+            sockaddr_in addr = {};
+            addr.sin_family = AF_INET;
+            addr.sin_addr = pInfo->ipi_addr;
+            *pDstAddr = CSocketAddress(addr);
+            break;
+        }
+#endif
+        
+#ifdef IP_RECVDSTADDR
+        // This code path for MacOSX and likely BSD as well
+        if ((pCmsg->cmsg_level == IPPROTO_IP) && (pCmsg->cmsg_type==IP_RECVDSTADDR) && CMSG_DATA(pCmsg))
+        {
+            sockaddr_in addr = {};
+            addr.sin_family = AF_INET;
+            addr.sin_addr = *(in_addr*)CMSG_DATA(pCmsg);
+            *pDstAddr = CSocketAddress(addr);
+            break;
+        }
+#endif
+    }
+}
+
+
 ssize_t recvfromex(int sockfd, void* buf, size_t len, int flags, CSocketAddress* pSrcAddr, CSocketAddress* pDstAddr)
 {
     struct iovec vec;
@@ -72,55 +125,74 @@ ssize_t recvfromex(int sockfd, void* buf, size_t len, int flags, CSocketAddress*
 
         if (pDstAddr)
         {
-            struct cmsghdr* pCmsg = NULL;
+            GetDestinationAddress(&hdr, addrRemote.ss_family, pDstAddr);
+        }
+    }
 
-            InitSocketAddress(addrRemote.ss_family, pDstAddr);
+    return ret;
+}
 
-            for (pCmsg = CMSG_FIRSTHDR(&hdr); pCmsg != NULL; pCmsg = CMSG_NXTHDR(&hdr, pCmsg))
-            {
-                // IPV6 address ----------------------------------------------------------
-                if ((pCmsg->cmsg_level == IPPROTO_IPV6) && (pCmsg->cmsg_type == IPV6_PKTINFO) && CMSG_DATA(pCmsg))
-                {
-                    struct in6_pktinfo* pInfo = (in6_pktinfo*)CMSG_DATA(pCmsg);
-                    sockaddr_in6 addr = {};
-                    addr.sin6_family = AF_INET6;
-                    addr.sin6_addr = pInfo->ipi6_addr;
-                    *pDstAddr = CSocketAddress(addr);
-                    break;
-                }
 
+#ifdef HAS_RECVMMSG
 
-                // IPV4 address ----------------------------------------------------------
-                // if you change the ifdef's below, make sure you it's matched with the same logic in stunsocket.cpp
-                // Might be worthwhile to just use IP_RECVORIGDSTADDR and IP_ORIGDSTADDR so we can merge with the bsd code
+int recvmmsgex(int sockfd, RecvMessageEx* pMessages, size_t count, int flags)
+{
+    mmsghdr hdrs[RECVMMSGEX_MAX] = {};
+    iovec vecs[RECVMMSGEX_MAX];
+    sockaddr_storage addrsRemote[RECVMMSGEX_MAX];
+    char controldata[RECVMMSGEX_MAX][256]; // room for one pktinfo control message (ipv6 is the bigger one)
+    int ret;
 
-#ifdef IP_PKTINFO
-                if ((pCmsg->cmsg_level == IPPROTO_IP) && (pCmsg->cmsg_type==IP_PKTINFO) && CMSG_DATA(pCmsg))
-                {
-                    struct in_pktinfo* pInfo = (in_pktinfo*)CMSG_DATA(pCmsg);
-                    sockaddr_in addr = {};
-                    addr.sin_family = AF_INET;
-                    addr.sin_addr = pInfo->ipi_addr;
-                    *pDstAddr = CSocketAddress(addr);
-                    break;
-                }
-#endif
-                
-#ifdef IP_RECVDSTADDR
-                // This code path for MacOSX and likely BSD as well
-                if ((pCmsg->cmsg_level == IPPROTO_IP) && (pCmsg->cmsg_type==IP_RECVDSTADDR) && CMSG_DATA(pCmsg))
-                {
-                    sockaddr_in addr = {};
-                    addr.sin_family = AF_INET;
-                    addr.sin_addr = *(in_addr*)CMSG_DATA(pCmsg);
-                    *pDstAddr = CSocketAddress(addr);
-                    break;
-                }
-#endif
-            }
-        }
+    count = (count <= RECVMMSGEX_MAX) ? count : RECVMMSGEX_MAX;
+
+    for (size_t index = 0; index < count; index++)
+    {
+        vecs[index].iov_base = pMessages[index].buf;
+        vecs[index].iov_len = pMessages[index].len;
+
+        hdrs[index].msg_hdr.msg_name = &addrsRemote[index];
+        hdrs[index].msg_hdr.msg_namelen = sizeof(addrsRemote[index]);
+        hdrs[index].msg_hdr.msg_iov = &vecs[index];
+        hdrs[index].msg_hdr.msg_iovlen = 1;
+        hdrs[index].msg_hdr.msg_control = controldata[index];
+        hdrs[index].msg_hdr.msg_controllen = sizeof(controldata[index]);
+    }
+
+    // MSG_WAITFORONE - block (unless flags says otherwise) for the first datagram, take whatever else is already queued
+    ret = ::recvmmsg(sockfd, hdrs, (unsigned int)count, flags | MSG_WAITFORONE, NULL);
+
+    for (int index = 0; index < ret; index++)
+    {
+        pMessages[index].received = hdrs[index].msg_len;
+        pMessages[index].addrSrc = CSocketAddress(*(sockaddr*)&addrsRemote[index]);
+        GetDestinationAddress(&hdrs[index].msg_hdr, addrsRemote[index].ss_family, &pMessages[index].addrDst);
     }
 
     return ret;
 }
 
+#else
+
+int recvmmsgex(int sockfd, RecvMessageEx* pMessages, size_t count, int flags)
+{
+    int received = 0;
+    ssize_t ret;
+
+    count = (count <= RECVMMSGEX_MAX) ? count : RECVMMSGEX_MAX;
+
+    for (size_t index = 0; index < count; index++)
+    {
+        ret = recvfromex(sockfd, pMessages[index].buf, pMessages[index].len, (index == 0) ? flags : MSG_DONTWAIT, &pMessages[index].addrSrc, &pMessages[index].addrDst);
+        if (ret < 0)
+        {
+            break;
+        }
+        pMessages[index].received = ret;
+        received++;
+    }
+
+    return (received > 0) ? received : -1;
+}
+
+#endif
+
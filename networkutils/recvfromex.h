@@ -22,5 +22,23 @@
 ssize_t recvfromex(int sockfd, void* buf, size_t len, int flags, CSocketAddress* pSrcAddr, CSocketAddress* pDstAddr);
 
 
+// one datagram for recvmmsgex - buf and len are set by the caller, the rest is filled in
+struct RecvMessageEx
+{
+    void* buf;
+    size_t len;
+    ssize_t received;
+    CSocketAddress addrSrc;
+    CSocketAddress addrDst;
+};
+
+const size_t RECVMMSGEX_MAX = 32;
+
+// recvfromex for up to count (at most RECVMMSGEX_MAX) datagrams at once. It waits for the first one
+// (unless flags has MSG_DONTWAIT), and then takes whatever else is already queued, with a single recvmmsg
+// call where the platform has one. Returns how many datagrams were received, or -1 if none were
+int recvmmsgex(int sockfd, RecvMessageEx* pMessages, size_t count, int flags);
+
+
 #endif	/* RECVFROMEX_H */
 
@@ -241,6 +241,40 @@ Cleanup:
     return hr;
 }
 
+HRESULT CStunSocket::SetTcpFastOpen(int queueLength)
+{
+    HRESULT hr = S_OK;
+    
+#ifdef TCP_FASTOPEN
+    int ret;
+    ret = ::setsockopt(_sock, IPPROTO_TCP, TCP_FASTOPEN, &queueLength, sizeof(queueLength));
+    ChkIf(ret == -1, ERRNOHR);
+#else
+    ((void)queueLength);
+    hr = E_NOTIMPL;
+#endif
+    
+Cleanup:
+    return hr;
+}
+
+HRESULT CStunSocket::SetDeferAccept(int seconds)
+{
+    HRESULT hr = S_OK;
+    
+#ifdef TCP_DEFER_ACCEPT
+    int ret;
+    ret = ::setsockopt(_sock, IPPROTO_TCP, TCP_DEFER_ACCEPT, &seconds, sizeof(seconds));
+    ChkIf(ret == -1, ERRNOHR);
+#else
+    ((void)seconds);
+    hr = E_NOTIMPL;
+#endif
+    
+Cleanup:
+    return hr;
+}
+
 
 void CStunSocket::UpdateAddresses()
 {
@@ -62,6 +62,10 @@ public:
     HRESULT EnablePktInfoOption(bool fEnable);
     HRESULT SetNonBlocking(bool fEnable);
     
+    // TCP listen socket options. Both return E_NOTIMPL when the platform doesn't support them
+    HRESULT SetTcpFastOpen(int queueLength);
+    HRESULT SetDeferAccept(int seconds);
+    
     
     void UpdateAddresses();
     
@@ -0,0 +1,409 @@
+/*
+   Copyright 2011 John Selbie
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "commonincludes.hpp"
+#include "tlssession.h"
+#include "polling.h"
+
+#include <openssl/err.h>
+#include <limits.h>
+
+
+static void LogTlsErrors(const char* pszWhat)
+{
+    unsigned long err;
+    char szError[256];
+
+    while ((err = ERR_get_error()) != 0)
+    {
+        ERR_error_string_n(err, szError, sizeof(szError));
+        Logging::LogMsg(LL_ALWAYS, "%s: %s", pszWhat, szError);
+    }
+}
+
+
+CTlsContext::CTlsContext() :
+_ctx(NULL),
+_fServer(false)
+{
+    ;
+}
+
+CTlsContext::~CTlsContext()
+{
+    if (_ctx)
+    {
+        SSL_CTX_free(_ctx);
+        _ctx = NULL;
+    }
+}
+
+HRESULT CTlsContext::CreateContext(bool fServer)
+{
+    HRESULT hr = S_OK;
+    long options = 0;
+
+    ChkIfA(_ctx != NULL, E_UNEXPECTED);
+
+    _ctx = SSL_CTX_new(fServer ? TLS_server_method() : TLS_client_method());
+    ChkIf(_ctx == NULL, E_FAIL);
+
+    _fServer = fServer;
+
+    SSL_CTX_set_min_proto_version(_ctx, TLS1_2_VERSION);
+
+#ifdef SSL_OP_NO_RENEGOTIATION
+    // a renegotiation could make a read want a write, and nobody asking for a STUN binding needs one
+    options |= SSL_OP_NO_RENEGOTIATION;
+#endif
+#ifdef SSL_OP_ENABLE_KTLS
+    // Once the handshake is done, have the kernel do the record encryption and decryption.
+    // OpenSSL quietly stays in userspace if the kernel or the negotiated cipher doesn't support it.
+    options |= SSL_OP_ENABLE_KTLS;
+#endif
+    SSL_CTX_set_options(_ctx, options);
+
+    // Writes are made straight out of the connection's ring buffer, so the buffer pointer can
+    // move between retries.  Idle sessions give their record buffers back.
+    SSL_CTX_set_mode(_ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER | SSL_MODE_RELEASE_BUFFERS);
+
+    if (fServer)
+    {
+        // Resumption is done with stateless session tickets (the ticket keys belong to this context).
+        // That avoids a server side session cache, and the lock around it that every thread would contend on.
+        SSL_CTX_set_session_cache_mode(_ctx, SSL_SESS_CACHE_OFF);
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+        // TLS 1.3 sends tickets after the handshake.  One is all a client needs for the next connection.
+        SSL_CTX_set_num_tickets(_ctx, 1);
+#endif
+    }
+    else
+    {
+        SSL_CTX_set_verify(_ctx, SSL_VERIFY_NONE, NULL);
+    }
+
+Cleanup:
+    if (FAILED(hr))
+    {
+        LogTlsErrors("Unable to create TLS context");
+    }
+    return hr;
+}
+
+HRESULT CTlsContext::InitServer(const char* pszCertificateFile, const char* pszPrivateKeyFile)
+{
+    HRESULT hr = S_OK;
+    int ret;
+
+    ChkIfA(pszCertificateFile == NULL, E_INVALIDARG);
+    ChkIfA(pszPrivateKeyFile == NULL, E_INVALIDARG);
+
+    Chk(CreateContext(true));
+
+    ret = SSL_CTX_use_certificate_chain_file(_ctx, pszCertificateFile);
+    if (ret != 1)
+    {
+        Logging::LogMsg(LL_ALWAYS, "Unable to load TLS certificate file %s", pszCertificateFile);
+        LogTlsErrors("TLS error");
+        Chk(E_FAIL);
+    }
+
+    ret = SSL_CTX_use_PrivateKey_file(_ctx, pszPrivateKeyFile, SSL_FILETYPE_PEM);
+    if (ret != 1)
+    {
+        Logging::LogMsg(LL_ALWAYS, "Unable to load TLS private key file %s", pszPrivateKeyFile);
+        LogTlsErrors("TLS error");
+        Chk(E_FAIL);
+    }
+
+    ret = SSL_CTX_check_private_key(_ctx);
+    if (ret != 1)
+    {
+        Logging::LogMsg(LL_ALWAYS, "TLS private key does not match the certificate");
+        LogTlsErrors("TLS error");
+        Chk(E_FAIL);
+    }
+
+Cleanup:
+    return hr;
+}
+
+HRESULT CTlsContext::InitServer(X509* pCertificate, EVP_PKEY* pPrivateKey)
+{
+    HRESULT hr = S_OK;
+
+    ChkIfA(pCertificate == NULL, E_INVALIDARG);
+    ChkIfA(pPrivateKey == NULL, E_INVALIDARG);
+
+    Chk(CreateContext(true));
+
+    ChkIf(SSL_CTX_use_certificate(_ctx, pCertificate) != 1, E_FAIL);
+    ChkIf(SSL_CTX_use_PrivateKey(_ctx, pPrivateKey) != 1, E_FAIL);
+    ChkIf(SSL_CTX_check_private_key(_ctx) != 1, E_FAIL);
+
+Cleanup:
+    if (FAILED(hr))
+    {
+        LogTlsErrors("TLS error");
+    }
+    return hr;
+}
+
+HRESULT CTlsContext::InitClient()
+{
+    return CreateContext(false);
+}
+
+bool CTlsContext::IsServer()
+{
+    return _fServer;
+}
+
+SSL_CTX* CTlsContext::GetContext()
+{
+    return _ctx;
+}
+
+
+// ------------------------------------------------------------------
+
+
+CTlsSession::CTlsSession() :
+_ssl(NULL),
+_fHandshakeComplete(false),
+_fBroken(false),
+_wantedEvents(0)
+{
+    ;
+}
+
+CTlsSession::~CTlsSession()
+{
+    Close();
+}
+
+HRESULT CTlsSession::Attach(CTlsContext* pContext, int sock, SSL_SESSION* pSession)
+{
+    HRESULT hr = S_OK;
+
+    ChkIfA(pContext == NULL, E_INVALIDARG);
+    ChkIfA(pContext->GetContext() == NULL, E_UNEXPECTED);
+    ChkIfA(sock == -1, E_INVALIDARG);
+    ChkIfA(_ssl != NULL, E_UNEXPECTED);
+
+    _ssl = SSL_new(pContext->GetContext());
+    ChkIf(_ssl == NULL, E_OUTOFMEMORY);
+
+    ChkIf(SSL_set_fd(_ssl, sock) != 1, E_FAIL);
+
+    if (pContext->IsServer())
+    {
+        SSL_set_accept_state(_ssl);
+    }
+    else
+    {
+        if (pSession)
+        {
+            ChkIf(SSL_set_session(_ssl, pSession) != 1, E_FAIL);
+        }
+        SSL_set_connect_state(_ssl);
+    }
+
+    _fHandshakeComplete = false;
+    _fBroken = false;
+
+    // whoever talks first, the handshake can't go anywhere until the socket is readable or writable
+    _wantedEvents = pContext->IsServer() ? IPOLLING_READ : IPOLLING_WRITE;
+
+Cleanup:
+    if (FAILED(hr))
+    {
+        ERR_clear_error();
+        Close();
+    }
+    return hr;
+}
+
+void CTlsSession::Close(bool fNotifyPeer)
+{
+    if (_ssl)
+    {
+        if (fNotifyPeer && _fHandshakeComplete && (_fBroken == false))
+        {
+            // one shot at a close_notify, without waiting on the peer's reply
+            SSL_shutdown(_ssl);
+        }
+
+        // don't leave errors from this session on the thread's error queue for the next one to find
+        ERR_clear_error();
+        SSL_free(_ssl);
+        _ssl = NULL;
+    }
+
+    _fHandshakeComplete = false;
+    _fBroken = false;
+    _wantedEvents = 0;
+}
+
+bool CTlsSession::IsAttached()
+{
+    return (_ssl != NULL);
+}
+
+bool CTlsSession::IsHandshakeComplete()
+{
+    return _fHandshakeComplete;
+}
+
+HRESULT CTlsSession::HandleResult(int ret)
+{
+    int err = SSL_get_error(_ssl, ret);
+
+    switch (err)
+    {
+        case SSL_ERROR_WANT_READ:
+            _wantedEvents = IPOLLING_READ;
+            return S_FALSE;
+
+        case SSL_ERROR_WANT_WRITE:
+            _wantedEvents = IPOLLING_WRITE;
+            return S_FALSE;
+
+        default:
+            // SSL_ERROR_ZERO_RETURN (close_notify), SSL_ERROR_SYSCALL (connection reset or EOF), or a protocol error
+            if (Logging::GetLogLevel() >= LL_VERBOSE)
+            {
+                char szError[256] = {};
+                ERR_error_string_n(ERR_peek_error(), szError, sizeof(szError));
+                Logging::LogMsg(LL_VERBOSE, "TLS session failed (ssl error == %d, errno == %d) %s", err, errno, szError);
+            }
+            ERR_clear_error();
+            _wantedEvents = 0;
+            
+            // OpenSSL doesn't allow SSL_shutdown after a fatal error. A close_notify from the peer isn't one.
+            _fBroken = (err != SSL_ERROR_ZERO_RETURN);
+            return E_FAIL;
+    }
+}
+
+HRESULT CTlsSession::Handshake()
+{
+    int ret;
+
+    if (_ssl == NULL)
+    {
+        return E_UNEXPECTED;
+    }
+
+    if (_fHandshakeComplete)
+    {
+        return S_OK;
+    }
+
+    ret = SSL_do_handshake(_ssl);
+    if (ret == 1)
+    {
+        _fHandshakeComplete = true;
+        _wantedEvents = 0;
+        return S_OK;
+    }
+
+    return HandleResult(ret);
+}
+
+HRESULT CTlsSession::Read(void* pBuffer, size_t size, size_t* pBytesRead)
+{
+    int ret;
+
+    *pBytesRead = 0;
+
+    if (_ssl == NULL)
+    {
+        return E_UNEXPECTED;
+    }
+
+    ret = SSL_read(_ssl, pBuffer, (int)std::min(size, (size_t)INT_MAX));
+    if (ret > 0)
+    {
+        _fHandshakeComplete = true; // SSL_read will finish a handshake that's still in progress
+        _wantedEvents = 0;
+        *pBytesRead = (size_t)ret;
+        return S_OK;
+    }
+
+    return HandleResult(ret);
+}
+
+HRESULT CTlsSession::Write(const void* pBuffer, size_t size, size_t* pBytesWritten)
+{
+    int ret;
+
+    *pBytesWritten = 0;
+
+    if (_ssl == NULL)
+    {
+        return E_UNEXPECTED;
+    }
+
+    ret = SSL_write(_ssl, pBuffer, (int)std::min(size, (size_t)INT_MAX));
+    if (ret > 0)
+    {
+        _fHandshakeComplete = true;
+        _wantedEvents = 0;
+        *pBytesWritten = (size_t)ret;
+        return S_OK;
+    }
+
+    return HandleResult(ret);
+}
+
+bool CTlsSession::HasPendingData()
+{
+    return (_ssl != NULL) && (SSL_pending(_ssl) > 0);
+}
+
+uint32_t CTlsSession::GetWantedEvents()
+{
+    return _wantedEvents;
+}
+
+bool CTlsSession::IsKernelSend()
+{
+#ifdef BIO_get_ktls_send
+    return (_ssl != NULL) && BIO_get_ktls_send(SSL_get_wbio(_ssl));
+#else
+    return false;
+#endif
+}
+
+bool CTlsSession::IsKernelReceive()
+{
+#ifdef BIO_get_ktls_recv
+    return (_ssl != NULL) && BIO_get_ktls_recv(SSL_get_rbio(_ssl));
+#else
+    return false;
+#endif
+}
+
+bool CTlsSession::IsResumed()
+{
+    return (_ssl != NULL) && (SSL_session_reused(_ssl) == 1);
+}
+
+SSL_SESSION* CTlsSession::GetSession()
+{
+    return (_ssl != NULL) ? SSL_get1_session(_ssl) : NULL;
+}
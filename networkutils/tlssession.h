@@ -0,0 +1,115 @@
+/*
+   Copyright 2011 John Selbie
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef TLSSESSION_H
+#define TLSSESSION_H
+
+#include <openssl/ssl.h>
+
+// CTlsContext holds the certificate, protocol settings, and session ticket keys
+// shared by every TLS session.  One instance is shared by all the threads of a
+// server, so a client can resume its session no matter which thread accepts it.
+
+class CTlsContext :
+    public CBasicRefCount,
+    public CObjectFactory<CTlsContext>,
+    public IRefCounted
+{
+private:
+    SSL_CTX* _ctx;
+    bool _fServer;
+
+    HRESULT CreateContext(bool fServer);
+
+public:
+    CTlsContext();
+    ~CTlsContext();
+
+    // server side context with a PEM certificate (chain) file and PEM private key file
+    HRESULT InitServer(const char* pszCertificateFile, const char* pszPrivateKeyFile);
+
+    // same as above, but with the certificate and key already in memory.  The context takes its own references.
+    HRESULT InitServer(X509* pCertificate, EVP_PKEY* pPrivateKey);
+
+    // client side context.  The server certificate is NOT verified - only intended for test and benchmark code
+    HRESULT InitClient();
+
+    bool IsServer();
+    SSL_CTX* GetContext();
+
+    ADDREF_AND_RELEASE_IMPL();
+};
+
+
+// CTlsSession wraps one non-blocking TLS connection over a socket the caller owns.
+// None of the methods below ever block.  When one of them can't make progress,
+// GetWantedEvents says which IPOLLING_ events have to fire before trying again.
+
+class CTlsSession
+{
+private:
+    SSL* _ssl;
+    bool _fHandshakeComplete;
+    bool _fBroken;  // a fatal error occurred - no close_notify can be sent
+    uint32_t _wantedEvents;
+
+    HRESULT HandleResult(int ret);
+
+    // disallow copy and assignment
+    CTlsSession(const CTlsSession&);
+    void operator=(const CTlsSession&);
+
+public:
+    CTlsSession();
+    ~CTlsSession();
+
+    // pSession is an optional session to resume (client side only)
+    HRESULT Attach(CTlsContext* pContext, int sock, SSL_SESSION* pSession=NULL);
+
+    // sends a close_notify if the handshake got that far (best effort, and only if fNotifyPeer), then frees the session.
+    // Doesn't close the socket.
+    void Close(bool fNotifyPeer=true);
+
+    bool IsAttached();
+    bool IsHandshakeComplete();
+
+    // S_OK once the handshake is complete, S_FALSE if it's waiting on the socket
+    HRESULT Handshake();
+
+    // S_OK with *pBytesRead > 0 when data was read, S_FALSE when waiting on the socket, E_FAIL when the session is closed or broken
+    HRESULT Read(void* pBuffer, size_t size, size_t* pBytesRead);
+
+    // S_OK with *pBytesWritten > 0 when data was sent, S_FALSE when waiting on the socket, E_FAIL when the session is broken
+    // When S_FALSE is returned, the next call must pass at least the same bytes again (the buffer is allowed to move)
+    HRESULT Write(const void* pBuffer, size_t size, size_t* pBytesWritten);
+
+    // decrypted bytes that have already been pulled off the socket.  The socket won't signal readable for these.
+    bool HasPendingData();
+
+    uint32_t GetWantedEvents();
+
+    // true when record encryption/decryption in that direction has been handed off to the kernel
+    bool IsKernelSend();
+    bool IsKernelReceive();
+
+    bool IsResumed();
+
+    // returns a new reference to the session for resuming later (client side). Caller must call SSL_SESSION_free
+    SSL_SESSION* GetSession();
+};
+
+
+#endif	/* TLSSESSION_H */
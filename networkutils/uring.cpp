@@ -0,0 +1,438 @@
+/*
+   Copyright 2011 John Selbie
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "commonincludes.hpp"
+#include "uring.h"
+
+#ifdef HAS_IOURING
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+
+CUring::CUring() :
+_ringfd(-1),
+_features(0),
+_pSqRing(NULL),
+_sizeSqRing(0),
+_pSqHead(NULL),
+_pSqTail(NULL),
+_sqMask(0),
+_sqEntries(0),
+_pSqes(NULL),
+_sizeSqes(0),
+_sqTail(0),
+_pCqRing(NULL),
+_sizeCqRing(0),
+_pCqHead(NULL),
+_pCqTail(NULL),
+_cqMask(0),
+_pCqes(NULL),
+_pBufRing(NULL),
+_sizeBufRing(0),
+_pBuffers(NULL),
+_sizeBuffers(0),
+_bufferCount(0),
+_bufferSize(0),
+_bufferTail(0)
+{
+    memset(_supportedOps, 0, sizeof(_supportedOps));
+}
+
+CUring::~CUring()
+{
+    Close();
+}
+
+HRESULT CUring::Init(uint32_t entries, uint32_t completionEntries)
+{
+    HRESULT hr = S_OK;
+    io_uring_params params;
+    int fd = -1;
+    void* pMap = NULL;
+    uint32_t* pSqArray = NULL;
+    const uint32_t c_requiredFeatures = IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG;
+
+    ChkIfA(_ringfd != -1, E_UNEXPECTED);
+    ChkIfA(entries == 0, E_INVALIDARG);
+
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN;
+    params.cq_entries = std::max(entries, completionEntries);
+    fd = (int)::syscall(__NR_io_uring_setup, entries, &params);
+
+    if ((fd < 0) && (errno == EINVAL))
+    {
+        // the last two flags are just optimizations, and newer than everything else needed here
+        memset(&params, 0, sizeof(params));
+        params.flags = IORING_SETUP_CQSIZE;
+        params.cq_entries = std::max(entries, completionEntries);
+        fd = (int)::syscall(__NR_io_uring_setup, entries, &params);
+    }
+
+    // ENOSYS on kernels without io_uring, EPERM when it's been disabled by policy
+    ChkIf(fd < 0, ERRNOHR);
+    _ringfd = fd;
+    _features = params.features;
+
+    // NODROP - completions that don't fit in the completion queue are held by the kernel instead of being lost
+    // EXT_ARG - a wait can have a timeout without a separate timeout request
+    ChkIf((_features & c_requiredFeatures) != c_requiredFeatures, E_NOTIMPL);
+
+    _sizeSqRing = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    _sizeCqRing = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+
+    if (_features & IORING_FEAT_SINGLE_MMAP)
+    {
+        _sizeSqRing = std::max(_sizeSqRing, _sizeCqRing);
+    }
+
+    pMap = ::mmap(NULL, _sizeSqRing, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ringfd, IORING_OFF_SQ_RING);
+    ChkIf(pMap == MAP_FAILED, ERRNOHR);
+    _pSqRing = (uint8_t*)pMap;
+
+    if (_features & IORING_FEAT_SINGLE_MMAP)
+    {
+        _pCqRing = _pSqRing;
+        _sizeCqRing = 0; // nothing separate to unmap
+    }
+    else
+    {
+        pMap = ::mmap(NULL, _sizeCqRing, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ringfd, IORING_OFF_CQ_RING);
+        ChkIf(pMap == MAP_FAILED, ERRNOHR);
+        _pCqRing = (uint8_t*)pMap;
+    }
+
+    _sizeSqes = params.sq_entries * sizeof(io_uring_sqe);
+    pMap = ::mmap(NULL, _sizeSqes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ringfd, IORING_OFF_SQES);
+    ChkIf(pMap == MAP_FAILED, ERRNOHR);
+    _pSqes = (io_uring_sqe*)pMap;
+
+    _pSqHead = (uint32_t*)(_pSqRing + params.sq_off.head);
+    _pSqTail = (uint32_t*)(_pSqRing + params.sq_off.tail);
+    _sqMask = *(uint32_t*)(_pSqRing + params.sq_off.ring_mask);
+    _sqEntries = *(uint32_t*)(_pSqRing + params.sq_off.ring_entries);
+    _sqTail = *_pSqTail;
+
+    // submission entries are always handed out in order, so the indirection array is just set up once as an identity mapping
+    pSqArray = (uint32_t*)(_pSqRing + params.sq_off.array);
+    for (uint32_t index = 0; index < _sqEntries; index++)
+    {
+        pSqArray[index] = index;
+    }
+
+    _pCqHead = (uint32_t*)(_pCqRing + params.cq_off.head);
+    _pCqTail = (uint32_t*)(_pCqRing + params.cq_off.tail);
+    _cqMask = *(uint32_t*)(_pCqRing + params.cq_off.ring_mask);
+    _pCqes = (io_uring_cqe*)(_pCqRing + params.cq_off.cqes);
+
+    Probe();
+
+Cleanup:
+    if (FAILED(hr))
+    {
+        Close();
+    }
+    return hr;
+}
+
+void CUring::Probe()
+{
+    const uint32_t c_probeOps = ARRAYSIZE(_supportedOps);
+    std::vector<uint8_t> buffer(sizeof(io_uring_probe) + c_probeOps * sizeof(io_uring_probe_op), 0);
+    io_uring_probe* pProbe = (io_uring_probe*)&buffer[0];
+
+    memset(_supportedOps, 0, sizeof(_supportedOps));
+
+    // kernels older than 5.6 can't be probed - nothing gets reported as supported
+    if (::syscall(__NR_io_uring_register, _ringfd, IORING_REGISTER_PROBE, pProbe, c_probeOps) < 0)
+    {
+        return;
+    }
+
+    for (uint32_t index = 0; (index < pProbe->ops_len) && (index < c_probeOps); index++)
+    {
+        if (pProbe->ops[index].flags & IO_URING_OP_SUPPORTED)
+        {
+            _supportedOps[pProbe->ops[index].op] = 1;
+        }
+    }
+}
+
+void CUring::Close()
+{
+    // closing the ring cancels whatever is still in flight
+    if (_ringfd != -1)
+    {
+        close(_ringfd);
+        _ringfd = -1;
+    }
+
+    if (_pSqes)
+    {
+        ::munmap(_pSqes, _sizeSqes);
+    }
+    if (_pCqRing && (_pCqRing != _pSqRing))
+    {
+        ::munmap(_pCqRing, _sizeCqRing);
+    }
+    if (_pSqRing)
+    {
+        ::munmap(_pSqRing, _sizeSqRing);
+    }
+    if (_pBufRing)
+    {
+        ::munmap(_pBufRing, _sizeBufRing);
+    }
+    if (_pBuffers)
+    {
+        ::munmap(_pBuffers, _sizeBuffers);
+    }
+
+    _features = 0;
+    _pSqRing = NULL;
+    _sizeSqRing = 0;
+    _pSqHead = NULL;
+    _pSqTail = NULL;
+    _sqMask = 0;
+    _sqEntries = 0;
+    _pSqes = NULL;
+    _sizeSqes = 0;
+    _sqTail = 0;
+    _pCqRing = NULL;
+    _sizeCqRing = 0;
+    _pCqHead = NULL;
+    _pCqTail = NULL;
+    _cqMask = 0;
+    _pCqes = NULL;
+    _pBufRing = NULL;
+    _sizeBufRing = 0;
+    _pBuffers = NULL;
+    _sizeBuffers = 0;
+    _bufferCount = 0;
+    _bufferSize = 0;
+    _bufferTail = 0;
+    memset(_supportedOps, 0, sizeof(_supportedOps));
+}
+
+bool CUring::IsValid()
+{
+    return (_ringfd != -1);
+}
+
+bool CUring::IsOpSupported(uint8_t opcode)
+{
+    return (_supportedOps[opcode] != 0);
+}
+
+io_uring_sqe* CUring::GetSqe()
+{
+    io_uring_sqe* pSqe = NULL;
+
+    if (_ringfd == -1)
+    {
+        return NULL;
+    }
+
+    if ((_sqTail - __atomic_load_n(_pSqHead, __ATOMIC_ACQUIRE)) >= _sqEntries)
+    {
+        // full - push what's queued to the kernel to make room
+        Enter(0, 0);
+
+        if ((_sqTail - __atomic_load_n(_pSqHead, __ATOMIC_ACQUIRE)) >= _sqEntries)
+        {
+            return NULL;
+        }
+    }
+
+    pSqe = &_pSqes[_sqTail & _sqMask];
+    memset(pSqe, 0, sizeof(*pSqe));
+    _sqTail++;
+
+    return pSqe;
+}
+
+HRESULT CUring::Enter(uint32_t waitCount, int timeoutMilliseconds)
+{
+    HRESULT hr = S_OK;
+    uint32_t toSubmit;
+    unsigned int flags = 0;
+    io_uring_getevents_arg arg;
+    __kernel_timespec ts;
+    void* pArg = NULL;
+    size_t sizeArg = 0;
+    int ret;
+    int err;
+
+    ChkIfA(_ringfd == -1, E_UNEXPECTED);
+
+    // publish everything handed out by GetSqe since the last call
+    __atomic_store_n(_pSqTail, _sqTail, __ATOMIC_RELEASE);
+    toSubmit = _sqTail - __atomic_load_n(_pSqHead, __ATOMIC_ACQUIRE);
+
+    // nothing to submit and nothing to wait for
+    ChkIf((toSubmit == 0) && (waitCount == 0), S_OK);
+
+    if (waitCount > 0)
+    {
+        flags |= IORING_ENTER_GETEVENTS;
+
+        if (timeoutMilliseconds >= 0)
+        {
+            memset(&arg, 0, sizeof(arg));
+            ts.tv_sec = timeoutMilliseconds / 1000;
+            ts.tv_nsec = (long long)(timeoutMilliseconds % 1000) * 1000000;
+            arg.ts = (uint64_t)(uintptr_t)&ts;
+            flags |= IORING_ENTER_EXT_ARG;
+            pArg = &arg;
+            sizeArg = sizeof(arg);
+        }
+    }
+
+    ret = (int)::syscall(__NR_io_uring_enter, _ringfd, toSubmit, waitCount, flags, pArg, sizeArg);
+
+    if (ret < 0)
+    {
+        err = errno;
+
+        // ETIME - the wait timed out.  EINTR - interrupted by a signal.
+        // EBUSY/EAGAIN - the completion queue is backed up, the caller needs to reap before submitting more.
+        // None of those are failures, the caller just finds fewer completions than it asked for.
+        ChkIf((err != ETIME) && (err != EINTR) && (err != EBUSY) && (err != EAGAIN), ERRNO_TO_HRESULT(err));
+    }
+
+Cleanup:
+    return hr;
+}
+
+io_uring_cqe* CUring::PeekCqe()
+{
+    uint32_t head;
+
+    if (_ringfd == -1)
+    {
+        return NULL;
+    }
+
+    head = *_pCqHead; // only this side writes the head
+    if (head == __atomic_load_n(_pCqTail, __ATOMIC_ACQUIRE))
+    {
+        return NULL;
+    }
+
+    return &_pCqes[head & _cqMask];
+}
+
+void CUring::AdvanceCq()
+{
+    __atomic_store_n(_pCqHead, *_pCqHead + 1, __ATOMIC_RELEASE);
+}
+
+HRESULT CUring::RegisterBufferRing(uint16_t groupId, uint32_t count, uint32_t size)
+{
+    HRESULT hr = S_OK;
+    io_uring_buf_reg reg;
+    void* pMap = NULL;
+    int ret;
+
+    ChkIfA(_ringfd == -1, E_UNEXPECTED);
+    ChkIfA(_pBufRing != NULL, E_UNEXPECTED);
+    ChkIfA((count == 0) || ((count & (count - 1)) != 0) || (count > 32768), E_INVALIDARG);
+    ChkIfA(size == 0, E_INVALIDARG);
+
+    // the ring has to be page aligned
+    _sizeBufRing = count * sizeof(io_uring_buf);
+    pMap = ::mmap(NULL, _sizeBufRing, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    ChkIf(pMap == MAP_FAILED, ERRNOHR);
+    _pBufRing = (io_uring_buf_ring*)pMap;
+
+    // the kernel writes into these behind our back, so they get their own mapping instead of
+    // coming off the heap.  If something were still in flight when the ring goes away, the
+    // write would fail rather than land in somebody else's memory.
+    _sizeBuffers = (size_t)count * size;
+    pMap = ::mmap(NULL, _sizeBuffers, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    ChkIf(pMap == MAP_FAILED, ERRNOHR);
+    _pBuffers = (uint8_t*)pMap;
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)_pBufRing;
+    reg.ring_entries = count;
+    reg.bgid = groupId;
+
+    // 5.19 and later
+    ret = (int)::syscall(__NR_io_uring_register, _ringfd, IORING_REGISTER_PBUF_RING, &reg, 1);
+    ChkIf(ret < 0, ERRNOHR);
+
+    _bufferCount = count;
+    _bufferSize = size;
+    _bufferTail = 0;
+
+    for (uint32_t id = 0; id < count; id++)
+    {
+        ReturnBuffer((uint16_t)id);
+    }
+
+Cleanup:
+    if (FAILED(hr))
+    {
+        if (_pBufRing)
+        {
+            ::munmap(_pBufRing, _sizeBufRing);
+        }
+        if (_pBuffers)
+        {
+            ::munmap(_pBuffers, _sizeBuffers);
+        }
+        _pBufRing = NULL;
+        _sizeBufRing = 0;
+        _pBuffers = NULL;
+        _sizeBuffers = 0;
+    }
+    return hr;
+}
+
+uint8_t* CUring::GetBuffer(uint16_t bufferId)
+{
+    ASSERT(bufferId < _bufferCount);
+    return _pBuffers + ((size_t)bufferId * _bufferSize);
+}
+
+uint32_t CUring::GetBufferSize()
+{
+    return _bufferSize;
+}
+
+void CUring::ReturnBuffer(uint16_t bufferId)
+{
+    io_uring_buf* pBuf;
+
+    ASSERT(bufferId < _bufferCount);
+
+    // The ring's tail shares memory with the reserved field of the first entry,
+    // so entries get filled in field by field rather than overwritten as a whole.
+    // The entries are indexed off the start of the ring instead of through the bufs member.
+    // The kernel header declares that as a flexible array inside a union, and the C++ expansion
+    // of that pads it out past the tail.
+    pBuf = ((io_uring_buf*)_pBufRing) + (_bufferTail & (_bufferCount - 1));
+    pBuf->addr = (uint64_t)(uintptr_t)GetBuffer(bufferId);
+    pBuf->len = _bufferSize;
+    pBuf->bid = bufferId;
+
+    _bufferTail++;
+    __atomic_store_n(&_pBufRing->tail, _bufferTail, __ATOMIC_RELEASE);
+}
+
+#endif // HAS_IOURING
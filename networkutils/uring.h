@@ -0,0 +1,113 @@
+/*
+   Copyright 2011 John Selbie
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef URING_H
+#define URING_H
+
+#ifdef HAS_IOURING
+
+// CUring is a thin wrapper around one io_uring instance, set up with the raw system calls
+// (no dependency on liburing).
+//    Requests are queued with GetSqe, and all of them go to the kernel with the next call
+//    to Enter - which can also wait for completions.  So a single system call both submits
+//    a whole batch of work and collects the results of the last one.
+//    Completions are read in place with PeekCqe and handed back with AdvanceCq.
+//    An optional provided buffer ring lets receives pick a buffer when data actually arrives,
+//    instead of every pending receive holding one.
+//    Not thread safe - a ring belongs to the thread that drives it.
+
+class CUring
+{
+private:
+    int _ringfd;
+    uint32_t _features;
+
+    // submission queue
+    uint8_t* _pSqRing;
+    size_t _sizeSqRing;
+    uint32_t* _pSqHead;
+    uint32_t* _pSqTail;
+    uint32_t _sqMask;
+    uint32_t _sqEntries;
+    io_uring_sqe* _pSqes;
+    size_t _sizeSqes;
+    uint32_t _sqTail;      // local copy of the tail, published to the kernel by Enter
+    uint32_t _sqUnsubmitted;
+
+    // completion queue (may share the mapping with the submission queue)
+    uint8_t* _pCqRing;
+    size_t _sizeCqRing;
+    uint32_t* _pCqHead;
+    uint32_t* _pCqTail;
+    uint32_t _cqMask;
+    io_uring_cqe* _pCqes;
+
+    // which opcodes the kernel supports (from IORING_REGISTER_PROBE)
+    uint8_t _supportedOps[256];
+
+    // provided buffer ring
+    io_uring_buf_ring* _pBufRing;
+    size_t _sizeBufRing;
+    uint8_t* _pBuffers;
+    size_t _sizeBuffers;
+    uint32_t _bufferCount;
+    uint32_t _bufferSize;
+    uint16_t _bufferTail;
+
+    void Probe();
+
+    // disallow copy and assignment
+    CUring(const CUring&);
+    void operator=(const CUring&);
+
+public:
+    CUring();
+    ~CUring();
+
+    // entries is the submission queue size, completionEntries the completion queue size (both rounded up to a power of 2 by the kernel)
+    // Fails if the kernel doesn't support io_uring, or is missing a feature this class depends on
+    HRESULT Init(uint32_t entries, uint32_t completionEntries);
+    void Close();
+    bool IsValid();
+
+    bool IsOpSupported(uint8_t opcode);
+
+    // returns a zeroed out submission entry. If the submission queue is full, the queued
+    // requests are submitted first to make room.  NULL only if that fails too.
+    io_uring_sqe* GetSqe();
+
+    // submits everything queued by GetSqe, then waits until at least waitCount completions are
+    // available or timeoutMilliseconds goes by (-1 waits indefinitely).
+    // S_OK in either case - the caller checks PeekCqe for what arrived
+    HRESULT Enter(uint32_t waitCount, int timeoutMilliseconds);
+
+    // the next completion (or NULL). It stays valid until AdvanceCq is called
+    io_uring_cqe* PeekCqe();
+    void AdvanceCq();
+
+    // registers a ring of count buffers (count must be a power of 2), each size bytes, for
+    // receives submitted with IOSQE_BUFFER_SELECT and buf_group set to groupId
+    HRESULT RegisterBufferRing(uint16_t groupId, uint32_t count, uint32_t size);
+    uint8_t* GetBuffer(uint16_t bufferId);
+    uint32_t GetBufferSize();
+
+    // puts a buffer picked by a receive back in the ring
+    void ReturnBuffer(uint16_t bufferId);
+};
+
+#endif // HAS_IOURING
+
+#endif	/* URING_H */
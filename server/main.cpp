@@ -129,6 +129,21 @@ struct StartupArgs
     std::string strDosProtect;
     std::string strConfigFile;
     std::string strReuseAddr;
+    std::string strTcpFastOpen;
+    std::string strDeferAccept;
+    std::string strCertificate;
+    std::string strPrivateKey;
+    std::string strTcpClose;
+    std::string strCloseWait;
+    std::string strIoUring;
+    std::string strWorkers;
+    std::string strResponseCache;
+    std::string strCacheTTL;
+    std::string strCredentials;
+    std::string strBuildCredentials;
+    std::string strRealm;
+    std::string strAuthDelay;
+    std::string strIceResponder;
     
 };
 
@@ -151,6 +166,21 @@ void DumpStartupArgs(StartupArgs& args)
     PRINTARG(strMaxConnections);
     PRINTARG(strDosProtect);
     PRINTARG(strReuseAddr);
+    PRINTARG(strTcpFastOpen);
+    PRINTARG(strDeferAccept);
+    PRINTARG(strCertificate);
+    PRINTARG(strPrivateKey);
+    PRINTARG(strTcpClose);
+    PRINTARG(strCloseWait);
+    PRINTARG(strIoUring);
+    PRINTARG(strWorkers);
+    PRINTARG(strResponseCache);
+    PRINTARG(strCacheTTL);
+    PRINTARG(strCredentials);
+    PRINTARG(strBuildCredentials);
+    PRINTARG(strRealm);
+    PRINTARG(strAuthDelay);
+    PRINTARG(strIceResponder);
     Logging::LogMsg(LL_DEBUG, "--------------------------\n");
 }
 
@@ -194,11 +224,56 @@ void DumpConfig(CStunServerConfig &config)
         Logging::LogMsg(LL_DEBUG, "Alternate IP will be advertised as %s", strSocket.c_str());
     }
     
-    Logging::LogMsg(LL_DEBUG, "Protocol = %s", config.fTCP ? "TCP" : "UDP");
+    Logging::LogMsg(LL_DEBUG, "Protocol = %s", config.fTLS ? "TLS" : (config.fTCP ? "TCP" : "UDP"));
+    if (config.fTLS)
+    {
+        Logging::LogMsg(LL_DEBUG, "TLS certificate file: %s", config.strTlsCertificateFile.c_str());
+        Logging::LogMsg(LL_DEBUG, "TLS private key file: %s", config.strTlsPrivateKeyFile.c_str());
+    }
     if (config.fTCP && (config.nMaxConnections>0))
     {
         Logging::LogMsg(LL_DEBUG, "Max TCP Connections per thread: %d", config.nMaxConnections);
     }
+    if (config.fTCP && (config.nTcpFastOpenQueueLength > 0))
+    {
+        Logging::LogMsg(LL_DEBUG, "TCP Fast Open queue length: %d", config.nTcpFastOpenQueueLength);
+    }
+    if (config.fTCP && (config.nDeferAcceptSeconds > 0))
+    {
+        Logging::LogMsg(LL_DEBUG, "TCP deferred accept timeout: %d seconds", config.nDeferAcceptSeconds);
+    }
+    if (config.fTCP)
+    {
+        Logging::LogMsg(LL_DEBUG, "TCP connections closed by the server get a %s", config.fTcpOrderlyClose ? "FIN" : "reset");
+    }
+    if (config.fTCP && (config.nTcpCloseWaitSeconds > 0))
+    {
+        Logging::LogMsg(LL_DEBUG, "TCP close wait: %d seconds", config.nTcpCloseWaitSeconds);
+    }
+    if (config.fTCP && config.fIoUring)
+    {
+        Logging::LogMsg(LL_DEBUG, "TCP connections use io_uring if the kernel supports it");
+    }
+    if ((config.fTCP == false) && (config.nPipelineWorkers > 0))
+    {
+        Logging::LogMsg(LL_DEBUG, "Pipeline mode with %d worker threads", config.nPipelineWorkers);
+    }
+    if ((config.fTCP == false) && (config.nResponseCacheSize > 0))
+    {
+        Logging::LogMsg(LL_DEBUG, "Response cache: %d entries per thread, kept for %d seconds", config.nResponseCacheSize, (config.nResponseCacheSeconds > 0) ? config.nResponseCacheSeconds : (CStunResponseCache::c_defaultTTL / 1000));
+    }
+    if (config.strCredentialsFile.length() > 0)
+    {
+        Logging::LogMsg(LL_DEBUG, "Credentials file: %s", config.strCredentialsFile.c_str());
+    }
+    if (config.nAuthDelayMilliseconds > 0)
+    {
+        Logging::LogMsg(LL_DEBUG, "Auth checks answered asynchronously after %u milliseconds", config.nAuthDelayMilliseconds);
+    }
+    if ((config.fTCP == false) && (config.nIceCacheSize > 0))
+    {
+        Logging::LogMsg(LL_DEBUG, "ICE responder: keys for %d ufrags per thread", config.nIceCacheSize);
+    }
 }
 
 
@@ -323,13 +398,31 @@ HRESULT BuildServerConfigurationFromArgs(StartupArgs& argsIn, CStunServerConfig*
     // ---- PROTOCOL --------------------------------------------------------
     if (args.strProtocol.length() > 0)
     {
-        if ((args.strProtocol != "udp") && (args.strProtocol != "tcp"))
+        if ((args.strProtocol != "udp") && (args.strProtocol != "tcp") && (args.strProtocol != "tls"))
         {
-            Logging::LogMsg(LL_ALWAYS, "Protocol argument must be 'udp' or 'tcp'. 'tls' is not supported yet");
+            Logging::LogMsg(LL_ALWAYS, "Protocol argument must be 'udp', 'tcp', or 'tls'");
             Chk(E_INVALIDARG);
         }
         
-        config.fTCP = (args.strProtocol == "tcp");
+        config.fTLS = (args.strProtocol == "tls");
+        config.fTCP = (args.strProtocol == "tcp") || config.fTLS;
+    }
+    
+    
+    // ---- TLS CERTIFICATE AND KEY ---------------------------------------------
+    if (config.fTLS)
+    {
+        if ((args.strCertificate.length() == 0) || (args.strPrivateKey.length() == 0))
+        {
+            Logging::LogMsg(LL_ALWAYS, "TLS mode requires both the --certificate and --privatekey parameters");
+            Chk(E_INVALIDARG);
+        }
+        config.strTlsCertificateFile = args.strCertificate;
+        config.strTlsPrivateKeyFile = args.strPrivateKey;
+    }
+    else if ((args.strCertificate.length() > 0) || (args.strPrivateKey.length() > 0))
+    {
+        Logging::LogMsg(LL_ALWAYS, "Certificate and private key parameters have no meaning unless TLS is used. Did you mean to specify \"--protocol=tls ?\"");
     }
     
     
@@ -352,10 +445,221 @@ HRESULT BuildServerConfigurationFromArgs(StartupArgs& argsIn, CStunServerConfig*
         }
         config.nMaxConnections = nMaxConnections;
     }
+    
+    
+    // ---- TCP FAST OPEN -------------------------------------------------------
+    if (args.strTcpFastOpen.length() > 0)
+    {
+        int nQueueLength = 0;
+        if (config.fTCP == false)
+        {
+            Logging::LogMsg(LL_ALWAYS, "TCP Fast Open parameter has no meaning in UDP mode. Did you mean to specify \"--protocol=tcp ?\"");
+        }
+        else
+        {
+            hr = StringHelper::ValidateNumberString(args.strTcpFastOpen.c_str(), 1, 100000, &nQueueLength);
+            if (FAILED(hr))
+            {
+                Logging::LogMsg(LL_ALWAYS, "TCP Fast Open queue length must be between 1-100000");
+                Chk(hr);
+            }
+        }
+        config.nTcpFastOpenQueueLength = nQueueLength;
+    }
+    
+    
+    // ---- TCP DEFER ACCEPT ----------------------------------------------------
+    if (args.strDeferAccept.length() > 0)
+    {
+        int nDeferSeconds = 0;
+        if (config.fTCP == false)
+        {
+            Logging::LogMsg(LL_ALWAYS, "Defer accept parameter has no meaning in UDP mode. Did you mean to specify \"--protocol=tcp ?\"");
+        }
+        else
+        {
+            hr = StringHelper::ValidateNumberString(args.strDeferAccept.c_str(), 1, 60, &nDeferSeconds);
+            if (FAILED(hr))
+            {
+                Logging::LogMsg(LL_ALWAYS, "Defer accept timeout must be between 1-60 seconds");
+                Chk(hr);
+            }
+        }
+        config.nDeferAcceptSeconds = nDeferSeconds;
+    }
+    
+    
+    // ---- TCP CLOSE MODE ------------------------------------------------------
+    StringHelper::ToLower(args.strTcpClose);
+    StringHelper::Trim(args.strTcpClose);
+    if (args.strTcpClose.length() > 0)
+    {
+        if (config.fTCP == false)
+        {
+            Logging::LogMsg(LL_ALWAYS, "TCP close parameter has no meaning in UDP mode. Did you mean to specify \"--protocol=tcp ?\"");
+        }
+        else if ((args.strTcpClose != "reset") && (args.strTcpClose != "fin"))
+        {
+            Logging::LogMsg(LL_ALWAYS, "TCP close argument must be 'reset' or 'fin'");
+            Chk(E_INVALIDARG);
+        }
+        config.fTcpOrderlyClose = (args.strTcpClose == "fin");
+    }
+    
+    
+    // ---- TCP CLOSE WAIT ------------------------------------------------------
+    if (args.strCloseWait.length() > 0)
+    {
+        int nCloseWait = 0;
+        if (config.fTCP == false)
+        {
+            Logging::LogMsg(LL_ALWAYS, "Close wait parameter has no meaning in UDP mode. Did you mean to specify \"--protocol=tcp ?\"");
+        }
+        else
+        {
+            hr = StringHelper::ValidateNumberString(args.strCloseWait.c_str(), 1, 3600, &nCloseWait);
+            if (FAILED(hr))
+            {
+                Logging::LogMsg(LL_ALWAYS, "Close wait must be between 1-3600 seconds");
+                Chk(hr);
+            }
+        }
+        config.nTcpCloseWaitSeconds = nCloseWait;
+    }
+    
+    
+    // ---- IO_URING SWITCH -----------------------------------------------------
+    if (args.strIoUring.length() > 0)
+    {
+        if (config.fTCP == false)
+        {
+            Logging::LogMsg(LL_ALWAYS, "io_uring parameter has no meaning in UDP mode. Did you mean to specify \"--protocol=tcp ?\"");
+        }
+        config.fIoUring = config.fTCP;
+    }
+    
+    
+    // ---- PIPELINE WORKERS ----------------------------------------------------
+    if (args.strWorkers.length() > 0)
+    {
+        int nWorkers = 0;
+        if (config.fTCP)
+        {
+            Logging::LogMsg(LL_ALWAYS, "Workers parameter has no meaning in TCP mode. Did you mean to specify \"--protocol=udp ?\"");
+        }
+        else
+        {
+            hr = StringHelper::ValidateNumberString(args.strWorkers.c_str(), 1, (int)CStunPipeline::c_maxWorkers, &nWorkers);
+            if (FAILED(hr))
+            {
+                Logging::LogMsg(LL_ALWAYS, "Workers must be between 1-%d", (int)CStunPipeline::c_maxWorkers);
+                Chk(hr);
+            }
+        }
+        config.nPipelineWorkers = nWorkers;
+    }
+    
+    
+    // ---- RESPONSE CACHE ------------------------------------------------------
+    if (args.strResponseCache.length() > 0)
+    {
+        int nCacheSize = 0;
+        if (config.fTCP)
+        {
+            Logging::LogMsg(LL_ALWAYS, "Response cache parameter has no meaning in TCP mode. Did you mean to specify \"--protocol=udp ?\"");
+        }
+        else
+        {
+            hr = StringHelper::ValidateNumberString(args.strResponseCache.c_str(), 1, 65536, &nCacheSize);
+            if (FAILED(hr))
+            {
+                Logging::LogMsg(LL_ALWAYS, "Response cache size must be between 1-65536");
+                Chk(hr);
+            }
+        }
+        config.nResponseCacheSize = nCacheSize;
+    }
+    
+    if (args.strCacheTTL.length() > 0)
+    {
+        int nCacheSeconds = 0;
+        if (config.fTCP)
+        {
+            Logging::LogMsg(LL_ALWAYS, "Cache TTL parameter has no meaning in TCP mode. Did you mean to specify \"--protocol=udp ?\"");
+        }
+        else
+        {
+            hr = StringHelper::ValidateNumberString(args.strCacheTTL.c_str(), 1, 60, &nCacheSeconds);
+            if (FAILED(hr))
+            {
+                Logging::LogMsg(LL_ALWAYS, "Cache TTL must be between 1-60 seconds");
+                Chk(hr);
+            }
+            if (config.nResponseCacheSize == 0)
+            {
+                Logging::LogMsg(LL_ALWAYS, "Cache TTL parameter has no meaning without --responsecache");
+            }
+        }
+        config.nResponseCacheSeconds = nCacheSeconds;
+    }
+    
+    
+    // ---- CREDENTIALS ---------------------------------------------------------
+    if (args.strCredentials.length() > 0)
+    {
+        config.strCredentialsFile = args.strCredentials;
+    }
+    
+    
+    // ---- AUTH DELAY ----------------------------------------------------------
+    if (args.strAuthDelay.length() > 0)
+    {
+        int nAuthDelay = 0;
+        hr = StringHelper::ValidateNumberString(args.strAuthDelay.c_str(), 0, 10000, &nAuthDelay);
+        if (FAILED(hr))
+        {
+            Logging::LogMsg(LL_ALWAYS, "Auth delay must be between 0-10000 milliseconds");
+            Chk(hr);
+        }
+        if ((config.fTCP == false) && (config.nPipelineWorkers > 0) && (nAuthDelay > 0))
+        {
+            Logging::LogMsg(LL_ALWAYS, "Warning - pipeline workers wait on delayed auth checks instead of going on with other requests");
+        }
+        config.nAuthDelayMilliseconds = (uint32_t)nAuthDelay;
+    }
+    
+    
+    // ---- ICE RESPONDER -------------------------------------------------------
+    if (args.strIceResponder.length() > 0)
+    {
+        int nIceCacheSize = 0;
+        if (config.fTCP)
+        {
+            Logging::LogMsg(LL_ALWAYS, "ICE responder parameter has no meaning in TCP mode. Did you mean to specify \"--protocol=udp ?\"");
+        }
+        else
+        {
+            hr = StringHelper::ValidateNumberString(args.strIceResponder.c_str(), 1, 65536, &nIceCacheSize);
+            if (FAILED(hr))
+            {
+                Logging::LogMsg(LL_ALWAYS, "ICE responder cache size must be between 1-65536");
+                Chk(hr);
+            }
+            if (config.strCredentialsFile.length() == 0)
+            {
+                Logging::LogMsg(LL_ALWAYS, "ICE responder parameter has no meaning without --credentials");
+            }
+            else if ((config.nPipelineWorkers == 0) && (config.nAuthDelayMilliseconds > 0))
+            {
+                Logging::LogMsg(LL_ALWAYS, "Warning - the ICE responder is turned off while auth checks are asynchronous (--authdelay)");
+            }
+        }
+        config.nIceCacheSize = nIceCacheSize;
+    }
 
 
     // ---- PRIMARY PORT --------------------------------------------------------
-    nPrimaryPort = DEFAULT_STUN_PORT;
+    nPrimaryPort = config.fTLS ? DEFAULT_STUN_TLS_PORT : DEFAULT_STUN_PORT;
     if (args.strPrimaryPort.length() > 0)
     {
         hr = StringHelper::ValidateNumberString(args.strPrimaryPort.c_str(), 0x0001, 0xffff, &nPrimaryPort);
@@ -367,7 +671,7 @@ HRESULT BuildServerConfigurationFromArgs(StartupArgs& argsIn, CStunServerConfig*
     }
 
     // ---- ALT PORT --------------------------------------------------------
-    nAltPort = DEFAULT_STUN_PORT + 1;
+    nAltPort = (config.fTLS ? DEFAULT_STUN_TLS_PORT : DEFAULT_STUN_PORT) + 1;
     if (args.strAltPort.length() > 0)
     {
         hr = StringHelper::ValidateNumberString(args.strAltPort.c_str(), 0x0001, 0xffff, &nAltPort);
@@ -542,6 +846,21 @@ HRESULT ParseCommandLineArgs(int argc, char** argv, int startindex, StartupArgs*
     cmdline.AddOption("ddp", no_argument, &pStartupArgs->strDosProtect);
     cmdline.AddOption("configfile", required_argument, &pStartupArgs->strConfigFile);
     cmdline.AddOption("reuseaddr", no_argument, &pStartupArgs->strReuseAddr);
+    cmdline.AddOption("tcpfastopen", required_argument, &pStartupArgs->strTcpFastOpen);
+    cmdline.AddOption("deferaccept", required_argument, &pStartupArgs->strDeferAccept);
+    cmdline.AddOption("certificate", required_argument, &pStartupArgs->strCertificate);
+    cmdline.AddOption("privatekey", required_argument, &pStartupArgs->strPrivateKey);
+    cmdline.AddOption("tcpclose", required_argument, &pStartupArgs->strTcpClose);
+    cmdline.AddOption("closewait", required_argument, &pStartupArgs->strCloseWait);
+    cmdline.AddOption("iouring", no_argument, &pStartupArgs->strIoUring);
+    cmdline.AddOption("workers", required_argument, &pStartupArgs->strWorkers);
+    cmdline.AddOption("responsecache", required_argument, &pStartupArgs->strResponseCache);
+    cmdline.AddOption("cachettl", required_argument, &pStartupArgs->strCacheTTL);
+    cmdline.AddOption("credentials", required_argument, &pStartupArgs->strCredentials);
+    cmdline.AddOption("buildcredentials", required_argument, &pStartupArgs->strBuildCredentials);
+    cmdline.AddOption("realm", required_argument, &pStartupArgs->strRealm);
+    cmdline.AddOption("authdelay", required_argument, &pStartupArgs->strAuthDelay);
+    cmdline.AddOption("iceresponder", required_argument, &pStartupArgs->strIceResponder);
 
     cmdline.ParseCommandLine(argc, argv, startindex, &fError);
 
@@ -598,6 +917,19 @@ HRESULT LoadConfigsFromFile(const std::string& filename, std::vector<StartupArgs
             args.strMaxConnections = child.get("maxconn", "");
             args.strDosProtect = child.get("ddp", "");
             args.strReuseAddr = child.get("reuseaddr", "");
+            args.strTcpFastOpen = child.get("tcpfastopen", "");
+            args.strDeferAccept = child.get("deferaccept", "");
+            args.strCertificate = child.get("certificate", "");
+            args.strPrivateKey = child.get("privatekey", "");
+            args.strTcpClose = child.get("tcpclose", "");
+            args.strCloseWait = child.get("closewait", "");
+            args.strIoUring = child.get("iouring", "");
+            args.strWorkers = child.get("workers", "");
+            args.strResponseCache = child.get("responsecache", "");
+            args.strCacheTTL = child.get("cachettl", "");
+            args.strCredentials = child.get("credentials", "");
+            args.strAuthDelay = child.get("authdelay", "");
+            args.strIceResponder = child.get("iceresponder", "");
             
             configurations.push_back(args);
         }
@@ -648,9 +980,10 @@ HRESULT BlockSignal(int sig)
 }
 
 
-// after all the child threads have initialized with a signal mask that blocks SIGINT and SIGTERM
-// then the main thread UI can just sit on WaitForAppExitSignal and wait for CTRL-C to get pressed
-void WaitForAppExitSignal()
+// after all the child threads have initialized with a signal mask that blocks SIGINT, SIGTERM, and SIGHUP
+// then the main thread UI can just sit on WaitForAppSignal and wait for CTRL-C to get pressed
+// returns the signal - SIGHUP means reload, anything else means exit
+int WaitForAppSignal()
 {
     while (true)
     {
@@ -658,18 +991,55 @@ void WaitForAppExitSignal()
         sigemptyset(&sigs);
         sigaddset(&sigs, SIGINT);
         sigaddset(&sigs, SIGTERM);
+        sigaddset(&sigs, SIGHUP);
         int sig = 0;
         
         int ret = sigwait(&sigs, &sig);
         Logging::LogMsg(LL_DEBUG, "sigwait returns %d (errno==%d)", ret, (ret==-1)?0:errno);
-        if ((sig == SIGINT) || (sig == SIGTERM))
+        if ((sig == SIGINT) || (sig == SIGTERM) || (sig == SIGHUP))
         {
-            break;
+            return sig;
         }
     }
 }
 
 
+// --buildcredentials: turns a text file of "username:password" lines into the file --credentials loads
+HRESULT BuildCredentialsFile(const StartupArgs& args)
+{
+    HRESULT hr = S_OK;
+    CStunCredentialFile file;
+
+    if (args.strCredentials.length() == 0)
+    {
+        Logging::LogMsg(LL_ALWAYS, "--buildcredentials needs --credentials for the name of the file to create");
+        return E_INVALIDARG;
+    }
+
+    if (args.strRealm.length() > MAX_STUN_AUTH_STRING_SIZE)
+    {
+        Logging::LogMsg(LL_ALWAYS, "Realm can be no longer than %d characters", MAX_STUN_AUTH_STRING_SIZE);
+        return E_INVALIDARG;
+    }
+
+    hr = CStunCredentialFile::Build(args.strBuildCredentials.c_str(), args.strRealm.c_str(), args.strCredentials.c_str());
+    if (SUCCEEDED(hr))
+    {
+        hr = file.Open(args.strCredentials.c_str());
+    }
+
+    if (FAILED(hr))
+    {
+        Logging::LogMsg(LL_ALWAYS, "Unable to build %s from %s (error code = x%x)", args.strCredentials.c_str(), args.strBuildCredentials.c_str(), hr);
+        return hr;
+    }
+
+    Logging::LogMsg(LL_ALWAYS, "Wrote %u users to %s (%s credentials)", file.GetCount(), args.strCredentials.c_str(), file.GetRealm()[0] ? "long term" : "short term");
+
+    return S_OK;
+}
+
+
 
 HRESULT StartUDP(CRefCountedPtr<CStunServer>& spServer, CStunServerConfig& config)
 {
@@ -735,9 +1105,10 @@ int main(int argc, char** argv)
     signal(SIGPIPE, SIG_IGN);
     BlockSignal(SIGPIPE);
     
-    // Block SIGTERM and SIGINT such that the child threads will never get that signal (so that subsequent WaitForAppExitSignal hooks on *this* thread)
+    // Block SIGTERM, SIGINT, and SIGHUP such that the child threads will never get those signals (so that subsequent WaitForAppSignal hooks on *this* thread)
     BlockSignal(SIGTERM);
     BlockSignal(SIGINT);
+    BlockSignal(SIGHUP);
     
 
 #ifdef DEBUG
@@ -770,6 +1141,12 @@ int main(int argc, char** argv)
         }
     }
     
+    if (args.strBuildCredentials.empty() == false)
+    {
+        hr = BuildCredentialsFile(args);
+        return SUCCEEDED(hr) ? 0 : -4;
+    }
+    
     if (args.strConfigFile.empty() == false)
     {
         hr = LoadConfigsFromFile(args.strConfigFile, argsVector);
@@ -834,7 +1211,21 @@ int main(int argc, char** argv)
     if (SUCCEEDED(hr))
     {
         Logging::LogMsg(LL_DEBUG, "Successfully started server.");
-        WaitForAppExitSignal();
+        
+        while (WaitForAppSignal() == SIGHUP)
+        {
+            Logging::LogMsg(LL_DEBUG, "SIGHUP - reloading credentials");
+            
+            for (std::vector<UdpServerPtr>::iterator itor = udpServers.begin(); itor != udpServers.end(); itor++)
+            {
+                (*itor)->ReloadCredentials();
+            }
+            
+            for (std::vector<TcpServerPtr>::iterator itor = tcpServers.begin(); itor != tcpServers.end(); itor++)
+            {
+                (*itor)->ReloadCredentials();
+            }
+        }
     }
 
 
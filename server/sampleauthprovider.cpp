@@ -15,7 +15,6 @@
 */
 
 #include "commonincludes.hpp"
-#include <openssl/hmac.h>
 #include "stuncore.h"
 #include "stunsocket.h"
 #include "stunsocketthread.h"
@@ -23,7 +22,6 @@
 #include "sampleauthprovider.h"
 
 
-static const char* c_szPrivateKey = "Change this string if you are going to use this code";
 static const char* c_szRealm = "YourRealmNameHere";
 
 
@@ -96,6 +94,14 @@ HRESULT CShortTermAuth::DoAuthCheck(AuthAttributes* pAuthAttributes, AuthRespons
     return S_OK;
 }
 
+HRESULT CLongTermAuth::Initialize()
+{
+    // Nonces are stateless: a timestamp and a MAC with a random key that gets replaced every few
+    // minutes (see CStunNonceGenerator).  Every server instance has keys of its own, so
+    // a nonce from one server is no good on another.
+    return _nonces.Init(CStunNonceGenerator::c_defaultLifetimeSeconds, CStunNonceGenerator::c_defaultRotationSeconds);
+}
+
 HRESULT CLongTermAuth::DoAuthCheck(AuthAttributes* pAuthAttributes, AuthResponse* pResponse)
 {
     HRESULT hr = S_OK;
@@ -104,7 +110,7 @@ HRESULT CLongTermAuth::DoAuthCheck(AuthAttributes* pAuthAttributes, AuthResponse
     
     // Go ahead and generate a new nonce and set the realm.
     // The realm and nonce attributes will only get sent back to the client when there is an auth error
-    CreateNonce(pResponse->szNonce);
+    Chk(_nonces.CreateNonce(pResponse->szNonce));
     strcpy(pResponse->szRealm, c_szRealm);
 
     // if we're missing any authentication attributes, then just return back a 401.
@@ -126,7 +132,7 @@ HRESULT CLongTermAuth::DoAuthCheck(AuthAttributes* pAuthAttributes, AuthResponse
     }
     
     // validate the nonce
-    if (FAILED(ValidateNonce(pAuthAttributes->szNonce)))
+    if (FAILED(_nonces.ValidateNonce(pAuthAttributes->szNonce)))
     {
         pResponse->responseType = StaleNonce;
         return S_OK;
@@ -136,94 +142,6 @@ HRESULT CLongTermAuth::DoAuthCheck(AuthAttributes* pAuthAttributes, AuthResponse
     // message integrity attribute can be validated with the value placed into pResponse->szPassword
     pResponse->responseType = AllowConditional;
     
-    return S_OK;
+Cleanup:
+    return hr;
 }
-
-
-
-
-void CLongTermAuth::HmacToString(uint8_t* hmacresult, char* pszResult)
-{
-    sprintf(pszResult, "%.2x%.2x%.2x%.2x%.2x%.2x%.2x%.2x%.2x%.2x%.2x%.2x%.2x%.2x%.2x%.2x%.2x%.2x%.2x%.2x", 
-    hmacresult[0], hmacresult[1], hmacresult[2], hmacresult[3], hmacresult[4], 
-    hmacresult[5], hmacresult[6], hmacresult[7], hmacresult[8], hmacresult[9], 
-    hmacresult[10], hmacresult[11], hmacresult[12], hmacresult[13], hmacresult[14], 
-    hmacresult[15], hmacresult[16], hmacresult[17], hmacresult[18], hmacresult[19]);
-}
-
-HRESULT CLongTermAuth::CreateNonce(char *pszNonce)
-{
-    // This is a sample "nonce provider".  Our implementation of "nonce" is just a a string
-    // indicating a timestamp followed by an HMAC hash of the timestamp.
-    // Validation of a nonce is to just to make sure the timestamp isn't more than a couple
-    // of minutes old and that the hmac hash matches
-    
-    // If you use this code, make sure you change the value of c_szPrivateKey!
-    
-    time_t thetime = time(NULL);
-    uint8_t hmacresult[20] = {};
-    char szHMAC[20*2+1];
-    char szTime[sizeof(time_t)*4];
-    unsigned int len = ARRAYSIZE(hmacresult);
-    
-    sprintf(szTime, "%u:", (unsigned int)thetime);
-    
-    HMAC(::EVP_sha1(), (unsigned char*)c_szPrivateKey, strlen(c_szPrivateKey), (unsigned char*)szTime, strlen(szTime), hmacresult, &len);
-    
-    HmacToString(hmacresult, szHMAC);
-
-    strcpy(pszNonce, szTime);
-    strcat(pszNonce, szHMAC);
-
-    return S_OK;
-}
-
-HRESULT CLongTermAuth::ValidateNonce(char* pszNonce)
-{
-    time_t thecurrenttime = time(NULL);
-    time_t thetime;
-    uint8_t hmacresult[20] = {};
-    char szHMAC[20*2+1];
-    char szNonce[100];
-    char *pRightHalf = NULL;
-    time_t diff;
-    unsigned int len = ARRAYSIZE(hmacresult);
-    
-    strncpy(szNonce, pszNonce, ARRAYSIZE(szNonce));
-    szNonce[ARRAYSIZE(szNonce)-1] = 0;
-    
-    pRightHalf = strstr(szNonce, ":");
-    
-    if (pRightHalf == NULL)
-    {
-        return E_FAIL;
-    }
-    
-    *pRightHalf++ = 0;
-
-    thetime = atoi(szNonce);
-    
-    diff = thecurrenttime - thetime;
-    if (((thecurrenttime - thetime) > 120) || (diff < 0))
-    {
-        // nonce is more than 2 minutes old - reject
-        return E_FAIL;
-    }
-    
-    // nonce timestamp is valid, but was it signed by this server?
-    HMAC(::EVP_sha1(), (unsigned char*)c_szPrivateKey, strlen(c_szPrivateKey), (unsigned char*)szNonce, strlen(szNonce), hmacresult, &len);
-    HmacToString(hmacresult, szHMAC);
-    if (strcmp(szHMAC, pRightHalf))
-    {
-        return E_FAIL;
-    }
-    
-    return S_OK;
-}
-
-
-
-
-
-
-
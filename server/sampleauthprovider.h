@@ -74,6 +74,11 @@ The implementation of DoAuthCheck needs to decide how to handle the AuthAttribut
 and then pass back a series of results and codes through the provided AuthResponse
 paramter.
 
+The server reuses both structs from one request to the next, and doesn't clear them
+in full.  The string fields are only guaranteed to be NUL-terminated - the bytes after
+the terminator may be left over from an earlier request, so don't compare or copy
+more than strlen of them.
+
 The AuthResponse parameter is for indicating to the server how to authenticate a
 message integrity attribute.  The implementation needs to set the following fieds 
 as appropriate:
@@ -118,6 +123,22 @@ as appropriate:
     szNonce
        A new nonce for subsequent requests in the event this request can not
  
+    credentialGeneration
+       Optional (the server sets it to 0 before each call to DoAuthCheck).  Each server
+       thread caches the long term key it derives for a username and realm.  A cached
+       key is only used again for the same password, but a provider that wants
+       every cached key discarded (for example, after reloading its user database)
+       can hand back a new credentialGeneration value.
+
+    A provider that changes credentialGeneration should also override
+
+  uint32_t GetCredentialGeneration();
+
+    to return the value DoAuthCheck would hand back right now.  With --iceresponder, a server
+    thread answers checks from a ufrag it has seen with the key it cached, without calling
+    DoAuthCheck, for as long as GetCredentialGeneration stays the same.  It's called for every
+    such check, so it should be no more than reading a variable.  The default returns 0.
+
 
     DoAuthCheck should return S_OK unless a fatal error occurs.  If DoAuthCheck returns
     a failure code, then 
@@ -148,11 +169,11 @@ class CLongTermAuth :
     public IStunAuth
 {
 private:
-    void HmacToString(uint8_t* hmacvalue, char* pszResult);
-    HRESULT CreateNonce(char* pszNonce);
-    HRESULT ValidateNonce(char* pszNonce);
+    CStunNonceGenerator _nonces;
     
 public:
+    // CreateInstance calls this - it sets up the keys nonces get signed with
+    HRESULT Initialize();
     
     virtual HRESULT DoAuthCheck(AuthAttributes* pAuthAttributes, AuthResponse* pResponse);
     ADDREF_AND_RELEASE_IMPL();
@@ -30,18 +30,53 @@ fHasPA(false),
 fHasAP(false),
 fHasAA(false),
 fMultiThreadedMode(false),
+nPipelineWorkers(0), // zero means disabled
+nResponseCacheSize(0), // zero means disabled
+nResponseCacheSeconds(0), // zero means default
+nIceCacheSize(0), // zero means disabled
 fTCP(false),
+fTLS(false),
 nMaxConnections(0), // zero means default
+nTcpFastOpenQueueLength(0), // zero means disabled
+nDeferAcceptSeconds(0), // zero means disabled
+fTcpOrderlyClose(false),
+nTcpCloseWaitSeconds(0), // zero means default
+fIoUring(false),
 fEnableDosProtection(false),
-fReuseAddr(false)
+fReuseAddr(false),
+nAuthDelayMilliseconds(0) // zero means disabled
 {
     ;
 }
 
 
 
+HRESULT InitDelayedAuth(const CStunServerConfig& config, CRefCountedPtr<IStunAuth>* pspAuth, CRefCountedPtr<IStunAsyncAuth>* pspAsyncAuth)
+{
+    HRESULT hr = S_OK;
+    CRefCountedPtr<CStunDelayedAuth> spDelayed;
+    
+    if (config.nAuthDelayMilliseconds == 0)
+    {
+        return S_OK;
+    }
+    
+    Chk(CStunDelayedAuth::CreateInstance(pspAuth->GetPointer(), config.nAuthDelayMilliseconds, spDelayed.GetPointerPointer()));
+    
+    Logging::LogMsg(LL_DEBUG, "Auth checks are delayed by %u milliseconds", config.nAuthDelayMilliseconds);
+    
+    *pspAuth = spDelayed.GetPointer();
+    *pspAsyncAuth = spDelayed.GetPointer();
+    
+Cleanup:
+    return hr;
+}
+
+
+
 CStunServer::CStunServer() :
-_arrSockets() // zero-init
+_arrSockets(), // zero-init
+_pPipeline(NULL)
 {
     ;
 }
@@ -97,16 +132,29 @@ HRESULT CStunServer::Initialize(const CStunServerConfig& config)
 {
     HRESULT hr = S_OK;
     int socketcount = 0;
-    CRefCountedPtr<IStunAuth> _spAuth;
     TransportAddressSet tsa = {};
     boost::shared_ptr<RateLimiter> spLimiter;
+    uint32_t responseCacheTTL = (config.nResponseCacheSeconds > 0) ? (config.nResponseCacheSeconds * 1000) : CStunResponseCache::c_defaultTTL;
 
     // cleanup any thing that's going on now
     Shutdown();
     
     // optional code: create an authentication provider and initialize it here (if you want authentication)
     // set the _spAuth member to reference it
-    // Chk(CYourAuthProvider::CreateInstanceNoInit(&_spAuth));
+    // Chk(CYourAuthProvider::CreateInstance(&_spAuth));
+    if (config.strCredentialsFile.length() > 0)
+    {
+        hr = CStunCredentialAuth::CreateInstance(config.strCredentialsFile.c_str(), _spCredentials.GetPointerPointer());
+        if (FAILED(hr))
+        {
+            Logging::LogMsg(LL_ALWAYS, "Unable to load credentials file %s", config.strCredentialsFile.c_str());
+            Chk(hr);
+        }
+        Logging::LogMsg(LL_DEBUG, "Loaded %u users from %s", _spCredentials->GetCount(), config.strCredentialsFile.c_str());
+        _spAuth = _spCredentials.GetPointer();
+    }
+    
+    Chk(InitDelayedAuth(config, &_spAuth, &_spAsyncAuth));
     
     // Create the sockets and initialize the TSA thing
     if (config.fHasPP)
@@ -139,10 +187,19 @@ HRESULT CStunServer::Initialize(const CStunServerConfig& config)
     {
         Logging::LogMsg(LL_DEBUG, "Creating rate limiter for ddos protection\n");
         // hard coding to 25000 ip addresses
-        spLimiter = boost::shared_ptr<RateLimiter>(new RateLimiter(25000, config.fMultiThreadedMode));
+        spLimiter = boost::shared_ptr<RateLimiter>(new RateLimiter(25000, config.fMultiThreadedMode || (config.nPipelineWorkers > 0)));
     }
 
-    if (config.fMultiThreadedMode == false)
+    if (config.nPipelineWorkers > 0)
+    {
+        Logging::LogMsg(LL_DEBUG, "Configuring pipeline mode with %d workers\n", config.nPipelineWorkers);
+
+        _pPipeline = new CStunPipeline();
+        ChkIf(_pPipeline==NULL, E_OUTOFMEMORY);
+
+        Chk(_pPipeline->Init(_arrSockets, &tsa, _spAuth, config.nPipelineWorkers, spLimiter, config.nResponseCacheSize, responseCacheTTL, config.nIceCacheSize));
+    }
+    else if (config.fMultiThreadedMode == false)
     {
         Logging::LogMsg(LL_DEBUG, "Configuring single threaded mode\n");
         
@@ -152,7 +209,7 @@ HRESULT CStunServer::Initialize(const CStunServerConfig& config)
 
         _threads.push_back(pThread);
         
-        Chk(pThread->Init(_arrSockets, &tsa, _spAuth, (SocketRole)-1, spLimiter));
+        Chk(pThread->Init(_arrSockets, &tsa, _spAuth, _spAsyncAuth, (SocketRole)-1, spLimiter, config.nResponseCacheSize, responseCacheTTL, config.nIceCacheSize));
     }
     else
     {
@@ -169,7 +226,7 @@ HRESULT CStunServer::Initialize(const CStunServerConfig& config)
                 pThread = new CStunSocketThread();
                 ChkIf(pThread==NULL, E_OUTOFMEMORY);
                 _threads.push_back(pThread);
-                Chk(pThread->Init(_arrSockets, &tsa, _spAuth, rolePrimaryRecv, spLimiter));
+                Chk(pThread->Init(_arrSockets, &tsa, _spAuth, _spAsyncAuth, rolePrimaryRecv, spLimiter, config.nResponseCacheSize, responseCacheTTL, config.nIceCacheSize));
             }
         }
     }
@@ -207,8 +264,13 @@ HRESULT CStunServer::Shutdown()
         _threads[index] = NULL;
     }
     _threads.clear();
+
+    delete _pPipeline;
+    _pPipeline = NULL;
     
     _spAuth.ReleaseAndClear();
+    _spCredentials.ReleaseAndClear();
+    _spAsyncAuth.ReleaseAndClear();
     
     return S_OK;
 }
@@ -220,7 +282,12 @@ HRESULT CStunServer::Start()
     HRESULT hr = S_OK;
     size_t len = _threads.size();
 
-    ChkIfA(len == 0, E_UNEXPECTED);
+    ChkIfA((len == 0) && (_pPipeline == NULL), E_UNEXPECTED);
+
+    if (_pPipeline != NULL)
+    {
+        ChkA(_pPipeline->Start());
+    }
 
     for (size_t index = 0; index < len; index++)
     {
@@ -280,10 +347,35 @@ HRESULT CStunServer::Stop()
         }
     }
 
+    if (_pPipeline != NULL)
+    {
+        _pPipeline->Stop();
+    }
+
 
     return S_OK;
 }
 
 
+HRESULT CStunServer::ReloadCredentials()
+{
+    HRESULT hr = S_OK;
+
+    if (_spCredentials == NULL)
+    {
+        return S_FALSE;
+    }
 
+    // the threads keep answering requests with the old users until the new ones are swapped in
+    hr = _spCredentials->Reload();
+    if (FAILED(hr))
+    {
+        Logging::LogMsg(LL_ALWAYS, "Unable to reload the credentials file - keeping the users already loaded");
+    }
+    else
+    {
+        Logging::LogMsg(LL_DEBUG, "Reloaded credentials file with %u users", _spCredentials->GetCount());
+    }
 
+    return hr;
+}
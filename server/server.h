@@ -20,7 +20,9 @@
 
 #include "stunsocket.h"
 #include "stunsocketthread.h"
+#include "stunpipeline.h"
 #include "stunauth.h"
+#include "credentialstore.h"
 #include "messagehandler.h"
 
 
@@ -36,9 +38,21 @@ public:
     bool fHasAA; // AA: Alternate ip, Alternate port
 
     bool fMultiThreadedMode;  // if true, one thread for each socket
+    uint32_t nPipelineWorkers; // UDP only: if non-zero, a receiver thread per socket hands requests to this many worker threads
+    uint32_t nResponseCacheSize; // UDP only: if non-zero, each thread keeps this many recent responses to answer retransmitted requests with
+    uint32_t nResponseCacheSeconds; // UDP only: how long a cached response is good for (zero means default)
+    uint32_t nIceCacheSize; // UDP only: if non-zero, ICE connectivity checks are answered by a CStunIceResponder that keeps the keys for this many ufrags per thread
     
     bool fTCP; // if true, then use TCP instead of UDP
+    bool fTLS; // if true, then TLS over TCP (fTCP is also true)
+    std::string strTlsCertificateFile; // PEM certificate (chain) file - TLS only
+    std::string strTlsPrivateKeyFile;  // PEM private key file - TLS only
     uint32_t nMaxConnections; // only valid for TCP (on a per-thread basis)
+    uint32_t nTcpFastOpenQueueLength; // TCP only: if non-zero, TCP_FASTOPEN is enabled on the listen sockets with this queue length
+    uint32_t nDeferAcceptSeconds; // TCP only: if non-zero, TCP_DEFER_ACCEPT is enabled on the listen sockets
+    bool fTcpOrderlyClose; // TCP only: if true, connections the server closes on its own get a FIN instead of a reset
+    uint32_t nTcpCloseWaitSeconds; // TCP only: how long a connection is held open after its last response waiting for the client to close (zero means default)
+    bool fIoUring; // TCP only: service connections with io_uring where the kernel supports it
 
     CSocketAddress addrPP; // address for PP
     CSocketAddress addrPA; // address for PA
@@ -52,9 +66,16 @@ public:
 
     bool fReuseAddr; // if true, the socket option SO_REUSEADDR will be set
 
+    std::string strCredentialsFile; // if not empty, requests are authenticated with the users in this file (CStunCredentialAuth)
+    uint32_t nAuthDelayMilliseconds; // for testing: if non-zero, every auth check is answered this late and asynchronously (CStunDelayedAuth)
+
     CStunServerConfig();
 };
 
+// with config.nAuthDelayMilliseconds set, wraps *pspAuth (which may be empty) in a CStunDelayedAuth.
+// That becomes *pspAuth, and *pspAsyncAuth too.  Shared by the UDP and TCP servers
+HRESULT InitDelayedAuth(const CStunServerConfig& config, CRefCountedPtr<IStunAuth>* pspAuth, CRefCountedPtr<IStunAsyncAuth>* pspAsyncAuth);
+
 
 class CStunServer :
 public CBasicRefCount,
@@ -65,6 +86,7 @@ private:
     CStunSocket _arrSockets[4];
 
     std::vector<CStunSocketThread*> _threads;
+    CStunPipeline* _pPipeline; // instead of _threads in pipeline mode
 
     CStunServer();
     ~CStunServer();
@@ -72,6 +94,8 @@ private:
     friend class CObjectFactory<CStunServer>;
 
     CRefCountedPtr<IStunAuth> _spAuth;
+    CRefCountedPtr<CStunCredentialAuth> _spCredentials; // same object as _spAuth when there's a credentials file
+    CRefCountedPtr<IStunAsyncAuth> _spAsyncAuth; // same object as _spAuth when it can answer asynchronously
     
     HRESULT AddSocket(TransportAddressSet* pTSA, SocketRole role, const CSocketAddress& addrListen, const CSocketAddress& addrAdvertise, bool fSetReuseFlag);
     
@@ -83,6 +107,9 @@ public:
     HRESULT Start();
     HRESULT Stop();
 
+    // maps the credentials file again (SIGHUP).  S_FALSE if there isn't one
+    HRESULT ReloadCredentials();
+
     ADDREF_AND_RELEASE_IMPL();
 };
 
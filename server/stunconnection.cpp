@@ -2,8 +2,14 @@
 #include "stuncore.h"
 #include "stunconnection.h"
 
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
 CConnectionPool::CConnectionPool() :
-_freelist(NULL)
+_freelist(NULL),
+_countFree(0),
+_minFreeSinceTrim(0)
 {
     
 }
@@ -22,6 +28,8 @@ void CConnectionPool::Reset()
         _freelist = _freelist->pNext;
         delete pConn;
     }
+    _countFree = 0;
+    _minFreeSinceTrim = 0;
 }
 
 HRESULT CConnectionPool::Grow()
@@ -38,17 +46,11 @@ HRESULT CConnectionPool::Grow()
             return E_OUTOFMEMORY;
         }
         
-        pConn->_spOutputBuffer = CRefCountedBuffer(new CBuffer(MAX_STUN_MESSAGE_SIZE));
-        pConn->_spReaderBuffer = CRefCountedBuffer(new CBuffer(MAX_STUN_MESSAGE_SIZE));
-        
-        if ((pConn->_spOutputBuffer == NULL) || (pConn->_spReaderBuffer == NULL))
-        {
-            delete pConn;
-            return E_OUTOFMEMORY;
-        }
+        pConn->_pBufferBlock = NULL;
         
         pConn->pNext = _freelist;
         _freelist = pConn;
+        _countFree++;
     }
     
     return S_OK;
@@ -70,16 +72,28 @@ StunConnection* CConnectionPool::GetConnection(int sock, SocketRole role)
     pConn = _freelist;
     _freelist = pConn->pNext;
     pConn->pNext = NULL;
+    _countFree--;
+    
+    if (_countFree < _minFreeSinceTrim)
+    {
+        _minFreeSinceTrim = _countFree;
+    }
     
     // prep this connection for usage
-    pConn->_reader.Reset();
-    pConn->_reader.GetStream().Attach(pConn->_spReaderBuffer, true);
-    pConn->_state = ConnectionState_Receiving;
+    ASSERT(pConn->_pBufferBlock == NULL);
+    pConn->_bufferIn.Detach();
+    pConn->_bufferOut.Detach();
+    pConn->_carryoverSize = 0;
+    pConn->_state = ConnectionState_Idle;
     pConn->_stunsocket.Attach(sock);
     pConn->_stunsocket.SetRole(role);
-    pConn->_txCount = 0;
-    pConn->_timeStart = time(NULL);
-    pConn->_idHashTable = -1;    
+    pConn->_eventset = 0;
+    pConn->_fPeerClosed = false;
+    pConn->_fHasResponded = false;
+    pConn->_fAuthPending = false;
+    pConn->_uringPending = 0;
+    pConn->_fClosing = false;
+    CTimerWheel::InitNode(&pConn->_timer, pConn);
     
     return pConn;
 }
@@ -87,16 +101,174 @@ StunConnection* CConnectionPool::GetConnection(int sock, SocketRole role)
 void CConnectionPool::ReleaseConnection(StunConnection* pConn)
 {
     ASSERT(pConn->_stunsocket.IsValid() == false); // not the pool's job to close a socket!
+    ASSERT(CTimerWheel::IsScheduled(&pConn->_timer) == false);
+    ASSERT(pConn->_pBufferBlock == NULL); // the buffer pool should have gotten these back
+    ASSERT(pConn->_tls.IsAttached() == false);
+    ASSERT(pConn->_uringPending == 0); // an io_uring request in flight still refers to it
     
     pConn->pNext = _freelist;
     _freelist = pConn;
+    _countFree++;
+}
+
+size_t CConnectionPool::Trim()
+{
+    size_t count = 0;
+    
+    // anything that sat on the free list for the entire interval wasn't needed
+    while ((count < _minFreeSinceTrim) && _freelist)
+    {
+        StunConnection* pConn = _freelist;
+        _freelist = pConn->pNext;
+        delete pConn;
+        count++;
+    }
+    
+    _countFree -= count;
+    _minFreeSinceTrim = _countFree;
+    
+    return count;
+}
+
+size_t CConnectionPool::GetFreeCount()
+{
+    return _countFree;
+}
+
+
+// ------------------------------------------------------------------
+
+CConnectionBufferPool::CConnectionBufferPool() :
+_minFreeSinceTrim(0)
+{
+    
+}
+
+CConnectionBufferPool::~CConnectionBufferPool()
+{
+    Reset();
+}
+
+void CConnectionBufferPool::Reset()
+{
+    for (size_t index = 0; index < _freelist.size(); index++)
+    {
+        delete [] _freelist[index];
+    }
+    _freelist.clear();
+    _minFreeSinceTrim = 0;
+}
+
+HRESULT CConnectionBufferPool::AttachBuffers(StunConnection* pConn)
+{
+    HRESULT hr = S_OK;
+    uint8_t* pBlock = NULL;
+    
+    if (pConn->_pBufferBlock != NULL)
+    {
+        return S_OK;
+    }
+    
+    if (_freelist.empty())
+    {
+        pBlock = new uint8_t[c_blockSize];
+        ChkIf(pBlock == NULL, E_OUTOFMEMORY);
+    }
+    else
+    {
+        pBlock = _freelist.back();
+        _freelist.pop_back();
+        
+        if (_freelist.size() < _minFreeSinceTrim)
+        {
+            _minFreeSinceTrim = _freelist.size();
+        }
+    }
+    
+    pConn->_pBufferBlock = pBlock;
+    pConn->_bufferIn.Attach(pBlock, CONNECTION_INPUT_BUFFER_SIZE);
+    pConn->_bufferOut.Attach(pBlock + CONNECTION_INPUT_BUFFER_SIZE, CONNECTION_OUTPUT_BUFFER_SIZE);
+    
+    // restore the start of the partial request
+    if (pConn->_carryoverSize > 0)
+    {
+        ChkA(pConn->_bufferIn.Write(pConn->_carryover, pConn->_carryoverSize));
+        pConn->_carryoverSize = 0;
+    }
+    
+Cleanup:
+    return hr;
 }
 
-void CConnectionPool::ResetConnection(StunConnection* pConn)
+bool CConnectionBufferPool::DetachBuffersIfIdle(StunConnection* pConn)
 {
-    pConn->_reader.Reset();
-    pConn->_reader.GetStream().Attach(pConn->_spReaderBuffer, true);
-    pConn->_state = ConnectionState_Receiving;
-    pConn->_txCount = 0;
+    size_t leftover;
+    
+    if (pConn->_pBufferBlock == NULL)
+    {
+        return true;
+    }
+    
+    leftover = pConn->_bufferIn.GetSize();
+    
+    if ((pConn->_bufferOut.IsEmpty() == false) || (leftover > CONNECTION_CARRYOVER_SIZE))
+    {
+        // still in the middle of something
+        return false;
+    }
+    
+    if (leftover > 0)
+    {
+        VERIFY(SUCCEEDED(pConn->_bufferIn.Peek(pConn->_carryover, leftover)));
+    }
+    pConn->_carryoverSize = leftover;
+    
+    ReleaseBuffers(pConn);
+    
+    return true;
+}
+
+void CConnectionBufferPool::ReleaseBuffers(StunConnection* pConn)
+{
+    if (pConn->_pBufferBlock != NULL)
+    {
+        _freelist.push_back(pConn->_pBufferBlock);
+        pConn->_pBufferBlock = NULL;
+        pConn->_bufferIn.Detach();
+        pConn->_bufferOut.Detach();
+    }
 }
 
+size_t CConnectionBufferPool::Trim()
+{
+    size_t count = _minFreeSinceTrim;
+    
+    ASSERT(count <= _freelist.size());
+    
+    // anything that sat on the free list for the entire interval wasn't needed
+    for (size_t index = 0; index < count; index++)
+    {
+        delete [] _freelist[index];
+    }
+    _freelist.erase(_freelist.begin(), _freelist.begin() + count);
+    
+    if (count > 0)
+    {
+        // shrink the free list's own storage too
+        std::vector<uint8_t*>(_freelist).swap(_freelist);
+        
+#ifdef __GLIBC__
+        // small blocks go back to the heap, not the OS, unless we ask
+        malloc_trim(0);
+#endif
+    }
+    
+    _minFreeSinceTrim = _freelist.size();
+    
+    return count;
+}
+
+size_t CConnectionBufferPool::GetFreeCount()
+{
+    return _freelist.size();
+}
@@ -3,26 +3,74 @@
 
 #include "stuncore.h"
 #include "stunsocket.h"
+#include "timerwheel.h"
+#include "tlssession.h"
 
 
+// Idle:         nothing buffered in either direction
+// Receiving:    a partial request is sitting in the input buffer
+// Transmitting: responses are queued up waiting for the socket to drain
+// Handshaking:  TLS mode only - the TLS handshake hasn't completed yet
 enum StunConnectionState
 {
     ConnectionState_Idle,
     ConnectionState_Receiving,
-    ConnectionState_Transmitting
+    ConnectionState_Transmitting,
+    ConnectionState_Handshaking
 };
 
+// Why a connection got closed.  Counted per thread.
+enum ConnectionCloseReason
+{
+    CloseReason_PeerClosed,        // the client closed (or half-closed) its end first
+    CloseReason_IdleTimeout,       // connected, but never started sending a request
+    CloseReason_CloseWait,         // the client neither sent another request nor closed within --closewait of its last response
+    CloseReason_ReadTimeout,       // a request started arriving but never finished
+    CloseReason_WriteTimeout,      // the client stopped reading its responses
+    CloseReason_HandshakeTimeout,  // TLS handshake didn't complete in time
+    CloseReason_ProtocolError,     // malformed or oversized request, or a failed TLS handshake
+    CloseReason_RateLimited,       // blocked by denial of service protection
+    CloseReason_Rejected,          // no room for another connection
+    CloseReason_ConnectionError,   // socket error, typically a reset from the client
+    CloseReason_Shutdown,          // server is exiting
+    CloseReason_Count
+};
+
+// a client can pipeline several requests into one segment, so the input
+// buffer holds a few messages worth.  The output buffer has to have room for at
+// least one full response before the next request gets processed
+const size_t CONNECTION_INPUT_BUFFER_SIZE = 2048;
+const size_t CONNECTION_OUTPUT_BUFFER_SIZE = 2048;
+
+// An idle connection doesn't hold on to the buffers above.  If it goes idle
+// with the start of the next request already received, those few bytes get
+// parked in the connection itself until the rest arrives.
+const size_t CONNECTION_CARRYOVER_SIZE = STUN_HEADER_SIZE;
+
+// io_uring requests a connection can have in flight - at most one of each
+const uint8_t CONNECTION_URING_RECEIVE = 0x01 << 0;
+const uint8_t CONNECTION_URING_SEND    = 0x01 << 1;
+
 
 struct StunConnection
 {
-    time_t _timeStart;
     StunConnectionState _state;
     CStunSocket _stunsocket;
-    CStunMessageReader _reader;
-    CRefCountedBuffer _spReaderBuffer;
-    CRefCountedBuffer _spOutputBuffer;  // contains the response
-    size_t _txCount;     // number of bytes of response transmitted thus far
-    int _idHashTable; // hints at which hash table the connection got inserted into
+    CTlsSession _tls;             // only attached when the server is running in TLS mode
+    uint8_t* _pBufferBlock;       // backing memory for both ring buffers - borrowed from the thread's CConnectionBufferPool, NULL when idle
+    CRingBuffer _bufferIn;        // bytes received, but not parsed yet
+    CRingBuffer _bufferOut;       // responses waiting to be sent
+    uint8_t _carryover[CONNECTION_CARRYOVER_SIZE]; // a partial request waiting for its buffers to be reattached
+    size_t _carryoverSize;
+    uint32_t _eventset;           // what we're currently registered for with the IPolling instance
+    bool _fPeerClosed;            // the client has shut down its end - finish sending responses, then close
+    bool _fHasResponded;          // at least one response has been sent on this connection
+    bool _fAuthPending;           // a request is waiting on an asynchronous auth check - the ones behind it wait too
+    uint8_t _uringPending;        // CONNECTION_URING_ requests in flight (io_uring mode only)
+    bool _fClosing;               // closed, but can't go back to the pool until its in-flight io_uring requests complete
+    msghdr _sendMsg;              // describes the in-flight io_uring send (points into _bufferOut via _sendRegions)
+    iovec _sendRegions[2];
+    TimerWheelNode _timer; // the idle, read, or write deadline for this connection (whichever applies to the current state)
     StunConnection* pNext; // next item in pool - meaningless outside of the pool
 };
 
@@ -33,6 +81,8 @@ class CConnectionPool
 private:
 
     StunConnection* _freelist;
+    size_t _countFree;
+    size_t _minFreeSinceTrim; // low water mark of the free list since the last call to Trim
     
     HRESULT Grow();
     
@@ -44,15 +94,53 @@ public:
     StunConnection* GetConnection(int sock, SocketRole role);
     void ReleaseConnection(StunConnection* pConn);
     
-    // ResetConnection resets streams to handle a subsequent incoming packet
-    // It's a lighter version of calling ReleaseConnection followed by GetConnection
-    void ResetConnection(StunConnection* pConn);
+    // frees whatever part of the free list went unused since the last call to Trim
+    size_t Trim();
+    size_t GetFreeCount();
     
     void Reset();
     
 };
 
 
+// CConnectionBufferPool lends the ring buffer memory out to connections only while
+// they have a request (or response) in flight, so a large number of idle
+// connections don't pin down a large amount of memory
+class CConnectionBufferPool
+{
+private:
+    
+    std::vector<uint8_t*> _freelist;
+    size_t _minFreeSinceTrim; // low water mark of the free list since the last call to Trim
+    
+    // disallow copy and assignment.
+    CConnectionBufferPool(const CConnectionBufferPool&);
+    void operator=(const CConnectionBufferPool&);
+    
+public:
+    static const size_t c_blockSize = CONNECTION_INPUT_BUFFER_SIZE + CONNECTION_OUTPUT_BUFFER_SIZE;
+    
+    CConnectionBufferPool();
+    ~CConnectionBufferPool();
+    
+    // no-op if the connection already has its buffers
+    HRESULT AttachBuffers(StunConnection* pConn);
+    
+    // gives the buffers back if nothing is pending other than (at most) a partial request
+    // header, which is moved to the connection's carryover area. Returns true if detached.
+    bool DetachBuffersIfIdle(StunConnection* pConn);
+    
+    // unconditionally gives the buffers back - any buffered data is discarded
+    void ReleaseBuffers(StunConnection* pConn);
+    
+    // frees whatever part of the free list went unused since the last call to Trim
+    size_t Trim();
+    size_t GetFreeCount();
+    
+    void Reset();
+};
+
+
 
 
 
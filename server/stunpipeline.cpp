@@ -0,0 +1,762 @@
+/*
+   Copyright 2011 John Selbie
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+
+#include "commonincludes.hpp"
+#include "stuncore.h"
+#include "stunsocket.h"
+#include "stunpipeline.h"
+#include "recvfromex.h"
+#include "ratelimiter.h"
+#include "oshelper.h"
+
+
+CStunPipelineWorker::CStunPipelineWorker() :
+_arrSendSockets(NULL),
+_tsa(), // zero-init
+_cacheReportTime(0),
+_cacheLookupsReported(0),
+_rotation(0),
+_pthread((pthread_t)-1),
+_fThreadIsValid(false),
+_fNeedToExit(false),
+_fSleeping(false),
+_results() // zero-init
+{
+    pthread_mutex_init(&_mutex, NULL);
+    pthread_cond_init(&_cond, NULL);
+}
+
+CStunPipelineWorker::~CStunPipelineWorker()
+{
+    SignalForStop();
+    WaitForStop();
+    ReleaseQueues();
+
+    pthread_cond_destroy(&_cond);
+    pthread_mutex_destroy(&_mutex);
+}
+
+void CStunPipelineWorker::ReleaseQueues()
+{
+    for (size_t index = 0; index < _queues.size(); index++)
+    {
+        delete _queues[index];
+    }
+    _queues.clear();
+}
+
+HRESULT CStunPipelineWorker::Init(CStunSocket* arrayOfFourSockets, TransportAddressSet* pTSA, IStunAuth* pAuth, size_t queueCount, size_t responseCacheSize, uint32_t responseCacheTTL, size_t iceCacheSize)
+{
+    HRESULT hr = S_OK;
+
+    ChkIfA(_fThreadIsValid, E_UNEXPECTED);
+    ChkIfA(arrayOfFourSockets == NULL, E_INVALIDARG);
+    ChkIfA(pTSA == NULL, E_INVALIDARG);
+    ChkIfA(queueCount == 0, E_INVALIDARG);
+
+    _arrSendSockets = arrayOfFourSockets;
+
+    _tsa = *pTSA;
+    ChkA(CStunRequestHandler::PrecomputeAttributes(&_tsa));
+
+    ReleaseQueues();
+    for (size_t index = 0; index < queueCount; index++)
+    {
+        CStunPacketQueue* pQueue = new CStunPacketQueue();
+        ChkIf(pQueue == NULL, E_OUTOFMEMORY);
+        _queues.push_back(pQueue);
+        ChkA(pQueue->Init(CStunPipeline::c_queueDepth));
+    }
+    _rotation = 0;
+
+    for (size_t index = 0; index < c_batchSize; index++)
+    {
+        _spBufferReaders[index] = CRefCountedBuffer(new CBuffer(MAX_STUN_MESSAGE_SIZE));
+        _spBufferOut[index] = CRefCountedBuffer(new CBuffer(MAX_STUN_MESSAGE_SIZE));
+
+        _readers[index].Reset();
+        _readers[index].GetStream().Attach(_spBufferReaders[index], true);
+
+        _msgIn[index].fConnectionOriented = false;
+        _msgIn[index].pReader = &_readers[index];
+        _msgOut[index].spBufferOut = _spBufferOut[index];
+    }
+
+    _spAuth = pAuth; // a reference of its own, the server keeps the one it has
+    if (pAuth)
+    {
+        ChkA(_keycache.Init(CStunKeyCache::c_defaultSize));
+    }
+
+    _responsecache.Reset();
+    if (responseCacheSize > 0)
+    {
+        ChkA(_responsecache.Init(responseCacheSize, responseCacheTTL));
+    }
+    _cacheReportTime = GetMillisecondCounter();
+    _cacheLookupsReported = 0;
+
+    _iceresponder.Reset();
+    if ((iceCacheSize > 0) && pAuth)
+    {
+        ChkA(_iceresponder.Init(iceCacheSize, CStunIceResponder::c_defaultTTL));
+    }
+
+    _fNeedToExit = false;
+    _fSleeping = false;
+
+Cleanup:
+    return hr;
+}
+
+HRESULT CStunPipelineWorker::Start()
+{
+    HRESULT hr = S_OK;
+    int err = 0;
+
+    ChkIfA(_fThreadIsValid, E_UNEXPECTED);
+    ChkIfA(_queues.size() == 0, E_UNEXPECTED);
+
+    err = ::pthread_create(&_pthread, NULL, CStunPipelineWorker::ThreadFunction, this);
+    ChkIfA(err != 0, ERRNO_TO_HRESULT(err));
+    _fThreadIsValid = true;
+
+Cleanup:
+    return hr;
+}
+
+void CStunPipelineWorker::SignalForStop()
+{
+    pthread_mutex_lock(&_mutex);
+    _fNeedToExit = true;
+    _fSleeping = false;
+    pthread_cond_signal(&_cond);
+    pthread_mutex_unlock(&_mutex);
+}
+
+void CStunPipelineWorker::WaitForStop()
+{
+    void* pRetValFromThread = NULL;
+
+    if (_fThreadIsValid)
+    {
+        pthread_join(_pthread, &pRetValFromThread);
+    }
+
+    _fThreadIsValid = false;
+    _pthread = (pthread_t)-1;
+}
+
+CStunPacketQueue* CStunPipelineWorker::GetQueue(size_t index)
+{
+    ASSERT(index < _queues.size());
+    return (index < _queues.size()) ? _queues[index] : NULL;
+}
+
+void CStunPipelineWorker::Wake()
+{
+    // The packets just pushed have to be visible before _fSleeping is read (a store then a load, so it takes a full fence).
+    // Paired with the fence in WaitForPackets, either the worker sees the packets or this sees the worker asleep
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&_fSleeping, __ATOMIC_RELAXED))
+    {
+        pthread_mutex_lock(&_mutex);
+        _fSleeping = false;
+        pthread_cond_signal(&_cond);
+        pthread_mutex_unlock(&_mutex);
+    }
+}
+
+int CStunPipelineWorker::GetShedCount()
+{
+    int count = 0;
+
+    for (size_t index = 0; index < _queues.size(); index++)
+    {
+        count += _queues[index]->GetShedCount();
+    }
+
+    return count;
+}
+
+// static
+void* CStunPipelineWorker::ThreadFunction(void* pThis)
+{
+    ((CStunPipelineWorker*)pThis)->Run();
+    return NULL;
+}
+
+void CStunPipelineWorker::Run()
+{
+    size_t count = 0;
+
+    Logging::LogMsg(LL_DEBUG, "Starting pipeline worker thread (%d queues)", _queues.size());
+
+    while (_fNeedToExit == false)
+    {
+        count = DequeueRequests();
+
+        if (count > 0)
+        {
+            ProcessRequestsAndSendResponses(count);
+        }
+        else
+        {
+            WaitForPackets();
+        }
+    }
+
+    ReportCacheStats(GetMillisecondCounter(), true);
+
+    Logging::LogMsg(LL_DEBUG, "Pipeline worker thread exiting");
+}
+
+bool CStunPipelineWorker::HasPackets()
+{
+    for (size_t index = 0; index < _queues.size(); index++)
+    {
+        if (_queues[index]->IsEmpty() == false)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+void CStunPipelineWorker::WaitForPackets()
+{
+    __atomic_store_n(&_fSleeping, true, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    // a receiver that pushed just before _fSleeping was set didn't wake anyone - so look one more time
+    if (HasPackets())
+    {
+        __atomic_store_n(&_fSleeping, false, __ATOMIC_RELAXED);
+        return;
+    }
+
+    pthread_mutex_lock(&_mutex);
+    while (_fSleeping && (_fNeedToExit == false))
+    {
+        pthread_cond_wait(&_cond, &_mutex);
+    }
+    _fSleeping = false;
+    pthread_mutex_unlock(&_mutex);
+}
+
+// Takes up to c_batchSize packets off the queues, starting with a different queue each time.  Returns how
+// many valid stun messages are now in _readers/_msgIn
+size_t CStunPipelineWorker::DequeueRequests()
+{
+    size_t count = 0;
+    size_t queueCount = _queues.size();
+
+    _rotation = (_rotation + 1) % queueCount;
+
+    for (size_t index = 0; (index < queueCount) && (count < c_batchSize); index++)
+    {
+        CStunPacketQueue* pQueue = _queues[(index + _rotation) % queueCount];
+
+        while ((count < c_batchSize) && pQueue->Pop(&_packet))
+        {
+            CStunMessageReader& reader = _readers[count];
+            StunMessageIn& msgIn = _msgIn[count];
+
+            if (_responsecache.IsEnabled())
+            {
+                const StunCachedResponse* pCached = _responsecache.Lookup(_packet.addrRemote, _packet.socketrole, _packet.data, _packet.size, GetMillisecondCounter());
+                if (pCached != NULL)
+                {
+                    SendResponse(pCached->socketrole, pCached->addrDest, pCached->data, pCached->size);
+                    continue;
+                }
+            }
+
+            reader.Reset();
+            _spBufferReaders[count]->SetSize(0);
+            reader.GetStream().Attach(_spBufferReaders[count], true);
+
+            reader.AddBytes(_packet.data, _packet.size);
+            if (reader.GetState() == CStunMessageReader::BodyValidated)
+            {
+                msgIn.socketrole = _packet.socketrole;
+                msgIn.addrRemote = _packet.addrRemote;
+                msgIn.addrLocal = _packet.addrLocal;
+
+                // an ICE connectivity check is taken care of right here, the rest go to the request handler as a batch
+                if (_iceresponder.IsEnabled() && AnswerIceCheck(msgIn, _msgOut[count]))
+                {
+                    continue;
+                }
+                count++;
+            }
+        }
+    }
+
+    return count;
+}
+
+void CStunPipelineWorker::ProcessRequestsAndSendResponses(size_t count)
+{
+    uint32_t now = 0;
+
+    _requestcontext.ProcessRequestBatch(_msgIn, _msgOut, _results, count, &_tsa, _spAuth, &_keycache);
+
+    for (size_t index = 0; index < count; index++)
+    {
+        if (SUCCEEDED(_results[index]))
+        {
+            const StunMessageOut& msgOut = _msgOut[index];
+            SendResponse(msgOut.socketrole, msgOut.addrDest, msgOut.spBufferOut->GetData(), msgOut.spBufferOut->GetSize());
+        }
+    }
+
+    if (_responsecache.IsEnabled())
+    {
+        now = GetMillisecondCounter();
+
+        for (size_t index = 0; index < count; index++)
+        {
+            if (SUCCEEDED(_results[index]))
+            {
+                _responsecache.Store(_msgIn[index], _msgOut[index], now);
+            }
+        }
+
+        ReportCacheStats(now, false);
+    }
+}
+
+// same as CStunSocketThread::AnswerIceCheck
+bool CStunPipelineWorker::AnswerIceCheck(const StunMessageIn& msgIn, StunMessageOut& msgOut)
+{
+    uint32_t now = GetMillisecondCounter();
+    HRESULT hr = _iceresponder.ProcessRequest(msgIn, msgOut, _spAuth, now);
+
+    if (hr == S_OK)
+    {
+        SendResponse(msgOut.socketrole, msgOut.addrDest, msgOut.spBufferOut->GetData(), msgOut.spBufferOut->GetSize());
+
+        if (_responsecache.IsEnabled())
+        {
+            _responsecache.Store(msgIn, msgOut, now);
+        }
+    }
+
+    return (hr != S_FALSE);
+}
+
+// same as CStunSocketThread::ReportCacheStats
+void CStunPipelineWorker::ReportCacheStats(uint32_t now, bool fFinal)
+{
+    uint64_t hits = _responsecache.GetHitCount();
+    uint64_t lookups = hits + _responsecache.GetMissCount();
+
+    if ((_responsecache.IsEnabled() == false) || (lookups == _cacheLookupsReported))
+    {
+        return;
+    }
+
+    if ((fFinal == false) && ((now - _cacheReportTime) < c_cacheReportIntervalMilliseconds))
+    {
+        return;
+    }
+
+    Logging::LogMsg(LL_DEBUG, "Pipeline worker response cache: %llu hits in %llu lookups (%d%% hit rate)", (unsigned long long)hits, (unsigned long long)lookups, (int)((hits * 100) / lookups));
+
+    _cacheReportTime = now;
+    _cacheLookupsReported = lookups;
+}
+
+HRESULT CStunPipelineWorker::SendResponse(SocketRole socketrole, const CSocketAddress& addrDest, const uint8_t* pData, size_t size)
+{
+    HRESULT hr = S_OK;
+    int sendret = -1;
+    int sockout = -1;
+    int err = 0;
+
+    // the sockets are shared with the other workers - sendto on a UDP socket is safe from any number of threads
+    ASSERT(_tsa.set[socketrole].fValid);
+    ASSERT(_arrSendSockets[socketrole].IsValid());
+    sockout = _arrSendSockets[socketrole].GetSocketHandle();
+    ASSERT(sockout != -1);
+
+    sendret = ::sendto(sockout, pData, size, 0, addrDest.GetSockAddr(), addrDest.GetSockAddrLength());
+    err = (sendret == -1) ? errno : 0;
+    if (Logging::GetLogLevel() >= LL_VERBOSE)
+    {
+        Logging::LogMsg(LL_VERBOSE, "sendto returns %d (err == %d)\n", sendret, err);
+    }
+
+    return hr;
+}
+
+
+// ---------------------------------------------------------------------------------------------
+
+
+CStunPipelineReceiver::CStunPipelineReceiver() :
+_pSocket(NULL),
+_queueIndex(0),
+_nextWorker(0),
+_fPinTransactions(false),
+_pthread((pthread_t)-1),
+_fThreadIsValid(false),
+_fNeedToExit(false)
+{
+    ;
+}
+
+CStunPipelineReceiver::~CStunPipelineReceiver()
+{
+    SignalForStop(true);
+    WaitForStop();
+}
+
+HRESULT CStunPipelineReceiver::Init(CStunSocket* pSocket, CStunPipelineWorker** arrWorkers, size_t workerCount, size_t queueIndex, bool fPinTransactions, boost::shared_ptr<RateLimiter>& spLimiter)
+{
+    HRESULT hr = S_OK;
+
+    ChkIfA(_fThreadIsValid, E_UNEXPECTED);
+    ChkIfA(pSocket == NULL, E_INVALIDARG);
+    ChkIfA(pSocket->IsValid() == false, E_INVALIDARG);
+    ChkIfA(arrWorkers == NULL, E_INVALIDARG);
+    ChkIfA(workerCount == 0, E_INVALIDARG);
+
+    _pSocket = pSocket;
+    _workers.assign(arrWorkers, arrWorkers + workerCount);
+    _pushed.assign(workerCount, false);
+    _queueIndex = queueIndex;
+    _nextWorker = 0;
+    _fPinTransactions = fPinTransactions;
+
+    for (size_t index = 0; index < c_recvBatchSize; index++)
+    {
+        _messages[index].buf = _packets[index].data;
+        _messages[index].len = sizeof(_packets[index].data);
+    }
+
+    _spLimiter = spLimiter;
+    _fNeedToExit = false;
+
+Cleanup:
+    return hr;
+}
+
+HRESULT CStunPipelineReceiver::Start()
+{
+    HRESULT hr = S_OK;
+    int err = 0;
+
+    ChkIfA(_fThreadIsValid, E_UNEXPECTED);
+    ChkIfA(_pSocket == NULL, E_UNEXPECTED);
+
+    err = ::pthread_create(&_pthread, NULL, CStunPipelineReceiver::ThreadFunction, this);
+    ChkIfA(err != 0, ERRNO_TO_HRESULT(err));
+    _fThreadIsValid = true;
+
+Cleanup:
+    return hr;
+}
+
+void CStunPipelineReceiver::SignalForStop(bool fPostMessages)
+{
+    _fNeedToExit = true;
+
+    // same as CStunSocketThread::SignalForStop - the socket sends a message to itself
+    if (fPostMessages && (_pSocket != NULL) && _fThreadIsValid)
+    {
+        char data = 'x';
+        CSocketAddress addr(_pSocket->GetLocalAddress());
+
+        if (addr.IsIPAddressZero())
+        {
+            CSocketAddress addrLocal;
+            CSocketAddress::GetLocalHost(addr.GetFamily(), &addrLocal);
+            addrLocal.SetPort(addr.GetPort());
+            addr = addrLocal;
+        }
+
+        ::sendto(_pSocket->GetSocketHandle(), &data, 1, 0, addr.GetSockAddr(), addr.GetSockAddrLength());
+    }
+}
+
+void CStunPipelineReceiver::WaitForStop()
+{
+    void* pRetValFromThread = NULL;
+
+    if (_fThreadIsValid)
+    {
+        pthread_join(_pthread, &pRetValFromThread);
+    }
+
+    _fThreadIsValid = false;
+    _pthread = (pthread_t)-1;
+}
+
+// static
+void* CStunPipelineReceiver::ThreadFunction(void* pThis)
+{
+    ((CStunPipelineReceiver*)pThis)->Run();
+    return NULL;
+}
+
+// The cheap checks that don't need a reader - a STUN request is at least a header, has the top two bits
+// clear, and has a length field that's a multiple of 4 and accounts for the rest of the datagram
+bool CStunPipelineReceiver::IsStunRequest(const uint8_t* pData, size_t size)
+{
+    uint16_t msgType = 0;
+    uint16_t msgLength = 0;
+
+    if ((size < STUN_HEADER_SIZE) || (size > MAX_STUN_MESSAGE_SIZE))
+    {
+        return false;
+    }
+
+    memcpy(&msgType, pData, sizeof(msgType));
+    memcpy(&msgLength, pData + 2, sizeof(msgLength));
+    msgType = ntohs(msgType);
+    msgLength = ntohs(msgLength);
+
+    // the class bits (0x0110) are both zero for a request
+    return (((msgType & 0xc000) == 0) && ((msgType & 0x0110) == 0) && ((msgLength % 4) == 0) && ((msgLength + STUN_HEADER_SIZE) == size));
+}
+
+void CStunPipelineReceiver::DispatchPacket(StunPacket& packet)
+{
+    size_t workerCount = _workers.size();
+    size_t index = _nextWorker;
+    uint32_t words[3];
+
+    if (_fPinTransactions)
+    {
+        // the 12 bytes of the transaction ID after the magic cookie, folded down
+        memcpy(words, packet.data + 8, sizeof(words));
+        index = (words[0] ^ words[1] ^ words[2]) % workerCount;
+    }
+    else
+    {
+        _nextWorker = (_nextWorker + 1) % workerCount;
+    }
+
+    // a full queue sheds its oldest packet, so this never blocks on a slow worker
+    _workers[index]->GetQueue(_queueIndex)->Push(packet);
+    _pushed[index] = true;
+}
+
+void CStunPipelineReceiver::Run()
+{
+    int ret = 0;
+    uint16_t localport = _pSocket->GetLocalAddress().GetPort();
+    SocketRole role = _pSocket->GetRole();
+    char szIPRemote[100] = {};
+
+    Logging::LogMsg(LL_DEBUG, "Starting pipeline receiver thread (%d workers)", _workers.size());
+
+    while (_fNeedToExit == false)
+    {
+        ret = ::recvmmsgex(_pSocket->GetSocketHandle(), _messages, c_recvBatchSize, 0);
+
+        if (_fNeedToExit)
+        {
+            break;
+        }
+
+        Logging::LogMsg(LL_VERBOSE, "recvmmsgex returns %d", ret);
+
+        for (int index = 0; index < ret; index++)
+        {
+            StunPacket& packet = _packets[index];
+            const RecvMessageEx& message = _messages[index];
+            bool allowed_to_pass = (_spLimiter.get() != NULL) ? _spLimiter->RateCheck(message.addrSrc) : true;
+
+            if (allowed_to_pass == false)
+            {
+                if (Logging::GetLogLevel() >= LL_VERBOSE)
+                {
+                    message.addrSrc.ToStringBuffer(szIPRemote, ARRAYSIZE(szIPRemote));
+                    Logging::LogMsg(LL_VERBOSE, "RateLimiter signals false for packet from %s", szIPRemote);
+                }
+                continue;
+            }
+
+            if (IsStunRequest(packet.data, message.received) == false)
+            {
+                continue;
+            }
+
+            packet.socketrole = role;
+            packet.addrRemote = message.addrSrc;
+            packet.addrLocal = message.addrDst;
+            packet.addrLocal.SetPort(localport); // recvfromex doesn't set the port on the local address
+            packet.size = message.received;
+
+            DispatchPacket(packet);
+        }
+
+        // one wake up per worker per batch, and only for workers that went to sleep
+        for (size_t index = 0; index < _pushed.size(); index++)
+        {
+            if (_pushed[index])
+            {
+                _pushed[index] = false;
+                _workers[index]->Wake();
+            }
+        }
+    }
+
+    Logging::LogMsg(LL_DEBUG, "Pipeline receiver thread exiting");
+}
+
+
+// ---------------------------------------------------------------------------------------------
+
+
+CStunPipeline::CStunPipeline()
+{
+    ;
+}
+
+CStunPipeline::~CStunPipeline()
+{
+    Stop();
+    Release();
+}
+
+void CStunPipeline::Release()
+{
+    for (size_t index = 0; index < _receivers.size(); index++)
+    {
+        delete _receivers[index];
+    }
+    _receivers.clear();
+
+    for (size_t index = 0; index < _workers.size(); index++)
+    {
+        delete _workers[index];
+    }
+    _workers.clear();
+}
+
+HRESULT CStunPipeline::Init(CStunSocket* arrayOfFourSockets, TransportAddressSet* pTSA, IStunAuth* pAuth, size_t workerCount, boost::shared_ptr<RateLimiter>& spLimiter, size_t responseCacheSize, uint32_t responseCacheTTL, size_t iceCacheSize)
+{
+    HRESULT hr = S_OK;
+    size_t socketCount = 0;
+
+    ChkIfA(arrayOfFourSockets == NULL, E_INVALIDARG);
+    ChkIfA(pTSA == NULL, E_INVALIDARG);
+    ChkIfA((workerCount == 0) || (workerCount > c_maxWorkers), E_INVALIDARG);
+
+    Release();
+
+    for (size_t index = 0; index < 4; index++)
+    {
+        socketCount += arrayOfFourSockets[index].IsValid() ? 1 : 0;
+    }
+    ChkIf(socketCount == 0, E_INVALIDARG);
+
+    // the workers first - each one has a queue for every receiver
+    for (size_t index = 0; index < workerCount; index++)
+    {
+        CStunPipelineWorker* pWorker = new CStunPipelineWorker();
+        ChkIf(pWorker == NULL, E_OUTOFMEMORY);
+        _workers.push_back(pWorker);
+        Chk(pWorker->Init(arrayOfFourSockets, pTSA, pAuth, socketCount, responseCacheSize, responseCacheTTL, iceCacheSize));
+    }
+
+    for (size_t index = 0; index < 4; index++)
+    {
+        if (arrayOfFourSockets[index].IsValid())
+        {
+            CStunPipelineReceiver* pReceiver = new CStunPipelineReceiver();
+            ChkIf(pReceiver == NULL, E_OUTOFMEMORY);
+            Chk(pReceiver->Init(&arrayOfFourSockets[index], &_workers[0], _workers.size(), _receivers.size(), (responseCacheSize > 0), spLimiter));
+            _receivers.push_back(pReceiver);
+        }
+    }
+
+Cleanup:
+    if (FAILED(hr))
+    {
+        Release();
+    }
+    return hr;
+}
+
+HRESULT CStunPipeline::Start()
+{
+    HRESULT hr = S_OK;
+
+    ChkIfA(_receivers.size() == 0, E_UNEXPECTED);
+
+    for (size_t index = 0; index < _workers.size(); index++)
+    {
+        ChkA(_workers[index]->Start());
+    }
+
+    for (size_t index = 0; index < _receivers.size(); index++)
+    {
+        ChkA(_receivers[index]->Start());
+    }
+
+Cleanup:
+    if (FAILED(hr))
+    {
+        Stop();
+    }
+    return hr;
+}
+
+HRESULT CStunPipeline::Stop()
+{
+    int shedcount = 0;
+
+    // the receivers first, so nothing is pushed to a worker that's gone
+    for (size_t index = 0; index < _receivers.size(); index++)
+    {
+        _receivers[index]->SignalForStop(false);
+    }
+
+    for (size_t index = 0; index < _receivers.size(); index++)
+    {
+        _receivers[index]->SignalForStop(true);
+    }
+
+    for (size_t index = 0; index < _receivers.size(); index++)
+    {
+        _receivers[index]->WaitForStop();
+    }
+
+    for (size_t index = 0; index < _workers.size(); index++)
+    {
+        _workers[index]->SignalForStop();
+    }
+
+    for (size_t index = 0; index < _workers.size(); index++)
+    {
+        _workers[index]->WaitForStop();
+        shedcount += _workers[index]->GetShedCount();
+    }
+
+    if (shedcount > 0)
+    {
+        Logging::LogMsg(LL_DEBUG, "Pipeline shed %d packets with full queues", shedcount);
+    }
+
+    return S_OK;
+}
@@ -0,0 +1,171 @@
+/*
+   Copyright 2011 John Selbie
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+
+#ifndef STUNPIPELINE_H
+#define	STUNPIPELINE_H
+
+#include "stunsocket.h"
+#include "ratelimiter.h"
+#include "recvfromex.h"
+
+
+// Pipeline mode for UDP (--workers).  A CStunSocketThread does everything for its sockets on one thread - receive,
+// parse, check the integrity, respond.  With long term credentials the HMAC and MD5 work dominates, and with a
+// single listening socket that all lands on a single core.  Pipeline mode splits the work into two stages:
+//    A receiver thread per socket takes batches of datagrams off it (recvmmsgex), drops the ones that are rate
+//    limited or can't be a STUN request, and hands the rest to the workers round robin.
+//    A pool of worker threads parses the requests, checks their integrity a batch at a time, and sends the
+//    responses straight out of whichever socket the response calls for.
+// Every receiver has a CStunPacketQueue of its own to every worker, so each queue has exactly one producer and one
+// consumer.  A full queue sheds its oldest packets - under overload the freshest requests are the ones that get answered.
+
+
+class CStunPipelineWorker
+{
+public:
+    CStunPipelineWorker();
+    ~CStunPipelineWorker();
+
+    // queueCount is the number of receivers feeding this worker.  responseCacheSize of zero turns off the response cache,
+    // iceCacheSize of zero the ICE responder
+    HRESULT Init(CStunSocket* arrayOfFourSockets, TransportAddressSet* pTSA, IStunAuth* pAuth, size_t queueCount, size_t responseCacheSize, uint32_t responseCacheTTL, size_t iceCacheSize);
+    HRESULT Start();
+
+    void SignalForStop();
+    void WaitForStop();
+
+    // receiver side - the queue receiver number index pushes to, and the call it makes after pushing a batch
+    CStunPacketQueue* GetQueue(size_t index);
+    void Wake();
+
+    int GetShedCount();
+
+private:
+    static const size_t c_batchSize = CStunIntegrityBatch::c_maxsize;
+    static const uint32_t c_cacheReportIntervalMilliseconds = 60000;
+
+    CStunSocket* _arrSendSockets; // matches CStunServer::_arrSockets
+    TransportAddressSet _tsa;
+
+    CRefCountedPtr<IStunAuth> _spAuth;
+    CStunKeyCache _keycache;
+    CStunRequestContext _requestcontext;
+    CStunResponseCache _responsecache;
+    uint32_t _cacheReportTime;
+    uint64_t _cacheLookupsReported;
+    CStunIceResponder _iceresponder;
+
+    std::vector<CStunPacketQueue*> _queues;
+    size_t _rotation;
+
+    pthread_t _pthread;
+    bool _fThreadIsValid;
+    bool _fNeedToExit;
+
+    // a worker with nothing to do sleeps on _cond with _fSleeping set, until a receiver sees the flag and wakes it
+    pthread_mutex_t _mutex;
+    pthread_cond_t _cond;
+    bool _fSleeping;
+
+    StunPacket _packet; // where packets are popped into on their way to a reader
+    CStunMessageReader _readers[c_batchSize];
+    CRefCountedBuffer _spBufferReaders[c_batchSize];
+    CRefCountedBuffer _spBufferOut[c_batchSize];
+    StunMessageIn _msgIn[c_batchSize];
+    StunMessageOut _msgOut[c_batchSize];
+    HRESULT _results[c_batchSize];
+
+    void Run();
+    static void* ThreadFunction(void* pThis);
+
+    bool HasPackets();
+    void WaitForPackets();
+    size_t DequeueRequests();
+    void ProcessRequestsAndSendResponses(size_t count);
+    bool AnswerIceCheck(const StunMessageIn& msgIn, StunMessageOut& msgOut);
+    HRESULT SendResponse(SocketRole socketrole, const CSocketAddress& addrDest, const uint8_t* pData, size_t size);
+    void ReportCacheStats(uint32_t now, bool fFinal);
+
+    void ReleaseQueues();
+};
+
+
+class CStunPipelineReceiver
+{
+public:
+    CStunPipelineReceiver();
+    ~CStunPipelineReceiver();
+
+    // the receiver pushes into queue number queueIndex of every worker.  With fPinTransactions, requests are
+    // handed out by transaction ID instead of round robin, so a retransmission finds the response the worker cached
+    HRESULT Init(CStunSocket* pSocket, CStunPipelineWorker** arrWorkers, size_t workerCount, size_t queueIndex, bool fPinTransactions, boost::shared_ptr<RateLimiter>& spLimiter);
+    HRESULT Start();
+
+    // fPostMessages sends a datagram to the socket to get the thread out of its receive call
+    void SignalForStop(bool fPostMessages);
+    void WaitForStop();
+
+private:
+    static const size_t c_recvBatchSize = 16;
+
+    CStunSocket* _pSocket;
+    std::vector<CStunPipelineWorker*> _workers;
+    std::vector<bool> _pushed; // which workers got packets from the current batch
+    size_t _queueIndex;
+    size_t _nextWorker;
+    bool _fPinTransactions;
+
+    pthread_t _pthread;
+    bool _fThreadIsValid;
+    bool _fNeedToExit;
+
+    boost::shared_ptr<RateLimiter> _spLimiter;
+
+    RecvMessageEx _messages[c_recvBatchSize];
+    StunPacket _packets[c_recvBatchSize]; // the datagrams are received straight into these
+
+    void Run();
+    static void* ThreadFunction(void* pThis);
+
+    void DispatchPacket(StunPacket& packet);
+    static bool IsStunRequest(const uint8_t* pData, size_t size);
+};
+
+
+class CStunPipeline
+{
+public:
+    // the depth of each receiver to worker queue
+    static const size_t c_queueDepth = 256;
+    static const size_t c_maxWorkers = 32;
+
+    CStunPipeline();
+    ~CStunPipeline();
+
+    HRESULT Init(CStunSocket* arrayOfFourSockets, TransportAddressSet* pTSA, IStunAuth* pAuth, size_t workerCount, boost::shared_ptr<RateLimiter>& spLimiter, size_t responseCacheSize, uint32_t responseCacheTTL, size_t iceCacheSize);
+    HRESULT Start();
+    HRESULT Stop();
+
+private:
+    std::vector<CStunPipelineReceiver*> _receivers;
+    std::vector<CStunPipelineWorker*> _workers;
+
+    void Release();
+};
+
+
+#endif	/* STUNPIPELINE_H */
@@ -22,6 +22,7 @@
 #include "stunsocketthread.h"
 #include "recvfromex.h"
 #include "ratelimiter.h"
+#include "oshelper.h"
 
 
 CStunSocketThread::CStunSocketThread() :
@@ -30,7 +31,10 @@ _fNeedToExit(false),
 _pthread((pthread_t)-1),
 _fThreadIsValid(false),
 _rotation(0),
-_tsa() // zero-init
+_tsa(), // zero-init
+_fAsyncAuth(false),
+_cacheReportTime(0),
+_cacheLookupsReported(0)
 {
     ClearSocketArray();
 }
@@ -47,7 +51,7 @@ void CStunSocketThread::ClearSocketArray()
     _socks.clear();
 }
 
-HRESULT CStunSocketThread::Init(CStunSocket* arrayOfFourSockets, TransportAddressSet* pTSA, IStunAuth* pAuth, SocketRole rolePrimaryRecv, boost::shared_ptr<RateLimiter>& spLimiter)
+HRESULT CStunSocketThread::Init(CStunSocket* arrayOfFourSockets, TransportAddressSet* pTSA, IStunAuth* pAuth, IStunAsyncAuth* pAsyncAuth, SocketRole rolePrimaryRecv, boost::shared_ptr<RateLimiter>& spLimiter, size_t responseCacheSize, uint32_t responseCacheTTL, size_t iceCacheSize)
 {
     HRESULT hr = S_OK;
     
@@ -67,8 +71,9 @@ HRESULT CStunSocketThread::Init(CStunSocket* arrayOfFourSockets, TransportAddres
     
     _arrSendSockets = arrayOfFourSockets;
     
-    // initialize the TSA thing
+    // initialize the TSA thing, and encode the RESPONSE-ORIGIN and OTHER-ADDRESS attributes it implies once up front
     _tsa = *pTSA;
+    ChkA(CStunRequestHandler::PrecomputeAttributes(&_tsa));
     
     if (fSingleSocketRecv)
     {
@@ -94,7 +99,33 @@ HRESULT CStunSocketThread::Init(CStunSocket* arrayOfFourSockets, TransportAddres
     
     _rotation = 0;
     
-    _spAuth.Attach(pAuth);
+    _spAuth = pAuth; // a reference of its own, the server keeps the one it has
+    
+    // long term keys derived for authenticated requests are kept around for the next request
+    if (pAuth)
+    {
+        ChkA(_keycache.Init(CStunKeyCache::c_defaultSize));
+    }
+    
+    _fAsyncAuth = (pAsyncAuth != NULL);
+    if (_fAsyncAuth)
+    {
+        Chk(_asynccontext.Init(pAsyncAuth, CStunAsyncRequestContext::c_defaultMaxPending));
+    }
+    
+    _responsecache.Reset();
+    if (responseCacheSize > 0)
+    {
+        ChkA(_responsecache.Init(responseCacheSize, responseCacheTTL));
+    }
+    _cacheReportTime = GetMillisecondCounter();
+    _cacheLookupsReported = 0;
+    
+    _iceresponder.Reset();
+    if ((iceCacheSize > 0) && pAuth && (_fAsyncAuth == false))
+    {
+        ChkA(_iceresponder.Init(iceCacheSize, CStunIceResponder::c_defaultTTL));
+    }
     
     _spLimiter = spLimiter;
 
@@ -106,30 +137,38 @@ HRESULT CStunSocketThread::InitThreadBuffers()
 {
     HRESULT hr = S_OK;
     
-    _reader.Reset();
-    
-    _spBufferReader = CRefCountedBuffer(new CBuffer(MAX_STUN_MESSAGE_SIZE));
     _spBufferIn = CRefCountedBuffer(new CBuffer(MAX_STUN_MESSAGE_SIZE));
-    _spBufferOut = CRefCountedBuffer(new CBuffer(MAX_STUN_MESSAGE_SIZE));
     
-    _reader.GetStream().Attach(_spBufferReader, true);
-    
-    _msgIn.fConnectionOriented = false;
-    _msgIn.pReader = &_reader;
-    _msgOut.spBufferOut = _spBufferOut;
+    for (size_t index = 0; index < c_batchSize; index++)
+    {
+        _readers[index].Reset();
+        
+        _spBufferReaders[index] = CRefCountedBuffer(new CBuffer(MAX_STUN_MESSAGE_SIZE));
+        _spBufferOut[index] = CRefCountedBuffer(new CBuffer(MAX_STUN_MESSAGE_SIZE));
+        
+        _readers[index].GetStream().Attach(_spBufferReaders[index], true);
+        
+        _msgIn[index].fConnectionOriented = false;
+        _msgIn[index].pReader = &_readers[index];
+        _msgOut[index].spBufferOut = _spBufferOut[index];
+    }
     
     return hr;
 }
 
 void CStunSocketThread::UninitThreadBuffers()
 {
-    _reader.Reset();
-    _spBufferReader.reset();
     _spBufferIn.reset();
-    _spBufferOut.reset();
     
-    _msgIn.pReader = NULL;
-    _msgOut.spBufferOut.reset();
+    for (size_t index = 0; index < c_batchSize; index++)
+    {
+        _readers[index].Reset();
+        _spBufferReaders[index].reset();
+        _spBufferOut[index].reset();
+        
+        _msgIn[index].pReader = NULL;
+        _msgOut[index].spBufferOut.reset();
+    }
 }
 
 
@@ -210,6 +249,10 @@ HRESULT CStunSocketThread::WaitForStopAndClose()
     
     UninitThreadBuffers();
     
+    // waits for the auth provider to answer anything still parked
+    _asynccontext.Reset();
+    _fAsyncAuth = false;
+    
     return S_OK;
 }
 
@@ -220,7 +263,7 @@ void* CStunSocketThread::ThreadFunction(void* pThis)
     return NULL;
 }
 
-// returns an index into _socks, not _arrSockets
+// returns an index into _socks, not _arrSockets.  NULL when it was only the async auth notification that fired
 CStunSocket* CStunSocketThread::WaitForSocketData()
 {
     fd_set set = {};
@@ -245,6 +288,13 @@ CStunSocket* CStunSocketThread::WaitForSocketData()
         FD_SET(sock, &set);
         nHighestSockValue = (sock > nHighestSockValue) ? sock : nHighestSockValue;
     }
+    
+    if (_fAsyncAuth)
+    {
+        int fd = _asynccontext.GetNotifyFd();
+        FD_SET(fd, &set);
+        nHighestSockValue = (fd > nHighestSockValue) ? fd : nHighestSockValue;
+    }
 
     // wait indefinitely for a socket
     ret = ::select(nHighestSockValue+1, &set, NULL, NULL, NULL);
@@ -266,7 +316,7 @@ CStunSocket* CStunSocketThread::WaitForSocketData()
         }
     }
     
-    ASSERT(pReadySocket != NULL);
+    ASSERT((pReadySocket != NULL) || _fAsyncAuth);
     
     return pReadySocket;
 }
@@ -275,13 +325,11 @@ CStunSocket* CStunSocketThread::WaitForSocketData()
 void CStunSocketThread::Run()
 {
     size_t nSocketCount = _socks.size();
-    bool fMultiSocketMode = (nSocketCount > 1);
+    // the async auth notification is one more thing to wait on, so it needs the select loop too
+    bool fMultiSocketMode = (nSocketCount > 1) || _fAsyncAuth;
     int recvflags = fMultiSocketMode ? MSG_DONTWAIT : 0;
     CStunSocket* pSocket = _socks[0];
-    int ret;
-    char szIPRemote[100] = {};
-    char szIPLocal[100] = {};
-    bool allowed_to_pass = true;
+    size_t count = 0;
 
     
     int sendsocketcount = 0;
@@ -304,8 +352,13 @@ void CStunSocketThread::Run()
             {
                 break;
             }
+            
+            if (_fAsyncAuth)
+            {
+                ProcessCompletedRequests();
+            }
 
-            ASSERT(pSocket != NULL);
+            ASSERT((pSocket != NULL) || _fAsyncAuth);
             
             if (pSocket == NULL)
             {
@@ -317,21 +370,64 @@ void CStunSocketThread::Run()
         ASSERT(pSocket != NULL);
 
         // now receive the data
+        count = ReceiveRequests(pSocket, recvflags);
+
+        if (_fNeedToExit)
+        {
+            break;
+        }
+        
+        // --------------------------------------------------------------------
+        // now let's handle these messages and get the responses back out
+        
+        if (count > 0)
+        {
+            ProcessRequestsAndSendResponses(count);
+        }
+    }
+
+    ReportCacheStats(GetMillisecondCounter(), true);
+
+    Logging::LogMsg(LL_DEBUG, "Thread exiting");
+}
+
+// Receives up to c_batchSize datagrams from pSocket.  Only the first receive uses recvflags (and may block),
+// the rest just drain what is already queued.  Returns how many valid stun messages are now in
+// _readers/_msgIn - datagrams that are rate limited or don't parse don't take up a slot
+size_t CStunSocketThread::ReceiveRequests(CStunSocket* pSocket, int recvflags)
+{
+    int ret;
+    char szIPRemote[100] = {};
+    char szIPLocal[100] = {};
+    bool allowed_to_pass = true;
+    size_t count = 0;
+    
+    for (size_t received = 0; received < c_batchSize; received++)
+    {
+        StunMessageIn& msgIn = _msgIn[count];
+        CStunMessageReader& reader = _readers[count];
+        
         _spBufferIn->SetSize(0);
 
-        ret = ::recvfromex(pSocket->GetSocketHandle(), _spBufferIn->GetData(), _spBufferIn->GetAllocatedSize(), recvflags, &_msgIn.addrRemote, &_msgIn.addrLocal);
+        ret = ::recvfromex(pSocket->GetSocketHandle(), _spBufferIn->GetData(), _spBufferIn->GetAllocatedSize(), (received == 0) ? recvflags : MSG_DONTWAIT, &msgIn.addrRemote, &msgIn.addrLocal);
+        
+        if ((ret < 0) && (received > 0))
+        {
+            // nothing more queued up
+            break;
+        }
 
         // recvfromex no longer sets the port value on the local address
         if (ret >= 0)
         {
-            _msgIn.addrLocal.SetPort(pSocket->GetLocalAddress().GetPort());
+            msgIn.addrLocal.SetPort(pSocket->GetLocalAddress().GetPort());
         }
         
 
         if (Logging::GetLogLevel() >= LL_VERBOSE)
         {
-            _msgIn.addrRemote.ToStringBuffer(szIPRemote, 100);
-            _msgIn.addrLocal.ToStringBuffer(szIPLocal, 100);
+            msgIn.addrRemote.ToStringBuffer(szIPRemote, 100);
+            msgIn.addrLocal.ToStringBuffer(szIPLocal, 100);
         }
         else
         {
@@ -341,16 +437,21 @@ void CStunSocketThread::Run()
         
         Logging::LogMsg(LL_VERBOSE, "recvfrom returns %d from %s on local interface %s", ret, szIPRemote, szIPLocal);
 
-        allowed_to_pass = (_spLimiter.get() != NULL) ? _spLimiter->RateCheck(_msgIn.addrRemote) : true;
+        allowed_to_pass = (_spLimiter.get() != NULL) ? _spLimiter->RateCheck(msgIn.addrRemote) : true;
         
         if (allowed_to_pass == false)
         {
             Logging::LogMsg(LL_VERBOSE, "RateLimiter signals false for packet from %s", szIPRemote);
         }
 
-        if ((ret < 0) || (allowed_to_pass == false))
+        if (ret < 0)
         {
             // error
+            break;
+        }
+        
+        if (allowed_to_pass == false)
+        {
             continue;
         }
 
@@ -361,57 +462,162 @@ void CStunSocketThread::Run()
 
         _spBufferIn->SetSize(ret);
         
-        _msgIn.socketrole = pSocket->GetRole();
+        msgIn.socketrole = pSocket->GetRole();
         
+        // a retransmission of a request answered recently gets the same response again, without being parsed
+        if (_responsecache.IsEnabled())
+        {
+            const StunCachedResponse* pCached = _responsecache.Lookup(msgIn.addrRemote, msgIn.socketrole, _spBufferIn->GetData(), ret, GetMillisecondCounter());
+            if (pCached != NULL)
+            {
+                SendResponse(pCached->socketrole, pCached->addrDest, pCached->data, pCached->size);
+                continue;
+            }
+        }
         
-        // --------------------------------------------------------------------
-        // now let's handle this message and get the response back out
+        // Reset the reader object and re-attach the buffer
+        reader.Reset();
+        _spBufferReaders[count]->SetSize(0);
+        reader.GetStream().Attach(_spBufferReaders[count], true);
+        
+        // Consume the message and just validate that it is a stun message
+        reader.AddBytes(_spBufferIn->GetData(), _spBufferIn->GetSize());
+        if (reader.GetState() == CStunMessageReader::BodyValidated)
+        {
+            // an ICE connectivity check is taken care of right here, the rest go to the request handler as a batch
+            if (_iceresponder.IsEnabled() && AnswerIceCheck(msgIn, _msgOut[count]))
+            {
+                continue;
+            }
+            count++;
+        }
+    }
+    
+    return count;
+}
+
+                        
+void CStunSocketThread::ProcessRequestsAndSendResponses(size_t count)
+{
+    // msgIn and msgOut are already initialized
+    uint32_t now = 0;
+    
+    if (_fAsyncAuth)
+    {
+        // E_PENDING (a failure code, so nothing gets sent or cached below) leaves the request with _asynccontext.
+        // Its response goes out from ProcessCompletedRequests
+        for (size_t index = 0; index < count; index++)
+        {
+            _results[index] = _asynccontext.ProcessRequest(_msgIn[index], _msgOut[index], &_tsa, &_keycache, NULL);
+        }
+    }
+    else
+    {
+        _requestcontext.ProcessRequestBatch(_msgIn, _msgOut, _results, count, &_tsa, _spAuth, &_keycache);
+    }
+    
+    for (size_t index = 0; index < count; index++)
+    {
+        if (SUCCEEDED(_results[index]))
+        {
+            const StunMessageOut& msgOut = _msgOut[index];
+            SendResponse(msgOut.socketrole, msgOut.addrDest, msgOut.spBufferOut->GetData(), msgOut.spBufferOut->GetSize());
+        }
+    }
+    
+    if (_responsecache.IsEnabled())
+    {
+        now = GetMillisecondCounter();
+        
+        for (size_t index = 0; index < count; index++)
+        {
+            if (SUCCEEDED(_results[index]))
+            {
+                _responsecache.Store(_msgIn[index], _msgOut[index], now);
+            }
+        }
         
-        ProcessRequestAndSendResponse();
+        ReportCacheStats(now, false);
     }
+}
 
-    Logging::LogMsg(LL_DEBUG, "Thread exiting");
+// true if the ICE responder took care of the request - it either answered it or dropped it for a bad FINGERPRINT
+bool CStunSocketThread::AnswerIceCheck(const StunMessageIn& msgIn, StunMessageOut& msgOut)
+{
+    uint32_t now = GetMillisecondCounter();
+    HRESULT hr = _iceresponder.ProcessRequest(msgIn, msgOut, _spAuth, now);
+    
+    if (hr == S_OK)
+    {
+        SendResponse(msgOut.socketrole, msgOut.addrDest, msgOut.spBufferOut->GetData(), msgOut.spBufferOut->GetSize());
+        
+        if (_responsecache.IsEnabled())
+        {
+            _responsecache.Store(msgIn, msgOut, now);
+        }
+    }
+    
+    return (hr != S_FALSE);
 }
 
-                        
-HRESULT CStunSocketThread::ProcessRequestAndSendResponse()
+// sends the responses to requests that were waiting on the auth provider.  Those don't go in the response cache -
+// a retransmission that arrives while the first copy is parked just gets parked too
+void CStunSocketThread::ProcessCompletedRequests()
 {
-    HRESULT hr = S_OK;
-    int sendret = -1;
-    int sockout = -1;
-    int err = 0;
+    StunMessageOut& msgOut = _msgOut[0];
+    void* pTag = NULL;
+    HRESULT hrResult = S_OK;
+    
+    while (_asynccontext.GetCompletedRequest(msgOut, &pTag, &hrResult))
+    {
+        if (SUCCEEDED(hrResult))
+        {
+            SendResponse(msgOut.socketrole, msgOut.addrDest, msgOut.spBufferOut->GetData(), msgOut.spBufferOut->GetSize());
+        }
+    }
+}
 
-    // Reset the reader object and re-attach the buffer
-    _reader.Reset();
-    _spBufferReader->SetSize(0);
-    _reader.GetStream().Attach(_spBufferReader, true);
+// logs the response cache's hit rate at most once every c_cacheReportIntervalMilliseconds, and when the thread exits
+void CStunSocketThread::ReportCacheStats(uint32_t now, bool fFinal)
+{
+    uint64_t hits = _responsecache.GetHitCount();
+    uint64_t lookups = hits + _responsecache.GetMissCount();
     
-    // Consume the message and just validate that it is a stun message
-    _reader.AddBytes(_spBufferIn->GetData(), _spBufferIn->GetSize());
-    ChkIf(_reader.GetState() != CStunMessageReader::BodyValidated, E_FAIL);
+    if ((_responsecache.IsEnabled() == false) || (lookups == _cacheLookupsReported))
+    {
+        return;
+    }
     
-    // msgIn and msgOut are already initialized
+    if ((fFinal == false) && ((now - _cacheReportTime) < c_cacheReportIntervalMilliseconds))
+    {
+        return;
+    }
+    
+    Logging::LogMsg(LL_DEBUG, "Response cache: %llu hits in %llu lookups (%d%% hit rate)", (unsigned long long)hits, (unsigned long long)lookups, (int)((hits * 100) / lookups));
     
-    Chk(CStunRequestHandler::ProcessRequest(_msgIn, _msgOut, &_tsa, _spAuth));
+    _cacheReportTime = now;
+    _cacheLookupsReported = lookups;
+}
+
+HRESULT CStunSocketThread::SendResponse(SocketRole socketrole, const CSocketAddress& addrDest, const uint8_t* pData, size_t size)
+{
+    HRESULT hr = S_OK;
+    int sendret = -1;
+    int sockout = -1;
+    int err = 0;
 
-    ASSERT(_tsa.set[_msgOut.socketrole].fValid);
-    ASSERT(_arrSendSockets[_msgOut.socketrole].IsValid());
-    sockout = _arrSendSockets[_msgOut.socketrole].GetSocketHandle();
+    ASSERT(_tsa.set[socketrole].fValid);
+    ASSERT(_arrSendSockets[socketrole].IsValid());
+    sockout = _arrSendSockets[socketrole].GetSocketHandle();
     ASSERT(sockout != -1);
     
-    // find the socket that matches the role specified by msgOut
-    sendret = ::sendto(sockout, _spBufferOut->GetData(), _spBufferOut->GetSize(), 0, _msgOut.addrDest.GetSockAddr(), _msgOut.addrDest.GetSockAddrLength());
+    // find the socket that matches the role the response goes out on
+    sendret = ::sendto(sockout, pData, size, 0, addrDest.GetSockAddr(), addrDest.GetSockAddrLength());
     err = (sendret == -1) ? errno : 0;
     if (Logging::GetLogLevel() >= LL_VERBOSE)
     {
         Logging::LogMsg(LL_VERBOSE, "sendto returns %d (err == %d)\n", sendret, err);
     }
-        
-Cleanup:
+    
     return hr;
 }
-
-
-
-
-
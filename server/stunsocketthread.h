@@ -33,7 +33,10 @@ public:
     CStunSocketThread();
     ~CStunSocketThread();
     
-    HRESULT Init(CStunSocket* arrayOfFourSockets, TransportAddressSet* pTSA, IStunAuth* pAuth, SocketRole rolePrimaryRecv, boost::shared_ptr<RateLimiter>& _spRateLimiter);
+    // responseCacheSize of zero turns off the cache of responses for retransmitted requests
+    // pAsyncAuth is optional - when set, auth checks don't block the thread (it's normally the same object as pAuth)
+    // iceCacheSize of zero turns off the ICE responder.  It's also off with pAsyncAuth, since its cache misses would block
+    HRESULT Init(CStunSocket* arrayOfFourSockets, TransportAddressSet* pTSA, IStunAuth* pAuth, IStunAsyncAuth* pAsyncAuth, SocketRole rolePrimaryRecv, boost::shared_ptr<RateLimiter>& _spRateLimiter, size_t responseCacheSize, uint32_t responseCacheTTL, size_t iceCacheSize);
     HRESULT Start();
 
     HRESULT SignalForStop(bool fPostMessages);
@@ -62,21 +65,40 @@ private:
     TransportAddressSet _tsa;
     
     CRefCountedPtr<IStunAuth> _spAuth;
-    
-    // pre-allocated objects for the thread
-    CStunMessageReader _reader;
-    CRefCountedBuffer _spBufferReader; // buffer internal to the reader
-    CRefCountedBuffer _spBufferIn;     // buffer we receive requests on
-    CRefCountedBuffer _spBufferOut;    // buffer we send response on
-    StunMessageIn _msgIn;
-    StunMessageOut _msgOut;
+    CStunKeyCache _keycache;
+    CStunRequestContext _requestcontext; // the request handlers, reused from one batch to the next
+    CStunAsyncRequestContext _asynccontext; // used instead of _requestcontext when the auth provider is asynchronous
+    bool _fAsyncAuth;
+    // how often the response cache's hit rate gets written to the debug log (when something changed)
+    static const uint32_t c_cacheReportIntervalMilliseconds = 60000;
+    CStunResponseCache _responsecache;   // answers retransmitted requests, when enabled
+    uint32_t _cacheReportTime;           // when the cache's hit rate was last logged
+    uint64_t _cacheLookupsReported;      // hits plus misses as of then
+    CStunIceResponder _iceresponder;     // answers ICE connectivity checks ahead of the request handler, when enabled
+    
+    // pre-allocated objects for the thread.  Up to c_batchSize datagrams are taken off the socket
+    // at a time, so their integrity checks can be done together (CStunRequestContext::ProcessRequestBatch)
+    static const size_t c_batchSize = CStunIntegrityBatch::c_maxsize;
+    CStunMessageReader _readers[c_batchSize];
+    CRefCountedBuffer _spBufferReaders[c_batchSize]; // buffers internal to the readers
+    CRefCountedBuffer _spBufferIn;                   // buffer we receive requests on
+    CRefCountedBuffer _spBufferOut[c_batchSize];     // buffers we send responses on
+    StunMessageIn _msgIn[c_batchSize];
+    StunMessageOut _msgOut[c_batchSize];
+    HRESULT _results[c_batchSize];
     
     boost::shared_ptr<RateLimiter> _spLimiter;
     
     HRESULT InitThreadBuffers();
     void UninitThreadBuffers();
     
-    HRESULT ProcessRequestAndSendResponse();
+    size_t ReceiveRequests(CStunSocket* pSocket, int recvflags);
+    void ProcessRequestsAndSendResponses(size_t count);
+    void ProcessCompletedRequests();
+    bool AnswerIceCheck(const StunMessageIn& msgIn, StunMessageOut& msgOut);
+    HRESULT SendResponse(SocketRole socketrole, const CSocketAddress& addrDest, const uint8_t* pData, size_t size);
+    
+    void ReportCacheStats(uint32_t now, bool fFinal);
     
     void ClearSocketArray();
     
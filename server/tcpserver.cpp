@@ -20,6 +20,7 @@
 #include "stunsocket.h"
 
 #include "stunsocketthread.h"
+#include "oshelper.h"
 
 // client sockets are now level triggered
 const uint32_t EPOLL_CLIENT_READ_EVENT_SET = IPOLLING_READ | IPOLLING_RDHUP;
@@ -36,11 +37,53 @@ const uint32_t EPOLL_PIPE_EVENT_SET = IPOLLING_READ;
 
 const int c_MaxNumberOfConnectionsDefault = 1000;
 
+// io_uring user data is a connection pointer (or for an accept, the listen socket's role)
+// with the type of request in the low bits
+const uint64_t URING_TAG_MASK    = 0x07;
+const uint64_t URING_TAG_ACCEPT  = 1;
+const uint64_t URING_TAG_RECEIVE = 2;
+const uint64_t URING_TAG_SEND    = 3;
+const uint64_t URING_TAG_PIPE    = 4;
+const uint64_t URING_TAG_CANCEL  = 5;
+const uint64_t URING_TAG_AUTH    = 6;
+const int URING_TAG_BITS = 3;
+
+
+// An abortive close (SO_LINGER with a zero timeout) sends a RST instead of a FIN.
+// The socket is freed immediately, and no TIME_WAIT entry is left behind on this side.
+static void SetResetOnClose(int sock)
+{
+    linger lingerReset = {};
+    lingerReset.l_onoff = 1;
+    lingerReset.l_linger = 0;
+    ::setsockopt(sock, SOL_SOCKET, SO_LINGER, &lingerReset, sizeof(lingerReset));
+}
+
+static const char* GetCloseReasonName(ConnectionCloseReason reason)
+{
+    switch (reason)
+    {
+        case CloseReason_PeerClosed: return "peer closed";
+        case CloseReason_IdleTimeout: return "idle timeout";
+        case CloseReason_CloseWait: return "close wait";
+        case CloseReason_ReadTimeout: return "read timeout";
+        case CloseReason_WriteTimeout: return "write timeout";
+        case CloseReason_HandshakeTimeout: return "handshake timeout";
+        case CloseReason_ProtocolError: return "protocol error";
+        case CloseReason_RateLimited: return "rate limited";
+        case CloseReason_Rejected: return "rejected";
+        case CloseReason_ConnectionError: return "connection error";
+        case CloseReason_Shutdown: return "shutdown";
+        default: return "unknown";
+    }
+}
+
 
 CTCPStunThread::CTCPStunThread()
 {
     _pipe[0] = _pipe[1] = -1;
     _pthread = (pthread_t)-1;
+    _connectionCount = 0;
     Reset();
 }
 
@@ -48,6 +91,21 @@ void CTCPStunThread::Reset()
 {
     _spPolling.ReleaseAndClear();
     
+#ifdef HAS_IOURING
+    // closing the ring is what guarantees the kernel is done with the connections and buffers below
+    _uring.Close();
+#endif
+    _fUsingUring = false;
+    for (size_t index = 0; index < ARRAYSIZE(_fAcceptArmed); index++)
+    {
+        _fAcceptArmed[index] = false;
+        _fAcceptMultishot[index] = false;
+        _fAcceptCanceling[index] = false;
+    }
+    _fPipeArmed = false;
+    _fAuthNotifyArmed = false;
+    _closingCount = 0;
+    
     CloseListenSockets();
     ClosePipes();
     
@@ -57,29 +115,53 @@ void CTCPStunThread::Reset()
     _tsaListen = emptyTSA; 
     
     _fNeedToExit = false;
+    // waits for the auth provider to answer anything still parked, so it goes before the reference to the provider
+    _asynccontext.Reset();
+    _fAsyncAuth = false;
     _spAuth.ReleaseAndClear();
+    _keycache.Reset();
+    _spTlsContext.ReleaseAndClear();
     _role = RolePP;
     
     _tsa = emptyTSA;
     
     _maxConnections = c_MaxNumberOfConnectionsDefault;
+    _tcpFastOpenQueueLength = 0;
+    _deferAcceptSeconds = 0;
+    _fOrderlyClose = false;
+    _closeWaitMilliseconds = c_closeWaitMillisecondsDefault;
+    
+    for (size_t index = 0; index < ARRAYSIZE(_closeCounts); index++)
+    {
+        _closeCounts[index] = 0;
+        _closeCountsFlushed[index] = 0;
+    }
 
     _pthread = (pthread_t)-1;
     _fThreadIsValid = false;
     
     
     _connectionpool.Reset();
+    _bufferpool.Reset();
 
     // the thread should have closed all the connections
-    ASSERT(_hashConnections1.Size() == 0);
-    ASSERT(_hashConnections2.Size() == 0);
-    _hashConnections1.ResetTable();
-    _hashConnections2.ResetTable();
-    
-    _pNewConnList = &_hashConnections1;
-    _pOldConnList = &_hashConnections2;
-    
-    _timeLastSweep = time(NULL);
+    ASSERT(_connectionCount == 0);
+    ASSERT(_timerwheel.GetCount() == 0);
+    _connectionTable.clear();
+    _connectionCount = 0;
+    
+    _timeNow = 0;
+    _timeNextTrim = 0;
+    _timeNextStats = 0;
+    
+    _timerTick = -1;
+    _timerTrim = -1;
+    _timerStats = -1;
+    _fTickArmed = false;
+    
+    _reader.Reset();
+    _spReaderBuffer.reset();
+    _spResponseBuffer.reset();
 }
 
 
@@ -182,6 +264,25 @@ HRESULT CTCPStunThread::CreateListenSockets()
             ChkA(_socketListenArray[r].TCPInit(_tsaListen.set[r].addr, (SocketRole)r, true));
             _socketTable[r] = _socketListenArray[r].GetSocketHandle();
             ChkA(_socketListenArray[r].SetNonBlocking(true));
+            
+            // Neither option is essential to serving requests, so a kernel that rejects them just gets a warning
+            if (_tcpFastOpenQueueLength > 0)
+            {
+                HRESULT hrOpt = _socketListenArray[r].SetTcpFastOpen(_tcpFastOpenQueueLength);
+                if (FAILED(hrOpt))
+                {
+                    Logging::LogMsg(LL_ALWAYS, "Warning - unable to enable TCP Fast Open on listen socket (hr == %x)", hrOpt);
+                }
+            }
+            if (_deferAcceptSeconds > 0)
+            {
+                HRESULT hrOpt = _socketListenArray[r].SetDeferAccept(_deferAcceptSeconds);
+                if (FAILED(hrOpt))
+                {
+                    Logging::LogMsg(LL_ALWAYS, "Warning - unable to enable deferred accept on listen socket (hr == %x)", hrOpt);
+                }
+            }
+            
             ret = listen(_socketTable[r], 128); // 128 - large backlog.
             ChkIfA(ret == -1, ERRNOHR);
             _countSocks++;
@@ -228,10 +329,9 @@ CStunSocket* CTCPStunThread::GetListenSocket(int sock)
 
 
 
-HRESULT CTCPStunThread::Init(const TransportAddressSet& tsaListen, const TransportAddressSet& tsaHandler, IStunAuth* pAuth, int maxConnections, boost::shared_ptr<RateLimiter>& spLimiter)
+HRESULT CTCPStunThread::Init(const TransportAddressSet& tsaListen, const TransportAddressSet& tsaHandler, IStunAuth* pAuth, IStunAsyncAuth* pAsyncAuth, CTlsContext* pTlsContext, const CStunServerConfig& config, boost::shared_ptr<RateLimiter>& spLimiter)
 {
     HRESULT hr = S_OK;
-    int ret;
     int countListen = 0;
     int countHandler = 0;
     
@@ -239,7 +339,11 @@ HRESULT CTCPStunThread::Init(const TransportAddressSet& tsaListen, const Transpo
     ChkIfA(_pipe[0] != -1, E_UNEXPECTED);
     ChkIfA(_fThreadIsValid, E_UNEXPECTED);
     
-    _maxConnections = (maxConnections > 0) ? maxConnections : c_MaxNumberOfConnectionsDefault;    
+    _maxConnections = (config.nMaxConnections > 0) ? (int)config.nMaxConnections : c_MaxNumberOfConnectionsDefault;
+    _tcpFastOpenQueueLength = (int)config.nTcpFastOpenQueueLength;
+    _deferAcceptSeconds = (int)config.nDeferAcceptSeconds;
+    _fOrderlyClose = config.fTcpOrderlyClose;
+    _closeWaitMilliseconds = (config.nTcpCloseWaitSeconds > 0) ? (config.nTcpCloseWaitSeconds * 1000) : c_closeWaitMillisecondsDefault;
 
     // Max sure we didn't accidently pass in anything crazy
     ChkIfA(_maxConnections >= 100000, E_INVALIDARG);
@@ -255,33 +359,82 @@ HRESULT CTCPStunThread::Init(const TransportAddressSet& tsaListen, const Transpo
     
     _tsaListen = tsaListen;
     _tsa = tsaHandler;
+    ChkA(CStunRequestHandler::PrecomputeAttributes(&_tsa));
+    
+    _spAuth = pAuth; // a reference of its own, the server keeps the one it has
+    
+    // long term keys derived for authenticated requests are kept around for the next request
+    if (pAuth)
+    {
+        ChkA(_keycache.Init(CStunKeyCache::c_defaultSize));
+    }
+    
+    _fAsyncAuth = (pAsyncAuth != NULL);
+    if (_fAsyncAuth)
+    {
+        Chk(_asynccontext.Init(pAsyncAuth, CStunAsyncRequestContext::c_defaultMaxPending));
+    }
     
-    _spAuth.Attach(pAuth);
+    // Attach doesn't take a reference of its own, and the server keeps the one it has
+    if (pTlsContext)
+    {
+        pTlsContext->AddRef();
+    }
+    _spTlsContext.Attach(pTlsContext);
 
     ChkA(CreateListenSockets());
     
     ChkA(CreatePipes());
-
-    // +5 for listening sockets and pipe
-    ChkA(CreatePollingInstance(IPOLLING_TYPE_BEST, (size_t)(_maxConnections + 5), _spPolling.GetPointerPointer()));
-    
-    
-    // add listen socket to epoll
-    ASSERT(_fListenSocketsOnEpoll == false);
-    ChkA(SetListenSocketsOnEpoll(true));
     
+#ifdef HAS_IOURING
+    // TLS sessions make their own socket reads and writes, so in TLS mode io_uring can only take over the polling (below)
+    if (config.fIoUring && (_spTlsContext == NULL))
+    {
+        HRESULT hrUring = InitUring();
+        if (FAILED(hrUring))
+        {
+            Logging::LogMsg(LL_ALWAYS, "Warning - io_uring connection handling is not available (hr == %x). Using the polling loop instead", hrUring);
+        }
+    }
+#endif
     
-    // add read end of pipe to epoll so we can get notified of when a signal to exit has occurred
-    ChkA(_spPolling->Add(_pipe[0], EPOLL_PIPE_EVENT_SET));
+    if (_fUsingUring == false)
+    {
+        // +6 for listening sockets, pipe, and the async auth notification
+        ChkA(CreatePollingInstance(config.fIoUring ? IPOLLING_TYPE_URING : IPOLLING_TYPE_BEST, (size_t)(_maxConnections + 6), _spPolling.GetPointerPointer()));
+        
+        
+        // add listen socket to epoll
+        ASSERT(_fListenSocketsOnEpoll == false);
+        ChkA(SetListenSocketsOnEpoll(true));
+        
+        
+        // add read end of pipe to epoll so we can get notified of when a signal to exit has occurred
+        ChkA(_spPolling->Add(_pipe[0], EPOLL_PIPE_EVENT_SET));
+        
+        // and the fd that signals auth checks completing
+        if (_fAsyncAuth)
+        {
+            ChkA(_spPolling->Add(_asynccontext.GetNotifyFd(), EPOLL_PIPE_EVENT_SET));
+        }
+        
+        // the tick timer starts out disarmed - there are no connections yet
+        ChkA(_spPolling->AddTimer(0, false, &_timerTick));
+        ChkA(_spPolling->AddTimer(c_poolTrimIntervalMilliseconds, true, &_timerTrim));
+        ChkA(_spPolling->AddTimer(c_statsIntervalMilliseconds, true, &_timerStats));
+    }
     
-    ret = _hashConnections1.InitTable(_maxConnections, 0);
-    ChkIfA(ret == -1, E_FAIL);
+    // the table grows on demand if a socket handle comes back larger than this
+    _connectionTable.assign((size_t)(_maxConnections + 64), NULL);
+    _connectionCount = 0;
     
-    ret = _hashConnections2.InitTable(_maxConnections, 0);
-    ChkIfA(ret == -1, E_FAIL);
+    _timeNow = GetMonotonicMilliseconds();
+    ChkA(_timerwheel.Init(c_timerTickMilliseconds, _timeNow));
+    _timeNextTrim = _timeNow + c_poolTrimIntervalMilliseconds;
+    _timeNextStats = _timeNow + c_statsIntervalMilliseconds;
     
-    _pNewConnList = &_hashConnections1;
-    _pOldConnList = &_hashConnections2;
+    _spReaderBuffer = CRefCountedBuffer(new CBuffer(MAX_STUN_MESSAGE_SIZE));
+    _spResponseBuffer = CRefCountedBuffer(new CBuffer(MAX_STUN_MESSAGE_SIZE));
     
     _spLimiter = spLimiter;
     
@@ -345,18 +498,65 @@ void* CTCPStunThread::ThreadFunction(void* pThis)
     return NULL;
 }
 
-int CTCPStunThread::GetTimeoutSeconds()
+int CTCPStunThread::GetTimeoutMilliseconds()
 {
-    size_t connCount = _pNewConnList->Size() + _pOldConnList->Size();
-    return (connCount == 0) ? -1 : (int)c_sweepTimeoutSeconds;
+    // only used in io_uring mode - otherwise these deadlines are timers on the polling instance
+    
+    // no connections means no timers, which means we can wait indefinitely
+    int timeout = _timerwheel.GetMillisecondsToNextTick(_timeNow);
+    
+    // ... unless there's pooled memory that might need to be given back
+    if ((_bufferpool.GetFreeCount() > 0) || (_connectionpool.GetFreeCount() > 0))
+    {
+        int timeoutTrim = (_timeNextTrim > _timeNow) ? (int)(_timeNextTrim - _timeNow) : 0;
+        
+        if ((timeout < 0) || (timeoutTrim < timeout))
+        {
+            timeout = timeoutTrim;
+        }
+    }
+    
+    return timeout;
 }
 
 bool CTCPStunThread::IsConnectionCountAtMax()
 {
-    size_t size1 = _pNewConnList->Size();
-    size_t size2 = _pOldConnList->Size();
+    return (_connectionCount >= (size_t)_maxConnections);
+}
+
+HRESULT CTCPStunThread::AddConnectionToTable(StunConnection* pConn)
+{
+    HRESULT hr = S_OK;
+    int sock = pConn->_stunsocket.GetSocketHandle();
+    
+    ChkIfA(sock < 0, E_UNEXPECTED);
+    
+    if ((size_t)sock >= _connectionTable.size())
+    {
+        _connectionTable.resize((size_t)sock * 2, NULL);
+    }
+    
+    ChkIfA(_connectionTable[sock] != NULL, E_UNEXPECTED);
+    
+    _connectionTable[sock] = pConn;
+    _connectionCount++;
     
-    return ((size1 + size2) >= (size_t)_maxConnections);
+Cleanup:
+    return hr;
+}
+
+StunConnection* CTCPStunThread::LookupConnection(int sock)
+{
+    if ((sock < 0) || ((size_t)sock >= _connectionTable.size()))
+    {
+        return NULL;
+    }
+    return _connectionTable[sock];
+}
+
+void CTCPStunThread::SetConnectionTimeout(StunConnection* pConn, uint32_t timeoutMilliseconds)
+{
+    _timerwheel.Schedule(&pConn->_timer, _timeNow + timeoutMilliseconds);
 }
 
 
@@ -364,24 +564,31 @@ void CTCPStunThread::Run()
 {
     HRESULT hrPoll;
     
+#ifdef HAS_IOURING
+    if (_fUsingUring)
+    {
+        RunUring();
+        return;
+    }
+#endif
+    
     Logging::LogMsg(LL_DEBUG, "Starting TCP listening thread (%d sockets)\n", _countSocks);
     
-    _timeLastSweep = time(NULL);
+    _timeNow = GetMonotonicMilliseconds();
     
     while (_fNeedToExit == false)
     {
         PollEvent pollevent = {};
-        // wait for a notification
-        int timeout = GetTimeoutSeconds();
         CStunSocket* pListenSocket = NULL;
         
         // turn off epoll eventing from the listen sockets if we are at max connections
         // otherwise, make sure it is enabled.
         SetListenSocketsOnEpoll(IsConnectionCountAtMax() == false);
         
-        hrPoll = _spPolling->WaitForNextEvent(&pollevent, timeout);
+        // connection deadlines, pool trimming, and stats are all timer events, so there's no timeout to compute
+        hrPoll = _spPolling->WaitForNextEvent(&pollevent, -1);
         
-        if ( _fNeedToExit || (pollevent.fd == _pipe[0]) )
+        if (_fNeedToExit)
         {
             break;
         }
@@ -389,7 +596,21 @@ void CTCPStunThread::Run()
         // hrPoll will be S_OK if there was an event.  S_FALSE otherwise
         ASSERT(SUCCEEDED(hrPoll));
         
-        if (hrPoll == S_OK)
+        _timeNow = GetMonotonicMilliseconds();
+        
+        if ((hrPoll == S_OK) && (pollevent.eventflags & IPOLLING_TIMER))
+        {
+            ProcessTimerEvent(pollevent.fd);
+        }
+        else if ((hrPoll == S_OK) && (pollevent.fd == _pipe[0]))
+        {
+            break;
+        }
+        else if ((hrPoll == S_OK) && _fAsyncAuth && (pollevent.fd == _asynccontext.GetNotifyFd()))
+        {
+            ProcessCompletedRequests();
+        }
+        else if (hrPoll == S_OK)
         {
             if (Logging::GetLogLevel() >= LL_VERBOSE)
             {
@@ -405,13 +626,7 @@ void CTCPStunThread::Run()
             pListenSocket = GetListenSocket(pollevent.fd);
             if (pListenSocket)
             {
-                StunConnection* pConn = AcceptConnection(pListenSocket);
-                
-                // as an optimization - see if we can do a read on the new connection
-                if (pConn)
-                {
-                    ReceiveBytesForConnection(pConn);
-                }
+                AcceptConnections(pListenSocket);
             }
             else
             {
@@ -419,8 +634,11 @@ void CTCPStunThread::Run()
             }
         }
         
-        // close any connection that we haven't heard from in a while
-        SweepDeadConnections();
+        // the first connection on the timer wheel starts the tick timer
+        if ((_fTickArmed == false) && (_timerwheel.GetCount() > 0))
+        {
+            ArmTickTimer();
+        }
     }
     
     ThreadCleanup();
@@ -430,35 +648,16 @@ void CTCPStunThread::Run()
 
 void CTCPStunThread::ProcessConnectionEvent(int sock, uint32_t eventflags)
 {
-    StunConnection** ppConn = NULL;
-    StunConnection* pConn = NULL;
-    
-    ppConn = _pNewConnList->Lookup(sock);
-    if (ppConn == NULL)
-    {
-        ppConn = _pOldConnList->Lookup(sock);
-    }
+    StunConnection* pConn = LookupConnection(sock);
     
-    if ((ppConn == NULL) || (*ppConn == NULL))
+    if (pConn == NULL)
     {
         Logging::LogMsg(LL_DEBUG, "Warning - ProcessConnectionEvent could not resolve socket into connection (socket == %d)", sock);
         return;
     }
     
-    pConn = *ppConn;
-    
     // if event flags is an error or a hangup, that's ok, the subsequent call below will consume the error and close the connection as appropriate
-    
-    if (pConn->_state == ConnectionState_Receiving)
-    {
-        ReceiveBytesForConnection(pConn);
-    }
-    else if (pConn->_state == ConnectionState_Transmitting)
-    {
-        WriteBytesForConnection(pConn);
-    }
-        
-    
+    ServiceConnection(pConn, eventflags);
 }
 
 bool CTCPStunThread::RateCheck(const CSocketAddress& addr)
@@ -482,51 +681,132 @@ bool CTCPStunThread::RateCheck(const CSocketAddress& addr)
 }
 
 
-StunConnection* CTCPStunThread::AcceptConnection(CStunSocket* pListenSocket)
+void CTCPStunThread::AcceptConnections(CStunSocket* pListenSocket)
+{
+    // drain the backlog rather than taking one connection per trip through the poll loop
+    // bounded so that a connection flood can't starve the connections we already have
+    for (int count = 0; count < c_maxAcceptsPerWakeup; count++)
+    {
+        StunConnection* pConn = NULL;
+        
+        if (IsConnectionCountAtMax())
+        {
+            // the listen sockets come off the epoll set at the top of the next loop iteration
+            break;
+        }
+        
+        if (AcceptConnection(pListenSocket, &pConn) != S_OK)
+        {
+            break;
+        }
+        
+        // as an optimization - see if we can do a read on the new connection
+        // With TCP_DEFER_ACCEPT enabled, the request is usually already waiting
+        if (pConn)
+        {
+            ServiceConnection(pConn, IPOLLING_READ);
+        }
+    }
+}
+
+// returns S_OK if a socket was taken off the backlog (*ppConn is NULL if it got rejected and closed)
+// returns S_FALSE if the backlog is empty
+HRESULT CTCPStunThread::AcceptConnection(CStunSocket* pListenSocket, StunConnection** ppConn)
 {
     int listensock = pListenSocket->GetSocketHandle();
     SocketRole role = pListenSocket->GetRole();
-    int clientsock = -1;
     int socktmp = -1;
     sockaddr_storage addrClient;
     socklen_t socklen = sizeof(addrClient);
-    StunConnection* pConn = NULL;
-    HRESULT hr = S_OK;
-    int insertresult;
     int err;
-    bool allowed_to_pass = true;
     
     ASSERT(listensock != -1);
     ASSERT(::IsValidSocketRole(role));
 
+    *ppConn = NULL;
+
+#ifdef SOCK_NONBLOCK
+    // saves the fcntl round trips of setting non-blocking mode after the fact
+    socktmp = ::accept4(listensock, (sockaddr*)&addrClient, &socklen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
     socktmp = ::accept(listensock, (sockaddr*)&addrClient, &socklen);
+#endif
 
     err = errno;
     Logging::LogMsg(LL_VERBOSE, "accept returns %d (errno == %d)", socktmp, (socktmp<0)?err:0);
-    ChkIfA(socktmp == -1, E_FAIL);
     
-    // --- rate limit check-------
-    allowed_to_pass = RateCheck(CSocketAddress(addrClient));
-    ChkIf(allowed_to_pass==false, E_FAIL); // this will trigger the socket to be immediately closed
-    // --------------------------
+    if (socktmp == -1)
+    {
+        if ((err == EAGAIN) || (err == EWOULDBLOCK))
+        {
+            return S_FALSE; // backlog is drained
+        }
+        if ((err == ECONNABORTED) || (err == EINTR))
+        {
+            return S_OK; // transient, the next connection in the backlog is still worth trying for
+        }
+        return E_FAIL;
+    }
+    
+    return AdmitConnection(socktmp, role, &addrClient, ppConn);
+}
+
+// Sets up a connection object for a socket that was just accepted, or closes the socket if the connection isn't allowed.
+// pAddrClient can be NULL if the client's address isn't known yet.
+// Always returns S_OK.  *ppConn is NULL if the connection got rejected
+HRESULT CTCPStunThread::AdmitConnection(int sock, SocketRole role, const sockaddr_storage* pAddrClient, StunConnection** ppConn)
+{
+    int socktmp = sock;
+    sockaddr_storage addrPeer;
+    socklen_t socklen = sizeof(addrPeer);
+    StunConnection* pConn = NULL;
+    HRESULT hr = S_OK;
+    bool allowed_to_pass = true;
     
+    *ppConn = NULL;
     
-    clientsock = socktmp;
+    // --- rate limit check-------
+    if (_spLimiter.get())
+    {
+        if (pAddrClient == NULL)
+        {
+            // a multishot accept doesn't report the client's address
+            ChkIf(::getpeername(sock, (sockaddr*)&addrPeer, &socklen) == -1, E_FAIL);
+            pAddrClient = &addrPeer;
+        }
+        
+        allowed_to_pass = RateCheck(CSocketAddress(*pAddrClient));
+        ChkIf(allowed_to_pass==false, E_ACCESSDENIED); // this will trigger the socket to be immediately closed
+    }
+    // --------------------------
     
-    pConn = _connectionpool.GetConnection(clientsock, role);
+    pConn = _connectionpool.GetConnection(sock, role);
     ChkIfA(pConn == NULL, E_FAIL); // Our connection pool has nothing left to give, only thing to do is abort this connection and close the socket
     socktmp = -1;
     
+#ifndef SOCK_NONBLOCK
     ChkA(pConn->_stunsocket.SetNonBlocking(true));
+#endif
     
-    ChkA(_spPolling->Add(clientsock, EPOLL_CLIENT_READ_EVENT_SET));
+    if (_fUsingUring == false)
+    {
+        ChkA(_spPolling->Add(sock, EPOLL_CLIENT_READ_EVENT_SET));
+        pConn->_eventset = EPOLL_CLIENT_READ_EVENT_SET;
+    }
     
-    // add connection to our tracking tables
-    pConn->_idHashTable = (_pNewConnList == &_hashConnections1) ? 1 : 2;
-    insertresult = _pNewConnList->Insert(clientsock, pConn);
+    // add connection to our tracking table
+    ChkA(AddConnectionToTable(pConn));
     
-    // out of space in the lookup tables?
-    ChkIfA(insertresult == -1, E_FAIL);
+    if (_spTlsContext)
+    {
+        Chk(pConn->_tls.Attach(_spTlsContext, sock));
+        pConn->_state = ConnectionState_Handshaking;
+        SetConnectionTimeout(pConn, c_handshakeTimeoutMilliseconds);
+    }
+    else
+    {
+        SetConnectionTimeout(pConn, c_idleTimeoutMilliseconds);
+    }
     
     if (Logging::GetLogLevel() >= LL_VERBOSE)
     {
@@ -542,246 +822,1336 @@ Cleanup:
     
     if (FAILED(hr))
     {
-        CloseConnection(pConn);
+        ConnectionCloseReason reason = (hr == E_ACCESSDENIED) ? CloseReason_RateLimited : CloseReason_Rejected;
+        
+        CloseConnection(pConn, reason);
         pConn = NULL;
         if (socktmp != -1)
         {
+            // turned away before it got a connection object
+            if (ShouldResetOnClose(reason))
+            {
+                SetResetOnClose(socktmp);
+            }
             close(socktmp);
+            _closeCounts[reason]++;
         }
+        
+        // the backlog entry was still consumed, so the caller can keep draining
+        hr = S_OK;
     }
+    
+    *ppConn = pConn;
 
-    return pConn;
+    return hr;
 }
 
-HRESULT CTCPStunThread::ReceiveBytesForConnection(StunConnection* pConn)
+void CTCPStunThread::ServiceConnection(StunConnection* pConn, uint32_t eventflags)
 {
-    uint8_t buffer[MAX_STUN_MESSAGE_SIZE];
-    size_t bytesneeded;
-    int bytesread;
     HRESULT hr = S_OK;
-    CStunMessageReader::ReaderParseState readerstate;
-    int err;
-    bool allowed_to_pass = true;
-    
-    int sock = pConn->_stunsocket.GetSocketHandle();
+    bool fProgress = false;
+    ConnectionCloseReason reason = CloseReason_ProtocolError;
     
-    while (true)
+    if (pConn->_state == ConnectionState_Handshaking)
     {
-        ASSERT(pConn->_state == ConnectionState_Receiving);
-        ASSERT(pConn->_reader.GetState() != CStunMessageReader::ParseError);
-        ASSERT(pConn->_reader.GetState() != CStunMessageReader::BodyValidated);
+        hr = ContinueHandshake(pConn);
+        Chk(hr);
         
-        bytesneeded = pConn->_reader.HowManyBytesNeeded();
-        
-        ChkIfA(bytesneeded == 0, E_UNEXPECTED);
-        
-        bytesread = recv(sock, buffer, bytesneeded, 0);
+        if (hr == S_FALSE)
+        {
+            // nothing else can happen on this connection until the handshake is done
+            Chk(UpdateConnectionState(pConn, false));
+            return;
+        }
         
-        err = errno;
-        Logging::LogMsg(LL_VERBOSE, "recv on socket %d returns %d (errno=%d)", sock, bytesread, (bytesread<0)?err:0);
+        // The client's first request usually arrives right behind its half of the handshake,
+        // and it may already be sitting in the session's buffer where the socket can't signal for it
+        eventflags |= IPOLLING_READ;
+    }
+    
+    reason = CloseReason_ConnectionError;
+    
+    // borrow the ring buffers for as long as there's something in flight
+    Chk(_bufferpool.AttachBuffers(pConn));
+    
+    if ((eventflags & (IPOLLING_READ | IPOLLING_RDHUP | IPOLLING_HUP | IPOLLING_ERROR)) && (pConn->_fPeerClosed == false))
+    {
+        Chk(ReceiveBytesForConnection(pConn));
+    }
+    
+    while (true)
+    {
+        // parse everything that has fully arrived and queue up the responses
+        hr = ProcessRequestsForConnection(pConn, &fProgress);
+        if (FAILED(hr))
+        {
+            reason = (hr == E_ACCESSDENIED) ? CloseReason_RateLimited : CloseReason_ProtocolError;
+            Chk(hr);
+        }
         
+        // then flush all the pending responses with one writev
+        Chk(WriteBytesForConnection(pConn));
         
-        if ((bytesread < 0) && ((err == EWOULDBLOCK) || (err==EAGAIN)) )
+        // The only reason to go around again is when request processing stopped
+        // because the output buffer was full, and the socket has since drained it.
+        if (pConn->_bufferOut.IsEmpty() == false)
         {
-            // no more bytes to be consumed - bail out of here and return success
             break;
         }
         
-
-        // any other error (or an EOF/shutdown notification) means the connection is dead
-        ChkIf(bytesread <= 0, E_FAIL);
-        
-        // we got data, now let's feed it into the reader
-        readerstate = pConn->_reader.AddBytes(buffer, bytesread);
+        // Nothing else gets processed until the auth provider answers (ProcessCompletedRequests)
+        if (pConn->_fAuthPending)
+        {
+            break;
+        }
         
-        ChkIf(readerstate == CStunMessageReader::ParseError, E_FAIL);
+        // Or a TLS session is holding decrypted bytes that didn't fit in the input buffer
+        // last time.  The socket won't signal for those, so pick them up now.
+        if (pConn->_tls.HasPendingData() && (pConn->_bufferIn.IsFull() == false))
+        {
+            Chk(ReceiveBytesForConnection(pConn));
+            continue;
+        }
         
-        if (readerstate == CStunMessageReader::BodyValidated)
+        if (pConn->_bufferIn.IsEmpty())
         {
-            StunMessageIn msgIn;
-            StunMessageOut msgOut;
-            
-            msgIn.addrLocal = pConn->_stunsocket.GetLocalAddress();
-            msgIn.addrRemote = pConn->_stunsocket.GetRemoteAddress();
-            msgIn.fConnectionOriented = true;
-            msgIn.pReader = &pConn->_reader;
-            msgIn.socketrole = pConn->_stunsocket.GetRole();
-            
-            msgOut.spBufferOut = pConn->_spOutputBuffer;
-            
-            allowed_to_pass = this->RateCheck(msgIn.addrRemote);
-            ChkIf(allowed_to_pass == false, E_FAIL);
-            
-            Chk(CStunRequestHandler::ProcessRequest(msgIn, msgOut, &_tsa, _spAuth));
-            
-            // success - transition to the response state
-            pConn->_state = ConnectionState_Transmitting;
-            
-            // change the socket such that we only listen for "write events"
-            Chk(_spPolling->ChangeEventSet(sock, EPOLL_CLIENT_WRITE_EVENT_SET));
-            
-            // optimization - go ahead and try to send the response
-            WriteBytesForConnection(pConn);
-            // WriteBytesForConnection will close the connection on error
-            
-            // so we can't assume the connection is still alive.  And if it's not alive, pConn likely got deleted
-            // either refetch from the hash tables, or invent an out parameter on WriteBytesForConnection and ConsumeRemoteClose to better propagate the close state of the connection
-            pConn = NULL;
-            
             break;
         }
         
-        // keep trying to read more bytes
+        size_t messagesize = 0;
+        if (GetNextMessageSize(pConn->_bufferIn, &messagesize) != S_OK)
+        {
+            break;
+        }
     }
-        
+    
+    // The client is done sending, so close our end as soon as the last response is out.
+    // The client closed first, so the TIME_WAIT ends up on its side instead of ours.
+    if (pConn->_fPeerClosed && pConn->_bufferOut.IsEmpty() && (pConn->_fAuthPending == false))
+    {
+        CloseConnection(pConn, CloseReason_PeerClosed);
+        return;
+    }
+    
+    // an idle connection gives the buffers back until more data shows up
+    _bufferpool.DetachBuffersIfIdle(pConn);
+    
+    Chk(UpdateConnectionState(pConn, fProgress));
+    
 Cleanup:
     if (FAILED(hr))
     {
-        CloseConnection(pConn);
+        CloseConnection(pConn, reason);
     }
-
-    return hr;
 }
 
-HRESULT CTCPStunThread::WriteBytesForConnection(StunConnection* pConn)
+HRESULT CTCPStunThread::ContinueHandshake(StunConnection* pConn)
 {
     HRESULT hr = S_OK;
     int sock = pConn->_stunsocket.GetSocketHandle();
-    int sent = -1;
-    uint8_t* pData = NULL;
-    size_t bytestotal, bytesremaining;
-    bool fForceClose = false;
-    int err;
-
     
+    hr = pConn->_tls.Handshake();
     
-    ASSERT(pConn != NULL);    
+    if (FAILED(hr))
+    {
+        Logging::LogMsg(LL_VERBOSE, "TLS handshake failed on socket %d", sock);
+    }
+    else if (hr == S_OK)
+    {
+        Logging::LogMsg(LL_VERBOSE, "TLS handshake complete on socket %d (%s, kernel TLS send=%s receive=%s)", sock,
+                pConn->_tls.IsResumed() ? "resumed" : "full handshake",
+                pConn->_tls.IsKernelSend() ? "yes" : "no",
+                pConn->_tls.IsKernelReceive() ? "yes" : "no");
+    }
     
-    pData = pConn->_spOutputBuffer->GetData();
-    bytestotal = pConn->_spOutputBuffer->GetSize();
+    return hr;
+}
+
+HRESULT CTCPStunThread::ReceiveBytesForConnection(StunConnection* pConn)
+{
+    HRESULT hr = S_OK;
+    iovec regions[2];
+    size_t numregions;
+    size_t bytesrequested;
+    ssize_t bytesread;
+    int err;
+    int sock = pConn->_stunsocket.GetSocketHandle();
     
+    if (pConn->_tls.IsAttached())
+    {
+        return ReceiveTlsBytesForConnection(pConn);
+    }
     
     while (true)
     {
-        ASSERT(pConn->_state == ConnectionState_Transmitting);
-        ASSERT(bytestotal > pConn->_txCount);
+        numregions = pConn->_bufferIn.GetWriteRegions(regions);
+        if (numregions == 0)
+        {
+            // input buffer is full - the parser needs to make room first
+            break;
+        }
         
-        bytesremaining = bytestotal - pConn->_txCount;
+        bytesrequested = pConn->_bufferIn.GetFreeSpace();
+        
+        bytesread = ::readv(sock, regions, (int)numregions);
         
-        sent = ::send(sock, pData + pConn->_txCount, bytesremaining, 0);
-
         err = errno;
-
-        // Can't send any more bytes, come back again later
-        ChkIf( ((sent == -1) && ((errno == EAGAIN) || (errno == EWOULDBLOCK))), S_OK);
+        Logging::LogMsg(LL_VERBOSE, "readv on socket %d returns %d (errno=%d)", sock, (int)bytesread, (bytesread<0)?err:0);
         
-        Logging::LogMsg(LL_VERBOSE, "send on socket %d returns %d (errno=%d)", sock, sent, (sent<0)?err:0);
-
-        // general connection error
-        ChkIf(sent == -1, E_FAIL);
+        if ((bytesread < 0) && ((err == EWOULDBLOCK) || (err==EAGAIN)) )
+        {
+            // no more bytes to be consumed - bail out of here and return success
+            break;
+        }
         
-        // can "send" ever return 0?
-        ChkIfA(sent == 0, E_UNEXPECTED);
+        // any other error means the connection is dead
+        ChkIf(bytesread < 0, E_FAIL);
         
-        pConn->_txCount += sent;
+        if (bytesread == 0)
+        {
+            // The client shut down its end.  Anything it sent before that still gets answered.
+            pConn->_fPeerClosed = true;
+            break;
+        }
         
-        // txCount should never exceed the total output message size, right?
-        ASSERT(pConn->_txCount <= bytestotal);
+        pConn->_bufferIn.CommitWrite((size_t)bytesread);
         
-        if (pConn->_txCount >= bytestotal)
+        // a short read means the socket is drained, no point in making another call just to get EAGAIN back
+        if ((size_t)bytesread < bytesrequested)
         {
-            pConn->_state = ConnectionState_Receiving;
-            _connectionpool.ResetConnection(pConn);
-            
-            // go back to listening for read events
-            ChkA(_spPolling->ChangeEventSet(sock, EPOLL_CLIENT_READ_EVENT_SET));
+            break;
+        }
+    }
+    
+Cleanup:
+    return hr;
+}
+
+HRESULT CTCPStunThread::ReceiveTlsBytesForConnection(StunConnection* pConn)
+{
+    HRESULT hr = S_OK;
+    iovec regions[2];
+    size_t numregions;
+    size_t bytesread = 0;
+    
+    // SSL_read hands back at most one record per call, so this goes one region at a time.
+    // With kernel TLS receive enabled, that's a plain read of already decrypted bytes.
+    while (true)
+    {
+        numregions = pConn->_bufferIn.GetWriteRegions(regions);
+        if (numregions == 0)
+        {
+            // input buffer is full - any remaining plaintext stays in the session until the parser makes room
+            break;
+        }
+        
+        hr = pConn->_tls.Read(regions[0].iov_base, regions[0].iov_len, &bytesread);
+        
+        // close_notify, a reset, or a protocol error all mean the connection is done
+        Chk(hr);
+        
+        if (hr == S_FALSE)
+        {
+            // waiting on the socket
+            hr = S_OK;
+            break;
+        }
+        
+        pConn->_bufferIn.CommitWrite(bytesread);
+    }
+    
+Cleanup:
+    return hr;
+}
+
+HRESULT CTCPStunThread::GetNextMessageSize(const CRingBuffer& buffer, size_t* pMessageSize)
+{
+    HRESULT hr = S_OK;
+    uint8_t header[STUN_HEADER_SIZE];
+    uint16_t msglength;
+    size_t messagesize;
+    
+    if (buffer.GetSize() < STUN_HEADER_SIZE)
+    {
+        return S_FALSE;
+    }
+    
+    Chk(buffer.Peek(header, sizeof(header)));
+    
+    // message length is the 16-bit field immediately after the message type
+    msglength = (uint16_t)((header[2] << 8) | header[3]);
+    messagesize = STUN_HEADER_SIZE + msglength;
+    
+    // anything this big can never be read, so there's no point in waiting for the rest of it
+    ChkIf(messagesize > MAX_STUN_MESSAGE_SIZE, E_FAIL);
+    
+    *pMessageSize = messagesize;
+    
+    hr = (buffer.GetSize() >= messagesize) ? S_OK : S_FALSE;
+    
+Cleanup:
+    return hr;
+}
+
+HRESULT CTCPStunThread::ProcessRequestsForConnection(StunConnection* pConn, bool* pfProgress)
+{
+    HRESULT hr = S_OK;
+    size_t messagesize = 0;
+    
+    // only start on a request if its response is guaranteed to fit in the output buffer.
+    // Responses go out in order, so a request waiting on the auth provider holds up the ones behind it
+    while ((pConn->_fAuthPending == false) && (pConn->_bufferOut.GetFreeSpace() >= MAX_STUN_MESSAGE_SIZE))
+    {
+        hr = GetNextMessageSize(pConn->_bufferIn, &messagesize);
+        if (hr != S_OK)
+        {
+            break;
+        }
+        
+        Chk(ProcessRequest(pConn, messagesize));
+        *pfProgress = true;
+    }
+    
+Cleanup:
+    // S_FALSE (incomplete message) isn't a failure for the caller
+    return FAILED(hr) ? hr : S_OK;
+}
+
+HRESULT CTCPStunThread::ProcessRequest(StunConnection* pConn, size_t messagesize)
+{
+    HRESULT hr = S_OK;
+    iovec regions[2];
+    size_t numregions;
+    CStunMessageReader::ReaderParseState readerstate = CStunMessageReader::HeaderNotRead;
+    StunMessageIn msgIn;
+    StunMessageOut msgOut;
+    bool allowed_to_pass = true;
+    
+    _reader.Reset();
+    _reader.GetStream().Attach(_spReaderBuffer, true);
+    
+    // the message may wrap around the end of the ring buffer
+    numregions = pConn->_bufferIn.GetReadRegions(regions, messagesize);
+    for (size_t index = 0; index < numregions; index++)
+    {
+        readerstate = _reader.AddBytes((const uint8_t*)regions[index].iov_base, (uint32_t)regions[index].iov_len);
+    }
+    pConn->_bufferIn.Consume(messagesize);
+    
+    ChkIf(readerstate != CStunMessageReader::BodyValidated, E_FAIL);
+    
+    msgIn.addrLocal = pConn->_stunsocket.GetLocalAddress();
+    msgIn.addrRemote = pConn->_stunsocket.GetRemoteAddress();
+    msgIn.fConnectionOriented = true;
+    msgIn.pReader = &_reader;
+    msgIn.socketrole = pConn->_stunsocket.GetRole();
+    
+    msgOut.spBufferOut = _spResponseBuffer;
+    
+    allowed_to_pass = this->RateCheck(msgIn.addrRemote);
+    ChkIf(allowed_to_pass == false, E_ACCESSDENIED);
+    
+    if (_fAsyncAuth)
+    {
+        hr = _asynccontext.ProcessRequest(msgIn, msgOut, &_tsa, &_keycache, pConn);
+        if (hr == E_PENDING)
+        {
+            // the response gets queued up by ProcessCompletedRequests
+            pConn->_fAuthPending = true;
+            return S_OK;
+        }
+        Chk(hr);
+    }
+    else
+    {
+        Chk(_requestcontext.ProcessRequest(msgIn, msgOut, &_tsa, _spAuth, &_keycache));
+    }
+    
+    // queue the response up behind any others that haven't been sent yet
+    ChkA(pConn->_bufferOut.Write(_spResponseBuffer->GetData(), _spResponseBuffer->GetSize()));
+    pConn->_fHasResponded = true;
+    
+Cleanup:
+    return hr;
+}
+
+HRESULT CTCPStunThread::WriteBytesForConnection(StunConnection* pConn)
+{
+    HRESULT hr = S_OK;
+    int sock = pConn->_stunsocket.GetSocketHandle();
+    iovec regions[2];
+    size_t numregions;
+    ssize_t sent = -1;
+    int err;
+    
+    if (pConn->_tls.IsAttached())
+    {
+        return WriteTlsBytesForConnection(pConn);
+    }
+    
+    if (_fUsingUring)
+    {
+        // the send gets submitted by UpdateConnectionState
+        return S_OK;
+    }
+    
+    while (pConn->_bufferOut.IsEmpty() == false)
+    {
+        // all the queued responses go out in one call
+        numregions = pConn->_bufferOut.GetReadRegions(regions, pConn->_bufferOut.GetSize());
+        
+        sent = ::writev(sock, regions, (int)numregions);
+        
+        err = errno;
+        
+        // Can't send any more bytes, come back again later
+        ChkIf( ((sent == -1) && ((err == EAGAIN) || (err == EWOULDBLOCK))), S_OK);
+        
+        Logging::LogMsg(LL_VERBOSE, "writev on socket %d returns %d (errno=%d)", sock, (int)sent, (sent<0)?err:0);
+        
+        // general connection error
+        ChkIf(sent == -1, E_FAIL);
+        
+        // can "writev" ever return 0?
+        ChkIfA(sent == 0, E_UNEXPECTED);
+        
+        pConn->_bufferOut.Consume((size_t)sent);
+        
+        // loop back and try to send the remaining bytes
+    }
+    
+Cleanup:
+    return hr;
+}
+
+HRESULT CTCPStunThread::WriteTlsBytesForConnection(StunConnection* pConn)
+{
+    HRESULT hr = S_OK;
+    iovec regions[2];
+    size_t numregions;
+    uint8_t flatbuffer[CONNECTION_OUTPUT_BUFFER_SIZE];
+    const void* pData = NULL;
+    size_t size = 0;
+    size_t sent = 0;
+    
+    while (pConn->_bufferOut.IsEmpty() == false)
+    {
+        // All the queued responses go out as one record.  If they wrap around the end of the
+        // ring buffer, flatten them first rather than paying for a second record.
+        size = pConn->_bufferOut.GetSize();
+        numregions = pConn->_bufferOut.GetReadRegions(regions, size);
+        
+        if (numregions == 1)
+        {
+            pData = regions[0].iov_base;
+        }
+        else
+        {
+            ChkA(pConn->_bufferOut.Peek(flatbuffer, size));
+            pData = flatbuffer;
+        }
+        
+        // Nothing gets consumed from the ring buffer until the session says it's been sent,
+        // so a retry always passes the same bytes again (plus whatever got queued since)
+        hr = pConn->_tls.Write(pData, size, &sent);
+        Chk(hr);
+        
+        if (hr == S_FALSE)
+        {
+            // Can't send any more bytes, come back again later
+            hr = S_OK;
+            break;
+        }
+        
+        pConn->_bufferOut.Consume(sent);
+    }
+    
+Cleanup:
+    return hr;
+}
+
+HRESULT CTCPStunThread::UpdateConnectionState(StunConnection* pConn, bool fProgress)
+{
+    HRESULT hr = S_OK;
+    StunConnectionState state;
+    uint32_t eventset = 0;
+    int sock = pConn->_stunsocket.GetSocketHandle();
+    
+    // without buffers attached, the only thing that can be pending is a partial request in the carryover area
+    bool fHasBuffers = (pConn->_pBufferBlock != NULL);
+    bool fOutputPending = fHasBuffers && (pConn->_bufferOut.IsEmpty() == false);
+    bool fInputPending = fHasBuffers ? (pConn->_bufferIn.IsEmpty() == false) : (pConn->_carryoverSize > 0);
+    bool fInputFull = fHasBuffers && pConn->_bufferIn.IsFull();
+    bool fHandshaking = pConn->_tls.IsAttached() && (pConn->_tls.IsHandshakeComplete() == false);
+    
+    if (fHandshaking)
+    {
+        state = ConnectionState_Handshaking;
+    }
+    else if (fOutputPending)
+    {
+        state = ConnectionState_Transmitting;
+    }
+    else if (fInputPending)
+    {
+        state = ConnectionState_Receiving;
+    }
+    else
+    {
+        state = ConnectionState_Idle;
+    }
+    
+    // The deadline only moves when the state changes or a request got processed.
+    // A client trickling in the bytes of a single request doesn't get to extend it.
+    if ((state != pConn->_state) || fProgress)
+    {
+        // Once a connection has been answered, the client is expected to either send
+        // another request or close the connection within the close wait period
+        uint32_t timeout = pConn->_fHasResponded ? _closeWaitMilliseconds : c_idleTimeoutMilliseconds;
+        
+        if (state == ConnectionState_Receiving)
+        {
+            timeout = c_readTimeoutMilliseconds;
+        }
+        else if (state == ConnectionState_Transmitting)
+        {
+            timeout = c_writeTimeoutMilliseconds;
+        }
+        else if (state == ConnectionState_Handshaking)
+        {
+            timeout = c_handshakeTimeoutMilliseconds;
+        }
+        
+        SetConnectionTimeout(pConn, timeout);
+        pConn->_state = state;
+    }
+    
+#ifdef HAS_IOURING
+    if (_fUsingUring)
+    {
+        // no event set in io_uring mode - the same rules decide which requests are kept in flight instead
+        return SubmitUringRequests(pConn);
+    }
+#endif
+    
+    // stop reading when there's no place to put the bytes.  That only happens when the
+    // client isn't reading its responses, so the output buffer is full too.
+    // And once the client has shut down its end, there's nothing left to read (and
+    // a level triggered RDHUP would just keep firing).
+    if ((fInputFull == false) && (pConn->_fPeerClosed == false))
+    {
+        eventset |= EPOLL_CLIENT_READ_EVENT_SET;
+    }
+    
+    if (fOutputPending)
+    {
+        eventset |= EPOLL_CLIENT_WRITE_EVENT_SET;
+    }
+    
+    // a TLS session can need the socket to be writable before it can go any further,
+    // even for a read (handshake messages, post-handshake messages like tickets)
+    if (pConn->_tls.GetWantedEvents() & IPOLLING_WRITE)
+    {
+        eventset |= EPOLL_CLIENT_WRITE_EVENT_SET;
+        if (fHandshaking)
+        {
+            eventset &= ~EPOLL_CLIENT_READ_EVENT_SET;
+        }
+    }
+    
+    if (eventset != pConn->_eventset)
+    {
+        ChkA(_spPolling->ChangeEventSet(sock, eventset));
+        pConn->_eventset = eventset;
+    }
+    
+Cleanup:
+    return hr;
+}
+
+bool CTCPStunThread::ShouldResetOnClose(ConnectionCloseReason reason)
+{
+    if (_fOrderlyClose)
+    {
+        return false;
+    }
+    
+    // A connection this side is giving up on gets reset, so that neither a TIME_WAIT entry nor
+    // a half-closed socket waiting on the client's FIN is left behind - that includes one that
+    // never sent a request at all.  A client that closed first, a connection that's already
+    // broken, and a client that went quiet after being answered (RFC 5389 7.2.2 - the client is
+    // the one that decides when it's done) get a normal close.
+    switch (reason)
+    {
+        case CloseReason_IdleTimeout:
+        case CloseReason_ReadTimeout:
+        case CloseReason_WriteTimeout:
+        case CloseReason_HandshakeTimeout:
+        case CloseReason_ProtocolError:
+        case CloseReason_RateLimited:
+        case CloseReason_Rejected:
+            return true;
+        default:
+            return false;
+    }
+}
+
+void CTCPStunThread::CloseConnection(StunConnection* pConn, ConnectionCloseReason reason)
+{
+    if (pConn)
+    {
+        int sock = pConn->_stunsocket.GetSocketHandle();
+        bool fReset = ShouldResetOnClose(reason);
+        
+        Logging::LogMsg(LL_VERBOSE, "Closing socket %d (%s%s)\n", sock, GetCloseReasonName(reason), fReset ? ", reset" : "");
+        
+        _closeCounts[reason]++;
+        
+        // an auth check still out for this connection gets answered into nothing
+        if (pConn->_fAuthPending)
+        {
+            _asynccontext.CancelRequests(pConn);
+            pConn->_fAuthPending = false;
+        }
+        
+#ifdef HAS_IOURING
+        if (_fUsingUring)
+        {
+            if (pConn->_uringPending & CONNECTION_URING_RECEIVE)
+            {
+                SubmitUringCancel((uint64_t)(uintptr_t)pConn | URING_TAG_RECEIVE);
+            }
+            if (pConn->_uringPending & CONNECTION_URING_SEND)
+            {
+                SubmitUringCancel((uint64_t)(uintptr_t)pConn | URING_TAG_SEND);
+            }
+        }
+#endif
+        if (_spPolling)
+        {
+            _spPolling->Remove(sock);
+        }
+        _timerwheel.Cancel(&pConn->_timer);
+        
+        // a connection that failed part way through AcceptConnection might not have made it into the table
+        if (LookupConnection(sock) == pConn)
+        {
+            _connectionTable[sock] = NULL;
+            _connectionCount--;
+        }
+        
+        // no point in a close_notify on a connection that's about to be reset
+        pConn->_tls.Close(fReset == false);
+        
+        if (fReset)
+        {
+            SetResetOnClose(sock);
+        }
+        // an io_uring request still in flight holds its own reference to the socket, so the
+        // actual close (and the reset, if any) happens when its cancellation goes through
+        pConn->_stunsocket.Close();
+        
+        if (pConn->_uringPending != 0)
+        {
+            // the pending requests still point at this connection (and maybe its buffers), so
+            // it can't go back to the pool until they complete
+            pConn->_fClosing = true;
+            _closingCount++;
+            return;
+        }
+        
+        FreeConnection(pConn);
+    }
+}
+
+void CTCPStunThread::FreeConnection(StunConnection* pConn)
+{
+    _bufferpool.ReleaseBuffers(pConn);
+    _connectionpool.ReleaseConnection(pConn);
+}
+
+
+void CTCPStunThread::CloseAllConnections()
+{
+    for (size_t index = 0; (index < _connectionTable.size()) && (_connectionCount > 0); index++)
+    {
+        if (_connectionTable[index])
+        {
+            CloseConnection(_connectionTable[index], CloseReason_Shutdown);
+        }
+    }
+}
+
+void CTCPStunThread::CloseExpiredConnections()
+{
+    TimerWheelNode* pNode = NULL;
+    StunConnection* pConn = NULL;
+    ConnectionCloseReason reason;
+    int count = 0;
+    
+    // expirations are processed incrementally so that a large batch of connections timing out
+    // at once doesn't stall the thread.  Anything left over stays queued in the timer wheel
+    // and the next tick (or GetTimeoutMilliseconds in io_uring mode) comes right back here.
+    while (count < c_maxExpirationsPerIteration)
+    {
+        pNode = _timerwheel.PopExpired(_timeNow);
+        if (pNode == NULL)
+        {
+            break;
+        }
+        
+        pConn = (StunConnection*)(pNode->pContext);
+        
+        Logging::LogMsg(LL_VERBOSE, "Connection on socket %d timed out (state == %d)", pConn->_stunsocket.GetSocketHandle(), pConn->_state);
+        
+        switch (pConn->_state)
+        {
+            case ConnectionState_Receiving:    reason = CloseReason_ReadTimeout; break;
+            case ConnectionState_Transmitting: reason = CloseReason_WriteTimeout; break;
+            case ConnectionState_Handshaking:  reason = CloseReason_HandshakeTimeout; break;
+            default:                           reason = pConn->_fHasResponded ? CloseReason_CloseWait : CloseReason_IdleTimeout; break;
+        }
+        
+        CloseConnection(pConn, reason);
+        count++;
+    }
+}
+
+
+void CTCPStunThread::TrimPools()
+{
+    size_t buffersFreed;
+    size_t connectionsFreed;
+    
+    buffersFreed = _bufferpool.Trim();
+    connectionsFreed = _connectionpool.Trim();
+    
+    if ((buffersFreed > 0) || (connectionsFreed > 0))
+    {
+        Logging::LogMsg(LL_VERBOSE, "Released %d unused connection buffers and %d unused connection objects", (int)buffersFreed, (int)connectionsFreed);
+    }
+}
+
+void CTCPStunThread::FlushStats()
+{
+    bool fChanged = false;
+    
+    for (int index = 0; index < (int)CloseReason_Count; index++)
+    {
+        if (_closeCounts[index] != _closeCountsFlushed[index])
+        {
+            fChanged = true;
+            break;
+        }
+    }
+    
+    if (fChanged == false)
+    {
+        return;
+    }
+    
+    Logging::LogMsg(LL_DEBUG, "TCP thread has %d open connections", (int)_connectionCount);
+    
+    for (int index = 0; index < (int)CloseReason_Count; index++)
+    {
+        if (_closeCounts[index] != _closeCountsFlushed[index])
+        {
+            Logging::LogMsg(LL_DEBUG, "TCP connections closed (%s) since last report: %llu", GetCloseReasonName((ConnectionCloseReason)index), (unsigned long long)(_closeCounts[index] - _closeCountsFlushed[index]));
+            _closeCountsFlushed[index] = _closeCounts[index];
+        }
+    }
+}
+
+void CTCPStunThread::ArmTickTimer()
+{
+    int timeout = _timerwheel.GetMillisecondsToNextTick(_timeNow);
+    
+    // -1 means the timer wheel is empty, so the tick timer gets disarmed.  A timer
+    // set to 0 is disarmed too, so a tick that is already due waits 1ms instead
+    if (timeout == 0)
+    {
+        timeout = 1;
+    }
+    
+    _fTickArmed = (timeout > 0);
+    _spPolling->ChangeTimer(_timerTick, _fTickArmed ? (uint32_t)timeout : 0, false);
+}
+
+void CTCPStunThread::ProcessTimerEvent(int timerId)
+{
+    if (timerId == _timerTick)
+    {
+        // close any connection whose deadline has passed, then wait for the next tick
+        CloseExpiredConnections();
+        ArmTickTimer();
+    }
+    else if (timerId == _timerTrim)
+    {
+        TrimPools();
+    }
+    else if (timerId == _timerStats)
+    {
+        FlushStats();
+    }
+}
+
+
+void CTCPStunThread::LogCloseCounts()
+{
+    for (int index = 0; index < (int)CloseReason_Count; index++)
+    {
+        Logging::LogMsg(LL_DEBUG, "TCP connections closed (%s): %llu", GetCloseReasonName((ConnectionCloseReason)index), (unsigned long long)_closeCounts[index]);
+    }
+}
+
+// queues up the responses to requests that were waiting on the auth provider, then goes on with the requests behind them
+void CTCPStunThread::ProcessCompletedRequests()
+{
+    StunMessageOut msgOut;
+    void* pTag = NULL;
+    HRESULT hrResult = S_OK;
+    
+    msgOut.spBufferOut = _spResponseBuffer;
+    
+    while (_asynccontext.GetCompletedRequest(msgOut, &pTag, &hrResult))
+    {
+        // a connection that closed in the meantime canceled its request, so it doesn't come out here
+        StunConnection* pConn = (StunConnection*)pTag;
+        HRESULT hr = hrResult;
+        
+        pConn->_fAuthPending = false;
+        
+        if (SUCCEEDED(hr))
+        {
+            // the buffers may have been given back while the connection waited
+            hr = _bufferpool.AttachBuffers(pConn);
+        }
+        
+        if (SUCCEEDED(hr))
+        {
+            // ProcessRequestsForConnection made sure there was room for this before it started on the request
+            hr = pConn->_bufferOut.Write(_spResponseBuffer->GetData(), _spResponseBuffer->GetSize());
+        }
+        
+        if (FAILED(hr))
+        {
+            CloseConnection(pConn, CloseReason_ProtocolError);
+            continue;
+        }
+        
+        pConn->_fHasResponded = true;
+        
+        ServiceConnection(pConn, 0);
+    }
+}
+
+void CTCPStunThread::ThreadCleanup()
+{
+    CloseAllConnections();
+#ifdef HAS_IOURING
+    if (_fUsingUring)
+    {
+        DrainUring();
+    }
+#endif
+    LogCloseCounts();
+}
 
-            pConn = NULL;
-            break;
-        }
-        // loop back and try to send the remaining bytes
+
+#ifdef HAS_IOURING
+
+HRESULT CTCPStunThread::InitUring()
+{
+    HRESULT hr = S_OK;
+    uint32_t completionEntries = c_uringEntries;
+    const uint8_t requiredOps[] = {IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SENDMSG, IORING_OP_ASYNC_CANCEL, IORING_OP_POLL_ADD};
+    
+    // every connection can have a receive and a send in flight, plus the cancellations for both when it closes
+    while ((completionEntries < 4 * (uint32_t)_maxConnections) && (completionEntries < 65536))
+    {
+        completionEntries *= 2;
+    }
+    
+    Chk(_uring.Init(c_uringEntries, completionEntries));
+    
+    for (size_t index = 0; index < ARRAYSIZE(requiredOps); index++)
+    {
+        ChkIf(_uring.IsOpSupported(requiredOps[index]) == false, E_NOTIMPL);
     }
     
-Cleanup:    
-    if ((FAILED(hr) || fForceClose))
+    // Buffer rings came with the same kernel release as multishot accept (5.19), so this
+    // succeeding also means the accepts below will work
+    Chk(_uring.RegisterBufferRing(c_uringBufferGroup, c_uringBufferCount, CONNECTION_INPUT_BUFFER_SIZE));
+    
+    // some kernels fail an io_uring accept on a non-blocking socket with EAGAIN instead of waiting for a connection
+    for (size_t r = 0; r < ARRAYSIZE(_socketTable); r++)
     {
-        CloseConnection(pConn);
+        if (_socketTable[r] != -1)
+        {
+            ChkA(_socketListenArray[r].SetNonBlocking(false));
+        }
     }
     
+    _fUsingUring = true;
+    
+Cleanup:
+    if (FAILED(hr))
+    {
+        _uring.Close();
+    }
     return hr;
 }
 
-void CTCPStunThread::CloseConnection(StunConnection* pConn)
+void CTCPStunThread::RunUring()
 {
-    if (pConn)
+    HRESULT hr = S_OK;
+    io_uring_sqe* pSqe = NULL;
+    
+    Logging::LogMsg(LL_DEBUG, "Starting TCP listening thread with io_uring (%d sockets)\n", _countSocks);
+    
+    _timeNow = GetMonotonicMilliseconds();
+    
+    // the pipe gets a poll request, so Stop can wake this thread up
+    pSqe = _uring.GetSqe();
+    if (pSqe)
     {
-        int sock = pConn->_stunsocket.GetSocketHandle();
+        pSqe->opcode = IORING_OP_POLL_ADD;
+        pSqe->fd = _pipe[0];
+        pSqe->poll32_events = POLLIN;
+        pSqe->user_data = URING_TAG_PIPE;
+        _fPipeArmed = true;
+    }
+    
+    if (_fAsyncAuth)
+    {
+        SubmitUringAuthNotify();
+    }
+    
+    while (_fNeedToExit == false)
+    {
+        int timeout = GetTimeoutMilliseconds();
         
-        Logging::LogMsg(LL_VERBOSE, "Closing socket %d\n", sock);
+        // keep accepts in flight as long as there's room for more connections
+        UpdateUringAccepts();
         
-        _spPolling->Remove(pConn->_stunsocket.GetSocketHandle());
-        pConn->_stunsocket.Close();
+        // one system call submits everything queued up since the last one, and waits for the next completion
+        hr = _uring.Enter(1, timeout);
+        if (FAILED(hr))
+        {
+            Logging::LogMsg(LL_ALWAYS, "io_uring wait failed (hr == %x). TCP thread exiting", hr);
+            _fNeedToExit = true;
+            break;
+        }
+        
+        _timeNow = GetMonotonicMilliseconds();
         
-        // now figure out which hash table we were in
-        if (pConn->_idHashTable == 1)
+        ReapUringCompletions();
+        
+        // close any connection whose deadline has passed
+        CloseExpiredConnections();
+        
+        if (_timeNow >= _timeNextTrim)
         {
-            VERIFY(_hashConnections1.Remove(sock) != -1);
+            TrimPools();
+            _timeNextTrim = _timeNow + c_poolTrimIntervalMilliseconds;
         }
-        else if (pConn->_idHashTable == 2)
+        
+        if (_timeNow >= _timeNextStats)
         {
-            VERIFY(_hashConnections2.Remove(sock) != -1);
+            FlushStats();
+            _timeNextStats = _timeNow + c_statsIntervalMilliseconds;
         }
-        else
+    }
+    
+    ThreadCleanup();
+    
+    Logging::LogMsg(LL_DEBUG, "TCP Thread exiting");
+}
+
+void CTCPStunThread::ReapUringCompletions()
+{
+    io_uring_cqe* pCqe = NULL;
+    
+    while ((pCqe = _uring.PeekCqe()) != NULL)
+    {
+        // copy out the completion and hand the slot back before processing it. Processing can queue more requests.
+        uint64_t userdata = pCqe->user_data;
+        int result = pCqe->res;
+        uint32_t flags = pCqe->flags;
+        
+        _uring.AdvanceCq();
+        
+        ProcessUringCompletion(userdata, result, flags);
+    }
+}
+
+void CTCPStunThread::ProcessUringCompletion(uint64_t userdata, int result, uint32_t flags)
+{
+    StunConnection* pConn = (StunConnection*)(uintptr_t)(userdata & ~URING_TAG_MASK);
+    
+    switch (userdata & URING_TAG_MASK)
+    {
+        case URING_TAG_ACCEPT:
+            OnUringAccept((int)(userdata >> URING_TAG_BITS), result, flags);
+            break;
+        case URING_TAG_RECEIVE:
+            OnUringReceive(pConn, result, flags);
+            break;
+        case URING_TAG_SEND:
+            OnUringSend(pConn, result);
+            break;
+        case URING_TAG_PIPE:
+            // Stop signaled the thread (or the poll got canceled on the way out)
+            _fPipeArmed = false;
+            break;
+        case URING_TAG_AUTH:
+            // the poll is one-shot, so it goes back in after the completed requests are picked up
+            _fAuthNotifyArmed = false;
+            if (_fNeedToExit == false)
+            {
+                ProcessCompletedRequests();
+                SubmitUringAuthNotify();
+            }
+            break;
+        default:
+            // the result of a cancellation.  The canceled request gets a completion of its own
+            break;
+    }
+}
+
+void CTCPStunThread::UpdateUringAccepts()
+{
+    bool fAtMax = IsConnectionCountAtMax();
+    bool fMultishot = ((size_t)_maxConnections >= _connectionCount + c_uringMultishotHeadroom);
+    
+    for (size_t r = 0; r < ARRAYSIZE(_socketTable); r++)
+    {
+        if (_socketTable[r] == -1)
         {
-            ASSERT(pConn->_idHashTable == -1);
+            continue;
         }
         
-        _connectionpool.ReleaseConnection(pConn);
+        if ((fAtMax == false) && (_fAcceptArmed[r] == false))
+        {
+            SubmitUringAccept((int)r, fMultishot);
+        }
+        else if ((fAtMax || (_fAcceptMultishot[r] && (fMultishot == false))) && _fAcceptArmed[r] && (_fAcceptCanceling[r] == false))
+        {
+            // New connections wait in the backlog until the cancellation goes through.
+            // Then a single accept replaces the multishot one, or at the limit, nothing does.
+            if (SUCCEEDED(SubmitUringCancel(((uint64_t)r << URING_TAG_BITS) | URING_TAG_ACCEPT)))
+            {
+                _fAcceptCanceling[r] = true;
+            }
+        }
+    }
+}
+
+HRESULT CTCPStunThread::SubmitUringAccept(int role, bool fMultishot)
+{
+    HRESULT hr = S_OK;
+    io_uring_sqe* pSqe = _uring.GetSqe();
+    
+    ChkIf(pSqe == NULL, E_FAIL);
+    
+    // a multishot accept keeps posting a completion for every new connection until it gets canceled (or fails)
+    pSqe->opcode = IORING_OP_ACCEPT;
+    pSqe->fd = _socketTable[role];
+    pSqe->ioprio = fMultishot ? IORING_ACCEPT_MULTISHOT : 0;
+    pSqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    pSqe->user_data = ((uint64_t)role << URING_TAG_BITS) | URING_TAG_ACCEPT;
+    
+    _fAcceptArmed[role] = true;
+    _fAcceptMultishot[role] = fMultishot;
+    
+Cleanup:
+    return hr;
+}
+
+HRESULT CTCPStunThread::SubmitUringReceive(StunConnection* pConn)
+{
+    HRESULT hr = S_OK;
+    io_uring_sqe* pSqe = _uring.GetSqe();
+    size_t freespace = (pConn->_pBufferBlock != NULL) ? pConn->_bufferIn.GetFreeSpace() : (CONNECTION_INPUT_BUFFER_SIZE - pConn->_carryoverSize);
+    
+    ChkIf(pSqe == NULL, E_FAIL);
+    
+    // The kernel picks a buffer from the ring when the data arrives, so an idle connection waiting on
+    // a receive doesn't tie up any memory.  Asking for no more than the input buffer can take keeps
+    // the same backpressure as the polling loop.
+    pSqe->opcode = IORING_OP_RECV;
+    pSqe->fd = pConn->_stunsocket.GetSocketHandle();
+    pSqe->len = (uint32_t)std::min(freespace, (size_t)_uring.GetBufferSize());
+    pSqe->flags = IOSQE_BUFFER_SELECT;
+    pSqe->buf_group = c_uringBufferGroup;
+    pSqe->user_data = (uint64_t)(uintptr_t)pConn | URING_TAG_RECEIVE;
+    
+    pConn->_uringPending |= CONNECTION_URING_RECEIVE;
+    
+Cleanup:
+    return hr;
+}
+
+HRESULT CTCPStunThread::SubmitUringSend(StunConnection* pConn)
+{
+    HRESULT hr = S_OK;
+    io_uring_sqe* pSqe = _uring.GetSqe();
+    size_t numregions;
+    
+    ChkIf(pSqe == NULL, E_FAIL);
+    
+    // the pending responses go out with a single sendmsg, even when they wrap around the end of the ring buffer
+    numregions = pConn->_bufferOut.GetReadRegions(pConn->_sendRegions, pConn->_bufferOut.GetSize());
+    
+    memset(&pConn->_sendMsg, 0, sizeof(pConn->_sendMsg));
+    pConn->_sendMsg.msg_iov = pConn->_sendRegions;
+    pConn->_sendMsg.msg_iovlen = numregions;
+    
+    pSqe->opcode = IORING_OP_SENDMSG;
+    pSqe->fd = pConn->_stunsocket.GetSocketHandle();
+    pSqe->addr = (uint64_t)(uintptr_t)&pConn->_sendMsg;
+    pSqe->len = 1;
+    pSqe->msg_flags = MSG_NOSIGNAL;
+    pSqe->user_data = (uint64_t)(uintptr_t)pConn | URING_TAG_SEND;
+    
+    pConn->_uringPending |= CONNECTION_URING_SEND;
+    
+Cleanup:
+    return hr;
+}
+
+HRESULT CTCPStunThread::SubmitUringCancel(uint64_t userdata)
+{
+    HRESULT hr = S_OK;
+    io_uring_sqe* pSqe = _uring.GetSqe();
+    
+    ChkIf(pSqe == NULL, E_FAIL);
+    
+    pSqe->opcode = IORING_OP_ASYNC_CANCEL;
+    pSqe->fd = -1;
+    pSqe->addr = userdata;
+    pSqe->user_data = URING_TAG_CANCEL;
+    
+Cleanup:
+    return hr;
+}
+
+HRESULT CTCPStunThread::SubmitUringAuthNotify()
+{
+    HRESULT hr = S_OK;
+    io_uring_sqe* pSqe = _uring.GetSqe();
+    
+    ChkIf(pSqe == NULL, E_FAIL);
+    
+    pSqe->opcode = IORING_OP_POLL_ADD;
+    pSqe->fd = _asynccontext.GetNotifyFd();
+    pSqe->poll32_events = POLLIN;
+    pSqe->user_data = URING_TAG_AUTH;
+    _fAuthNotifyArmed = true;
+    
+Cleanup:
+    return hr;
+}
+
+HRESULT CTCPStunThread::SubmitUringRequests(StunConnection* pConn)
+{
+    HRESULT hr = S_OK;
+    bool fHasBuffers = (pConn->_pBufferBlock != NULL);
+    bool fOutputPending = fHasBuffers && (pConn->_bufferOut.IsEmpty() == false);
+    bool fInputFull = fHasBuffers && pConn->_bufferIn.IsFull();
+    
+    // At most one receive and one send in flight.  Same as the event set in the polling loop,
+    // reads stop when there's no place to put the bytes or the client has shut down its end.
+    if (((pConn->_uringPending & CONNECTION_URING_RECEIVE) == 0) && (fInputFull == false) && (pConn->_fPeerClosed == false))
+    {
+        Chk(SubmitUringReceive(pConn));
+    }
+    
+    if (((pConn->_uringPending & CONNECTION_URING_SEND) == 0) && fOutputPending)
+    {
+        Chk(SubmitUringSend(pConn));
+    }
+    
+Cleanup:
+    return hr;
+}
+
+void CTCPStunThread::OnUringAccept(int role, int result, uint32_t flags)
+{
+    StunConnection* pConn = NULL;
+    
+    if ((flags & IORING_CQE_F_MORE) == 0)
+    {
+        // the accept is done - a single accept, or a multishot accept that got canceled or failed.
+        // UpdateUringAccepts submits another if needed
+        _fAcceptArmed[role] = false;
+        _fAcceptMultishot[role] = false;
+        _fAcceptCanceling[role] = false;
+    }
+    
+    if (result < 0)
+    {
+        if (result != -ECANCELED)
+        {
+            Logging::LogMsg(LL_DEBUG, "io_uring accept failed (errno == %d)", -result);
+        }
+        return;
+    }
+    
+    Logging::LogMsg(LL_VERBOSE, "io_uring accept returns %d", result);
+    
+    if (_fNeedToExit || IsConnectionCountAtMax())
+    {
+        // a multishot accept took more than the headroom it was given
+        if (ShouldResetOnClose(CloseReason_Rejected))
+        {
+            SetResetOnClose(result);
+        }
+        close(result);
+        _closeCounts[CloseReason_Rejected]++;
+        return;
+    }
+    
+    AdmitConnection(result, (SocketRole)role, NULL, &pConn);
+    
+    if (pConn)
+    {
+        // gets the first receive in flight
+        if (FAILED(UpdateConnectionState(pConn, false)))
+        {
+            CloseConnection(pConn, CloseReason_ConnectionError);
+        }
+    }
+}
+
+void CTCPStunThread::OnUringReceive(StunConnection* pConn, int result, uint32_t flags)
+{
+    HRESULT hr = S_OK;
+    uint16_t bufferId = (uint16_t)(flags >> IORING_CQE_BUFFER_SHIFT);
+    
+    pConn->_uringPending &= ~CONNECTION_URING_RECEIVE;
+    
+    Logging::LogMsg(LL_VERBOSE, "io_uring receive on socket %d returns %d", pConn->_stunsocket.GetSocketHandle(), result);
+    
+    if (pConn->_fClosing == false)
+    {
+        if (result > 0)
+        {
+            hr = _bufferpool.AttachBuffers(pConn);
+            if (SUCCEEDED(hr))
+            {
+                hr = pConn->_bufferIn.Write(_uring.GetBuffer(bufferId), (size_t)result);
+            }
+        }
+        else if (result == 0)
+        {
+            // The client shut down its end.  Anything it sent before that still gets answered.
+            pConn->_fPeerClosed = true;
+        }
+        else if (result != -ENOBUFS)
+        {
+            // ENOBUFS just means every buffer in the ring was in use - the receive gets submitted again below
+            hr = E_FAIL;
+        }
+    }
+    
+    if (flags & IORING_CQE_F_BUFFER)
+    {
+        _uring.ReturnBuffer(bufferId);
+    }
+    
+    if (pConn->_fClosing)
+    {
+        OnUringClosingComplete(pConn);
+    }
+    else if (FAILED(hr))
+    {
+        CloseConnection(pConn, CloseReason_ConnectionError);
+    }
+    else
+    {
+        // the bytes are already in the input buffer
+        ServiceConnection(pConn, 0);
     }
 }
 
+void CTCPStunThread::OnUringSend(StunConnection* pConn, int result)
+{
+    pConn->_uringPending &= ~CONNECTION_URING_SEND;
+    
+    Logging::LogMsg(LL_VERBOSE, "io_uring send on socket %d returns %d", pConn->_stunsocket.GetSocketHandle(), result);
+    
+    if (pConn->_fClosing)
+    {
+        OnUringClosingComplete(pConn);
+        return;
+    }
+    
+    if (result <= 0)
+    {
+        CloseConnection(pConn, CloseReason_ConnectionError);
+        return;
+    }
+    
+    pConn->_bufferOut.Consume((size_t)result);
+    
+    // the output buffer has room again, so any requests that were held back can be processed now
+    ServiceConnection(pConn, 0);
+}
 
-void CTCPStunThread::CloseAllConnections(StunThreadConnectionMap* pConnMap)
+void CTCPStunThread::OnUringClosingComplete(StunConnection* pConn)
 {
-    StunThreadConnectionMap::Item* pItem = pConnMap->LookupByIndex(0);
-    while (pItem)
+    if (pConn->_uringPending == 0)
     {
-        CloseConnection(pItem->value);
-        pItem = pConnMap->LookupByIndex(0);
+        ASSERT(_closingCount > 0);
+        _closingCount--;
+        FreeConnection(pConn);
     }
 }
 
-void CTCPStunThread::SweepDeadConnections()
+void CTCPStunThread::DrainUring()
 {
-    time_t timeCurrent = time(NULL);
-    StunThreadConnectionMap* pSwap = NULL;
+    uint64_t timeStart = GetMonotonicMilliseconds();
     
-    // should we try to scale the timeout based on the active number of connections?
+    // the connections are all closed (or closing), so the only other requests left are the accepts and the pipe poll
+    for (size_t r = 0; r < ARRAYSIZE(_socketTable); r++)
+    {
+        if (_fAcceptArmed[r] && (_fAcceptCanceling[r] == false))
+        {
+            SubmitUringCancel(((uint64_t)r << URING_TAG_BITS) | URING_TAG_ACCEPT);
+            _fAcceptCanceling[r] = true;
+        }
+    }
+    if (_fPipeArmed)
+    {
+        SubmitUringCancel(URING_TAG_PIPE);
+    }
+    if (_fAuthNotifyArmed)
+    {
+        SubmitUringCancel(URING_TAG_AUTH);
+    }
     
-    if ((timeCurrent - _timeLastSweep) >= c_sweepTimeoutSeconds)
+    while ((_closingCount > 0) || _fPipeArmed || _fAuthNotifyArmed || _fAcceptArmed[0] || _fAcceptArmed[1] || _fAcceptArmed[2] || _fAcceptArmed[3])
     {
-        if  (_pOldConnList->Size())
+        if ((GetMonotonicMilliseconds() - timeStart) > c_uringDrainMilliseconds)
         {
-            Logging::LogMsg(LL_VERBOSE, "SweepDeadConnections closing %d connections", _pOldConnList->Size());
+            // Whatever hasn't completed yet stays allocated - the kernel might still write to it.
+            // Closing the ring in Reset ends all of it.
+            Logging::LogMsg(LL_DEBUG, "io_uring requests still pending at shutdown (%d connections)", (int)_closingCount);
+            break;
         }
         
-        CloseAllConnections(_pOldConnList);
-        
-        _timeLastSweep = time(NULL);
-        
+        if (FAILED(_uring.Enter(1, 100)))
+        {
+            break;
+        }
         
-        pSwap = _pOldConnList;
-        _pOldConnList = _pNewConnList;
-        _pNewConnList = pSwap;
+        ReapUringCompletions();
     }
 }
 
+#endif // HAS_IOURING
 
-void CTCPStunThread::ThreadCleanup()
-{
-    CloseAllConnections(_pOldConnList);
-    CloseAllConnections(_pNewConnList);
-}
 
 
 
@@ -839,7 +2209,20 @@ HRESULT CTCPServer::Initialize(const CStunServerConfig& config)
     
     // optional code: create an authentication provider and initialize it here (if you want authentication)
     // set the _spAuth member to reference it
-    // Chk(CYourAuthProvider::CreateInstanceNoInit(&_spAuth));    
+    // Chk(CYourAuthProvider::CreateInstance(&_spAuth));    
+    if (config.strCredentialsFile.length() > 0)
+    {
+        hr = CStunCredentialAuth::CreateInstance(config.strCredentialsFile.c_str(), _spCredentials.GetPointerPointer());
+        if (FAILED(hr))
+        {
+            Logging::LogMsg(LL_ALWAYS, "Unable to load credentials file %s", config.strCredentialsFile.c_str());
+            Chk(hr);
+        }
+        Logging::LogMsg(LL_DEBUG, "Loaded %u users from %s", _spCredentials->GetCount(), config.strCredentialsFile.c_str());
+        _spAuth = _spCredentials.GetPointer();
+    }
+    
+    Chk(InitDelayedAuth(config, &_spAuth, &_spAsyncAuth));
 
     // tsaHandler is sort of a hack for TCP.  It's really just a glorified indication to the the
     // CStunRequestHandler code to figure out if it can offer a CHANGED-ADDRESS attribute.
@@ -854,6 +2237,12 @@ HRESULT CTCPServer::Initialize(const CStunServerConfig& config)
     InitTSA(&tsaListenAll, RoleAP, config.fHasAP, config.addrAP, CSocketAddress());
     InitTSA(&tsaListenAll, RoleAA, config.fHasAA, config.addrAA, CSocketAddress());
     
+    if (config.fTLS)
+    {
+        Chk(CTlsContext::CreateInstanceNoInit(_spTlsContext.GetPointerPointer()));
+        Chk(_spTlsContext->InitServer(config.strTlsCertificateFile.c_str(), config.strTlsPrivateKeyFile.c_str()));
+    }
+    
     if (config.fEnableDosProtection)
     {
         spLimiter = boost::shared_ptr<RateLimiter>(new RateLimiter(20000, config.fMultiThreadedMode));
@@ -863,7 +2252,7 @@ HRESULT CTCPServer::Initialize(const CStunServerConfig& config)
     {
         _threads[0] = new CTCPStunThread();
         
-        ChkA(_threads[0]->Init(tsaListenAll, tsaHandler, _spAuth, config.nMaxConnections, spLimiter));
+        ChkA(_threads[0]->Init(tsaListenAll, tsaHandler, _spAuth, _spAsyncAuth, _spTlsContext, config, spLimiter));
     }
     else
     {
@@ -887,7 +2276,7 @@ HRESULT CTCPServer::Initialize(const CStunServerConfig& config)
                
                 _threads[threadindex] = new CTCPStunThread();
 
-                Chk(_threads[threadindex]->Init(tsaListen, tsaHandler, _spAuth, config.nMaxConnections, spLimiter));
+                Chk(_threads[threadindex]->Init(tsaListen, tsaHandler, _spAuth, _spAsyncAuth, _spTlsContext, config, spLimiter));
             }
         }
     }
@@ -910,6 +2299,9 @@ HRESULT CTCPServer::Shutdown()
     }
     
     _spAuth.ReleaseAndClear();
+    _spCredentials.ReleaseAndClear();
+    _spAsyncAuth.ReleaseAndClear();
+    _spTlsContext.ReleaseAndClear();
     
     return S_OK;
 }
@@ -937,6 +2329,28 @@ HRESULT CTCPServer::Stop()
     return S_OK;
 }
 
+HRESULT CTCPServer::ReloadCredentials()
+{
+    HRESULT hr = S_OK;
+
+    if (_spCredentials == NULL)
+    {
+        return S_FALSE;
+    }
+
+    hr = _spCredentials->Reload();
+    if (FAILED(hr))
+    {
+        Logging::LogMsg(LL_ALWAYS, "Unable to reload the credentials file - keeping the users already loaded");
+    }
+    else
+    {
+        Logging::LogMsg(LL_DEBUG, "Reloaded credentials file with %u users", _spCredentials->GetCount());
+    }
+
+    return hr;
+}
+
 
 
 
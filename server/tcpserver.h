@@ -21,17 +21,46 @@
 #include "stuncore.h"
 #include "stunauth.h"
 #include "server.h"
-#include "fasthash.h"
 #include "messagehandler.h"
 #include "stunconnection.h"
 #include "polling.h"
 #include "ratelimiter.h"
+#include "timerwheel.h"
+#include "uring.h"
 
 
 
 class CTCPStunThread
 {
-    static const int c_sweepTimeoutSeconds = 60;
+    // a connection that hasn't started sending a request gets closed after this long
+    static const uint32_t c_idleTimeoutMilliseconds = 60000;
+    // once the first bytes of a request arrive, the rest of the message has to show up within this window
+    static const uint32_t c_readTimeoutMilliseconds = 10000;
+    // a client that won't drain the response within this window gets dropped
+    static const uint32_t c_writeTimeoutMilliseconds = 10000;
+    static const uint32_t c_timerTickMilliseconds = 250;
+    // upper bound on how many expired connections get closed per loop iteration
+    static const int c_maxExpirationsPerIteration = 100;
+    // how often memory that went unused gets released from the connection and buffer pools
+    static const uint32_t c_poolTrimIntervalMilliseconds = 30000;
+    // how often the connection counters get written to the debug log (when something changed)
+    static const uint32_t c_statsIntervalMilliseconds = 60000;
+    // after its last response, this is how long a connection is held open waiting for the client to close it.
+    // Unless --closewait says otherwise, an answered connection gets as long as one that hasn't sent anything yet
+    static const uint32_t c_closeWaitMillisecondsDefault = c_idleTimeoutMilliseconds;
+    // a TLS client has this long to complete its handshake
+    static const uint32_t c_handshakeTimeoutMilliseconds = 10000;
+    // upper bound on how many pending connections get pulled off a listen socket's backlog per wakeup
+    static const int c_maxAcceptsPerWakeup = 64;
+    // io_uring mode: submission queue size, and the receive buffers shared by all the connections on the thread
+    static const uint32_t c_uringEntries = 1024;
+    static const uint32_t c_uringBufferCount = 256;
+    static const uint16_t c_uringBufferGroup = 0;
+    // io_uring mode: a multishot accept takes everything in a listen socket's backlog at once.  It's only used
+    // while there's room for a full backlog - closer to the connection limit, accepts go one at a time.
+    static const int c_uringMultishotHeadroom = 128;
+    // io_uring mode: how long the thread waits on cancelled requests when it exits
+    static const int c_uringDrainMilliseconds = 2000;
     
     
     int _pipe[2];
@@ -58,15 +87,53 @@ class CTCPStunThread
     
     bool _fNeedToExit;
     CRefCountedPtr<IStunAuth> _spAuth;
+    CStunKeyCache _keycache;   // long term keys derived for authenticated requests
+    CStunRequestContext _requestcontext; // the request handler, reused for every request on every connection
+    CStunAsyncRequestContext _asynccontext; // used instead of _requestcontext when the auth provider is asynchronous
+    bool _fAsyncAuth;
+    bool _fAuthNotifyArmed;      // io_uring mode: a poll is in flight for _asynccontext's notification fd
+    CRefCountedPtr<CTlsContext> _spTlsContext; // NULL unless the listen sockets are TLS
     SocketRole _role;
     
     TransportAddressSet _tsa;  // this
     int _maxConnections;
+    int _tcpFastOpenQueueLength; // zero if TCP_FASTOPEN is not enabled
+    int _deferAcceptSeconds;     // zero if TCP_DEFER_ACCEPT is not enabled
+    bool _fOrderlyClose;         // if false, connections this side gives up on are reset instead of getting a FIN
+    uint32_t _closeWaitMilliseconds;
+    
+    uint64_t _closeCounts[CloseReason_Count];
+    uint64_t _closeCountsFlushed[CloseReason_Count]; // _closeCounts as of the last FlushStats
     
     pthread_t _pthread;
     bool _fThreadIsValid;
     
+    // In io_uring mode (plain TCP only), accepts, receives, and sends are all io_uring requests
+    // instead of readiness events followed by system calls.  Everything queued up while handling
+    // one batch of completions goes to the kernel with the call that waits for the next batch.
+    bool _fUsingUring;
+#ifdef HAS_IOURING
+    CUring _uring;
+#endif
+    bool _fAcceptArmed[4];     // an accept is in flight for the listen socket
+    bool _fAcceptMultishot[4]; // ... and it is a multishot accept
+    bool _fAcceptCanceling[4];
+    bool _fPipeArmed;
+    size_t _closingCount;      // closed connections waiting on their in-flight requests
+    
     CConnectionPool _connectionpool;
+    CConnectionBufferPool _bufferpool;
+    uint64_t _timeNextTrim;
+    uint64_t _timeNextStats;
+    
+    // Housekeeping is driven by timers on the polling instance (not used in io_uring mode, where
+    // the deadlines above are checked once per batch of completions instead)
+    //    _timerTick is a one-shot timer, only armed while the timer wheel has connections on it
+    //    _timerTrim and _timerStats are periodic
+    int _timerTick;
+    int _timerTrim;
+    int _timerStats;
+    bool _fTickArmed;
     
     // this is the function that runs in a thread
     void Run();
@@ -78,33 +145,76 @@ class CTCPStunThread
     // ---------------------------------------------------------------
     // thread data
     
-    // maps socket back to connection
-    typedef FastHashDynamic<int, StunConnection*> StunThreadConnectionMap;
-    
-    StunThreadConnectionMap _hashConnections1;
-    StunThreadConnectionMap _hashConnections2;
+    // maps socket back to connection.  Socket handles are small integers
+    // handed out lowest first, so the table is indexed directly by socket
+    std::vector<StunConnection*> _connectionTable;
+    size_t _connectionCount;
     
-    StunThreadConnectionMap* _pNewConnList;
-    StunThreadConnectionMap* _pOldConnList;
-    time_t _timeLastSweep;
+    CTimerWheel _timerwheel;
+    uint64_t _timeNow;
     
+    // requests are only handed to the reader once they are completely buffered,
+    // so one reader (and one response buffer) is shared by all the connections on this thread
+    CStunMessageReader _reader;
+    CRefCountedBuffer _spReaderBuffer;
+    CRefCountedBuffer _spResponseBuffer;
     
+    HRESULT AddConnectionToTable(StunConnection* pConn);
+    StunConnection* LookupConnection(int sock);
+    void SetConnectionTimeout(StunConnection* pConn, uint32_t timeoutMilliseconds);
     
-    StunConnection* AcceptConnection(CStunSocket* pListenSocket);
+    void AcceptConnections(CStunSocket* pListenSocket);
+    HRESULT AcceptConnection(CStunSocket* pListenSocket, StunConnection** ppConn);
+    HRESULT AdmitConnection(int sock, SocketRole role, const sockaddr_storage* pAddrClient, StunConnection** ppConn);
 
     void ProcessConnectionEvent(int sock, uint32_t eventflags);
     
+    void ServiceConnection(StunConnection* pConn, uint32_t eventflags);
+    HRESULT ContinueHandshake(StunConnection* pConn);
     HRESULT ReceiveBytesForConnection(StunConnection* pConn);
+    HRESULT ReceiveTlsBytesForConnection(StunConnection* pConn);
+    HRESULT ProcessRequestsForConnection(StunConnection* pConn, bool* pfProgress);
+    HRESULT ProcessRequest(StunConnection* pConn, size_t messagesize);
     HRESULT WriteBytesForConnection(StunConnection* pConn);
-    
-    void CloseAllConnections(StunThreadConnectionMap* pConnMap);
-    void SweepDeadConnections();
+    HRESULT WriteTlsBytesForConnection(StunConnection* pConn);
+    HRESULT UpdateConnectionState(StunConnection* pConn, bool fProgress);
+    static HRESULT GetNextMessageSize(const CRingBuffer& buffer, size_t* pMessageSize);
+    
+    void CloseAllConnections();
+    void CloseExpiredConnections();
+    void TrimPools();
+    void FlushStats();
+    void ArmTickTimer();
+    void ProcessTimerEvent(int timerId);
     void ThreadCleanup();
-    int GetTimeoutSeconds();
+    void ProcessCompletedRequests();
+    int GetTimeoutMilliseconds();
     bool IsConnectionCountAtMax();
-    void CloseConnection(StunConnection* pConn);
+    void CloseConnection(StunConnection* pConn, ConnectionCloseReason reason);
+    void FreeConnection(StunConnection* pConn);
+    bool ShouldResetOnClose(ConnectionCloseReason reason);
+    void LogCloseCounts();
     bool RateCheck(const CSocketAddress& addr);
     
+#ifdef HAS_IOURING
+    HRESULT InitUring();
+    void RunUring();
+    void DrainUring();
+    void ReapUringCompletions();
+    void UpdateUringAccepts();
+    HRESULT SubmitUringAccept(int role, bool fMultishot);
+    HRESULT SubmitUringReceive(StunConnection* pConn);
+    HRESULT SubmitUringSend(StunConnection* pConn);
+    HRESULT SubmitUringCancel(uint64_t userdata);
+    HRESULT SubmitUringAuthNotify();
+    HRESULT SubmitUringRequests(StunConnection* pConn);
+    void ProcessUringCompletion(uint64_t userdata, int result, uint32_t flags);
+    void OnUringAccept(int role, int result, uint32_t flags);
+    void OnUringReceive(StunConnection* pConn, int result, uint32_t flags);
+    void OnUringSend(StunConnection* pConn, int result);
+    void OnUringClosingComplete(StunConnection* pConn);
+#endif
+    
     // thread members
     
     // ---------------------------------------------------------------
@@ -115,7 +225,10 @@ public:
     
     // tsaListen are the set of addresses we listen to connections on (either 1 address or 4 addresses)
     // tsaHandler is what gets passed to the CStunRequestHandler for formation of the "other-address" attribute
-    HRESULT Init(const TransportAddressSet& tsaListen, const TransportAddressSet& tsaHandler, IStunAuth* pAuth, int maxConnections, boost::shared_ptr<RateLimiter>& spLimiter);
+    // config supplies the per-thread connection limit and the listen socket options
+    // pTlsContext is NULL for plain TCP, otherwise every accepted connection starts with a TLS handshake
+    // pAsyncAuth is optional - when set, a connection waiting on an auth check doesn't hold up the others
+    HRESULT Init(const TransportAddressSet& tsaListen, const TransportAddressSet& tsaHandler, IStunAuth* pAuth, IStunAsyncAuth* pAsyncAuth, CTlsContext* pTlsContext, const CStunServerConfig& config, boost::shared_ptr<RateLimiter>& spLimiter);
     HRESULT Start();
     HRESULT Stop();
 };
@@ -130,6 +243,9 @@ private:
     CTCPStunThread* _threads[4];
     
     CRefCountedPtr<IStunAuth> _spAuth;
+    CRefCountedPtr<CStunCredentialAuth> _spCredentials; // same object as _spAuth when there's a credentials file
+    CRefCountedPtr<IStunAsyncAuth> _spAsyncAuth;        // same object as _spAuth with --authdelay
+    CRefCountedPtr<CTlsContext> _spTlsContext; // shared by all threads, so session tickets from one thread are good on any of them
     
     void InitTSA(TransportAddressSet* pTSA, SocketRole role, bool fValid, const CSocketAddress& addrListen, const CSocketAddress& addrAdvertise);
     
@@ -144,6 +260,9 @@ public:
     HRESULT Start();
     HRESULT Stop();
     
+    // maps the credentials file again (SIGHUP).  S_FALSE if there isn't one
+    HRESULT ReloadCredentials();
+    
     ADDREF_AND_RELEASE_IMPL();    
     
 };
@@ -0,0 +1,305 @@
+/*
+   Copyright 2011 John Selbie
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "commonincludes.hpp"
+#include "stuncore.h"
+#include "asyncrequestcontext.h"
+
+
+CStunAsyncRequestContext::CStunAsyncRequestContext() :
+_pAuth(NULL),
+_readyIndex(0)
+{
+    _fdNotify[0] = _fdNotify[1] = -1;
+    pthread_mutex_init(&_lock, NULL);
+}
+
+CStunAsyncRequestContext::~CStunAsyncRequestContext()
+{
+    Reset();
+    pthread_mutex_destroy(&_lock);
+}
+
+HRESULT CStunAsyncRequestContext::Init(IStunAsyncAuth* pAuth, size_t maxPending)
+{
+    HRESULT hr = S_OK;
+    
+    ChkIfA(_pAuth != NULL, E_UNEXPECTED);
+    ChkIfA(pAuth == NULL, E_INVALIDARG);
+    ChkIfA(maxPending == 0, E_INVALIDARG);
+    
+#ifdef HAS_EVENTFD
+    _fdNotify[0] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    ChkIf(_fdNotify[0] == -1, ERRNO_TO_HRESULT(errno));
+    _fdNotify[1] = _fdNotify[0];
+#else
+    ChkIf(pipe(_fdNotify) == -1, ERRNO_TO_HRESULT(errno));
+    fcntl(_fdNotify[0], F_SETFL, fcntl(_fdNotify[0], F_GETFL) | O_NONBLOCK);
+    fcntl(_fdNotify[1], F_SETFL, fcntl(_fdNotify[1], F_GETFL) | O_NONBLOCK);
+#endif
+    
+    // everything a parked request needs is allocated now
+    for (size_t index = 0; index < maxPending; index++)
+    {
+        Slot* pSlot = new Slot();
+        
+        pSlot->spReaderBuffer = CRefCountedBuffer(new CBuffer(MAX_STUN_MESSAGE_SIZE));
+        pSlot->msgOut.spBufferOut = CRefCountedBuffer(new CBuffer(MAX_STUN_MESSAGE_SIZE));
+        pSlot->pTag = NULL;
+        pSlot->fInUse = false;
+        pSlot->fCanceled = false;
+        pSlot->hrAuth = S_OK;
+        
+        _slots.push_back(pSlot);
+        _free.push_back(pSlot);
+    }
+    
+    _completed.reserve(maxPending);
+    _ready.reserve(maxPending);
+    _readyIndex = 0;
+    
+    _pAuth = pAuth;
+    
+Cleanup:
+    if (FAILED(hr))
+    {
+        Reset();
+    }
+    return hr;
+}
+
+void CStunAsyncRequestContext::Reset()
+{
+    // a slot can't be freed while the provider might still write to it
+    while (_free.size() < _slots.size())
+    {
+        pthread_mutex_lock(&_lock);
+        _free.insert(_free.end(), _completed.begin(), _completed.end());
+        _completed.clear();
+        pthread_mutex_unlock(&_lock);
+        
+        for (; _readyIndex < _ready.size(); _readyIndex++)
+        {
+            _free.push_back(_ready[_readyIndex]);
+        }
+        
+        if (_free.size() < _slots.size())
+        {
+            usleep(1000);
+        }
+    }
+    
+    for (size_t index = 0; index < _slots.size(); index++)
+    {
+        delete _slots[index];
+    }
+    
+    _slots.clear();
+    _free.clear();
+    _ready.clear();
+    _readyIndex = 0;
+    
+    if (_fdNotify[0] != -1)
+    {
+        close(_fdNotify[0]);
+    }
+    if ((_fdNotify[1] != -1) && (_fdNotify[1] != _fdNotify[0]))
+    {
+        close(_fdNotify[1]);
+    }
+    _fdNotify[0] = _fdNotify[1] = -1;
+    
+    _pAuth = NULL;
+}
+
+int CStunAsyncRequestContext::GetNotifyFd()
+{
+    return _fdNotify[0];
+}
+
+HRESULT CStunAsyncRequestContext::ProcessRequest(const StunMessageIn& msgIn, StunMessageOut& msgOut, TransportAddressSet* pAddressSet, /*optional*/ CStunKeyCache* pKeyCache, void* pTag)
+{
+    HRESULT hr = S_OK;
+    Slot* pSlot = NULL;
+    
+    ChkIfA(_pAuth == NULL, E_UNEXPECTED);
+    
+    if (_free.empty())
+    {
+        // every slot is waiting on the provider already - this request waits on it right here
+        return _syncContext.ProcessRequest(msgIn, msgOut, pAddressSet, _pAuth, pKeyCache);
+    }
+    
+    pSlot = _free.back();
+    _free.pop_back();
+    pSlot->fInUse = true;
+    pSlot->fCanceled = false;
+    pSlot->hrAuth = S_OK;
+    pSlot->pTag = pTag;
+    
+    hr = pSlot->handler.BeginAsyncRequest(msgIn, msgOut, pAddressSet, _pAuth, pKeyCache, this, pSlot);
+    
+    if (SUCCEEDED(hr) && pSlot->handler._fAuthPending)
+    {
+        // the callback may have come in already, but GetCompletedRequest (this thread) won't look at the slot before it's parked
+        ParkRequest(pSlot, msgIn, msgOut);
+        return E_PENDING;
+    }
+    
+    // the provider answered right away
+    if (SUCCEEDED(hr))
+    {
+        hr = pSlot->handler.FinishRequest();
+    }
+    
+    FreeSlot(pSlot);
+    
+Cleanup:
+    return hr;
+}
+
+// copies the request into the slot and points the handler at the copy
+void CStunAsyncRequestContext::ParkRequest(Slot* pSlot, const StunMessageIn& msgIn, const StunMessageOut& msgOut)
+{
+    CDataStream& stream = msgIn.pReader->GetStream();
+    CStunMessageReader::ReaderParseState state;
+    UNREFERENCED_VARIABLE(state); // only referenced in ASSERT
+    
+    pSlot->reader.Reset();
+    pSlot->spReaderBuffer->SetSize(0);
+    pSlot->reader.GetStream().Attach(pSlot->spReaderBuffer, true);
+    state = pSlot->reader.AddBytes(stream.GetDataPointerUnsafe(), (uint32_t)stream.GetSize());
+    ASSERT(state == CStunMessageReader::BodyValidated);
+    
+    pSlot->msgIn = msgIn;
+    pSlot->msgIn.pReader = &pSlot->reader;
+    
+    // BeginRequest already worked out where the response goes
+    pSlot->msgOut.socketrole = msgOut.socketrole;
+    pSlot->msgOut.addrDest = msgOut.addrDest;
+    pSlot->msgOut.spBufferOut->SetSize(0);
+}
+
+void CStunAsyncRequestContext::FreeSlot(Slot* pSlot)
+{
+    pSlot->fInUse = false;
+    pSlot->pTag = NULL;
+    _free.push_back(pSlot);
+}
+
+bool CStunAsyncRequestContext::GetCompletedRequest(StunMessageOut& msgOut, void** ppTag, HRESULT* phrResult)
+{
+    while (true)
+    {
+        Slot* pSlot = NULL;
+        HRESULT hr = S_OK;
+        size_t size = 0;
+        
+        if (_readyIndex >= _ready.size())
+        {
+            _ready.clear();
+            _readyIndex = 0;
+            
+            // a callback that comes in after this leaves the fd signaled for next time
+            ClearNotify();
+            
+            pthread_mutex_lock(&_lock);
+            _ready.swap(_completed);
+            pthread_mutex_unlock(&_lock);
+            
+            if (_ready.empty())
+            {
+                return false;
+            }
+        }
+        
+        pSlot = _ready[_readyIndex++];
+        
+        if (pSlot->fCanceled)
+        {
+            FreeSlot(pSlot);
+            continue;
+        }
+        
+        hr = pSlot->handler.ResumeRequest(pSlot->msgIn, pSlot->msgOut, pSlot->hrAuth);
+        
+        size = pSlot->msgOut.spBufferOut->GetSize();
+        ASSERT(size <= msgOut.spBufferOut->GetAllocatedSize());
+        
+        msgOut.socketrole = pSlot->msgOut.socketrole;
+        msgOut.addrDest = pSlot->msgOut.addrDest;
+        memcpy(msgOut.spBufferOut->GetData(), pSlot->msgOut.spBufferOut->GetData(), size);
+        msgOut.spBufferOut->SetSize(size);
+        
+        *ppTag = pSlot->pTag;
+        *phrResult = hr;
+        
+        FreeSlot(pSlot);
+        return true;
+    }
+}
+
+void CStunAsyncRequestContext::CancelRequests(void* pTag)
+{
+    for (size_t index = 0; index < _slots.size(); index++)
+    {
+        if (_slots[index]->fInUse && (_slots[index]->pTag == pTag))
+        {
+            _slots[index]->fCanceled = true;
+        }
+    }
+}
+
+size_t CStunAsyncRequestContext::GetPendingCount()
+{
+    return _slots.size() - _free.size();
+}
+
+// called by the provider, on any thread
+void CStunAsyncRequestContext::OnAuthCheckComplete(void* pContext, HRESULT hrResult)
+{
+    Slot* pSlot = (Slot*)pContext;
+    
+    pthread_mutex_lock(&_lock);
+    pSlot->hrAuth = hrResult;
+    _completed.push_back(pSlot);
+    pthread_mutex_unlock(&_lock);
+    
+    Notify();
+}
+
+void CStunAsyncRequestContext::Notify()
+{
+#ifdef HAS_EVENTFD
+    uint64_t value = 1;
+    ssize_t ret = write(_fdNotify[1], &value, sizeof(value));
+#else
+    char value = 'x';
+    ssize_t ret = write(_fdNotify[1], &value, sizeof(value));
+#endif
+    UNREFERENCED_VARIABLE(ret); // a full pipe is still readable
+}
+
+void CStunAsyncRequestContext::ClearNotify()
+{
+    uint64_t value = 0;
+    
+    // an eventfd resets on the first read.  A pipe may have several bytes in it
+    while (read(_fdNotify[0], &value, sizeof(value)) > 0)
+    {
+        
+    }
+}
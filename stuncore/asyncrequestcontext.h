@@ -0,0 +1,96 @@
+/*
+   Copyright 2011 John Selbie
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef STUN_ASYNC_REQUEST_CONTEXT_H
+#define STUN_ASYNC_REQUEST_CONTEXT_H
+
+#include "messagehandler.h"
+
+
+// CStunAsyncRequestContext is CStunRequestContext for an IStunAsyncAuth provider.  A request the provider doesn't
+// answer right away gets parked in one of a fixed number of slots, and the socket thread goes on with other requests.
+//    Parking copies the message, so the caller's reader and buffers are free for the next packet as soon as
+//    ProcessRequest returns.
+//    When the provider answers, the notification fd (GetNotifyFd - an eventfd on Linux, a pipe elsewhere) turns
+//    readable.  The socket thread polls it along with its sockets, then calls GetCompletedRequest until it returns false.
+//    With every slot in use, a request gets the provider's blocking DoAuthCheck instead.
+//    Only the provider's callback comes in on another thread.  Reset (and the destructor) wait for the callbacks of
+//    any requests still out with the provider, so the provider has to outlive the context.
+
+class CStunAsyncRequestContext : public IStunAuthCallback
+{
+private:
+    struct Slot
+    {
+        CStunRequestHandler handler;
+        CStunMessageReader reader;
+        CRefCountedBuffer spReaderBuffer;
+        StunMessageIn msgIn;
+        StunMessageOut msgOut;
+        void* pTag;
+        bool fInUse;
+        bool fCanceled;
+        HRESULT hrAuth;   // from the provider's callback
+    };
+    
+    IStunAsyncAuth* _pAuth;
+    std::vector<Slot*> _slots;
+    std::vector<Slot*> _free;
+    std::vector<Slot*> _completed;   // filled in by the callback - guarded by _lock
+    std::vector<Slot*> _ready;       // what the socket thread took out of _completed last
+    size_t _readyIndex;
+    pthread_mutex_t _lock;
+    int _fdNotify[2];                // read and write ends - the same eventfd twice on Linux
+    
+    CStunRequestContext _syncContext;  // for when every slot is in use
+    
+    void ParkRequest(Slot* pSlot, const StunMessageIn& msgIn, const StunMessageOut& msgOut);
+    void FreeSlot(Slot* pSlot);
+    void Notify();
+    void ClearNotify();
+    
+    // not copyable
+    CStunAsyncRequestContext(const CStunAsyncRequestContext&);
+    CStunAsyncRequestContext& operator=(const CStunAsyncRequestContext&);
+    
+public:
+    static const size_t c_defaultMaxPending = 256;
+    
+    CStunAsyncRequestContext();
+    virtual ~CStunAsyncRequestContext();
+    
+    HRESULT Init(IStunAsyncAuth* pAuth, size_t maxPending);
+    void Reset();
+    
+    int GetNotifyFd();
+    
+    // S_OK - the response is in msgOut, same as CStunRequestContext::ProcessRequest.
+    // E_PENDING - the request is parked.  Its response comes out of GetCompletedRequest along with pTag
+    HRESULT ProcessRequest(const StunMessageIn& msgIn, StunMessageOut& msgOut, TransportAddressSet* pAddressSet, /*optional*/ CStunKeyCache* pKeyCache, void* pTag);
+    
+    // the next parked request the provider has answered.  Its response goes in msgOut (the caller allocates
+    // msgOut.spBufferOut) and *phrResult is what ProcessRequest would have returned.  false if there are no more
+    bool GetCompletedRequest(StunMessageOut& msgOut, void** ppTag, HRESULT* phrResult);
+    
+    // parked requests with this tag don't come out of GetCompletedRequest (the TCP connection went away)
+    void CancelRequests(void* pTag);
+    
+    size_t GetPendingCount();
+    
+    virtual void OnAuthCheckComplete(void* pContext, HRESULT hrResult);
+};
+
+#endif
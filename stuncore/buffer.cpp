@@ -18,13 +18,20 @@
 
 #include "commonincludes.hpp"
 #include "buffer.h"
+#include "bufferpool.h"
+#include "atomichelpers.h"
 
 
+// per thread, so counting doesn't put a shared cache line on every allocation
+static __thread int g_allocationCount = 0;
+
 
 CBuffer::CBuffer() :
 _data(NULL),
 _size(0),
-_allocatedSize(0)
+_allocatedSize(0),
+_refcount(0),
+_pPool(NULL)
 {
     ;
 }
@@ -39,7 +46,12 @@ void CBuffer::Reset()
 }
 
 
-CBuffer::CBuffer(size_t nSize)
+CBuffer::CBuffer(size_t nSize) :
+_data(NULL),
+_size(0),
+_allocatedSize(0),
+_refcount(0),
+_pPool(NULL)
 {
     InitWithAllocation(nSize);
 }
@@ -54,6 +66,8 @@ HRESULT CBuffer::InitWithAllocation(size_t size)
     boost::scoped_array<uint8_t> spAlloc(new uint8_t[size+2]); // add two bytes for null termination (makes debugging ascii and unicode strings easier), but these two bytes are invisible to the caller (not included in _allocatedSize)
 
     _spAllocation.swap(spAlloc);
+    
+    g_allocationCount++;
 
     spAlloc.reset();
 
@@ -107,7 +121,12 @@ HRESULT CBuffer::InitWithAllocAndCopy(uint8_t* pByteArray, size_t size)
 }
 
 
-CBuffer::CBuffer(uint8_t* pByteArray, size_t nByteArraySize, bool fCopy)
+CBuffer::CBuffer(uint8_t* pByteArray, size_t nByteArraySize, bool fCopy) :
+_data(NULL),
+_size(0),
+_allocatedSize(0),
+_refcount(0),
+_pPool(NULL)
 {
 
     if (fCopy == false)
@@ -145,5 +164,28 @@ bool CBuffer::IsValid()
     return (_data != NULL);
 }
 
+int CBuffer::GetAllocationCount()
+{
+    return g_allocationCount;
+}
+
 
+void intrusive_ptr_add_ref(CBuffer* pBuffer)
+{
+    AtomicIncrement(&pBuffer->_refcount);
+}
 
+void intrusive_ptr_release(CBuffer* pBuffer)
+{
+    if (AtomicDecrement(&pBuffer->_refcount) == 0)
+    {
+        if (pBuffer->_pPool)
+        {
+            pBuffer->_pPool->Release(pBuffer);
+        }
+        else
+        {
+            delete pBuffer;
+        }
+    }
+}
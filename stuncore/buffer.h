@@ -24,6 +24,8 @@
 
 
 
+class CBufferPool;
+
 class CBuffer
 {
 private:
@@ -31,10 +33,17 @@ private:
     size_t _size;
     size_t _allocatedSize;
     boost::scoped_array<uint8_t> _spAllocation;
+    
+    int _refcount;      // intrusive reference count for CRefCountedBuffer
+    CBufferPool* _pPool; // where the buffer goes when the last reference is released (NULL: it gets deleted)
 
     // disallow copy and assignment.
     CBuffer(const CBuffer&);
     void operator=(const CBuffer& other);
+    
+    friend class CBufferPool;
+    friend void intrusive_ptr_add_ref(CBuffer* pBuffer);
+    friend void intrusive_ptr_release(CBuffer* pBuffer);
 
 
 public:
@@ -60,9 +69,16 @@ public:
     inline uint8_t* GetData() {return _data;}
 
     bool IsValid();
+    
+    // how many times a CBuffer has allocated memory on the calling thread since it started.  Tests and
+    // benchmarks compare this before and after to catch code that allocates per message
+    static int GetAllocationCount();
 };
 
-typedef boost::shared_ptr<CBuffer> CRefCountedBuffer;
+void intrusive_ptr_add_ref(CBuffer* pBuffer);
+void intrusive_ptr_release(CBuffer* pBuffer);
+
+typedef boost::intrusive_ptr<CBuffer> CRefCountedBuffer;
 
 
 #endif
@@ -0,0 +1,181 @@
+/*
+   Copyright 2011 John Selbie
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "commonincludes.hpp"
+#include "bufferpool.h"
+
+
+static pthread_key_t g_keyThreadPool;
+static pthread_once_t g_onceThreadPool = PTHREAD_ONCE_INIT;
+
+static void CloseThreadPool(void* pPool)
+{
+    ((CBufferPool*)pPool)->Close();
+}
+
+static void CreateThreadPoolKey()
+{
+    int ret = pthread_key_create(&g_keyThreadPool, CloseThreadPool);
+    UNREFERENCED_VARIABLE(ret);
+    ASSERT(ret == 0);
+}
+
+
+CBufferPool::CBufferPool() :
+_minFreeSinceTrim(0),
+_countOutstanding(0),
+_countAcquired(0),
+_countCreated(0),
+_fClosed(false)
+{
+    ;
+}
+
+CBufferPool::~CBufferPool()
+{
+    ASSERT(_countOutstanding == 0);
+    
+    for (size_t index = 0; index < _freelist.size(); index++)
+    {
+        delete _freelist[index];
+    }
+    _freelist.clear();
+}
+
+void CBufferPool::Close()
+{
+    ASSERT(_fClosed == false);
+    _fClosed = true;
+    
+    if (_countOutstanding == 0)
+    {
+        delete this;
+    }
+}
+
+CBufferPool* CBufferPool::GetThreadPool()
+{
+    CBufferPool* pPool = NULL;
+    
+    pthread_once(&g_onceThreadPool, CreateThreadPoolKey);
+    
+    pPool = (CBufferPool*)pthread_getspecific(g_keyThreadPool);
+    if (pPool == NULL)
+    {
+        pPool = new CBufferPool();
+        pthread_setspecific(g_keyThreadPool, pPool);
+    }
+    
+    return pPool;
+}
+
+HRESULT CBufferPool::Acquire(CRefCountedBuffer* pspBuffer)
+{
+    HRESULT hr = S_OK;
+    CBuffer* pBuffer = NULL;
+    
+    ChkIfA(pspBuffer == NULL, E_INVALIDARG);
+    ChkIfA(_fClosed, E_UNEXPECTED);
+    
+    if (_freelist.empty())
+    {
+        pBuffer = new CBuffer(c_bufferSize);
+        ChkIf(pBuffer == NULL, E_OUTOFMEMORY);
+        if (pBuffer->IsValid() == false)
+        {
+            delete pBuffer;
+            ChkA(E_OUTOFMEMORY);
+        }
+        pBuffer->_pPool = this;
+        _countCreated++;
+    }
+    else
+    {
+        pBuffer = _freelist.back();
+        _freelist.pop_back();
+        
+        if (_freelist.size() < _minFreeSinceTrim)
+        {
+            _minFreeSinceTrim = _freelist.size();
+        }
+        
+        pBuffer->_size = c_bufferSize; // same as a new CBuffer(c_bufferSize)
+    }
+    
+    _countOutstanding++;
+    _countAcquired++;
+    
+    *pspBuffer = CRefCountedBuffer(pBuffer);
+    
+Cleanup:
+    return hr;
+}
+
+void CBufferPool::Release(CBuffer* pBuffer)
+{
+    ASSERT(pBuffer->_pPool == this);
+    ASSERT(_countOutstanding > 0);
+    
+    _countOutstanding--;
+    
+    if (_fClosed)
+    {
+        delete pBuffer;
+        if (_countOutstanding == 0)
+        {
+            delete this;
+        }
+        return;
+    }
+    
+    _freelist.push_back(pBuffer);
+}
+
+size_t CBufferPool::Trim()
+{
+    size_t trimmed = 0;
+    
+    while ((trimmed < _minFreeSinceTrim) && (_freelist.empty() == false))
+    {
+        delete _freelist.back();
+        _freelist.pop_back();
+        trimmed++;
+    }
+    
+    _minFreeSinceTrim = _freelist.size();
+    
+    return trimmed;
+}
+
+size_t CBufferPool::GetFreeCount()
+{
+    return _freelist.size();
+}
+
+size_t CBufferPool::GetOutstandingCount()
+{
+    return _countOutstanding;
+}
+
+uint64_t CBufferPool::GetAcquireCount()
+{
+    return _countAcquired;
+}
+
+uint64_t CBufferPool::GetCreateCount()
+{
+    return _countCreated;
+}
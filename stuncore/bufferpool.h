@@ -0,0 +1,74 @@
+/*
+   Copyright 2011 John Selbie
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef CBUFFERPOOL_H
+#define CBUFFERPOOL_H
+
+#include "buffer.h"
+#include "stuntypes.h"
+
+
+// CBufferPool hands out message sized buffers (c_bufferSize bytes) from a free list.  The
+// reference count lives in the CBuffer itself, so getting a buffer and letting go of the last
+// reference to it is a few pointer moves - malloc only gets involved when the free list is empty.
+//    A pool isn't thread safe.  Each thread has its own (GetThreadPool), and a pooled buffer
+//    has to be released on the thread that acquired it while that thread is running.
+//    When a thread exits, its pool is closed - buffers still referenced at that point are
+//    deleted as they're released, and the pool itself goes away with the last of them.
+
+class CBufferPool
+{
+public:
+    static const size_t c_bufferSize = MAX_STUN_MESSAGE_SIZE;
+
+private:
+    std::vector<CBuffer*> _freelist;
+    size_t _minFreeSinceTrim;  // low water mark of the free list since the last call to Trim
+    size_t _countOutstanding;
+    uint64_t _countAcquired;
+    uint64_t _countCreated;
+    bool _fClosed;
+
+    void Release(CBuffer* pBuffer);
+    friend void intrusive_ptr_release(CBuffer* pBuffer);
+
+    ~CBufferPool();
+
+    // disallow copy and assignment.
+    CBufferPool(const CBufferPool&);
+    void operator=(const CBufferPool&);
+
+public:
+    CBufferPool();
+
+    // frees the idle buffers, and the pool itself once nothing is outstanding. The pool can't be used after this
+    void Close();
+
+    HRESULT Acquire(CRefCountedBuffer* pspBuffer);
+
+    // frees whatever part of the free list went unused since the last call to Trim
+    size_t Trim();
+
+    size_t GetFreeCount();
+    size_t GetOutstandingCount();
+    uint64_t GetAcquireCount();
+    uint64_t GetCreateCount();   // how many times Acquire had to allocate a new buffer
+
+    // the calling thread's pool, created on first use
+    static CBufferPool* GetThreadPool();
+};
+
+#endif
@@ -0,0 +1,519 @@
+/*
+   Copyright 2011 John Selbie
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "commonincludes.hpp"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "atomichelpers.h"
+#include "stringhelper.h"
+#include "credentialstore.h"
+
+
+static const uint8_t c_credentialMagic[8] = {'S', 'T', 'U', 'N', 'C', 'R', 'E', 'D'};
+
+
+CStunCredentialFile::CStunCredentialFile() :
+_pMap(NULL),
+_mapSize(0),
+_slots(NULL),
+_mask(0),
+_recordCount(0)
+{
+    _szRealm[0] = '\0';
+}
+
+CStunCredentialFile::~CStunCredentialFile()
+{
+    Close();
+}
+
+// FNV-1a
+uint32_t CStunCredentialFile::Hash(const char* pszUser, size_t length)
+{
+    uint32_t hash = 2166136261U;
+
+    for (size_t index = 0; index < length; index++)
+    {
+        hash = (hash ^ (uint8_t)pszUser[index]) * 16777619U;
+    }
+
+    return hash;
+}
+
+HRESULT CStunCredentialFile::Build(const char* pszTextFile, const char* pszRealm, const char* pszOutputFile)
+{
+    HRESULT hr = S_OK;
+    FILE* fileIn = NULL;
+    FILE* fileOut = NULL;
+    char szLine[MAX_STUN_AUTH_STRING_SIZE * 2 + 16];
+    std::vector<uint8_t> records;
+    std::vector<StunCredentialSlot> slots;
+    std::vector<size_t> offsets;   // of every record in records, in the order they were read
+    std::vector<uint32_t> hashes;
+    StunCredentialFileHeader header = {};
+    size_t realmLength = (pszRealm == NULL) ? 0 : strlen(pszRealm);
+    size_t slotCount = 2;
+    uint32_t slotsOffset = 0;
+    uint32_t recordsOffset = 0;
+    std::string strTempFile;
+
+    ChkIfA(pszTextFile == NULL, E_INVALIDARG);
+    ChkIfA(pszOutputFile == NULL, E_INVALIDARG);
+    ChkIf(realmLength > MAX_STUN_AUTH_STRING_SIZE, E_INVALIDARG);
+
+    fileIn = fopen(pszTextFile, "r");
+    ChkIf(fileIn == NULL, ERRNO_TO_HRESULT(errno));
+
+    // one "username:password" per line.  Blank lines and lines starting with # are skipped
+    while (fgets(szLine, sizeof(szLine), fileIn) != NULL)
+    {
+        size_t length = strlen(szLine);
+        char* pszPassword = NULL;
+        size_t userLength = 0;
+        size_t passwordLength = 0;
+
+        // a line that didn't fit in szLine can't hold credentials short enough to be used
+        ChkIf((length == (sizeof(szLine) - 1)) && (szLine[length-1] != '\n'), E_INVALIDARG);
+
+        while ((length > 0) && ((szLine[length-1] == '\n') || (szLine[length-1] == '\r')))
+        {
+            szLine[--length] = '\0';
+        }
+
+        if ((length == 0) || (szLine[0] == '#'))
+        {
+            continue;
+        }
+
+        pszPassword = strchr(szLine, ':');
+        ChkIf(pszPassword == NULL, E_INVALIDARG);
+        *pszPassword++ = '\0';
+
+        userLength = strlen(szLine);
+        passwordLength = strlen(pszPassword);
+        ChkIf((userLength == 0) || (userLength > MAX_STUN_AUTH_STRING_SIZE), E_INVALIDARG);
+        ChkIf((passwordLength == 0) || (passwordLength > MAX_STUN_AUTH_STRING_SIZE), E_INVALIDARG);
+
+        offsets.push_back(records.size());
+        hashes.push_back(Hash(szLine, userLength));
+        records.push_back((uint8_t)userLength);
+        records.push_back((uint8_t)passwordLength);
+        records.insert(records.end(), (uint8_t*)szLine, (uint8_t*)szLine + userLength);
+        records.insert(records.end(), (uint8_t*)pszPassword, (uint8_t*)pszPassword + passwordLength);
+    }
+    ChkIf(ferror(fileIn) != 0, E_FAIL);
+
+    while (slotCount < (offsets.size() * 2))
+    {
+        slotCount *= 2;
+    }
+
+    slotsOffset = (uint32_t)sizeof(header);
+    recordsOffset = slotsOffset + (uint32_t)(slotCount * sizeof(StunCredentialSlot));
+    ChkIf(((uint64_t)recordsOffset + records.size()) > 0xffffffff, E_INVALIDARG);
+
+    slots.resize(slotCount);
+    memset(&slots[0], 0, slots.size() * sizeof(slots[0]));
+
+    for (size_t index = 0; index < offsets.size(); index++)
+    {
+        size_t slot = hashes[index] & (slotCount - 1);
+        const uint8_t* pRecord = &records[offsets[index]];
+
+        while (slots[slot].recordOffset != 0)
+        {
+            const uint8_t* pOther = &records[ntohl(slots[slot].recordOffset) - recordsOffset];
+
+            // the same user twice is almost certainly a mistake in the text file
+            ChkIf((pOther[0] == pRecord[0]) && (memcmp(pOther + 2, pRecord + 2, pRecord[0]) == 0), E_INVALIDARG);
+
+            slot = (slot + 1) & (slotCount - 1);
+        }
+
+        slots[slot].hash = htonl(hashes[index]);
+        slots[slot].recordOffset = htonl(recordsOffset + (uint32_t)offsets[index]);
+    }
+
+    memcpy(header.magic, c_credentialMagic, sizeof(header.magic));
+    header.version = htonl(STUN_CREDENTIAL_FILE_VERSION);
+    header.recordCount = htonl((uint32_t)offsets.size());
+    header.slotCount = htonl((uint32_t)slotCount);
+    header.slotsOffset = htonl(slotsOffset);
+    header.recordsOffset = htonl(recordsOffset);
+    header.recordsSize = htonl((uint32_t)records.size());
+    header.realmLength = htonl((uint32_t)realmLength);
+    if (realmLength > 0)
+    {
+        memcpy(header.realm, pszRealm, realmLength);
+    }
+
+    // written next to the old file and renamed over it, so a server reloading at the same time gets one or the other
+    strTempFile = pszOutputFile;
+    strTempFile += ".tmp";
+    fileOut = fopen(strTempFile.c_str(), "wb");
+    ChkIf(fileOut == NULL, ERRNO_TO_HRESULT(errno));
+
+    ChkIf(fwrite(&header, sizeof(header), 1, fileOut) != 1, E_FAIL);
+    ChkIf(fwrite(&slots[0], sizeof(slots[0]), slots.size(), fileOut) != slots.size(), E_FAIL);
+    if (records.size() > 0)
+    {
+        ChkIf(fwrite(&records[0], 1, records.size(), fileOut) != records.size(), E_FAIL);
+    }
+    ChkIf(fclose(fileOut) != 0, E_FAIL);
+    fileOut = NULL;
+
+    ChkIf(rename(strTempFile.c_str(), pszOutputFile) != 0, ERRNO_TO_HRESULT(errno));
+
+Cleanup:
+    if (fileIn)
+    {
+        fclose(fileIn);
+    }
+    if (fileOut)
+    {
+        fclose(fileOut);
+        remove(strTempFile.c_str());
+    }
+    return hr;
+}
+
+HRESULT CStunCredentialFile::Open(const char* pszFilename)
+{
+    HRESULT hr = S_OK;
+    int fd = -1;
+    struct stat st = {};
+    void* pMap = MAP_FAILED;
+
+    ChkIfA(_pMap != NULL, E_UNEXPECTED);
+    ChkIfA(pszFilename == NULL, E_INVALIDARG);
+
+    fd = open(pszFilename, O_RDONLY);
+    ChkIf(fd == -1, ERRNO_TO_HRESULT(errno));
+
+    ChkIf(fstat(fd, &st) == -1, ERRNO_TO_HRESULT(errno));
+    ChkIf(st.st_size < (off_t)sizeof(StunCredentialFileHeader), E_INVALIDARG);
+
+    pMap = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ChkIf(pMap == MAP_FAILED, ERRNO_TO_HRESULT(errno));
+
+    _pMap = (uint8_t*)pMap;
+    _mapSize = (size_t)st.st_size;
+
+    Chk(Validate());
+
+Cleanup:
+    if (fd != -1)
+    {
+        close(fd);
+    }
+    if (FAILED(hr))
+    {
+        Close();
+    }
+    return hr;
+}
+
+// Everything a lookup relies on gets checked once here, so a damaged file fails to load instead of being trusted
+HRESULT CStunCredentialFile::Validate()
+{
+    HRESULT hr = S_OK;
+    const StunCredentialFileHeader* pHeader = (const StunCredentialFileHeader*)_pMap;
+    uint32_t slotCount = ntohl(pHeader->slotCount);
+    uint64_t slotsOffset = ntohl(pHeader->slotsOffset);
+    uint64_t recordsOffset = ntohl(pHeader->recordsOffset);
+    uint64_t recordsEnd = recordsOffset + ntohl(pHeader->recordsSize);
+    uint32_t realmLength = ntohl(pHeader->realmLength);
+    uint32_t recordCount = 0;
+
+    ChkIf(memcmp(pHeader->magic, c_credentialMagic, sizeof(c_credentialMagic)) != 0, E_INVALIDARG);
+    ChkIf(ntohl(pHeader->version) != STUN_CREDENTIAL_FILE_VERSION, E_INVALIDARG);
+    ChkIf((slotCount < 2) || (slotCount & (slotCount - 1)), E_INVALIDARG);
+    ChkIf(ntohl(pHeader->recordCount) >= slotCount, E_INVALIDARG);
+    ChkIf((slotsOffset < sizeof(StunCredentialFileHeader)) || (slotsOffset % sizeof(uint32_t)), E_INVALIDARG);
+    ChkIf((slotsOffset + (uint64_t)slotCount * sizeof(StunCredentialSlot)) > recordsOffset, E_INVALIDARG);
+    ChkIf(recordsEnd > _mapSize, E_INVALIDARG);
+    ChkIf(realmLength > MAX_STUN_AUTH_STRING_SIZE, E_INVALIDARG);
+    ChkIf(memchr(pHeader->realm, '\0', realmLength) != NULL, E_INVALIDARG);
+
+    _slots = (const StunCredentialSlot*)(_pMap + slotsOffset);
+
+    for (uint32_t index = 0; index < slotCount; index++)
+    {
+        uint64_t offset = ntohl(_slots[index].recordOffset);
+        const uint8_t* pRecord = _pMap + offset;
+
+        if (offset == 0)
+        {
+            ChkIf(_slots[index].hash != 0, E_INVALIDARG); // empty slots are all zeros
+            continue;
+        }
+
+        ChkIf((offset < recordsOffset) || ((offset + 2) > recordsEnd), E_INVALIDARG);
+        ChkIf((pRecord[0] == 0) || (pRecord[0] > MAX_STUN_AUTH_STRING_SIZE), E_INVALIDARG);
+        ChkIf((pRecord[1] == 0) || (pRecord[1] > MAX_STUN_AUTH_STRING_SIZE), E_INVALIDARG);
+        ChkIf((offset + 2 + pRecord[0] + pRecord[1]) > recordsEnd, E_INVALIDARG);
+        ChkIf(Hash((const char*)(pRecord + 2), pRecord[0]) != ntohl(_slots[index].hash), E_INVALIDARG);
+        recordCount++;
+    }
+    ChkIf(recordCount != ntohl(pHeader->recordCount), E_INVALIDARG);
+
+    _mask = slotCount - 1;
+    _recordCount = recordCount;
+    memcpy(_szRealm, pHeader->realm, realmLength);
+    _szRealm[realmLength] = '\0';
+
+Cleanup:
+    return hr;
+}
+
+void CStunCredentialFile::Close()
+{
+    if (_pMap != NULL)
+    {
+        munmap(_pMap, _mapSize);
+    }
+
+    _pMap = NULL;
+    _mapSize = 0;
+    _slots = NULL;
+    _mask = 0;
+    _recordCount = 0;
+    _szRealm[0] = '\0';
+}
+
+HRESULT CStunCredentialFile::LookupPassword(const char* pszUser, char* pszPassword)
+{
+    size_t length;
+    uint32_t hash;
+    uint32_t slot;
+
+    if ((_pMap == NULL) || (pszUser == NULL) || (pszPassword == NULL))
+    {
+        return E_FAIL;
+    }
+
+    length = strlen(pszUser);
+    if ((length == 0) || (length > MAX_STUN_AUTH_STRING_SIZE))
+    {
+        return E_FAIL;
+    }
+
+    hash = Hash(pszUser, length);
+    slot = hash & _mask;
+
+    // the table is never more than half full, so there's always an empty slot to stop at
+    while (true)
+    {
+        uint32_t offset = ntohl(_slots[slot].recordOffset);
+        const uint8_t* pRecord = _pMap + offset;
+
+        if (offset == 0)
+        {
+            return E_FAIL;
+        }
+
+        if ((ntohl(_slots[slot].hash) == hash) && (pRecord[0] == length) && (memcmp(pRecord + 2, pszUser, length) == 0))
+        {
+            memcpy(pszPassword, pRecord + 2 + pRecord[0], pRecord[1]);
+            pszPassword[pRecord[1]] = '\0';
+            return S_OK;
+        }
+
+        slot = (slot + 1) & _mask;
+    }
+}
+
+const char* CStunCredentialFile::GetRealm()
+{
+    return _szRealm;
+}
+
+uint32_t CStunCredentialFile::GetCount()
+{
+    return _recordCount;
+}
+
+
+// ---------------------------------------------------------------------------------------------
+
+
+CStunCredentialAuth::CStunCredentialAuth() :
+_pFile(NULL),
+_generation(0),
+_epoch(0),
+_readers()
+{
+    pthread_mutex_init(&_reloadLock, NULL);
+}
+
+CStunCredentialAuth::~CStunCredentialAuth()
+{
+    delete _pFile;
+    _pFile = NULL;
+    pthread_mutex_destroy(&_reloadLock);
+}
+
+HRESULT CStunCredentialAuth::Initialize(const char* pszFilename)
+{
+    HRESULT hr = S_OK;
+    CStunCredentialFile* pFile = NULL;
+
+    ChkIfA(_pFile != NULL, E_UNEXPECTED);
+    ChkIfA(StringHelper::IsNullOrEmpty(pszFilename), E_INVALIDARG);
+
+    pFile = new CStunCredentialFile();
+    ChkIf(pFile == NULL, E_OUTOFMEMORY);
+    Chk(pFile->Open(pszFilename));
+
+    // a file reloaded with a realm is long term credentials from then on, so the nonces are always ready
+    Chk(_nonces.Init(CStunNonceGenerator::c_defaultLifetimeSeconds, CStunNonceGenerator::c_defaultRotationSeconds));
+
+    _strFilename = pszFilename;
+    _pFile = pFile;
+    pFile = NULL;
+    _generation = 1;
+
+Cleanup:
+    delete pFile;
+    return hr;
+}
+
+HRESULT CStunCredentialAuth::Reload()
+{
+    HRESULT hr = S_OK;
+    CStunCredentialFile* pFile = NULL;
+    CStunCredentialFile* pOld = NULL;
+
+    pthread_mutex_lock(&_reloadLock);
+
+    ChkIfA(_pFile == NULL, E_UNEXPECTED);
+
+    pFile = new CStunCredentialFile();
+    ChkIf(pFile == NULL, E_OUTOFMEMORY);
+
+    // a file that doesn't load leaves the current one in place
+    Chk(pFile->Open(_strFilename.c_str()));
+
+    pOld = _pFile;
+    __atomic_store_n(&_pFile, pFile, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&_generation, 1, __ATOMIC_SEQ_CST);
+    pFile = NULL;
+
+    WaitForReaders();
+
+Cleanup:
+    pthread_mutex_unlock(&_reloadLock);
+    delete pOld;
+    delete pFile;
+    return hr;
+}
+
+// returns once nothing can still be using the file that was in _pFile before the last swap
+void CStunCredentialAuth::WaitForReaders()
+{
+    for (int pass = 0; pass < 2; pass++)
+    {
+        uint32_t epoch = __atomic_load_n(&_epoch, __ATOMIC_SEQ_CST);
+
+        __atomic_store_n(&_epoch, epoch + 1, __ATOMIC_SEQ_CST);
+
+        while (__atomic_load_n(&_readers[epoch & 1], __ATOMIC_SEQ_CST) != 0)
+        {
+            usleep(100);
+        }
+    }
+}
+
+uint32_t CStunCredentialAuth::GetCount()
+{
+    uint32_t count = 0;
+    uint32_t index = __atomic_load_n(&_epoch, __ATOMIC_SEQ_CST) & 1;
+
+    AtomicIncrement(&_readers[index]);
+    count = __atomic_load_n(&_pFile, __ATOMIC_SEQ_CST)->GetCount();
+    AtomicDecrement(&_readers[index]);
+
+    return count;
+}
+
+uint32_t CStunCredentialAuth::GetCredentialGeneration()
+{
+    return __atomic_load_n(&_generation, __ATOMIC_SEQ_CST);
+}
+
+HRESULT CStunCredentialAuth::DoAuthCheck(AuthAttributes* pAuthAttributes, AuthResponse* pResponse)
+{
+    uint32_t index = __atomic_load_n(&_epoch, __ATOMIC_SEQ_CST) & 1;
+    CStunCredentialFile* pFile = NULL;
+    const char* pszRealm = NULL;
+    bool fLongTerm = false;
+    HRESULT hrLookup = E_FAIL;
+
+    ASSERT(_pFile != NULL);
+
+    AtomicIncrement(&_readers[index]);
+
+    // Reload swaps the file in before it bumps the generation, so reading them the other way round means a
+    // password from the old file never goes out with the new generation
+    pResponse->credentialGeneration = __atomic_load_n(&_generation, __ATOMIC_SEQ_CST);
+    pFile = __atomic_load_n(&_pFile, __ATOMIC_SEQ_CST);
+
+    pszRealm = pFile->GetRealm();
+    fLongTerm = (pszRealm[0] != '\0');
+    pResponse->authCredMech = fLongTerm ? AuthCredLongTerm : AuthCredShortTerm;
+
+    if (fLongTerm)
+    {
+        strcpy(pResponse->szRealm, pszRealm);
+    }
+
+    if (pAuthAttributes->fMessageIntegrityPresent == false)
+    {
+        // RFC 5389 - a 400 for short term credentials, a challenge for long term
+        pResponse->responseType = fLongTerm ? Unauthorized : Reject;
+    }
+    else if (fLongTerm && ((pAuthAttributes->szNonce[0] == '\0') || strcmp(pAuthAttributes->szRealm, pszRealm)))
+    {
+        pResponse->responseType = Unauthorized;
+    }
+    else
+    {
+        hrLookup = pFile->LookupPassword(pAuthAttributes->szUser, pResponse->szPassword);
+
+        if (FAILED(hrLookup))
+        {
+            pResponse->responseType = Unauthorized;
+        }
+        else if (fLongTerm && FAILED(_nonces.ValidateNonce(pAuthAttributes->szNonce)))
+        {
+            pResponse->responseType = StaleNonce;
+        }
+        else
+        {
+            pResponse->responseType = AllowConditional;
+        }
+    }
+
+    AtomicDecrement(&_readers[index]);
+
+    // the nonce only goes back to the client with a 401 or a 438
+    if (fLongTerm && ((pResponse->responseType == Unauthorized) || (pResponse->responseType == StaleNonce)))
+    {
+        return _nonces.CreateNonce(pResponse->szNonce);
+    }
+
+    return S_OK;
+}
@@ -0,0 +1,133 @@
+/*
+   Copyright 2011 John Selbie
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef STUN_CREDENTIAL_STORE_H
+#define STUN_CREDENTIAL_STORE_H
+
+#include "stunauth.h"
+#include "noncegenerator.h"
+
+
+// The credentials file is built once from a text file of "username:password" lines (CStunCredentialFile::Build)
+// and memory mapped by the server.  Nothing in it is parsed or copied at load time beyond a validation pass, so
+// millions of users load in about the time it takes to read the file, and a lookup is a hash and a probe or two.
+// Every integer is in network byte order.
+//
+//    header      StunCredentialFileHeader
+//    slots       slotCount x StunCredentialSlot - open addressing with linear probing, at most half full
+//    records     for every user: uint8 userLength, uint8 passwordLength, the user name, the password (no terminators)
+//
+// A slot with a record offset of zero is empty (zero is inside the header, so no record can be there).
+
+const uint32_t STUN_CREDENTIAL_FILE_VERSION = 1;
+
+struct StunCredentialFileHeader
+{
+    uint8_t magic[8];          // "STUNCRED"
+    uint32_t version;
+    uint32_t recordCount;
+    uint32_t slotCount;        // a power of 2
+    uint32_t slotsOffset;
+    uint32_t recordsOffset;
+    uint32_t recordsSize;
+    uint32_t realmLength;      // zero for short term credentials
+    char realm[MAX_STUN_AUTH_STRING_SIZE];
+};
+
+struct StunCredentialSlot
+{
+    uint32_t hash;             // of the user name
+    uint32_t recordOffset;     // from the start of the file
+};
+
+
+class CStunCredentialFile
+{
+private:
+    uint8_t* _pMap;
+    size_t _mapSize;
+    const StunCredentialSlot* _slots;
+    uint32_t _mask;
+    uint32_t _recordCount;
+    char _szRealm[MAX_STUN_AUTH_STRING_SIZE+1];
+
+    HRESULT Validate();
+
+    // disallow copy and assignment.
+    CStunCredentialFile(const CStunCredentialFile&);
+    void operator=(const CStunCredentialFile& other);
+
+public:
+    CStunCredentialFile();
+    ~CStunCredentialFile();
+
+    static uint32_t Hash(const char* pszUser, size_t length);
+
+    // pszRealm may be NULL or empty for short term credentials
+    static HRESULT Build(const char* pszTextFile, const char* pszRealm, const char* pszOutputFile);
+
+    HRESULT Open(const char* pszFilename);
+    void Close();
+
+    // copies the user's password into pszPassword (at least MAX_STUN_AUTH_STRING_SIZE+1 chars).  E_FAIL if there's no such user
+    HRESULT LookupPassword(const char* pszUser, char* pszPassword);
+
+    const char* GetRealm();   // empty for short term credentials
+    uint32_t GetCount();
+};
+
+
+// CStunCredentialAuth is the auth provider for a credentials file (--credentials).  A file built with a realm
+// means long term credentials, otherwise short term.
+//    Reload maps the file again and swaps it in while requests keep getting checked against the old one.  The
+//    old mapping goes away once every DoAuthCheck that could have seen it has finished - DoAuthCheck never waits.
+//    Reload changes the credentialGeneration handed back, so threads drop the long term keys they have cached.
+
+class CStunCredentialAuth :
+    public CBasicRefCount,
+    public CObjectFactory<CStunCredentialAuth>,
+    public IStunAuth
+{
+private:
+    std::string _strFilename;
+    CStunCredentialFile* _pFile;   // swapped by Reload
+    uint32_t _generation;
+
+    // DoAuthCheck counts itself in _readers[_epoch & 1] while it uses _pFile.  Reload flips the epoch twice,
+    // waiting each time for the count it flipped away from to drain (the same idea as sleepable RCU)
+    uint32_t _epoch;
+    int _readers[2];
+    pthread_mutex_t _reloadLock;
+
+    CStunNonceGenerator _nonces;   // long term credentials only
+
+    void WaitForReaders();
+
+public:
+    CStunCredentialAuth();
+    virtual ~CStunCredentialAuth();
+
+    HRESULT Initialize(const char* pszFilename);
+    HRESULT Reload();
+
+    uint32_t GetCount();
+
+    virtual HRESULT DoAuthCheck(AuthAttributes* pAuthAttributes, AuthResponse* pResponse);
+    virtual uint32_t GetCredentialGeneration();
+    ADDREF_AND_RELEASE_IMPL();
+};
+
+#endif
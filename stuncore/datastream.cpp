@@ -18,6 +18,7 @@
 
 #include "commonincludes.hpp"
 #include "datastream.h"
+#include "bufferpool.h"
 
 
 
@@ -108,8 +109,13 @@ HRESULT CDataStream::Grow(size_t size)
 
     ASSERT(newallocationsize > 0);
 
-    CRefCountedBuffer spNewBuffer(new CBuffer(newallocationsize));
-
+    CRefCountedBuffer spNewBuffer;
+    
+    // anything message sized comes from this thread's pool
+    if ((newallocationsize > CBufferPool::c_bufferSize) || FAILED(CBufferPool::GetThreadPool()->Acquire(&spNewBuffer)))
+    {
+        spNewBuffer = CRefCountedBuffer(new CBuffer(newallocationsize));
+    }
 
     if (spNewBuffer->IsValid() == false)
     {
@@ -0,0 +1,170 @@
+/*
+   Copyright 2011 John Selbie
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "commonincludes.hpp"
+#include "oshelper.h"
+#include "delayedauth.h"
+
+
+CStunDelayedAuth::CStunDelayedAuth() :
+_latency(0),
+_thread((pthread_t)-1),
+_fThreadValid(false),
+_fExit(false)
+{
+    pthread_mutex_init(&_lock, NULL);
+    pthread_cond_init(&_cond, NULL);
+}
+
+CStunDelayedAuth::~CStunDelayedAuth()
+{
+    if (_fThreadValid)
+    {
+        pthread_mutex_lock(&_lock);
+        _fExit = true;
+        pthread_cond_signal(&_cond);
+        pthread_mutex_unlock(&_lock);
+        
+        pthread_join(_thread, NULL);
+        _fThreadValid = false;
+    }
+    
+    pthread_cond_destroy(&_cond);
+    pthread_mutex_destroy(&_lock);
+}
+
+HRESULT CStunDelayedAuth::Initialize(IStunAuth* pInner, uint32_t latencyMilliseconds)
+{
+    HRESULT hr = S_OK;
+    int err = 0;
+    
+    ChkIfA(_fThreadValid, E_UNEXPECTED);
+    
+    _spInner = pInner;
+    _latency = latencyMilliseconds;
+    
+    err = pthread_create(&_thread, NULL, CStunDelayedAuth::ThreadFunction, this);
+    ChkIfA(err != 0, ERRNO_TO_HRESULT(err));
+    _fThreadValid = true;
+    
+Cleanup:
+    return hr;
+}
+
+void CStunDelayedAuth::SetLatency(uint32_t latencyMilliseconds)
+{
+    __atomic_store_n(&_latency, latencyMilliseconds, __ATOMIC_RELAXED);
+}
+
+HRESULT CStunDelayedAuth::CheckInner(AuthAttributes* pAuthAttributes, AuthResponse* pResponse)
+{
+    if (_spInner == NULL)
+    {
+        pResponse->responseType = Allow;
+        return S_OK;
+    }
+    
+    return _spInner->DoAuthCheck(pAuthAttributes, pResponse);
+}
+
+uint32_t CStunDelayedAuth::GetCredentialGeneration()
+{
+    return (_spInner != NULL) ? _spInner->GetCredentialGeneration() : 0;
+}
+
+HRESULT CStunDelayedAuth::DoAuthCheck(AuthAttributes* pAuthAttributes, AuthResponse* pResponse)
+{
+    uint32_t latency = __atomic_load_n(&_latency, __ATOMIC_RELAXED);
+    
+    if (latency > 0)
+    {
+        usleep(latency * 1000);
+    }
+    
+    return CheckInner(pAuthAttributes, pResponse);
+}
+
+HRESULT CStunDelayedAuth::BeginAuthCheck(AuthAttributes* pAuthAttributes, AuthResponse* pResponse, IStunAuthCallback* pCallback, void* pContext)
+{
+    uint32_t latency = __atomic_load_n(&_latency, __ATOMIC_RELAXED);
+    PendingCheck check = {pAuthAttributes, pResponse, pCallback, pContext, 0};
+    
+    if ((latency == 0) || (pCallback == NULL))
+    {
+        return DoAuthCheck(pAuthAttributes, pResponse);
+    }
+    
+    check.timeDue = GetMonotonicMilliseconds() + latency;
+    
+    pthread_mutex_lock(&_lock);
+    _queue.push_back(check);
+    pthread_cond_signal(&_cond);
+    pthread_mutex_unlock(&_lock);
+    
+    return E_PENDING;
+}
+
+void* CStunDelayedAuth::ThreadFunction(void* pThis)
+{
+    ((CStunDelayedAuth*)pThis)->Run();
+    return NULL;
+}
+
+// answers the queued checks in order, each one once its time has come.  Whatever is still
+// queued when the provider goes away gets answered right away - every check gets its callback
+void CStunDelayedAuth::Run()
+{
+    pthread_mutex_lock(&_lock);
+    
+    while (true)
+    {
+        PendingCheck check;
+        uint64_t now = 0;
+        HRESULT hr = S_OK;
+        
+        if (_queue.empty())
+        {
+            if (_fExit)
+            {
+                break;
+            }
+            pthread_cond_wait(&_cond, &_lock);
+            continue;
+        }
+        
+        check = _queue.front();
+        now = GetMonotonicMilliseconds();
+        
+        if ((now < check.timeDue) && (_fExit == false))
+        {
+            // checks are only ever added at the back, and the front one is due first (unless the latency went down)
+            pthread_mutex_unlock(&_lock);
+            usleep((useconds_t)(check.timeDue - now) * 1000);
+            pthread_mutex_lock(&_lock);
+            continue;
+        }
+        
+        _queue.pop_front();
+        pthread_mutex_unlock(&_lock);
+        
+        hr = CheckInner(check.pAuthAttributes, check.pResponse);
+        check.pCallback->OnAuthCheckComplete(check.pContext, hr);
+        
+        pthread_mutex_lock(&_lock);
+    }
+    
+    pthread_mutex_unlock(&_lock);
+}
@@ -0,0 +1,74 @@
+/*
+   Copyright 2011 John Selbie
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef STUN_DELAYED_AUTH_H
+#define STUN_DELAYED_AUTH_H
+
+#include "stunauth.h"
+
+
+// CStunDelayedAuth is a stand-in for a provider backed by a remote store.  Every auth check gets answered
+// latency milliseconds late, with whatever the provider it wraps says (or Allow if it doesn't wrap one).
+// It's for testing and measuring how the server copes with a slow provider (--authdelay).
+//    BeginAuthCheck queues the check for a worker thread and returns E_PENDING.  A latency of 0 answers on the spot.
+//    DoAuthCheck, the blocking version, sleeps through the latency.
+//    SetLatency can change the latency at any time.  Checks already queued keep the latency they got.
+
+class CStunDelayedAuth :
+    public CBasicRefCount,
+    public CObjectFactory<CStunDelayedAuth>,
+    public IStunAsyncAuth
+{
+private:
+    struct PendingCheck
+    {
+        AuthAttributes* pAuthAttributes;
+        AuthResponse* pResponse;
+        IStunAuthCallback* pCallback;
+        void* pContext;
+        uint64_t timeDue;   // GetMonotonicMilliseconds
+    };
+    
+    CRefCountedPtr<IStunAuth> _spInner;
+    uint32_t _latency;
+    
+    std::list<PendingCheck> _queue;
+    pthread_mutex_t _lock;
+    pthread_cond_t _cond;
+    pthread_t _thread;
+    bool _fThreadValid;
+    bool _fExit;
+    
+    static void* ThreadFunction(void* pThis);
+    void Run();
+    HRESULT CheckInner(AuthAttributes* pAuthAttributes, AuthResponse* pResponse);
+    
+public:
+    CStunDelayedAuth();
+    virtual ~CStunDelayedAuth();
+    
+    // pInner is optional
+    HRESULT Initialize(IStunAuth* pInner, uint32_t latencyMilliseconds);
+    
+    void SetLatency(uint32_t latencyMilliseconds);
+    
+    virtual HRESULT DoAuthCheck(AuthAttributes* pAuthAttributes, AuthResponse* pResponse);
+    virtual HRESULT BeginAuthCheck(AuthAttributes* pAuthAttributes, AuthResponse* pResponse, IStunAuthCallback* pCallback, void* pContext);
+    virtual uint32_t GetCredentialGeneration();
+    ADDREF_AND_RELEASE_IMPL();
+};
+
+#endif
@@ -0,0 +1,266 @@
+/*
+   Copyright 2011 John Selbie
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "commonincludes.hpp"
+#include "stuncore.h"
+#include "iceresponder.h"
+
+
+CStunIceResponder::CStunIceResponder() :
+_authattributes(), // zero-init
+_authresponse() // zero-init
+{
+    Reset();
+}
+
+void CStunIceResponder::Reset()
+{
+    _entries.clear();
+    _mask = 0;
+    _ttl = 0;
+    _generation = 0;
+    _hits = 0;
+    _misses = 0;
+}
+
+HRESULT CStunIceResponder::Init(size_t size, uint32_t ttlMilliseconds)
+{
+    HRESULT hr = S_OK;
+    size_t slots = 1;
+
+    Reset();
+
+    ChkIfA(size == 0, E_INVALIDARG);
+    ChkIfA(size > 0x10000, E_INVALIDARG);
+    ChkIfA(ttlMilliseconds == 0, E_INVALIDARG);
+
+    while (slots < size)
+    {
+        slots *= 2;
+    }
+
+    _entries.resize(slots);
+    _mask = (uint32_t)(slots - 1);
+    _ttl = ttlMilliseconds;
+    Flush();
+
+Cleanup:
+    return hr;
+}
+
+void CStunIceResponder::Flush()
+{
+    for (size_t index = 0; index < _entries.size(); index++)
+    {
+        _entries[index].fValid = false;
+        _entries[index].key.Reset();
+    }
+}
+
+bool CStunIceResponder::IsEnabled()
+{
+    return (_entries.empty() == false);
+}
+
+// FNV-1a over the ufrag
+uint32_t CStunIceResponder::Hash(const char* pUfrag, size_t length)
+{
+    uint32_t hash = 2166136261U;
+
+    for (size_t index = 0; index < length; index++)
+    {
+        hash = (hash ^ (uint8_t)pUfrag[index]) * 16777619U;
+    }
+
+    return hash;
+}
+
+HRESULT CStunIceResponder::ProcessRequest(const StunMessageIn& msgIn, StunMessageOut& msgOut, IStunAuth* pAuth, uint32_t now)
+{
+    HRESULT hr = S_OK;
+    CStunMessageReader* pReader = msgIn.pReader;
+    StunAttribute attribUser = {};
+    const char* pUfrag = NULL;
+    const char* pColon = NULL;
+    size_t ufragLength = 0;
+    uint32_t hash = 0;
+    Entry* pEntry = NULL;
+    const CStunIntegrityKey* pKey = NULL;
+    CStunIntegrityKey key;
+    uint32_t generation = 0;
+    bool fIntegrityValid = false;
+    bool fFingerprintValid = false;
+
+    ChkIfA(pReader == NULL, E_INVALIDARG);
+    ChkIfA(msgOut.spBufferOut == NULL, E_INVALIDARG);
+    ChkIfA(msgOut.spBufferOut->GetAllocatedSize() < MAX_STUN_MESSAGE_SIZE, E_INVALIDARG);
+    ChkIfA(pReader->GetState() != CStunMessageReader::BodyValidated, E_UNEXPECTED);
+
+    ChkIf(_entries.empty() || (pAuth == NULL), S_FALSE);
+
+    // a plain binding request with short term credentials and a fingerprint - nothing that changes how it's answered
+    ChkIf(pReader->GetMessageClass() != StunMsgClassRequest, S_FALSE);
+    ChkIf(pReader->GetMessageType() != StunMsgTypeBinding, S_FALSE);
+    ChkIf(pReader->IsMessageLegacyFormat(), S_FALSE);
+    ChkIf(pReader->HasFingerprintAttribute() == false, S_FALSE);
+    ChkIf(pReader->HasMessageIntegritySha256Attribute(), S_FALSE);
+    ChkIf(SUCCEEDED(pReader->GetAttributeByType(STUN_ATTRIBUTE_CHANGEREQUEST, NULL)), S_FALSE);
+    ChkIf(SUCCEEDED(pReader->GetAttributeByType(STUN_ATTRIBUTE_RESPONSE_PORT, NULL)), S_FALSE);
+    ChkIf(SUCCEEDED(pReader->GetAttributeByType(STUN_ATTRIBUTE_PADDING, NULL)), S_FALSE);
+
+    ChkIf(FAILED(pReader->GetAttributeByType(STUN_ATTRIBUTE_USERNAME, &attribUser)), S_FALSE);
+    ChkIf((attribUser.size == 0) || (attribUser.size > MAX_STUN_AUTH_STRING_SIZE), S_FALSE);
+
+    // the local ufrag is everything before the colon
+    pUfrag = (const char*)(pReader->GetStream().GetDataPointerUnsafe() + attribUser.offset);
+    pColon = (const char*)memchr(pUfrag, ':', attribUser.size);
+    ufragLength = pColon ? (size_t)(pColon - pUfrag) : attribUser.size;
+    ChkIf(ufragLength == 0, S_FALSE);
+
+    hash = Hash(pUfrag, ufragLength);
+    pEntry = &_entries[hash & _mask];
+
+    // read before a miss asks for the key, so a reload that lands in between leaves the new entry already stale
+    generation = pAuth->GetCredentialGeneration();
+
+    // (now - timestamp) is unsigned, so it comes out right when the millisecond counter wraps
+    if (pEntry->fValid && (pEntry->hash == hash) &&
+        (pEntry->generation == generation) &&
+        ((now - pEntry->timestamp) < _ttl) &&
+        (pEntry->ufragLength == ufragLength) &&
+        (memcmp(pEntry->ufrag, pUfrag, ufragLength) == 0))
+    {
+        // this also checks MESSAGE-INTEGRITY is followed by FINGERPRINT and nothing else
+        ChkIf(FAILED(pReader->ValidateMessageIntegrityAndFingerprint(pEntry->key, &fIntegrityValid, &fFingerprintValid)), S_FALSE);
+        ChkIf(fFingerprintValid == false, E_FAIL);
+
+        if (fIntegrityValid)
+        {
+            _hits++;
+            pKey = &pEntry->key;
+        }
+        else
+        {
+            // the password may have changed since - the auth provider gets asked again
+            pEntry->fValid = false;
+        }
+    }
+
+    if (pKey == NULL)
+    {
+        _misses++;
+
+        ChkIf(FetchKey(*pReader, pUfrag, ufragLength, pAuth, &key) != S_OK, S_FALSE);
+        ChkIf(FAILED(pReader->ValidateMessageIntegrityAndFingerprint(key, &fIntegrityValid, &fFingerprintValid)), S_FALSE);
+        ChkIf(fFingerprintValid == false, E_FAIL);
+
+        // CStunRequestHandler sends the 401
+        ChkIf(fIntegrityValid == false, S_FALSE);
+
+        // whatever was in the slot gets replaced
+        pEntry->fValid = true;
+        pEntry->hash = hash;
+        pEntry->timestamp = now;
+        pEntry->generation = generation;
+        pEntry->ufragLength = ufragLength;
+        memcpy(pEntry->ufrag, pUfrag, ufragLength);
+        pEntry->key = key;
+        pKey = &pEntry->key;
+    }
+
+    Chk(BuildResponse(msgIn, msgOut, *pKey));
+
+Cleanup:
+    return hr;
+}
+
+// asks the auth provider for the ufrag's password, the way CStunRequestHandler::ValidateAuth does for a user name.
+// S_FALSE unless the answer is a short term password to check the request with
+HRESULT CStunIceResponder::FetchKey(CStunMessageReader& reader, const char* pUfrag, size_t ufragLength, IStunAuth* pAuth, CStunIntegrityKey* pKey)
+{
+    HRESULT hr = S_OK;
+
+    ASSERT(ufragLength < ARRAYSIZE(_authattributes.szUser));
+
+    // the password belongs to the local ufrag, not to the pair of them
+    memcpy(_authattributes.szUser, pUfrag, ufragLength);
+    _authattributes.szUser[ufragLength] = '\0';
+    _authattributes.szRealm[0] = '\0';
+    _authattributes.szNonce[0] = '\0';
+    _authattributes.szLegacyPassword[0] = '\0';
+    _authattributes.fMessageIntegrityPresent = true;
+
+    _authresponse.responseType = Allow;
+    _authresponse.authCredMech = AuthCredShortTerm;
+    _authresponse.szPassword[0] = '\0';
+    _authresponse.szRealm[0] = '\0';
+    _authresponse.szNonce[0] = '\0';
+    _authresponse.credentialGeneration = 0;
+
+    reader.GetStringAttributeByType(STUN_ATTRIBUTE_REALM, _authattributes.szRealm, ARRAYSIZE(_authattributes.szRealm));
+    reader.GetStringAttributeByType(STUN_ATTRIBUTE_NONCE, _authattributes.szNonce, ARRAYSIZE(_authattributes.szNonce));
+
+    Chk(pAuth->DoAuthCheck(&_authattributes, &_authresponse));
+
+    ChkIf(_authresponse.responseType != AllowConditional, S_FALSE);
+    ChkIf(_authresponse.authCredMech != AuthCredShortTerm, S_FALSE);
+
+    _authresponse.szPassword[ARRAYSIZE(_authresponse.szPassword)-1] = '\0';
+
+    if (_authresponse.credentialGeneration != _generation)
+    {
+        Flush();
+        _generation = _authresponse.credentialGeneration;
+    }
+
+    Chk(pKey->InitShortTerm(_authresponse.szPassword));
+
+Cleanup:
+    return hr;
+}
+
+HRESULT CStunIceResponder::BuildResponse(const StunMessageIn& msgIn, StunMessageOut& msgOut, const CStunIntegrityKey& key)
+{
+    HRESULT hr = S_OK;
+    CStunMessageWriter writer(msgOut.spBufferOut->GetData(), msgOut.spBufferOut->GetAllocatedSize());
+    StunTransactionId transid;
+
+    msgIn.pReader->GetTransactionId(&transid);
+
+    msgOut.spBufferOut->SetSize(0);
+    msgOut.socketrole = msgIn.socketrole;
+    msgOut.addrDest = msgIn.addrRemote;
+
+    Chk(writer.AddHeader(StunMsgTypeBinding, StunMsgClassSuccessResponse));
+    Chk(writer.AddTransactionId(transid));
+    Chk(writer.AddXorMappedAddress(msgIn.addrRemote));
+    Chk(writer.AddMessageIntegrityAndFingerprint(key));
+
+    msgOut.spBufferOut->SetSize(writer.GetSize());
+
+Cleanup:
+    return hr;
+}
+
+uint64_t CStunIceResponder::GetHitCount()
+{
+    return _hits;
+}
+
+uint64_t CStunIceResponder::GetMissCount()
+{
+    return _misses;
+}
@@ -0,0 +1,91 @@
+/*
+   Copyright 2011 John Selbie
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef STUN_ICE_RESPONDER_H
+#define STUN_ICE_RESPONDER_H
+
+#include "stunauth.h"
+#include "stunintegrity.h"
+#include "messagehandler.h"
+
+
+// CStunIceResponder answers ICE connectivity checks (RFC 8445, section 7.3) - binding requests with a USERNAME of
+// "local-ufrag:remote-ufrag", a short term MESSAGE-INTEGRITY and a FINGERPRINT - without going through CStunRequestHandler.
+//    The password belongs to the local ufrag (the user name up to the colon), so that's what the auth provider is asked
+//    about - a credentials file for ICE lists ufrags and their passwords.
+//    The HMAC key for each local ufrag is kept set up (CStunIntegrityKey) in a direct-mapped cache, so a check from a
+//    known ufrag doesn't call the auth provider or hash the password.  A ufrag is only asked about again when its entry
+//    expires (TTL milliseconds after it was stored), when a check fails the HMAC with the cached key, or when it's pushed
+//    out.  Every entry is stamped with the auth provider's GetCredentialGeneration, and is only used while that stays the
+//    same - a credentials file reload makes every ufrag get looked up again.  The credential generation DoAuthCheck
+//    hands back on a miss discards everything when it changes, too.
+//    MESSAGE-INTEGRITY and FINGERPRINT are checked in one walk over the request, and the response is signed the same way.
+//    The response is what RFC 8445 asks for: XOR-MAPPED-ADDRESS, MESSAGE-INTEGRITY and FINGERPRINT.
+//    Anything else - another layout, a CHANGE-REQUEST, a failed HMAC, an answer from the auth provider other than
+//    short term AllowConditional - is left for CStunRequestHandler, which answers it the way it always has.
+//    One instance per thread - there is no locking.
+
+class CStunIceResponder
+{
+private:
+    struct Entry
+    {
+        bool fValid;
+        uint32_t hash;
+        uint32_t timestamp;  // GetMillisecondCounter when it was stored
+        uint32_t generation; // pAuth->GetCredentialGeneration() from before the key was looked up
+        size_t ufragLength;
+        char ufrag[MAX_STUN_AUTH_STRING_SIZE];
+        CStunIntegrityKey key;
+    };
+    
+    std::vector<Entry> _entries;
+    uint32_t _mask;
+    uint32_t _ttl;
+    uint32_t _generation;
+    uint64_t _hits;
+    uint64_t _misses;
+    
+    // what goes to and comes back from the auth provider on a miss
+    AuthAttributes _authattributes;
+    AuthResponse _authresponse;
+    
+    static uint32_t Hash(const char* pUfrag, size_t length);
+    HRESULT FetchKey(CStunMessageReader& reader, const char* pUfrag, size_t ufragLength, IStunAuth* pAuth, CStunIntegrityKey* pKey);
+    HRESULT BuildResponse(const StunMessageIn& msgIn, StunMessageOut& msgOut, const CStunIntegrityKey& key);
+    
+public:
+    static const size_t c_defaultSize = 4096;
+    static const uint32_t c_defaultTTL = 30000;
+    
+    CStunIceResponder();
+    
+    // size is rounded up to a power of 2
+    HRESULT Init(size_t size, uint32_t ttlMilliseconds);
+    void Reset();
+    void Flush();
+    
+    bool IsEnabled();
+    
+    // S_OK - msgOut has the response to send.  S_FALSE - not a check this class answers, run it through
+    // CStunRequestHandler instead.  Failure - the request has a bad FINGERPRINT and gets no response at all
+    HRESULT ProcessRequest(const StunMessageIn& msgIn, StunMessageOut& msgOut, IStunAuth* pAuth, uint32_t now);
+    
+    uint64_t GetHitCount();
+    uint64_t GetMissCount();
+};
+
+#endif
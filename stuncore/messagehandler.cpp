@@ -23,25 +23,126 @@
 
 CStunRequestHandler::CStunRequestHandler() :
 _pAuth(NULL),
+_pKeyCache(NULL),
+_pBatch(NULL),
+_pAsyncAuth(NULL),
+_pAuthCallback(NULL),
+_pAuthCallbackContext(NULL),
 _pAddrSet(NULL),
 _pMsgIn(NULL),
 _pMsgOut(NULL),
 _integrity(), // zero-init
+_fIntegrityPending(false),
+_fAuthPending(false),
+_batchIndex(0),
 _error(), // zero-init
 _fRequestHasResponsePort(false),
 _transid(), // zero-init
-_fLegacyMode(false)
+_fLegacyMode(false),
+_authattributes(), // zero-init
+_authresponse() // zero-init
 {
     
 }
 
+// Puts back the state a freshly constructed handler has, as far as the next request can tell. Fields that
+// are always written before they are read (the integrity keys, the auth strings past their terminator) are left alone
+void CStunRequestHandler::Reset()
+{
+    _integrity.fSendWithIntegrity = false;
+    _integrity.fSha256 = false;
+    _fIntegrityPending = false;
+    _fAuthPending = false;
+    _batchIndex = 0;
+    
+    _error.errorcode = 0;
+    _error.msgclass = StunMsgClassRequest;
+    _error.msgtype = 0;
+    _error.attribUnknown = 0;
+    _error.szNonce[0] = '\0';
+    _error.szRealm[0] = '\0';
+    
+    _fRequestHasResponsePort = false;
+    _fLegacyMode = false;
+}
+
 
-HRESULT CStunRequestHandler::ProcessRequest(const StunMessageIn& msgIn, StunMessageOut& msgOut, TransportAddressSet* pAddressSet, /*optional*/ IStunAuth* pAuth)
+HRESULT CStunRequestHandler::ProcessRequest(const StunMessageIn& msgIn, StunMessageOut& msgOut, TransportAddressSet* pAddressSet, /*optional*/ IStunAuth* pAuth, /*optional*/ CStunKeyCache* pKeyCache)
 {
     HRESULT hr = S_OK;
     
     CStunRequestHandler handler;
     
+    Chk(handler.BeginRequest(msgIn, msgOut, pAddressSet, pAuth, pKeyCache, NULL));
+    Chk(handler.FinishRequest());
+    
+Cleanup:
+    return hr;
+}
+
+void CStunRequestHandler::ProcessRequestBatch(const StunMessageIn* arrMsgIn, StunMessageOut* arrMsgOut, HRESULT* arrResults, size_t count, TransportAddressSet* pAddressSet, /*optional*/ IStunAuth* pAuth, /*optional*/ CStunKeyCache* pKeyCache)
+{
+    CStunRequestHandler handlers[CStunIntegrityBatch::c_maxsize];
+    CStunIntegrityBatch batch;
+    
+    ProcessBatchImpl(handlers, batch, arrMsgIn, arrMsgOut, arrResults, count, pAddressSet, pAuth, pKeyCache);
+}
+
+void CStunRequestHandler::ProcessBatchImpl(CStunRequestHandler* handlers, CStunIntegrityBatch& batch, const StunMessageIn* arrMsgIn, StunMessageOut* arrMsgOut, HRESULT* arrResults, size_t count, TransportAddressSet* pAddressSet, IStunAuth* pAuth, CStunKeyCache* pKeyCache)
+{
+    ASSERT(count <= CStunIntegrityBatch::c_maxsize);
+    count = (count <= CStunIntegrityBatch::c_maxsize) ? count : CStunIntegrityBatch::c_maxsize;
+    
+    // everything up to the integrity check, for every request...
+    for (size_t index = 0; index < count; index++)
+    {
+        arrResults[index] = handlers[index].BeginRequest(arrMsgIn[index], arrMsgOut[index], pAddressSet, pAuth, pKeyCache, &batch);
+    }
+    
+    // ...then all the integrity checks at once...
+    if (batch.GetCount() > 0)
+    {
+        batch.Verify();
+    }
+    
+    // ...then the responses
+    for (size_t index = 0; index < count; index++)
+    {
+        if (SUCCEEDED(arrResults[index]))
+        {
+            arrResults[index] = handlers[index].FinishRequest();
+        }
+    }
+}
+
+
+CStunRequestContext::CStunRequestContext()
+{
+    
+}
+
+HRESULT CStunRequestContext::ProcessRequest(const StunMessageIn& msgIn, StunMessageOut& msgOut, TransportAddressSet* pAddressSet, /*optional*/ IStunAuth* pAuth, /*optional*/ CStunKeyCache* pKeyCache)
+{
+    HRESULT hr = S_OK;
+    
+    Chk(_handlers[0].BeginRequest(msgIn, msgOut, pAddressSet, pAuth, pKeyCache, NULL));
+    Chk(_handlers[0].FinishRequest());
+    
+Cleanup:
+    return hr;
+}
+
+void CStunRequestContext::ProcessRequestBatch(const StunMessageIn* arrMsgIn, StunMessageOut* arrMsgOut, HRESULT* arrResults, size_t count, TransportAddressSet* pAddressSet, /*optional*/ IStunAuth* pAuth, /*optional*/ CStunKeyCache* pKeyCache)
+{
+    _batch.Reset();
+    CStunRequestHandler::ProcessBatchImpl(_handlers, _batch, arrMsgIn, arrMsgOut, arrResults, count, pAddressSet, pAuth, pKeyCache);
+}
+
+
+HRESULT CStunRequestHandler::BeginRequest(const StunMessageIn& msgIn, StunMessageOut& msgOut, TransportAddressSet* pAddressSet, IStunAuth* pAuth, CStunKeyCache* pKeyCache, CStunIntegrityBatch* pBatch)
+{
+    HRESULT hr = S_OK;
+    
     // parameter checking
     ChkIfA(msgIn.pReader==NULL, E_INVALIDARG);
     ChkIfA(IsValidSocketRole(msgIn.socketrole)==false, E_INVALIDARG);
@@ -57,23 +158,62 @@ HRESULT CStunRequestHandler::ProcessRequest(const StunMessageIn& msgIn, StunMess
     
     msgOut.spBufferOut->SetSize(0);
     
+    // the handler may be a long lived one (CStunRequestContext) that ran another request before this one
+    Reset();
+    
     // build the context object to pass around this "C" type code environment
-    handler._pAuth = pAuth;
-    handler._pAddrSet = pAddressSet;
-    handler._pMsgIn = &msgIn;
-    handler._pMsgOut = &msgOut;
+    _pAuth = pAuth;
+    _pKeyCache = pKeyCache;
+    _pBatch = pBatch;
+    _pAddrSet = pAddressSet;
+    _pMsgIn = &msgIn;
+    _pMsgOut = &msgOut;
     
     // pre-prep message out
-    handler._pMsgOut->socketrole = handler._pMsgIn->socketrole; // output socket is the socket that sent us the message
-    handler._pMsgOut->addrDest = handler._pMsgIn->addrRemote; // destination address is same as source
+    _pMsgOut->socketrole = _pMsgIn->socketrole; // output socket is the socket that sent us the message
+    _pMsgOut->addrDest = _pMsgIn->addrRemote; // destination address is same as source
     
     // now call the function that does all the real work
-    hr = handler.ProcessRequestImpl();
+    hr = ProcessRequestImpl();
     
 Cleanup:
     return hr;
 }
 
+HRESULT CStunRequestHandler::BeginAsyncRequest(const StunMessageIn& msgIn, StunMessageOut& msgOut, TransportAddressSet* pAddressSet, IStunAsyncAuth* pAuth, CStunKeyCache* pKeyCache, IStunAuthCallback* pCallback, void* pCallbackContext)
+{
+    _pAsyncAuth = pAuth;
+    _pAuthCallback = pCallback;
+    _pAuthCallbackContext = pCallbackContext;
+    
+    return BeginRequest(msgIn, msgOut, pAddressSet, pAuth, pKeyCache, NULL);
+}
+
+// the request may have been moved while the auth check was pending, so msgIn and msgOut are where it is now
+HRESULT CStunRequestHandler::ResumeRequest(const StunMessageIn& msgIn, StunMessageOut& msgOut, HRESULT hrAuth)
+{
+    HRESULT hrResult = hrAuth;
+    
+    ASSERT(_fAuthPending);
+    _fAuthPending = false;
+    
+    _pMsgIn = &msgIn;
+    _pMsgOut = &msgOut;
+    
+    if (SUCCEEDED(hrResult))
+    {
+        OnAuthResponse();
+    }
+    
+    // same as a failed ValidateAuth in ProcessRequestImpl
+    if (FAILED(hrResult) && (_error.errorcode == 0))
+    {
+        _error.errorcode = STUN_ERROR_BADREQUEST;
+    }
+    
+    return FinishRequest();
+}
+
 HRESULT CStunRequestHandler::ProcessRequestImpl()
 {
     HRESULT hrResult = S_OK;
@@ -137,6 +277,20 @@ HRESULT CStunRequestHandler::ProcessRequestImpl()
         }
     }
     
+Cleanup:
+    return hr;
+}
+
+// the rest of the request, once the integrity check (if it went to a batch) is done
+HRESULT CStunRequestHandler::FinishRequest()
+{
+    HRESULT hrResult = S_OK;
+    
+    if (_fIntegrityPending)
+    {
+        _fIntegrityPending = false;
+        OnIntegrityResult(_pBatch->IsValid(_batchIndex));
+    }
     
     if (_error.errorcode == 0)
     {
@@ -152,48 +306,39 @@ HRESULT CStunRequestHandler::ProcessRequestImpl()
         BuildErrorResponse();
     }
     
-Cleanup:
-    return hr;
+    return S_OK;
 }
 
 void CStunRequestHandler::BuildErrorResponse()
 {
-    CStunMessageBuilder builder;
-    CRefCountedBuffer spBuffer;
-    
-
-    _pMsgOut->spBufferOut->SetSize(0);
-    builder.GetStream().Attach(_pMsgOut->spBufferOut, true);
+    CStunMessageWriter writer(_pMsgOut->spBufferOut->GetData(), _pMsgOut->spBufferOut->GetAllocatedSize());
     
     // set RFC 3478 mode if the request appears to be that way
-    builder.SetLegacyMode(_fLegacyMode);
+    writer.SetLegacyMode(_fLegacyMode);
     
-    builder.AddHeader((StunMessageType)_error.msgtype, _error.msgclass);
-    builder.AddTransactionId(_transid);
-    builder.AddErrorCode(_error.errorcode, "FAILED");
+    writer.AddHeader((StunMessageType)_error.msgtype, _error.msgclass);
+    writer.AddTransactionId(_transid);
+    writer.AddErrorCode(_error.errorcode, "FAILED");
     
     if ((_error.errorcode == ::STUN_ERROR_UNKNOWNATTRIB) && (_error.attribUnknown != 0))
     {
-        builder.AddUnknownAttributes(&_error.attribUnknown, 1);
+        writer.AddUnknownAttributes(&_error.attribUnknown, 1);
     }
     else if ((_error.errorcode == ::STUN_ERROR_STALENONCE) || (_error.errorcode == ::STUN_ERROR_UNAUTHORIZED))
     {
         if (_error.szNonce[0])
         {
-            builder.AddStringAttribute(STUN_ATTRIBUTE_NONCE, _error.szNonce);
+            writer.AddStringAttribute(STUN_ATTRIBUTE_NONCE, _error.szNonce);
         }
         
         if (_error.szRealm[0])
         {
-            builder.AddStringAttribute(STUN_ATTRIBUTE_REALM, _error.szRealm);
+            writer.AddStringAttribute(STUN_ATTRIBUTE_REALM, _error.szRealm);
         }
     }
 
-    builder.FixLengthField();
-    builder.GetResult(&spBuffer);
-
-    ASSERT(spBuffer->GetSize() != 0);
-    ASSERT(spBuffer == _pMsgOut->spBufferOut);
+    ASSERT(writer.GetSize() != 0);
+    _pMsgOut->spBufferOut->SetSize(writer.GetSize());
 
     return;
 }
@@ -211,16 +356,19 @@ HRESULT CStunRequestHandler::ProcessBindingRequest()
     SocketRole socketOther;
     CSocketAddress addrOrigin;
     CSocketAddress addrOther;
-    CStunMessageBuilder builder;
     uint16_t paddingSize = 0;
     HRESULT hrResult;
+    const StunPrecomputedAttributes* pPrecomputed = (_pAddrSet && _pAddrSet->attributes.fValid) ? &_pAddrSet->attributes : NULL;
+    const StunEncodedAttribute* pOther = NULL;
+    const StunEncodedAttribute* pOrigin = NULL;
 
+    // the response goes straight into the output buffer (BeginRequest checked that it can hold MAX_STUN_MESSAGE_SIZE)
+    CStunMessageWriter writer(_pMsgOut->spBufferOut->GetData(), _pMsgOut->spBufferOut->GetAllocatedSize());
     
     _pMsgOut->spBufferOut->SetSize(0);
-    builder.GetStream().Attach(_pMsgOut->spBufferOut, true);
 
     // if the client request smells like RFC 3478, then send the resposne back in the same way
-    builder.SetLegacyMode(_fLegacyMode);
+    writer.SetLegacyMode(_fLegacyMode);
 
     // check for an alternate response port
     // check for padding attribute (todo - figure out how to inject padding into the response)
@@ -285,40 +433,60 @@ HRESULT CStunRequestHandler::ProcessBindingRequest()
     // received on, irrespective of the client sending a change-requset that influenced
     // the value of socketOutput value above.
     
-    fSendOtherAddress = HasAddress(RolePP) && HasAddress(RolePA) && HasAddress(RoleAP) && HasAddress(RoleAA);
-
-    if (fSendOtherAddress)
+    if (pPrecomputed)
     {
-        socketOther = SocketRoleSwapIP(SocketRoleSwapPort(_pMsgIn->socketrole));
-        // so if our ip address is "0.0.0.0", disable this attribute
-        fSendOtherAddress = (IsIPAddressZeroOrInvalid(socketOther) == false);
-        
-        // so if the local address of the other socket isn't known (e.g. ip == "0.0.0.0"), disable this attribute
+        // the usual case - the server worked out both attributes for every socket role at startup
+        pOther = &pPrecomputed->otherAddress[_fLegacyMode ? 1 : 0][_pMsgIn->socketrole];
+        pOrigin = &pPrecomputed->responseOrigin[_fLegacyMode ? 1 : 0][socketOutput];
+        fSendOtherAddress = (pOther->size != 0);
+        fSendOriginAddress = (pOrigin->size != 0);
+    }
+    else
+    {
+        fSendOtherAddress = HasAddress(RolePP) && HasAddress(RolePA) && HasAddress(RoleAP) && HasAddress(RoleAA);
+
         if (fSendOtherAddress)
         {
-            addrOther = _pAddrSet->set[socketOther].addr;
+            socketOther = SocketRoleSwapIP(SocketRoleSwapPort(_pMsgIn->socketrole));
+            // so if our ip address is "0.0.0.0", disable this attribute
+            fSendOtherAddress = (IsIPAddressZeroOrInvalid(socketOther) == false);
+
+            // so if the local address of the other socket isn't known (e.g. ip == "0.0.0.0"), disable this attribute
+            if (fSendOtherAddress)
+            {
+                addrOther = _pAddrSet->set[socketOther].addr;
+            }
         }
     }
 
     // What's our address origin?
-    addrOrigin = _pAddrSet->set[socketOutput].addr;
-    if (addrOrigin.IsIPAddressZero())
+    // A precomputed origin is only missing when the socket's address is "0.0.0.0", so that's the one case worked out here
+    if ((pOrigin == NULL) || ((fSendOriginAddress == false) && (socketOutput == _pMsgIn->socketrole)))
     {
-        // Since we're sending back from the IP address we received on, we can just use the address the message came in on
-        // Otherwise, we don't actually know it
-        if (socketOutput == _pMsgIn->socketrole)
+        pOrigin = NULL;
+        
+        if (_pAddrSet)
         {
-            addrOrigin = _pMsgIn->addrLocal;
+            addrOrigin = _pAddrSet->set[socketOutput].addr;
         }
+        if (addrOrigin.IsIPAddressZero())
+        {
+            // Since we're sending back from the IP address we received on, we can just use the address the message came in on
+            // Otherwise, we don't actually know it
+            if (socketOutput == _pMsgIn->socketrole)
+            {
+                addrOrigin = _pMsgIn->addrLocal;
+            }
+        }
+        fSendOriginAddress = (false == addrOrigin.IsIPAddressZero());
     }
-    fSendOriginAddress = (false == addrOrigin.IsIPAddressZero());
 
     // Success - we're all clear to build the response
     _pMsgOut->socketrole = socketOutput;
     
 
-    builder.AddHeader(StunMsgTypeBinding, StunMsgClassSuccessResponse);
-    builder.AddTransactionId(_transid);
+    writer.AddHeader(StunMsgTypeBinding, StunMsgClassSuccessResponse);
+    writer.AddTransactionId(_transid);
     
     // paranoia - just to be consistent with Vovida, send the attributes back in the same order it does
     // I suspect there are clients out there that might be hardcoded to the ordering
@@ -328,66 +496,176 @@ HRESULT CStunRequestHandler::ProcessBindingRequest()
     // CHANGED-ADDRESS (OTHER-ADDRESS)
     // XOR-MAPPED-ADDRESS (XOR-MAPPED_ADDRESS-OPTIONAL)
     
-    builder.AddMappedAddress(_pMsgIn->addrRemote);
+    writer.AddMappedAddress(_pMsgIn->addrRemote);
 
-    if (fSendOriginAddress)
+    if (fSendOriginAddress && pOrigin)
     {
-        builder.AddResponseOriginAddress(addrOrigin); // pass true to send back SOURCE_ADDRESS, otherwise, pass false to send back RESPONSE-ORIGIN
+        writer.AddEncodedAttribute(pOrigin->data, pOrigin->size);
+    }
+    else if (fSendOriginAddress)
+    {
+        writer.AddResponseOriginAddress(addrOrigin); // sends back SOURCE-ADDRESS in legacy mode, otherwise RESPONSE-ORIGIN
     }
 
-    if (fSendOtherAddress)
+    if (fSendOtherAddress && pOther)
+    {
+        writer.AddEncodedAttribute(pOther->data, pOther->size);
+    }
+    else if (fSendOtherAddress)
     {
-        builder.AddOtherAddress(addrOther); // pass true to send back CHANGED-ADDRESS, otherwise, pass false to send back OTHER-ADDRESS
+        writer.AddOtherAddress(addrOther); // sends back CHANGED-ADDRESS in legacy mode, otherwise OTHER-ADDRESS
     }
 
     // send back the XOR-MAPPED-ADDRESS (encoded as an optional message for legacy clients)
-    builder.AddXorMappedAddress(_pMsgIn->addrRemote);
+    writer.AddXorMappedAddress(_pMsgIn->addrRemote);
     
     
     // finally - if we're supposed to have a message integrity attribute as a result of authorization, add it at the very end
-    if (_integrity.fSendWithIntegrity)
+    // (with the same algorithm the request used)
+    if (_integrity.fSendWithIntegrity && _integrity.fSha256)
     {
-        if (_integrity.fUseLongTerm == false)
-        {
-            builder.AddMessageIntegrityShortTerm(_integrity.szPassword);
-        }
-        else
+        writer.AddMessageIntegritySha256(_integrity.keySha256);
+    }
+    else if (_integrity.fSendWithIntegrity)
+    {
+        writer.AddMessageIntegrity(_integrity.key);
+    }
+
+    _pMsgOut->spBufferOut->SetSize(writer.GetSize());
+
+    return S_OK;
+}
+
+
+HRESULT CStunRequestHandler::PrecomputeAttributes(TransportAddressSet* pAddressSet)
+{
+    HRESULT hr = S_OK;
+    StunPrecomputedAttributes attributes = {};
+    bool fAllRoles = false;
+
+    ChkIfA(pAddressSet == NULL, E_INVALIDARG);
+
+    // same rules as ProcessBindingRequest. OTHER-ADDRESS needs all four sockets and a known address for the opposite one.
+    // RESPONSE-ORIGIN needs a known address for the socket the response goes out on
+    fAllRoles = pAddressSet->set[RolePP].fValid && pAddressSet->set[RolePA].fValid && pAddressSet->set[RoleAP].fValid && pAddressSet->set[RoleAA].fValid;
+
+    for (int legacy = 0; legacy < 2; legacy++)
+    {
+        for (size_t index = 0; index < ARRAYSIZE(pAddressSet->set); index++)
         {
-            builder.AddMessageIntegrityLongTerm(_integrity.szUser, _integrity.szRealm, _integrity.szPassword);
+            SocketRole role = (SocketRole)index;
+            SocketRole roleOther = SocketRoleSwapIP(SocketRoleSwapPort(role));
+
+            if (fAllRoles && (pAddressSet->set[roleOther].addr.IsIPAddressZero() == false))
+            {
+                Chk(EncodeAttribute(legacy != 0, true, pAddressSet->set[roleOther].addr, &attributes.otherAddress[legacy][role]));
+            }
+
+            if (pAddressSet->set[role].addr.IsIPAddressZero() == false)
+            {
+                Chk(EncodeAttribute(legacy != 0, false, pAddressSet->set[role].addr, &attributes.responseOrigin[legacy][role]));
+            }
         }
     }
 
-    builder.FixLengthField();
+    attributes.fValid = true;
+    pAddressSet->attributes = attributes;
 
-    return S_OK;
+Cleanup:
+    return hr;
+}
+
+HRESULT CStunRequestHandler::EncodeAttribute(bool fLegacyMode, bool fOtherAddress, const CSocketAddress& addr, StunEncodedAttribute* pAttribute)
+{
+    HRESULT hr = S_OK;
+    uint8_t buffer[STUN_HEADER_SIZE + sizeof(pAttribute->data)];
+    CStunMessageWriter writer(buffer, sizeof(buffer));
+    StunTransactionId transid = {};
+    size_t size = 0;
+
+    // encoded by the same writer code as the per request path, the attribute just lands after a throwaway header
+    writer.SetLegacyMode(fLegacyMode);
+    Chk(writer.AddHeader(StunMsgTypeBinding, StunMsgClassSuccessResponse));
+    Chk(writer.AddTransactionId(transid));
+    Chk(fOtherAddress ? writer.AddOtherAddress(addr) : writer.AddResponseOriginAddress(addr));
+
+    size = writer.GetSize() - STUN_HEADER_SIZE;
+    ChkIfA(size > sizeof(pAttribute->data), E_UNEXPECTED);
+
+    memcpy(pAttribute->data, buffer + STUN_HEADER_SIZE, size);
+    pAttribute->size = (uint16_t)size;
+
+Cleanup:
+    return hr;
 }
 
 
 HRESULT CStunRequestHandler::ValidateAuth()
 {
-    AuthAttributes authattributes;
-    AuthResponse authresponse;
     HRESULT hr = S_OK;
-    HRESULT hrRet = S_OK;
     
     // aliases
     CStunMessageReader& reader = *(_pMsgIn->pReader);
+    AuthAttributes& authattributes = _authattributes;
+    AuthResponse& authresponse = _authresponse;
     
     if (_pAuth == NULL)
     {
         return S_OK; // nothing to do if there is no auth mechanism in place
     }
     
-    memset(&authattributes, '\0', sizeof(authattributes));
-    memset(&authresponse, '\0', sizeof(authresponse));
+    // the structs live as long as the handler does, so only the fields that mean something get cleared (not all ~500 bytes)
+    authattributes.szUser[0] = '\0';
+    authattributes.szRealm[0] = '\0';
+    authattributes.szNonce[0] = '\0';
+    authattributes.szLegacyPassword[0] = '\0';
+    
+    authresponse.responseType = Allow;
+    authresponse.authCredMech = AuthCredShortTerm;
+    authresponse.szPassword[0] = '\0';
+    authresponse.szRealm[0] = '\0';
+    authresponse.szNonce[0] = '\0';
+    authresponse.credentialGeneration = 0;
     
     reader.GetStringAttributeByType(STUN_ATTRIBUTE_USERNAME, authattributes.szUser, ARRAYSIZE(authattributes.szUser));
     reader.GetStringAttributeByType(STUN_ATTRIBUTE_REALM, authattributes.szRealm, ARRAYSIZE(authattributes.szRealm));
     reader.GetStringAttributeByType(STUN_ATTRIBUTE_NONCE, authattributes.szNonce, ARRAYSIZE(authattributes.szNonce));
     reader.GetStringAttributeByType(::STUN_ATTRIBUTE_LEGACY_PASSWORD, authattributes.szLegacyPassword, ARRAYSIZE(authattributes.szLegacyPassword));
-    authattributes.fMessageIntegrityPresent = reader.HasMessageIntegrityAttribute();
+    authattributes.fMessageIntegrityPresent = reader.HasMessageIntegrityAttribute() || reader.HasMessageIntegritySha256Attribute();
     
-    Chk(_pAuth->DoAuthCheck(&authattributes, &authresponse));
+    if (_pAsyncAuth)
+    {
+        hr = _pAsyncAuth->BeginAuthCheck(&authattributes, &authresponse, _pAuthCallback, _pAuthCallbackContext);
+        if (hr == E_PENDING)
+        {
+            // ResumeRequest picks it up from here
+            _fAuthPending = true;
+            return S_OK;
+        }
+        Chk(hr);
+    }
+    else
+    {
+        Chk(_pAuth->DoAuthCheck(&authattributes, &authresponse));
+    }
+    
+    OnAuthResponse();
+    
+Cleanup:
+    return hr;
+}
+
+// the second half of ValidateAuth - acts on what the provider put in _authresponse
+void CStunRequestHandler::OnAuthResponse()
+{
+    HRESULT hrRet = S_OK;
+    StunIntegrityInput input = {};
+    uint16_t passwordAlgorithm = STUN_PASSWORD_ALGORITHM_MD5;
+    
+    // aliases
+    CStunMessageReader& reader = *(_pMsgIn->pReader);
+    AuthAttributes& authattributes = _authattributes;
+    AuthResponse& authresponse = _authresponse;
     
     // enforce that everything is null terminated
     authresponse.szNonce[ARRAYSIZE(authresponse.szNonce)-1] = 0;
@@ -415,43 +693,117 @@ HRESULT CStunRequestHandler::ValidateAuth()
     {
         // validate the message in // if either ValidateAuth or ProcessBindingRequest set an errorcode....
 
-        if (authresponse.authCredMech == AuthCredLongTerm)
+        // RFC 8489 - when the request has both, MESSAGE-INTEGRITY-SHA256 is the one that counts
+        _integrity.fSha256 = reader.HasMessageIntegritySha256Attribute();
+        
+        // the key derivation defaults to MD5 unless the client picked another (long term credentials only)
+        if (FAILED(reader.GetPasswordAlgorithm(&passwordAlgorithm)) || (authresponse.authCredMech != AuthCredLongTerm))
+        {
+            passwordAlgorithm = STUN_PASSWORD_ALGORITHM_MD5;
+        }
+        
+        if ((passwordAlgorithm != STUN_PASSWORD_ALGORITHM_MD5) && (passwordAlgorithm != STUN_PASSWORD_ALGORITHM_SHA256))
         {
-            hrRet = reader.ValidateMessageIntegrityLong(authattributes.szUser, authattributes.szRealm, authresponse.szPassword);
+            _error.errorcode = STUN_ERROR_BADREQUEST;
+            hrRet = E_FAIL;
         }
         else
         {
-            hrRet = reader.ValidateMessageIntegrityShort(authresponse.szPassword);
+            // the key is derived once - the same one signs the response
+            hrRet = InitIntegrityKey(authattributes, authresponse, passwordAlgorithm);
         }
         
-        if (SUCCEEDED(hrRet))
+        if (SUCCEEDED(hrRet) && _integrity.fSha256)
         {
-            _integrity.fSendWithIntegrity = true;
-            _integrity.fUseLongTerm = (authresponse.authCredMech == AuthCredLongTerm);
-            
-            COMPILE_TIME_ASSERT(sizeof(_integrity.szPassword)==sizeof(authresponse.szPassword));
-            
-            strcpy(_integrity.szPassword, authresponse.szPassword);
-            strcpy(_integrity.szUser, authattributes.szUser);
-            strcpy(_integrity.szRealm, authattributes.szRealm);
+            hrRet = reader.ValidateMessageIntegritySha256(_integrity.keySha256);
         }
-        else
+        else if (SUCCEEDED(hrRet) && _pBatch && (_pBatch->IsFull() == false))
+        {
+            // the batch computes the HMAC later - FinishRequest picks up the result
+            hrRet = reader.GetMessageIntegrityInput(&input);
+            if (SUCCEEDED(hrRet))
+            {
+                hrRet = _pBatch->Add(_integrity.key, input, &_batchIndex);
+            }
+            _fIntegrityPending = SUCCEEDED(hrRet);
+        }
+        else if (SUCCEEDED(hrRet))
+        {
+            hrRet = reader.ValidateMessageIntegrity(_integrity.key);
+        }
+        
+        if ((_fIntegrityPending == false) && (_error.errorcode == 0))
         {
-            // bad password - so now turn this thing into a 401
-            _error.errorcode = STUN_ERROR_UNAUTHORIZED;
+            OnIntegrityResult(SUCCEEDED(hrRet));
         }
     }
     
-    if ((_error.errorcode == STUN_ERROR_UNAUTHORIZED) || (_error.errorcode == STUN_ERROR_STALENONCE))
+    // a pending integrity check may still turn into a 401
+    if ((_error.errorcode == STUN_ERROR_UNAUTHORIZED) || (_error.errorcode == STUN_ERROR_STALENONCE) || _fIntegrityPending)
     {
         strcpy(_error.szRealm, authresponse.szRealm);
         strcpy(_error.szNonce, authresponse.szNonce);
     }
+}
 
-Cleanup:
+// derives _integrity.key or _integrity.keySha256 (whichever _integrity.fSha256 calls for) from the credentials
+HRESULT CStunRequestHandler::InitIntegrityKey(const AuthAttributes& authattributes, const AuthResponse& authresponse, uint16_t passwordAlgorithm)
+{
+    HRESULT hr = S_OK;
+    bool fLongTerm = (authresponse.authCredMech == AuthCredLongTerm);
+    
+    if (fLongTerm && _pKeyCache)
+    {
+        _pKeyCache->SetGeneration(authresponse.credentialGeneration);
+    }
+    
+    if (_integrity.fSha256)
+    {
+        if (fLongTerm && _pKeyCache)
+        {
+            hr = _pKeyCache->GetLongTermKeySha256(authattributes.szUser, authattributes.szRealm, authresponse.szPassword, &_integrity.keySha256, passwordAlgorithm);
+        }
+        else if (fLongTerm)
+        {
+            hr = _integrity.keySha256.InitLongTerm(authattributes.szUser, authattributes.szRealm, authresponse.szPassword, passwordAlgorithm);
+        }
+        else
+        {
+            hr = _integrity.keySha256.InitShortTerm(authresponse.szPassword);
+        }
+    }
+    else
+    {
+        if (fLongTerm && _pKeyCache)
+        {
+            hr = _pKeyCache->GetLongTermKey(authattributes.szUser, authattributes.szRealm, authresponse.szPassword, &_integrity.key, passwordAlgorithm);
+        }
+        else if (fLongTerm)
+        {
+            hr = _integrity.key.InitLongTerm(authattributes.szUser, authattributes.szRealm, authresponse.szPassword, passwordAlgorithm);
+        }
+        else
+        {
+            hr = _integrity.key.InitShortTerm(authresponse.szPassword);
+        }
+    }
+    
     return hr;
 }
 
+void CStunRequestHandler::OnIntegrityResult(bool fValid)
+{
+    if (fValid)
+    {
+        _integrity.fSendWithIntegrity = true;
+    }
+    else
+    {
+        // bad password - so now turn this thing into a 401
+        _error.errorcode = STUN_ERROR_UNAUTHORIZED;
+    }
+}
+
 bool CStunRequestHandler::HasAddress(SocketRole role)
 {
     return (_pAddrSet && ::IsValidSocketRole(role) && _pAddrSet->set[role].fValid);
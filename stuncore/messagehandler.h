@@ -42,10 +42,12 @@ struct StunMessageIntegrity
 {
     bool fSendWithIntegrity;
     
-    bool fUseLongTerm;
-    char szUser[MAX_STUN_AUTH_STRING_SIZE+1]; // used for computing the message-integrity value
-    char szRealm[MAX_STUN_AUTH_STRING_SIZE+1]; // used for computing the message-integrity value
-    char szPassword[MAX_STUN_AUTH_STRING_SIZE+1]; // used for computing the message-integrity value
+    // the request carried MESSAGE-INTEGRITY-SHA256 - it's validated (and the response signed) with keySha256 instead of key
+    bool fSha256;
+    
+    // the key the request was validated with, reused to sign the response
+    CStunIntegrityKey key;
+    CStunIntegrityKeySha256 keySha256;
 };
 
 struct TransportAddress
@@ -54,9 +56,29 @@ struct TransportAddress
     bool fValid; // set to false if not valid (basic mode and most TCP/SSL scenarios)
 };
 
+// a RESPONSE-ORIGIN or OTHER-ADDRESS attribute encoded ahead of time (attribute header included)
+struct StunEncodedAttribute
+{
+    uint8_t data[4 + STUN_ATTRIBUTE_MAPPEDADDRESS_SIZE_IPV6];
+    uint16_t size; // 0 if the attribute doesn't get sent
+};
+
+// The RESPONSE-ORIGIN and OTHER-ADDRESS attributes of a binding response only depend on the
+// socket roles and the addresses in the TransportAddressSet, so CStunRequestHandler::PrecomputeAttributes
+// encodes all of them once and each response just copies the bytes in.
+// The first index is 0 for RFC 5389 responses and 1 for legacy (RFC 3489) responses, which use the
+// SOURCE-ADDRESS and CHANGED-ADDRESS attribute types instead.
+struct StunPrecomputedAttributes
+{
+    bool fValid; // false (the zero-init state) means ProcessRequest works the attributes out per request
+    StunEncodedAttribute otherAddress[2][4];   // indexed by the role the request was received on
+    StunEncodedAttribute responseOrigin[2][4]; // indexed by the role the response is sent from
+};
+
 struct TransportAddressSet
 {
     TransportAddress set[4]; // one for each socket role RolePP, RolePA, RoleAP, and RoleAA
+    StunPrecomputedAttributes attributes; // has to be refreshed (PrecomputeAttributes) after any change to set
 };
 
 struct StunErrorCode
@@ -75,32 +97,95 @@ struct StunErrorCode
 class CStunRequestHandler
 {
 public:
-    static HRESULT ProcessRequest(const StunMessageIn& msgIn, StunMessageOut& msgOut, TransportAddressSet* pAddressSet, /*optional*/ IStunAuth* pAuth);
+    static HRESULT ProcessRequest(const StunMessageIn& msgIn, StunMessageOut& msgOut, TransportAddressSet* pAddressSet, /*optional*/ IStunAuth* pAuth, /*optional*/ CStunKeyCache* pKeyCache);
+    
+    // Same as calling ProcessRequest on each of count requests (at most CStunIntegrityBatch::c_maxsize),
+    // except the MESSAGE-INTEGRITY checks for all of them are computed together by a CStunIntegrityBatch.
+    // arrResults[i] is what ProcessRequest would have returned for request i
+    static void ProcessRequestBatch(const StunMessageIn* arrMsgIn, StunMessageOut* arrMsgOut, HRESULT* arrResults, size_t count, TransportAddressSet* pAddressSet, /*optional*/ IStunAuth* pAuth, /*optional*/ CStunKeyCache* pKeyCache);
+    
+    // fills in pAddressSet->attributes from pAddressSet->set
+    static HRESULT PrecomputeAttributes(TransportAddressSet* pAddressSet);
 private:
     
+    friend class CStunRequestContext;
+    friend class CStunAsyncRequestContext;
+    
     CStunRequestHandler();
+    
+    static void ProcessBatchImpl(CStunRequestHandler* handlers, CStunIntegrityBatch& batch, const StunMessageIn* arrMsgIn, StunMessageOut* arrMsgOut, HRESULT* arrResults, size_t count, TransportAddressSet* pAddressSet, IStunAuth* pAuth, CStunKeyCache* pKeyCache);
+    
+    void Reset();
 
     HRESULT ProcessBindingRequest();
     void BuildErrorResponse();
     HRESULT ValidateAuth();
+    void OnAuthResponse();
+    HRESULT InitIntegrityKey(const AuthAttributes& authattributes, const AuthResponse& authresponse, uint16_t passwordAlgorithm);
+    void OnIntegrityResult(bool fValid);
     HRESULT ProcessRequestImpl();
     
+    // a request is handled in two steps, so a batch of them can have their integrity checked in between
+    HRESULT BeginRequest(const StunMessageIn& msgIn, StunMessageOut& msgOut, TransportAddressSet* pAddressSet, IStunAuth* pAuth, CStunKeyCache* pKeyCache, CStunIntegrityBatch* pBatch);
+    HRESULT FinishRequest();
+    
+    // BeginRequest with an IStunAsyncAuth.  If the auth check goes pending, _fAuthPending is set and
+    // ResumeRequest (instead of FinishRequest) takes it from there once pCallback gets called
+    HRESULT BeginAsyncRequest(const StunMessageIn& msgIn, StunMessageOut& msgOut, TransportAddressSet* pAddressSet, IStunAsyncAuth* pAuth, CStunKeyCache* pKeyCache, IStunAuthCallback* pCallback, void* pCallbackContext);
+    HRESULT ResumeRequest(const StunMessageIn& msgIn, StunMessageOut& msgOut, HRESULT hrAuth);
+    
     // input
     IStunAuth* _pAuth;
+    CStunKeyCache* _pKeyCache;
+    CStunIntegrityBatch* _pBatch;
+    IStunAsyncAuth* _pAsyncAuth;
+    IStunAuthCallback* _pAuthCallback;
+    void* _pAuthCallbackContext;
     TransportAddressSet* _pAddrSet;
     const StunMessageIn* _pMsgIn;
     StunMessageOut* _pMsgOut;
     
     // member variables to remember along the way
     StunMessageIntegrity _integrity;
+    bool _fIntegrityPending;  // the integrity check was queued in _pBatch at _batchIndex
+    bool _fAuthPending;       // _pAsyncAuth hasn't answered yet
+    size_t _batchIndex;
     StunErrorCode _error;
     
     bool _fRequestHasResponsePort;
     StunTransactionId _transid;
     bool _fLegacyMode;
     
+    // what goes to and comes back from _pAuth
+    AuthAttributes _authattributes;
+    AuthResponse _authresponse;
+    
     bool HasAddress(SocketRole role);
     bool IsIPAddressZeroOrInvalid(SocketRole role);
+    
+    static HRESULT EncodeAttribute(bool fLegacyMode, bool fOtherAddress, const CSocketAddress& addr, StunEncodedAttribute* pAttribute);
+};
+
+
+// CStunRequestContext is the long lived way to run requests through CStunRequestHandler - each socket thread keeps one.
+// The static CStunRequestHandler methods construct (and zero) a handler, or eight of them and an integrity batch, for
+// every call. A context builds those once and each request only resets the handler fields it uses.
+// Same results as the static methods, but a context must only be used by one thread at a time
+class CStunRequestContext
+{
+private:
+    CStunRequestHandler _handlers[CStunIntegrityBatch::c_maxsize];
+    CStunIntegrityBatch _batch;
+    
+    // not copyable - it's too big to pass around anyway
+    CStunRequestContext(const CStunRequestContext&);
+    CStunRequestContext& operator=(const CStunRequestContext&);
+    
+public:
+    CStunRequestContext();
+    
+    HRESULT ProcessRequest(const StunMessageIn& msgIn, StunMessageOut& msgOut, TransportAddressSet* pAddressSet, /*optional*/ IStunAuth* pAuth, /*optional*/ CStunKeyCache* pKeyCache);
+    void ProcessRequestBatch(const StunMessageIn* arrMsgIn, StunMessageOut* arrMsgOut, HRESULT* arrResults, size_t count, TransportAddressSet* pAddressSet, /*optional*/ IStunAuth* pAuth, /*optional*/ CStunKeyCache* pKeyCache);
 };
 
 
@@ -0,0 +1,294 @@
+/*
+   Copyright 2011 John Selbie
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+
+#include "commonincludes.hpp"
+#include <openssl/rand.h>
+#include "oshelper.h"
+#include "noncegenerator.h"
+
+
+static const char c_base64url[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+
+
+CStunNonceGenerator::CStunNonceGenerator() :
+_generation(0),
+_timeRotate(0),
+_lifetime(0),
+_rotationInterval(0),
+_salt(0)
+{
+    pthread_mutex_init(&_rotateLock, NULL);
+}
+
+CStunNonceGenerator::~CStunNonceGenerator()
+{
+    pthread_mutex_destroy(&_rotateLock);
+}
+
+uint32_t CStunNonceGenerator::GetCurrentTime()
+{
+    return (uint32_t)(GetMonotonicMilliseconds() / 1000);
+}
+
+HRESULT CStunNonceGenerator::CreateKey(CStunIntegrityKey* pKey)
+{
+    HRESULT hr = S_OK;
+    uint8_t key[CStunIntegrityKey::c_hmacsize];
+    
+    ChkIf(RAND_bytes(key, sizeof(key)) != 1, E_FAIL);
+    Chk(pKey->Init(key, sizeof(key)));
+    
+Cleanup:
+    memset(key, 0, sizeof(key));
+    return hr;
+}
+
+HRESULT CStunNonceGenerator::Init(uint32_t lifetimeSeconds, uint32_t rotationSeconds)
+{
+    return Init(lifetimeSeconds, rotationSeconds, GetCurrentTime());
+}
+
+HRESULT CStunNonceGenerator::Init(uint32_t lifetimeSeconds, uint32_t rotationSeconds, uint32_t now)
+{
+    HRESULT hr = S_OK;
+    
+    ChkIfA(lifetimeSeconds == 0, E_INVALIDARG);
+    ChkIfA(rotationSeconds < lifetimeSeconds, E_INVALIDARG);
+    
+    // there's a "previous" key from the start, it just never signed anything
+    for (uint32_t index = 0; index < c_keyCount; index++)
+    {
+        Chk(CreateKey(&_keys[index]));
+    }
+    
+    ChkIf(RAND_bytes((uint8_t*)&_salt, sizeof(_salt)) != 1, E_FAIL);
+    
+    _generation = 1;
+    _lifetime = lifetimeSeconds;
+    _rotationInterval = rotationSeconds;
+    _timeRotate = now + rotationSeconds;
+    
+Cleanup:
+    return hr;
+}
+
+// a new key takes over, and the current one becomes the previous one.  Whoever gets here first does it
+void CStunNonceGenerator::Rotate(uint32_t now)
+{
+    uint32_t generation;
+    
+    if (pthread_mutex_trylock(&_rotateLock) != 0)
+    {
+        return;
+    }
+    
+    if ((int32_t)(now - _timeRotate) >= 0)
+    {
+        generation = _generation + 1;
+        
+        // if there's no randomness to be had, the current key just stays on until the next interval
+        if (SUCCEEDED(CreateKey(&_keys[generation % c_keyCount])))
+        {
+            // the key has to be all there before anybody can see the new generation
+            __atomic_store_n(&_generation, generation, __ATOMIC_RELEASE);
+        }
+        
+        __atomic_store_n(&_timeRotate, now + _rotationInterval, __ATOMIC_RELAXED);
+    }
+    
+    pthread_mutex_unlock(&_rotateLock);
+}
+
+// A generator that was never initialized has keys in their Reset state - a MAC from one of those is no secret,
+// so nothing gets signed or checked until Init has succeeded
+bool CStunNonceGenerator::IsKeyValid(uint32_t generation) const
+{
+    return (_lifetime != 0) && _keys[generation % c_keyCount].IsValid();
+}
+
+void CStunNonceGenerator::Sign(uint32_t generation, uint8_t* pNonce) const
+{
+    uint8_t mac[CStunIntegrityKey::c_hmacsize];
+    
+    _keys[generation % c_keyCount].Compute(pNonce, c_signedSize, mac);
+    memcpy(pNonce + c_signedSize, mac, c_macSize);
+}
+
+HRESULT CStunNonceGenerator::CreateNonce(char* pszNonce)
+{
+    return CreateNonce(pszNonce, GetCurrentTime());
+}
+
+HRESULT CStunNonceGenerator::CreateNonce(char* pszNonce, uint32_t now)
+{
+    uint8_t nonce[c_nonceSize];
+    uint32_t generation;
+    uint32_t salt;
+    
+    pszNonce[0] = '\0';
+    
+    if (_lifetime == 0)
+    {
+        return E_UNEXPECTED;
+    }
+    
+    if ((int32_t)(now - __atomic_load_n(&_timeRotate, __ATOMIC_RELAXED)) >= 0)
+    {
+        Rotate(now);
+    }
+    
+    generation = __atomic_load_n(&_generation, __ATOMIC_ACQUIRE);
+    if (IsKeyValid(generation) == false)
+    {
+        return E_UNEXPECTED;
+    }
+    
+    salt = __atomic_add_fetch(&_salt, 1, __ATOMIC_RELAXED);
+    
+    nonce[0] = (uint8_t)generation;
+    nonce[1] = (uint8_t)(now >> 24);
+    nonce[2] = (uint8_t)(now >> 16);
+    nonce[3] = (uint8_t)(now >> 8);
+    nonce[4] = (uint8_t)now;
+    memcpy(nonce + 5, &salt, sizeof(salt));
+    
+    Sign(generation, nonce);
+    Encode(nonce, pszNonce);
+    
+    return S_OK;
+}
+
+HRESULT CStunNonceGenerator::ValidateNonce(const char* pszNonce)
+{
+    return ValidateNonce(pszNonce, GetCurrentTime());
+}
+
+HRESULT CStunNonceGenerator::ValidateNonce(const char* pszNonce, uint32_t now)
+{
+    uint8_t nonce[c_nonceSize];
+    uint8_t expected[c_nonceSize];
+    uint32_t generation = __atomic_load_n(&_generation, __ATOMIC_ACQUIRE);
+    uint32_t timestamp;
+    uint8_t diff = 0;
+    
+    if (FAILED(Decode(pszNonce, nonce)))
+    {
+        return E_FAIL;
+    }
+    
+    // signed with the current key or the one before it
+    if (nonce[0] == (uint8_t)(generation - 1))
+    {
+        generation--;
+    }
+    else if (nonce[0] != (uint8_t)generation)
+    {
+        return E_FAIL;
+    }
+    
+    if (IsKeyValid(generation) == false)
+    {
+        return E_FAIL;
+    }
+    
+    // unsigned, so a timestamp from the future is as stale as an old one
+    timestamp = ((uint32_t)nonce[1] << 24) | ((uint32_t)nonce[2] << 16) | ((uint32_t)nonce[3] << 8) | nonce[4];
+    if ((now - timestamp) > _lifetime)
+    {
+        return E_FAIL;
+    }
+    
+    memcpy(expected, nonce, c_signedSize);
+    Sign(generation, expected);
+    
+    // the time it takes doesn't say how much of the MAC was right
+    for (size_t index = c_signedSize; index < c_nonceSize; index++)
+    {
+        diff |= (uint8_t)(expected[index] ^ nonce[index]);
+    }
+    
+    return (diff == 0) ? S_OK : E_FAIL;
+}
+
+// c_nonceSize is a multiple of 3, so every 3 bytes are exactly 4 characters and there's no padding
+void CStunNonceGenerator::Encode(const uint8_t* pNonce, char* pszNonce)
+{
+    for (size_t index = 0; index < c_nonceSize; index += 3)
+    {
+        uint32_t group = ((uint32_t)pNonce[index] << 16) | ((uint32_t)pNonce[index+1] << 8) | pNonce[index+2];
+        
+        *pszNonce++ = c_base64url[(group >> 18) & 0x3f];
+        *pszNonce++ = c_base64url[(group >> 12) & 0x3f];
+        *pszNonce++ = c_base64url[(group >> 6) & 0x3f];
+        *pszNonce++ = c_base64url[group & 0x3f];
+    }
+    
+    *pszNonce = '\0';
+}
+
+static inline int Base64UrlValue(uint8_t ch)
+{
+    if ((ch >= 'A') && (ch <= 'Z'))
+    {
+        return ch - 'A';
+    }
+    if ((ch >= 'a') && (ch <= 'z'))
+    {
+        return ch - 'a' + 26;
+    }
+    if ((ch >= '0') && (ch <= '9'))
+    {
+        return ch - '0' + 52;
+    }
+    if (ch == '-')
+    {
+        return 62;
+    }
+    if (ch == '_')
+    {
+        return 63;
+    }
+    return -1;
+}
+
+// E_FAIL for anything that isn't exactly c_nonceLength base64url characters
+HRESULT CStunNonceGenerator::Decode(const char* pszNonce, uint8_t* pNonce)
+{
+    const uint8_t* pch = (const uint8_t*)pszNonce;
+    
+    for (size_t index = 0; index < c_nonceSize; index += 3)
+    {
+        uint32_t group = 0;
+        
+        for (size_t count = 0; count < 4; count++)
+        {
+            // the terminator isn't a base64url character, so a short string stops here
+            int value = Base64UrlValue(*pch++);
+            if (value < 0)
+            {
+                return E_FAIL;
+            }
+            group = (group << 6) | (uint32_t)value;
+        }
+        
+        pNonce[index] = (uint8_t)(group >> 16);
+        pNonce[index+1] = (uint8_t)(group >> 8);
+        pNonce[index+2] = (uint8_t)group;
+    }
+    
+    return (*pch == '\0') ? S_OK : E_FAIL;
+}
@@ -0,0 +1,93 @@
+/*
+   Copyright 2011 John Selbie
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+
+#ifndef STUN_NONCE_GENERATOR_H
+#define STUN_NONCE_GENERATOR_H
+
+#include "stunintegrity.h"
+
+
+// CStunNonceGenerator hands out the nonces for long term credentials (RFC 5389, section 10.2) and checks the
+// ones clients send back.  Nothing is kept per nonce - a nonce carries everything it takes to check it:
+//
+//    key id      1 byte    low byte of the generation of the key that signed it
+//    timestamp   4 bytes   seconds, when it was handed out
+//    salt        4 bytes   a counter from a random start, so no two nonces are alike
+//    MAC         9 bytes   HMAC-SHA1 of the 9 bytes above, truncated
+//
+// base64url encoded without padding, that's 24 characters.
+//    The keys are random, and a new one takes over every rotation interval.  A nonce signed with the one before
+//    it is still good, so as long as the rotation interval is at least the lifetime no nonce goes stale early.
+//    The keys are CStunIntegrityKeys (the HMAC key blocks are hashed once, up front), so signing or checking a
+//    nonce is two SHA-1 blocks and no string formatting or parsing.
+//    CreateNonce does the rotation once the interval is up.  Any number of threads can share an instance.
+
+class CStunNonceGenerator
+{
+private:
+    // a key gets reused c_keyCount generations later - long after the last CreateNonce or ValidateNonce that could
+    // have been using it is done
+    static const uint32_t c_keyCount = 4;
+    static const size_t c_signedSize = 9;
+    static const size_t c_macSize = 9;
+    static const size_t c_nonceSize = c_signedSize + c_macSize;
+    
+    CStunIntegrityKey _keys[c_keyCount];   // indexed by generation
+    uint32_t _generation;                  // of the key nonces are signed with now
+    uint32_t _timeRotate;                  // when the next key takes over
+    uint32_t _lifetime;
+    uint32_t _rotationInterval;
+    uint32_t _salt;
+    pthread_mutex_t _rotateLock;
+    
+    static HRESULT CreateKey(CStunIntegrityKey* pKey);
+    void Rotate(uint32_t now);
+    bool IsKeyValid(uint32_t generation) const;
+    void Sign(uint32_t generation, uint8_t* pNonce) const;
+    
+    static void Encode(const uint8_t* pNonce, char* pszNonce);
+    static HRESULT Decode(const char* pszNonce, uint8_t* pNonce);
+    
+    // not copyable
+    CStunNonceGenerator(const CStunNonceGenerator&);
+    CStunNonceGenerator& operator=(const CStunNonceGenerator&);
+    
+public:
+    static const uint32_t c_defaultLifetimeSeconds = 120;
+    static const uint32_t c_defaultRotationSeconds = 600;
+    static const size_t c_nonceLength = 24;  // characters, not counting the terminator
+    
+    CStunNonceGenerator();
+    ~CStunNonceGenerator();
+    
+    // the clock nonces are stamped with - GetMonotonicMilliseconds, in seconds
+    static uint32_t GetCurrentTime();
+    
+    // rotationSeconds can't be less than lifetimeSeconds
+    HRESULT Init(uint32_t lifetimeSeconds, uint32_t rotationSeconds);
+    HRESULT Init(uint32_t lifetimeSeconds, uint32_t rotationSeconds, uint32_t now);
+    
+    // pszNonce has room for c_nonceLength+1 chars.  E_UNEXPECTED (and an empty string) if Init hasn't succeeded
+    HRESULT CreateNonce(char* pszNonce);
+    HRESULT CreateNonce(char* pszNonce, uint32_t now);
+    
+    // S_OK if this instance handed out pszNonce within the last lifetimeSeconds, E_FAIL otherwise (always, before Init)
+    HRESULT ValidateNonce(const char* pszNonce);
+    HRESULT ValidateNonce(const char* pszNonce, uint32_t now);
+};
+
+#endif
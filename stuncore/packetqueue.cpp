@@ -0,0 +1,187 @@
+/*
+   Copyright 2011 John Selbie
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "commonincludes.hpp"
+#include "atomichelpers.h"
+#include "packetqueue.h"
+
+
+CStunPacketQueue::CStunPacketQueue() :
+_cells(NULL),
+_mask(0),
+_enqueuepos(0),
+_dequeuepos(0),
+_shedcount(0)
+{
+    ;
+}
+
+CStunPacketQueue::~CStunPacketQueue()
+{
+    delete [] _cells;
+    _cells = NULL;
+}
+
+HRESULT CStunPacketQueue::Init(size_t capacity)
+{
+    HRESULT hr = S_OK;
+    size_t size = 2;
+
+    ChkIfA(_cells != NULL, E_UNEXPECTED);
+    ChkIfA(capacity == 0, E_INVALIDARG);
+
+    while (size < capacity)
+    {
+        size = size * 2;
+    }
+
+    _cells = new Cell[size];
+    ChkIf(_cells == NULL, E_OUTOFMEMORY);
+
+    // a cell is free for the lap starting at position p when its sequence is p
+    for (size_t index = 0; index < size; index++)
+    {
+        _cells[index].sequence = index;
+    }
+
+    _mask = size - 1;
+    _enqueuepos = 0;
+    _dequeuepos = 0;
+    _shedcount = 0;
+
+Cleanup:
+    return hr;
+}
+
+void CStunPacketQueue::CopyPacket(const StunPacket& src, StunPacket* pDst)
+{
+    ASSERT(src.size <= sizeof(src.data));
+
+    pDst->socketrole = src.socketrole;
+    pDst->addrRemote = src.addrRemote;
+    pDst->addrLocal = src.addrLocal;
+    pDst->size = src.size;
+    memcpy(pDst->data, src.data, src.size);
+}
+
+bool CStunPacketQueue::TryPush(const StunPacket& packet)
+{
+    // there's only one producer, so _enqueuepos doesn't need a compare and swap
+    size_t pos = _enqueuepos;
+    Cell* pCell = &_cells[pos & _mask];
+    size_t sequence = __atomic_load_n(&pCell->sequence, __ATOMIC_ACQUIRE);
+
+    if (sequence != pos)
+    {
+        // still holds the packet from the last lap (or a consumer is in the middle of copying it out)
+        return false;
+    }
+
+    CopyPacket(packet, &pCell->packet);
+    __atomic_store_n(&pCell->sequence, pos + 1, __ATOMIC_RELEASE);
+    _enqueuepos = pos + 1;
+
+    return true;
+}
+
+bool CStunPacketQueue::Push(const StunPacket& packet)
+{
+    ASSERT(_cells != NULL);
+
+    // A full queue gives up its oldest packet.  A consumer in the middle of a Pop keeps the cell
+    // the producer needs busy for a moment, so after a few tries the new packet is the one dropped
+    for (int attempt = 0; attempt < 4; attempt++)
+    {
+        if (TryPush(packet))
+        {
+            return true;
+        }
+
+        if (Pop(NULL))
+        {
+            AtomicIncrement(&_shedcount);
+        }
+    }
+
+    AtomicIncrement(&_shedcount);
+    return false;
+}
+
+bool CStunPacketQueue::Pop(StunPacket* pPacket)
+{
+    size_t pos = __atomic_load_n(&_dequeuepos, __ATOMIC_RELAXED);
+    Cell* pCell = NULL;
+
+    ASSERT(_cells != NULL);
+
+    while (true)
+    {
+        size_t sequence;
+        intptr_t diff;
+
+        pCell = &_cells[pos & _mask];
+        sequence = __atomic_load_n(&pCell->sequence, __ATOMIC_ACQUIRE);
+        diff = (intptr_t)sequence - (intptr_t)(pos + 1);
+
+        if (diff == 0)
+        {
+            // full for this lap - claim it (the producer may be shedding this same packet)
+            if (__atomic_compare_exchange_n(&_dequeuepos, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            {
+                break;
+            }
+            // pos now holds the current _dequeuepos
+        }
+        else if (diff < 0)
+        {
+            // empty
+            return false;
+        }
+        else
+        {
+            // another thread took this one
+            pos = __atomic_load_n(&_dequeuepos, __ATOMIC_RELAXED);
+        }
+    }
+
+    if (pPacket)
+    {
+        CopyPacket(pCell->packet, pPacket);
+    }
+
+    // free for the producer's next lap
+    __atomic_store_n(&pCell->sequence, pos + _mask + 1, __ATOMIC_RELEASE);
+
+    return true;
+}
+
+bool CStunPacketQueue::IsEmpty()
+{
+    size_t pos = __atomic_load_n(&_dequeuepos, __ATOMIC_RELAXED);
+    size_t sequence = __atomic_load_n(&_cells[pos & _mask].sequence, __ATOMIC_ACQUIRE);
+
+    return (sequence != (pos + 1));
+}
+
+size_t CStunPacketQueue::GetCapacity()
+{
+    return (_cells != NULL) ? (_mask + 1) : 0;
+}
+
+int CStunPacketQueue::GetShedCount()
+{
+    return __atomic_load_n(&_shedcount, __ATOMIC_RELAXED);
+}
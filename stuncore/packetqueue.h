@@ -0,0 +1,91 @@
+/*
+   Copyright 2011 John Selbie
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef STUN_PACKET_QUEUE_H
+#define STUN_PACKET_QUEUE_H
+
+#include "stuntypes.h"
+#include "socketaddress.h"
+#include "socketrole.h"
+
+
+// a datagram on its way from the thread that received it to the thread that answers it
+struct StunPacket
+{
+    SocketRole socketrole;      // the socket it arrived on
+    CSocketAddress addrRemote;
+    CSocketAddress addrLocal;
+    size_t size;
+    uint8_t data[MAX_STUN_MESSAGE_SIZE];
+};
+
+
+// CStunPacketQueue is a bounded, lock-free FIFO of StunPackets between one producer thread and one consumer thread.
+// It's Dmitry Vyukov's bounded queue - every cell has a sequence number that says whether it's free or full for the
+// current lap, so the two sides never touch the same cell at the same time and never wait on each other.
+//    The capacity is fixed by Init.  Nothing is allocated after that.
+//    Packets are copied in and out (only the bytes in use), so a cell is never held across a Push or a Pop.
+//    A full queue sheds its oldest packet to make room - the producer pops it the same way the consumer
+//    would (Pop is safe for more than one thread).  Stale requests are the ones least worth answering.
+
+class CStunPacketQueue
+{
+private:
+    struct Cell
+    {
+        size_t sequence;
+        StunPacket packet;
+    };
+
+    Cell* _cells;
+    size_t _mask;
+
+    // the producer's and the consumer's positions are kept on cache lines of their own
+    uint8_t _pad0[64];
+    size_t _enqueuepos;
+    uint8_t _pad1[64];
+    size_t _dequeuepos;
+    uint8_t _pad2[64];
+    int _shedcount;
+
+    // disallow copy and assignment.
+    CStunPacketQueue(const CStunPacketQueue&);
+    void operator=(const CStunPacketQueue& other);
+
+    bool TryPush(const StunPacket& packet);
+    static void CopyPacket(const StunPacket& src, StunPacket* pDst);
+
+public:
+    CStunPacketQueue();
+    ~CStunPacketQueue();
+
+    // capacity is rounded up to a power of 2
+    HRESULT Init(size_t capacity);
+
+    // producer only.  Returns false if the packet itself had to be dropped (rare - see Push)
+    bool Push(const StunPacket& packet);
+
+    // pPacket may be NULL to just discard the packet
+    bool Pop(StunPacket* pPacket);
+
+    bool IsEmpty();
+    size_t GetCapacity();
+
+    // how many packets were dropped because the queue was full
+    int GetShedCount();
+};
+
+#endif
@@ -0,0 +1,157 @@
+/*
+   Copyright 2011 John Selbie
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "commonincludes.hpp"
+#include "stuncore.h"
+#include "responsecache.h"
+
+
+CStunResponseCache::CStunResponseCache()
+{
+    Reset();
+}
+
+void CStunResponseCache::Reset()
+{
+    _entries.clear();
+    _mask = 0;
+    _ttl = 0;
+    _hits = 0;
+    _misses = 0;
+}
+
+HRESULT CStunResponseCache::Init(size_t size, uint32_t ttlMilliseconds)
+{
+    HRESULT hr = S_OK;
+    size_t slots = 1;
+
+    Reset();
+
+    ChkIfA(size == 0, E_INVALIDARG);
+    ChkIfA(size > 0x10000, E_INVALIDARG);
+    ChkIfA(ttlMilliseconds == 0, E_INVALIDARG);
+
+    while (slots < size)
+    {
+        slots *= 2;
+    }
+
+    _entries.resize(slots);
+    _mask = (uint32_t)(slots - 1);
+    _ttl = ttlMilliseconds;
+    Flush();
+
+Cleanup:
+    return hr;
+}
+
+void CStunResponseCache::Flush()
+{
+    for (size_t index = 0; index < _entries.size(); index++)
+    {
+        _entries[index].fValid = false;
+    }
+}
+
+bool CStunResponseCache::IsEnabled()
+{
+    return (_entries.empty() == false);
+}
+
+// FNV-1a over the transaction ID and the client's port.  The transaction ID is random, so it does most of the work
+uint32_t CStunResponseCache::Hash(const CSocketAddress& addrRemote, const uint8_t* pHeader)
+{
+    uint32_t hash = 2166136261U;
+    uint16_t port = addrRemote.GetPort();
+
+    for (size_t index = 4; index < STUN_HEADER_SIZE; index++)
+    {
+        hash = (hash ^ pHeader[index]) * 16777619U;
+    }
+
+    hash = (hash ^ (uint8_t)(port >> 8)) * 16777619U;
+    hash = (hash ^ (uint8_t)(port & 0xff)) * 16777619U;
+
+    return hash;
+}
+
+const StunCachedResponse* CStunResponseCache::Lookup(const CSocketAddress& addrRemote, SocketRole socketrole, const uint8_t* pRequest, size_t requestSize, uint32_t now)
+{
+    uint32_t hash;
+    Entry* pEntry = NULL;
+
+    if (_entries.empty() || (pRequest == NULL) || (requestSize < STUN_HEADER_SIZE))
+    {
+        return NULL;
+    }
+
+    hash = Hash(addrRemote, pRequest);
+    pEntry = &_entries[hash & _mask];
+
+    // (now - timestamp) is unsigned, so it comes out right when the millisecond counter wraps
+    if (pEntry->fValid && (pEntry->hash == hash) &&
+        ((now - pEntry->timestamp) < _ttl) &&
+        (pEntry->socketrole == socketrole) &&
+        (memcmp(pEntry->header, pRequest, STUN_HEADER_SIZE) == 0) &&
+        pEntry->addrRemote.IsSameIP_and_Port(addrRemote))
+    {
+        _hits++;
+        return &pEntry->response;
+    }
+
+    _misses++;
+    return NULL;
+}
+
+void CStunResponseCache::Store(const StunMessageIn& msgIn, const StunMessageOut& msgOut, uint32_t now)
+{
+    uint32_t hash;
+    Entry* pEntry = NULL;
+    CDataStream& stream = msgIn.pReader->GetStream();
+    const uint8_t* pRequest = stream.GetDataPointerUnsafe();
+    size_t responseSize = msgOut.spBufferOut->GetSize();
+
+    if (_entries.empty() || (pRequest == NULL) || (stream.GetSize() < STUN_HEADER_SIZE) || (responseSize > MAX_STUN_MESSAGE_SIZE))
+    {
+        return;
+    }
+
+    hash = Hash(msgIn.addrRemote, pRequest);
+    pEntry = &_entries[hash & _mask];
+
+    // whatever was in the slot gets replaced
+    pEntry->fValid = true;
+    pEntry->hash = hash;
+    pEntry->timestamp = now;
+    pEntry->socketrole = msgIn.socketrole;
+    pEntry->addrRemote = msgIn.addrRemote;
+    memcpy(pEntry->header, pRequest, STUN_HEADER_SIZE);
+
+    pEntry->response.socketrole = msgOut.socketrole;
+    pEntry->response.addrDest = msgOut.addrDest;
+    pEntry->response.size = responseSize;
+    memcpy(pEntry->response.data, msgOut.spBufferOut->GetData(), responseSize);
+}
+
+uint64_t CStunResponseCache::GetHitCount()
+{
+    return _hits;
+}
+
+uint64_t CStunResponseCache::GetMissCount()
+{
+    return _misses;
+}
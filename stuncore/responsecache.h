@@ -0,0 +1,89 @@
+/*
+   Copyright 2011 John Selbie
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef STUN_RESPONSE_CACHE_H
+#define STUN_RESPONSE_CACHE_H
+
+#include "stuntypes.h"
+#include "socketaddress.h"
+#include "socketrole.h"
+#include "messagehandler.h"
+
+
+// a response as it went out, ready to be sent again
+struct StunCachedResponse
+{
+    SocketRole socketrole;   // the socket it was sent from
+    CSocketAddress addrDest;
+    size_t size;
+    uint8_t data[MAX_STUN_MESSAGE_SIZE];
+};
+
+
+// CStunResponseCache remembers the responses a thread recently sent over UDP, so that a retransmitted request
+// (RFC 5389, section 7.3) is answered with the same bytes instead of being parsed, authenticated and built again.
+//    It's keyed on the client's address, the socket the request came in on, and the request's 20 byte header -
+//    message type, length, and transaction ID.  A client that retransmits sends the same header every time.
+//    Like CStunKeyCache, it's a direct-mapped table with a fixed size.  A new response takes over its slot.
+//    Entries expire TTL milliseconds after they were stored.
+//    One instance per thread - there is no locking.
+
+class CStunResponseCache
+{
+private:
+    struct Entry
+    {
+        bool fValid;
+        uint32_t hash;
+        uint32_t timestamp;  // GetMillisecondCounter when it was stored
+        SocketRole socketrole; // the socket the request came in on
+        CSocketAddress addrRemote;
+        uint8_t header[STUN_HEADER_SIZE];
+        StunCachedResponse response;
+    };
+
+    std::vector<Entry> _entries;
+    uint32_t _mask;
+    uint32_t _ttl;
+    uint64_t _hits;
+    uint64_t _misses;
+
+    static uint32_t Hash(const CSocketAddress& addrRemote, const uint8_t* pHeader);
+
+public:
+    static const size_t c_defaultSize = 1024;
+    static const uint32_t c_defaultTTL = 10000; // covers the first four retransmissions with the RFC 5389 default RTO
+
+    CStunResponseCache();
+
+    // size is rounded up to a power of 2
+    HRESULT Init(size_t size, uint32_t ttlMilliseconds);
+    void Reset();
+    void Flush();
+
+    bool IsEnabled();
+
+    // NULL if this request wasn't answered in the last TTL milliseconds
+    const StunCachedResponse* Lookup(const CSocketAddress& addrRemote, SocketRole socketrole, const uint8_t* pRequest, size_t requestSize, uint32_t now);
+
+    // remembers msgOut as the response to the request msgIn was read from
+    void Store(const StunMessageIn& msgIn, const StunMessageOut& msgOut, uint32_t now);
+
+    uint64_t GetHitCount();
+    uint64_t GetMissCount();
+};
+
+#endif
@@ -0,0 +1,176 @@
+/*
+   Copyright 2011 John Selbie
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "commonincludes.hpp"
+#include "ringbuffer.h"
+
+
+CRingBuffer::CRingBuffer() :
+_pData(NULL),
+_capacity(0),
+_readpos(0),
+_size(0)
+{
+    ;
+}
+
+void CRingBuffer::Attach(uint8_t* pData, size_t capacity)
+{
+    _pData = pData;
+    _capacity = pData ? capacity : 0;
+    Reset();
+}
+
+void CRingBuffer::Detach()
+{
+    Attach(NULL, 0);
+}
+
+void CRingBuffer::Reset()
+{
+    _readpos = 0;
+    _size = 0;
+}
+
+size_t CRingBuffer::GetReadRegions(iovec* pRegions, size_t maxbytes) const
+{
+    size_t total = (maxbytes < _size) ? maxbytes : _size;
+    size_t first;
+
+    if (total == 0)
+    {
+        return 0;
+    }
+
+    first = _capacity - _readpos;
+    if (first > total)
+    {
+        first = total;
+    }
+
+    pRegions[0].iov_base = _pData + _readpos;
+    pRegions[0].iov_len = first;
+
+    if (first == total)
+    {
+        return 1;
+    }
+
+    pRegions[1].iov_base = _pData;
+    pRegions[1].iov_len = total - first;
+    return 2;
+}
+
+void CRingBuffer::Consume(size_t count)
+{
+    ASSERT(count <= _size);
+
+    if (count > _size)
+    {
+        count = _size;
+    }
+
+    _size -= count;
+
+    // snap back to the start of the buffer when empty, that keeps the data in one region more often
+    _readpos = (_size == 0) ? 0 : ((_readpos + count) % _capacity);
+}
+
+size_t CRingBuffer::GetWriteRegions(iovec* pRegions) const
+{
+    size_t freespace = _capacity - _size;
+    size_t writepos;
+    size_t first;
+
+    if (freespace == 0)
+    {
+        return 0;
+    }
+
+    writepos = (_readpos + _size) % _capacity;
+    first = _capacity - writepos;
+    if (first > freespace)
+    {
+        first = freespace;
+    }
+
+    pRegions[0].iov_base = _pData + writepos;
+    pRegions[0].iov_len = first;
+
+    if (first == freespace)
+    {
+        return 1;
+    }
+
+    pRegions[1].iov_base = _pData;
+    pRegions[1].iov_len = freespace - first;
+    return 2;
+}
+
+void CRingBuffer::CommitWrite(size_t count)
+{
+    ASSERT(count <= (_capacity - _size));
+
+    if (count > (_capacity - _size))
+    {
+        count = _capacity - _size;
+    }
+
+    _size += count;
+}
+
+HRESULT CRingBuffer::Write(const void* pData, size_t count)
+{
+    HRESULT hr = S_OK;
+    iovec regions[2];
+    size_t numregions;
+    const uint8_t* pSrc = (const uint8_t*)pData;
+
+    ChkIf(count > GetFreeSpace(), E_FAIL);
+
+    numregions = GetWriteRegions(regions);
+    for (size_t index = 0; (index < numregions) && (count > 0); index++)
+    {
+        size_t chunk = (regions[index].iov_len < count) ? regions[index].iov_len : count;
+        memcpy(regions[index].iov_base, pSrc, chunk);
+        pSrc += chunk;
+        count -= chunk;
+        CommitWrite(chunk);
+    }
+
+Cleanup:
+    return hr;
+}
+
+HRESULT CRingBuffer::Peek(void* pData, size_t count) const
+{
+    HRESULT hr = S_OK;
+    iovec regions[2];
+    size_t numregions;
+    uint8_t* pDst = (uint8_t*)pData;
+
+    ChkIf(count > _size, E_FAIL);
+
+    numregions = GetReadRegions(regions, count);
+    for (size_t index = 0; index < numregions; index++)
+    {
+        memcpy(pDst, regions[index].iov_base, regions[index].iov_len);
+        pDst += regions[index].iov_len;
+    }
+
+Cleanup:
+    return hr;
+}
@@ -0,0 +1,67 @@
+/*
+   Copyright 2011 John Selbie
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef RINGBUFFER_H
+#define RINGBUFFER_H
+
+#include <sys/uio.h>
+
+// CRingBuffer is a fixed capacity byte FIFO over memory owned by someone else
+//    The free space and the data are each exposed as (at most) two contiguous
+//    regions, so callers can fill and drain the buffer with a single readv/writev
+//    call without copying into an intermediate buffer.
+
+class CRingBuffer
+{
+private:
+    uint8_t* _pData;
+    size_t _capacity;
+    size_t _readpos;
+    size_t _size;
+
+    // disallow copy and assignment.
+    CRingBuffer(const CRingBuffer&);
+    void operator=(const CRingBuffer& other);
+
+public:
+    CRingBuffer();
+
+    void Attach(uint8_t* pData, size_t capacity);
+    void Detach();
+
+    // discards all the data in the buffer
+    void Reset();
+
+    inline size_t GetSize() const {return _size;}
+    inline size_t GetCapacity() const {return _capacity;}
+    inline size_t GetFreeSpace() const {return _capacity - _size;}
+    inline bool IsEmpty() const {return (_size == 0);}
+    inline bool IsFull() const {return (_size == _capacity);}
+
+    // fills in up to two regions describing the first maxbytes of data - returns the number of regions
+    size_t GetReadRegions(iovec* pRegions, size_t maxbytes) const;
+    void Consume(size_t count);
+
+    // fills in up to two regions describing the free space - returns the number of regions
+    size_t GetWriteRegions(iovec* pRegions) const;
+    void CommitWrite(size_t count);
+
+    HRESULT Write(const void* pData, size_t count);
+    HRESULT Peek(void* pData, size_t count) const;
+};
+
+
+#endif
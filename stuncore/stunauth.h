@@ -57,6 +57,7 @@ struct AuthResponse
     char szPassword[MAX_STUN_AUTH_STRING_SIZE+1]; // ignored if _responseType is anything other than AllowConditional
     char szRealm[MAX_STUN_AUTH_STRING_SIZE+1]; // realm attribute for challenge-response. Ignored if _authCredMech is not AuthCredLongTerm
     char szNonce[MAX_STUN_AUTH_STRING_SIZE+1]; // nonce attribute for challenge-response. Ignored if _authCredMech is not AuthCredLongTerm
+    uint32_t credentialGeneration; // optional. Change this whenever passwords change, and keys the server has cached for long term credentials get discarded
 };
 
 
@@ -64,6 +65,31 @@ class IStunAuth : public IRefCounted
 {
 public:
     virtual HRESULT DoAuthCheck(AuthAttributes* pAuthAttributes, AuthResponse* pResponse) = 0;
+    
+    // the credentialGeneration DoAuthCheck would hand back right now.  Keys a server thread holds on to without asking
+    // DoAuthCheck again (--iceresponder) are only used while this stays the same, so it has to be cheap.
+    // A provider whose passwords never change can leave it alone
+    virtual uint32_t GetCredentialGeneration() {return 0;}
+};
+
+
+class IStunAuthCallback
+{
+public:
+    // hrResult is what DoAuthCheck would have returned
+    virtual void OnAuthCheckComplete(void* pContext, HRESULT hrResult) = 0;
+};
+
+// An auth provider that has to wait on something (a database, another server) implements IStunAsyncAuth, so that
+// the socket threads can go on with other requests in the meantime (CStunAsyncRequestContext).
+// BeginAuthCheck either answers right away the way DoAuthCheck does, or returns E_PENDING and answers later on a
+// thread of its own: it fills in *pResponse, then calls pCallback->OnAuthCheckComplete(pContext, ...) exactly once.
+// pAuthAttributes and pResponse stay valid until then.  The callback may come before BeginAuthCheck has returned.
+// DoAuthCheck is still expected to work - it's the blocking version.
+class IStunAsyncAuth : public IStunAuth
+{
+public:
+    virtual HRESULT BeginAuthCheck(AuthAttributes* pAuthAttributes, AuthResponse* pResponse, IStunAuthCallback* pCallback, void* pContext) = 0;
 };
 
 
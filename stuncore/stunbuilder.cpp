@@ -22,16 +22,7 @@
 #include "atomichelpers.h"
 
 #include "stunbuilder.h"
-#include <boost/crc.hpp>
-
-#ifndef __APPLE__
-#include <openssl/md5.h>
-#include <openssl/hmac.h>
-#else
-#define COMMON_DIGEST_FOR_OPENSSL
-#include <CommonCrypto/CommonCrypto.h>
-#endif
-
+#include "crc32.h"
 
 #include "stunauth.h"
 
@@ -300,6 +291,11 @@ HRESULT CStunMessageBuilder::AddUnknownAttributes(const uint16_t* arr, size_t co
         // repeat the last attribute in the array to get an even alignment of 4 bytes
         _stream.Write(&arr[count-1], sizeof(arr[0]));
     }
+    else if (count % 2)
+    {
+        // RFC 5389 - the length stays unpadded, but the attribute still ends on a 4 byte boundary
+        Chk(_stream.WriteUint16(0));
+    }
     
     
 Cleanup:
@@ -419,7 +415,6 @@ HRESULT CStunMessageBuilder::AddChangeRequest(const StunChangeRequestAttribute&
 
 HRESULT CStunMessageBuilder::AddFingerprintAttribute()
 {
-    boost::crc_32_type result;
     uint32_t value;
     CRefCountedBuffer spBuffer;
     void* pData = NULL;
@@ -442,9 +437,7 @@ HRESULT CStunMessageBuilder::AddFingerprintAttribute()
 
     ASSERT(length > 8);
     length = length-8;
-    result.process_bytes(pData, length);
-
-    value = result.checksum();
+    value = Crc32(pData, length);
     value = value ^ STUN_FINGERPRINT_XOR;
 
     offset = -(int)(sizeof(value));
@@ -473,21 +466,18 @@ HRESULT CStunMessageBuilder::AddRealm(const char* pszRealm)
 }
 
 
-HRESULT CStunMessageBuilder::AddMessageIntegrityImpl(uint8_t* key, size_t keysize)
+HRESULT CStunMessageBuilder::AddMessageIntegrity(const CStunIntegrityKey& key)
 {
     HRESULT hr = S_OK;
-    const size_t c_hmacsize = 20;
+    const size_t c_hmacsize = CStunIntegrityKey::c_hmacsize;
     uint8_t hmacvaluedummy[c_hmacsize] = {}; // zero-init
-    unsigned int resultlength = c_hmacsize;
     uint8_t* pDstBuf = NULL;
     
     CRefCountedBuffer spBuffer;
-    void* pData = NULL;
+    uint8_t* pData = NULL;
     size_t length = 0;
-    unsigned char* pHashResult = NULL;
-    UNREFERENCED_VARIABLE(pHashResult);
     
-    ChkIfA(key==NULL || keysize <= 0, E_INVALIDARG);
+    ChkIfA(key.IsValid() == false, E_INVALIDARG);
     
     // add in a "zero-init" HMAC value.  This adds 24 bytes to the length
     Chk(AddAttribute(STUN_ATTRIBUTE_MESSAGEINTEGRITY, hmacvaluedummy, ARRAYSIZE(hmacvaluedummy)));
@@ -504,80 +494,75 @@ HRESULT CStunMessageBuilder::AddMessageIntegrityImpl(uint8_t* key, size_t keysiz
     
     
     // now do a little pointer math so that HMAC can write exactly to where the hash bytes will appear
-    pDstBuf = ((uint8_t*)pData) + length + 4;
+    pDstBuf = pData + length + 4;
     
-#ifndef __APPLE__
-    pHashResult = HMAC(EVP_sha1(), key, keysize, (uint8_t*)pData, length, pDstBuf, &resultlength);
-    ASSERT(resultlength == 20);
-    ASSERT(pHashResult != NULL);
-#else
-    CCHmac(kCCHmacAlgSHA1, key, keysize,(uint8_t*)pData, length, pDstBuf);
-    UNREFERENCED_VARIABLE(resultlength);
-#endif
+    key.Compute(pData, length, pDstBuf);
     
 Cleanup:
     return hr;
 }
 
-HRESULT CStunMessageBuilder::AddMessageIntegrityShortTerm(const char* pszPassword)
-{
-    return AddMessageIntegrityImpl((uint8_t*)pszPassword, strlen(pszPassword)); // if password is null/empty, AddMessageIntegrityImpl will ChkIfA on it
-}
-
-HRESULT CStunMessageBuilder::AddMessageIntegrityLongTerm(const char* pszUserName, const char* pszRealm, const char* pszPassword)
+HRESULT CStunMessageBuilder::AddMessageIntegritySha256(const CStunIntegrityKeySha256& key)
 {
     HRESULT hr = S_OK;
-    const size_t MAX_KEY_SIZE = MAX_STUN_AUTH_STRING_SIZE*3 + 2;
-    uint8_t key[MAX_KEY_SIZE + 1]; // long enough for 64-char strings and two semicolons and a null char for debugging
+    const size_t c_hmacsize = CStunIntegrityKeySha256::c_hmacsize;
+    uint8_t hmacvaluedummy[c_hmacsize] = {}; // zero-init
+    CRefCountedBuffer spBuffer;
+    uint8_t* pData = NULL;
+    size_t length = 0;
     
-    uint8_t hash[MD5_DIGEST_LENGTH] = {};
-    uint8_t* pResult = NULL;
-    uint8_t* pDst = key;
+    ChkIfA(key.IsValid() == false, E_INVALIDARG);
     
-    size_t lenUserName = pszUserName ? strlen(pszUserName) : 0;
-    size_t lenRealm = pszRealm ? strlen(pszRealm) : 0;
-    size_t lenPassword = pszPassword ? strlen(pszPassword) : 0;
-    size_t lenTotal = lenUserName + lenRealm + lenPassword + 2; // +2 for the two colons
+    // same as AddMessageIntegrity, but a 32 byte HMAC (36 bytes with the attribute header)
+    Chk(AddAttribute(STUN_ATTRIBUTE_MESSAGEINTEGRITY_SHA256, hmacvaluedummy, ARRAYSIZE(hmacvaluedummy)));
 
-    UNREFERENCED_VARIABLE(pResult);
-    
-    ChkIfA(lenTotal > MAX_KEY_SIZE, E_INVALIDARG); // if we ever hit this limit, just increase MAX_STUN_AUTH_STRING_SIZE
-    
-    // too bad CDatastream really only works on refcounted buffers.  Otherwise, we wouldn't have to do all this messed up pointer math
-    
-    // We could create a refcounted buffer in this function, but that would mean a call to "new and delete", and we're trying to avoid memory allocations in 
-    // critical code paths because they are a proven perf hit
-    
-    // TODO - Fix CDataStream and CBuffer so that "ref counted buffers" are no longer needed
-    
-    pDst = key;
+    Chk(FixLengthField());
+
+    ChkA(_stream.GetBuffer(&spBuffer));
+    pData = spBuffer->GetData();
+    length = spBuffer->GetSize();
+
+    ASSERT(length > (c_hmacsize + 4));
+    length = length - (c_hmacsize + 4);
     
-    memcpy(pDst, pszUserName, lenUserName);
-    pDst += lenUserName;
+    key.Compute(pData, length, pData + length + 4);
     
-    *pDst = ':';
-    pDst++;
+Cleanup:
+    return hr;
+}
+
+HRESULT CStunMessageBuilder::AddPasswordAlgorithm(uint16_t algorithm)
+{
+    HRESULT hr = S_OK;
     
-    memcpy(pDst, pszRealm, lenRealm);
-    pDst += lenRealm;
+    // no parameters for either of the algorithms RFC 8489 defines
+    Chk(AddAttributeHeader(STUN_ATTRIBUTE_PASSWORD_ALGORITHM, 4));
+    Chk(_stream.WriteUint16(htons(algorithm)));
+    Chk(_stream.WriteUint16(0));
     
-    *pDst = ':';
-    pDst++;
+Cleanup:
+    return hr;
+}
 
-    memcpy(pDst, pszPassword, lenPassword);
-    pDst += lenPassword;
-    *pDst ='\0'; // null terminate for debugging (this char doesn not get hashed
+HRESULT CStunMessageBuilder::AddMessageIntegrityShortTerm(const char* pszPassword)
+{
+    HRESULT hr = S_OK;
+    CStunIntegrityKey key;
     
-    ASSERT(key+lenTotal == pDst);
+    Chk(key.InitShortTerm(pszPassword)); // a NULL or empty password is an empty key
+    Chk(AddMessageIntegrity(key));
+    
+Cleanup:
+    return hr;
+}
 
-#ifndef __APPLE__
-    pResult = MD5(key, lenTotal, hash);
-#else
-    pResult = CC_MD5(key, lenTotal, hash);
-#endif
+HRESULT CStunMessageBuilder::AddMessageIntegrityLongTerm(const char* pszUserName, const char* pszRealm, const char* pszPassword)
+{
+    HRESULT hr = S_OK;
+    CStunIntegrityKey key;
     
-    ASSERT(pResult != NULL);
-    hr= AddMessageIntegrityImpl(hash, MD5_DIGEST_LENGTH);
+    Chk(key.InitLongTerm(pszUserName, pszRealm, pszPassword));
+    Chk(AddMessageIntegrity(key));
     
 Cleanup:
     return hr;
@@ -23,6 +23,7 @@
 #include "datastream.h"
 #include "socketaddress.h"
 #include "stuntypes.h"
+#include "stunintegrity.h"
 
 
 
@@ -37,8 +38,6 @@ private:
 
     HRESULT AddMappedAddressImpl(uint16_t attribute, const CSocketAddress& addr);
     
-    HRESULT AddMessageIntegrityImpl(uint8_t* key, size_t keysize);
-    
 
 public:
     CStunMessageBuilder();
@@ -77,6 +76,11 @@ public:
     
     HRESULT AddMessageIntegrityShortTerm(const char* pszPassword);
     HRESULT AddMessageIntegrityLongTerm(const char* pszUserName, const char* pszRealm, const char* pszPassword);
+    HRESULT AddMessageIntegrity(const CStunIntegrityKey& key);
+    
+    // RFC 8489.  When a message has both, MESSAGE-INTEGRITY goes first
+    HRESULT AddMessageIntegritySha256(const CStunIntegrityKeySha256& key);
+    HRESULT AddPasswordAlgorithm(uint16_t algorithm);
 
     HRESULT FixLengthField();
 
@@ -20,14 +20,26 @@
 #define STUNCORE_H_
 
 #include "buffer.h"
+#include "bufferpool.h"
+#include "credentialstore.h"
 #include "datastream.h"
+#include "packetqueue.h"
+#include "ringbuffer.h"
 #include "socketaddress.h"
 #include "stunbuilder.h"
+#include "stunwriter.h"
 #include "stunreader.h"
+#include "stunintegrity.h"
+#include "stunintegritybatch.h"
+#include "noncegenerator.h"
 #include "stuntypes.h"
 #include "stunutils.h"
 #include "messagehandler.h"
+#include "asyncrequestcontext.h"
+#include "responsecache.h"
+#include "iceresponder.h"
 #include "stunauth.h"
+#include "delayedauth.h"
 #include "stunclienttests.h"
 #include "stunclientlogic.h"
 
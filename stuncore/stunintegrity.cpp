@@ -0,0 +1,552 @@
+/*
+   Copyright 2011 John Selbie
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "commonincludes.hpp"
+#include "stunauth.h"
+#include "stunintegrity.h"
+#include "crc32.h"
+
+#ifndef __APPLE__
+#include <openssl/md5.h>
+#endif
+
+
+static const size_t c_sha1BlockSize = 64;
+static const size_t c_sha256BlockSize = 64;
+
+
+// The keys below are HMAC midstates - the SHA_CTX/SHA256_CTX left after hashing the padded key, copied for every
+// message.  Only the low level digest API gives access to that state, and OpenSSL 3 marks all of it deprecated.
+// The EVP equivalent (a keyed EVP_MAC_CTX, duplicated per message) allocates on every call, which costs more than
+// the hashing of a STUN message does, so the deprecation warnings are turned off for the key classes only.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wdeprecated-declarations"
+
+CStunIntegrityKey::CStunIntegrityKey()
+{
+    Reset();
+}
+
+void CStunIntegrityKey::Reset()
+{
+    memset(&_inner, '\0', sizeof(_inner));
+    memset(&_outer, '\0', sizeof(_outer));
+    _fValid = false;
+}
+
+bool CStunIntegrityKey::IsValid() const
+{
+    return _fValid;
+}
+
+HRESULT CStunIntegrityKey::Init(const uint8_t* key, size_t keylength)
+{
+    HRESULT hr = S_OK;
+    uint8_t keyhash[SHA_DIGEST_LENGTH];
+    uint8_t padded[c_sha1BlockSize];
+    uint8_t block[c_sha1BlockSize];
+    
+    Reset();
+    
+    // an empty key is fine (RFC 2104) - a short term password can be empty
+    ChkIfA((key == NULL) && (keylength != 0), E_INVALIDARG);
+    
+    // keys longer than a block get hashed first (RFC 2104)
+    if (keylength > c_sha1BlockSize)
+    {
+        SHA1(key, keylength, keyhash);
+        key = keyhash;
+        keylength = sizeof(keyhash);
+    }
+    
+    memset(padded, '\0', sizeof(padded));
+    if (keylength > 0)
+    {
+        memcpy(padded, key, keylength);
+    }
+    
+    for (size_t index = 0; index < c_sha1BlockSize; index++)
+    {
+        block[index] = padded[index] ^ 0x36;
+    }
+    SHA1_Init(&_inner);
+    SHA1_Update(&_inner, block, sizeof(block));
+    
+    for (size_t index = 0; index < c_sha1BlockSize; index++)
+    {
+        block[index] = padded[index] ^ 0x5c;
+    }
+    SHA1_Init(&_outer);
+    SHA1_Update(&_outer, block, sizeof(block));
+    
+    _fValid = true;
+    
+Cleanup:
+    return hr;
+}
+
+HRESULT CStunIntegrityKey::InitShortTerm(const char* pszPassword)
+{
+    return Init((const uint8_t*)pszPassword, pszPassword ? strlen(pszPassword) : 0);
+}
+
+HRESULT CStunIntegrityKey::InitLongTerm(const char* pszUser, const char* pszRealm, const char* pszPassword, uint16_t passwordAlgorithm)
+{
+    HRESULT hr = S_OK;
+    uint8_t key[c_maxlongtermkeysize];
+    size_t keylength = 0;
+    
+    Reset();
+    Chk(ComputeLongTermKey(pszUser, pszRealm, pszPassword, passwordAlgorithm, key, &keylength));
+    Chk(Init(key, keylength));
+    
+Cleanup:
+    return hr;
+}
+
+HRESULT CStunIntegrityKey::ComputeLongTermKey(const char* pszUser, const char* pszRealm, const char* pszPassword, uint8_t* pKey)
+{
+    HRESULT hr = S_OK;
+    uint8_t key[c_maxlongtermkeysize];
+    size_t keylength = 0;
+    
+    ChkIfA(pKey == NULL, E_INVALIDARG);
+    Chk(ComputeLongTermKey(pszUser, pszRealm, pszPassword, STUN_PASSWORD_ALGORITHM_MD5, key, &keylength));
+    ASSERT(keylength == c_longtermkeysize);
+    memcpy(pKey, key, c_longtermkeysize);
+    
+Cleanup:
+    return hr;
+}
+
+HRESULT CStunIntegrityKey::ComputeLongTermKey(const char* pszUser, const char* pszRealm, const char* pszPassword, uint16_t passwordAlgorithm, uint8_t* pKey, size_t* pKeyLength)
+{
+    HRESULT hr = S_OK;
+    const size_t MAX_KEY_SIZE = MAX_STUN_AUTH_STRING_SIZE*3 + 2;
+    uint8_t key[MAX_KEY_SIZE + 1]; // long enough for 64-char strings and two colons and a null char for debugging
+    uint8_t* pDst = key;
+    
+    size_t lenUser = pszUser ? strlen(pszUser) : 0;
+    size_t lenRealm = pszRealm ? strlen(pszRealm) : 0;
+    size_t lenPassword = pszPassword ? strlen(pszPassword) : 0;
+    size_t lenTotal = lenUser + lenRealm + lenPassword + 2; // +2 for the two colons
+    
+    COMPILE_TIME_ASSERT(MD5_DIGEST_LENGTH == c_longtermkeysize);
+    COMPILE_TIME_ASSERT(SHA256_DIGEST_LENGTH == c_maxlongtermkeysize);
+    
+    ChkIfA(pKey == NULL, E_INVALIDARG);
+    ChkIfA(pKeyLength == NULL, E_INVALIDARG);
+    ChkIf((passwordAlgorithm != STUN_PASSWORD_ALGORITHM_MD5) && (passwordAlgorithm != STUN_PASSWORD_ALGORITHM_SHA256), E_INVALIDARG);
+    ChkIfA(lenTotal > MAX_KEY_SIZE, E_INVALIDARG); // if we ever hit this limit, just increase MAX_STUN_AUTH_STRING_SIZE
+    
+    if (lenUser > 0)
+    {
+        memcpy(pDst, pszUser, lenUser);
+        pDst += lenUser;
+    }
+    *pDst = ':';
+    pDst++;
+    
+    if (lenRealm > 0)
+    {
+        memcpy(pDst, pszRealm, lenRealm);
+        pDst += lenRealm;
+    }
+    *pDst = ':';
+    pDst++;
+    
+    if (lenPassword > 0)
+    {
+        memcpy(pDst, pszPassword, lenPassword);
+        pDst += lenPassword;
+    }
+    *pDst = '\0'; // null terminate for debugging (does not get hashed)
+    
+    ASSERT(key+lenTotal == pDst);
+    
+    if (passwordAlgorithm == STUN_PASSWORD_ALGORITHM_SHA256)
+    {
+        ChkIfA(NULL == SHA256(key, lenTotal, pKey), E_FAIL);
+        *pKeyLength = SHA256_DIGEST_LENGTH;
+    }
+    else
+    {
+        ChkIfA(NULL == MD5(key, lenTotal, pKey), E_FAIL);
+        *pKeyLength = MD5_DIGEST_LENGTH;
+    }
+    
+Cleanup:
+    return hr;
+}
+
+void CStunIntegrityKey::Compute(const uint8_t* pData, size_t length, uint8_t* pResult) const
+{
+    SHA_CTX ctx;
+    uint8_t innerhash[SHA_DIGEST_LENGTH];
+    
+    ASSERT(_fValid);
+    
+    ctx = _inner;
+    SHA1_Update(&ctx, pData, length);
+    SHA1_Final(innerhash, &ctx);
+    
+    ctx = _outer;
+    SHA1_Update(&ctx, innerhash, sizeof(innerhash));
+    SHA1_Final(pResult, &ctx);
+}
+
+void CStunIntegrityKey::ComputeWithCrc32(uint8_t* pData, size_t length, uint16_t lengthField, uint8_t* pResult, uint32_t* pCrc) const
+{
+    SHA_CTX ctx;
+    uint8_t innerhash[SHA_DIGEST_LENGTH];
+    uint16_t lengthHeader = 0;
+    
+    ASSERT(_fValid);
+    ASSERT(length >= STUN_HEADER_SIZE);
+    
+    // the header's length field is the only byte range the two disagree on - it's patched in place for the
+    // HMAC and put back for the CRC.  Each runs over the whole range in one call: cutting the message into
+    // pieces to interleave them costs more in call overhead (and keeps the CRC off its PCLMULQDQ path) than it
+    // could save in memory traffic, since a STUN message is in L1 either way
+    memcpy(&lengthHeader, pData + 2, sizeof(lengthHeader));
+    memcpy(pData + 2, &lengthField, sizeof(lengthField));
+    
+    ctx = _inner;
+    SHA1_Update(&ctx, pData, length);
+    
+    memcpy(pData + 2, &lengthHeader, sizeof(lengthHeader));
+    
+    *pCrc = Crc32Update(*pCrc, pData, length);
+    
+    SHA1_Final(innerhash, &ctx);
+    
+    ctx = _outer;
+    SHA1_Update(&ctx, innerhash, sizeof(innerhash));
+    SHA1_Final(pResult, &ctx);
+}
+
+void CStunIntegrityKey::GetState(uint32_t* pInner, uint32_t* pOuter) const
+{
+    ASSERT(_fValid);
+    
+    pInner[0] = _inner.h0;
+    pInner[1] = _inner.h1;
+    pInner[2] = _inner.h2;
+    pInner[3] = _inner.h3;
+    pInner[4] = _inner.h4;
+    
+    pOuter[0] = _outer.h0;
+    pOuter[1] = _outer.h1;
+    pOuter[2] = _outer.h2;
+    pOuter[3] = _outer.h3;
+    pOuter[4] = _outer.h4;
+}
+
+
+CStunIntegrityKeySha256::CStunIntegrityKeySha256()
+{
+    Reset();
+}
+
+void CStunIntegrityKeySha256::Reset()
+{
+    memset(&_inner, '\0', sizeof(_inner));
+    memset(&_outer, '\0', sizeof(_outer));
+    _fValid = false;
+}
+
+bool CStunIntegrityKeySha256::IsValid() const
+{
+    return _fValid;
+}
+
+HRESULT CStunIntegrityKeySha256::Init(const uint8_t* key, size_t keylength)
+{
+    HRESULT hr = S_OK;
+    uint8_t keyhash[SHA256_DIGEST_LENGTH];
+    uint8_t padded[c_sha256BlockSize];
+    uint8_t block[c_sha256BlockSize];
+    
+    Reset();
+    
+    // an empty key is fine (RFC 2104) - a short term password can be empty
+    ChkIfA((key == NULL) && (keylength != 0), E_INVALIDARG);
+    
+    // keys longer than a block get hashed first (RFC 2104)
+    if (keylength > c_sha256BlockSize)
+    {
+        SHA256(key, keylength, keyhash);
+        key = keyhash;
+        keylength = sizeof(keyhash);
+    }
+    
+    memset(padded, '\0', sizeof(padded));
+    if (keylength > 0)
+    {
+        memcpy(padded, key, keylength);
+    }
+    
+    for (size_t index = 0; index < c_sha256BlockSize; index++)
+    {
+        block[index] = padded[index] ^ 0x36;
+    }
+    SHA256_Init(&_inner);
+    SHA256_Update(&_inner, block, sizeof(block));
+    
+    for (size_t index = 0; index < c_sha256BlockSize; index++)
+    {
+        block[index] = padded[index] ^ 0x5c;
+    }
+    SHA256_Init(&_outer);
+    SHA256_Update(&_outer, block, sizeof(block));
+    
+    _fValid = true;
+    
+Cleanup:
+    return hr;
+}
+
+HRESULT CStunIntegrityKeySha256::InitShortTerm(const char* pszPassword)
+{
+    return Init((const uint8_t*)pszPassword, pszPassword ? strlen(pszPassword) : 0);
+}
+
+HRESULT CStunIntegrityKeySha256::InitLongTerm(const char* pszUser, const char* pszRealm, const char* pszPassword, uint16_t passwordAlgorithm)
+{
+    HRESULT hr = S_OK;
+    uint8_t key[CStunIntegrityKey::c_maxlongtermkeysize];
+    size_t keylength = 0;
+    
+    Reset();
+    Chk(CStunIntegrityKey::ComputeLongTermKey(pszUser, pszRealm, pszPassword, passwordAlgorithm, key, &keylength));
+    Chk(Init(key, keylength));
+    
+Cleanup:
+    return hr;
+}
+
+void CStunIntegrityKeySha256::Compute(const uint8_t* pData, size_t length, uint8_t* pResult) const
+{
+    SHA256_CTX ctx;
+    uint8_t innerhash[SHA256_DIGEST_LENGTH];
+    
+    ASSERT(_fValid);
+    
+    ctx = _inner;
+    SHA256_Update(&ctx, pData, length);
+    SHA256_Final(innerhash, &ctx);
+    
+    ctx = _outer;
+    SHA256_Update(&ctx, innerhash, sizeof(innerhash));
+    SHA256_Final(pResult, &ctx);
+}
+
+#pragma GCC diagnostic pop
+
+
+CStunKeyCache::CStunKeyCache()
+{
+    Reset();
+}
+
+void CStunKeyCache::Reset()
+{
+    _entries.clear();
+    _mask = 0;
+    _generation = 0;
+    _hits = 0;
+    _misses = 0;
+}
+
+HRESULT CStunKeyCache::Init(size_t size)
+{
+    HRESULT hr = S_OK;
+    size_t slots = 1;
+    
+    Reset();
+    
+    ChkIfA(size == 0, E_INVALIDARG);
+    ChkIfA(size > 0x10000, E_INVALIDARG);
+    
+    while (slots < size)
+    {
+        slots *= 2;
+    }
+    
+    _entries.resize(slots);
+    _mask = (uint32_t)(slots - 1);
+    Flush();
+    
+Cleanup:
+    return hr;
+}
+
+void CStunKeyCache::Flush()
+{
+    for (size_t index = 0; index < _entries.size(); index++)
+    {
+        _entries[index].fValid = false;
+        _entries[index].fHasKey = false;
+        _entries[index].fHasKeySha256 = false;
+        _entries[index].key.Reset();
+        _entries[index].keySha256.Reset();
+    }
+}
+
+void CStunKeyCache::SetGeneration(uint32_t generation)
+{
+    if (generation != _generation)
+    {
+        Flush();
+        _generation = generation;
+    }
+}
+
+// FNV-1a over "user:realm"
+uint32_t CStunKeyCache::Hash(const char* pszUser, const char* pszRealm)
+{
+    uint32_t hash = 2166136261U;
+    
+    for (const char* psz = pszUser; *psz; psz++)
+    {
+        hash = (hash ^ (uint8_t)*psz) * 16777619U;
+    }
+    
+    hash = (hash ^ (uint8_t)':') * 16777619U;
+    
+    for (const char* psz = pszRealm; *psz; psz++)
+    {
+        hash = (hash ^ (uint8_t)*psz) * 16777619U;
+    }
+    
+    return hash;
+}
+
+// the slot for these credentials - taken over for them if it held anything else.  NULL if they're too long to cache
+CStunKeyCache::Entry* CStunKeyCache::Lookup(const char* pszUser, const char* pszRealm, const char* pszPassword, uint16_t passwordAlgorithm)
+{
+    uint32_t hash;
+    Entry* pEntry = NULL;
+    
+    if (_entries.empty() ||
+        (strlen(pszUser) > MAX_STUN_AUTH_STRING_SIZE) ||
+        (strlen(pszRealm) > MAX_STUN_AUTH_STRING_SIZE) ||
+        (strlen(pszPassword) > MAX_STUN_AUTH_STRING_SIZE))
+    {
+        return NULL;
+    }
+    
+    hash = Hash(pszUser, pszRealm);
+    pEntry = &_entries[hash & _mask];
+    
+    if (pEntry->fValid && (pEntry->hash == hash) &&
+        (pEntry->passwordAlgorithm == passwordAlgorithm) &&
+        (strcmp(pEntry->szUser, pszUser) == 0) &&
+        (strcmp(pEntry->szRealm, pszRealm) == 0) &&
+        (strcmp(pEntry->szPassword, pszPassword) == 0))
+    {
+        return pEntry;
+    }
+    
+    // whatever was in the slot gets replaced
+    pEntry->fValid = true;
+    pEntry->hash = hash;
+    strcpy(pEntry->szUser, pszUser);
+    strcpy(pEntry->szRealm, pszRealm);
+    strcpy(pEntry->szPassword, pszPassword);
+    pEntry->passwordAlgorithm = passwordAlgorithm;
+    pEntry->fHasKey = false;
+    pEntry->fHasKeySha256 = false;
+    
+    return pEntry;
+}
+
+HRESULT CStunKeyCache::GetLongTermKey(const char* pszUser, const char* pszRealm, const char* pszPassword, CStunIntegrityKey* pKey, uint16_t passwordAlgorithm)
+{
+    HRESULT hr = S_OK;
+    Entry* pEntry = NULL;
+    
+    ChkIfA(pKey == NULL, E_INVALIDARG);
+    
+    pszUser = pszUser ? pszUser : "";
+    pszRealm = pszRealm ? pszRealm : "";
+    pszPassword = pszPassword ? pszPassword : "";
+    
+    // strings too long to cache (or no cache at all) just get the key derived every time
+    pEntry = Lookup(pszUser, pszRealm, pszPassword, passwordAlgorithm);
+    
+    if (pEntry && pEntry->fHasKey)
+    {
+        _hits++;
+        *pKey = pEntry->key;
+    }
+    else
+    {
+        _misses++;
+        Chk(pKey->InitLongTerm(pszUser, pszRealm, pszPassword, passwordAlgorithm));
+        if (pEntry)
+        {
+            pEntry->key = *pKey;
+            pEntry->fHasKey = true;
+        }
+    }
+    
+Cleanup:
+    return hr;
+}
+
+HRESULT CStunKeyCache::GetLongTermKeySha256(const char* pszUser, const char* pszRealm, const char* pszPassword, CStunIntegrityKeySha256* pKey, uint16_t passwordAlgorithm)
+{
+    HRESULT hr = S_OK;
+    Entry* pEntry = NULL;
+    
+    ChkIfA(pKey == NULL, E_INVALIDARG);
+    
+    pszUser = pszUser ? pszUser : "";
+    pszRealm = pszRealm ? pszRealm : "";
+    pszPassword = pszPassword ? pszPassword : "";
+    
+    pEntry = Lookup(pszUser, pszRealm, pszPassword, passwordAlgorithm);
+    
+    if (pEntry && pEntry->fHasKeySha256)
+    {
+        _hits++;
+        *pKey = pEntry->keySha256;
+    }
+    else
+    {
+        _misses++;
+        Chk(pKey->InitLongTerm(pszUser, pszRealm, pszPassword, passwordAlgorithm));
+        if (pEntry)
+        {
+            pEntry->keySha256 = *pKey;
+            pEntry->fHasKeySha256 = true;
+        }
+    }
+    
+Cleanup:
+    return hr;
+}
+
+uint64_t CStunKeyCache::GetHitCount()
+{
+    return _hits;
+}
+
+uint64_t CStunKeyCache::GetMissCount()
+{
+    return _misses;
+}
@@ -0,0 +1,177 @@
+/*
+   Copyright 2011 John Selbie
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef STUN_INTEGRITY_H
+#define STUN_INTEGRITY_H
+
+#include "stuntypes.h"
+#include "stunauth.h"
+
+#ifndef __APPLE__
+#include <openssl/sha.h>
+#else
+#define COMMON_DIGEST_FOR_OPENSSL
+#include <CommonCrypto/CommonCrypto.h>
+#endif
+
+
+// CStunIntegrityKey is an HMAC-SHA1 key for the MESSAGE-INTEGRITY attribute, with the key already
+// hashed in.  HMAC starts both its inner and outer hash with a block derived from the key - Init
+// hashes those two blocks once and keeps the SHA-1 state after each.  Computing a message's HMAC
+// then only costs hashing the message itself and the inner digest.
+//    Cheap to copy (no allocations), so a key can be computed once per credential
+//    and carried from validating a request to signing its response.
+
+class CStunIntegrityKey
+{
+private:
+    SHA_CTX _inner;  // SHA-1 state after hashing (key ^ ipad)
+    SHA_CTX _outer;  // SHA-1 state after hashing (key ^ opad)
+    bool _fValid;
+
+public:
+    static const size_t c_hmacsize = 20;
+    static const size_t c_longtermkeysize = 16;
+    static const size_t c_maxlongtermkeysize = 32;
+
+    CStunIntegrityKey();
+    
+    void Reset();
+    bool IsValid() const;
+
+    HRESULT Init(const uint8_t* key, size_t keylength);
+    
+    // short term credentials: the key is the password
+    HRESULT InitShortTerm(const char* pszPassword);
+    
+    // long term credentials: the key is MD5(username ":" realm ":" password), or SHA-256 of the same
+    // when the client picked that with the PASSWORD-ALGORITHM attribute
+    HRESULT InitLongTerm(const char* pszUser, const char* pszRealm, const char* pszPassword, uint16_t passwordAlgorithm=STUN_PASSWORD_ALGORITHM_MD5);
+    static HRESULT ComputeLongTermKey(const char* pszUser, const char* pszRealm, const char* pszPassword, uint8_t* pKey);
+    
+    // pKey has room for c_maxlongtermkeysize bytes.  *pKeyLength is c_longtermkeysize for MD5, c_maxlongtermkeysize for SHA-256
+    static HRESULT ComputeLongTermKey(const char* pszUser, const char* pszRealm, const char* pszPassword, uint16_t passwordAlgorithm, uint8_t* pKey, size_t* pKeyLength);
+
+    // writes the c_hmacsize byte HMAC of length bytes at pData to pResult
+    void Compute(const uint8_t* pData, size_t length, uint8_t* pResult) const;
+    
+    // Compute and a CRC-32 of the same bytes of a STUN message, for a MESSAGE-INTEGRITY that is followed by a
+    // FINGERPRINT.  The HMAC is computed as if the header's length field were lengthField (network byte order) -
+    // it's patched while hashing and put back - the CRC covers the bytes as they are.
+    // *pCrc is continued (Crc32Update), so start it at 0
+    void ComputeWithCrc32(uint8_t* pData, size_t length, uint16_t lengthField, uint8_t* pResult, uint32_t* pCrc) const;
+    
+    // the five SHA-1 state words after the inner and outer key blocks, for code that runs the hash itself
+    void GetState(uint32_t* pInner, uint32_t* pOuter) const;
+};
+
+
+// CStunIntegrityKeySha256 is the same thing for the MESSAGE-INTEGRITY-SHA256 attribute (RFC 8489),
+// an HMAC-SHA256 whose key is derived from the credentials exactly like the SHA-1 one.
+// OpenSSL uses the SHA extensions (SHA-NI) for the hashing when the CPU has them.
+
+class CStunIntegrityKeySha256
+{
+private:
+    SHA256_CTX _inner;  // SHA-256 state after hashing (key ^ ipad)
+    SHA256_CTX _outer;  // SHA-256 state after hashing (key ^ opad)
+    bool _fValid;
+
+public:
+    static const size_t c_hmacsize = 32;
+    static const size_t c_minhmacsize = 16; // a sender may truncate the HMAC, down to 16 bytes
+
+    CStunIntegrityKeySha256();
+    
+    void Reset();
+    bool IsValid() const;
+
+    HRESULT Init(const uint8_t* key, size_t keylength);
+    HRESULT InitShortTerm(const char* pszPassword);
+    HRESULT InitLongTerm(const char* pszUser, const char* pszRealm, const char* pszPassword, uint16_t passwordAlgorithm=STUN_PASSWORD_ALGORITHM_MD5);
+
+    // writes the c_hmacsize byte HMAC of length bytes at pData to pResult
+    void Compute(const uint8_t* pData, size_t length, uint8_t* pResult) const;
+};
+
+
+// What a MESSAGE-INTEGRITY check hashes and compares against (see CStunMessageReader::GetMessageIntegrityInput)
+struct StunIntegrityInput
+{
+    uint8_t* pData;          // start of the message
+    size_t length;           // number of bytes covered by the HMAC
+    uint16_t lengthField;    // value (network byte order) the header length field must have while hashing
+    const uint8_t* pHmac;    // the HMAC the message carries
+    size_t hmacLength;       // and its length (MESSAGE-INTEGRITY-SHA256 may be truncated)
+};
+
+
+// CStunKeyCache remembers the long term keys derived for recent (username, realm) pairs, so a
+// client sending a steady stream of authenticated requests doesn't cost an MD5 and an HMAC key
+// setup for every request - and every response.
+//    Bounded - a fixed number of slots, direct mapped by a hash of the username and realm.
+//    A slot is only a hit for the same password and password algorithm it was derived with, so a
+//    changed password is just a miss.  A new credential generation from the auth provider discards everything.
+//    The SHA-1 and SHA-256 HMAC keys for a slot are each set up the first time they're asked for.
+//    Not thread safe - each thread that handles requests owns one.
+
+class CStunKeyCache
+{
+private:
+    struct Entry
+    {
+        bool fValid;
+        uint32_t hash;
+        char szUser[MAX_STUN_AUTH_STRING_SIZE+1];
+        char szRealm[MAX_STUN_AUTH_STRING_SIZE+1];
+        char szPassword[MAX_STUN_AUTH_STRING_SIZE+1];
+        uint16_t passwordAlgorithm;
+        bool fHasKey;
+        bool fHasKeySha256;
+        CStunIntegrityKey key;
+        CStunIntegrityKeySha256 keySha256;
+    };
+    
+    std::vector<Entry> _entries;
+    uint32_t _mask;
+    uint32_t _generation;
+    uint64_t _hits;
+    uint64_t _misses;
+    
+    static uint32_t Hash(const char* pszUser, const char* pszRealm);
+    Entry* Lookup(const char* pszUser, const char* pszRealm, const char* pszPassword, uint16_t passwordAlgorithm);
+    
+public:
+    static const size_t c_defaultSize = 256;
+    
+    CStunKeyCache();
+    
+    // size is rounded up to a power of 2
+    HRESULT Init(size_t size);
+    void Reset();
+    
+    // discards every cached key if generation is different from the last one seen
+    void SetGeneration(uint32_t generation);
+    void Flush();
+    
+    HRESULT GetLongTermKey(const char* pszUser, const char* pszRealm, const char* pszPassword, CStunIntegrityKey* pKey, uint16_t passwordAlgorithm=STUN_PASSWORD_ALGORITHM_MD5);
+    HRESULT GetLongTermKeySha256(const char* pszUser, const char* pszRealm, const char* pszPassword, CStunIntegrityKeySha256* pKey, uint16_t passwordAlgorithm=STUN_PASSWORD_ALGORITHM_MD5);
+    
+    uint64_t GetHitCount();
+    uint64_t GetMissCount();
+};
+
+#endif
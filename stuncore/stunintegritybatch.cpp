@@ -0,0 +1,361 @@
+/*
+   Copyright 2011 John Selbie
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "commonincludes.hpp"
+#include "stunintegrity.h"
+#include "stunintegritybatch.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAS_INTEGRITY_AVX2
+#include <immintrin.h>
+#endif
+
+
+static const size_t c_sha1BlockSize = 64;
+static const size_t c_sha1StateWords = 5;
+
+
+#ifdef HAS_INTEGRITY_AVX2
+
+static inline void WriteBigEndian32(uint8_t* p, uint32_t value)
+{
+    p[0] = (uint8_t)(value >> 24);
+    p[1] = (uint8_t)(value >> 16);
+    p[2] = (uint8_t)(value >> 8);
+    p[3] = (uint8_t)value;
+}
+
+// the message length (in bits) that ends SHA-1 padding
+static inline void WriteBitLength(uint8_t* p, uint64_t bytes)
+{
+    uint64_t bits = bytes * 8;
+    WriteBigEndian32(p, (uint32_t)(bits >> 32));
+    WriteBigEndian32(p + 4, (uint32_t)bits);
+}
+
+#define SHA1X8_ROTL(x, n) _mm256_or_si256(_mm256_slli_epi32((x), (n)), _mm256_srli_epi32((x), 32-(n)))
+
+#define SHA1X8_ROUND(f, k, w) \
+{ \
+    __m256i temp = _mm256_add_epi32(_mm256_add_epi32(SHA1X8_ROTL(a, 5), (f)), _mm256_add_epi32(_mm256_add_epi32(e, (k)), (w))); \
+    e = d; \
+    d = c; \
+    c = SHA1X8_ROTL(b, 30); \
+    b = a; \
+    a = temp; \
+}
+
+// Loads 32 bytes at offset from each of the 8 blocks, and transposes them so pW[n] holds
+// word n (byte swapped to big endian) from every lane - an 8x8 transpose of 32 bit values
+__attribute__((target("avx2")))
+static void Sha1LoadX8(const uint8_t* const pBlocks[CStunIntegrityBatch::c_maxsize], size_t offset, __m256i* pW)
+{
+    const __m256i byteswap = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+                                              3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+    __m256i r[8], t[8], u[8];
+
+    for (int lane = 0; lane < 8; lane++)
+    {
+        r[lane] = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i*)(pBlocks[lane] + offset)), byteswap);
+    }
+
+    for (int pair = 0; pair < 8; pair += 4)
+    {
+        t[pair+0] = _mm256_unpacklo_epi32(r[pair+0], r[pair+1]);
+        t[pair+1] = _mm256_unpackhi_epi32(r[pair+0], r[pair+1]);
+        t[pair+2] = _mm256_unpacklo_epi32(r[pair+2], r[pair+3]);
+        t[pair+3] = _mm256_unpackhi_epi32(r[pair+2], r[pair+3]);
+
+        u[pair+0] = _mm256_unpacklo_epi64(t[pair+0], t[pair+2]);
+        u[pair+1] = _mm256_unpackhi_epi64(t[pair+0], t[pair+2]);
+        u[pair+2] = _mm256_unpacklo_epi64(t[pair+1], t[pair+3]);
+        u[pair+3] = _mm256_unpackhi_epi64(t[pair+1], t[pair+3]);
+    }
+
+    // u[0..3] hold words 0-3 (low half) and 4-7 (high half) of lanes 0-3, u[4..7] the same for lanes 4-7
+    for (int word = 0; word < 4; word++)
+    {
+        pW[word] = _mm256_permute2x128_si256(u[word], u[word+4], 0x20);
+        pW[word+4] = _mm256_permute2x128_si256(u[word], u[word+4], 0x31);
+    }
+}
+
+// Runs one SHA-1 block for each of 8 lanes.  state[word][lane] is the hash state, pBlocks[lane] the
+// lane's next 64 bytes.  Lanes with a zero in laneMask are left as they were (their block is still read).
+__attribute__((target("avx2")))
+static void Sha1CompressX8(uint32_t state[c_sha1StateWords][CStunIntegrityBatch::c_maxsize], const uint8_t* const pBlocks[CStunIntegrityBatch::c_maxsize], const uint32_t laneMask[CStunIntegrityBatch::c_maxsize])
+{
+    const __m256i k1 = _mm256_set1_epi32(0x5A827999);
+    const __m256i k2 = _mm256_set1_epi32(0x6ED9EBA1);
+    const __m256i k3 = _mm256_set1_epi32(0x8F1BBCDC);
+    const __m256i k4 = _mm256_set1_epi32((int)0xCA62C1D6);
+
+    __m256i mask = _mm256_loadu_si256((const __m256i*)laneMask);
+    __m256i a0 = _mm256_loadu_si256((const __m256i*)state[0]);
+    __m256i b0 = _mm256_loadu_si256((const __m256i*)state[1]);
+    __m256i c0 = _mm256_loadu_si256((const __m256i*)state[2]);
+    __m256i d0 = _mm256_loadu_si256((const __m256i*)state[3]);
+    __m256i e0 = _mm256_loadu_si256((const __m256i*)state[4]);
+    __m256i a = a0, b = b0, c = c0, d = d0, e = e0;
+    __m256i w[16];
+    int t;
+
+    COMPILE_TIME_ASSERT(CStunIntegrityBatch::c_maxsize == 8);
+
+    // transpose: vector t holds big endian word t of every lane's block
+    for (t = 0; t < 16; t += 8)
+    {
+        Sha1LoadX8(pBlocks, t*4, &w[t]);
+    }
+
+    // the message schedule is kept in a 16 entry circular buffer:  w[t] = rotl1(w[t-3] ^ w[t-8] ^ w[t-14] ^ w[t-16])
+    for (t = 0; t < 20; t++)
+    {
+        if (t >= 16)
+        {
+            w[t&15] = SHA1X8_ROTL(_mm256_xor_si256(_mm256_xor_si256(w[(t+13)&15], w[(t+8)&15]), _mm256_xor_si256(w[(t+2)&15], w[t&15])), 1);
+        }
+        SHA1X8_ROUND(_mm256_or_si256(_mm256_and_si256(b, c), _mm256_andnot_si256(b, d)), k1, w[t&15]);
+    }
+
+    for (; t < 40; t++)
+    {
+        w[t&15] = SHA1X8_ROTL(_mm256_xor_si256(_mm256_xor_si256(w[(t+13)&15], w[(t+8)&15]), _mm256_xor_si256(w[(t+2)&15], w[t&15])), 1);
+        SHA1X8_ROUND(_mm256_xor_si256(_mm256_xor_si256(b, c), d), k2, w[t&15]);
+    }
+
+    for (; t < 60; t++)
+    {
+        w[t&15] = SHA1X8_ROTL(_mm256_xor_si256(_mm256_xor_si256(w[(t+13)&15], w[(t+8)&15]), _mm256_xor_si256(w[(t+2)&15], w[t&15])), 1);
+        SHA1X8_ROUND(_mm256_or_si256(_mm256_and_si256(b, c), _mm256_and_si256(d, _mm256_or_si256(b, c))), k3, w[t&15]);
+    }
+
+    for (; t < 80; t++)
+    {
+        w[t&15] = SHA1X8_ROTL(_mm256_xor_si256(_mm256_xor_si256(w[(t+13)&15], w[(t+8)&15]), _mm256_xor_si256(w[(t+2)&15], w[t&15])), 1);
+        SHA1X8_ROUND(_mm256_xor_si256(_mm256_xor_si256(b, c), d), k4, w[t&15]);
+    }
+
+    _mm256_storeu_si256((__m256i*)state[0], _mm256_blendv_epi8(a0, _mm256_add_epi32(a0, a), mask));
+    _mm256_storeu_si256((__m256i*)state[1], _mm256_blendv_epi8(b0, _mm256_add_epi32(b0, b), mask));
+    _mm256_storeu_si256((__m256i*)state[2], _mm256_blendv_epi8(c0, _mm256_add_epi32(c0, c), mask));
+    _mm256_storeu_si256((__m256i*)state[3], _mm256_blendv_epi8(d0, _mm256_add_epi32(d0, d), mask));
+    _mm256_storeu_si256((__m256i*)state[4], _mm256_blendv_epi8(e0, _mm256_add_epi32(e0, e), mask));
+}
+
+#endif
+
+
+CStunIntegrityBatch::CStunIntegrityBatch()
+{
+    Reset();
+    _fUseSimd = HasSimd();
+}
+
+void CStunIntegrityBatch::Reset()
+{
+    _count = 0;
+}
+
+bool CStunIntegrityBatch::HasSimd()
+{
+#ifdef HAS_INTEGRITY_AVX2
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+#else
+    return false;
+#endif
+}
+
+void CStunIntegrityBatch::SetUseSimd(bool fUseSimd)
+{
+    _fUseSimd = fUseSimd && HasSimd();
+}
+
+HRESULT CStunIntegrityBatch::Add(const CStunIntegrityKey& key, const StunIntegrityInput& input, size_t* pIndex)
+{
+    HRESULT hr = S_OK;
+
+    ChkIfA(pIndex == NULL, E_INVALIDARG);
+    ChkIfA(key.IsValid() == false, E_INVALIDARG);
+    ChkIfA(input.pData == NULL, E_INVALIDARG);
+    ChkIfA(input.pHmac == NULL, E_INVALIDARG);
+    ChkIf(_count >= c_maxsize, E_FAIL);
+
+    _entries[_count].pKey = &key;
+    _entries[_count].input = input;
+    _entries[_count].fValid = false;
+    *pIndex = _count;
+    _count++;
+
+Cleanup:
+    return hr;
+}
+
+size_t CStunIntegrityBatch::GetCount()
+{
+    return _count;
+}
+
+bool CStunIntegrityBatch::IsFull()
+{
+    return (_count >= c_maxsize);
+}
+
+bool CStunIntegrityBatch::IsValid(size_t index)
+{
+    return ((index < _count) && _entries[index].fValid);
+}
+
+void CStunIntegrityBatch::Verify()
+{
+    uint16_t lengthFields[c_maxsize];
+
+    // patch the length fields for hashing.  Put back in reverse order, in case a message was added twice
+    for (size_t index = 0; index < _count; index++)
+    {
+        StunIntegrityInput& input = _entries[index].input;
+        memcpy(&lengthFields[index], input.pData + 2, sizeof(uint16_t));
+        memcpy(input.pData + 2, &input.lengthField, sizeof(uint16_t));
+    }
+
+    if (_fUseSimd && (_count > 1))
+    {
+        VerifySimd();
+    }
+    else
+    {
+        for (size_t index = 0; index < _count; index++)
+        {
+            VerifyOne(_entries[index]);
+        }
+    }
+
+    for (size_t index = _count; index > 0; index--)
+    {
+        memcpy(_entries[index-1].input.pData + 2, &lengthFields[index-1], sizeof(uint16_t));
+    }
+}
+
+void CStunIntegrityBatch::VerifyOne(Entry& entry)
+{
+    uint8_t hmac[CStunIntegrityKey::c_hmacsize];
+
+    entry.pKey->Compute(entry.input.pData, entry.input.length, hmac);
+    entry.fValid = (memcmp(hmac, entry.input.pHmac, sizeof(hmac)) == 0);
+}
+
+void CStunIntegrityBatch::VerifySimd()
+{
+#ifdef HAS_INTEGRITY_AVX2
+    uint32_t state[c_sha1StateWords][c_maxsize] = {};
+    uint32_t outer[c_sha1StateWords][c_maxsize] = {};
+    uint8_t tails[c_maxsize][c_sha1BlockSize*2] = {};
+    const uint8_t* blocks[c_maxsize];
+    uint32_t laneMask[c_maxsize];
+    size_t fullBlocks[c_maxsize] = {};
+    size_t totalBlocks[c_maxsize] = {};
+    size_t maxBlocks = 0;
+
+    // The key blocks are already hashed, so each lane starts from its key's inner state.  Only the
+    // last one or two blocks of a message need padding - those are built in tails, the rest is hashed in place
+    for (size_t lane = 0; lane < _count; lane++)
+    {
+        const StunIntegrityInput& input = _entries[lane].input;
+        uint32_t innerWords[c_sha1StateWords];
+        uint32_t outerWords[c_sha1StateWords];
+        size_t remainder = input.length % c_sha1BlockSize;
+        size_t tailBlocks = ((remainder + 9) > c_sha1BlockSize) ? 2 : 1; // room for the 0x80 byte and the 8 byte length
+
+        _entries[lane].pKey->GetState(innerWords, outerWords);
+        for (size_t word = 0; word < c_sha1StateWords; word++)
+        {
+            state[word][lane] = innerWords[word];
+            outer[word][lane] = outerWords[word];
+        }
+
+        fullBlocks[lane] = input.length / c_sha1BlockSize;
+        totalBlocks[lane] = fullBlocks[lane] + tailBlocks;
+
+        memcpy(tails[lane], input.pData + fullBlocks[lane]*c_sha1BlockSize, remainder);
+        tails[lane][remainder] = 0x80;
+        WriteBitLength(tails[lane] + tailBlocks*c_sha1BlockSize - 8, c_sha1BlockSize + input.length);
+
+        maxBlocks = (totalBlocks[lane] > maxBlocks) ? totalBlocks[lane] : maxBlocks;
+    }
+
+    // inner hash - lanes that have run out of blocks just idle until the longest message is done
+    for (size_t block = 0; block < maxBlocks; block++)
+    {
+        for (size_t lane = 0; lane < c_maxsize; lane++)
+        {
+            if (block < fullBlocks[lane])
+            {
+                blocks[lane] = _entries[lane].input.pData + block*c_sha1BlockSize;
+                laneMask[lane] = 0xffffffff;
+            }
+            else if (block < totalBlocks[lane])
+            {
+                blocks[lane] = tails[lane] + (block - fullBlocks[lane])*c_sha1BlockSize;
+                laneMask[lane] = 0xffffffff;
+            }
+            else
+            {
+                blocks[lane] = tails[lane];
+                laneMask[lane] = 0;
+            }
+        }
+
+        Sha1CompressX8(state, blocks, laneMask);
+    }
+
+    // outer hash - always one block: the inner digest and its padding
+    for (size_t lane = 0; lane < c_maxsize; lane++)
+    {
+        uint8_t* pBlock = tails[lane];
+
+        memset(pBlock, '\0', c_sha1BlockSize);
+        for (size_t word = 0; word < c_sha1StateWords; word++)
+        {
+            WriteBigEndian32(pBlock + word*4, state[word][lane]);
+        }
+        pBlock[CStunIntegrityKey::c_hmacsize] = 0x80;
+        WriteBitLength(pBlock + c_sha1BlockSize - 8, c_sha1BlockSize + CStunIntegrityKey::c_hmacsize);
+
+        blocks[lane] = pBlock;
+        laneMask[lane] = (lane < _count) ? 0xffffffff : 0;
+    }
+
+    Sha1CompressX8(outer, blocks, laneMask);
+
+    for (size_t lane = 0; lane < _count; lane++)
+    {
+        uint8_t hmac[CStunIntegrityKey::c_hmacsize];
+
+        for (size_t word = 0; word < c_sha1StateWords; word++)
+        {
+            WriteBigEndian32(hmac + word*4, outer[word][lane]);
+        }
+
+        _entries[lane].fValid = (memcmp(hmac, _entries[lane].input.pHmac, sizeof(hmac)) == 0);
+    }
+#else
+    for (size_t index = 0; index < _count; index++)
+    {
+        VerifyOne(_entries[index]);
+    }
+#endif
+}
@@ -0,0 +1,70 @@
+/*
+   Copyright 2011 John Selbie
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef STUN_INTEGRITY_BATCH_H
+#define STUN_INTEGRITY_BATCH_H
+
+#include "stunintegrity.h"
+
+
+// CStunIntegrityBatch checks the MESSAGE-INTEGRITY of several messages together.  SHA-1 is a
+// chain of dependent steps, so one hash at a time leaves most of a modern core idle.  With AVX2,
+// the HMACs of up to 8 messages are computed side by side - each 32 bit lane of the vector
+// registers runs the hash for a different message (the "multi-buffer" technique).
+//    Every message still gets its own verdict - a bad HMAC only fails that message.
+//    Without AVX2 (or with a single message) each HMAC is computed by CStunIntegrityKey::Compute.
+//    The keys and the message buffers are referenced, not copied - they have to stay put until Verify returns.
+//    Verify patches each message's length field while hashing (see StunIntegrityInput) and puts it back.
+
+class CStunIntegrityBatch
+{
+public:
+    static const size_t c_maxsize = 8;
+
+private:
+    struct Entry
+    {
+        const CStunIntegrityKey* pKey;
+        StunIntegrityInput input;
+        bool fValid;
+    };
+
+    Entry _entries[c_maxsize];
+    size_t _count;
+    bool _fUseSimd;
+
+    void VerifyOne(Entry& entry);
+    void VerifySimd();
+
+public:
+    CStunIntegrityBatch();
+
+    void Reset();
+
+    // queues a check. *pIndex is what to pass to IsValid once Verify is done
+    HRESULT Add(const CStunIntegrityKey& key, const StunIntegrityInput& input, size_t* pIndex);
+    size_t GetCount();
+    bool IsFull();
+
+    void Verify();
+    bool IsValid(size_t index);
+
+    // true if the CPU can run the multi-buffer code.  SetUseSimd(false) forces one message at a time (test and benchmark code)
+    static bool HasSimd();
+    void SetUseSimd(bool fUseSimd);
+};
+
+#endif
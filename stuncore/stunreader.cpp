@@ -21,16 +21,7 @@
 #include "stunreader.h"
 #include "stunutils.h"
 #include "socketaddress.h"
-#include <boost/crc.hpp>
-
-#ifndef __APPLE__
-#include <openssl/evp.h>
-#include <openssl/hmac.h>
-#include <openssl/md5.h>
-#else
-#define COMMON_DIGEST_FOR_OPENSSL
-#include <CommonCrypto/CommonCrypto.h>
-#endif
+#include "crc32.h"
 
 #include "stunauth.h"
 #include "fasthash.h"
@@ -41,6 +32,7 @@
 
 CStunMessageReader::CStunMessageReader()
 {
+    memset(_slots, '\0', sizeof(_slots));
     Reset();
 }
 
@@ -49,10 +41,6 @@ void CStunMessageReader::Reset()
     _fAllowLegacyFormat = true;
     _fMessageIsLegacyFormat = false;
     _state = HeaderNotRead;
-    _mapAttributes.Reset();
-    
-    _indexFingerprint = -1;
-    _indexMessageIntegrity = -1;
     _countAttributes = 0;
     
     memset(&_transactionid, '\0', sizeof(_transactionid));
@@ -90,19 +78,72 @@ uint16_t CStunMessageReader::HowManyBytesNeeded()
     return 0;
 }
 
+int CStunMessageReader::GetWellKnownSlot(uint16_t attributeType)
+{
+    switch (attributeType)
+    {
+        case STUN_ATTRIBUTE_MAPPEDADDRESS: return SlotMappedAddress;
+        case STUN_ATTRIBUTE_CHANGEREQUEST: return SlotChangeRequest;
+        case STUN_ATTRIBUTE_SOURCEADDRESS: return SlotSourceAddress;
+        case STUN_ATTRIBUTE_CHANGEDADDRESS: return SlotChangedAddress;
+        case STUN_ATTRIBUTE_USERNAME: return SlotUserName;
+        case STUN_ATTRIBUTE_LEGACY_PASSWORD: return SlotLegacyPassword;
+        case STUN_ATTRIBUTE_MESSAGEINTEGRITY: return SlotMessageIntegrity;
+        case STUN_ATTRIBUTE_ERRORCODE: return SlotErrorCode;
+        case STUN_ATTRIBUTE_REALM: return SlotRealm;
+        case STUN_ATTRIBUTE_NONCE: return SlotNonce;
+        case STUN_ATTRIBUTE_MESSAGEINTEGRITY_SHA256: return SlotMessageIntegritySha256;
+        case STUN_ATTRIBUTE_PASSWORD_ALGORITHM: return SlotPasswordAlgorithm;
+        case STUN_ATTRIBUTE_XORMAPPEDADDRESS: return SlotXorMappedAddress;
+        case STUN_ATTRIBUTE_PADDING: return SlotPadding;
+        case STUN_ATTRIBUTE_RESPONSE_PORT: return SlotResponsePort;
+        case STUN_ATTRIBUTE_XORMAPPEDADDRESS_OPTIONAL: return SlotXorMappedAddressOptional;
+        case STUN_ATTRIBUTE_FINGERPRINT: return SlotFingerprint;
+        case STUN_ATTRIBUTE_RESPONSE_ORIGIN: return SlotResponseOrigin;
+        case STUN_ATTRIBUTE_OTHER_ADDRESS: return SlotOtherAddress;
+    }
+    return SlotNone;
+}
+
+// index into _attributes of the last attribute of this type, or -1
+int CStunMessageReader::FindAttribute(uint16_t attributeType)
+{
+    int slot = GetWellKnownSlot(attributeType);
+    
+    if (slot != SlotNone)
+    {
+        int index = _slots[slot];
+        return ((index < _countAttributes) && (_attributes[index].attributeType == attributeType)) ? index : -1;
+    }
+    
+    for (int index = _countAttributes - 1; index >= 0; index--)
+    {
+        if (_attributes[index].attributeType == attributeType)
+        {
+            return index;
+        }
+    }
+    return -1;
+}
+
+StunAttribute* CStunMessageReader::LookupAttribute(uint16_t attributeType)
+{
+    int index = FindAttribute(attributeType);
+    return (index >= 0) ? &_attributes[index] : NULL;
+}
+
 bool CStunMessageReader::HasFingerprintAttribute()
 {
-    StunAttribute *pAttrib = _mapAttributes.Lookup(STUN_ATTRIBUTE_FINGERPRINT);
+    StunAttribute *pAttrib = LookupAttribute(STUN_ATTRIBUTE_FINGERPRINT);
     return (pAttrib != NULL);
 }
 
 bool CStunMessageReader::IsFingerprintAttributeValid()
 {
     HRESULT hr = S_OK;
-    StunAttribute* pAttrib = _mapAttributes.Lookup(STUN_ATTRIBUTE_FINGERPRINT);
+    StunAttribute* pAttrib = LookupAttribute(STUN_ATTRIBUTE_FINGERPRINT);
     CRefCountedBuffer spBuffer;
     size_t size=0;
-    boost::crc_32_type crc;
     uint32_t computedValue=1;
     uint32_t readValue=0;
     uint8_t* ptr = NULL;
@@ -125,8 +166,7 @@ bool CStunMessageReader::IsFingerprintAttributeValid()
     ptr = spBuffer->GetData();
     ChkIfA(ptr==NULL, E_FAIL);
 
-    crc.process_bytes(ptr, size-8); // -8 because we're assuming the fingerprint attribute is 8 bytes and is the last attribute in the stream
-    computedValue = crc.checksum();
+    computedValue = Crc32(ptr, size-8); // -8 because we're assuming the fingerprint attribute is 8 bytes and is the last attribute in the stream
     computedValue = computedValue ^ STUN_FINGERPRINT_XOR;
 
     readValue = *(uint32_t*)(ptr+pAttrib->offset);
@@ -139,220 +179,210 @@ Cleanup:
 
 bool CStunMessageReader::HasMessageIntegrityAttribute()
 {
-    return (NULL != _mapAttributes.Lookup(STUN_ATTRIBUTE_MESSAGEINTEGRITY));
+    return (NULL != LookupAttribute(STUN_ATTRIBUTE_MESSAGEINTEGRITY));
+}
+
+bool CStunMessageReader::HasMessageIntegritySha256Attribute()
+{
+    return (NULL != LookupAttribute(STUN_ATTRIBUTE_MESSAGEINTEGRITY_SHA256));
 }
 
-HRESULT CStunMessageReader::ValidateMessageIntegrity(uint8_t* key, size_t keylength)
+// attributeType is MESSAGE-INTEGRITY or MESSAGE-INTEGRITY-SHA256 with an HMAC of minsize to maxsize bytes
+HRESULT CStunMessageReader::GetIntegrityInput(uint16_t attributeType, size_t minsize, size_t maxsize, StunIntegrityInput* pInput)
 {
     HRESULT hr = S_OK;
     
-    int lastAttributeIndex = _countAttributes - 1;
-    bool fFingerprintAdjustment = false;
-    bool fNoOtherAttributesAfterIntegrity = false;
-    const size_t c_hmacsize = 20;
-    uint8_t hmaccomputed[c_hmacsize] = {}; // zero-init
-    unsigned int hmaclength = c_hmacsize;
-#ifndef __APPLE__
-    HMAC_CTX* ctx = NULL;
-#if OPENSSL_VERSION_NUMBER < 0x10100000L
-    HMAC_CTX ctxData = {};
-    ctx = &ctxData;
-    HMAC_CTX_init(ctx);
-#else
-    ctx = HMAC_CTX_new();
-#endif
-#else
-    CCHmacContext* ctx = NULL;
-    CCHmacContext ctxData = {};
-    ctx = &ctxData;
-    
-    UNREFERENCED_VARIABLE(hmaclength);
-#endif
-    uint32_t chunk32;
-    uint16_t chunk16;
-    size_t len, nChunks;
-    CDataStream stream;
+    int indexAttribute = -1;
+    int indexNext = -1;
+    uint8_t* pData = NULL;
+    uint16_t lengthHeader = 0;
     CRefCountedBuffer spBuffer;
     StunAttribute* pAttribIntegrity=NULL;
     
-    int cmp = 0;
-    bool fContextInit = false;
-    
+    ChkIfA(pInput == NULL, E_INVALIDARG);
     
     ChkIf(_state != BodyValidated, E_FAIL);
     
-    ChkIf(_countAttributes == 0, E_FAIL); // if there's not attributes, there's definitely not a message integrity attribute
-    ChkIf(_indexMessageIntegrity == -1, E_FAIL);
-    
-    // can a key be empty?
-    ChkIfA(key==NULL, E_INVALIDARG);
-    ChkIfA(keylength==0, E_INVALIDARG);
-    
-    pAttribIntegrity = _mapAttributes.Lookup(::STUN_ATTRIBUTE_MESSAGEINTEGRITY);
+    indexAttribute = FindAttribute(attributeType);
+    ChkIf(indexAttribute == -1, E_FAIL);
     
-    ChkIf(pAttribIntegrity == NULL, E_FAIL);
+    pAttribIntegrity = &_attributes[indexAttribute];
 
-    ChkIf(pAttribIntegrity->size != c_hmacsize, E_FAIL);
+    ChkIf((pAttribIntegrity->size < minsize) || (pAttribIntegrity->size > maxsize), E_FAIL);
+    ChkIf((pAttribIntegrity->size % 4) != 0, E_FAIL);
     
-    // first, check to make sure that no other attributes (other than fingerprint) follow the message integrity
-    fNoOtherAttributesAfterIntegrity = (_indexMessageIntegrity == lastAttributeIndex) || ((_indexMessageIntegrity == (lastAttributeIndex-1)) && (_indexFingerprint == lastAttributeIndex));
-    ChkIf(fNoOtherAttributesAfterIntegrity==false, E_FAIL);
-    
-    fFingerprintAdjustment = (_indexMessageIntegrity == (lastAttributeIndex-1));
-
-    Chk(GetBuffer(&spBuffer));
-    stream.Attach(spBuffer, false);
-    
-    // Here comes the fun part.  If there is a fingerprint attribute, we have to adjust the length header in computing the hash
-#ifndef __APPLE__
-#if OPENSSL_VERSION_NUMBER < 0x10100000L // could be lower!
-    HMAC_Init(ctx, key, keylength, EVP_sha1());
-#else
-    HMAC_Init_ex(ctx, key, keylength, EVP_sha1(), NULL);
-#endif
-#else
-    CCHmacInit(ctx, kCCHmacAlgSHA1, key, keylength);
-#endif
-    fContextInit = true;
-    
-    // message type
-    Chk(stream.ReadUint16(&chunk16));
-#ifndef __APPLE__
-    HMAC_Update(ctx, (unsigned char*)&chunk16, sizeof(chunk16));
-#else
-    CCHmacUpdate(ctx, &chunk16, sizeof(chunk16));
-#endif
-    
-    // message length
-    Chk(stream.ReadUint16(&chunk16));
-    if (fFingerprintAdjustment)
+    // first, check to make sure nothing follows the message integrity other than (in this order)
+    // MESSAGE-INTEGRITY-SHA256 if this is MESSAGE-INTEGRITY, and FINGERPRINT
+    indexNext = indexAttribute + 1;
+    if ((attributeType == STUN_ATTRIBUTE_MESSAGEINTEGRITY) && (indexNext < _countAttributes) && (_attributes[indexNext].attributeType == STUN_ATTRIBUTE_MESSAGEINTEGRITY_SHA256))
     {
-        // subtract the length of the fingerprint off the length header
-        // fingerprint attribute is 8 bytes long including it's own header
-        // and to do this, we have to fix the network byte ordering issue
-        uint16_t lengthHeader = ntohs(chunk16);
-        uint16_t adjustedlengthHeader = lengthHeader - 8;
-        
-        
-        chunk16 = htons(adjustedlengthHeader);
+        indexNext++;
     }
-    
-#ifndef __APPLE__
-    HMAC_Update(ctx, (unsigned char*)&chunk16, sizeof(chunk16));
-#else
-    CCHmacUpdate(ctx, &chunk16, sizeof(chunk16));
-#endif
-    
-    // now include everything up to the hash attribute itself.
-    len = pAttribIntegrity->offset;
-    len -= 4; // subtract the size of the attribute header
-    len -= 4; // subtract the size of the message header (not including the transaction id)
-    
-    // len should be the number of bytes from the start of the transaction ID up through to the start of the integrity attribute header
-    // the stun message has to be a multiple of 4 bytes, so we can read in 32 bit chunks
-    nChunks = len / 4;
-    ASSERT((len % 4) == 0);
-    for (size_t count = 0; count < nChunks; count++)
+    if ((indexNext < _countAttributes) && (_attributes[indexNext].attributeType == STUN_ATTRIBUTE_FINGERPRINT))
     {
-        Chk(stream.ReadUint32(&chunk32));
-#ifndef __APPLE__
-        HMAC_Update(ctx, (unsigned char*)&chunk32, sizeof(chunk32));
-#else
-        CCHmacUpdate(ctx, &chunk32, sizeof(chunk32));
-#endif
+        indexNext++;
     }
+    ChkIf(indexNext != _countAttributes, E_FAIL);
+
+    Chk(GetBuffer(&spBuffer));
+    pData = spBuffer->GetData();
     
-#ifndef __APPLE__
-    HMAC_Final(ctx, hmaccomputed, &hmaclength);
-#else
-    CCHmacFinal(ctx, hmaccomputed);
-#endif
-    
+    // Here comes the fun part.  Whatever follows the integrity attribute, the length header has to be
+    // computed as if the integrity attribute were last.  Rather than hash the header separately,
+    // the caller patches the length field in place for the duration of the hash, so it's one contiguous pass.
+    lengthHeader = htons((uint16_t)(pAttribIntegrity->offset + pAttribIntegrity->size - STUN_HEADER_SIZE));
     
-    // now compare the bytes
-    cmp = memcmp(hmaccomputed, spBuffer->GetData() + pAttribIntegrity->offset, c_hmacsize);
+    // the hash covers everything from the start of the message up to the integrity attribute header
+    pInput->pData = pData;
+    pInput->length = pAttribIntegrity->offset - 4; // subtract the size of the attribute header
+    pInput->lengthField = lengthHeader;
+    pInput->pHmac = pData + pAttribIntegrity->offset;
+    pInput->hmacLength = pAttribIntegrity->size;
     
-    hr = (cmp == 0 ? S_OK : E_FAIL);
+    ASSERT((pInput->length % 4) == 0);
     
 Cleanup:
-    if (fContextInit)
-    {
-#ifndef __APPLE__
-#if OPENSSL_VERSION_NUMBER < 0x10100000L
-        HMAC_CTX_cleanup(ctx);
-#else
-        HMAC_CTX_free(ctx);
-#endif
-#else
-        UNREFERENCED_VARIABLE(fContextInit);
-#endif
-    }
-        
     return hr;
 }
 
-HRESULT CStunMessageReader::ValidateMessageIntegrityShort(const char* pszPassword)
+HRESULT CStunMessageReader::GetMessageIntegrityInput(StunIntegrityInput* pInput)
 {
-    return ValidateMessageIntegrity((uint8_t*)pszPassword, strlen(pszPassword));
+    return GetIntegrityInput(STUN_ATTRIBUTE_MESSAGEINTEGRITY, CStunIntegrityKey::c_hmacsize, CStunIntegrityKey::c_hmacsize, pInput);
 }
 
-HRESULT CStunMessageReader::ValidateMessageIntegrityLong(const char* pszUser, const char* pszRealm, const char* pszPassword)
+HRESULT CStunMessageReader::GetMessageIntegritySha256Input(StunIntegrityInput* pInput)
+{
+    return GetIntegrityInput(STUN_ATTRIBUTE_MESSAGEINTEGRITY_SHA256, CStunIntegrityKeySha256::c_minhmacsize, CStunIntegrityKeySha256::c_hmacsize, pInput);
+}
+
+template <typename KeyType>
+static HRESULT ValidateIntegrityInput(const StunIntegrityInput& input, const KeyType& key)
+{
+    uint8_t hmaccomputed[KeyType::c_hmacsize] = {}; // zero-init
+    uint16_t lengthHeader = 0;
+    
+    ASSERT(input.hmacLength <= sizeof(hmaccomputed));
+    
+    memcpy(&lengthHeader, input.pData + 2, sizeof(lengthHeader));
+    memcpy(input.pData + 2, &input.lengthField, sizeof(input.lengthField));
+    
+    key.Compute(input.pData, input.length, hmaccomputed);
+    
+    memcpy(input.pData + 2, &lengthHeader, sizeof(lengthHeader));
+    
+    // now compare the bytes (a truncated HMAC is compared on its leading bytes)
+    return (memcmp(hmaccomputed, input.pHmac, input.hmacLength) == 0) ? S_OK : E_FAIL;
+}
+
+HRESULT CStunMessageReader::ValidateMessageIntegrity(const CStunIntegrityKey& key)
 {
     HRESULT hr = S_OK;
-    const size_t MAX_KEY_SIZE = MAX_STUN_AUTH_STRING_SIZE*3 + 2;
-    uint8_t key[MAX_KEY_SIZE + 1]; // long enough for 64-char strings and two semicolons and a null char
-    uint8_t* pData = NULL;
-    uint8_t* pDst = key;
-    size_t totallength = 0;
+    StunIntegrityInput input = {};
     
-    size_t passwordlength = pszPassword ? strlen(pszPassword) : 0;
-    size_t userLength = pszUser ? strlen(pszUser)  : 0;
-    size_t realmLength = pszRealm ? strlen(pszRealm) : 0;
+    Chk(GetMessageIntegrityInput(&input));
     
-    uint8_t hash[MD5_DIGEST_LENGTH] = {};
+    ChkIfA(key.IsValid() == false, E_INVALIDARG);
     
-    ChkIf(_state != BodyValidated, E_FAIL);
-   
-    totallength = userLength + realmLength + passwordlength + 2; // +2 for two semi-colons
+    hr = ValidateIntegrityInput(input, key);
     
-    pData = GetStream().GetDataPointerUnsafe();
-    ChkIfA(pData==NULL, E_FAIL);
+Cleanup:
+    return hr;
+}
+
+HRESULT CStunMessageReader::ValidateMessageIntegrityAndFingerprint(const CStunIntegrityKey& key, bool* pfIntegrityValid, bool* pfFingerprintValid)
+{
+    HRESULT hr = S_OK;
+    StunIntegrityInput input = {};
+    uint8_t hmaccomputed[CStunIntegrityKey::c_hmacsize];
+    uint32_t crc = 0;
+    uint32_t readValue = 0;
     
-    if (userLength > 0)
-    {
-        memcpy(pDst, pszUser, userLength);
-        pDst += userLength;
-    }
-    *pDst = ':';
-    pDst++;
+    ChkIfA(pfIntegrityValid == NULL, E_INVALIDARG);
+    ChkIfA(pfFingerprintValid == NULL, E_INVALIDARG);
+    ChkIfA(key.IsValid() == false, E_INVALIDARG);
     
+    Chk(GetMessageIntegrityInput(&input));
     
-    if (realmLength > 0)
-    {
-        memcpy(pDst, pszRealm, realmLength);
-        pDst += realmLength;
-    }
-    *pDst = ':';
-    pDst++;
+    // nothing but the fingerprint may come after the integrity attribute
+    ChkIf(_countAttributes < 2, E_FAIL);
+    ChkIf(_attributes[_countAttributes-1].attributeType != STUN_ATTRIBUTE_FINGERPRINT, E_FAIL);
+    ChkIf(_attributes[_countAttributes-1].size != sizeof(readValue), E_FAIL);
+    ChkIf(_attributes[_countAttributes-2].attributeType != STUN_ATTRIBUTE_MESSAGEINTEGRITY, E_FAIL);
+    ASSERT(input.length + 4 + CStunIntegrityKey::c_hmacsize + 8 == _stream.GetSize());
+    
+    key.ComputeWithCrc32(input.pData, input.length, input.lengthField, hmaccomputed, &crc);
+    crc = Crc32Update(crc, input.pData + input.length, 4 + CStunIntegrityKey::c_hmacsize);
+    
+    memcpy(&readValue, input.pData + _attributes[_countAttributes-1].offset, sizeof(readValue));
+    
+    *pfIntegrityValid = (memcmp(hmaccomputed, input.pHmac, sizeof(hmaccomputed)) == 0);
+    *pfFingerprintValid = (ntohl(readValue) == (crc ^ STUN_FINGERPRINT_XOR));
+    
+Cleanup:
+    return hr;
+}
 
-    if (passwordlength > 0)
-    {
-        memcpy(pDst, pszPassword, passwordlength);
-        pDst += passwordlength;
-    }
-    *pDst = '0'; // null terminate for debugging (does not get hashed)
+HRESULT CStunMessageReader::ValidateMessageIntegritySha256(const CStunIntegrityKeySha256& key)
+{
+    HRESULT hr = S_OK;
+    StunIntegrityInput input = {};
+    
+    Chk(GetMessageIntegritySha256Input(&input));
+    
+    ChkIfA(key.IsValid() == false, E_INVALIDARG);
+    
+    hr = ValidateIntegrityInput(input, key);
     
-    ASSERT(key+totallength == pDst);
+Cleanup:
+    return hr;
+}
+
+HRESULT CStunMessageReader::GetPasswordAlgorithm(uint16_t* pAlgorithm)
+{
+    StunAttribute* pAttrib = NULL;
+    HRESULT hr = S_OK;
+    uint16_t algorithmNBO;
+    uint8_t *pData = NULL;
     
-#ifndef __APPLE__
-    ChkIfA(NULL == MD5(key, totallength, hash), E_FAIL);
-#else
-        CC_MD5(key, totallength, hash);
-#endif
+    ChkIfA(pAlgorithm == NULL, E_INVALIDARG);
     
+    pAttrib = LookupAttribute(STUN_ATTRIBUTE_PASSWORD_ALGORITHM);
+    ChkIf(pAttrib == NULL, E_FAIL);
+    
+    // algorithm (16 bits), parameters length (16 bits), then the parameters
+    ChkIf(pAttrib->size < 4, E_UNEXPECTED);
     
+    pData = _stream.GetDataPointerUnsafe();
+    ChkIf(pData==NULL, E_UNEXPECTED);
     
-    Chk(ValidateMessageIntegrity(hash, ARRAYSIZE(hash)));
+    memcpy(&algorithmNBO, pData + pAttrib->offset, sizeof(algorithmNBO));
+    *pAlgorithm = ntohs(algorithmNBO);
+    
+Cleanup:
+    return hr;
+}
+
+HRESULT CStunMessageReader::ValidateMessageIntegrityShort(const char* pszPassword)
+{
+    HRESULT hr = S_OK;
+    CStunIntegrityKey key;
+    
+    ChkIf(_state != BodyValidated, E_FAIL);
+    Chk(key.InitShortTerm(pszPassword));
+    Chk(ValidateMessageIntegrity(key));
+    
+Cleanup:
+    return hr;
+}
+
+HRESULT CStunMessageReader::ValidateMessageIntegrityLong(const char* pszUser, const char* pszRealm, const char* pszPassword)
+{
+    HRESULT hr = S_OK;
+    CStunIntegrityKey key;
+    
+    ChkIf(_state != BodyValidated, E_FAIL);
+    Chk(key.InitLongTerm(pszUser, pszRealm, pszPassword));
+    Chk(ValidateMessageIntegrity(key));
     
 Cleanup:
     return hr;    
@@ -362,23 +392,21 @@ Cleanup:
 
 HRESULT CStunMessageReader::GetAttributeByIndex(int index, StunAttribute* pAttribute)
 {
-    StunAttribute* pFound = _mapAttributes.LookupValueByIndex((size_t)index);
-    
-    if (pFound == NULL)
+    if ((index < 0) || (index >= _countAttributes))
     {
         return E_FAIL;
     }
     
     if (pAttribute)
     {
-        *pAttribute = *pFound;
+        *pAttribute = _attributes[index];
     }
     return S_OK;
 }
 
 HRESULT CStunMessageReader::GetAttributeByType(uint16_t attributeType, StunAttribute* pAttribute)
 {
-    StunAttribute* pFound = _mapAttributes.Lookup(attributeType);
+    StunAttribute* pFound = LookupAttribute(attributeType);
         
     if (pFound == NULL)
     {
@@ -395,7 +423,7 @@ HRESULT CStunMessageReader::GetAttributeByType(uint16_t attributeType, StunAttri
 
 int CStunMessageReader::GetAttributeCount()
 {
-    return (int)(this->_mapAttributes.Size());
+    return _countAttributes;
 }
 
 HRESULT CStunMessageReader::GetResponsePort(uint16_t* pPort)
@@ -407,7 +435,7 @@ HRESULT CStunMessageReader::GetResponsePort(uint16_t* pPort)
 
     ChkIfA(pPort == NULL, E_INVALIDARG);
 
-    pAttrib = _mapAttributes.Lookup(STUN_ATTRIBUTE_RESPONSE_PORT);
+    pAttrib = LookupAttribute(STUN_ATTRIBUTE_RESPONSE_PORT);
     ChkIf(pAttrib == NULL, E_FAIL);
     
     ChkIf(pAttrib->size != STUN_ATTRIBUTE_RESPONSE_PORT_SIZE, E_UNEXPECTED);
@@ -430,7 +458,7 @@ HRESULT CStunMessageReader::GetChangeRequest(StunChangeRequestAttribute* pChange
 
     ChkIfA(pChangeRequest == NULL, E_INVALIDARG);
     
-    pAttrib = _mapAttributes.Lookup(STUN_ATTRIBUTE_CHANGEREQUEST);
+    pAttrib = LookupAttribute(STUN_ATTRIBUTE_CHANGEREQUEST);
     ChkIf(pAttrib == NULL, E_FAIL);
 
     ChkIf(pAttrib->size != STUN_ATTRIBUTE_CHANGEREQUEST_SIZE, E_UNEXPECTED);
@@ -465,7 +493,7 @@ HRESULT CStunMessageReader::GetPaddingAttributeSize(uint16_t* pSizePadding)
 
     *pSizePadding = 0;
     
-    pAttrib = _mapAttributes.Lookup(STUN_ATTRIBUTE_PADDING);
+    pAttrib = LookupAttribute(STUN_ATTRIBUTE_PADDING);
 
     ChkIf(pAttrib == NULL, E_FAIL);
 
@@ -486,7 +514,7 @@ HRESULT CStunMessageReader::GetErrorCode(uint16_t* pErrorNumber)
 
     ChkIf(pErrorNumber==NULL, E_INVALIDARG);
 
-    pAttrib = _mapAttributes.Lookup(STUN_ATTRIBUTE_ERRORCODE);
+    pAttrib = LookupAttribute(STUN_ATTRIBUTE_ERRORCODE);
     ChkIf(pAttrib == NULL, E_FAIL);
 
     // first 21 bits of error-code attribute must be zero.
@@ -506,7 +534,7 @@ Cleanup:
 HRESULT CStunMessageReader::GetAddressHelper(uint16_t attribType, CSocketAddress* pAddr)
 {
     HRESULT hr = S_OK;
-    StunAttribute* pAttrib = _mapAttributes.Lookup(attribType);
+    StunAttribute* pAttrib = LookupAttribute(attribType);
     uint8_t *pAddrStart = NULL;
 
     ChkIf(pAttrib == NULL, E_FAIL);
@@ -582,7 +610,7 @@ HRESULT CStunMessageReader::GetResponseOriginAddress(CSocketAddress* pAddr)
 HRESULT CStunMessageReader::GetStringAttributeByType(uint16_t attributeType, char* pszValue, /*in-out*/ size_t size)
 {
     HRESULT hr = S_OK;
-    StunAttribute* pAttrib = _mapAttributes.Lookup(attributeType);
+    StunAttribute* pAttrib = LookupAttribute(attributeType);
     
     ChkIfA(pszValue == NULL, E_INVALIDARG);
     ChkIf(pAttrib == NULL, E_INVALIDARG);
@@ -707,35 +735,26 @@ HRESULT CStunMessageReader::ReadBody()
 
         if (SUCCEEDED(hr))
         {
-            int result;
-            StunAttribute attrib;
-            attrib.attributeType = attributeType;
-            attrib.size = attributeLength;
-            attrib.offset = attributeOffset;
-
-            // if we have already read in more attributes than MAX_NUM_ATTRIBUTES, then Insert call will fail (this is how we gate too many attributes)
-            result = _mapAttributes.Insert(attributeType, attrib);
-            hr = (result >= 0) ? S_OK : E_FAIL;
+            // this is how we gate too many attributes
+            hr = (_countAttributes < (int)MAX_NUM_ATTRIBUTES) ? S_OK : E_FAIL;
         }
         
         if (SUCCEEDED(hr))
         {
+            int slot = GetWellKnownSlot(attributeType);
+            StunAttribute& attrib = _attributes[_countAttributes];
+            attrib.attributeType = attributeType;
+            attrib.size = attributeLength;
+            attrib.offset = attributeOffset;
             
-            if (attributeType == ::STUN_ATTRIBUTE_FINGERPRINT)
-            {
-                _indexFingerprint = _countAttributes;
-            }
-            
-            if (attributeType == ::STUN_ATTRIBUTE_MESSAGEINTEGRITY)
+            if (slot != SlotNone)
             {
-                _indexMessageIntegrity = _countAttributes;
+                _slots[slot] = (uint8_t)_countAttributes;
             }
             
             _countAttributes++;
         }
         
-
-        
         if (SUCCEEDED(hr))
         {
             hr = _stream.SeekRelative(attributeLength);
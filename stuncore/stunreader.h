@@ -24,7 +24,7 @@
 #include "stuntypes.h"
 #include "datastream.h"
 #include "socketaddress.h"
-#include "fasthash.h"
+#include "stunintegrity.h"
 
 
 class CStunMessageReader
@@ -48,14 +48,43 @@ private:
 
     static const size_t MAX_NUM_ATTRIBUTES = 30;
     
-    typedef FastHash<uint16_t, StunAttribute, MAX_NUM_ATTRIBUTES, 53> AttributeHashTable; // 53 is a prime number for a reasonable table width
+    // the attributes in the order they appear in the message
+    StunAttribute _attributes[MAX_NUM_ATTRIBUTES];
+    int _countAttributes;
     
-    AttributeHashTable _mapAttributes;
+    // the attribute types the reader and the request handler look up by name get a slot with the
+    // index of the last one of that type in _attributes.  A slot is only believed if it points below
+    // _countAttributes at an attribute of the right type - so Reset doesn't have to clear them
+    enum WellKnownSlot
+    {
+        SlotMappedAddress,
+        SlotChangeRequest,
+        SlotSourceAddress,
+        SlotChangedAddress,
+        SlotUserName,
+        SlotLegacyPassword,
+        SlotMessageIntegrity,
+        SlotErrorCode,
+        SlotRealm,
+        SlotNonce,
+        SlotMessageIntegritySha256,
+        SlotPasswordAlgorithm,
+        SlotXorMappedAddress,
+        SlotPadding,
+        SlotResponsePort,
+        SlotXorMappedAddressOptional,
+        SlotFingerprint,
+        SlotResponseOrigin,
+        SlotOtherAddress,
+        SlotCount,
+        SlotNone = -1
+    };
     
-    // special index values for message integrity attribute validation
-    int _indexFingerprint;
-    int _indexMessageIntegrity;
-    int _countAttributes;
+    uint8_t _slots[SlotCount];
+    
+    static int GetWellKnownSlot(uint16_t attributeType);
+    int FindAttribute(uint16_t attributeType);
+    StunAttribute* LookupAttribute(uint16_t attributeType);
     
 
     StunTransactionId _transactionid;
@@ -67,8 +96,7 @@ private:
     HRESULT ReadBody();
 
     HRESULT GetAddressHelper(uint16_t attribType, CSocketAddress* pAddr);
-    
-    HRESULT ValidateMessageIntegrity(uint8_t* key, size_t keylength);
+    HRESULT GetIntegrityInput(uint16_t attributeType, size_t minsize, size_t maxsize, StunIntegrityInput* pInput);
     
 public:
     CStunMessageReader();
@@ -89,6 +117,24 @@ public:
     bool HasMessageIntegrityAttribute();
     HRESULT ValidateMessageIntegrityShort(const char* pszPassword);
     HRESULT ValidateMessageIntegrityLong(const char* pszUser, const char* pszRealm, const char* pszPassword);
+    HRESULT ValidateMessageIntegrity(const CStunIntegrityKey& key);
+    
+    // what ValidateMessageIntegrity hashes, for checking the integrity of many messages at once (CStunIntegrityBatch)
+    // fails the same way ValidateMessageIntegrity does for a message without a usable MESSAGE-INTEGRITY attribute
+    HRESULT GetMessageIntegrityInput(StunIntegrityInput* pInput);
+    
+    // ValidateMessageIntegrity and IsFingerprintAttributeValid in one walk over the message, for the common ICE layout
+    // where MESSAGE-INTEGRITY is followed only by FINGERPRINT.  Fails if the message isn't laid out that way, otherwise
+    // reports the two results separately - an ICE agent drops a message with a bad fingerprint but answers a bad HMAC with a 401
+    HRESULT ValidateMessageIntegrityAndFingerprint(const CStunIntegrityKey& key, bool* pfIntegrityValid, bool* pfFingerprintValid);
+    
+    // MESSAGE-INTEGRITY-SHA256 (RFC 8489).  A message may carry both integrity attributes
+    bool HasMessageIntegritySha256Attribute();
+    HRESULT ValidateMessageIntegritySha256(const CStunIntegrityKeySha256& key);
+    HRESULT GetMessageIntegritySha256Input(StunIntegrityInput* pInput);
+    
+    // the algorithm from the PASSWORD-ALGORITHM attribute (STUN_PASSWORD_ALGORITHM_MD5 or _SHA256 if it's one we know)
+    HRESULT GetPasswordAlgorithm(uint16_t* pAlgorithm);
     
     HRESULT GetAttributeByType(uint16_t attributeType, StunAttribute* pAttribute);
     HRESULT GetAttributeByIndex(int index, StunAttribute* pAttribute);
@@ -52,6 +52,9 @@ const uint16_t STUN_ATTRIBUTE_REALM = 0x0014;
 const uint16_t STUN_ATTRIBUTE_NONCE = 0x0015;
 const uint16_t STUN_ATTRIBUTE_XORMAPPEDADDRESS = 0x0020;
 
+const uint16_t STUN_ATTRIBUTE_MESSAGEINTEGRITY_SHA256 = 0x001C; // RFC 8489
+const uint16_t STUN_ATTRIBUTE_PASSWORD_ALGORITHM = 0x001D; // RFC 8489
+
 const uint16_t STUN_ATTRIBUTE_PADDING = 0x0026;
 const uint16_t STUN_ATTRIBUTE_RESPONSE_PORT = 0x0027;
 
@@ -61,6 +64,8 @@ const uint16_t STUN_ATTRIBUTE_RESPONSE_PORT = 0x0027;
 // 0x8020 is is not defined in any RFC, but is the value that Vovida server uses
 const uint16_t STUN_ATTRIBUTE_XORMAPPEDADDRESS_OPTIONAL = 0x8020;
 
+const uint16_t STUN_ATTRIBUTE_PASSWORD_ALGORITHMS = 0x8002; // RFC 8489
+
 const uint16_t STUN_ATTRIBUTE_SOFTWARE = 0x8022;
 const uint16_t STUN_ATTRIBUTE_ALTERNATESERVER = 0x8023;
 
@@ -72,6 +77,11 @@ const uint16_t STUN_ATTRIBUTE_OTHER_ADDRESS = 0x802c;
 
 
 
+// PASSWORD-ALGORITHM values (RFC 8489) - the hash that turns "username:realm:password" into the long term key
+const uint16_t STUN_PASSWORD_ALGORITHM_MD5 = 0x0001;
+const uint16_t STUN_PASSWORD_ALGORITHM_SHA256 = 0x0002;
+
+
 const uint16_t STUN_TRANSACTION_ID_LENGTH = 16;
 
 const uint8_t STUN_ATTRIBUTE_FIELD_IPV4 = 1;
@@ -38,28 +38,27 @@ HRESULT GetMappedAddress(uint8_t* pData, size_t size, CSocketAddress* pAddr)
     uint8_t ip6[STUN_IPV6_LENGTH];
     uint32_t ip4;
 
-
-    CRefCountedBuffer spBuffer(new CBuffer(pData, size, false));
-    CDataStream stream(spBuffer);
-
     ChkIfA(pAddr==NULL, E_INVALIDARG);
+    ChkIf(pData==NULL, E_INVALIDARG);
 
-    Chk(stream.SeekDirect(1)); // skip over the zero byte
-
-    Chk(stream.ReadUint8(&attributeid));
-    Chk(stream.ReadUint16(&port));
+    // zero byte, family, port - read straight out of the attribute (no stream needed for 4 fields)
+    ChkIf(size < 4, E_INVALIDARG);
+    attributeid = pData[1];
+    memcpy(&port, pData + 2, sizeof(port));
     port = ntohs(port);
 
     if (attributeid == STUN_ATTRIBUTE_FIELD_IPV4)
     {
-        Chk(stream.ReadUint32(&ip4));
+        ChkIf(size < 4 + STUN_IPV4_LENGTH, E_INVALIDARG);
+        memcpy(&ip4, pData + 4, sizeof(ip4));
         ip4 = ntohl(ip4);
         *pAddr = CSocketAddress(ip4, port);
     }
     else
     {
         sockaddr_in6 addr6={};
-        Chk(stream.Read(ip6, STUN_IPV6_LENGTH));
+        ChkIf(size < 4 + STUN_IPV6_LENGTH, E_INVALIDARG);
+        memcpy(ip6, pData + 4, STUN_IPV6_LENGTH);
         addr6.sin6_family = AF_INET6;
         addr6.sin6_port = htons(port);
         memcpy(&addr6.sin6_addr, ip6, STUN_IPV6_LENGTH);
@@ -0,0 +1,382 @@
+/*
+   Copyright 2011 John Selbie
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "commonincludes.hpp"
+
+#include "stringhelper.h"
+#include "stunwriter.h"
+#include "crc32.h"
+
+
+CStunMessageWriter::CStunMessageWriter() :
+_pData(NULL),
+_capacity(0),
+_size(0),
+_transactionid(),
+_fLegacyMode(false)
+{
+    ;
+}
+
+CStunMessageWriter::CStunMessageWriter(uint8_t* pData, size_t capacity) :
+_pData(NULL),
+_capacity(0),
+_size(0),
+_transactionid(),
+_fLegacyMode(false)
+{
+    Attach(pData, capacity);
+}
+
+void CStunMessageWriter::Attach(uint8_t* pData, size_t capacity)
+{
+    _pData = pData;
+    _capacity = (pData == NULL) ? 0 : ((capacity > c_maxsize) ? c_maxsize : capacity);
+    _size = 0;
+    _transactionid = StunTransactionId();
+}
+
+void CStunMessageWriter::SetLegacyMode(bool fLegacyMode)
+{
+    _fLegacyMode = fLegacyMode;
+}
+
+HRESULT CStunMessageWriter::Reserve(size_t size)
+{
+    return ((_capacity - _size) >= size) ? S_OK : E_FAIL;
+}
+
+void CStunMessageWriter::WriteAttributeHeader(uint16_t attribType, uint16_t size)
+{
+    WriteUint16(htons(attribType));
+    WriteUint16(htons(size));
+}
+
+void CStunMessageWriter::UpdateLengthField()
+{
+    uint16_t length = htons((uint16_t)(_size - STUN_HEADER_SIZE));
+
+    ASSERT(_size >= STUN_HEADER_SIZE);
+    memcpy(_pData + 2, &length, sizeof(length));
+}
+
+HRESULT CStunMessageWriter::AddHeader(StunMessageType msgType, StunMessageClass msgClass)
+{
+    uint16_t msgTypeField = 0;
+    HRESULT hr = S_OK;
+
+    ChkIfA(_size != 0, E_UNEXPECTED);
+    Chk(Reserve(4));
+
+    // same encoding as CStunMessageBuilder::AddHeader
+    msgTypeField =  (msgType & 0x0f80) << 2;
+    msgTypeField |= (msgType & 0x0070) << 1;
+    msgTypeField |= (msgType & 0x000f);
+    msgTypeField |= (msgClass & 0x02) << 7;
+    msgTypeField |= (msgClass & 0x01) << 4;
+
+    WriteUint16(htons(msgTypeField));
+    WriteUint16(0); // length, filled in by AddTransactionId and every attribute after it
+
+Cleanup:
+    return hr;
+}
+
+HRESULT CStunMessageWriter::AddTransactionId(const StunTransactionId& transid)
+{
+    HRESULT hr = S_OK;
+
+    ChkIfA(_size != 4, E_UNEXPECTED);
+    Chk(Reserve(sizeof(transid.id)));
+
+    _transactionid = transid;
+    WriteBytes(transid.id, sizeof(transid.id));
+    UpdateLengthField();
+
+Cleanup:
+    return hr;
+}
+
+HRESULT CStunMessageWriter::AddAttribute(uint16_t attribType, const void* data, uint16_t size)
+{
+    size_t padding = 0;
+    HRESULT hr = S_OK;
+    uint16_t sizeheader = size;
+
+    if (data == NULL)
+    {
+        size = 0;
+    }
+
+    padding = (size % 4) ? (4 - (size % 4)) : 0;
+
+    if (_fLegacyMode)
+    {
+        // RFC 3489 - the padding counts in the attribute's length
+        sizeheader += padding;
+    }
+
+    Chk(Reserve(4 + size + padding));
+
+    WriteAttributeHeader(attribType, sizeheader);
+    if (size > 0)
+    {
+        WriteBytes(data, size);
+    }
+    WriteZeros(padding);
+    UpdateLengthField();
+
+Cleanup:
+    return hr;
+}
+
+HRESULT CStunMessageWriter::AddEncodedAttribute(const void* pAttribute, size_t size)
+{
+    HRESULT hr = S_OK;
+
+    ChkIfA(pAttribute == NULL, E_INVALIDARG);
+    ChkIfA((size < 4) || (size % 4), E_INVALIDARG);
+    ChkIfA(_size < STUN_HEADER_SIZE, E_UNEXPECTED);
+    Chk(Reserve(size));
+
+    WriteBytes(pAttribute, size);
+    UpdateLengthField();
+
+Cleanup:
+    return hr;
+}
+
+HRESULT CStunMessageWriter::AddStringAttribute(uint16_t attribType, const char* pstr)
+{
+    HRESULT hr = S_OK;
+    size_t length = 0;
+
+    ChkIfA(StringHelper::IsNullOrEmpty(pstr), E_INVALIDARG);
+
+    length = strlen(pstr);
+    ChkIf(length > 0xffff, E_INVALIDARG);
+
+    hr = AddAttribute(attribType, pstr, (uint16_t)length);
+
+Cleanup:
+    return hr;
+}
+
+HRESULT CStunMessageWriter::AddMappedAddressImpl(uint16_t attribute, const CSocketAddress& addr)
+{
+    HRESULT hr = S_OK;
+    uint8_t ip[STUN_IPV6_LENGTH];
+    uint16_t port = addr.GetPort_NBO();
+    size_t length = addr.GetIP_NBO(ip, sizeof(ip));
+    uint8_t family = (addr.GetFamily()==AF_INET) ? STUN_ATTRIBUTE_FIELD_IPV4 :STUN_ATTRIBUTE_FIELD_IPV6;
+    size_t attributeSize = (family == STUN_ATTRIBUTE_FIELD_IPV4) ? STUN_ATTRIBUTE_MAPPEDADDRESS_SIZE_IPV4 : STUN_ATTRIBUTE_MAPPEDADDRESS_SIZE_IPV6;
+
+    ASSERT((length == STUN_IPV4_LENGTH) || (length == STUN_IPV6_LENGTH));
+    ChkIfA(attributeSize != (length + 4), E_UNEXPECTED);
+
+    Chk(Reserve(4 + attributeSize));
+
+    WriteAttributeHeader(attribute, (uint16_t)attributeSize);
+    _pData[_size++] = 0;
+    _pData[_size++] = family;
+    WriteUint16(port);
+    WriteBytes(ip, length);
+    UpdateLengthField();
+
+Cleanup:
+    return hr;
+}
+
+HRESULT CStunMessageWriter::AddXorMappedAddress(const CSocketAddress& addr)
+{
+    CSocketAddress addrxor(addr);
+    uint16_t attributeID = _fLegacyMode ? STUN_ATTRIBUTE_XORMAPPEDADDRESS_OPTIONAL : STUN_ATTRIBUTE_XORMAPPEDADDRESS;
+
+    addrxor.ApplyStunXorMap(_transactionid);
+
+    return AddMappedAddressImpl(attributeID, addrxor);
+}
+
+HRESULT CStunMessageWriter::AddMappedAddress(const CSocketAddress& addr)
+{
+    return AddMappedAddressImpl(STUN_ATTRIBUTE_MAPPEDADDRESS, addr);
+}
+
+HRESULT CStunMessageWriter::AddResponseOriginAddress(const CSocketAddress& addr)
+{
+    return AddMappedAddressImpl(_fLegacyMode ? STUN_ATTRIBUTE_SOURCEADDRESS : STUN_ATTRIBUTE_RESPONSE_ORIGIN, addr);
+}
+
+HRESULT CStunMessageWriter::AddOtherAddress(const CSocketAddress& addr)
+{
+    return AddMappedAddressImpl(_fLegacyMode ? STUN_ATTRIBUTE_CHANGEDADDRESS : STUN_ATTRIBUTE_OTHER_ADDRESS, addr);
+}
+
+HRESULT CStunMessageWriter::AddErrorCode(uint16_t errorNumber, const char* pszReason)
+{
+    HRESULT hr = S_OK;
+    size_t strsize = (pszReason==NULL) ? 0 : strlen(pszReason);
+    size_t size = strsize + 4;
+    size_t padding = (size%4) ? (4-size%4) : 0;
+    size_t sizeheader = _fLegacyMode ? (size + padding) : size;
+
+    ChkIf(strsize >= 128, E_INVALIDARG);
+    ChkIf(errorNumber < 300, E_INVALIDARG);
+    ChkIf(errorNumber > 600, E_INVALIDARG);
+
+    Chk(Reserve(4 + size + padding));
+
+    WriteAttributeHeader(STUN_ATTRIBUTE_ERRORCODE, (uint16_t)sizeheader);
+    WriteUint16(0);
+    _pData[_size++] = (uint8_t)(errorNumber / 100);
+    _pData[_size++] = (uint8_t)(errorNumber % 100);
+    if (strsize > 0)
+    {
+        WriteBytes(pszReason, strsize);
+    }
+    WriteZeros(padding);
+    UpdateLengthField();
+
+Cleanup:
+    return hr;
+}
+
+HRESULT CStunMessageWriter::AddUnknownAttributes(const uint16_t* arr, size_t count)
+{
+    HRESULT hr = S_OK;
+    size_t size = count * sizeof(uint16_t);
+    bool fPad = false;
+
+    ChkIfA(arr == NULL, E_INVALIDARG);
+    ChkIfA(count <= 0, E_INVALIDARG);
+
+    // same as CStunMessageBuilder - legacy clients get the last attribute repeated instead of implicit padding
+    fPad = !!(count % 2);
+
+    Chk(Reserve(4 + size + (fPad ? sizeof(uint16_t) : 0)));
+
+    WriteAttributeHeader(STUN_ATTRIBUTE_UNKNOWNATTRIBUTES, (uint16_t)((fPad && _fLegacyMode) ? (size + sizeof(uint16_t)) : size));
+    WriteBytes(arr, size);
+    if (fPad && _fLegacyMode)
+    {
+        WriteBytes(&arr[count-1], sizeof(arr[0]));
+    }
+    else if (fPad)
+    {
+        WriteZeros(sizeof(uint16_t));
+    }
+    UpdateLengthField();
+
+Cleanup:
+    return hr;
+}
+
+HRESULT CStunMessageWriter::AddMessageIntegrity(const CStunIntegrityKey& key)
+{
+    HRESULT hr = S_OK;
+
+    ChkIfA(key.IsValid() == false, E_INVALIDARG);
+    Chk(Reserve(4 + CStunIntegrityKey::c_hmacsize));
+
+    // the length field counts the integrity attribute before it gets hashed
+    WriteAttributeHeader(STUN_ATTRIBUTE_MESSAGEINTEGRITY, CStunIntegrityKey::c_hmacsize);
+    _size += CStunIntegrityKey::c_hmacsize;
+    UpdateLengthField();
+
+    key.Compute(_pData, _size - CStunIntegrityKey::c_hmacsize - 4, _pData + _size - CStunIntegrityKey::c_hmacsize);
+
+Cleanup:
+    return hr;
+}
+
+HRESULT CStunMessageWriter::AddMessageIntegritySha256(const CStunIntegrityKeySha256& key)
+{
+    HRESULT hr = S_OK;
+
+    ChkIfA(key.IsValid() == false, E_INVALIDARG);
+    Chk(Reserve(4 + CStunIntegrityKeySha256::c_hmacsize));
+
+    WriteAttributeHeader(STUN_ATTRIBUTE_MESSAGEINTEGRITY_SHA256, CStunIntegrityKeySha256::c_hmacsize);
+    _size += CStunIntegrityKeySha256::c_hmacsize;
+    UpdateLengthField();
+
+    key.Compute(_pData, _size - CStunIntegrityKeySha256::c_hmacsize - 4, _pData + _size - CStunIntegrityKeySha256::c_hmacsize);
+
+Cleanup:
+    return hr;
+}
+
+HRESULT CStunMessageWriter::AddFingerprintAttribute()
+{
+    HRESULT hr = S_OK;
+    uint32_t value = 0;
+
+    Chk(Reserve(8));
+
+    WriteAttributeHeader(STUN_ATTRIBUTE_FINGERPRINT, sizeof(value));
+    _size += sizeof(value);
+    UpdateLengthField();
+
+    // the CRC covers everything but the 8 bytes of the fingerprint attribute
+    value = htonl(Crc32(_pData, _size - 8) ^ STUN_FINGERPRINT_XOR);
+    memcpy(_pData + _size - sizeof(value), &value, sizeof(value));
+
+Cleanup:
+    return hr;
+}
+
+HRESULT CStunMessageWriter::AddMessageIntegrityAndFingerprint(const CStunIntegrityKey& key)
+{
+    HRESULT hr = S_OK;
+    size_t sizeHashed = 0;
+    uint16_t lengthIntegrity = 0;
+    uint32_t crc = 0;
+    uint32_t value = 0;
+
+    ChkIfA(key.IsValid() == false, E_INVALIDARG);
+    Chk(Reserve(4 + CStunIntegrityKey::c_hmacsize + 8));
+
+    // both attribute headers go in first, so the length field is final before anything is hashed.
+    // The HMAC is computed as if the length stopped after MESSAGE-INTEGRITY
+    sizeHashed = _size;
+    WriteAttributeHeader(STUN_ATTRIBUTE_MESSAGEINTEGRITY, CStunIntegrityKey::c_hmacsize);
+    _size += CStunIntegrityKey::c_hmacsize;
+    lengthIntegrity = htons((uint16_t)(_size - STUN_HEADER_SIZE));
+
+    WriteAttributeHeader(STUN_ATTRIBUTE_FINGERPRINT, sizeof(value));
+    _size += sizeof(value);
+    UpdateLengthField();
+
+    key.ComputeWithCrc32(_pData, sizeHashed, lengthIntegrity, _pData + sizeHashed + 4, &crc);
+
+    // the CRC still has the MESSAGE-INTEGRITY attribute to cover
+    crc = Crc32Update(crc, _pData + sizeHashed, 4 + CStunIntegrityKey::c_hmacsize);
+    value = htonl(crc ^ STUN_FINGERPRINT_XOR);
+    memcpy(_pData + _size - sizeof(value), &value, sizeof(value));
+
+Cleanup:
+    return hr;
+}
+
+uint8_t* CStunMessageWriter::GetData()
+{
+    return _pData;
+}
+
+size_t CStunMessageWriter::GetSize()
+{
+    return _size;
+}
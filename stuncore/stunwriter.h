@@ -0,0 +1,105 @@
+/*
+   Copyright 2011 John Selbie
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef STUN_MESSAGE_WRITER_H
+#define STUN_MESSAGE_WRITER_H
+
+#include "socketaddress.h"
+#include "stuntypes.h"
+#include "stunintegrity.h"
+
+
+// CStunMessageWriter builds a STUN message straight into memory the caller owns (a send buffer, a slot
+// in a sendmmsg array, a stack array) instead of a CDataStream over a CRefCountedBuffer.
+//    Each Add method works out the exact number of bytes it will write and checks that against the
+//    capacity once - the individual field writes after that are unchecked.  Nothing ever grows.
+//    No message is bigger than c_maxsize, so a buffer of at least that many bytes never fills up.
+//    The length field in the header is kept current as attributes are added - there's no FixLengthField step.
+//    The bytes written are the same as CStunMessageBuilder's for the same calls (legacy mode included).
+
+class CStunMessageWriter
+{
+public:
+    static const size_t c_maxsize = MAX_STUN_MESSAGE_SIZE;
+
+private:
+    uint8_t* _pData;
+    size_t _capacity;
+    size_t _size;
+    StunTransactionId _transactionid;
+    bool _fLegacyMode;
+
+    // the unchecked writes - the caller has already called Reserve
+    inline void WriteBytes(const void* pData, size_t size)
+    {
+        memcpy(_pData + _size, pData, size);
+        _size += size;
+    }
+
+    inline void WriteUint16(uint16_t valueNBO)
+    {
+        WriteBytes(&valueNBO, sizeof(valueNBO));
+    }
+
+    inline void WriteZeros(size_t size)
+    {
+        memset(_pData + _size, '\0', size);
+        _size += size;
+    }
+
+    HRESULT Reserve(size_t size);
+    void WriteAttributeHeader(uint16_t attribType, uint16_t size);
+    void UpdateLengthField();
+
+    HRESULT AddMappedAddressImpl(uint16_t attribute, const CSocketAddress& addr);
+
+public:
+    CStunMessageWriter();
+    CStunMessageWriter(uint8_t* pData, size_t capacity);
+
+    // starts a new message at pData.  Capacities beyond c_maxsize are never used
+    void Attach(uint8_t* pData, size_t capacity);
+    void SetLegacyMode(bool fLegacyMode);
+
+    HRESULT AddHeader(StunMessageType msgType, StunMessageClass msgClass);
+    HRESULT AddTransactionId(const StunTransactionId& transid);
+
+    HRESULT AddAttribute(uint16_t attribType, const void* data, uint16_t size);
+
+    // copies an attribute that is already encoded (header, value and padding) - e.g. one built ahead of time by another writer
+    HRESULT AddEncodedAttribute(const void* pAttribute, size_t size);
+    HRESULT AddStringAttribute(uint16_t attribType, const char* pstr);
+
+    HRESULT AddXorMappedAddress(const CSocketAddress& addr);
+    HRESULT AddMappedAddress(const CSocketAddress& addr);
+    HRESULT AddResponseOriginAddress(const CSocketAddress& addr);
+    HRESULT AddOtherAddress(const CSocketAddress& addr);
+
+    HRESULT AddErrorCode(uint16_t errorNumber, const char* pszReason);
+    HRESULT AddUnknownAttributes(const uint16_t* arrAttributeIds, size_t count);
+
+    HRESULT AddMessageIntegrity(const CStunIntegrityKey& key);
+    HRESULT AddMessageIntegritySha256(const CStunIntegrityKeySha256& key);
+    HRESULT AddFingerprintAttribute();
+
+    // AddMessageIntegrity then AddFingerprintAttribute, with the HMAC and the CRC computed in one walk over the message
+    HRESULT AddMessageIntegrityAndFingerprint(const CStunIntegrityKey& key);
+
+    uint8_t* GetData();
+    size_t GetSize();
+};
+
+#endif
@@ -0,0 +1,109 @@
+/*
+   Copyright 2011 John Selbie
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+
+#include "commonincludes.hpp"
+#include "crc32.h"
+#include "benchcrc32.h"
+#include <boost/crc.hpp>
+
+
+static uint32_t BenchBoost(const uint8_t* pData, size_t length)
+{
+    boost::crc_32_type crc;
+    crc.process_bytes(pData, length);
+    return crc.checksum();
+}
+
+static uint32_t BenchSlice8(const uint8_t* pData, size_t length)
+{
+    return Crc32Slice8(0, pData, length);
+}
+
+static uint32_t BenchClmul(const uint8_t* pData, size_t length)
+{
+    return Crc32Clmul(0, pData, length);
+}
+
+static uint32_t BenchDefault(const uint8_t* pData, size_t length)
+{
+    return Crc32(pData, length);
+}
+
+HRESULT CBenchCrc32::Run()
+{
+    HRESULT hr = S_OK;
+    // 100 bytes is about the size of an ICE connectivity check (USERNAME, PRIORITY, MESSAGE-INTEGRITY, FINGERPRINT)
+    const size_t c_lengths[] = {100, 548, 1500, 65536};
+    
+    PrintBenchmarkResult(GetName(), "PCLMULQDQ available (1=yes)", Crc32HasClmul() ? 1 : 0, "");
+    
+    for (size_t index = 0; index < ARRAYSIZE(c_lengths); index++)
+    {
+        ChkA(BenchFunction(BenchBoost, "boost", c_lengths[index]));
+        ChkA(BenchFunction(BenchSlice8, "slice8", c_lengths[index]));
+        if (Crc32HasClmul())
+        {
+            ChkA(BenchFunction(BenchClmul, "clmul", c_lengths[index]));
+        }
+        ChkA(BenchFunction(BenchDefault, "Crc32", c_lengths[index]));
+    }
+    
+Cleanup:
+    return hr;
+}
+
+HRESULT CBenchCrc32::BenchFunction(Crc32Function pfn, const char* pszName, size_t length)
+{
+    HRESULT hr = S_OK;
+    const double c_duration = 0.5;
+    std::vector<uint8_t> data(length);
+    CBenchmarkTimer timer;
+    double seconds = 0;
+    uint64_t count = 0;
+    uint32_t result = 0;
+    uint32_t expected;
+    char szMetric[100];
+    
+    for (size_t index = 0; index < length; index++)
+    {
+        data[index] = (uint8_t)index;
+    }
+    
+    expected = BenchBoost(&data[0], length);
+    
+    timer.Start();
+    while ((seconds = timer.GetElapsedSeconds()) < c_duration)
+    {
+        for (int loop = 0; loop < 1000; loop++)
+        {
+            // feeding the result back in keeps the calls from being optimized away
+            data[0] = (uint8_t)result;
+            result = pfn(&data[0], length);
+            count++;
+        }
+    }
+    
+    data[0] = 0;
+    ChkIfA(pfn(&data[0], length) != expected, E_FAIL);
+    
+    sprintf(szMetric, "%s, %d bytes", pszName, (int)length);
+    PrintBenchmarkResult(GetName(), szMetric, count / seconds, "per second");
+    PrintBenchmarkResult(GetName(), szMetric, ((count * length) / seconds) / (1024*1024), "MB/sec");
+    
+Cleanup:
+    return hr;
+}
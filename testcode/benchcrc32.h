@@ -0,0 +1,36 @@
+/*
+   Copyright 2011 John Selbie
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef BENCH_CRC32_H
+#define BENCH_CRC32_H
+
+#include "benchmark.h"
+
+
+// CRC-32 throughput for each implementation (and boost::crc_32_type for reference),
+// at the size of a typical FINGERPRINT-protected STUN message and at larger sizes
+class CBenchCrc32 : public IBenchmark
+{
+private:
+    typedef uint32_t (*Crc32Function)(const uint8_t* pData, size_t length);
+    HRESULT BenchFunction(Crc32Function pfn, const char* pszName, size_t length);
+
+public:
+    virtual HRESULT Run();
+    BENCH_DECLARE_NAME("CBenchCrc32");
+};
+
+#endif
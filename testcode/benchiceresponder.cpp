@@ -0,0 +1,257 @@
+/*
+   Copyright 2011 John Selbie
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "commonincludes.hpp"
+#include "stuncore.h"
+#include "oshelper.h"
+#include "benchiceresponder.h"
+
+
+static const double c_duration = 0.5;
+
+
+// the cheapest short term auth provider there is - every user has the same password
+class CBenchAuthIce :
+    public CBasicRefCount,
+    public CObjectFactory<CBenchAuthIce>,
+    public IStunAuth
+{
+public:
+    virtual HRESULT DoAuthCheck(AuthAttributes* pAuthAttributes, AuthResponse* pResponse)
+    {
+        UNREFERENCED_VARIABLE(pAuthAttributes);
+        
+        pResponse->authCredMech = AuthCredShortTerm;
+        pResponse->responseType = AllowConditional;
+        strcpy(pResponse->szPassword, "passwordpasswordpassword");
+        return S_OK;
+    }
+    ADDREF_AND_RELEASE_IMPL();
+};
+
+
+HRESULT CBenchIceResponder::Run()
+{
+    HRESULT hr = S_OK;
+    
+    ChkA(CBenchAuthIce::CreateInstanceNoInit(_spAuth.GetPointerPointer()));
+    ChkA(InitRequests());
+    
+    ChkA(BenchRequestHandler());
+    ChkA(BenchResponder(1, "checks, CStunIceResponder (every lookup a miss)"));
+    ChkA(BenchResponder(CStunIceResponder::c_defaultSize, "checks, CStunIceResponder"));
+    ChkA(BenchValidate(false));
+    ChkA(BenchValidate(true));
+    ChkA(BenchSign(false));
+    ChkA(BenchSign(true));
+    
+Cleanup:
+    return hr;
+}
+
+// c_requestCount checks with the attributes a browser sends, from as many ufrags (with one cache slot, consecutive ones collide)
+HRESULT CBenchIceResponder::InitRequests()
+{
+    HRESULT hr = S_OK;
+    uint32_t priority = htonl(0x6e0001ff);
+    uint8_t tiebreaker[8] = {1, 2, 3, 4, 5, 6, 7, 8};
+    uint32_t networkcost = htonl(0x00010000);
+    char szUser[MAX_STUN_AUTH_STRING_SIZE+1];
+    
+    for (size_t index = 0; index < c_requestCount; index++)
+    {
+        CStunMessageBuilder builder;
+        CRefCountedBuffer spRequest;
+        
+        sprintf(szUser, "uf%02d:Xq3b", (int)index);
+        
+        ChkA(builder.AddBindingRequestHeader());
+        ChkA(builder.AddRandomTransactionId(NULL));
+        ChkA(builder.AddUserName(szUser));
+        ChkA(builder.AddAttribute(0xC057, &networkcost, sizeof(networkcost))); // GOOG-NETWORK-INFO
+        ChkA(builder.AddAttribute(0x802A, tiebreaker, sizeof(tiebreaker)));   // ICE-CONTROLLING
+        ChkA(builder.AddAttribute(0x0024, &priority, sizeof(priority)));      // PRIORITY
+        ChkA(builder.AddMessageIntegrityShortTerm("passwordpasswordpassword"));
+        ChkA(builder.AddFingerprintAttribute());
+        ChkA(builder.GetResult(&spRequest));
+        
+        _readers[index].Reset();
+        ChkIfA(CStunMessageReader::BodyValidated != _readers[index].AddBytes(spRequest->GetData(), spRequest->GetSize()), E_FAIL);
+        
+        _msgIn[index].socketrole = RolePP;
+        _msgIn[index].addrRemote = CSocketAddress(0x0a000001 + (uint32_t)index, 50000);
+        _msgIn[index].addrLocal = CSocketAddress(0x0a100001, 3478);
+        _msgIn[index].pReader = &_readers[index];
+        _msgIn[index].fConnectionOriented = false;
+    }
+    
+    _msgOut.spBufferOut = CRefCountedBuffer(new CBuffer(MAX_STUN_MESSAGE_SIZE));
+    
+Cleanup:
+    return hr;
+}
+
+HRESULT CBenchIceResponder::BenchRequestHandler()
+{
+    HRESULT hr = S_OK;
+    CStunRequestContext context;
+    TransportAddressSet tsa = {};
+    CStunKeyCache keycache;
+    CBenchmarkTimer timer;
+    double seconds = 0;
+    uint64_t count = 0;
+    
+    tsa.set[RolePP].fValid = true;
+    tsa.set[RolePP].addr = CSocketAddress(0x0a100001, 3478);
+    ChkA(CStunRequestHandler::PrecomputeAttributes(&tsa));
+    ChkA(keycache.Init(CStunKeyCache::c_defaultSize));
+    
+    timer.Start();
+    while ((seconds = timer.GetElapsedSeconds()) < c_duration)
+    {
+        for (size_t index = 0; index < c_requestCount; index++)
+        {
+            hr = context.ProcessRequest(_msgIn[index], _msgOut, &tsa, _spAuth, &keycache);
+            count++;
+        }
+    }
+    
+    ChkA(hr);
+    ChkIfA(_msgOut.spBufferOut->GetSize() == 0, E_FAIL);
+    
+    PrintBenchmarkResult(GetName(), "checks, CStunRequestHandler", count / seconds, "per second per core");
+    
+Cleanup:
+    return hr;
+}
+
+HRESULT CBenchIceResponder::BenchResponder(size_t cacheSize, const char* pszMetric)
+{
+    HRESULT hr = S_OK;
+    CStunIceResponder responder;
+    CBenchmarkTimer timer;
+    double seconds = 0;
+    uint64_t count = 0;
+    uint32_t now = GetMillisecondCounter();
+    
+    ChkA(responder.Init(cacheSize, CStunIceResponder::c_defaultTTL));
+    
+    timer.Start();
+    while ((seconds = timer.GetElapsedSeconds()) < c_duration)
+    {
+        for (size_t index = 0; index < c_requestCount; index++)
+        {
+            hr = responder.ProcessRequest(_msgIn[index], _msgOut, _spAuth, now);
+            count++;
+        }
+    }
+    
+    ChkIfA(hr != S_OK, E_FAIL);
+    
+    PrintBenchmarkResult(GetName(), pszMetric, count / seconds, "per second per core");
+    
+Cleanup:
+    return hr;
+}
+
+HRESULT CBenchIceResponder::BenchValidate(bool fOnePass)
+{
+    HRESULT hr = S_OK;
+    CStunIntegrityKey key;
+    CBenchmarkTimer timer;
+    double seconds = 0;
+    uint64_t count = 0;
+    bool fIntegrityValid = false;
+    bool fFingerprintValid = false;
+    
+    ChkA(key.InitShortTerm("passwordpasswordpassword"));
+    
+    timer.Start();
+    while ((seconds = timer.GetElapsedSeconds()) < c_duration)
+    {
+        for (size_t index = 0; index < c_requestCount; index++)
+        {
+            if (fOnePass)
+            {
+                hr = _readers[index].ValidateMessageIntegrityAndFingerprint(key, &fIntegrityValid, &fFingerprintValid);
+            }
+            else
+            {
+                fFingerprintValid = _readers[index].IsFingerprintAttributeValid();
+                hr = _readers[index].ValidateMessageIntegrity(key);
+                fIntegrityValid = SUCCEEDED(hr);
+            }
+            count++;
+        }
+    }
+    
+    ChkA(hr);
+    ChkIfA((fIntegrityValid == false) || (fFingerprintValid == false), E_FAIL);
+    
+    PrintBenchmarkResult(GetName(), fOnePass ? "validations, ValidateMessageIntegrityAndFingerprint" : "validations, ValidateMessageIntegrity + IsFingerprintAttributeValid", count / seconds, "per second per core");
+    
+Cleanup:
+    return hr;
+}
+
+HRESULT CBenchIceResponder::BenchSign(bool fOnePass)
+{
+    HRESULT hr = S_OK;
+    CStunIntegrityKey key;
+    CBenchmarkTimer timer;
+    double seconds = 0;
+    uint64_t count = 0;
+    StunTransactionId transid = {};
+    CSocketAddress addr(0x0a000001, 50000);
+    uint8_t buffer[MAX_STUN_MESSAGE_SIZE];
+    
+    ChkA(key.InitShortTerm("passwordpasswordpassword"));
+    
+    timer.Start();
+    while ((seconds = timer.GetElapsedSeconds()) < c_duration)
+    {
+        for (int loop = 0; loop < 1000; loop++)
+        {
+            CStunMessageWriter writer(buffer, sizeof(buffer));
+            
+            transid.id[0] = (uint8_t)loop;
+            writer.AddHeader(StunMsgTypeBinding, StunMsgClassSuccessResponse);
+            writer.AddTransactionId(transid);
+            writer.AddXorMappedAddress(addr);
+            
+            if (fOnePass)
+            {
+                hr = writer.AddMessageIntegrityAndFingerprint(key);
+            }
+            else
+            {
+                hr = writer.AddMessageIntegrity(key);
+                if (SUCCEEDED(hr))
+                {
+                    hr = writer.AddFingerprintAttribute();
+                }
+            }
+            count++;
+        }
+    }
+    
+    ChkA(hr);
+    
+    PrintBenchmarkResult(GetName(), fOnePass ? "responses, AddMessageIntegrityAndFingerprint" : "responses, AddMessageIntegrity + AddFingerprintAttribute", count / seconds, "per second per core");
+    
+Cleanup:
+    return hr;
+}
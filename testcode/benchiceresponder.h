@@ -0,0 +1,48 @@
+/*
+   Copyright 2011 John Selbie
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef BENCH_ICE_RESPONDER_H
+#define BENCH_ICE_RESPONDER_H
+
+#include "benchmark.h"
+
+
+// ICE connectivity checks answered per second on one core: through CStunRequestHandler, and through
+// CStunIceResponder with its ufrag cache missing every time and hitting.  Then the two halves on their own -
+// checking MESSAGE-INTEGRITY and FINGERPRINT, and signing a response with both - one attribute at a time and in one pass
+class CBenchIceResponder : public IBenchmark
+{
+private:
+    static const size_t c_requestCount = 64;
+    
+    CStunMessageReader _readers[c_requestCount];
+    StunMessageIn _msgIn[c_requestCount];
+    StunMessageOut _msgOut;
+    CRefCountedPtr<IStunAuth> _spAuth;
+    
+    HRESULT InitRequests();
+    
+    HRESULT BenchRequestHandler();
+    HRESULT BenchResponder(size_t cacheSize, const char* pszMetric);
+    HRESULT BenchValidate(bool fOnePass);
+    HRESULT BenchSign(bool fOnePass);
+    
+public:
+    virtual HRESULT Run();
+    BENCH_DECLARE_NAME("CBenchIceResponder");
+};
+
+#endif
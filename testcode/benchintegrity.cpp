@@ -0,0 +1,282 @@
+/*
+   Copyright 2011 John Selbie
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+
+#include "commonincludes.hpp"
+#include "stuncore.h"
+#include "benchintegrity.h"
+
+
+static const char* c_pszUser = "remoteufrag:localufrag";
+static const char* c_pszRealm = "stunrealm";
+static const char* c_pszPassword = "0123456789abcdefghijkl";
+
+
+static HRESULT ValidateShortTerm(CStunMessageReader& reader, const CBenchIntegrity::Keys& keys, CStunKeyCache& cache)
+{
+    UNREFERENCED_VARIABLE(keys);
+    UNREFERENCED_VARIABLE(cache);
+    return reader.ValidateMessageIntegrityShort(c_pszPassword);
+}
+
+static HRESULT ValidateLongTerm(CStunMessageReader& reader, const CBenchIntegrity::Keys& keys, CStunKeyCache& cache)
+{
+    UNREFERENCED_VARIABLE(keys);
+    UNREFERENCED_VARIABLE(cache);
+    return reader.ValidateMessageIntegrityLong(c_pszUser, c_pszRealm, c_pszPassword);
+}
+
+static HRESULT ValidateCached(CStunMessageReader& reader, const CBenchIntegrity::Keys& keys, CStunKeyCache& cache)
+{
+    HRESULT hr = S_OK;
+    CStunIntegrityKey keyCached;
+    
+    UNREFERENCED_VARIABLE(keys);
+    
+    Chk(cache.GetLongTermKey(c_pszUser, c_pszRealm, c_pszPassword, &keyCached));
+    Chk(reader.ValidateMessageIntegrity(keyCached));
+    
+Cleanup:
+    return hr;
+}
+
+static HRESULT ValidatePrecomputed(CStunMessageReader& reader, const CBenchIntegrity::Keys& keys, CStunKeyCache& cache)
+{
+    UNREFERENCED_VARIABLE(cache);
+    return reader.ValidateMessageIntegrity(keys.key);
+}
+
+static HRESULT ValidateShortTermSha256(CStunMessageReader& reader, const CBenchIntegrity::Keys& keys, CStunKeyCache& cache)
+{
+    HRESULT hr = S_OK;
+    CStunIntegrityKeySha256 key;
+    
+    UNREFERENCED_VARIABLE(keys);
+    UNREFERENCED_VARIABLE(cache);
+    
+    Chk(key.InitShortTerm(c_pszPassword));
+    Chk(reader.ValidateMessageIntegritySha256(key));
+    
+Cleanup:
+    return hr;
+}
+
+static HRESULT ValidateLongTermSha256(CStunMessageReader& reader, const CBenchIntegrity::Keys& keys, CStunKeyCache& cache)
+{
+    HRESULT hr = S_OK;
+    CStunIntegrityKeySha256 key;
+    
+    UNREFERENCED_VARIABLE(keys);
+    UNREFERENCED_VARIABLE(cache);
+    
+    Chk(key.InitLongTerm(c_pszUser, c_pszRealm, c_pszPassword, STUN_PASSWORD_ALGORITHM_SHA256));
+    Chk(reader.ValidateMessageIntegritySha256(key));
+    
+Cleanup:
+    return hr;
+}
+
+static HRESULT ValidateCachedSha256(CStunMessageReader& reader, const CBenchIntegrity::Keys& keys, CStunKeyCache& cache)
+{
+    HRESULT hr = S_OK;
+    CStunIntegrityKeySha256 keyCached;
+    
+    UNREFERENCED_VARIABLE(keys);
+    
+    Chk(cache.GetLongTermKeySha256(c_pszUser, c_pszRealm, c_pszPassword, &keyCached, STUN_PASSWORD_ALGORITHM_SHA256));
+    Chk(reader.ValidateMessageIntegritySha256(keyCached));
+    
+Cleanup:
+    return hr;
+}
+
+static HRESULT ValidatePrecomputedSha256(CStunMessageReader& reader, const CBenchIntegrity::Keys& keys, CStunKeyCache& cache)
+{
+    UNREFERENCED_VARIABLE(cache);
+    return reader.ValidateMessageIntegritySha256(keys.keySha256);
+}
+
+
+// the long term SHA-256 message uses SHA-256 for the password algorithm too
+HRESULT CBenchIntegrity::CreateMessage(bool fLongTerm, bool fSha256)
+{
+    HRESULT hr = S_OK;
+    CStunMessageBuilder builder;
+    CStunIntegrityKeySha256 keySha256;
+    uint32_t priority = htonl(0x6e7f00ff);
+    uint64_t tiebreaker = 0x1122334455667788ULL;
+    
+    ChkA(builder.AddBindingRequestHeader());
+    ChkA(builder.AddRandomTransactionId(NULL));
+    ChkA(builder.AddUserName(c_pszUser));
+    if (fLongTerm)
+    {
+        ChkA(builder.AddRealm(c_pszRealm));
+    }
+    ChkA(builder.AddAttribute(0x0024, &priority, sizeof(priority)));       // PRIORITY
+    ChkA(builder.AddAttribute(0x802A, &tiebreaker, sizeof(tiebreaker)));   // ICE-CONTROLLING
+    if (fSha256)
+    {
+        if (fLongTerm)
+        {
+            ChkA(builder.AddPasswordAlgorithm(STUN_PASSWORD_ALGORITHM_SHA256));
+            ChkA(keySha256.InitLongTerm(c_pszUser, c_pszRealm, c_pszPassword, STUN_PASSWORD_ALGORITHM_SHA256));
+        }
+        else
+        {
+            ChkA(keySha256.InitShortTerm(c_pszPassword));
+        }
+        ChkA(builder.AddMessageIntegritySha256(keySha256));
+    }
+    else if (fLongTerm)
+    {
+        ChkA(builder.AddMessageIntegrityLongTerm(c_pszUser, c_pszRealm, c_pszPassword));
+    }
+    else
+    {
+        ChkA(builder.AddMessageIntegrityShortTerm(c_pszPassword));
+    }
+    ChkA(builder.AddFingerprintAttribute());
+    ChkA(builder.GetResult(&_spMessage));
+    
+    _reader.Reset();
+    ChkIfA(_reader.AddBytes(_spMessage->GetData(), _spMessage->GetSize()) != CStunMessageReader::BodyValidated, E_FAIL);
+    
+Cleanup:
+    return hr;
+}
+
+HRESULT CBenchIntegrity::Run()
+{
+    HRESULT hr = S_OK;
+    Keys keys;
+    
+    ChkA(_keycache.Init(CStunKeyCache::c_defaultSize));
+    
+    ChkA(CreateMessage(false, false));
+    ChkA(keys.key.InitShortTerm(c_pszPassword));
+    ChkA(BenchValidate(ValidateShortTerm, keys, "short term, key per message"));
+    ChkA(BenchValidate(ValidatePrecomputed, keys, "short term, precomputed key"));
+    
+    ChkA(BenchBatch(keys.key, false, false, "short term, one at a time"));
+    ChkA(BenchBatch(keys.key, true, false, "short term, batch without SIMD"));
+    if (CStunIntegrityBatch::HasSimd())
+    {
+        ChkA(BenchBatch(keys.key, true, true, "short term, batch with AVX2"));
+    }
+    
+    ChkA(CreateMessage(true, false));
+    ChkA(keys.key.InitLongTerm(c_pszUser, c_pszRealm, c_pszPassword));
+    ChkA(BenchValidate(ValidateLongTerm, keys, "long term, key per message"));
+    ChkA(BenchValidate(ValidateCached, keys, "long term, key cache"));
+    ChkA(BenchValidate(ValidatePrecomputed, keys, "long term, precomputed key"));
+    
+    ChkA(CreateMessage(false, true));
+    ChkA(keys.keySha256.InitShortTerm(c_pszPassword));
+    ChkA(BenchValidate(ValidateShortTermSha256, keys, "SHA-256 short term, key per message"));
+    ChkA(BenchValidate(ValidatePrecomputedSha256, keys, "SHA-256 short term, precomputed key"));
+    
+    ChkA(CreateMessage(true, true));
+    ChkA(keys.keySha256.InitLongTerm(c_pszUser, c_pszRealm, c_pszPassword, STUN_PASSWORD_ALGORITHM_SHA256));
+    ChkA(BenchValidate(ValidateLongTermSha256, keys, "SHA-256 long term, key per message"));
+    ChkA(BenchValidate(ValidateCachedSha256, keys, "SHA-256 long term, key cache"));
+    ChkA(BenchValidate(ValidatePrecomputedSha256, keys, "SHA-256 long term, precomputed key"));
+    
+Cleanup:
+    return hr;
+}
+
+HRESULT CBenchIntegrity::BenchValidate(ValidateFunction pfn, const Keys& keys, const char* pszMetric)
+{
+    HRESULT hr = S_OK;
+    const double c_duration = 0.5;
+    CBenchmarkTimer timer;
+    double seconds = 0;
+    uint64_t count = 0;
+    
+    timer.Start();
+    while ((seconds = timer.GetElapsedSeconds()) < c_duration)
+    {
+        for (int loop = 0; loop < 1000; loop++)
+        {
+            ChkA(pfn(_reader, keys, _keycache));
+            count++;
+        }
+    }
+    
+    PrintBenchmarkResult(GetName(), pszMetric, count / seconds, "per second");
+    
+Cleanup:
+    return hr;
+}
+
+HRESULT CBenchIntegrity::BenchBatch(const CStunIntegrityKey& key, bool fBatch, bool fUseSimd, const char* pszMetric)
+{
+    HRESULT hr = S_OK;
+    const size_t c_size = CStunIntegrityBatch::c_maxsize;
+    const double c_duration = 0.5;
+    CBenchmarkTimer timer;
+    double seconds = 0;
+    uint64_t count = 0;
+    
+    for (size_t index = 0; index < c_size; index++)
+    {
+        _batchReaders[index].Reset();
+        ChkIfA(_batchReaders[index].AddBytes(_spMessage->GetData(), _spMessage->GetSize()) != CStunMessageReader::BodyValidated, E_FAIL);
+    }
+    
+    timer.Start();
+    while ((seconds = timer.GetElapsedSeconds()) < c_duration)
+    {
+        for (int loop = 0; loop < 100; loop++)
+        {
+            if (fBatch)
+            {
+                CStunIntegrityBatch batch;
+                StunIntegrityInput input;
+                size_t batchIndex;
+                
+                batch.SetUseSimd(fUseSimd);
+                for (size_t index = 0; index < c_size; index++)
+                {
+                    ChkA(_batchReaders[index].GetMessageIntegrityInput(&input));
+                    ChkA(batch.Add(key, input, &batchIndex));
+                }
+                
+                batch.Verify();
+                
+                for (size_t index = 0; index < c_size; index++)
+                {
+                    ChkIfA(batch.IsValid(index) == false, E_FAIL);
+                }
+            }
+            else
+            {
+                for (size_t index = 0; index < c_size; index++)
+                {
+                    ChkA(_batchReaders[index].ValidateMessageIntegrity(key));
+                }
+            }
+            
+            count += c_size;
+        }
+    }
+    
+    PrintBenchmarkResult(GetName(), pszMetric, count / seconds, "per second");
+    
+Cleanup:
+    return hr;
+}
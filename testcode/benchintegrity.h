@@ -0,0 +1,52 @@
+/*
+   Copyright 2011 John Selbie
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef BENCH_INTEGRITY_H
+#define BENCH_INTEGRITY_H
+
+#include "benchmark.h"
+
+
+// MESSAGE-INTEGRITY and MESSAGE-INTEGRITY-SHA256 validations per second on an ICE connectivity check sized
+// binding request, with the key derived per message, looked up in a CStunKeyCache, and precomputed.
+// Then a batch's worth of those requests checked one at a time against a CStunIntegrityBatch
+class CBenchIntegrity : public IBenchmark
+{
+public:
+    struct Keys
+    {
+        CStunIntegrityKey key;
+        CStunIntegrityKeySha256 keySha256;
+    };
+
+private:
+    CRefCountedBuffer _spMessage;
+    CStunMessageReader _reader;
+    CStunKeyCache _keycache;
+    CStunMessageReader _batchReaders[CStunIntegrityBatch::c_maxsize];
+
+    HRESULT CreateMessage(bool fLongTerm, bool fSha256);
+
+    typedef HRESULT (*ValidateFunction)(CStunMessageReader& reader, const Keys& keys, CStunKeyCache& cache);
+    HRESULT BenchValidate(ValidateFunction pfn, const Keys& keys, const char* pszMetric);
+    HRESULT BenchBatch(const CStunIntegrityKey& key, bool fBatch, bool fUseSimd, const char* pszMetric);
+
+public:
+    virtual HRESULT Run();
+    BENCH_DECLARE_NAME("CBenchIntegrity");
+};
+
+#endif
@@ -0,0 +1,48 @@
+/*
+   Copyright 2011 John Selbie
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+
+#include "commonincludes.hpp"
+#include "benchmark.h"
+#include <time.h>
+
+
+CBenchmarkTimer::CBenchmarkTimer()
+{
+    Start();
+}
+
+uint64_t CBenchmarkTimer::GetNanoseconds()
+{
+    timespec ts = {};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec) * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+void CBenchmarkTimer::Start()
+{
+    _timeStart = GetNanoseconds();
+}
+
+double CBenchmarkTimer::GetElapsedSeconds()
+{
+    return (GetNanoseconds() - _timeStart) / 1000000000.0;
+}
+
+void PrintBenchmarkResult(const char* pszBenchmark, const char* pszMetric, double value, const char* pszUnits)
+{
+    printf("%-24s %-40s %14.2f %s\n", pszBenchmark, pszMetric, value, pszUnits);
+}
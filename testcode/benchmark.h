@@ -0,0 +1,50 @@
+/*
+   Copyright 2011 John Selbie
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef BENCHMARK_DECLARE_H
+#define BENCHMARK_DECLARE_H
+
+
+// Benchmarks are run with "stuntestcode --bench" instead of the unit tests.
+// Each one prints its own results through PrintBenchmarkResult
+
+class IBenchmark
+{
+public:
+    virtual ~IBenchmark() {};
+
+    virtual HRESULT Run() = 0;
+    virtual const char* GetName() = 0;
+};
+
+#define BENCH_DECLARE_NAME(benchname) virtual const char* GetName() {return benchname;}
+
+
+class CBenchmarkTimer
+{
+private:
+    uint64_t _timeStart;
+    static uint64_t GetNanoseconds();
+
+public:
+    CBenchmarkTimer();
+    void Start();
+    double GetElapsedSeconds();
+};
+
+void PrintBenchmarkResult(const char* pszBenchmark, const char* pszMetric, double value, const char* pszUnits);
+
+#endif
@@ -0,0 +1,161 @@
+/*
+   Copyright 2011 John Selbie
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+
+#include "commonincludes.hpp"
+#include <openssl/hmac.h>
+#include "stuncore.h"
+#include "benchnonce.h"
+
+
+static const char* c_szLegacyKey = "Change this string if you are going to use this code";
+
+
+// what the sample provider did before CStunNonceGenerator, for comparison: "time:" and a hex HMAC of it
+static void FormatLegacy(const char* pszTime, char* pszNonce)
+{
+    uint8_t hmacresult[20] = {};
+    unsigned int len = sizeof(hmacresult);
+    
+    HMAC(::EVP_sha1(), c_szLegacyKey, strlen(c_szLegacyKey), (const unsigned char*)pszTime, strlen(pszTime), hmacresult, &len);
+    
+    strcpy(pszNonce, pszTime);
+    for (size_t index = 0; index < sizeof(hmacresult); index++)
+    {
+        sprintf(pszNonce + strlen(pszNonce), "%.2x", hmacresult[index]);
+    }
+}
+
+static void CreateLegacy(CStunNonceGenerator& nonces, char* pszNonce)
+{
+    char szTime[24];
+    
+    UNREFERENCED_VARIABLE(nonces);
+    
+    sprintf(szTime, "%u:", (unsigned int)time(NULL));
+    FormatLegacy(szTime, pszNonce);
+}
+
+static HRESULT ValidateLegacy(CStunNonceGenerator& nonces, const char* pszNonce)
+{
+    char szExpected[100];
+    char szNonce[100];
+    char* pRightHalf = NULL;
+    time_t thetime;
+    
+    UNREFERENCED_VARIABLE(nonces);
+    
+    strncpy(szNonce, pszNonce, sizeof(szNonce));
+    szNonce[sizeof(szNonce) - 1] = '\0';
+    
+    pRightHalf = strstr(szNonce, ":");
+    if (pRightHalf == NULL)
+    {
+        return E_FAIL;
+    }
+    pRightHalf[1] = '\0';
+    
+    thetime = atoi(szNonce);
+    if ((time(NULL) - thetime) > 120)
+    {
+        return E_FAIL;
+    }
+    
+    FormatLegacy(szNonce, szExpected);
+    return (strcmp(szExpected, pszNonce) == 0) ? S_OK : E_FAIL;
+}
+
+static void CreateGenerator(CStunNonceGenerator& nonces, char* pszNonce)
+{
+    nonces.CreateNonce(pszNonce);
+}
+
+static HRESULT ValidateGenerator(CStunNonceGenerator& nonces, const char* pszNonce)
+{
+    return nonces.ValidateNonce(pszNonce);
+}
+
+
+HRESULT CBenchNonce::Run()
+{
+    HRESULT hr = S_OK;
+    
+    ChkA(_nonces.Init(CStunNonceGenerator::c_defaultLifetimeSeconds, CStunNonceGenerator::c_defaultRotationSeconds));
+    
+    ChkA(BenchCreate(CreateLegacy, "challenges, sprintf + HMAC"));
+    ChkA(BenchCreate(CreateGenerator, "challenges, CStunNonceGenerator"));
+    ChkA(BenchValidate(CreateLegacy, ValidateLegacy, "validations, sprintf + HMAC"));
+    ChkA(BenchValidate(CreateGenerator, ValidateGenerator, "validations, CStunNonceGenerator"));
+    
+Cleanup:
+    return hr;
+}
+
+HRESULT CBenchNonce::BenchCreate(CreateFunction pfn, const char* pszMetric)
+{
+    HRESULT hr = S_OK;
+    const double c_duration = 0.5;
+    CBenchmarkTimer timer;
+    double seconds = 0;
+    uint64_t count = 0;
+    char szNonce[MAX_STUN_AUTH_STRING_SIZE+1] = {};
+    
+    timer.Start();
+    while ((seconds = timer.GetElapsedSeconds()) < c_duration)
+    {
+        for (int loop = 0; loop < 1000; loop++)
+        {
+            pfn(_nonces, szNonce);
+            count++;
+        }
+    }
+    
+    ChkIfA(szNonce[0] == '\0', E_FAIL);
+    
+    PrintBenchmarkResult(GetName(), pszMetric, count / seconds, "per second");
+    
+Cleanup:
+    return hr;
+}
+
+HRESULT CBenchNonce::BenchValidate(CreateFunction pfnCreate, ValidateFunction pfnValidate, const char* pszMetric)
+{
+    HRESULT hr = S_OK;
+    const double c_duration = 0.5;
+    CBenchmarkTimer timer;
+    double seconds = 0;
+    uint64_t count = 0;
+    char szNonce[MAX_STUN_AUTH_STRING_SIZE+1] = {};
+    
+    pfnCreate(_nonces, szNonce);
+    
+    timer.Start();
+    while ((seconds = timer.GetElapsedSeconds()) < c_duration)
+    {
+        for (int loop = 0; loop < 1000; loop++)
+        {
+            hr = pfnValidate(_nonces, szNonce);
+            count++;
+        }
+    }
+    
+    ChkA(hr);
+    
+    PrintBenchmarkResult(GetName(), pszMetric, count / seconds, "per second");
+    
+Cleanup:
+    return hr;
+}
@@ -0,0 +1,42 @@
+/*
+   Copyright 2011 John Selbie
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+
+#ifndef BENCH_NONCE_H
+#define BENCH_NONCE_H
+
+#include "benchmark.h"
+
+
+// Long term credential challenges (a new nonce) and nonce validations per second with CStunNonceGenerator,
+// and with the "time:hmac" strings the sample auth provider used to make with sprintf and a one-shot HMAC
+class CBenchNonce : public IBenchmark
+{
+private:
+    CStunNonceGenerator _nonces;
+    
+    typedef void (*CreateFunction)(CStunNonceGenerator& nonces, char* pszNonce);
+    typedef HRESULT (*ValidateFunction)(CStunNonceGenerator& nonces, const char* pszNonce);
+    
+    HRESULT BenchCreate(CreateFunction pfn, const char* pszMetric);
+    HRESULT BenchValidate(CreateFunction pfnCreate, ValidateFunction pfnValidate, const char* pszMetric);
+    
+public:
+    virtual HRESULT Run();
+    BENCH_DECLARE_NAME("CBenchNonce");
+};
+
+#endif
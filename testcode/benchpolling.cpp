@@ -0,0 +1,196 @@
+/*
+   Copyright 2011 John Selbie
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+
+#include "commonincludes.hpp"
+#include "polling.h"
+#include "benchpolling.h"
+#include <sys/resource.h>
+
+
+static const size_t c_maxDescriptors = 50000;
+static const size_t c_busyPipeCount = 8;
+
+
+CBenchPolling::CBenchPolling()
+{
+    _idlepipe[0] = -1;
+    _idlepipe[1] = -1;
+}
+
+CBenchPolling::~CBenchPolling()
+{
+    CloseDescriptors();
+}
+
+HRESULT CBenchPolling::CreateDescriptors(size_t count)
+{
+    HRESULT hr = S_OK;
+    int fds[2];
+    char ch = 'x';
+
+    ChkIfA(::pipe(_idlepipe) == -1, ERRNOHR);
+
+    for (size_t index = 0; index < count; index++)
+    {
+        int fd = ::dup(_idlepipe[0]);
+        ChkIfA(fd == -1, ERRNOHR);
+        _fds.push_back(fd);
+    }
+
+    // the write ends get closed right away, the data stays readable
+    for (size_t index = 0; index < c_busyPipeCount; index++)
+    {
+        ChkIfA(::pipe(fds) == -1, ERRNOHR);
+        _busypipes.push_back(fds[0]);
+        ChkIfA(::write(fds[1], &ch, 1) != 1, E_FAIL);
+        close(fds[1]);
+    }
+
+Cleanup:
+    return hr;
+}
+
+void CBenchPolling::CloseDescriptors()
+{
+    for (size_t index = 0; index < _fds.size(); index++)
+    {
+        close(_fds[index]);
+    }
+    _fds.clear();
+
+    for (size_t index = 0; index < _busypipes.size(); index++)
+    {
+        close(_busypipes[index]);
+    }
+    _busypipes.clear();
+
+    for (size_t index = 0; index < ARRAYSIZE(_idlepipe); index++)
+    {
+        if (_idlepipe[index] != -1)
+        {
+            close(_idlepipe[index]);
+            _idlepipe[index] = -1;
+        }
+    }
+}
+
+HRESULT CBenchPolling::Run()
+{
+    HRESULT hr = S_OK;
+    rlimit limit = {};
+    size_t count = c_maxDescriptors;
+
+    // leave some room for the rest of the process
+    if ((getrlimit(RLIMIT_NOFILE, &limit) == 0) && (limit.rlim_cur != RLIM_INFINITY))
+    {
+        count = std::min(count, (size_t)limit.rlim_cur - c_busyPipeCount - 100);
+    }
+
+    CloseDescriptors();
+    ChkA(CreateDescriptors(count));
+
+#ifdef HAS_EPOLL
+    ChkA(BenchPollingType(IPOLLING_TYPE_EPOLL, "epoll"));
+#endif
+    ChkA(BenchPollingType(IPOLLING_TYPE_POLL, "poll"));
+
+Cleanup:
+    CloseDescriptors();
+    return hr;
+}
+
+HRESULT CBenchPolling::BenchPollingType(uint32_t polltype, const char* pszType)
+{
+    HRESULT hr = S_OK;
+    const double c_duration = 1.0;
+    const size_t count = _fds.size();
+    const size_t c_churnIterations = 200000;
+    CRefCountedPtr<IPolling> spPolling;
+    std::vector<int> order(_fds);
+    CBenchmarkTimer timer;
+    double seconds = 0;
+    uint64_t events = 0;
+    PollEvent event;
+    char szMetric[100];
+
+    ChkA(CreatePollingInstance(polltype, count + c_busyPipeCount, spPolling.GetPointerPointer()));
+
+    // removal order is random, so entries come out of the middle as well as the ends
+    srand(100);
+    for (size_t index = count - 1; index > 0; index--)
+    {
+        std::swap(order[index], order[rand() % (index + 1)]);
+    }
+
+    timer.Start();
+    for (size_t index = 0; index < count; index++)
+    {
+        ChkA(spPolling->Add(_fds[index], IPOLLING_READ));
+    }
+    seconds = timer.GetElapsedSeconds();
+    sprintf(szMetric, "%s: add (%d sockets)", pszType, (int)count);
+    PrintBenchmarkResult(GetName(), szMetric, count / seconds, "per second");
+
+    timer.Start();
+    for (size_t index = 0; index < count; index++)
+    {
+        ChkA(spPolling->Remove(order[index]));
+    }
+    seconds = timer.GetElapsedSeconds();
+    sprintf(szMetric, "%s: remove, random order", pszType);
+    PrintBenchmarkResult(GetName(), szMetric, count / seconds, "per second");
+
+    // steady state: a full table with connections coming and going
+    for (size_t index = 0; index < count; index++)
+    {
+        ChkA(spPolling->Add(_fds[index], IPOLLING_READ));
+    }
+
+    timer.Start();
+    for (size_t index = 0; index < c_churnIterations; index++)
+    {
+        int fd = _fds[rand() % count];
+        ChkA(spPolling->Remove(fd));
+        ChkA(spPolling->Add(fd, IPOLLING_READ));
+    }
+    seconds = timer.GetElapsedSeconds();
+    sprintf(szMetric, "%s: remove+add with a full table", pszType);
+    PrintBenchmarkResult(GetName(), szMetric, c_churnIterations / seconds, "per second");
+
+    // a few busy sockets among all the idle ones
+    for (size_t index = 0; index < _busypipes.size(); index++)
+    {
+        ChkA(spPolling->Add(_busypipes[index], IPOLLING_READ));
+    }
+
+    timer.Start();
+    while ((seconds = timer.GetElapsedSeconds()) < c_duration)
+    {
+        for (int loop = 0; loop < 100; loop++)
+        {
+            hr = spPolling->WaitForNextEvent(&event, 0);
+            ChkA(hr);
+            ChkIfA(hr == S_FALSE, E_UNEXPECTED);
+            events++;
+        }
+    }
+    sprintf(szMetric, "%s: events (%d busy sockets)", pszType, (int)c_busyPipeCount);
+    PrintBenchmarkResult(GetName(), szMetric, events / seconds, "per second");
+
+Cleanup:
+    return hr;
+}
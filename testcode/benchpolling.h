@@ -0,0 +1,46 @@
+/*
+   Copyright 2011 John Selbie
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef BENCH_POLLING_H
+#define BENCH_POLLING_H
+
+#include "benchmark.h"
+
+
+// Registration churn and event dispatch for each polling type, with tens of thousands
+// of sockets registered (as many as the open file limit allows).  The registered
+// sockets are duplicates of one idle pipe, plus a few pipes that always have data.
+class CBenchPolling : public IBenchmark
+{
+private:
+    std::vector<int> _fds;     // idle
+    int _idlepipe[2];
+    std::vector<int> _busypipes;
+
+    HRESULT CreateDescriptors(size_t count);
+    void CloseDescriptors();
+
+    HRESULT BenchPollingType(uint32_t polltype, const char* pszType);
+
+public:
+    CBenchPolling();
+    ~CBenchPolling();
+
+    virtual HRESULT Run();
+    BENCH_DECLARE_NAME("CBenchPolling");
+};
+
+#endif
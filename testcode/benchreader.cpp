@@ -0,0 +1,124 @@
+/*
+   Copyright 2011 John Selbie
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+
+#include "commonincludes.hpp"
+#include "stuncore.h"
+#include "benchreader.h"
+
+
+HRESULT CBenchReader::CreateRequest(CRefCountedBuffer* pspBuffer)
+{
+    HRESULT hr = S_OK;
+    CStunMessageBuilder builder;
+    uint32_t priority = htonl(0x6e7f00ff);
+    uint64_t tiebreaker = 0x1122334455667788ULL;
+    
+    ChkA(builder.AddBindingRequestHeader());
+    ChkA(builder.AddRandomTransactionId(NULL));
+    ChkA(builder.AddUserName("remoteufrag:localufrag"));
+    ChkA(builder.AddAttribute(0x0024, &priority, sizeof(priority)));       // PRIORITY
+    ChkA(builder.AddAttribute(0x802A, &tiebreaker, sizeof(tiebreaker)));   // ICE-CONTROLLING
+    ChkA(builder.AddMessageIntegrityShortTerm("0123456789abcdefghijkl"));
+    ChkA(builder.AddFingerprintAttribute());
+    ChkA(builder.GetResult(pspBuffer));
+    
+Cleanup:
+    return hr;
+}
+
+HRESULT CBenchReader::CreateResponse(CRefCountedBuffer* pspBuffer)
+{
+    HRESULT hr = S_OK;
+    CStunMessageBuilder builder;
+    CSocketAddress addrMapped(0x01020304, 5000);
+    CSocketAddress addrOrigin(0x05060708, 3478);
+    CSocketAddress addrOther(0x05060709, 3479);
+    
+    ChkA(builder.AddHeader(StunMsgTypeBinding, StunMsgClassSuccessResponse));
+    ChkA(builder.AddRandomTransactionId(NULL));
+    ChkA(builder.AddXorMappedAddress(addrMapped));
+    ChkA(builder.AddMappedAddress(addrMapped));
+    ChkA(builder.AddResponseOriginAddress(addrOrigin));
+    ChkA(builder.AddOtherAddress(addrOther));
+    ChkA(builder.AddFingerprintAttribute());
+    ChkA(builder.GetResult(pspBuffer));
+    
+Cleanup:
+    return hr;
+}
+
+HRESULT CBenchReader::Run()
+{
+    HRESULT hr = S_OK;
+    CRefCountedBuffer spRequest;
+    CRefCountedBuffer spResponse;
+    
+    ChkA(CreateRequest(&spRequest));
+    ChkA(CreateResponse(&spResponse));
+    
+    ChkA(BenchParse(spRequest, false, "ICE request, parse"));
+    ChkA(BenchParse(spRequest, true, "ICE request, parse and look up"));
+    ChkA(BenchParse(spResponse, false, "binding response, parse"));
+    ChkA(BenchParse(spResponse, true, "binding response, parse and look up"));
+    
+Cleanup:
+    return hr;
+}
+
+HRESULT CBenchReader::BenchParse(CRefCountedBuffer& spBuffer, bool fLookups, const char* pszMetric)
+{
+    HRESULT hr = S_OK;
+    const double c_duration = 0.5;
+    CBenchmarkTimer timer;
+    double seconds = 0;
+    uint64_t count = 0;
+    uint64_t found = 0;
+    StunAttribute attrib;
+    
+    timer.Start();
+    while ((seconds = timer.GetElapsedSeconds()) < c_duration)
+    {
+        for (int loop = 0; loop < 1000; loop++)
+        {
+            _reader.Reset();
+            ChkIfA(_reader.AddBytes(spBuffer->GetData(), spBuffer->GetSize()) != CStunMessageReader::BodyValidated, E_FAIL);
+            
+            if (fLookups)
+            {
+                // what the request handler and the client ask for - present or not
+                found += SUCCEEDED(_reader.GetAttributeByType(STUN_ATTRIBUTE_USERNAME, &attrib));
+                found += SUCCEEDED(_reader.GetAttributeByType(STUN_ATTRIBUTE_REALM, &attrib));
+                found += SUCCEEDED(_reader.GetAttributeByType(STUN_ATTRIBUTE_NONCE, &attrib));
+                found += SUCCEEDED(_reader.GetAttributeByType(STUN_ATTRIBUTE_CHANGEREQUEST, &attrib));
+                found += SUCCEEDED(_reader.GetAttributeByType(STUN_ATTRIBUTE_RESPONSE_PORT, &attrib));
+                found += SUCCEEDED(_reader.GetAttributeByType(STUN_ATTRIBUTE_PADDING, &attrib));
+                found += SUCCEEDED(_reader.GetAttributeByType(STUN_ATTRIBUTE_XORMAPPEDADDRESS, &attrib));
+                found += SUCCEEDED(_reader.GetAttributeByType(STUN_ATTRIBUTE_OTHER_ADDRESS, &attrib));
+                found += _reader.HasMessageIntegrityAttribute();
+                found += _reader.HasFingerprintAttribute();
+            }
+            count++;
+        }
+    }
+    
+    ChkIfA(fLookups && (found == 0), E_FAIL);
+    
+    PrintBenchmarkResult(GetName(), pszMetric, count / seconds, "per second");
+    
+Cleanup:
+    return hr;
+}
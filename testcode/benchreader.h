@@ -0,0 +1,40 @@
+/*
+   Copyright 2011 John Selbie
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef BENCH_READER_H
+#define BENCH_READER_H
+
+#include "benchmark.h"
+
+
+// CStunMessageReader parses per second (Reset plus AddBytes), and parses followed by the
+// attribute lookups the server does, for an ICE connectivity check and for a binding response
+class CBenchReader : public IBenchmark
+{
+private:
+    CStunMessageReader _reader;
+
+    HRESULT CreateRequest(CRefCountedBuffer* pspBuffer);
+    HRESULT CreateResponse(CRefCountedBuffer* pspBuffer);
+
+    HRESULT BenchParse(CRefCountedBuffer& spBuffer, bool fLookups, const char* pszMetric);
+
+public:
+    virtual HRESULT Run();
+    BENCH_DECLARE_NAME("CBenchReader");
+};
+
+#endif
@@ -0,0 +1,157 @@
+/*
+   Copyright 2011 John Selbie
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+
+#include "commonincludes.hpp"
+#include "stuncore.h"
+#include "benchtls.h"
+
+
+HRESULT CBenchTls::Run()
+{
+    HRESULT hr = S_OK;
+    CTlsLoopback loopback;
+    int sockClient = -1;
+    int sockServer = -1;
+    CTlsSession client;
+    CTlsSession server;
+    SSL_SESSION* pSession = NULL;
+    uint8_t data[1] = {0};
+    uint8_t received[1];
+
+    ChkA(loopback.Init());
+
+    // one connection up front, to get a session ticket and to report what the kernel took over
+    ChkA(loopback.Connect(&sockClient, &sockServer));
+    ChkA(loopback.Handshake(&client, sockClient, &server, sockServer, NULL));
+    ChkA(CTlsLoopback::Transfer(&server, &client, data, sizeof(data), received));
+    pSession = client.GetSession();
+    ChkIfA(pSession == NULL, E_FAIL);
+
+    PrintBenchmarkResult(GetName(), "kernel TLS send (1=yes)", server.IsKernelSend() ? 1 : 0, "");
+    PrintBenchmarkResult(GetName(), "kernel TLS receive (1=yes)", server.IsKernelReceive() ? 1 : 0, "");
+
+    ChkA(BenchHandshakes(loopback, NULL, "full handshakes"));
+    ChkA(BenchHandshakes(loopback, pSession, "resumed handshakes"));
+
+    // a binding request and response, one at a time and pipelined
+    ChkA(BenchThroughput(loopback, 20, 80, 1, "binding exchanges, 1 in flight"));
+    ChkA(BenchThroughput(loopback, 20, 80, 64, "binding exchanges, 64 pipelined"));
+
+    // bulk records, for raw encryption throughput
+    ChkA(BenchThroughput(loopback, 16384, 16384, 1, "16K record exchanges"));
+
+Cleanup:
+    client.Close();
+    server.Close();
+    if (sockClient != -1)
+    {
+        close(sockClient);
+    }
+    if (sockServer != -1)
+    {
+        close(sockServer);
+    }
+    if (pSession)
+    {
+        SSL_SESSION_free(pSession);
+    }
+    return hr;
+}
+
+HRESULT CBenchTls::BenchHandshakes(CTlsLoopback& loopback, SSL_SESSION* pResume, const char* pszMetric)
+{
+    HRESULT hr = S_OK;
+    const int c_iterations = 500;
+    CBenchmarkTimer timer;
+    double seconds;
+
+    for (int index = 0; index < c_iterations; index++)
+    {
+        int sockClient = -1;
+        int sockServer = -1;
+        CTlsSession client;
+        CTlsSession server;
+
+        ChkA(loopback.Connect(&sockClient, &sockServer));
+        hr = loopback.Handshake(&client, sockClient, &server, sockServer, pResume);
+        if (SUCCEEDED(hr) && (pResume != NULL) && (server.IsResumed() == false))
+        {
+            hr = E_FAIL;
+        }
+
+        client.Close();
+        server.Close();
+        close(sockClient);
+        close(sockServer);
+
+        ChkA(hr);
+    }
+
+    seconds = timer.GetElapsedSeconds();
+    PrintBenchmarkResult(GetName(), pszMetric, c_iterations / seconds, "per second");
+
+Cleanup:
+    return hr;
+}
+
+HRESULT CBenchTls::BenchThroughput(CTlsLoopback& loopback, size_t requestsize, size_t responsesize, size_t batchsize, const char* pszMetric)
+{
+    HRESULT hr = S_OK;
+    const double c_duration = 1.0;
+    int sockClient = -1;
+    int sockServer = -1;
+    CTlsSession client;
+    CTlsSession server;
+    std::vector<uint8_t> requests(requestsize * batchsize, 0xaa);
+    std::vector<uint8_t> responses(responsesize * batchsize, 0x55);
+    std::vector<uint8_t> received(std::max(requests.size(), responses.size()));
+    CBenchmarkTimer timer;
+    double seconds = 0;
+    uint64_t exchanges = 0;
+    uint64_t bytes = 0;
+
+    ChkA(loopback.Connect(&sockClient, &sockServer));
+    ChkA(loopback.Handshake(&client, sockClient, &server, sockServer, NULL));
+
+    timer.Start();
+    while ((seconds = timer.GetElapsedSeconds()) < c_duration)
+    {
+        for (int loop = 0; loop < 100; loop++)
+        {
+            ChkA(CTlsLoopback::Transfer(&client, &server, &requests[0], requests.size(), &received[0]));
+            ChkA(CTlsLoopback::Transfer(&server, &client, &responses[0], responses.size(), &received[0]));
+            exchanges += batchsize;
+            bytes += requests.size() + responses.size();
+        }
+    }
+
+    PrintBenchmarkResult(GetName(), pszMetric, exchanges / seconds, "per second");
+    PrintBenchmarkResult(GetName(), pszMetric, (bytes / seconds) / (1024*1024), "MB/sec");
+
+Cleanup:
+    client.Close();
+    server.Close();
+    if (sockClient != -1)
+    {
+        close(sockClient);
+    }
+    if (sockServer != -1)
+    {
+        close(sockServer);
+    }
+    return hr;
+}
@@ -0,0 +1,38 @@
+/*
+   Copyright 2011 John Selbie
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef BENCH_TLS_H
+#define BENCH_TLS_H
+
+#include "benchmark.h"
+#include "testtlssession.h"
+
+
+// Handshakes per second (full and resumed) and steady state record throughput
+// over loopback.  Both ends run on the calling thread, so the numbers include
+// the client's share of the work.
+class CBenchTls : public IBenchmark
+{
+private:
+    HRESULT BenchHandshakes(CTlsLoopback& loopback, SSL_SESSION* pResume, const char* pszMetric);
+    HRESULT BenchThroughput(CTlsLoopback& loopback, size_t requestsize, size_t responsesize, size_t batchsize, const char* pszMetric);
+
+public:
+    virtual HRESULT Run();
+    BENCH_DECLARE_NAME("CBenchTls");
+};
+
+#endif
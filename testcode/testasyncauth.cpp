@@ -0,0 +1,346 @@
+/*
+   Copyright 2011 John Selbie
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+
+#include "commonincludes.hpp"
+#include "stuncore.h"
+#include "testasyncauth.h"
+#include "testmessagehandler.h"
+#include <poll.h>
+
+
+static const uint32_t c_testLatency = 50;
+
+
+HRESULT CTestAsyncAuth::Run()
+{
+    HRESULT hr = S_OK;
+    
+    _tsa.set[RolePP].fValid = true;
+    _tsa.set[RolePP].addr = CSocketAddress(0x7f000001, 3478);
+    _tsa.set[RolePA].fValid = false;
+    _tsa.set[RoleAP].fValid = false;
+    _tsa.set[RoleAA].fValid = false;
+    ChkA(CStunRequestHandler::PrecomputeAttributes(&_tsa));
+    
+    ChkA(TestPending());
+    ChkA(TestManyPending());
+    ChkA(TestNoLatency());
+    ChkA(TestSlotsFull());
+    ChkA(TestCancel());
+    
+Cleanup:
+    return hr;
+}
+
+// a binding request (new transaction ID) signed with the password CMockAuthShort has for "AuthorizedUser", into _reader/_msgIn
+HRESULT CTestAsyncAuth::InitRequest(const char* pszUser)
+{
+    HRESULT hr = S_OK;
+    CStunMessageBuilder builder;
+    
+    ChkA(builder.AddBindingRequestHeader());
+    ChkA(builder.AddRandomTransactionId(NULL));
+    ChkA(builder.AddUserName(pszUser));
+    ChkA(builder.AddMessageIntegrityShortTerm("password"));
+    ChkA(builder.GetResult(&_spRequest));
+    
+    _reader.Reset();
+    ChkIfA(CStunMessageReader::BodyValidated != _reader.AddBytes(_spRequest->GetData(), _spRequest->GetSize()), E_FAIL);
+    
+    _msgIn.socketrole = RolePP;
+    _msgIn.addrLocal = _tsa.set[RolePP].addr;
+    _msgIn.addrRemote = CSocketAddress(0x0a000001, 5000);
+    _msgIn.pReader = &_reader;
+    _msgIn.fConnectionOriented = false;
+    
+    _spResponse = CRefCountedBuffer(new CBuffer(MAX_STUN_MESSAGE_SIZE));
+    _msgOut.spBufferOut = _spResponse;
+    
+Cleanup:
+    return hr;
+}
+
+// what the blocking path answers the request in _msgIn with
+HRESULT CTestAsyncAuth::GetExpectedResponse(IStunAuth* pAuth, CRefCountedBuffer* pspExpected)
+{
+    HRESULT hr = S_OK;
+    CStunRequestContext context;
+    StunMessageOut msgOut;
+    
+    *pspExpected = CRefCountedBuffer(new CBuffer(MAX_STUN_MESSAGE_SIZE));
+    msgOut.spBufferOut = *pspExpected;
+    
+    ChkA(context.ProcessRequest(_msgIn, msgOut, &_tsa, pAuth, NULL));
+    
+Cleanup:
+    return hr;
+}
+
+HRESULT CTestAsyncAuth::ValidateResponse(const StunMessageOut& msgOut, CRefCountedBuffer& spExpected)
+{
+    HRESULT hr = S_OK;
+    
+    ChkIfA(msgOut.socketrole != RolePP, E_FAIL);
+    ChkIfA(msgOut.addrDest.IsSameIP_and_Port(CSocketAddress(0x0a000001, 5000)) == false, E_FAIL);
+    ChkIfA(msgOut.spBufferOut->GetSize() != spExpected->GetSize(), E_FAIL);
+    ChkIfA(0 != memcmp(msgOut.spBufferOut->GetData(), spExpected->GetData(), spExpected->GetSize()), E_FAIL);
+    
+Cleanup:
+    return hr;
+}
+
+// the notification fd has to turn readable - a test that never gets its callback fails instead of hanging
+HRESULT CTestAsyncAuth::WaitForNotify(CStunAsyncRequestContext& context)
+{
+    HRESULT hr = S_OK;
+    pollfd pfd = {};
+    
+    pfd.fd = context.GetNotifyFd();
+    pfd.events = POLLIN;
+    
+    ChkIfA(::poll(&pfd, 1, 5000) != 1, E_FAIL);
+    
+Cleanup:
+    return hr;
+}
+
+// a request is parked, the caller's buffers get reused, and the response comes out of the notification matching
+// what the blocking path produces
+HRESULT CTestAsyncAuth::TestPending()
+{
+    HRESULT hr = S_OK;
+    CRefCountedPtr<CMockAuthShort> spMock;
+    CRefCountedPtr<CStunDelayedAuth> spDelayed;
+    CStunAsyncRequestContext context;
+    CRefCountedBuffer spExpected;
+    StunMessageOut msgOut;
+    void* pTag = NULL;
+    HRESULT hrResult = E_FAIL;
+    int tag = 0;
+    
+    ChkA(CMockAuthShort::CreateInstanceNoInit(spMock.GetPointerPointer()));
+    ChkA(CStunDelayedAuth::CreateInstance(spMock.GetPointer(), c_testLatency, spDelayed.GetPointerPointer()));
+    ChkA(context.Init(spDelayed, 4));
+    
+    ChkA(InitRequest("AuthorizedUser"));
+    ChkA(GetExpectedResponse(spMock, &spExpected));
+    
+    ChkIfA(context.ProcessRequest(_msgIn, _msgOut, &_tsa, NULL, &tag) != E_PENDING, E_FAIL);
+    ChkIfA(context.GetPendingCount() != 1, E_FAIL);
+    
+    // the parked request is a copy
+    _reader.Reset();
+    memset(_spRequest->GetData(), 0xee, _spRequest->GetSize());
+    memset(_spResponse->GetData(), 0xee, _spResponse->GetAllocatedSize());
+    
+    msgOut.spBufferOut = CRefCountedBuffer(new CBuffer(MAX_STUN_MESSAGE_SIZE));
+    ChkA(WaitForNotify(context));
+    
+    ChkIfA(context.GetCompletedRequest(msgOut, &pTag, &hrResult) == false, E_FAIL);
+    ChkIfA(pTag != &tag, E_FAIL);
+    ChkA(hrResult);
+    ChkA(ValidateResponse(msgOut, spExpected));
+    
+    ChkIfA(context.GetCompletedRequest(msgOut, &pTag, &hrResult), E_FAIL);
+    ChkIfA(context.GetPendingCount() != 0, E_FAIL);
+    
+Cleanup:
+    context.Reset();
+    return hr;
+}
+
+// lots of requests out at once, some of them for users the provider turns away (a 401 response).
+// Every one comes back exactly once, with its own tag and its own response
+HRESULT CTestAsyncAuth::TestManyPending()
+{
+    HRESULT hr = S_OK;
+    const size_t count = 20;
+    CRefCountedPtr<CMockAuthShort> spMock;
+    CRefCountedPtr<CStunDelayedAuth> spDelayed;
+    CStunAsyncRequestContext context;
+    CRefCountedBuffer expected[count];
+    bool fDone[count] = {};
+    size_t completed = 0;
+    StunMessageOut msgOut;
+    
+    ChkA(CMockAuthShort::CreateInstanceNoInit(spMock.GetPointerPointer()));
+    ChkA(CStunDelayedAuth::CreateInstance(spMock.GetPointer(), c_testLatency, spDelayed.GetPointerPointer()));
+    ChkA(context.Init(spDelayed, count));
+    
+    for (size_t index = 0; index < count; index++)
+    {
+        ChkA(InitRequest(((index % 3) == 0) ? "SomeoneElse" : "AuthorizedUser"));
+        ChkA(GetExpectedResponse(spMock, &expected[index]));
+        ChkIfA(context.ProcessRequest(_msgIn, _msgOut, &_tsa, NULL, &fDone[index]) != E_PENDING, E_FAIL);
+    }
+    
+    ChkIfA(context.GetPendingCount() != count, E_FAIL);
+    
+    msgOut.spBufferOut = CRefCountedBuffer(new CBuffer(MAX_STUN_MESSAGE_SIZE));
+    
+    while (completed < count)
+    {
+        void* pTag = NULL;
+        HRESULT hrResult = E_FAIL;
+        
+        ChkA(WaitForNotify(context));
+        
+        while (context.GetCompletedRequest(msgOut, &pTag, &hrResult))
+        {
+            size_t index = (bool*)pTag - fDone;
+            
+            ChkIfA(index >= count, E_FAIL);
+            ChkIfA(fDone[index], E_FAIL);
+            ChkA(hrResult);
+            ChkA(ValidateResponse(msgOut, expected[index]));
+            fDone[index] = true;
+            completed++;
+        }
+    }
+    
+    ChkIfA(context.GetPendingCount() != 0, E_FAIL);
+    
+Cleanup:
+    context.Reset();
+    return hr;
+}
+
+// with no latency the provider answers on the spot, and so does ProcessRequest
+HRESULT CTestAsyncAuth::TestNoLatency()
+{
+    HRESULT hr = S_OK;
+    CRefCountedPtr<CMockAuthShort> spMock;
+    CRefCountedPtr<CStunDelayedAuth> spDelayed;
+    CStunAsyncRequestContext context;
+    CRefCountedBuffer spExpected;
+    
+    ChkA(CMockAuthShort::CreateInstanceNoInit(spMock.GetPointerPointer()));
+    ChkA(CStunDelayedAuth::CreateInstance(spMock.GetPointer(), 0, spDelayed.GetPointerPointer()));
+    ChkA(context.Init(spDelayed, 4));
+    
+    ChkA(InitRequest("AuthorizedUser"));
+    ChkA(GetExpectedResponse(spMock, &spExpected));
+    ChkA(context.ProcessRequest(_msgIn, _msgOut, &_tsa, NULL, NULL));
+    ChkA(ValidateResponse(_msgOut, spExpected));
+    
+    ChkA(InitRequest("SomeoneElse"));
+    ChkA(GetExpectedResponse(spMock, &spExpected));
+    ChkA(context.ProcessRequest(_msgIn, _msgOut, &_tsa, NULL, NULL));
+    ChkA(ValidateResponse(_msgOut, spExpected));
+    
+    ChkIfA(context.GetPendingCount() != 0, E_FAIL);
+    
+Cleanup:
+    context.Reset();
+    return hr;
+}
+
+// once every slot is in use, requests wait on the provider's blocking check instead of being turned away
+HRESULT CTestAsyncAuth::TestSlotsFull()
+{
+    HRESULT hr = S_OK;
+    CRefCountedPtr<CMockAuthShort> spMock;
+    CRefCountedPtr<CStunDelayedAuth> spDelayed;
+    CStunAsyncRequestContext context;
+    CRefCountedBuffer spExpected;
+    StunMessageOut msgOut;
+    void* pTag = NULL;
+    HRESULT hrResult = E_FAIL;
+    size_t completed = 0;
+    
+    ChkA(CMockAuthShort::CreateInstanceNoInit(spMock.GetPointerPointer()));
+    ChkA(CStunDelayedAuth::CreateInstance(spMock.GetPointer(), c_testLatency, spDelayed.GetPointerPointer()));
+    ChkA(context.Init(spDelayed, 2));
+    
+    for (size_t index = 0; index < 2; index++)
+    {
+        ChkA(InitRequest("AuthorizedUser"));
+        ChkIfA(context.ProcessRequest(_msgIn, _msgOut, &_tsa, NULL, NULL) != E_PENDING, E_FAIL);
+    }
+    
+    ChkA(InitRequest("AuthorizedUser"));
+    ChkA(GetExpectedResponse(spMock, &spExpected));
+    ChkA(context.ProcessRequest(_msgIn, _msgOut, &_tsa, NULL, NULL));
+    ChkA(ValidateResponse(_msgOut, spExpected));
+    
+    // the parked ones still come back
+    msgOut.spBufferOut = CRefCountedBuffer(new CBuffer(MAX_STUN_MESSAGE_SIZE));
+    while (completed < 2)
+    {
+        ChkA(WaitForNotify(context));
+        while (context.GetCompletedRequest(msgOut, &pTag, &hrResult))
+        {
+            ChkA(hrResult);
+            completed++;
+        }
+    }
+    
+Cleanup:
+    context.Reset();
+    return hr;
+}
+
+// a canceled request (its TCP connection closed) never comes out of GetCompletedRequest, and its slot gets reused
+HRESULT CTestAsyncAuth::TestCancel()
+{
+    HRESULT hr = S_OK;
+    CRefCountedPtr<CStunDelayedAuth> spDelayed;
+    CStunAsyncRequestContext context;
+    StunMessageOut msgOut;
+    int tagCanceled = 0;
+    int tagKept = 0;
+    void* pTag = NULL;
+    HRESULT hrResult = E_FAIL;
+    
+    // no inner provider - everybody gets in
+    ChkA(CStunDelayedAuth::CreateInstance((IStunAuth*)NULL, c_testLatency, spDelayed.GetPointerPointer()));
+    ChkA(context.Init(spDelayed, 2));
+    
+    ChkA(InitRequest("AuthorizedUser"));
+    ChkIfA(context.ProcessRequest(_msgIn, _msgOut, &_tsa, NULL, &tagCanceled) != E_PENDING, E_FAIL);
+    ChkA(InitRequest("AuthorizedUser"));
+    ChkIfA(context.ProcessRequest(_msgIn, _msgOut, &_tsa, NULL, &tagKept) != E_PENDING, E_FAIL);
+    
+    context.CancelRequests(&tagCanceled);
+    
+    msgOut.spBufferOut = CRefCountedBuffer(new CBuffer(MAX_STUN_MESSAGE_SIZE));
+    
+    // both callbacks are in when nothing is pending anymore
+    while (context.GetPendingCount() > 0)
+    {
+        ChkA(WaitForNotify(context));
+        while (context.GetCompletedRequest(msgOut, &pTag, &hrResult))
+        {
+            ChkIfA(pTag != &tagKept, E_FAIL);
+            ChkA(hrResult);
+            tagKept++;
+        }
+    }
+    
+    ChkIfA(tagKept != 1, E_FAIL);
+    
+    // both slots are free again
+    for (size_t index = 0; index < 2; index++)
+    {
+        ChkA(InitRequest("AuthorizedUser"));
+        ChkIfA(context.ProcessRequest(_msgIn, _msgOut, &_tsa, NULL, NULL) != E_PENDING, E_FAIL);
+    }
+    
+Cleanup:
+    context.Reset();
+    return hr;
+}
@@ -0,0 +1,50 @@
+/*
+   Copyright 2011 John Selbie
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+
+#ifndef TEST_ASYNC_AUTH_H
+#define TEST_ASYNC_AUTH_H
+
+#include "unittest.h"
+
+
+class CTestAsyncAuth : public IUnitTest
+{
+private:
+    TransportAddressSet _tsa;
+    CStunMessageReader _reader;
+    CRefCountedBuffer _spRequest;
+    CRefCountedBuffer _spResponse;
+    StunMessageIn _msgIn;
+    StunMessageOut _msgOut;
+    
+    HRESULT InitRequest(const char* pszUser);
+    HRESULT GetExpectedResponse(IStunAuth* pAuth, CRefCountedBuffer* pspExpected);
+    HRESULT ValidateResponse(const StunMessageOut& msgOut, CRefCountedBuffer& spExpected);
+    HRESULT WaitForNotify(CStunAsyncRequestContext& context);
+    
+    HRESULT TestPending();
+    HRESULT TestManyPending();
+    HRESULT TestNoLatency();
+    HRESULT TestSlotsFull();
+    HRESULT TestCancel();
+    
+public:
+    virtual HRESULT Run();
+    UT_DECLARE_TEST_NAME("CTestAsyncAuth");
+};
+
+#endif
@@ -0,0 +1,191 @@
+/*
+   Copyright 2011 John Selbie
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "commonincludes.hpp"
+#include "stuncore.h"
+#include "testbufferpool.h"
+
+
+HRESULT CTestBufferPool::Run()
+{
+    HRESULT hr = S_OK;
+    
+    ChkA(TestReuse());
+    ChkA(TestClose());
+    ChkA(TestNoAllocations());
+    ChkA(TestThreadPools());
+    
+Cleanup:
+    return hr;
+}
+
+// released buffers come back out of the pool instead of being allocated again
+HRESULT CTestBufferPool::TestReuse()
+{
+    HRESULT hr = S_OK;
+    CBufferPool* pPool = new CBufferPool();
+    CRefCountedBuffer spBuffers[3];
+    CRefCountedBuffer spCopy;
+    CBuffer* pFirst = NULL;
+    int allocations = 0;
+    
+    for (size_t index = 0; index < ARRAYSIZE(spBuffers); index++)
+    {
+        ChkA(pPool->Acquire(&spBuffers[index]));
+        ChkIfA(spBuffers[index]->GetAllocatedSize() != CBufferPool::c_bufferSize, E_FAIL);
+        ChkIfA(spBuffers[index]->GetSize() != CBufferPool::c_bufferSize, E_FAIL);
+    }
+    ChkIfA(pPool->GetCreateCount() != 3, E_FAIL);
+    ChkIfA(pPool->GetOutstandingCount() != 3, E_FAIL);
+    ChkIfA(pPool->GetFreeCount() != 0, E_FAIL);
+    
+    // the last reference is what returns a buffer
+    pFirst = spBuffers[0].get();
+    spCopy = spBuffers[0];
+    spBuffers[0].reset();
+    ChkIfA(pPool->GetOutstandingCount() != 3, E_FAIL);
+    spCopy->SetSize(10);
+    spCopy.reset();
+    ChkIfA(pPool->GetOutstandingCount() != 2, E_FAIL);
+    ChkIfA(pPool->GetFreeCount() != 1, E_FAIL);
+    
+    // and the next Acquire gets it back, reset to full size
+    allocations = CBuffer::GetAllocationCount();
+    ChkA(pPool->Acquire(&spBuffers[0]));
+    ChkIfA(spBuffers[0].get() != pFirst, E_FAIL);
+    ChkIfA(spBuffers[0]->GetSize() != CBufferPool::c_bufferSize, E_FAIL);
+    ChkIfA(CBuffer::GetAllocationCount() != allocations, E_FAIL);
+    ChkIfA(pPool->GetCreateCount() != 3, E_FAIL);
+    ChkIfA(pPool->GetAcquireCount() != 4, E_FAIL);
+    
+    for (size_t index = 0; index < ARRAYSIZE(spBuffers); index++)
+    {
+        spBuffers[index].reset();
+    }
+    ChkIfA(pPool->GetFreeCount() != 3, E_FAIL);
+    
+    // one of the three gets used between trims - the other two are freed by the second trim
+    pPool->Trim();
+    ChkA(pPool->Acquire(&spBuffers[0]));
+    spBuffers[0].reset();
+    ChkIfA(pPool->Trim() != 2, E_FAIL);
+    ChkIfA(pPool->GetFreeCount() != 1, E_FAIL);
+    
+Cleanup:
+    for (size_t index = 0; index < ARRAYSIZE(spBuffers); index++)
+    {
+        spBuffers[index].reset();
+    }
+    pPool->Close();
+    return hr;
+}
+
+// buffers that outlive their pool still work, and are deleted when released
+HRESULT CTestBufferPool::TestClose()
+{
+    HRESULT hr = S_OK;
+    CBufferPool* pPool = new CBufferPool();
+    CRefCountedBuffer spBuffer1;
+    CRefCountedBuffer spBuffer2;
+    
+    ChkA(pPool->Acquire(&spBuffer1));
+    ChkA(pPool->Acquire(&spBuffer2));
+    spBuffer2.reset();
+    
+    pPool->Close();
+    pPool = NULL;
+    
+    memset(spBuffer1->GetData(), 'x', spBuffer1->GetAllocatedSize());
+    spBuffer1.reset();
+    
+Cleanup:
+    return hr;
+}
+
+// parsing and building messages through CDataStream doesn't allocate once the thread's pool has buffers
+HRESULT CTestBufferPool::TestNoAllocations()
+{
+    HRESULT hr = S_OK;
+    CStunMessageReader reader;
+    CRefCountedBuffer spMessage;
+    int allocations = 0;
+    uint64_t created = 0;
+    
+    for (int loop = 0; loop < 100; loop++)
+    {
+        CStunMessageBuilder builder;
+        CRefCountedBuffer spBuffer;
+        CSocketAddress addr;
+        
+        if (loop == 1)
+        {
+            // the first time through filled the pool
+            allocations = CBuffer::GetAllocationCount();
+            created = CBufferPool::GetThreadPool()->GetCreateCount();
+        }
+        
+        ChkA(builder.AddBindingRequestHeader());
+        ChkA(builder.AddRandomTransactionId(NULL));
+        ChkA(builder.AddMappedAddress(CSocketAddress(0x01020304, 5000)));
+        ChkA(builder.AddFingerprintAttribute());
+        ChkA(builder.GetResult(&spBuffer));
+        
+        reader.Reset();
+        ChkIfA(reader.AddBytes(spBuffer->GetData(), spBuffer->GetSize()) != CStunMessageReader::BodyValidated, E_FAIL);
+        ChkA(reader.GetMappedAddress(&addr));
+        ChkIfA(reader.IsFingerprintAttributeValid() == false, E_FAIL);
+    }
+    
+    ChkIfA(CBuffer::GetAllocationCount() != allocations, E_FAIL);
+    ChkIfA(CBufferPool::GetThreadPool()->GetCreateCount() != created, E_FAIL);
+    
+Cleanup:
+    return hr;
+}
+
+
+static void* ThreadPoolProc(void* pParam)
+{
+    CRefCountedBuffer spBuffer;
+    CBufferPool* pPool = CBufferPool::GetThreadPool();
+    
+    *(CBufferPool**)pParam = pPool;
+    
+    if (FAILED(pPool->Acquire(&spBuffer)) || (pPool != CBufferPool::GetThreadPool()))
+    {
+        *(CBufferPool**)pParam = NULL;
+    }
+    
+    // spBuffer goes back to the pool here, and the pool is closed when the thread exits
+    return NULL;
+}
+
+// every thread gets a pool of its own
+HRESULT CTestBufferPool::TestThreadPools()
+{
+    HRESULT hr = S_OK;
+    CBufferPool* pPoolOther = NULL;
+    pthread_t thread;
+    
+    ChkIfA(0 != pthread_create(&thread, NULL, ThreadPoolProc, &pPoolOther), E_FAIL);
+    pthread_join(thread, NULL);
+    
+    ChkIfA(pPoolOther == NULL, E_FAIL);
+    ChkIfA(pPoolOther == CBufferPool::GetThreadPool(), E_FAIL);
+    
+Cleanup:
+    return hr;
+}
@@ -27,6 +27,9 @@ HRESULT CTestBuilder::Run()
     HRESULT hr = S_OK;
     Chk(Test1())
     Chk(Test2());
+    Chk(TestWriter(false));
+    Chk(TestWriter(true));
+    Chk(TestWriterCapacity());
 Cleanup:
     return hr;
 }
@@ -139,3 +142,111 @@ Cleanup:
 }
 
 
+
+// CStunMessageWriter writes the same bytes as CStunMessageBuilder for the same calls
+HRESULT CTestBuilder::TestWriter(bool fLegacyMode)
+{
+    HRESULT hr = S_OK;
+    CStunMessageBuilder builder;
+    uint8_t buffer[MAX_STUN_MESSAGE_SIZE];
+    CStunMessageWriter writer(buffer, sizeof(buffer));
+    CRefCountedBuffer spBuffer;
+    CStunMessageReader reader;
+    CStunIntegrityKey key;
+    CStunIntegrityKeySha256 keySha256;
+    StunTransactionId transid = {};
+    sockaddr_in6 addr6 = {};
+    const uint16_t unknown[3] = {0x7001, 0x7002, 0x7003};
+    
+    CSocketAddress addr(0x7f000001, 9999);
+    CSocketAddress addrOrigin(0xAABBCCDD, 8888);
+    
+    addr6.sin6_family = AF_INET6;
+    addr6.sin6_port = htons(7777);
+    addr6.sin6_addr.s6_addr[0] = 0x20;
+    addr6.sin6_addr.s6_addr[15] = 0x01;
+    
+    ChkA(key.InitShortTerm("password"));
+    ChkA(keySha256.InitShortTerm("password"));
+    
+    builder.SetLegacyMode(fLegacyMode);
+    writer.SetLegacyMode(fLegacyMode);
+    
+    ChkA(builder.AddBindingResponseHeader(false));
+    ChkA(builder.AddRandomTransactionId(&transid));
+    ChkA(builder.AddErrorCode(STUN_ERROR_UNAUTHORIZED, "FAILED"));
+    ChkA(builder.AddUnknownAttributes(unknown, 3));
+    ChkA(builder.AddUnknownAttributes(unknown, 2));
+    ChkA(builder.AddStringAttribute(STUN_ATTRIBUTE_REALM, "realm"));
+    ChkA(builder.AddAttribute(STUN_ATTRIBUTE_PADDING, NULL, 0));
+    ChkA(builder.AddMappedAddress(addr));
+    ChkA(builder.AddResponseOriginAddress(addrOrigin));
+    ChkA(builder.AddOtherAddress(CSocketAddress(addr6)));
+    ChkA(builder.AddXorMappedAddress(CSocketAddress(addr6)));
+    ChkA(builder.AddMessageIntegrity(key));
+    ChkA(builder.AddMessageIntegritySha256(keySha256));
+    ChkA(builder.AddFingerprintAttribute());
+    ChkA(builder.GetResult(&spBuffer));
+    
+    ChkA(writer.AddHeader(StunMsgTypeBinding, StunMsgClassFailureResponse));
+    ChkA(writer.AddTransactionId(transid));
+    ChkA(writer.AddErrorCode(STUN_ERROR_UNAUTHORIZED, "FAILED"));
+    ChkA(writer.AddUnknownAttributes(unknown, 3));
+    ChkA(writer.AddUnknownAttributes(unknown, 2));
+    ChkA(writer.AddStringAttribute(STUN_ATTRIBUTE_REALM, "realm"));
+    ChkA(writer.AddAttribute(STUN_ATTRIBUTE_PADDING, NULL, 0));
+    ChkA(writer.AddMappedAddress(addr));
+    ChkA(writer.AddResponseOriginAddress(addrOrigin));
+    ChkA(writer.AddOtherAddress(CSocketAddress(addr6)));
+    ChkA(writer.AddXorMappedAddress(CSocketAddress(addr6)));
+    ChkA(writer.AddMessageIntegrity(key));
+    ChkA(writer.AddMessageIntegritySha256(keySha256));
+    ChkA(writer.AddFingerprintAttribute());
+    
+    ChkIfA(writer.GetData() != buffer, E_FAIL);
+    ChkIfA(writer.GetSize() != spBuffer->GetSize(), E_FAIL);
+    ChkIfA(memcmp(buffer, spBuffer->GetData(), writer.GetSize()) != 0, E_FAIL);
+    
+    if (fLegacyMode == false)
+    {
+        ChkIfA(reader.AddBytes(buffer, writer.GetSize()) != CStunMessageReader::BodyValidated, E_FAIL);
+        ChkIfA(reader.IsFingerprintAttributeValid() == false, E_FAIL);
+        ChkA(reader.ValidateMessageIntegrity(key));
+        ChkA(reader.ValidateMessageIntegritySha256(keySha256));
+    }
+    
+Cleanup:
+    return hr;
+}
+
+// a CStunMessageWriter over a small buffer fails an attribute that doesn't fit without writing any of it
+HRESULT CTestBuilder::TestWriterCapacity()
+{
+    HRESULT hr = S_OK;
+    const size_t c_capacity = STUN_HEADER_SIZE + 12;
+    uint8_t buffer[c_capacity + 4];
+    CStunMessageWriter writer;
+    StunTransactionId transid = {};
+    CSocketAddress addr(0x7f000001, 9999);
+    
+    memset(buffer, 0xee, sizeof(buffer));
+    
+    // nothing attached
+    ChkIfA(SUCCEEDED(writer.AddHeader(StunMsgTypeBinding, StunMsgClassRequest)), E_FAIL);
+    
+    writer.Attach(buffer, c_capacity);
+    ChkA(writer.AddHeader(StunMsgTypeBinding, StunMsgClassRequest));
+    ChkA(writer.AddTransactionId(transid));
+    ChkA(writer.AddMappedAddress(addr));
+    ChkIfA(SUCCEEDED(writer.AddStringAttribute(STUN_ATTRIBUTE_SOFTWARE, "x")), E_FAIL);
+    ChkIfA(SUCCEEDED(writer.AddFingerprintAttribute()), E_FAIL);
+    
+    ChkIfA(writer.GetSize() != c_capacity, E_FAIL);
+    for (size_t index = c_capacity; index < sizeof(buffer); index++)
+    {
+        ChkIfA(buffer[index] != 0xee, E_FAIL);
+    }
+    
+Cleanup:
+    return hr;
+}
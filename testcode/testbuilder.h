@@ -26,6 +26,8 @@ class CTestBuilder : public IUnitTest
 public:
     HRESULT Test1();
     HRESULT Test2();
+    HRESULT TestWriter(bool fLegacyMode);
+    HRESULT TestWriterCapacity();
 
     virtual HRESULT Run();
 
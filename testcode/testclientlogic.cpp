@@ -171,6 +171,7 @@ HRESULT CTestClientLogic::CommonInit(NatBehavior behavior, NatFiltering filterin
     _tsa.set[RoleAP].addr = _addrServerAP;
     _tsa.set[RoleAA].fValid = true;
     _tsa.set[RoleAA].addr = _addrServerAA;
+    ChkA(CStunRequestHandler::PrecomputeAttributes(&_tsa));
     
     
     _addrLocal = CSocketAddress(0x33333333, 7000);
@@ -337,7 +338,7 @@ HRESULT CTestClientLogic::TestBehaviorAndFiltering(bool fBehaviorTest, NatBehavi
         stunmsgOut.spBufferOut = spMsgResponse;
         spMsgResponse->SetSize(0);
         
-        ChkA(::CStunRequestHandler::ProcessRequest(stunmsgIn, stunmsgOut, &_tsa, NULL));
+        ChkA(::CStunRequestHandler::ProcessRequest(stunmsgIn, stunmsgOut, &_tsa, NULL, NULL));
         
         // simulate the message coming back
         
@@ -34,6 +34,24 @@
 #include "testpolling.h"
 #include "testatomichelpers.h"
 #include "testratelimiter.h"
+#include "testtimerwheel.h"
+#include "testringbuffer.h"
+#include "testbufferpool.h"
+#include "testpacketqueue.h"
+#include "testresponsecache.h"
+#include "testcredentialstore.h"
+#include "testasyncauth.h"
+#include "testnoncegenerator.h"
+#include "testiceresponder.h"
+#include "testtlssession.h"
+#include "testcrc32.h"
+#include "benchtls.h"
+#include "benchpolling.h"
+#include "benchcrc32.h"
+#include "benchintegrity.h"
+#include "benchreader.h"
+#include "benchnonce.h"
+#include "benchiceresponder.h"
 
 void ReaderFuzzTest()
 {
@@ -86,6 +104,17 @@ void RunUnitTests()
     boost::shared_ptr<CTestPolling> spTestPolling(new CTestPolling);
     boost::shared_ptr<CTestAtomicHelpers> spTestAtomicHelpers(new CTestAtomicHelpers);
     boost::shared_ptr<CTestRateLimiter> spTestRateLimiter(new CTestRateLimiter);
+    boost::shared_ptr<CTestTimerWheel> spTestTimerWheel(new CTestTimerWheel);
+    boost::shared_ptr<CTestRingBuffer> spTestRingBuffer(new CTestRingBuffer);
+    boost::shared_ptr<CTestTlsSession> spTestTlsSession(new CTestTlsSession);
+    boost::shared_ptr<CTestCrc32> spTestCrc32(new CTestCrc32);
+    boost::shared_ptr<CTestBufferPool> spTestBufferPool(new CTestBufferPool);
+    boost::shared_ptr<CTestPacketQueue> spTestPacketQueue(new CTestPacketQueue);
+    boost::shared_ptr<CTestResponseCache> spTestResponseCache(new CTestResponseCache);
+    boost::shared_ptr<CTestCredentialStore> spTestCredentialStore(new CTestCredentialStore);
+    boost::shared_ptr<CTestAsyncAuth> spTestAsyncAuth(new CTestAsyncAuth);
+    boost::shared_ptr<CTestNonceGenerator> spTestNonceGenerator(new CTestNonceGenerator);
+    boost::shared_ptr<CTestIceResponder> spTestIceResponder(new CTestIceResponder);
 
     vecTests.push_back(spTestDataStream.get());
     vecTests.push_back(spTestReader.get());
@@ -100,6 +129,17 @@ void RunUnitTests()
     vecTests.push_back(spTestPolling.get());
     vecTests.push_back(spTestAtomicHelpers.get());
     vecTests.push_back(spTestRateLimiter.get());
+    vecTests.push_back(spTestTimerWheel.get());
+    vecTests.push_back(spTestRingBuffer.get());
+    vecTests.push_back(spTestTlsSession.get());
+    vecTests.push_back(spTestCrc32.get());
+    vecTests.push_back(spTestBufferPool.get());
+    vecTests.push_back(spTestPacketQueue.get());
+    vecTests.push_back(spTestResponseCache.get());
+    vecTests.push_back(spTestCredentialStore.get());
+    vecTests.push_back(spTestAsyncAuth.get());
+    vecTests.push_back(spTestNonceGenerator.get());
+    vecTests.push_back(spTestIceResponder.get());
 
 
     for (size_t index = 0; index < vecTests.size(); index++)
@@ -110,6 +150,37 @@ void RunUnitTests()
 }
 
 
+void RunBenchmarks()
+{
+    std::vector<IBenchmark*> vecBenchmarks;
+    
+    boost::shared_ptr<CBenchTls> spBenchTls(new CBenchTls);
+    boost::shared_ptr<CBenchPolling> spBenchPolling(new CBenchPolling);
+    boost::shared_ptr<CBenchCrc32> spBenchCrc32(new CBenchCrc32);
+    boost::shared_ptr<CBenchIntegrity> spBenchIntegrity(new CBenchIntegrity);
+    boost::shared_ptr<CBenchReader> spBenchReader(new CBenchReader);
+    boost::shared_ptr<CBenchNonce> spBenchNonce(new CBenchNonce);
+    boost::shared_ptr<CBenchIceResponder> spBenchIceResponder(new CBenchIceResponder);
+    
+    vecBenchmarks.push_back(spBenchTls.get());
+    vecBenchmarks.push_back(spBenchPolling.get());
+    vecBenchmarks.push_back(spBenchCrc32.get());
+    vecBenchmarks.push_back(spBenchIntegrity.get());
+    vecBenchmarks.push_back(spBenchReader.get());
+    vecBenchmarks.push_back(spBenchNonce.get());
+    vecBenchmarks.push_back(spBenchIceResponder.get());
+    
+    for (size_t index = 0; index < vecBenchmarks.size(); index++)
+    {
+        HRESULT hr = vecBenchmarks[index]->Run();
+        if (FAILED(hr))
+        {
+            printf("Benchmark %s failed (hr == %x)\n", vecBenchmarks[index]->GetName(), hr);
+        }
+    }
+}
+
+
 void PrettyPrintTest()
 {
     const size_t MAX_TEXT_SIZE = 100000;
@@ -139,11 +210,16 @@ int main(int argc, char** argv)
     CCmdLineParser cmdline;
     std::string strFuzz;
     std::string strPP;
+    std::string strBench;
     bool fParseError = false;
+    
+    // same as the server - a write to a socket the peer has closed should fail, not kill the process
+    signal(SIGPIPE, SIG_IGN);
 
     
     cmdline.AddOption("fuzz", no_argument, &strFuzz);
     cmdline.AddOption("pp", no_argument, &strPP);
+    cmdline.AddOption("bench", no_argument, &strBench);
     
     cmdline.ParseCommandLine(argc, argv, 1, &fParseError);
     
@@ -155,6 +231,10 @@ int main(int argc, char** argv)
     {
         PrettyPrintTest();
     }
+    else if (strBench.size() > 0)
+    {
+        RunBenchmarks();
+    }
     else
     {
         RunUnitTests();
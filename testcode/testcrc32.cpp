@@ -0,0 +1,126 @@
+/*
+   Copyright 2011 John Selbie
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "commonincludes.hpp"
+#include "testcrc32.h"
+#include "crc32.h"
+#include <boost/crc.hpp>
+
+
+static uint32_t BoostCrc32(const void* pData, size_t length)
+{
+    boost::crc_32_type crc;
+    crc.process_bytes(pData, length);
+    return crc.checksum();
+}
+
+HRESULT CTestCrc32::Run()
+{
+    HRESULT hr = S_OK;
+    
+    ChkA(TestKnownValue());
+    ChkA(TestAgainstBoost());
+    ChkA(TestUpdate());
+    
+Cleanup:
+    return hr;
+}
+
+// the standard check value for CRC-32
+HRESULT CTestCrc32::TestKnownValue()
+{
+    HRESULT hr = S_OK;
+    const char* pszCheck = "123456789";
+    const uint32_t c_checkValue = 0xCBF43926;
+    
+    ChkIfA(Crc32(pszCheck, 9) != c_checkValue, E_FAIL);
+    ChkIfA(Crc32Slice8(0, pszCheck, 9) != c_checkValue, E_FAIL);
+    ChkIfA(Crc32(NULL, 0) != 0, E_FAIL);
+    
+Cleanup:
+    return hr;
+}
+
+HRESULT CTestCrc32::TestAgainstBoost()
+{
+    HRESULT hr = S_OK;
+    const size_t c_maxLength = 1100;
+    const size_t c_maxOffset = 16;
+    std::vector<uint8_t> data(c_maxLength + c_maxOffset);
+    bool fClmul = Crc32HasClmul();
+    
+    srand(100);
+    for (size_t index = 0; index < data.size(); index++)
+    {
+        data[index] = (uint8_t)rand();
+    }
+    
+    for (size_t offset = 0; offset < c_maxOffset; offset++)
+    {
+        for (size_t length = 0; length <= c_maxLength; length++)
+        {
+            const uint8_t* pData = &data[offset];
+            uint32_t expected = BoostCrc32(pData, length);
+            
+            ChkIfA(Crc32(pData, length) != expected, E_FAIL);
+            ChkIfA(Crc32Slice8(0, pData, length) != expected, E_FAIL);
+            
+            if (fClmul)
+            {
+                ChkIfA(Crc32Clmul(0, pData, length) != expected, E_FAIL);
+            }
+        }
+    }
+    
+Cleanup:
+    return hr;
+}
+
+// a checksum computed in pieces matches the one computed all at once
+HRESULT CTestCrc32::TestUpdate()
+{
+    HRESULT hr = S_OK;
+    const size_t c_length = 5000;
+    std::vector<uint8_t> data(c_length);
+    uint32_t expected;
+    bool fClmul = Crc32HasClmul();
+    
+    srand(200);
+    for (size_t index = 0; index < data.size(); index++)
+    {
+        data[index] = (uint8_t)rand();
+    }
+    
+    expected = BoostCrc32(&data[0], c_length);
+    
+    for (size_t split = 0; split <= c_length; split += 37)
+    {
+        uint32_t crc = Crc32(&data[0], split);
+        ChkIfA(Crc32Update(crc, &data[split], c_length - split) != expected, E_FAIL);
+        
+        crc = Crc32Slice8(0, &data[0], split);
+        ChkIfA(Crc32Slice8(crc, &data[split], c_length - split) != expected, E_FAIL);
+        
+        if (fClmul)
+        {
+            crc = Crc32Clmul(0, &data[0], split);
+            ChkIfA(Crc32Clmul(crc, &data[split], c_length - split) != expected, E_FAIL);
+        }
+    }
+    
+Cleanup:
+    return hr;
+}
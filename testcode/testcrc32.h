@@ -0,0 +1,37 @@
+/*
+   Copyright 2011 John Selbie
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef TEST_CRC32_H
+#define TEST_CRC32_H
+
+#include "unittest.h"
+
+
+// every CRC-32 implementation against boost::crc_32_type, over all the lengths
+// and alignments that exercise the head, block, and tail paths
+class CTestCrc32 : public IUnitTest
+{
+private:
+    HRESULT TestKnownValue();
+    HRESULT TestAgainstBoost();
+    HRESULT TestUpdate();
+    
+public:
+    virtual HRESULT Run();
+    UT_DECLARE_TEST_NAME("CTestCrc32");
+};
+
+#endif
@@ -0,0 +1,452 @@
+/*
+   Copyright 2011 John Selbie
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "commonincludes.hpp"
+#include "stuncore.h"
+#include "testcredentialstore.h"
+
+
+static const size_t c_userCount = 500;
+
+struct ReaderArgs
+{
+    CStunCredentialAuth* pAuth;
+    bool fStop;
+    bool fFailed;
+};
+
+static void InitAuthAttributes(AuthAttributes* pAttribs, const char* pszUser)
+{
+    memset(pAttribs, 0, sizeof(*pAttribs));
+    strcpy(pAttribs->szUser, pszUser);
+    pAttribs->fMessageIntegrityPresent = true;
+}
+
+// checks a short term user over and over while the main thread reloads the file under it
+static void* ReaderThread(void* pvArgs)
+{
+    ReaderArgs* pArgs = (ReaderArgs*)pvArgs;
+    uint32_t generationLast = 0;
+
+    while (__atomic_load_n(&pArgs->fStop, __ATOMIC_ACQUIRE) == false)
+    {
+        AuthAttributes attribs;
+        AuthResponse response = {};
+        char szUser[20];
+        unsigned int number = (unsigned int)(rand() % c_userCount);
+        char szSuffix[20];
+        size_t suffixLength;
+
+        sprintf(szUser, "user%u", number);
+        sprintf(szSuffix, "-%u", number);
+        suffixLength = strlen(szSuffix);
+        InitAuthAttributes(&attribs, szUser);
+
+        pArgs->pAuth->DoAuthCheck(&attribs, &response);
+
+        // whichever file it was checked against, it's one of the passwords that file gave the user
+        if ((response.responseType != AllowConditional) ||
+            (strlen(response.szPassword) <= suffixLength) ||
+            (strcmp(response.szPassword + strlen(response.szPassword) - suffixLength, szSuffix) != 0) ||
+            (response.credentialGeneration < generationLast))
+        {
+            pArgs->fFailed = true;
+            break;
+        }
+
+        generationLast = response.credentialGeneration;
+    }
+
+    return NULL;
+}
+
+
+HRESULT CTestCredentialStore::Run()
+{
+    HRESULT hr = S_OK;
+    char szPrefix[100];
+
+    sprintf(szPrefix, "/tmp/testcredentialstore.%d", (int)getpid());
+    _strTextFile = std::string(szPrefix) + ".txt";
+    _strCredFile = std::string(szPrefix) + ".db";
+
+    ChkA(TestBuildAndLookup());
+    ChkA(TestBadFiles());
+    ChkA(TestShortTerm());
+    ChkA(TestLongTerm());
+    ChkA(TestReload());
+
+Cleanup:
+    remove(_strTextFile.c_str());
+    remove(_strCredFile.c_str());
+    return hr;
+}
+
+HRESULT CTestCredentialStore::WriteText(const char* pszText)
+{
+    HRESULT hr = S_OK;
+    FILE* file = fopen(_strTextFile.c_str(), "w");
+
+    ChkIfA(file == NULL, E_FAIL);
+    ChkIfA(fputs(pszText, file) < 0, E_FAIL);
+
+Cleanup:
+    if (file)
+    {
+        fclose(file);
+    }
+    return hr;
+}
+
+// "userN:<prefix>-N" for N in [0, count), with a comment and a blank line thrown in
+HRESULT CTestCredentialStore::WriteUsers(const char* pszPasswordPrefix, size_t count)
+{
+    HRESULT hr = S_OK;
+    FILE* file = fopen(_strTextFile.c_str(), "w");
+
+    ChkIfA(file == NULL, E_FAIL);
+
+    fprintf(file, "# users for CTestCredentialStore\n\n");
+    for (size_t index = 0; index < count; index++)
+    {
+        fprintf(file, "user%u:%s-%u\n", (unsigned int)index, pszPasswordPrefix, (unsigned int)index);
+    }
+
+Cleanup:
+    if (file)
+    {
+        fclose(file);
+    }
+    return hr;
+}
+
+HRESULT CTestCredentialStore::TestBuildAndLookup()
+{
+    HRESULT hr = S_OK;
+    CStunCredentialFile file;
+    char szPassword[MAX_STUN_AUTH_STRING_SIZE+1];
+    char szExpected[MAX_STUN_AUTH_STRING_SIZE+1];
+    char szUser[MAX_STUN_AUTH_STRING_SIZE+1];
+
+    ChkA(WriteUsers("pw", c_userCount));
+    ChkA(CStunCredentialFile::Build(_strTextFile.c_str(), NULL, _strCredFile.c_str()));
+    ChkA(file.Open(_strCredFile.c_str()));
+
+    ChkIfA(file.GetCount() != c_userCount, E_FAIL);
+    ChkIfA(file.GetRealm()[0] != '\0', E_FAIL);
+
+    for (size_t index = 0; index < c_userCount; index++)
+    {
+        sprintf(szUser, "user%u", (unsigned int)index);
+        sprintf(szExpected, "pw-%u", (unsigned int)index);
+        ChkA(file.LookupPassword(szUser, szPassword));
+        ChkIfA(strcmp(szPassword, szExpected) != 0, E_FAIL);
+    }
+
+    // names that aren't there, including prefixes and extensions of ones that are
+    ChkIfA(SUCCEEDED(file.LookupPassword("user", szPassword)), E_FAIL);
+    ChkIfA(SUCCEEDED(file.LookupPassword("user1x", szPassword)), E_FAIL);
+    ChkIfA(SUCCEEDED(file.LookupPassword("User1", szPassword)), E_FAIL);
+    ChkIfA(SUCCEEDED(file.LookupPassword("", szPassword)), E_FAIL);
+    sprintf(szUser, "user%u", (unsigned int)c_userCount);
+    ChkIfA(SUCCEEDED(file.LookupPassword(szUser, szPassword)), E_FAIL);
+
+    file.Close();
+    ChkIfA(SUCCEEDED(file.LookupPassword("user1", szPassword)), E_FAIL);
+
+    // with a realm, and the longest names and passwords allowed
+    ChkA(WriteText("aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa:bbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbb\r\n"
+                   "x:y"));
+    ChkA(CStunCredentialFile::Build(_strTextFile.c_str(), "example.org", _strCredFile.c_str()));
+    ChkA(file.Open(_strCredFile.c_str()));
+    ChkIfA(file.GetCount() != 2, E_FAIL);
+    ChkIfA(strcmp(file.GetRealm(), "example.org") != 0, E_FAIL);
+    ChkA(file.LookupPassword("x", szPassword));
+    ChkIfA(strcmp(szPassword, "y") != 0, E_FAIL);
+    ChkA(file.LookupPassword("aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa", szPassword));
+    ChkIfA(strlen(szPassword) != MAX_STUN_AUTH_STRING_SIZE, E_FAIL);
+
+Cleanup:
+    return hr;
+}
+
+// text files that shouldn't build, and credentials files that shouldn't load
+HRESULT CTestCredentialStore::TestBadFiles()
+{
+    HRESULT hr = S_OK;
+    const char* badText[] = {
+        "alice:one\nbob:two\nalice:three\n",    // the same user twice
+        "alice:one\nbob\n",                      // no password
+        "alice:one\n:two\n",                     // no user name
+        "alice:\n",
+        "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa:one\n", // 65 character user name
+    };
+    CStunCredentialFile file;
+    FILE* fileCorrupt = NULL;
+    std::vector<uint8_t> contents;
+    long length = 0;
+
+    remove(_strCredFile.c_str());
+
+    for (size_t index = 0; index < ARRAYSIZE(badText); index++)
+    {
+        ChkA(WriteText(badText[index]));
+        ChkIfA(SUCCEEDED(CStunCredentialFile::Build(_strTextFile.c_str(), NULL, _strCredFile.c_str())), E_FAIL);
+        ChkIfA(SUCCEEDED(file.Open(_strCredFile.c_str())), E_FAIL);
+    }
+
+    ChkIfA(SUCCEEDED(CStunCredentialFile::Build("/nonexistent/users.txt", NULL, _strCredFile.c_str())), E_FAIL);
+    ChkIfA(SUCCEEDED(file.Open(_strTextFile.c_str())), E_FAIL);
+
+    // an empty file is fine
+    ChkA(WriteText("# nobody\n"));
+    ChkA(CStunCredentialFile::Build(_strTextFile.c_str(), NULL, _strCredFile.c_str()));
+    ChkA(file.Open(_strCredFile.c_str()));
+    ChkIfA(file.GetCount() != 0, E_FAIL);
+    file.Close();
+
+    // a flipped bit anywhere past the header padding gets caught, as does a truncated file
+    ChkA(WriteUsers("pw", 20));
+    ChkA(CStunCredentialFile::Build(_strTextFile.c_str(), NULL, _strCredFile.c_str()));
+
+    fileCorrupt = fopen(_strCredFile.c_str(), "rb");
+    ChkIfA(fileCorrupt == NULL, E_FAIL);
+    fseek(fileCorrupt, 0, SEEK_END);
+    length = ftell(fileCorrupt);
+    fseek(fileCorrupt, 0, SEEK_SET);
+    contents.resize(length);
+    ChkIfA(fread(&contents[0], 1, length, fileCorrupt) != (size_t)length, E_FAIL);
+    fclose(fileCorrupt);
+    fileCorrupt = NULL;
+
+    for (size_t offset = 0; offset < contents.size(); offset += 7)
+    {
+        std::vector<uint8_t> corrupt = contents;
+        bool fInRealm = (offset >= offsetof(StunCredentialFileHeader, realm)) && (offset < sizeof(StunCredentialFileHeader));
+        bool fLoaded = false;
+
+        // the realm bytes past realmLength aren't used, and a changed password is still a valid file
+        if (fInRealm)
+        {
+            continue;
+        }
+
+        corrupt[offset] ^= 0x01;
+        fileCorrupt = fopen(_strCredFile.c_str(), "wb");
+        ChkIfA(fileCorrupt == NULL, E_FAIL);
+        ChkIfA(fwrite(&corrupt[0], 1, corrupt.size(), fileCorrupt) != corrupt.size(), E_FAIL);
+        fclose(fileCorrupt);
+        fileCorrupt = NULL;
+
+        fLoaded = SUCCEEDED(file.Open(_strCredFile.c_str()));
+        file.Close();
+
+        if (fLoaded)
+        {
+            // the only bytes that can change without failing validation are in a password
+            ChkIfA(offset < sizeof(StunCredentialFileHeader) + 64 * sizeof(StunCredentialSlot), E_FAIL);
+        }
+    }
+
+    fileCorrupt = fopen(_strCredFile.c_str(), "wb");
+    ChkIfA(fileCorrupt == NULL, E_FAIL);
+    ChkIfA(fwrite(&contents[0], 1, contents.size() - 1, fileCorrupt) != contents.size() - 1, E_FAIL);
+    fclose(fileCorrupt);
+    fileCorrupt = NULL;
+    ChkIfA(SUCCEEDED(file.Open(_strCredFile.c_str())), E_FAIL);
+
+Cleanup:
+    if (fileCorrupt)
+    {
+        fclose(fileCorrupt);
+    }
+    return hr;
+}
+
+HRESULT CTestCredentialStore::TestShortTerm()
+{
+    HRESULT hr = S_OK;
+    CRefCountedPtr<CStunCredentialAuth> spAuth;
+    AuthAttributes attribs;
+    AuthResponse response = {};
+
+    ChkA(WriteUsers("pw", c_userCount));
+    ChkA(CStunCredentialFile::Build(_strTextFile.c_str(), NULL, _strCredFile.c_str()));
+    ChkA(CStunCredentialAuth::CreateInstance(_strCredFile.c_str(), spAuth.GetPointerPointer()));
+    ChkIfA(spAuth->GetCount() != c_userCount, E_FAIL);
+
+    InitAuthAttributes(&attribs, "user7");
+    ChkA(spAuth->DoAuthCheck(&attribs, &response));
+    ChkIfA(response.responseType != AllowConditional, E_FAIL);
+    ChkIfA(response.authCredMech != AuthCredShortTerm, E_FAIL);
+    ChkIfA(strcmp(response.szPassword, "pw-7") != 0, E_FAIL);
+    ChkIfA(response.credentialGeneration == 0, E_FAIL);
+
+    // no integrity is a 400 with short term credentials
+    attribs.fMessageIntegrityPresent = false;
+    ChkA(spAuth->DoAuthCheck(&attribs, &response));
+    ChkIfA(response.responseType != Reject, E_FAIL);
+
+    InitAuthAttributes(&attribs, "mallory");
+    ChkA(spAuth->DoAuthCheck(&attribs, &response));
+    ChkIfA(response.responseType != Unauthorized, E_FAIL);
+
+    // a file that isn't there doesn't make a provider
+    spAuth.ReleaseAndClear();
+    ChkIfA(SUCCEEDED(CStunCredentialAuth::CreateInstance("/nonexistent/users.db", spAuth.GetPointerPointer())), E_FAIL);
+    ChkIfA(spAuth != NULL, E_FAIL);
+
+Cleanup:
+    return hr;
+}
+
+// the 401 challenge hands out a realm and nonce, and the nonce is what gets the client in
+HRESULT CTestCredentialStore::TestLongTerm()
+{
+    HRESULT hr = S_OK;
+    CRefCountedPtr<CStunCredentialAuth> spAuth;
+    AuthAttributes attribs;
+    AuthResponse response = {};
+    char szNonce[MAX_STUN_AUTH_STRING_SIZE+1];
+
+    ChkA(WriteUsers("pw", 10));
+    ChkA(CStunCredentialFile::Build(_strTextFile.c_str(), "example.org", _strCredFile.c_str()));
+    ChkA(CStunCredentialAuth::CreateInstance(_strCredFile.c_str(), spAuth.GetPointerPointer()));
+
+    // the first request has no integrity
+    memset(&attribs, 0, sizeof(attribs));
+    ChkA(spAuth->DoAuthCheck(&attribs, &response));
+    ChkIfA(response.responseType != Unauthorized, E_FAIL);
+    ChkIfA(response.authCredMech != AuthCredLongTerm, E_FAIL);
+    ChkIfA(strcmp(response.szRealm, "example.org") != 0, E_FAIL);
+    ChkIfA(response.szNonce[0] == '\0', E_FAIL);
+    ChkIfA(strlen(response.szNonce) > MAX_STUN_AUTH_STRING_SIZE, E_FAIL);
+    strcpy(szNonce, response.szNonce);
+
+    // the retry
+    InitAuthAttributes(&attribs, "user3");
+    strcpy(attribs.szRealm, "example.org");
+    strcpy(attribs.szNonce, szNonce);
+    memset(&response, 0, sizeof(response));
+    ChkA(spAuth->DoAuthCheck(&attribs, &response));
+    ChkIfA(response.responseType != AllowConditional, E_FAIL);
+    ChkIfA(strcmp(response.szPassword, "pw-3") != 0, E_FAIL);
+    ChkIfA(strcmp(response.szRealm, "example.org") != 0, E_FAIL);
+
+    // a nonce this server didn't hand out
+    attribs.szNonce[strlen(attribs.szNonce) - 1] ^= 0x01;
+    ChkA(spAuth->DoAuthCheck(&attribs, &response));
+    ChkIfA(response.responseType != StaleNonce, E_FAIL);
+    ChkIfA(response.szNonce[0] == '\0', E_FAIL);
+
+    strcpy(attribs.szNonce, "12345");
+    ChkA(spAuth->DoAuthCheck(&attribs, &response));
+    ChkIfA(response.responseType != StaleNonce, E_FAIL);
+
+    // the wrong realm, no nonce, or an unknown user
+    strcpy(attribs.szNonce, szNonce);
+    strcpy(attribs.szRealm, "example.com");
+    ChkA(spAuth->DoAuthCheck(&attribs, &response));
+    ChkIfA(response.responseType != Unauthorized, E_FAIL);
+
+    strcpy(attribs.szRealm, "example.org");
+    attribs.szNonce[0] = '\0';
+    ChkA(spAuth->DoAuthCheck(&attribs, &response));
+    ChkIfA(response.responseType != Unauthorized, E_FAIL);
+
+    InitAuthAttributes(&attribs, "user10");
+    strcpy(attribs.szRealm, "example.org");
+    strcpy(attribs.szNonce, szNonce);
+    ChkA(spAuth->DoAuthCheck(&attribs, &response));
+    ChkIfA(response.responseType != Unauthorized, E_FAIL);
+
+Cleanup:
+    return hr;
+}
+
+// reloading swaps in the new users while other threads are checking requests, and a bad file changes nothing
+HRESULT CTestCredentialStore::TestReload()
+{
+    HRESULT hr = S_OK;
+    CRefCountedPtr<CStunCredentialAuth> spAuth;
+    const size_t c_threadCount = 3;
+    pthread_t threads[c_threadCount];
+    ReaderArgs args = {NULL, false, false};
+    size_t threadsStarted = 0;
+    AuthAttributes attribs;
+    AuthResponse response = {};
+    uint32_t generation = 0;
+    char szPrefix[20];
+
+    ChkA(WriteUsers("first", c_userCount));
+    ChkA(CStunCredentialFile::Build(_strTextFile.c_str(), NULL, _strCredFile.c_str()));
+    ChkA(CStunCredentialAuth::CreateInstance(_strCredFile.c_str(), spAuth.GetPointerPointer()));
+
+    InitAuthAttributes(&attribs, "user1");
+    ChkA(spAuth->DoAuthCheck(&attribs, &response));
+    generation = response.credentialGeneration;
+
+    args.pAuth = spAuth.GetPointer();
+    for (size_t index = 0; index < c_threadCount; index++)
+    {
+        ChkIfA(0 != pthread_create(&threads[index], NULL, ReaderThread, &args), E_FAIL);
+        threadsStarted++;
+    }
+
+    for (int pass = 0; pass < 20; pass++)
+    {
+        sprintf(szPrefix, "pass%d", pass);
+        ChkA(WriteUsers(szPrefix, c_userCount));
+        ChkA(CStunCredentialFile::Build(_strTextFile.c_str(), NULL, _strCredFile.c_str()));
+        ChkA(spAuth->Reload());
+
+        ChkA(spAuth->DoAuthCheck(&attribs, &response));
+        ChkIfA(response.responseType != AllowConditional, E_FAIL);
+        ChkIfA(strncmp(response.szPassword, szPrefix, strlen(szPrefix)) != 0, E_FAIL);
+        ChkIfA(response.credentialGeneration == generation, E_FAIL);
+        generation = response.credentialGeneration;
+    }
+
+    __atomic_store_n(&args.fStop, true, __ATOMIC_RELEASE);
+    while (threadsStarted > 0)
+    {
+        pthread_join(threads[--threadsStarted], NULL);
+    }
+    ChkIfA(args.fFailed, E_FAIL);
+
+    // a file that won't load keeps the users already there
+    ChkA(WriteText("broken"));
+    ChkIfA(SUCCEEDED(CStunCredentialFile::Build(_strTextFile.c_str(), NULL, _strCredFile.c_str())), E_FAIL);
+    remove(_strCredFile.c_str());
+    ChkIfA(SUCCEEDED(spAuth->Reload()), E_FAIL);
+
+    ChkA(spAuth->DoAuthCheck(&attribs, &response));
+    ChkIfA(response.responseType != AllowConditional, E_FAIL);
+    ChkIfA(strcmp(response.szPassword, "pass19-1") != 0, E_FAIL);
+    ChkIfA(response.credentialGeneration != generation, E_FAIL);
+    ChkIfA(spAuth->GetCount() != c_userCount, E_FAIL);
+
+Cleanup:
+    if (threadsStarted > 0)
+    {
+        __atomic_store_n(&args.fStop, true, __ATOMIC_RELEASE);
+        while (threadsStarted > 0)
+        {
+            pthread_join(threads[--threadsStarted], NULL);
+        }
+    }
+    return hr;
+}
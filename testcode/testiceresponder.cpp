@@ -0,0 +1,406 @@
+/*
+   Copyright 2011 John Selbie
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "commonincludes.hpp"
+#include "stuncore.h"
+#include "testiceresponder.h"
+
+
+static const uint16_t c_attributePriority = 0x0024;        // RFC 8445
+static const uint16_t c_attributeIceControlling = 0x802A;  // RFC 8445
+
+
+CMockAuthIce::CMockAuthIce() :
+generation(0),
+calls(0)
+{
+    strcpy(szPassword, "password");
+    szLastUser[0] = '\0';
+}
+
+uint32_t CMockAuthIce::GetCredentialGeneration()
+{
+    return generation;
+}
+
+HRESULT CMockAuthIce::DoAuthCheck(AuthAttributes* pAuthAttributes, AuthResponse* pResponse)
+{
+    calls++;
+    strcpy(szLastUser, pAuthAttributes->szUser);
+    
+    pResponse->authCredMech = AuthCredShortTerm;
+    pResponse->credentialGeneration = generation;
+    
+    if (0 == strncmp(pAuthAttributes->szUser, "ufrag", 5))
+    {
+        strcpy(pResponse->szPassword, szPassword);
+        pResponse->responseType = AllowConditional;
+    }
+    else
+    {
+        pResponse->responseType = Reject;
+    }
+    
+    return S_OK;
+}
+
+
+HRESULT CTestIceResponder::Run()
+{
+    HRESULT hr = S_OK;
+    
+    ChkA(TestSigning());
+    ChkA(TestValidation());
+    ChkA(TestCache());
+    ChkA(TestRekey());
+    ChkA(TestFallback());
+    
+Cleanup:
+    return hr;
+}
+
+// builds a connectivity check (with the attributes an ICE agent sends) into _reader/_msgIn, and a fresh response buffer into _msgOut
+HRESULT CTestIceResponder::InitCheck(const char* pszUser, const char* pszPassword, bool fFingerprint)
+{
+    HRESULT hr = S_OK;
+    CStunMessageBuilder builder;
+    uint32_t priority = htonl(0x6e0001ff);
+    uint8_t tiebreaker[8] = {1, 2, 3, 4, 5, 6, 7, 8};
+    
+    ChkA(builder.AddBindingRequestHeader());
+    ChkA(builder.AddRandomTransactionId(NULL));
+    ChkA(builder.AddUserName(pszUser));
+    ChkA(builder.AddAttribute(c_attributePriority, &priority, sizeof(priority)));
+    ChkA(builder.AddAttribute(c_attributeIceControlling, tiebreaker, sizeof(tiebreaker)));
+    ChkA(builder.AddMessageIntegrityShortTerm(pszPassword));
+    if (fFingerprint)
+    {
+        ChkA(builder.AddFingerprintAttribute());
+    }
+    ChkA(builder.GetResult(&_spRequest));
+    
+    _reader.Reset();
+    ChkIfA(CStunMessageReader::BodyValidated != _reader.AddBytes(_spRequest->GetData(), _spRequest->GetSize()), E_FAIL);
+    
+    _msgIn.socketrole = RolePP;
+    _msgIn.addrRemote = CSocketAddress(0x0a000001, 5000);
+    _msgIn.addrLocal = CSocketAddress(0x0a000002, 3478);
+    _msgIn.pReader = &_reader;
+    _msgIn.fConnectionOriented = false;
+    
+    _spResponse = CRefCountedBuffer(new CBuffer(MAX_STUN_MESSAGE_SIZE));
+    _msgOut.socketrole = RoleAA;
+    _msgOut.spBufferOut = _spResponse;
+    
+Cleanup:
+    return hr;
+}
+
+// the response in _msgOut is a success response to the request in _reader, signed with pszPassword, with a good fingerprint
+HRESULT CTestIceResponder::ValidateResponse(const char* pszPassword)
+{
+    HRESULT hr = S_OK;
+    CStunMessageReader reader;
+    CSocketAddress addrMapped;
+    StunTransactionId transidRequest;
+    StunTransactionId transidResponse;
+    
+    ChkIfA(_msgOut.socketrole != RolePP, E_FAIL);
+    ChkIfA(_msgOut.addrDest.IsSameIP_and_Port(_msgIn.addrRemote) == false, E_FAIL);
+    
+    ChkIfA(CStunMessageReader::BodyValidated != reader.AddBytes(_spResponse->GetData(), _spResponse->GetSize()), E_FAIL);
+    ChkIfA(reader.GetMessageClass() != StunMsgClassSuccessResponse, E_FAIL);
+    ChkIfA(reader.GetMessageType() != StunMsgTypeBinding, E_FAIL);
+    
+    _reader.GetTransactionId(&transidRequest);
+    reader.GetTransactionId(&transidResponse);
+    ChkIfA(memcmp(&transidRequest, &transidResponse, sizeof(transidRequest)) != 0, E_FAIL);
+    
+    ChkA(reader.GetXorMappedAddress(&addrMapped));
+    ChkIfA(addrMapped.IsSameIP_and_Port(_msgIn.addrRemote) == false, E_FAIL);
+    
+    ChkA(reader.ValidateMessageIntegrityShort(pszPassword));
+    ChkIfA(reader.IsFingerprintAttributeValid() == false, E_FAIL);
+    
+Cleanup:
+    return hr;
+}
+
+// AddMessageIntegrityAndFingerprint writes the same bytes as AddMessageIntegrity and AddFingerprintAttribute,
+// for messages that end anywhere in a SHA-1 block
+HRESULT CTestIceResponder::TestSigning()
+{
+    HRESULT hr = S_OK;
+    CStunIntegrityKey key;
+    StunTransactionId transid = {};
+    CSocketAddress addr(0x0a000001, 5000);
+    char szSoftware[200] = {};
+    uint8_t bufferTwoStep[MAX_STUN_MESSAGE_SIZE];
+    uint8_t bufferOnePass[MAX_STUN_MESSAGE_SIZE];
+    
+    ChkA(key.InitShortTerm("password"));
+    
+    for (size_t length = 0; length < 150; length++)
+    {
+        CStunMessageWriter writerTwoStep(bufferTwoStep, sizeof(bufferTwoStep));
+        CStunMessageWriter writerOnePass(bufferOnePass, sizeof(bufferOnePass));
+        CStunMessageWriter* writers[2] = {&writerTwoStep, &writerOnePass};
+        
+        transid.id[length % sizeof(transid.id)]++;
+        memset(szSoftware, 'a' + (length % 26), length);
+        szSoftware[length] = '\0';
+        
+        for (size_t index = 0; index < ARRAYSIZE(writers); index++)
+        {
+            ChkA(writers[index]->AddHeader(StunMsgTypeBinding, StunMsgClassSuccessResponse));
+            ChkA(writers[index]->AddTransactionId(transid));
+            ChkA(writers[index]->AddXorMappedAddress(addr));
+            if (length > 0)
+            {
+                ChkA(writers[index]->AddStringAttribute(STUN_ATTRIBUTE_SOFTWARE, szSoftware));
+            }
+        }
+        
+        ChkA(writerTwoStep.AddMessageIntegrity(key));
+        ChkA(writerTwoStep.AddFingerprintAttribute());
+        ChkA(writerOnePass.AddMessageIntegrityAndFingerprint(key));
+        
+        ChkIfA(writerTwoStep.GetSize() != writerOnePass.GetSize(), E_FAIL);
+        ChkIfA(memcmp(bufferTwoStep, bufferOnePass, writerOnePass.GetSize()) != 0, E_FAIL);
+    }
+    
+Cleanup:
+    return hr;
+}
+
+// ValidateMessageIntegrityAndFingerprint agrees with ValidateMessageIntegrity and IsFingerprintAttributeValid
+HRESULT CTestIceResponder::TestValidation()
+{
+    HRESULT hr = S_OK;
+    CStunIntegrityKey key;
+    CStunIntegrityKey keyWrong;
+    bool fIntegrityValid = false;
+    bool fFingerprintValid = false;
+    uint8_t* pData = NULL;
+    size_t size = 0;
+    
+    ChkA(key.InitShortTerm("password"));
+    ChkA(keyWrong.InitShortTerm("wrongpassword"));
+    
+    ChkA(InitCheck("ufrag1:remote1", "password", true));
+    pData = _reader.GetStream().GetDataPointerUnsafe();
+    size = _reader.GetStream().GetSize();
+    
+    ChkA(_reader.ValidateMessageIntegrityAndFingerprint(key, &fIntegrityValid, &fFingerprintValid));
+    ChkIfA((fIntegrityValid == false) || (fFingerprintValid == false), E_FAIL);
+    ChkA(_reader.ValidateMessageIntegrity(key));
+    ChkIfA(_reader.IsFingerprintAttributeValid() == false, E_FAIL);
+    
+    // the length field is back the way it was
+    ChkA(_reader.ValidateMessageIntegrityAndFingerprint(key, &fIntegrityValid, &fFingerprintValid));
+    ChkIfA((fIntegrityValid == false) || (fFingerprintValid == false), E_FAIL);
+    
+    ChkA(_reader.ValidateMessageIntegrityAndFingerprint(keyWrong, &fIntegrityValid, &fFingerprintValid));
+    ChkIfA(fIntegrityValid || (fFingerprintValid == false), E_FAIL);
+    
+    // a damaged fingerprint
+    pData[size - 1] ^= 0x01;
+    ChkA(_reader.ValidateMessageIntegrityAndFingerprint(key, &fIntegrityValid, &fFingerprintValid));
+    ChkIfA((fIntegrityValid == false) || fFingerprintValid, E_FAIL);
+    ChkIfA(_reader.IsFingerprintAttributeValid(), E_FAIL);
+    pData[size - 1] ^= 0x01;
+    
+    // a damaged HMAC - the fingerprint covers it too
+    pData[size - 9] ^= 0x01;
+    ChkA(_reader.ValidateMessageIntegrityAndFingerprint(key, &fIntegrityValid, &fFingerprintValid));
+    ChkIfA(fIntegrityValid || fFingerprintValid, E_FAIL);
+    pData[size - 9] ^= 0x01;
+    
+    // a damaged body
+    pData[STUN_HEADER_SIZE + 5] ^= 0x01;
+    ChkA(_reader.ValidateMessageIntegrityAndFingerprint(key, &fIntegrityValid, &fFingerprintValid));
+    ChkIfA(fIntegrityValid || fFingerprintValid, E_FAIL);
+    pData[STUN_HEADER_SIZE + 5] ^= 0x01;
+    
+    // without a fingerprint there's nothing to check in one pass
+    ChkA(InitCheck("ufrag1:remote1", "password", false));
+    ChkIfA(SUCCEEDED(_reader.ValidateMessageIntegrityAndFingerprint(key, &fIntegrityValid, &fFingerprintValid)), E_FAIL);
+    
+Cleanup:
+    return hr;
+}
+
+// the auth provider is asked once per local ufrag, whatever the remote ufrag is
+HRESULT CTestIceResponder::TestCache()
+{
+    HRESULT hr = S_OK;
+    CStunIceResponder responder;
+    const char* users[] = {"ufrag1:remote1", "ufrag1:remote2", "ufrag2:remote1", "ufrag1:remote1", "ufrag2:remote3"};
+    const uint32_t now = 1000;
+    
+    ChkA(CMockAuthIce::CreateInstanceNoInit(_spAuth.GetPointerPointer()));
+    
+    // not initialized - everything goes to the request handler
+    ChkIfA(responder.IsEnabled(), E_FAIL);
+    ChkA(InitCheck("ufrag1:remote1", "password", true));
+    ChkIfA(responder.ProcessRequest(_msgIn, _msgOut, _spAuth, now) != S_FALSE, E_FAIL);
+    ChkIfA(_spAuth->calls != 0, E_FAIL);
+    
+    ChkA(responder.Init(16, 5000));
+    ChkIfA(responder.IsEnabled() == false, E_FAIL);
+    
+    for (size_t index = 0; index < ARRAYSIZE(users); index++)
+    {
+        ChkA(InitCheck(users[index], "password", true));
+        ChkIfA(responder.ProcessRequest(_msgIn, _msgOut, _spAuth, now + (uint32_t)index) != S_OK, E_FAIL);
+        ChkA(ValidateResponse("password"));
+    }
+    
+    ChkIfA(_spAuth->calls != 2, E_FAIL);
+    ChkIfA(strcmp(_spAuth->szLastUser, "ufrag2") != 0, E_FAIL); // asked about the ufrag, not the whole user name
+    ChkIfA(responder.GetMissCount() != 2, E_FAIL);
+    ChkIfA(responder.GetHitCount() != 3, E_FAIL);
+    
+    // a request the provider doesn't let in with a password
+    ChkA(InitCheck("stranger:remote1", "password", true));
+    ChkIfA(responder.ProcessRequest(_msgIn, _msgOut, _spAuth, now) != S_FALSE, E_FAIL);
+    
+Cleanup:
+    return hr;
+}
+
+// a cached key is given up on when it expires, when it doesn't match a check, and when the credentials change
+HRESULT CTestIceResponder::TestRekey()
+{
+    HRESULT hr = S_OK;
+    CStunIceResponder responder;
+    const uint32_t ttl = 1000;
+    const uint32_t now = 0xffffff00; // the millisecond counter wraps in the middle of this test
+    
+    ChkA(CMockAuthIce::CreateInstanceNoInit(_spAuth.GetPointerPointer()));
+    ChkA(responder.Init(16, ttl));
+    
+    ChkA(InitCheck("ufrag1:remote1", "password", true));
+    ChkIfA(responder.ProcessRequest(_msgIn, _msgOut, _spAuth, now) != S_OK, E_FAIL);
+    ChkIfA(responder.ProcessRequest(_msgIn, _msgOut, _spAuth, now + ttl - 1) != S_OK, E_FAIL);
+    ChkIfA(_spAuth->calls != 1, E_FAIL);
+    
+    // expired
+    ChkIfA(responder.ProcessRequest(_msgIn, _msgOut, _spAuth, now + ttl) != S_OK, E_FAIL);
+    ChkIfA(_spAuth->calls != 2, E_FAIL);
+    
+    // a new password - the cached key fails the check, so the provider is asked again
+    strcpy(_spAuth->szPassword, "newpassword");
+    ChkA(InitCheck("ufrag1:remote1", "newpassword", true));
+    ChkIfA(responder.ProcessRequest(_msgIn, _msgOut, _spAuth, now + ttl) != S_OK, E_FAIL);
+    ChkA(ValidateResponse("newpassword"));
+    ChkIfA(_spAuth->calls != 3, E_FAIL);
+    
+    // the old password doesn't get in anymore
+    ChkA(InitCheck("ufrag1:remote1", "password", true));
+    ChkIfA(responder.ProcessRequest(_msgIn, _msgOut, _spAuth, now + ttl) != S_FALSE, E_FAIL);
+    ChkIfA(_spAuth->calls != 4, E_FAIL);
+    
+    // a new credential generation, seen on a miss, drops every other ufrag's key too
+    ChkA(InitCheck("ufrag1:remote1", "newpassword", true));
+    ChkIfA(responder.ProcessRequest(_msgIn, _msgOut, _spAuth, now + ttl) != S_OK, E_FAIL);
+    ChkIfA(_spAuth->calls != 5, E_FAIL);
+    
+    _spAuth->generation++;
+    ChkA(InitCheck("ufrag2:remote1", "newpassword", true));
+    ChkIfA(responder.ProcessRequest(_msgIn, _msgOut, _spAuth, now + ttl) != S_OK, E_FAIL);
+    ChkIfA(_spAuth->calls != 6, E_FAIL);
+    
+    ChkA(InitCheck("ufrag1:remote1", "newpassword", true));
+    ChkIfA(responder.ProcessRequest(_msgIn, _msgOut, _spAuth, now + ttl) != S_OK, E_FAIL);
+    ChkIfA(_spAuth->calls != 7, E_FAIL);
+    
+    // a reload is noticed on a hit too.  The ufrag's old password still matches the key cached for it,
+    // but the provider is asked again and doesn't let it in anymore
+    ChkA(InitCheck("ufrag1:remote1", "newpassword", true));
+    ChkIfA(responder.ProcessRequest(_msgIn, _msgOut, _spAuth, now + ttl) != S_OK, E_FAIL);
+    ChkIfA(_spAuth->calls != 7, E_FAIL);
+    
+    strcpy(_spAuth->szPassword, "rekeyed");
+    _spAuth->generation++;
+    ChkA(InitCheck("ufrag1:remote1", "newpassword", true));
+    ChkIfA(responder.ProcessRequest(_msgIn, _msgOut, _spAuth, now + ttl) != S_FALSE, E_FAIL);
+    ChkIfA(_spAuth->calls != 8, E_FAIL);
+    
+Cleanup:
+    return hr;
+}
+
+// anything but a well formed connectivity check is left for the request handler - except a bad fingerprint, which gets dropped
+HRESULT CTestIceResponder::TestFallback()
+{
+    HRESULT hr = S_OK;
+    CStunIceResponder responder;
+    CStunMessageBuilder builder;
+    StunChangeRequestAttribute changerequest = {};
+    const uint32_t now = 1000;
+    uint8_t* pData = NULL;
+    size_t size = 0;
+    
+    ChkA(CMockAuthIce::CreateInstanceNoInit(_spAuth.GetPointerPointer()));
+    ChkA(responder.Init(16, 5000));
+    
+    // no auth provider
+    ChkA(InitCheck("ufrag1:remote1", "password", true));
+    ChkIfA(responder.ProcessRequest(_msgIn, _msgOut, NULL, now) != S_FALSE, E_FAIL);
+    
+    // no fingerprint
+    ChkA(InitCheck("ufrag1:remote1", "password", false));
+    ChkIfA(responder.ProcessRequest(_msgIn, _msgOut, _spAuth, now) != S_FALSE, E_FAIL);
+    
+    // the wrong password, before and after the ufrag is cached
+    ChkA(InitCheck("ufrag1:remote1", "wrongpassword", true));
+    ChkIfA(responder.ProcessRequest(_msgIn, _msgOut, _spAuth, now) != S_FALSE, E_FAIL);
+    ChkA(InitCheck("ufrag1:remote1", "password", true));
+    ChkIfA(responder.ProcessRequest(_msgIn, _msgOut, _spAuth, now) != S_OK, E_FAIL);
+    ChkA(InitCheck("ufrag1:remote1", "wrongpassword", true));
+    ChkIfA(responder.ProcessRequest(_msgIn, _msgOut, _spAuth, now) != S_FALSE, E_FAIL);
+    
+    // a bad fingerprint, before and after the ufrag is cached
+    for (int pass = 0; pass < 2; pass++)
+    {
+        ChkA(InitCheck((pass == 0) ? "ufrag3:remote1" : "ufrag1:remote1", "password", true));
+        pData = _reader.GetStream().GetDataPointerUnsafe();
+        size = _reader.GetStream().GetSize();
+        pData[size - 1] ^= 0x01;
+        ChkIfA(SUCCEEDED(responder.ProcessRequest(_msgIn, _msgOut, _spAuth, now)), E_FAIL);
+    }
+    
+    // a change request
+    changerequest.fChangeIP = true;
+    ChkA(builder.AddBindingRequestHeader());
+    ChkA(builder.AddRandomTransactionId(NULL));
+    ChkA(builder.AddUserName("ufrag1:remote1"));
+    ChkA(builder.AddChangeRequest(changerequest));
+    ChkA(builder.AddMessageIntegrityShortTerm("password"));
+    ChkA(builder.AddFingerprintAttribute());
+    ChkA(builder.GetResult(&_spRequest));
+    _reader.Reset();
+    ChkIfA(CStunMessageReader::BodyValidated != _reader.AddBytes(_spRequest->GetData(), _spRequest->GetSize()), E_FAIL);
+    ChkIfA(responder.ProcessRequest(_msgIn, _msgOut, _spAuth, now) != S_FALSE, E_FAIL);
+    
+    // a user name without a ufrag
+    ChkA(InitCheck(":remote1", "password", true));
+    ChkIfA(responder.ProcessRequest(_msgIn, _msgOut, _spAuth, now) != S_FALSE, E_FAIL);
+    
+Cleanup:
+    return hr;
+}
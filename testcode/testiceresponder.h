@@ -0,0 +1,68 @@
+/*
+   Copyright 2011 John Selbie
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef TEST_ICE_RESPONDER_H
+#define TEST_ICE_RESPONDER_H
+
+#include "unittest.h"
+
+
+// short term auth provider for the ICE responder tests: every user name starting with "ufrag" is let in with
+// the current password.  Counts how often it gets asked
+class CMockAuthIce :
+     public CBasicRefCount,
+     public CObjectFactory<CMockAuthIce>,
+     public IStunAuth
+{
+public:
+    char szPassword[MAX_STUN_AUTH_STRING_SIZE+1];
+    uint32_t generation;
+    int calls;
+    char szLastUser[MAX_STUN_AUTH_STRING_SIZE+1];   // what the last DoAuthCheck was asked about
+    
+    CMockAuthIce();
+    
+    virtual HRESULT DoAuthCheck(AuthAttributes* pAuthAttributes, AuthResponse* pResponse);
+    virtual uint32_t GetCredentialGeneration();
+    ADDREF_AND_RELEASE_IMPL();
+};
+
+
+class CTestIceResponder : public IUnitTest
+{
+private:
+    CRefCountedPtr<CMockAuthIce> _spAuth;
+    CStunMessageReader _reader;
+    CRefCountedBuffer _spRequest;
+    CRefCountedBuffer _spResponse;
+    StunMessageIn _msgIn;
+    StunMessageOut _msgOut;
+    
+    HRESULT InitCheck(const char* pszUser, const char* pszPassword, bool fFingerprint);
+    HRESULT ValidateResponse(const char* pszPassword);
+    
+    HRESULT TestSigning();
+    HRESULT TestValidation();
+    HRESULT TestCache();
+    HRESULT TestRekey();
+    HRESULT TestFallback();
+    
+public:
+    virtual HRESULT Run();
+    UT_DECLARE_TEST_NAME("CTestIceResponder");
+};
+
+#endif
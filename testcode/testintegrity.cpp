@@ -17,6 +17,7 @@
 #include "commonincludes.hpp"
 #include "stuncore.h"
 #include "testintegrity.h"
+#include <openssl/hmac.h>
 
 
 // This test validates that the construction and parsing of the message integrity attribute in a stun message works as expected
@@ -76,6 +77,143 @@ HRESULT CTestIntegrity::TestMessageIntegrity(bool fWithFingerprint, bool fLongCr
         ChkA(reader.ValidateMessageIntegrityLong(pszUserName, pszRealm, pszPassword));
     }
     
+    // the wrong password fails
+    if (fLongCredentials == false)
+    {
+        ChkIfA(SUCCEEDED(reader.ValidateMessageIntegrityShort("WrongPassword")), E_FAIL);
+    }
+    else
+    {
+        ChkIfA(SUCCEEDED(reader.ValidateMessageIntegrityLong(pszUserName, pszRealm, "WrongPassword")), E_FAIL);
+    }
+    
+    // validating patches the length field while it hashes - it has to be put back
+    if (fWithFingerprint)
+    {
+        ChkIfA(reader.IsFingerprintAttributeValid() == false, E_FAIL);
+    }
+    
+Cleanup:
+    return hr;
+}
+
+
+// MESSAGE-INTEGRITY-SHA256 alone or following MESSAGE-INTEGRITY, short term or long term
+// (with SHA-256 as the password algorithm), with or without a fingerprint
+HRESULT CTestIntegrity::TestMessageIntegritySha256(bool fWithFingerprint, bool fLongCredentials, bool fWithSha1)
+{
+    HRESULT hr = S_OK;
+    
+    const char* pszUserName = "username";
+    const char* pszRealm = "stunrealm";
+    const char* pszPassword = "ThePassword";
+    
+    CStunMessageBuilder builder;
+    CStunMessageReader reader;
+    CStunIntegrityKey key;
+    CStunIntegrityKeySha256 keySha256;
+    CStunIntegrityKeySha256 keyWrong;
+    CRefCountedBuffer spBuffer;
+    uint16_t passwordAlgorithm = 0;
+    
+    if (fLongCredentials)
+    {
+        ChkA(key.InitLongTerm(pszUserName, pszRealm, pszPassword, STUN_PASSWORD_ALGORITHM_SHA256));
+        ChkA(keySha256.InitLongTerm(pszUserName, pszRealm, pszPassword, STUN_PASSWORD_ALGORITHM_SHA256));
+        ChkA(keyWrong.InitLongTerm(pszUserName, pszRealm, pszPassword, STUN_PASSWORD_ALGORITHM_MD5));
+    }
+    else
+    {
+        ChkA(key.InitShortTerm(pszPassword));
+        ChkA(keySha256.InitShortTerm(pszPassword));
+        ChkA(keyWrong.InitShortTerm("WrongPassword"));
+    }
+    
+    builder.AddBindingRequestHeader();
+    builder.AddRandomTransactionId(NULL);
+    builder.AddUserName(pszUserName);
+    builder.AddRealm(pszRealm);
+    if (fLongCredentials)
+    {
+        ChkA(builder.AddPasswordAlgorithm(STUN_PASSWORD_ALGORITHM_SHA256));
+    }
+    if (fWithSha1)
+    {
+        ChkA(builder.AddMessageIntegrity(key));
+    }
+    ChkA(builder.AddMessageIntegritySha256(keySha256));
+    if (fWithFingerprint)
+    {
+        ChkA(builder.AddFingerprintAttribute());
+    }
+    ChkA(builder.GetResult(&spBuffer));
+    
+    ChkIfA(reader.AddBytes(spBuffer->GetData(), spBuffer->GetSize()) != CStunMessageReader::BodyValidated, E_FAIL);
+    
+    ChkIfA(reader.HasMessageIntegritySha256Attribute() == false, E_FAIL);
+    ChkIfA(reader.HasMessageIntegrityAttribute() != fWithSha1, E_FAIL);
+    
+    ChkA(reader.ValidateMessageIntegritySha256(keySha256));
+    ChkIfA(SUCCEEDED(reader.ValidateMessageIntegritySha256(keyWrong)), E_FAIL);
+    
+    // MESSAGE-INTEGRITY is still good with MESSAGE-INTEGRITY-SHA256 after it
+    if (fWithSha1)
+    {
+        ChkA(reader.ValidateMessageIntegrity(key));
+    }
+    
+    if (fLongCredentials)
+    {
+        ChkA(reader.GetPasswordAlgorithm(&passwordAlgorithm));
+        ChkIfA(passwordAlgorithm != STUN_PASSWORD_ALGORITHM_SHA256, E_FAIL);
+    }
+    else
+    {
+        ChkIfA(SUCCEEDED(reader.GetPasswordAlgorithm(&passwordAlgorithm)), E_FAIL);
+    }
+    
+    if (fWithFingerprint)
+    {
+        ChkIfA(reader.IsFingerprintAttributeValid() == false, E_FAIL);
+    }
+    
+Cleanup:
+    return hr;
+}
+
+// a MESSAGE-INTEGRITY-SHA256 truncated to 16 bytes is still valid - but not one truncated any further
+HRESULT CTestIntegrity::TestTruncatedSha256()
+{
+    HRESULT hr = S_OK;
+    CStunIntegrityKeySha256 key;
+    uint8_t hmac[CStunIntegrityKeySha256::c_hmacsize];
+    
+    ChkA(key.InitShortTerm("password"));
+    
+    for (size_t size = 12; size <= CStunIntegrityKeySha256::c_hmacsize; size += 4)
+    {
+        CStunMessageBuilder builder;
+        CStunMessageReader reader;
+        CRefCountedBuffer spBuffer;
+        uint8_t* pData = NULL;
+        size_t length = 0;
+        
+        builder.AddBindingRequestHeader();
+        builder.AddRandomTransactionId(NULL);
+        builder.AddUserName("username");
+        ChkA(builder.AddAttribute(STUN_ATTRIBUTE_MESSAGEINTEGRITY_SHA256, hmac, (uint16_t)size));
+        ChkA(builder.FixLengthField());
+        ChkA(builder.GetResult(&spBuffer));
+        
+        pData = spBuffer->GetData();
+        length = spBuffer->GetSize() - size - 4;
+        key.Compute(pData, length, hmac);
+        memcpy(pData + length + 4, hmac, size);
+        
+        ChkIfA(reader.AddBytes(pData, spBuffer->GetSize()) != CStunMessageReader::BodyValidated, E_FAIL);
+        ChkIfA(SUCCEEDED(reader.ValidateMessageIntegritySha256(key)) != (size >= CStunIntegrityKeySha256::c_minhmacsize), E_FAIL);
+    }
+    
 Cleanup:
     return hr;
 }
@@ -144,6 +282,276 @@ Cleanup:
 
 
 
+// CStunIntegrityKey and CStunIntegrityKeySha256 against OpenSSL's HMAC, for keys shorter
+// than, equal to, and longer than the block size
+HRESULT CTestIntegrity::TestIntegrityKey()
+{
+    HRESULT hr = S_OK;
+    const size_t c_keylengths[] = {0, 1, 16, 20, 63, 64, 65, 200};
+    uint8_t keydata[200];
+    uint8_t data[300];
+    uint8_t expected[CStunIntegrityKey::c_hmacsize];
+    uint8_t result[CStunIntegrityKey::c_hmacsize];
+    uint8_t expectedSha256[CStunIntegrityKeySha256::c_hmacsize];
+    uint8_t resultSha256[CStunIntegrityKeySha256::c_hmacsize];
+    unsigned int expectedlength = 0;
+    
+    for (size_t index = 0; index < sizeof(keydata); index++)
+    {
+        keydata[index] = (uint8_t)(index * 7 + 1);
+    }
+    for (size_t index = 0; index < sizeof(data); index++)
+    {
+        data[index] = (uint8_t)(index * 13);
+    }
+    
+    for (size_t k = 0; k < ARRAYSIZE(c_keylengths); k++)
+    {
+        CStunIntegrityKey key;
+        ChkA(key.Init(keydata, c_keylengths[k]));
+        
+        for (size_t length = 0; length <= sizeof(data); length += 3)
+        {
+            ChkIfA(NULL == HMAC(EVP_sha1(), keydata, (int)c_keylengths[k], data, length, expected, &expectedlength), E_FAIL);
+            ChkIfA(expectedlength != sizeof(expected), E_FAIL);
+            
+            key.Compute(data, length, result);
+            ChkIfA(memcmp(expected, result, sizeof(result)) != 0, E_FAIL);
+        }
+    }
+    
+    for (size_t k = 0; k < ARRAYSIZE(c_keylengths); k++)
+    {
+        CStunIntegrityKeySha256 key;
+        ChkA(key.Init(keydata, c_keylengths[k]));
+        
+        for (size_t length = 0; length <= sizeof(data); length += 3)
+        {
+            ChkIfA(NULL == HMAC(EVP_sha256(), keydata, (int)c_keylengths[k], data, length, expectedSha256, &expectedlength), E_FAIL);
+            ChkIfA(expectedlength != sizeof(expectedSha256), E_FAIL);
+            
+            key.Compute(data, length, resultSha256);
+            ChkIfA(memcmp(expectedSha256, resultSha256, sizeof(resultSha256)) != 0, E_FAIL);
+        }
+    }
+    
+    // an empty short term password is an empty key, not an error
+    {
+        CStunIntegrityKey key;
+        
+        ChkA(key.InitShortTerm(""));
+        ChkIfA(NULL == HMAC(EVP_sha1(), keydata, 0, data, sizeof(data), expected, &expectedlength), E_FAIL);
+        key.Compute(data, sizeof(data), result);
+        ChkIfA(memcmp(expected, result, sizeof(result)) != 0, E_FAIL);
+    }
+    
+    // the SHA-256 password algorithm hashes "username:realm:password" with SHA-256 instead of MD5
+    {
+        const char c_credentials[] = "user:realm:password";
+        uint8_t longtermkey[CStunIntegrityKey::c_maxlongtermkeysize];
+        size_t longtermkeylength = 0;
+        
+        ChkA(CStunIntegrityKey::ComputeLongTermKey("user", "realm", "password", STUN_PASSWORD_ALGORITHM_SHA256, longtermkey, &longtermkeylength));
+        ChkIfA(longtermkeylength != SHA256_DIGEST_LENGTH, E_FAIL);
+        SHA256((const uint8_t*)c_credentials, sizeof(c_credentials)-1, expectedSha256);
+        ChkIfA(memcmp(expectedSha256, longtermkey, SHA256_DIGEST_LENGTH) != 0, E_FAIL);
+        
+        ChkIfA(SUCCEEDED(CStunIntegrityKey::ComputeLongTermKey("user", "realm", "password", 3, longtermkey, &longtermkeylength)), E_FAIL);
+    }
+    
+Cleanup:
+    return hr;
+}
+
+
+static bool IsSameKey(const CStunIntegrityKey& key1, const CStunIntegrityKey& key2)
+{
+    const uint8_t data[] = "The quick brown fox jumps over the lazy dog";
+    uint8_t result1[CStunIntegrityKey::c_hmacsize];
+    uint8_t result2[CStunIntegrityKey::c_hmacsize];
+    
+    key1.Compute(data, sizeof(data), result1);
+    key2.Compute(data, sizeof(data), result2);
+    return (memcmp(result1, result2, sizeof(result1)) == 0);
+}
+
+// cached long term keys: a hit returns the same key that deriving it would, and a changed
+// password, a slot collision, or a new credential generation all derive the key again
+HRESULT CTestIntegrity::TestKeyCache()
+{
+    HRESULT hr = S_OK;
+    CStunKeyCache cache;
+    CStunIntegrityKey key;
+    CStunIntegrityKey expected;
+    char szUser[MAX_STUN_AUTH_STRING_SIZE+1];
+    
+    ChkA(cache.Init(4));
+    
+    ChkA(expected.InitLongTerm("user", "realm", "password"));
+    
+    ChkA(cache.GetLongTermKey("user", "realm", "password", &key));
+    ChkIfA(cache.GetMissCount() != 1, E_FAIL);
+    ChkIfA(IsSameKey(key, expected) == false, E_FAIL);
+    
+    key.Reset();
+    ChkA(cache.GetLongTermKey("user", "realm", "password", &key));
+    ChkIfA(cache.GetHitCount() != 1, E_FAIL);
+    ChkIfA(IsSameKey(key, expected) == false, E_FAIL);
+    
+    // same user and realm, new password
+    ChkA(expected.InitLongTerm("user", "realm", "newpassword"));
+    ChkA(cache.GetLongTermKey("user", "realm", "newpassword", &key));
+    ChkIfA(cache.GetMissCount() != 2, E_FAIL);
+    ChkIfA(IsSameKey(key, expected) == false, E_FAIL);
+    
+    // a new generation throws everything out
+    cache.SetGeneration(1);
+    ChkA(cache.GetLongTermKey("user", "realm", "newpassword", &key));
+    ChkIfA(cache.GetMissCount() != 3, E_FAIL);
+    ChkIfA(IsSameKey(key, expected) == false, E_FAIL);
+    
+    // the same generation again doesn't
+    cache.SetGeneration(1);
+    ChkA(cache.GetLongTermKey("user", "realm", "newpassword", &key));
+    ChkIfA(cache.GetHitCount() != 2, E_FAIL);
+    
+    // the SHA-256 HMAC key for the same credentials is derived once, then cached alongside
+    {
+        CStunIntegrityKeySha256 keySha256;
+        CStunIntegrityKeySha256 expectedSha256;
+        uint8_t result1[CStunIntegrityKeySha256::c_hmacsize];
+        uint8_t result2[CStunIntegrityKeySha256::c_hmacsize];
+        uint64_t misses = cache.GetMissCount();
+        
+        ChkA(expectedSha256.InitLongTerm("user", "realm", "newpassword", STUN_PASSWORD_ALGORITHM_SHA256));
+        for (int pass = 0; pass < 2; pass++)
+        {
+            ChkA(cache.GetLongTermKeySha256("user", "realm", "newpassword", &keySha256, STUN_PASSWORD_ALGORITHM_SHA256));
+            keySha256.Compute((const uint8_t*)"data", 4, result1);
+            expectedSha256.Compute((const uint8_t*)"data", 4, result2);
+            ChkIfA(memcmp(result1, result2, sizeof(result1)) != 0, E_FAIL);
+        }
+        ChkIfA(cache.GetMissCount() != misses + 1, E_FAIL);
+        
+        // a different password algorithm is a different key
+        ChkA(expected.InitLongTerm("user", "realm", "newpassword", STUN_PASSWORD_ALGORITHM_SHA256));
+        ChkA(cache.GetLongTermKey("user", "realm", "newpassword", &key, STUN_PASSWORD_ALGORITHM_SHA256));
+        ChkIfA(IsSameKey(key, expected) == false, E_FAIL);
+        ChkIfA(cache.GetMissCount() != misses + 2, E_FAIL);
+    }
+    
+    // more users than slots - keys that get pushed out are derived again, and always correct
+    for (int pass = 0; pass < 2; pass++)
+    {
+        for (int index = 0; index < 20; index++)
+        {
+            sprintf(szUser, "user%d", index);
+            ChkA(expected.InitLongTerm(szUser, "realm", "password"));
+            ChkA(cache.GetLongTermKey(szUser, "realm", "password", &key));
+            ChkIfA(IsSameKey(key, expected) == false, E_FAIL);
+        }
+    }
+    
+Cleanup:
+    return hr;
+}
+
+
+// a batch of messages of different lengths (one to several SHA-1 blocks), with and without a
+// fingerprint, under short and long term keys - some with the wrong key.  Every message gets the
+// same verdict ValidateMessageIntegrity gives it, and the messages are left intact
+HRESULT CTestIntegrity::TestIntegrityBatch(bool fUseSimd)
+{
+    HRESULT hr = S_OK;
+    const size_t c_size = CStunIntegrityBatch::c_maxsize;
+    CStunMessageReader readers[c_size];
+    CStunIntegrityKey keys[c_size];
+    CRefCountedBuffer spBuffers[c_size];
+    bool expected[c_size];
+    uint8_t software[300];
+    char szUser[MAX_STUN_AUTH_STRING_SIZE+1];
+    
+    memset(software, 'x', sizeof(software));
+    
+    for (size_t index = 0; index < c_size; index++)
+    {
+        CStunMessageBuilder builder;
+        bool fLongTerm = ((index % 3) == 1);
+        bool fWithFingerprint = ((index % 2) == 0);
+        
+        sprintf(szUser, "user%d", (int)(index * 1000));
+        
+        ChkA(builder.AddBindingRequestHeader());
+        ChkA(builder.AddRandomTransactionId(NULL));
+        ChkA(builder.AddUserName(szUser));
+        ChkA(builder.AddAttribute(STUN_ATTRIBUTE_SOFTWARE, software, (uint16_t)(index * 37)));
+        if (fLongTerm)
+        {
+            ChkA(builder.AddRealm("realm"));
+            ChkA(builder.AddMessageIntegrityLongTerm(szUser, "realm", "password"));
+        }
+        else
+        {
+            ChkA(builder.AddMessageIntegrityShortTerm("password"));
+        }
+        if (fWithFingerprint)
+        {
+            ChkA(builder.AddFingerprintAttribute());
+        }
+        ChkA(builder.GetResult(&spBuffers[index]));
+        
+        ChkIfA(readers[index].AddBytes(spBuffers[index]->GetData(), spBuffers[index]->GetSize()) != CStunMessageReader::BodyValidated, E_FAIL);
+        
+        // every third message is checked with the wrong password
+        expected[index] = ((index % 3) != 2);
+        if (fLongTerm)
+        {
+            ChkA(keys[index].InitLongTerm(szUser, "realm", expected[index] ? "password" : "wrong"));
+        }
+        else
+        {
+            ChkA(keys[index].InitShortTerm(expected[index] ? "password" : "wrong"));
+        }
+        
+        ChkIfA(SUCCEEDED(readers[index].ValidateMessageIntegrity(keys[index])) != expected[index], E_FAIL);
+    }
+    
+    // every batch size, so some lanes sit idle
+    for (size_t count = 1; count <= c_size; count++)
+    {
+        CStunIntegrityBatch batch;
+        size_t batchIndex = 0;
+        
+        batch.SetUseSimd(fUseSimd);
+        
+        for (size_t index = 0; index < count; index++)
+        {
+            StunIntegrityInput input;
+            ChkA(readers[index].GetMessageIntegrityInput(&input));
+            ChkA(batch.Add(keys[index], input, &batchIndex));
+            ChkIfA(batchIndex != index, E_FAIL);
+        }
+        
+        ChkIfA(batch.IsFull() != (count == c_size), E_FAIL);
+        
+        batch.Verify();
+        
+        for (size_t index = 0; index < count; index++)
+        {
+            ChkIfA(batch.IsValid(index) != expected[index], E_FAIL);
+            
+            if (readers[index].HasFingerprintAttribute())
+            {
+                ChkIfA(readers[index].IsFingerprintAttributeValid() == false, E_FAIL);
+            }
+        }
+    }
+    
+Cleanup:
+    return hr;
+}
+
+
 HRESULT CTestIntegrity::Run()
 {
     HRESULT hr = S_OK;
@@ -156,6 +564,20 @@ HRESULT CTestIntegrity::Run()
     
     ChkA(Test2());
     
+    for (int variant = 0; variant < 8; variant++)
+    {
+        ChkA(TestMessageIntegritySha256((variant & 1) != 0, (variant & 2) != 0, (variant & 4) != 0));
+    }
+    ChkA(TestTruncatedSha256());
+    
+    ChkA(TestIntegrityKey());
+    ChkA(TestKeyCache());
+    
+    ChkA(TestIntegrityBatch(false));
+    if (CStunIntegrityBatch::HasSimd())
+    {
+        ChkA(TestIntegrityBatch(true));
+    }
     
 Cleanup:
     return hr;
@@ -25,7 +25,13 @@ class CTestIntegrity : public IUnitTest
 private:
     HRESULT TestMessageIntegrity(bool fWithFingerprint, bool fLongCredentials);        
     
+    HRESULT TestMessageIntegritySha256(bool fWithFingerprint, bool fLongCredentials, bool fWithSha1);
+    HRESULT TestTruncatedSha256();
+    
     HRESULT Test2();
+    HRESULT TestIntegrityKey();
+    HRESULT TestKeyCache();
+    HRESULT TestIntegrityBatch(bool fUseSimd);
 
 public:
     
@@ -20,6 +20,7 @@
 #include "unittest.h"
 
 #include "stunauth.h"
+#include "atomichelpers.h"
 #include "testmessagehandler.h"
 
 
@@ -35,6 +36,40 @@ static const char* c_szIPMapped = "3.3.3.3";
 static const uint16_t c_portMapped = 3333;
 
 
+// Test8 counts the allocations made while it runs requests through a CStunRequestContext.
+// Replacing the global operator new is the only way to see all of them, so this applies to the whole test binary,
+// but nothing gets counted unless s_fCountAllocations is set
+static bool s_fCountAllocations = false;
+static int s_countAllocations = 0;
+
+void* operator new(size_t size)
+{
+    void* ptr = NULL;
+    
+    if (s_fCountAllocations)
+    {
+        AtomicIncrement(&s_countAllocations);
+    }
+    
+    ptr = malloc(size ? size : 1);
+    if (ptr == NULL)
+    {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+void operator delete(void* ptr) throw()
+{
+    free(ptr);
+}
+
+void operator delete(void* ptr, size_t size) throw()
+{
+    free(ptr);
+}
+
+
 
 HRESULT CMockAuthShort::DoAuthCheck(AuthAttributes* pAuthAttributes, AuthResponse *pResponse)
 {
@@ -130,7 +165,7 @@ HRESULT CTestMessageHandler::SendHelper(CStunMessageBuilder& builderRequest, CSt
     
     msgOut.spBufferOut = spBufferResponse;
     
-    ChkA(CStunRequestHandler::ProcessRequest(msgIn, msgOut, &tas, pAuth));
+    ChkA(CStunRequestHandler::ProcessRequest(msgIn, msgOut, &tas, pAuth, NULL));
     
     ChkIf(CStunMessageReader::BodyValidated != pReaderResponse->AddBytes(spBufferResponse->GetData(), spBufferResponse->GetSize()), E_FAIL);
     
@@ -235,6 +270,8 @@ void CTestMessageHandler::InitTransportAddressSet(TransportAddressSet& tas, bool
     tas.set[RoleAA].fValid = fRoleAA;
     tas.set[RoleAA].addr = fRoleAA ? _addrServerAA : addrZero;
     
+    // left for the tests that want it to call CStunRequestHandler::PrecomputeAttributes
+    tas.attributes.fValid = false;
 }
 
 
@@ -271,7 +308,7 @@ HRESULT CTestMessageHandler::Test1()
     msgOut.spBufferOut = spBufferOut;
     msgOut.socketrole = RoleAA; // deliberately wrong - so we can validate if it got changed to RolePP
     
-    ChkA(CStunRequestHandler::ProcessRequest(msgIn, msgOut, &tas, NULL));
+    ChkA(CStunRequestHandler::ProcessRequest(msgIn, msgOut, &tas, NULL, NULL));
     
     reader.Reset();
     ChkIfA(CStunMessageReader::BodyValidated != reader.AddBytes(spBufferOut->GetData(), spBufferOut->GetSize()), E_FAIL);
@@ -339,7 +376,7 @@ HRESULT CTestMessageHandler::Test2()
     msgOut.socketrole = RolePP; // deliberate initialized wrong
     msgOut.spBufferOut = spBufferOut;
     
-    ChkA(CStunRequestHandler::ProcessRequest(msgIn, msgOut, &tas, NULL));
+    ChkA(CStunRequestHandler::ProcessRequest(msgIn, msgOut, &tas, NULL, NULL));
     
     // parse the response
     reader.Reset();
@@ -478,6 +515,432 @@ Cleanup:
 }
 
 
+// a batch of long-credential requests - each one gets the same response it would get on its own,
+// no matter what the others in the batch look like
+HRESULT CTestMessageHandler::Test5()
+{
+    HRESULT hr = S_OK;
+    const size_t c_count = 5;
+    const char* c_passwords[c_count] = {"password", "wrong", NULL, "password", "password"};
+    CStunMessageReader readers[c_count];
+    CStunMessageReader readerResponse;
+    StunMessageIn msgIn[c_count];
+    StunMessageOut msgOut[c_count];
+    HRESULT results[c_count];
+    TransportAddressSet tas;
+    uint16_t errorcode = 0;
+    char szRealm[MAX_STUN_AUTH_STRING_SIZE+1];
+    
+    InitTransportAddressSet(tas, true, true, true, true);
+    
+    for (size_t index = 0; index < c_count; index++)
+    {
+        CStunMessageBuilder builder;
+        CRefCountedBuffer spBufferRequest;
+        
+        if (index == 4)
+        {
+            // not a request at all - no response
+            builder.AddHeader(StunMsgTypeBinding, StunMsgClassSuccessResponse);
+            builder.AddRandomTransactionId(NULL);
+        }
+        else
+        {
+            InitBindingRequest(builder);
+        }
+        builder.AddNonce("NewNonce");
+        builder.AddRealm("MyRealm");
+        builder.AddUserName("AuthorizedUser");
+        if (c_passwords[index])
+        {
+            builder.AddMessageIntegrityLongTerm("AuthorizedUser", "MyRealm", c_passwords[index]);
+        }
+        builder.AddFingerprintAttribute();
+        builder.GetResult(&spBufferRequest);
+        
+        ChkIfA(CStunMessageReader::BodyValidated != readers[index].AddBytes(spBufferRequest->GetData(), spBufferRequest->GetSize()), E_FAIL);
+        
+        msgIn[index].fConnectionOriented = false;
+        msgIn[index].addrLocal = _addrServerPP;
+        msgIn[index].pReader = &readers[index];
+        msgIn[index].socketrole = RolePP;
+        msgIn[index].addrRemote = _addrMapped;
+        
+        msgOut[index].spBufferOut = CRefCountedBuffer(new CBuffer(MAX_STUN_MESSAGE_SIZE));
+    }
+    
+    CStunRequestHandler::ProcessRequestBatch(msgIn, msgOut, results, c_count, &tas, _spAuthLong, NULL);
+    
+    for (size_t index = 0; index < c_count; index++)
+    {
+        if (index == 4)
+        {
+            ChkIfA(SUCCEEDED(results[index]), E_FAIL);
+            continue;
+        }
+        
+        ChkA(results[index]);
+        
+        readerResponse.Reset();
+        ChkIfA(CStunMessageReader::BodyValidated != readerResponse.AddBytes(msgOut[index].spBufferOut->GetData(), msgOut[index].spBufferOut->GetSize()), E_FAIL);
+        
+        if ((index == 0) || (index == 3))
+        {
+            ChkIfA(readerResponse.GetMessageClass() != ::StunMsgClassSuccessResponse, E_UNEXPECTED);
+            ChkA(readerResponse.ValidateMessageIntegrityLong("AuthorizedUser", "MyRealm", "password"));
+        }
+        else
+        {
+            ChkIfA(readerResponse.GetMessageClass() != ::StunMsgClassFailureResponse, E_UNEXPECTED);
+            ChkA(readerResponse.GetErrorCode(&errorcode));
+            ChkIfA(errorcode != ::STUN_ERROR_UNAUTHORIZED, E_UNEXPECTED);
+            
+            // a bad HMAC found by the batch still sends back the realm for the retry
+            ChkA(readerResponse.GetStringAttributeByType(STUN_ATTRIBUTE_REALM, szRealm, ARRAYSIZE(szRealm)));
+            ChkIfA(strcmp(szRealm, "MyRealm") != 0, E_UNEXPECTED);
+        }
+    }
+    
+Cleanup:
+    return hr;
+}
+
+
+// long-credential requests signed with MESSAGE-INTEGRITY-SHA256 get responses signed the same way
+HRESULT CTestMessageHandler::Test6()
+{
+    HRESULT hr = S_OK;
+    CStunIntegrityKeySha256 key;
+    CStunIntegrityKeySha256 keyMD5;
+    uint16_t errorcode = 0;
+    
+    ChkA(key.InitLongTerm("AuthorizedUser", "MyRealm", "password", STUN_PASSWORD_ALGORITHM_SHA256));
+    ChkA(keyMD5.InitLongTerm("AuthorizedUser", "MyRealm", "password", STUN_PASSWORD_ALGORITHM_MD5));
+    
+    // SHA-256 password algorithm, and the MD5 default (no PASSWORD-ALGORITHM attribute)
+    for (int pass = 0; pass < 2; pass++)
+    {
+        CStunMessageBuilder builder;
+        CStunMessageReader readerResponse;
+        CSocketAddress addrMapped;
+        
+        InitBindingRequest(builder);
+        builder.AddNonce("NewNonce");
+        builder.AddRealm("MyRealm");
+        builder.AddUserName("AuthorizedUser");
+        if (pass == 0)
+        {
+            builder.AddPasswordAlgorithm(STUN_PASSWORD_ALGORITHM_SHA256);
+        }
+        builder.AddMessageIntegritySha256((pass == 0) ? key : keyMD5);
+        builder.FixLengthField();
+        
+        ChkA(SendHelper(builder, &readerResponse, _spAuthLong));
+        
+        ChkIfA(readerResponse.GetMessageClass() != ::StunMsgClassSuccessResponse, E_UNEXPECTED);
+        ChkA(readerResponse.GetMappedAddress(&addrMapped));
+        
+        ChkIfA(readerResponse.HasMessageIntegrityAttribute(), E_UNEXPECTED);
+        ChkA(readerResponse.ValidateMessageIntegritySha256((pass == 0) ? key : keyMD5));
+    }
+    
+    // a bad HMAC is rejected
+    {
+        CStunMessageBuilder builder;
+        CStunMessageReader readerResponse;
+        
+        InitBindingRequest(builder);
+        builder.AddNonce("NewNonce");
+        builder.AddRealm("MyRealm");
+        builder.AddUserName("AuthorizedUser");
+        builder.AddPasswordAlgorithm(STUN_PASSWORD_ALGORITHM_MD5);
+        builder.AddMessageIntegritySha256(key);
+        builder.FixLengthField();
+        
+        ChkA(SendHelper(builder, &readerResponse, _spAuthLong));
+        
+        ChkIfA(readerResponse.GetMessageClass() != ::StunMsgClassFailureResponse, E_UNEXPECTED);
+        ChkA(readerResponse.GetErrorCode(&errorcode));
+        ChkIfA(errorcode != ::STUN_ERROR_UNAUTHORIZED, E_UNEXPECTED);
+    }
+    
+    // an unknown password algorithm is a bad request
+    {
+        CStunMessageBuilder builder;
+        CStunMessageReader readerResponse;
+        
+        InitBindingRequest(builder);
+        builder.AddNonce("NewNonce");
+        builder.AddRealm("MyRealm");
+        builder.AddUserName("AuthorizedUser");
+        builder.AddPasswordAlgorithm(0x0099);
+        builder.AddMessageIntegritySha256(key);
+        builder.FixLengthField();
+        
+        ChkA(SendHelper(builder, &readerResponse, _spAuthLong));
+        
+        ChkIfA(readerResponse.GetMessageClass() != ::StunMsgClassFailureResponse, E_UNEXPECTED);
+        ChkA(readerResponse.GetErrorCode(&errorcode));
+        ChkIfA(errorcode != ::STUN_ERROR_BADREQUEST, E_UNEXPECTED);
+    }
+    
+Cleanup:
+    return hr;
+}
+
+// Test7 - responses built with the precomputed RESPONSE-ORIGIN and OTHER-ADDRESS attributes are byte for byte the
+// same as the ones worked out per request. Every receive role, change request, and legacy mode is covered
+HRESULT CTestMessageHandler::Test7()
+{
+    HRESULT hr = S_OK;
+    CSocketAddress addrZero;
+    CSocketAddress arrAddrLocal[4] = {_addrServerPP, _addrServerPA, _addrServerAP, _addrServerAA};
+    
+    // all four sockets, then all four with the alternate IP unknown (bound to INADDR_ANY), then a single socket
+    for (int config = 0; config < 3; config++)
+    {
+        TransportAddressSet tas = {};
+        TransportAddressSet tasPrecomputed = {};
+        
+        InitTransportAddressSet(tas, true, (config != 2), (config != 2), (config != 2));
+        if (config == 1)
+        {
+            tas.set[RoleAP].addr = addrZero;
+            tas.set[RoleAA].addr = addrZero;
+        }
+        
+        tasPrecomputed = tas;
+        ChkA(CStunRequestHandler::PrecomputeAttributes(&tasPrecomputed));
+        ChkIfA(tasPrecomputed.attributes.fValid == false, E_FAIL);
+        
+        for (int legacy = 0; legacy < 2; legacy++)
+        {
+            for (int role = 0; role < 4; role++)
+            {
+                for (int change = 0; change < 4; change++)
+                {
+                    CStunMessageBuilder builder;
+                    StunTransactionId transid = {};
+                    StunChangeRequestAttribute changerequest = {};
+                    CRefCountedBuffer spBufferRequest;
+                    CRefCountedBuffer spBufferOut(new CBuffer(MAX_STUN_MESSAGE_SIZE));
+                    CRefCountedBuffer spBufferOutPrecomputed(new CBuffer(MAX_STUN_MESSAGE_SIZE));
+                    CStunMessageReader reader;
+                    CStunMessageReader readerResponse;
+                    StunMessageIn msgIn;
+                    StunMessageOut msgOut;
+                    StunMessageOut msgOutPrecomputed;
+                    HRESULT hrResult;
+                    HRESULT hrResultPrecomputed;
+                    CSocketAddress addrOther;
+                    
+                    if (tas.set[role].fValid == false)
+                    {
+                        continue;
+                    }
+                    
+                    builder.AddHeader(StunMsgTypeBinding, StunMsgClassRequest);
+                    if (legacy)
+                    {
+                        // no magic cookie
+                        for (size_t index = 0; index < ARRAYSIZE(transid.id); index++)
+                        {
+                            transid.id[index] = (uint8_t)(index + 1);
+                        }
+                        builder.AddTransactionId(transid);
+                    }
+                    else
+                    {
+                        builder.AddRandomTransactionId(&transid);
+                    }
+                    
+                    changerequest.fChangeIP = !!(change & 0x01);
+                    changerequest.fChangePort = !!(change & 0x02);
+                    if (change)
+                    {
+                        builder.AddChangeRequest(changerequest);
+                    }
+                    builder.FixLengthField();
+                    ChkA(builder.GetResult(&spBufferRequest));
+                    
+                    ChkIfA(CStunMessageReader::BodyValidated != reader.AddBytes(spBufferRequest->GetData(), spBufferRequest->GetSize()), E_FAIL);
+                    ChkIfA(reader.IsMessageLegacyFormat() != (legacy != 0), E_FAIL);
+                    
+                    msgIn.socketrole = (SocketRole)role;
+                    msgIn.addrRemote = _addrMapped;
+                    msgIn.pReader = &reader;
+                    msgIn.addrLocal = arrAddrLocal[role];
+                    msgIn.fConnectionOriented = false;
+                    
+                    msgOut.spBufferOut = spBufferOut;
+                    msgOutPrecomputed.spBufferOut = spBufferOutPrecomputed;
+                    
+                    hrResult = CStunRequestHandler::ProcessRequest(msgIn, msgOut, &tas, NULL, NULL);
+                    hrResultPrecomputed = CStunRequestHandler::ProcessRequest(msgIn, msgOutPrecomputed, &tasPrecomputed, NULL, NULL);
+                    
+                    ChkIfA(hrResult != hrResultPrecomputed, E_FAIL);
+                    ChkIfA(msgOut.socketrole != msgOutPrecomputed.socketrole, E_FAIL);
+                    ChkIfA(spBufferOut->GetSize() != spBufferOutPrecomputed->GetSize(), E_FAIL);
+                    ChkIfA(0 != memcmp(spBufferOut->GetData(), spBufferOutPrecomputed->GetData(), spBufferOut->GetSize()), E_FAIL);
+                    
+                    // and the precomputed OTHER-ADDRESS really is the opposite socket
+                    if ((config == 0) && (legacy == 0) && (change == 0))
+                    {
+                        ChkIfA(CStunMessageReader::BodyValidated != readerResponse.AddBytes(spBufferOutPrecomputed->GetData(), spBufferOutPrecomputed->GetSize()), E_FAIL);
+                        ChkA(readerResponse.GetOtherAddress(&addrOther));
+                        ChkIfA(false == addrOther.IsSameIP_and_Port(arrAddrLocal[SocketRoleSwapIP(SocketRoleSwapPort((SocketRole)role))]), E_FAIL);
+                    }
+                }
+            }
+        }
+    }
+    
+Cleanup:
+    return hr;
+}
+
+// Test8 - a CStunRequestContext reused across many requests (in any order, alone or in batches) sends back exactly
+// what a freshly constructed handler would, and once it's warmed up it doesn't allocate anything
+HRESULT CTestMessageHandler::Test8()
+{
+    HRESULT hr = S_OK;
+    const size_t c_count = 6;
+    CStunMessageReader readers[c_count];
+    StunMessageIn msgIn[c_count];
+    StunMessageOut msgOut[c_count];
+    StunMessageOut msgOutExpected[c_count];
+    HRESULT results[c_count];
+    HRESULT resultsExpected[c_count];
+    TransportAddressSet tas = {};
+    CStunIntegrityKeySha256 keySha256;
+    CStunKeyCache keycache;
+    CStunRequestContext context;
+    IStunAuth* arrAuth[2] = {_spAuthLong, NULL};
+    
+    InitTransportAddressSet(tas, true, true, true, true);
+    ChkA(CStunRequestHandler::PrecomputeAttributes(&tas));
+    ChkA(keySha256.InitLongTerm("AuthorizedUser", "MyRealm", "password", STUN_PASSWORD_ALGORITHM_MD5));
+    ChkA(keycache.Init(CStunKeyCache::c_defaultSize));
+    
+    // good HMAC, bad HMAC, no HMAC, good SHA-256 HMAC, a legacy request, and a request for the other socket
+    for (size_t index = 0; index < c_count; index++)
+    {
+        CStunMessageBuilder builder;
+        CRefCountedBuffer spBufferRequest;
+        StunTransactionId transid = {};
+        StunChangeRequestAttribute changerequest = {};
+        
+        builder.AddHeader(StunMsgTypeBinding, StunMsgClassRequest);
+        if (index == 4)
+        {
+            // no magic cookie
+            for (size_t i = 0; i < ARRAYSIZE(transid.id); i++)
+            {
+                transid.id[i] = (uint8_t)(i + 1);
+            }
+            builder.AddTransactionId(transid);
+        }
+        else
+        {
+            builder.AddRandomTransactionId(&transid);
+        }
+        
+        if (index < 4)
+        {
+            builder.AddNonce("NewNonce");
+            builder.AddRealm("MyRealm");
+            builder.AddUserName("AuthorizedUser");
+        }
+        
+        if (index == 0)
+        {
+            builder.AddMessageIntegrityLongTerm("AuthorizedUser", "MyRealm", "password");
+        }
+        else if (index == 1)
+        {
+            builder.AddMessageIntegrityLongTerm("AuthorizedUser", "MyRealm", "wrong");
+        }
+        else if (index == 3)
+        {
+            builder.AddMessageIntegritySha256(keySha256);
+        }
+        else if (index == 5)
+        {
+            changerequest.fChangeIP = true;
+            changerequest.fChangePort = true;
+            builder.AddChangeRequest(changerequest);
+        }
+        builder.FixLengthField();
+        ChkA(builder.GetResult(&spBufferRequest));
+        
+        ChkIfA(CStunMessageReader::BodyValidated != readers[index].AddBytes(spBufferRequest->GetData(), spBufferRequest->GetSize()), E_FAIL);
+        
+        msgIn[index].fConnectionOriented = false;
+        msgIn[index].addrLocal = _addrServerPP;
+        msgIn[index].pReader = &readers[index];
+        msgIn[index].socketrole = RolePP;
+        msgIn[index].addrRemote = _addrMapped;
+        
+        msgOut[index].spBufferOut = CRefCountedBuffer(new CBuffer(MAX_STUN_MESSAGE_SIZE));
+        msgOutExpected[index].spBufferOut = CRefCountedBuffer(new CBuffer(MAX_STUN_MESSAGE_SIZE));
+    }
+    
+    for (size_t authindex = 0; authindex < ARRAYSIZE(arrAuth); authindex++)
+    {
+        IStunAuth* pAuth = arrAuth[authindex];
+        
+        for (size_t index = 0; index < c_count; index++)
+        {
+            resultsExpected[index] = CStunRequestHandler::ProcessRequest(msgIn[index], msgOutExpected[index], &tas, pAuth, NULL);
+        }
+        
+        // one at a time, forwards then backwards so every request follows a different one than before - then as a batch
+        for (size_t pass = 0; pass < 3; pass++)
+        {
+            if (pass < 2)
+            {
+                for (size_t i = 0; i < c_count; i++)
+                {
+                    size_t index = (pass == 0) ? i : (c_count - 1 - i);
+                    results[index] = context.ProcessRequest(msgIn[index], msgOut[index], &tas, pAuth, &keycache);
+                }
+            }
+            else
+            {
+                context.ProcessRequestBatch(msgIn, msgOut, results, c_count, &tas, pAuth, &keycache);
+            }
+            
+            for (size_t index = 0; index < c_count; index++)
+            {
+                ChkIfA(results[index] != resultsExpected[index], E_FAIL);
+                ChkIfA(msgOut[index].socketrole != msgOutExpected[index].socketrole, E_FAIL);
+                ChkIfA(msgOut[index].spBufferOut->GetSize() != msgOutExpected[index].spBufferOut->GetSize(), E_FAIL);
+                ChkIfA(0 != memcmp(msgOut[index].spBufferOut->GetData(), msgOutExpected[index].spBufferOut->GetData(), msgOut[index].spBufferOut->GetSize()), E_FAIL);
+            }
+        }
+    }
+    
+    // warmed up now (the key cache has its entries) - the steady state shouldn't allocate at all
+    s_countAllocations = 0;
+    s_fCountAllocations = true;
+    for (size_t loop = 0; loop < 100; loop++)
+    {
+        context.ProcessRequestBatch(msgIn, msgOut, results, c_count, &tas, _spAuthLong, &keycache);
+        for (size_t index = 0; index < c_count; index++)
+        {
+            context.ProcessRequest(msgIn[index], msgOut[index], &tas, _spAuthLong, &keycache);
+        }
+    }
+    s_fCountAllocations = false;
+    
+    ChkIfA(s_countAllocations != 0, E_FAIL);
+    
+Cleanup:
+    s_fCountAllocations = false;
+    return hr;
+}
+
+
 HRESULT CTestMessageHandler::Run()
 {
     
@@ -487,6 +950,10 @@ HRESULT CTestMessageHandler::Run()
     Chk(Test2());
     Chk(Test3());
     Chk(Test4());
+    Chk(Test5());
+    Chk(Test6());
+    Chk(Test7());
+    Chk(Test8());
     
 Cleanup:
     return hr;
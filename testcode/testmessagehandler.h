@@ -86,6 +86,10 @@ public:
     HRESULT Test2();
     HRESULT Test3();
     HRESULT Test4();
+    HRESULT Test5();
+    HRESULT Test6();
+    HRESULT Test7();
+    HRESULT Test8();
     HRESULT Run();
 
     UT_DECLARE_TEST_NAME("CTestMessageHandler");
@@ -0,0 +1,240 @@
+/*
+   Copyright 2011 John Selbie
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+
+#include "commonincludes.hpp"
+#include "stuncore.h"
+#include "testnoncegenerator.h"
+
+
+static const uint32_t c_lifetime = 120;
+static const uint32_t c_rotation = 600;
+
+
+HRESULT CTestNonceGenerator::Run()
+{
+    HRESULT hr = S_OK;
+    
+    ChkA(TestRoundTrip());
+    ChkA(TestTampering());
+    ChkA(TestExpiry());
+    ChkA(TestRotation());
+    ChkA(TestUninitialized());
+    
+Cleanup:
+    return hr;
+}
+
+// a nonce is c_nonceLength base64url characters, good on the instance that made it, and on no other
+HRESULT CTestNonceGenerator::TestRoundTrip()
+{
+    HRESULT hr = S_OK;
+    CStunNonceGenerator nonces;
+    CStunNonceGenerator other;
+    const uint32_t now = 1000;
+    char szNonce[CStunNonceGenerator::c_nonceLength + 1];
+    char szSecond[CStunNonceGenerator::c_nonceLength + 1];
+    
+    ChkA(nonces.Init(c_lifetime, c_rotation, now));
+    ChkA(other.Init(c_lifetime, c_rotation, now));
+    
+    // the rotation interval can't be shorter than the lifetime
+    ChkIfA(SUCCEEDED(other.Init(c_lifetime, c_lifetime - 1, now)), E_FAIL);
+    ChkA(other.Init(c_lifetime, c_rotation, now));
+    
+    ChkA(nonces.CreateNonce(szNonce, now));
+    ChkIfA(strlen(szNonce) != CStunNonceGenerator::c_nonceLength, E_FAIL);
+    ChkIfA(strspn(szNonce, "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_") != CStunNonceGenerator::c_nonceLength, E_FAIL);
+    
+    ChkA(nonces.ValidateNonce(szNonce, now));
+    ChkIfA(SUCCEEDED(other.ValidateNonce(szNonce, now)), E_FAIL);
+    
+    // the same second, but not the same nonce
+    ChkA(nonces.CreateNonce(szSecond, now));
+    ChkIfA(strcmp(szNonce, szSecond) == 0, E_FAIL);
+    ChkA(nonces.ValidateNonce(szSecond, now));
+    
+    // the clock the server stamps them with
+    ChkA(nonces.CreateNonce(szNonce));
+    ChkA(nonces.ValidateNonce(szNonce));
+    
+Cleanup:
+    return hr;
+}
+
+// any change at all - a character, the length - and it's not a nonce this instance made
+HRESULT CTestNonceGenerator::TestTampering()
+{
+    HRESULT hr = S_OK;
+    CStunNonceGenerator nonces;
+    const uint32_t now = 5000;
+    char szNonce[CStunNonceGenerator::c_nonceLength + 1];
+    char szTampered[CStunNonceGenerator::c_nonceLength + 2];
+    
+    ChkA(nonces.Init(c_lifetime, c_rotation, now));
+    ChkA(nonces.CreateNonce(szNonce, now));
+    
+    for (size_t index = 0; index < CStunNonceGenerator::c_nonceLength; index++)
+    {
+        strcpy(szTampered, szNonce);
+        szTampered[index] = (szTampered[index] == 'A') ? 'B' : 'A';
+        ChkIfA(SUCCEEDED(nonces.ValidateNonce(szTampered, now)), E_FAIL);
+        
+        // not a base64url character
+        szTampered[index] = '=';
+        ChkIfA(SUCCEEDED(nonces.ValidateNonce(szTampered, now)), E_FAIL);
+    }
+    
+    strcpy(szTampered, szNonce);
+    szTampered[CStunNonceGenerator::c_nonceLength - 1] = '\0';
+    ChkIfA(SUCCEEDED(nonces.ValidateNonce(szTampered, now)), E_FAIL);
+    
+    strcpy(szTampered, szNonce);
+    strcat(szTampered, "A");
+    ChkIfA(SUCCEEDED(nonces.ValidateNonce(szTampered, now)), E_FAIL);
+    
+    ChkIfA(SUCCEEDED(nonces.ValidateNonce("", now)), E_FAIL);
+    ChkIfA(SUCCEEDED(nonces.ValidateNonce("1234567890:0123456789abcdef0123456789abcdef01234567", now)), E_FAIL);
+    
+    ChkA(nonces.ValidateNonce(szNonce, now));
+    
+Cleanup:
+    return hr;
+}
+
+// good for the lifetime and no longer.  One from the future is no good either
+HRESULT CTestNonceGenerator::TestExpiry()
+{
+    HRESULT hr = S_OK;
+    CStunNonceGenerator nonces;
+    const uint32_t now = 100000;
+    char szNonce[CStunNonceGenerator::c_nonceLength + 1];
+    
+    ChkA(nonces.Init(c_lifetime, c_rotation, now));
+    ChkA(nonces.CreateNonce(szNonce, now));
+    
+    ChkA(nonces.ValidateNonce(szNonce, now + c_lifetime));
+    ChkIfA(SUCCEEDED(nonces.ValidateNonce(szNonce, now + c_lifetime + 1)), E_FAIL);
+    ChkIfA(SUCCEEDED(nonces.ValidateNonce(szNonce, now + 100 * c_lifetime)), E_FAIL);
+    ChkIfA(SUCCEEDED(nonces.ValidateNonce(szNonce, now - 1)), E_FAIL);
+    
+Cleanup:
+    return hr;
+}
+
+// a new key takes over every rotation interval.  Nonces signed with the key before it are still good, older ones aren't
+HRESULT CTestNonceGenerator::TestRotation()
+{
+    HRESULT hr = S_OK;
+    CStunNonceGenerator nonces;
+    const uint32_t rotation = 300;
+    const uint32_t lifetime = 1000000;   // long enough that only the keys decide
+    const uint32_t start = 1000;
+    uint32_t now = start;
+    char szFirst[CStunNonceGenerator::c_nonceLength + 1];
+    char szSecond[CStunNonceGenerator::c_nonceLength + 1];
+    char szThird[CStunNonceGenerator::c_nonceLength + 1];
+    
+    ChkA(nonces.Init(c_lifetime, rotation, now));
+    
+    // the lifetime can't outlast the previous key
+    ChkIfA(SUCCEEDED(nonces.Init(lifetime, rotation, now)), E_FAIL);
+    ChkA(nonces.Init(rotation, rotation, now));
+    
+    ChkA(nonces.CreateNonce(szFirst, now));
+    
+    // no new key until the interval is up
+    now = start + rotation - 1;
+    ChkA(nonces.CreateNonce(szSecond, now));
+    ChkA(nonces.ValidateNonce(szFirst, now));
+    
+    // this one is signed with a new key, and the first key is still good
+    now = start + rotation;
+    ChkA(nonces.CreateNonce(szSecond, now));
+    ChkA(nonces.ValidateNonce(szFirst, now));
+    ChkA(nonces.ValidateNonce(szSecond, now));
+    
+    // one more key, and the first one is gone - even for a nonce that hasn't expired
+    now = start + 2 * rotation;
+    ChkA(nonces.CreateNonce(szThird, now));
+    ChkIfA(SUCCEEDED(nonces.ValidateNonce(szFirst, start + rotation)), E_FAIL);
+    ChkA(nonces.ValidateNonce(szSecond, now));
+    ChkA(nonces.ValidateNonce(szThird, now));
+    
+    // only CreateNonce rotates, so checking nonces long after the interval is up leaves the keys alone
+    ChkA(nonces.ValidateNonce(szThird, now + rotation));
+    ChkA(nonces.ValidateNonce(szSecond, start + 2 * rotation));
+    
+Cleanup:
+    return hr;
+}
+
+// what anybody could sign a nonce with if a generator's keys were left in their Reset state
+static void ForgeNonce(uint32_t now, char* pszNonce)
+{
+    static const char c_base64url[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+    uint8_t nonce[18] = {};
+    uint8_t mac[CStunIntegrityKey::c_hmacsize];
+    CStunIntegrityKey key;
+    
+    nonce[1] = (uint8_t)(now >> 24);
+    nonce[2] = (uint8_t)(now >> 16);
+    nonce[3] = (uint8_t)(now >> 8);
+    nonce[4] = (uint8_t)now;
+    
+    // a key that never got Init - a debug build asserts here, and then computes the same MAC a release build does
+    key.Reset();
+    key.Compute(nonce, 9, mac);
+    
+    memcpy(nonce + 9, mac, 9);
+    
+    for (size_t index = 0; index < sizeof(nonce); index += 3)
+    {
+        uint32_t group = ((uint32_t)nonce[index] << 16) | ((uint32_t)nonce[index+1] << 8) | nonce[index+2];
+        
+        *pszNonce++ = c_base64url[(group >> 18) & 0x3f];
+        *pszNonce++ = c_base64url[(group >> 12) & 0x3f];
+        *pszNonce++ = c_base64url[(group >> 6) & 0x3f];
+        *pszNonce++ = c_base64url[group & 0x3f];
+    }
+    
+    *pszNonce = '\0';
+}
+
+// a generator that never got Init has no secret to sign with, so it neither hands out nor accepts anything
+HRESULT CTestNonceGenerator::TestUninitialized()
+{
+    HRESULT hr = S_OK;
+    CStunNonceGenerator nonces;
+    CStunNonceGenerator other;
+    const uint32_t now = 1000;
+    char szNonce[CStunNonceGenerator::c_nonceLength + 1];
+    
+    ChkIfA(SUCCEEDED(nonces.CreateNonce(szNonce, now)), E_FAIL);
+    ChkIfA(szNonce[0] != '\0', E_FAIL);
+    
+    // a nonce that checks out against a generator with keys, offered to one without
+    ChkA(other.Init(c_lifetime, c_rotation, now));
+    ChkA(other.CreateNonce(szNonce, now));
+    ChkIfA(SUCCEEDED(nonces.ValidateNonce(szNonce, now)), E_FAIL);
+    
+    // a forgery: generation 0, stamped now, and the MAC a key in its Reset state would give it
+    ForgeNonce(now, szNonce);
+    ChkIfA(SUCCEEDED(nonces.ValidateNonce(szNonce, now)), E_FAIL);
+    
+Cleanup:
+    return hr;
+}
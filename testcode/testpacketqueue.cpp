@@ -0,0 +1,202 @@
+/*
+   Copyright 2011 John Selbie
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "commonincludes.hpp"
+#include "stuncore.h"
+#include "testpacketqueue.h"
+
+
+static const uint32_t c_threadPacketCount = 200000;
+
+struct ProducerArgs
+{
+    CStunPacketQueue* pQueue;
+    bool fDone;
+};
+
+// the packets in these tests carry a counter in their first four bytes
+static void SetPacketNumber(StunPacket* pPacket, uint32_t number)
+{
+    pPacket->size = sizeof(number) + (number % 16);
+    memset(pPacket->data, 0xab, pPacket->size);
+    memcpy(pPacket->data, &number, sizeof(number));
+    pPacket->socketrole = (SocketRole)(number % 4);
+}
+
+static uint32_t GetPacketNumber(const StunPacket& packet)
+{
+    uint32_t number = 0;
+    memcpy(&number, packet.data, sizeof(number));
+    return number;
+}
+
+
+HRESULT CTestPacketQueue::Run()
+{
+    HRESULT hr = S_OK;
+    
+    ChkA(TestOrder());
+    ChkA(TestShedding());
+    ChkA(TestThreads());
+    
+Cleanup:
+    return hr;
+}
+
+// first in, first out - across many laps of a small queue
+HRESULT CTestPacketQueue::TestOrder()
+{
+    HRESULT hr = S_OK;
+    CStunPacketQueue queue;
+    StunPacket packet;
+    uint32_t numberWrite = 0;
+    uint32_t numberRead = 0;
+    
+    ChkA(queue.Init(5));
+    ChkIfA(queue.GetCapacity() != 8, E_FAIL);
+    ChkIfA(queue.IsEmpty() == false, E_FAIL);
+    ChkIfA(queue.Pop(&packet), E_FAIL);
+    
+    for (size_t iteration = 0; iteration < 100; iteration++)
+    {
+        size_t pushcount = 1 + (iteration % 8);
+        
+        for (size_t index = 0; index < pushcount; index++)
+        {
+            SetPacketNumber(&packet, numberWrite++);
+            ChkIfA(queue.Push(packet) == false, E_FAIL);
+        }
+        
+        ChkIfA(queue.IsEmpty(), E_FAIL);
+        
+        while (queue.Pop(&packet))
+        {
+            ChkIfA(GetPacketNumber(packet) != numberRead, E_FAIL);
+            ChkIfA(packet.size != sizeof(uint32_t) + (numberRead % 16), E_FAIL);
+            ChkIfA(packet.socketrole != (SocketRole)(numberRead % 4), E_FAIL);
+            numberRead++;
+        }
+        
+        ChkIfA(numberRead != numberWrite, E_FAIL);
+        ChkIfA(queue.IsEmpty() == false, E_FAIL);
+    }
+    
+    ChkIfA(queue.GetShedCount() != 0, E_FAIL);
+    
+Cleanup:
+    return hr;
+}
+
+// pushing into a full queue drops the oldest packets, not the new ones
+HRESULT CTestPacketQueue::TestShedding()
+{
+    HRESULT hr = S_OK;
+    CStunPacketQueue queue;
+    StunPacket packet;
+    const uint32_t c_extra = 3;
+    uint32_t numberExpected = c_extra;
+    
+    ChkA(queue.Init(16));
+    
+    for (uint32_t number = 0; number < 16 + c_extra; number++)
+    {
+        SetPacketNumber(&packet, number);
+        ChkIfA(queue.Push(packet) == false, E_FAIL);
+    }
+    
+    ChkIfA(queue.GetShedCount() != (int)c_extra, E_FAIL);
+    
+    while (queue.Pop(&packet))
+    {
+        ChkIfA(GetPacketNumber(packet) != numberExpected, E_FAIL);
+        numberExpected++;
+    }
+    ChkIfA(numberExpected != 16 + c_extra, E_FAIL);
+    
+Cleanup:
+    return hr;
+}
+
+void* CTestPacketQueue::ProducerThread(void* pArgs)
+{
+    ProducerArgs* pProducerArgs = (ProducerArgs*)pArgs;
+    StunPacket packet;
+    
+    for (uint32_t number = 0; number < c_threadPacketCount; number++)
+    {
+        SetPacketNumber(&packet, number);
+        pProducerArgs->pQueue->Push(packet);
+    }
+    
+    __atomic_store_n(&pProducerArgs->fDone, true, __ATOMIC_RELEASE);
+    
+    return NULL;
+}
+
+// a producer thread that's faster than the consumer - whatever the consumer gets is in order and intact,
+// and every packet is either received or counted as shed
+HRESULT CTestPacketQueue::TestThreads()
+{
+    HRESULT hr = S_OK;
+    CStunPacketQueue queue;
+    StunPacket packet;
+    pthread_t thread;
+    bool fThreadStarted = false;
+    ProducerArgs args = {&queue, false};
+    uint32_t received = 0;
+    uint32_t numberLast = 0;
+    bool fDone = false;
+    
+    ChkA(queue.Init(64));
+    
+    ChkIfA(0 != pthread_create(&thread, NULL, ProducerThread, &args), E_FAIL);
+    fThreadStarted = true;
+    
+    while (true)
+    {
+        // once the producer is done, one last pass drains the queue
+        fDone = __atomic_load_n(&args.fDone, __ATOMIC_ACQUIRE);
+        
+        while (queue.Pop(&packet))
+        {
+            uint32_t number = GetPacketNumber(packet);
+            
+            ChkIfA((received > 0) && (number <= numberLast), E_FAIL);
+            ChkIfA(packet.size != sizeof(uint32_t) + (number % 16), E_FAIL);
+            ChkIfA((packet.size > sizeof(uint32_t)) && (packet.data[packet.size - 1] != 0xab), E_FAIL);
+            
+            numberLast = number;
+            received++;
+        }
+        
+        if (fDone)
+        {
+            break;
+        }
+    }
+    
+    pthread_join(thread, NULL);
+    fThreadStarted = false;
+    
+    ChkIfA(received + (uint32_t)queue.GetShedCount() != c_threadPacketCount, E_FAIL);
+    
+Cleanup:
+    if (fThreadStarted)
+    {
+        pthread_join(thread, NULL);
+    }
+    return hr;
+}
@@ -18,6 +18,8 @@
 #include "unittest.h"
 
 #include "polling.h"
+#include "uring.h"
+#include "oshelper.h"
 
 #include "testpolling.h"
 
@@ -39,12 +41,26 @@ HRESULT CTestPolling::Run()
     _polltype = IPOLLING_TYPE_EPOLL;
     ChkA(Test1());
     ChkA(Test2());
+    ChkA(Test4());
+    ChkA(Test6());
 #endif
     
     _polltype = IPOLLING_TYPE_POLL;
     ChkA(Test1());
     ChkA(Test2());
     ChkA(Test3());
+    ChkA(Test4());
+    ChkA(Test6());
+    ChkA(Test7());
+    
+    // falls back to epoll if the kernel running the test doesn't support io_uring
+    _polltype = IPOLLING_TYPE_URING;
+    ChkA(Test1());
+    ChkA(Test2());
+    ChkA(Test4());
+    ChkA(Test6());
+    
+    ChkA(Test5());
 Cleanup:
     return hr;
 }
@@ -406,4 +422,234 @@ Cleanup:
     
 }
 
+// events are level triggered: a socket keeps getting reported for as long as there's
+// unread data.  And a change to the event set takes effect on the next wait.
+HRESULT CTestPolling::Test4()
+{
+    HRESULT hr = S_OK;
+    HRESULT hrResult;
+    PollEvent event;
+    char ch;
+    
+    ChkA(TestInit(10, 2));
+    
+    ChkA(WritePipe(&_pipes[0]));
+    ChkA(WritePipe(&_pipes[0]));
+    
+    // two bytes, read one at a time - the event has to come back for the second one
+    for (int index = 0; index < 2; index++)
+    {
+        hrResult = _spPolling->WaitForNextEvent(&event, 0);
+        ChkIfA(hrResult != S_OK, E_UNEXPECTED);
+        ChkIfA(event.fd != _pipes[0].readpipe, E_UNEXPECTED);
+        ChkIfA(::read(event.fd, &ch, 1) != 1, E_UNEXPECTED);
+    }
+    
+    hrResult = _spPolling->WaitForNextEvent(&event, 0);
+    ChkIfA(hrResult != S_FALSE, E_UNEXPECTED);
+    
+    // the read end of a pipe never becomes writable, so nothing fires until it's switched back to read
+    ChkA(_spPolling->ChangeEventSet(_pipes[1].readpipe, IPOLLING_WRITE));
+    ChkA(WritePipe(&_pipes[1]));
+    
+    hrResult = _spPolling->WaitForNextEvent(&event, 0);
+    ChkIfA(hrResult != S_FALSE, E_UNEXPECTED);
+    
+    ChkA(_spPolling->ChangeEventSet(_pipes[1].readpipe, IPOLLING_READ));
+    
+    hrResult = _spPolling->WaitForNextEvent(&event, 0);
+    ChkIfA(hrResult != S_OK, E_UNEXPECTED);
+    ChkIfA(event.fd != _pipes[1].readpipe, E_UNEXPECTED);
+    ChkIfA((event.eventflags & IPOLLING_READ) == 0, E_UNEXPECTED);
+    
+Cleanup:
+    return hr;
+}
+
+// receives through CUring's provided buffer ring. The ring only has two buffers,
+// so the later receives only work if the earlier buffers made it back into the ring
+HRESULT CTestPolling::Test5()
+{
+    HRESULT hr = S_OK;
+#ifdef HAS_IOURING
+    CUring uring;
+    int sockets[2] = {-1, -1};
+    const char* messages[] = {"first", "second", "third", "fourth"};
+    
+    if (FAILED(uring.Init(8, 16)))
+    {
+        // not supported by the kernel running the test
+        return S_OK;
+    }
+    
+    ChkA(uring.RegisterBufferRing(1, 2, 16));
+    ChkIfA(::socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) == -1, ERRNOHR);
+    
+    for (size_t index = 0; index < ARRAYSIZE(messages); index++)
+    {
+        size_t length = strlen(messages[index]);
+        io_uring_sqe* pSqe = NULL;
+        io_uring_cqe* pCqe = NULL;
+        uint16_t bufferId;
+        
+        ChkIfA(::write(sockets[1], messages[index], length) != (ssize_t)length, E_UNEXPECTED);
+        
+        pSqe = uring.GetSqe();
+        ChkIfA(pSqe == NULL, E_UNEXPECTED);
+        pSqe->opcode = IORING_OP_RECV;
+        pSqe->fd = sockets[0];
+        pSqe->flags = IOSQE_BUFFER_SELECT;
+        pSqe->buf_group = 1;
+        pSqe->user_data = index;
+        
+        ChkA(uring.Enter(1, 1000));
+        
+        pCqe = uring.PeekCqe();
+        ChkIfA(pCqe == NULL, E_UNEXPECTED);
+        ChkIfA(pCqe->user_data != index, E_UNEXPECTED);
+        ChkIfA(pCqe->res != (int)length, E_UNEXPECTED);
+        ChkIfA((pCqe->flags & IORING_CQE_F_BUFFER) == 0, E_UNEXPECTED);
+        
+        bufferId = (uint16_t)(pCqe->flags >> IORING_CQE_BUFFER_SHIFT);
+        ChkIfA(memcmp(uring.GetBuffer(bufferId), messages[index], length) != 0, E_UNEXPECTED);
+        
+        uring.AdvanceCq();
+        uring.ReturnBuffer(bufferId);
+    }
+    
+Cleanup:
+    if (sockets[0] != -1)
+    {
+        close(sockets[0]);
+        close(sockets[1]);
+    }
+#endif
+    return hr;
+}
 
+// timers: a one shot timer fires once, a periodic timer keeps firing, and a timer that
+// got disarmed or removed doesn't fire - even if it was already due when that happened
+HRESULT CTestPolling::Test6()
+{
+    HRESULT hr = S_OK;
+    int timerOnce = -1;
+    int timerPeriodic = -1;
+    int countOnce = 0;
+    int countPeriodic = 0;
+    PollEvent event;
+    uint64_t timeStart;
+    char ch;
+    
+    ChkA(TestInit(10, 1));
+    
+    ChkA(_spPolling->AddTimer(30, false, &timerOnce));
+    ChkA(_spPolling->AddTimer(10, true, &timerPeriodic));
+    
+    timeStart = GetMonotonicMilliseconds();
+    while ((GetMonotonicMilliseconds() - timeStart) < 100)
+    {
+        hr = _spPolling->WaitForNextEvent(&event, 10);
+        ChkA(hr);
+        if (hr == S_FALSE)
+        {
+            continue;
+        }
+        
+        ChkIfA(event.eventflags != IPOLLING_TIMER, E_UNEXPECTED);
+        ChkIfA((event.fd != timerOnce) && (event.fd != timerPeriodic), E_UNEXPECTED);
+        countOnce += (event.fd == timerOnce) ? 1 : 0;
+        countPeriodic += (event.fd == timerPeriodic) ? 1 : 0;
+    }
+    
+    ChkIfA(countOnce != 1, E_UNEXPECTED);
+    ChkIfA(countPeriodic < 3, E_UNEXPECTED); // about 10, but the machine running the test might be busy
+    
+    // let both come due again without collecting the events, then take them back
+    ChkA(_spPolling->ChangeTimer(timerOnce, 5, false));
+    usleep(20000);
+    ChkA(_spPolling->ChangeTimer(timerPeriodic, 0, false));
+    ChkA(_spPolling->RemoveTimer(timerOnce));
+    
+    // timers and sockets mix
+    ChkA(WritePipe(&_pipes[0]));
+    ChkA(_spPolling->WaitForNextEvent(&event, 100));
+    ChkIfA(hr != S_OK, E_UNEXPECTED);
+    ChkIfA(event.fd != _pipes[0].readpipe, E_UNEXPECTED);
+    ChkIfA((event.eventflags & IPOLLING_TIMER) != 0, E_UNEXPECTED);
+    ChkIfA(::read(_pipes[0].readpipe, &ch, 1) != 1, E_UNEXPECTED);
+    _pipes[0].fDataPending = false;
+    
+    hr = _spPolling->WaitForNextEvent(&event, 50);
+    ChkA(hr);
+    ChkIfA(hr != S_FALSE, E_UNEXPECTED);
+    
+    // and a disarmed timer can be armed again
+    ChkA(_spPolling->ChangeTimer(timerPeriodic, 5, false));
+    ChkA(_spPolling->WaitForNextEvent(&event, 1000));
+    ChkIfA(hr != S_OK, E_UNEXPECTED);
+    ChkIfA((event.fd != timerPeriodic) || (event.eventflags != IPOLLING_TIMER), E_UNEXPECTED);
+    
+Cleanup:
+    TestUnInit();
+    return hr;
+}
+
+// sockets removed while they still have events waiting to be handed out (CPoll only - CEpoll
+// leaves that to the caller, see CEpoll::Remove).  The events for them just go away, and the
+// ones for the sockets left behind still come through
+HRESULT CTestPolling::Test7()
+{
+    HRESULT hr = S_OK;
+    HRESULT hrResult;
+    PollEvent event;
+    int fd;
+    int count;
+    
+    ChkA(TestInit(10, 6));
+    
+    for (size_t index = 0; index < _pipes.size(); index++)
+    {
+        ChkA(WritePipe(&_pipes[index]));
+    }
+    
+    // one event gets handed out, the rest are pending
+    ChkA(ConsumeEvent(&fd, &count));
+    ChkIfA(GetPendingCount() != 5, E_UNEXPECTED);
+    
+    // remove all but one of the pipes still waiting, from the front, back, and middle
+    for (int removed = 0; removed < 4; removed++)
+    {
+        int last = -1;
+        int chosen = -1;
+        
+        for (int index = 0; index < (int)_pipes.size(); index++)
+        {
+            if (_pipes[index].fDataPending)
+            {
+                if (chosen == -1)
+                {
+                    chosen = index;
+                }
+                last = index;
+            }
+        }
+        
+        ChkA(RemovePipe((removed % 2) ? last : chosen));
+    }
+    
+    ChkIfA(GetPendingCount() != 1, E_UNEXPECTED);
+    
+    ChkA(ConsumeEvent(&fd, &count));
+    ChkIfA(GetPendingCount() != 0, E_UNEXPECTED);
+    
+    hrResult = _spPolling->WaitForNextEvent(&event, 0);
+    ChkIfA(hrResult != S_FALSE, E_UNEXPECTED);
+    
+    // and the polling instance carries on normally
+    ChkA(WritePipe(&_pipes[0]));
+    ChkA(ConsumeEvent(&fd, &count));
+    ChkIfA(fd != _pipes[0].readpipe, E_UNEXPECTED);
+    
+Cleanup:
+    return hr;
+}
@@ -49,6 +49,10 @@ public:
     HRESULT Test1();
     HRESULT Test2();
     HRESULT Test3();
+    HRESULT Test4();
+    HRESULT Test5();
+    HRESULT Test6();
+    HRESULT Test7();
     
     HRESULT Run();
     
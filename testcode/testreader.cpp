@@ -52,6 +52,7 @@ HRESULT CTestReader::Run()
     HRESULT hr = S_OK;
     Chk(Test1());
     Chk(Test2());
+    Chk(Test3());
 Cleanup:
     return hr;
 }
@@ -191,3 +192,81 @@ Cleanup:
     return hr;
 }
 
+
+// the attribute index: wire order, last one of a type wins, nothing left over
+// from the previous message after a Reset, and no more than 30 attributes
+HRESULT CTestReader::Test3()
+{
+    HRESULT hr = S_OK;
+    CStunMessageReader reader;
+    StunAttribute attrib;
+    const uint16_t c_unknownType = 0x8077;
+    char szValue[100];
+    
+    // the RFC 5769 request, then a message with none of its attributes
+    ChkIfA(reader.AddBytes(c_requestbytes, sizeof(c_requestbytes)-1) != CStunMessageReader::BodyValidated, E_FAIL);
+    ChkIfA(reader.GetAttributeCount() != 6, E_FAIL);
+    ChkA(reader.GetAttributeByIndex(0, &attrib));
+    ChkIfA(attrib.attributeType != STUN_ATTRIBUTE_SOFTWARE, E_FAIL);
+    ChkA(reader.GetAttributeByIndex(5, &attrib));
+    ChkIfA(attrib.attributeType != STUN_ATTRIBUTE_FINGERPRINT, E_FAIL);
+    ChkIfA(SUCCEEDED(reader.GetAttributeByIndex(6, &attrib)), E_FAIL);
+    
+    {
+        CStunMessageBuilder builder;
+        CRefCountedBuffer spBuffer;
+        
+        ChkA(builder.AddBindingRequestHeader());
+        ChkA(builder.AddRandomTransactionId(NULL));
+        ChkA(builder.AddAttribute(c_unknownType, "abcd", 4));
+        ChkA(builder.AddStringAttribute(STUN_ATTRIBUTE_REALM, "realm1"));
+        ChkA(builder.AddStringAttribute(STUN_ATTRIBUTE_REALM, "realm2"));
+        ChkA(builder.AddAttribute(c_unknownType, "efgh", 4));
+        ChkA(builder.AddAttribute(STUN_ATTRIBUTE_SOFTWARE, "x", 1));
+        ChkA(builder.AddAttribute(STUN_ATTRIBUTE_SOFTWARE, "y", 1));
+        ChkA(builder.FixLengthField());
+        ChkA(builder.GetResult(&spBuffer));
+        
+        reader.Reset();
+        ChkIfA(reader.AddBytes(spBuffer->GetData(), spBuffer->GetSize()) != CStunMessageReader::BodyValidated, E_FAIL);
+        ChkIfA(reader.GetAttributeCount() != 6, E_FAIL);
+        
+        ChkIfA(reader.HasMessageIntegrityAttribute(), E_FAIL);
+        ChkIfA(reader.HasFingerprintAttribute(), E_FAIL);
+        ChkIfA(SUCCEEDED(reader.GetAttributeByType(STUN_ATTRIBUTE_USERNAME, &attrib)), E_FAIL);
+        
+        ChkA(reader.GetStringAttributeByType(STUN_ATTRIBUTE_REALM, szValue, ARRAYSIZE(szValue)));
+        ChkIfA(strcmp(szValue, "realm2") != 0, E_FAIL);
+        ChkA(reader.GetStringAttributeByType(c_unknownType, szValue, ARRAYSIZE(szValue)));
+        ChkIfA(strcmp(szValue, "efgh") != 0, E_FAIL);
+        ChkA(reader.GetStringAttributeByType(STUN_ATTRIBUTE_SOFTWARE, szValue, ARRAYSIZE(szValue)));
+        ChkIfA(strcmp(szValue, "y") != 0, E_FAIL);
+        
+        ChkA(reader.GetAttributeByIndex(1, &attrib));
+        ChkIfA(attrib.attributeType != STUN_ATTRIBUTE_REALM, E_FAIL);
+        ChkA(reader.GetAttributeByIndex(3, &attrib));
+        ChkIfA(attrib.attributeType != c_unknownType, E_FAIL);
+    }
+    
+    // 30 attributes is fine, 31 is a parse error
+    for (size_t count = 30; count <= 31; count++)
+    {
+        CStunMessageBuilder builder;
+        CRefCountedBuffer spBuffer;
+        
+        ChkA(builder.AddBindingRequestHeader());
+        ChkA(builder.AddRandomTransactionId(NULL));
+        for (size_t index = 0; index < count; index++)
+        {
+            ChkA(builder.AddAttribute(STUN_ATTRIBUTE_PADDING, NULL, 0));
+        }
+        ChkA(builder.FixLengthField());
+        ChkA(builder.GetResult(&spBuffer));
+        
+        reader.Reset();
+        ChkIfA((reader.AddBytes(spBuffer->GetData(), spBuffer->GetSize()) == CStunMessageReader::BodyValidated) != (count == 30), E_FAIL);
+    }
+    
+Cleanup:
+    return hr;
+}
@@ -31,6 +31,7 @@ public:
 
     HRESULT Test1();
     HRESULT Test2();
+    HRESULT Test3();
     HRESULT Run();
 
     UT_DECLARE_TEST_NAME("CTestReader");
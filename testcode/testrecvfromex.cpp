@@ -61,6 +61,9 @@ HRESULT CTestRecvFromEx::DoTest(bool fIPV6)
     int ret;
     timeval tv = {};
     
+    RecvMessageEx messages[4];
+    char buffers[4][16];
+    
     
     if (fIPV6)
     {
@@ -123,6 +126,41 @@ HRESULT CTestRecvFromEx::DoTest(bool fIPV6)
     ChkIfA(addrSrcOnRecv.IsIPAddressZero(), E_UNEXPECTED);
     ChkIfA(addrDestOnRecv.IsIPAddressZero(), E_UNEXPECTED);
     
+    // recvmmsgex - three datagrams of different sizes come off the socket with a single call
+    for (size_t index = 0; index < ARRAYSIZE(messages); index++)
+    {
+        messages[index].buf = buffers[index];
+        messages[index].len = sizeof(buffers[index]);
+        messages[index].received = -1;
+    }
+    
+    for (size_t index = 0; index < 3; index++)
+    {
+        memset(buffers[0], (int)index, index + 1);
+        ret = sendto(socketSend.GetSocketHandle(), buffers[0], index + 1, 0, addrDestForSend.GetSockAddr(), addrDestForSend.GetSockAddrLength());
+        ChkIfA(ret <= 0, E_UNEXPECTED);
+    }
+    
+    FD_ZERO(&set);
+    FD_SET(socketRecv.GetSocketHandle(), &set);
+    tv.tv_sec = 3;
+    ret = select(socketRecv.GetSocketHandle()+1, &set, NULL, NULL, &tv);
+    ChkIfA(ret <= 0, E_UNEXPECTED);
+    
+    ret = ::recvmmsgex(socketRecv.GetSocketHandle(), messages, ARRAYSIZE(messages), MSG_DONTWAIT);
+    ChkIfA(ret != 3, E_UNEXPECTED);
+    
+    for (size_t index = 0; index < 3; index++)
+    {
+        ChkIfA(messages[index].received != (ssize_t)(index + 1), E_UNEXPECTED);
+        ChkIfA(buffers[index][0] != (char)index, E_UNEXPECTED);
+        ChkIfA(messages[index].addrSrc.IsIPAddressZero(), E_UNEXPECTED);
+        ChkIfA(messages[index].addrDst.IsIPAddressZero(), E_UNEXPECTED);
+    }
+    
+    // nothing left
+    ret = ::recvmmsgex(socketRecv.GetSocketHandle(), messages, ARRAYSIZE(messages), MSG_DONTWAIT);
+    ChkIfA(ret >= 0, E_UNEXPECTED);
     
 Cleanup:
 
@@ -0,0 +1,220 @@
+/*
+   Copyright 2011 John Selbie
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "commonincludes.hpp"
+#include "stuncore.h"
+#include "testresponsecache.h"
+
+
+HRESULT CTestResponseCache::Run()
+{
+    HRESULT hr = S_OK;
+
+    ChkA(TestHitAndMiss());
+    ChkA(TestExpiry());
+    ChkA(TestEviction());
+
+Cleanup:
+    return hr;
+}
+
+// builds a binding request with a new transaction ID into _reader/_msgIn, and a made up response to it
+// (responseTag in every byte) into _msgOut
+HRESULT CTestResponseCache::InitRequest(const CSocketAddress& addrRemote, SocketRole role, uint8_t responseTag)
+{
+    HRESULT hr = S_OK;
+    CStunMessageBuilder builder;
+    CSocketAddress addrDest(0x7f000001, 4000);
+
+    ChkA(builder.AddBindingRequestHeader());
+    ChkA(builder.AddRandomTransactionId(NULL));
+    ChkA(builder.AddStringAttribute(STUN_ATTRIBUTE_SOFTWARE, "responsecachetest"));
+    ChkA(builder.FixLengthField());
+    ChkA(builder.GetResult(&_spRequest));
+
+    _reader.Reset();
+    ChkIfA(CStunMessageReader::BodyValidated != _reader.AddBytes(_spRequest->GetData(), _spRequest->GetSize()), E_FAIL);
+
+    _msgIn.socketrole = role;
+    _msgIn.addrRemote = addrRemote;
+    _msgIn.pReader = &_reader;
+    _msgIn.fConnectionOriented = false;
+
+    _spResponse = CRefCountedBuffer(new CBuffer(MAX_STUN_MESSAGE_SIZE));
+    memset(_spResponse->GetData(), responseTag, 60);
+    _spResponse->SetSize(60);
+
+    _msgOut.socketrole = RoleAA;
+    _msgOut.addrDest = addrDest;
+    _msgOut.spBufferOut = _spResponse;
+
+Cleanup:
+    return hr;
+}
+
+HRESULT CTestResponseCache::ValidateHit(const StunCachedResponse* pCached, uint8_t responseTag)
+{
+    HRESULT hr = S_OK;
+
+    ChkIfA(pCached == NULL, E_FAIL);
+    ChkIfA(pCached->socketrole != RoleAA, E_FAIL);
+    ChkIfA(pCached->addrDest.IsSameIP_and_Port(CSocketAddress(0x7f000001, 4000)) == false, E_FAIL);
+    ChkIfA(pCached->size != 60, E_FAIL);
+
+    for (size_t index = 0; index < pCached->size; index++)
+    {
+        ChkIfA(pCached->data[index] != responseTag, E_FAIL);
+    }
+
+Cleanup:
+    return hr;
+}
+
+// a retransmission (the same bytes, from the same address, on the same socket) gets the stored response - nothing else does
+HRESULT CTestResponseCache::TestHitAndMiss()
+{
+    HRESULT hr = S_OK;
+    CStunResponseCache cache;
+    CSocketAddress addrRemote(0x0a000001, 5000);
+    CSocketAddress addrOtherPort(0x0a000001, 5001);
+    CSocketAddress addrOtherIP(0x0a000002, 5000);
+    const uint32_t now = 1000;
+    uint8_t request[MAX_STUN_MESSAGE_SIZE];
+    size_t requestSize = 0;
+
+    // not initialized - nothing is cached and nothing is counted
+    ChkIfA(cache.IsEnabled(), E_FAIL);
+    ChkA(InitRequest(addrRemote, RolePP, 0x11));
+    cache.Store(_msgIn, _msgOut, now);
+    ChkIfA(cache.Lookup(addrRemote, RolePP, _spRequest->GetData(), _spRequest->GetSize(), now) != NULL, E_FAIL);
+    ChkIfA(cache.GetMissCount() != 0, E_FAIL);
+
+    ChkA(cache.Init(16, 5000));
+    ChkIfA(cache.IsEnabled() == false, E_FAIL);
+
+    // never answered
+    ChkIfA(cache.Lookup(addrRemote, RolePP, _spRequest->GetData(), _spRequest->GetSize(), now) != NULL, E_FAIL);
+    ChkIfA(cache.GetMissCount() != 1, E_FAIL);
+
+    cache.Store(_msgIn, _msgOut, now);
+    requestSize = _spRequest->GetSize();
+    memcpy(request, _spRequest->GetData(), requestSize);
+
+    // the response is a copy - the buffer it came from can be reused right away
+    memset(_spResponse->GetData(), 0xee, _spResponse->GetSize());
+
+    ChkA(ValidateHit(cache.Lookup(addrRemote, RolePP, request, requestSize, now + 500), 0x11));
+    ChkA(ValidateHit(cache.Lookup(addrRemote, RolePP, request, requestSize, now + 1500), 0x11));
+    ChkIfA(cache.GetHitCount() != 2, E_FAIL);
+
+    // a different client, a different socket, or a truncated request
+    ChkIfA(cache.Lookup(addrOtherPort, RolePP, request, requestSize, now) != NULL, E_FAIL);
+    ChkIfA(cache.Lookup(addrOtherIP, RolePP, request, requestSize, now) != NULL, E_FAIL);
+    ChkIfA(cache.Lookup(addrRemote, RolePA, request, requestSize, now) != NULL, E_FAIL);
+    ChkIfA(cache.Lookup(addrRemote, RolePP, request, STUN_HEADER_SIZE - 1, now) != NULL, E_FAIL);
+
+    // the same header with a different transaction ID
+    request[STUN_HEADER_SIZE - 1] ^= 0xff;
+    ChkIfA(cache.Lookup(addrRemote, RolePP, request, requestSize, now) != NULL, E_FAIL);
+    request[STUN_HEADER_SIZE - 1] ^= 0xff;
+
+    // or a different length
+    request[3] += 4;
+    ChkIfA(cache.Lookup(addrRemote, RolePP, request, requestSize, now) != NULL, E_FAIL);
+    request[3] -= 4;
+
+    ChkA(ValidateHit(cache.Lookup(addrRemote, RolePP, request, requestSize, now), 0x11));
+    ChkIfA(cache.GetHitCount() != 3, E_FAIL);
+    ChkIfA(cache.GetMissCount() != 6, E_FAIL);
+
+    // a new request from the same client doesn't find the old response
+    ChkA(InitRequest(addrRemote, RolePP, 0x22));
+    ChkIfA(cache.Lookup(addrRemote, RolePP, _spRequest->GetData(), _spRequest->GetSize(), now) != NULL, E_FAIL);
+
+    cache.Flush();
+    ChkIfA(cache.Lookup(addrRemote, RolePP, request, requestSize, now) != NULL, E_FAIL);
+
+Cleanup:
+    return hr;
+}
+
+// responses are good for TTL milliseconds - across the millisecond counter wrapping
+HRESULT CTestResponseCache::TestExpiry()
+{
+    HRESULT hr = S_OK;
+    CStunResponseCache cache;
+    CSocketAddress addrRemote(0x0a000001, 5000);
+    const uint32_t ttl = 1000;
+    const uint32_t startTimes[] = {0, 123456, 0xffffff00};
+
+    ChkA(cache.Init(16, ttl));
+
+    for (size_t index = 0; index < ARRAYSIZE(startTimes); index++)
+    {
+        uint32_t now = startTimes[index];
+
+        ChkA(InitRequest(addrRemote, RoleAP, 0x33));
+        cache.Store(_msgIn, _msgOut, now);
+
+        ChkA(ValidateHit(cache.Lookup(addrRemote, RoleAP, _spRequest->GetData(), _spRequest->GetSize(), now), 0x33));
+        ChkA(ValidateHit(cache.Lookup(addrRemote, RoleAP, _spRequest->GetData(), _spRequest->GetSize(), now + ttl - 1), 0x33));
+        ChkIfA(cache.Lookup(addrRemote, RoleAP, _spRequest->GetData(), _spRequest->GetSize(), now + ttl) != NULL, E_FAIL);
+        ChkIfA(cache.Lookup(addrRemote, RoleAP, _spRequest->GetData(), _spRequest->GetSize(), now + 10 * ttl) != NULL, E_FAIL);
+    }
+
+Cleanup:
+    return hr;
+}
+
+// a full cache holds on to no more than its size, and always to the latest response
+HRESULT CTestResponseCache::TestEviction()
+{
+    HRESULT hr = S_OK;
+    CStunResponseCache cache;
+    CSocketAddress addrRemote(0x0a000001, 5000);
+    const size_t requestCount = 64;
+    uint8_t requests[requestCount][MAX_STUN_MESSAGE_SIZE];
+    size_t sizes[requestCount];
+    size_t hits = 0;
+
+    ChkA(cache.Init(3, 10000)); // rounded up to 4
+
+    for (size_t index = 0; index < requestCount; index++)
+    {
+        ChkA(InitRequest(addrRemote, RolePP, (uint8_t)index));
+        cache.Store(_msgIn, _msgOut, 0);
+        sizes[index] = _spRequest->GetSize();
+        memcpy(requests[index], _spRequest->GetData(), sizes[index]);
+    }
+
+    ChkA(ValidateHit(cache.Lookup(addrRemote, RolePP, requests[requestCount - 1], sizes[requestCount - 1], 0), (uint8_t)(requestCount - 1)));
+
+    for (size_t index = 0; index < requestCount; index++)
+    {
+        const StunCachedResponse* pCached = cache.Lookup(addrRemote, RolePP, requests[index], sizes[index], 0);
+        if (pCached != NULL)
+        {
+            ChkA(ValidateHit(pCached, (uint8_t)index));
+            hits++;
+        }
+    }
+
+    ChkIfA(hits == 0, E_FAIL);
+    ChkIfA(hits > 4, E_FAIL);
+
+Cleanup:
+    return hr;
+}
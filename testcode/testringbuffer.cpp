@@ -0,0 +1,152 @@
+/*
+   Copyright 2011 John Selbie
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "commonincludes.hpp"
+#include "stuncore.h"
+#include "testringbuffer.h"
+
+
+HRESULT CTestRingBuffer::Run()
+{
+    HRESULT hr = S_OK;
+    
+    ChkA(TestWrapAround());
+    ChkA(TestRegions());
+    
+Cleanup:
+    return hr;
+}
+
+// pushes a counting pattern through a small ring buffer in odd sized chunks
+// so that the reads and writes straddle the end of the buffer in every possible way
+HRESULT CTestRingBuffer::TestWrapAround()
+{
+    HRESULT hr = S_OK;
+    const size_t c_capacity = 37;
+    uint8_t storage[c_capacity];
+    uint8_t chunk[c_capacity];
+    CRingBuffer ring;
+    uint8_t valWrite = 0;
+    uint8_t valRead = 0;
+    
+    ring.Attach(storage, sizeof(storage));
+    
+    ChkIfA(ring.IsEmpty() == false, E_FAIL);
+    ChkIfA(ring.GetFreeSpace() != c_capacity, E_FAIL);
+    
+    for (size_t iteration = 0; iteration < 500; iteration++)
+    {
+        size_t writesize = 1 + (iteration * 7) % c_capacity;
+        size_t readsize = 1 + (iteration * 5) % c_capacity;
+        
+        if (writesize > ring.GetFreeSpace())
+        {
+            // writing more than there's room for has to fail without changing anything
+            size_t sizeBefore = ring.GetSize();
+            ChkIfA(SUCCEEDED(ring.Write(chunk, writesize)), E_FAIL);
+            ChkIfA(ring.GetSize() != sizeBefore, E_FAIL);
+            writesize = ring.GetFreeSpace();
+        }
+        
+        for (size_t index = 0; index < writesize; index++)
+        {
+            chunk[index] = valWrite++;
+        }
+        ChkA(ring.Write(chunk, writesize));
+        
+        if (readsize > ring.GetSize())
+        {
+            readsize = ring.GetSize();
+        }
+        
+        ChkA(ring.Peek(chunk, readsize));
+        ring.Consume(readsize);
+        
+        for (size_t index = 0; index < readsize; index++)
+        {
+            ChkIfA(chunk[index] != valRead, E_FAIL);
+            valRead++;
+        }
+        
+        ChkIfA(ring.GetSize() + ring.GetFreeSpace() != c_capacity, E_FAIL);
+    }
+    
+Cleanup:
+    return hr;
+}
+
+HRESULT CTestRingBuffer::TestRegions()
+{
+    HRESULT hr = S_OK;
+    uint8_t storage[100];
+    CRingBuffer ring;
+    iovec regions[2];
+    size_t numregions;
+    
+    ring.Attach(storage, sizeof(storage));
+    
+    // empty buffer - all the free space is in one region
+    numregions = ring.GetWriteRegions(regions);
+    ChkIfA(numregions != 1, E_FAIL);
+    ChkIfA(regions[0].iov_base != storage, E_FAIL);
+    ChkIfA(regions[0].iov_len != 100, E_FAIL);
+    ChkIfA(ring.GetReadRegions(regions, 100) != 0, E_FAIL);
+    
+    // simulate a readv of 90 bytes, then consuming 80 of them
+    ring.CommitWrite(90);
+    ring.Consume(80);
+    
+    // the data is contiguous
+    numregions = ring.GetReadRegions(regions, 100);
+    ChkIfA(numregions != 1, E_FAIL);
+    ChkIfA(regions[0].iov_base != storage+80, E_FAIL);
+    ChkIfA(regions[0].iov_len != 10, E_FAIL);
+    
+    // the free space wraps around
+    numregions = ring.GetWriteRegions(regions);
+    ChkIfA(numregions != 2, E_FAIL);
+    ChkIfA(regions[0].iov_base != storage+90, E_FAIL);
+    ChkIfA(regions[0].iov_len != 10, E_FAIL);
+    ChkIfA(regions[1].iov_base != storage, E_FAIL);
+    ChkIfA(regions[1].iov_len != 80, E_FAIL);
+    
+    // now the data wraps around
+    ring.CommitWrite(30);
+    numregions = ring.GetReadRegions(regions, 100);
+    ChkIfA(numregions != 2, E_FAIL);
+    ChkIfA(regions[0].iov_len != 20, E_FAIL);
+    ChkIfA(regions[1].iov_base != storage, E_FAIL);
+    ChkIfA(regions[1].iov_len != 20, E_FAIL);
+    
+    // but limiting the read to what's before the end is one region
+    numregions = ring.GetReadRegions(regions, 15);
+    ChkIfA(numregions != 1, E_FAIL);
+    ChkIfA(regions[0].iov_len != 15, E_FAIL);
+    
+    // draining the buffer puts the read position back at the start
+    ring.Consume(40);
+    ChkIfA(ring.IsEmpty() == false, E_FAIL);
+    numregions = ring.GetWriteRegions(regions);
+    ChkIfA(numregions != 1, E_FAIL);
+    ChkIfA(regions[0].iov_base != storage, E_FAIL);
+    
+    ring.CommitWrite(100);
+    ChkIfA(ring.IsFull() == false, E_FAIL);
+    ChkIfA(ring.GetWriteRegions(regions) != 0, E_FAIL);
+    
+Cleanup:
+    return hr;
+}
@@ -0,0 +1,34 @@
+/*
+   Copyright 2011 John Selbie
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef TEST_RING_BUFFER_H
+#define TEST_RING_BUFFER_H
+
+#include "unittest.h"
+
+
+class CTestRingBuffer : public IUnitTest
+{
+private:
+    HRESULT TestWrapAround();
+    HRESULT TestRegions();
+    
+public:
+    virtual HRESULT Run();
+    UT_DECLARE_TEST_NAME("CTestRingBuffer");
+};
+
+#endif
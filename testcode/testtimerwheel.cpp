@@ -0,0 +1,209 @@
+/*
+   Copyright 2011 John Selbie
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "commonincludes.hpp"
+#include "testtimerwheel.h"
+#include "timerwheel.h"
+
+
+HRESULT CTestTimerWheel::Run()
+{
+    HRESULT hr = S_OK;
+    
+    ChkA(TestExpirationOrder());
+    ChkA(TestCancel());
+    ChkA(TestIncremental());
+    
+Cleanup:
+    return hr;
+}
+
+// schedules timers spread across every level of the wheel (and beyond it)
+// and validates that each one fires exactly once, never early, and at most a tick late
+HRESULT CTestTimerWheel::TestExpirationOrder()
+{
+    HRESULT hr = S_OK;
+    const size_t c_count = 2000;
+    const uint32_t c_tick = 10;
+    const uint64_t c_timeStart = 123456789;
+    std::vector<TestTimer> timers(c_count);
+    CTimerWheel wheel;
+    uint64_t timeNow = c_timeStart;
+    uint64_t timeLast = 0;
+    size_t fired = 0;
+    TimerWheelNode* pNode = NULL;
+    
+    ChkA(wheel.Init(c_tick, timeNow));
+    
+    srand(100);
+    for (size_t index = 0; index < c_count; index++)
+    {
+        // a mix of timeouts that land on each level of the wheel
+        uint64_t delta = ((uint64_t)(rand() % 1000)) << ((index % 4) * 5);
+        
+        // and a few that are past the 64^4 tick range of the wheel
+        if ((index % 100) == 0)
+        {
+            delta = ((((uint64_t)1) << 24) + (uint64_t)(rand() % 1000)) * c_tick;
+        }
+        
+        CTimerWheel::InitNode(&timers[index].node, &timers[index]);
+        timers[index].timeExpire = timeNow + delta;
+        timers[index].fFired = false;
+        wheel.Schedule(&timers[index].node, timers[index].timeExpire);
+        
+        timeLast = std::max(timeLast, timers[index].timeExpire);
+    }
+    
+    ChkIfA(wheel.GetCount() != c_count, E_FAIL);
+    
+    while (timeNow <= timeLast + 2*c_tick)
+    {
+        while ((pNode = wheel.PopExpired(timeNow)) != NULL)
+        {
+            TestTimer* pTimer = (TestTimer*)(pNode->pContext);
+            ChkIfA(pTimer->fFired, E_FAIL);
+            ChkIfA(CTimerWheel::IsScheduled(pNode), E_FAIL);
+            
+            // never early
+            ChkIfA(timeNow < pTimer->timeExpire, E_FAIL);
+            
+            // and we advance time in increments that would catch anything later than one tick
+            ChkIfA(timeNow >= (pTimer->timeExpire + 2*c_tick), E_FAIL);
+            
+            pTimer->fFired = true;
+            fired++;
+        }
+        
+        timeNow += c_tick;
+    }
+    
+    ChkIfA(fired != c_count, E_FAIL);
+    ChkIfA(wheel.GetCount() != 0, E_FAIL);
+    ChkIfA(wheel.GetMillisecondsToNextTick(timeNow) != -1, E_FAIL);
+    
+Cleanup:
+    return hr;
+}
+
+HRESULT CTestTimerWheel::TestCancel()
+{
+    HRESULT hr = S_OK;
+    const size_t c_count = 500;
+    std::vector<TestTimer> timers(c_count);
+    CTimerWheel wheel;
+    uint64_t timeNow = 0;
+    size_t fired = 0;
+    TimerWheelNode* pNode = NULL;
+    
+    ChkA(wheel.Init(1, timeNow));
+    
+    for (size_t index = 0; index < c_count; index++)
+    {
+        CTimerWheel::InitNode(&timers[index].node, &timers[index]);
+        timers[index].timeExpire = 100 + index * 7;
+        timers[index].fFired = false;
+        timers[index].fCancelled = false;
+        wheel.Schedule(&timers[index].node, timers[index].timeExpire);
+    }
+    
+    // cancel every third timer, and push every other one further out (reschedule is implicitly a cancel)
+    for (size_t index = 0; index < c_count; index++)
+    {
+        if ((index % 3) == 0)
+        {
+            wheel.Cancel(&timers[index].node);
+            timers[index].fCancelled = true;
+            ChkIfA(CTimerWheel::IsScheduled(&timers[index].node), E_FAIL);
+        }
+        else if ((index % 2) == 0)
+        {
+            timers[index].timeExpire += 5000;
+            wheel.Schedule(&timers[index].node, timers[index].timeExpire);
+        }
+    }
+    
+    // cancelling twice is harmless
+    wheel.Cancel(&timers[0].node);
+    
+    ChkIfA(wheel.GetCount() != (c_count - (c_count+2)/3), E_FAIL);
+    
+    for (timeNow = 0; timeNow < 10000; timeNow++)
+    {
+        while ((pNode = wheel.PopExpired(timeNow)) != NULL)
+        {
+            TestTimer* pTimer = (TestTimer*)(pNode->pContext);
+            ChkIfA(pTimer->fCancelled, E_FAIL);
+            ChkIfA(pTimer->fFired, E_FAIL);
+            ChkIfA(pTimer->timeExpire != timeNow, E_FAIL); // with a 1ms tick, expirations are exact
+            pTimer->fFired = true;
+            fired++;
+        }
+    }
+    
+    ChkIfA(fired != (c_count - (c_count+2)/3), E_FAIL);
+    
+Cleanup:
+    return hr;
+}
+
+HRESULT CTestTimerWheel::TestIncremental()
+{
+    HRESULT hr = S_OK;
+    const size_t c_count = 10;
+    TestTimer timers[c_count];
+    CTimerWheel wheel;
+    uint64_t timeNow = 5000;
+    TimerWheelNode* pNode = NULL;
+    
+    ChkA(wheel.Init(100, timeNow));
+    
+    ChkIfA(wheel.GetMillisecondsToNextTick(timeNow) != -1, E_FAIL);
+    ChkIfA(wheel.PopExpired(timeNow) != NULL, E_FAIL);
+    
+    for (size_t index = 0; index < c_count; index++)
+    {
+        CTimerWheel::InitNode(&timers[index].node, &timers[index]);
+        wheel.Schedule(&timers[index].node, timeNow + 1000);
+    }
+    
+    // nothing due yet - the caller should be told to sleep until the next tick
+    ChkIfA(wheel.PopExpired(timeNow) != NULL, E_FAIL);
+    ChkIfA(wheel.GetMillisecondsToNextTick(timeNow) <= 0, E_FAIL);
+    ChkIfA(wheel.GetMillisecondsToNextTick(timeNow) > 100, E_FAIL);
+    
+    // a long stall, then everything comes due at once
+    timeNow += 60000;
+    
+    // pull them off a few at a time, the rest stay queued and the wheel reports there's more work to do
+    for (size_t index = 0; index < c_count; index++)
+    {
+        pNode = wheel.PopExpired(timeNow);
+        ChkIfA(pNode == NULL, E_FAIL);
+        ChkIfA(wheel.GetCount() != (c_count - index - 1), E_FAIL);
+        
+        if (index < (c_count - 1))
+        {
+            ChkIfA(wheel.GetMillisecondsToNextTick(timeNow) != 0, E_FAIL);
+        }
+    }
+    
+    ChkIfA(wheel.PopExpired(timeNow) != NULL, E_FAIL);
+    ChkIfA(wheel.GetMillisecondsToNextTick(timeNow) != -1, E_FAIL);
+    
+Cleanup:
+    return hr;
+}
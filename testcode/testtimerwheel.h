@@ -0,0 +1,45 @@
+/*
+   Copyright 2011 John Selbie
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef TEST_TIMER_WHEEL_H
+#define TEST_TIMER_WHEEL_H
+
+#include "timerwheel.h"
+#include "unittest.h"
+
+
+class CTestTimerWheel : public IUnitTest
+{
+private:
+    
+    struct TestTimer
+    {
+        TimerWheelNode node;
+        uint64_t timeExpire;
+        bool fFired;
+        bool fCancelled;
+    };
+    
+    HRESULT TestExpirationOrder();
+    HRESULT TestCancel();
+    HRESULT TestIncremental();
+    
+public:
+    virtual HRESULT Run();
+    UT_DECLARE_TEST_NAME("CTestTimerWheel");
+};
+
+#endif
@@ -0,0 +1,392 @@
+/*
+   Copyright 2011 John Selbie
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+
+#include "commonincludes.hpp"
+#include "stuncore.h"
+#include "polling.h"
+#include "testtlssession.h"
+
+#include <openssl/x509.h>
+#include <openssl/evp.h>
+#include <openssl/ec.h>
+
+
+CTlsLoopback::CTlsLoopback() :
+_sockListen(-1)
+{
+    ;
+}
+
+CTlsLoopback::~CTlsLoopback()
+{
+    if (_sockListen != -1)
+    {
+        close(_sockListen);
+        _sockListen = -1;
+    }
+}
+
+HRESULT CTlsLoopback::CreateSelfSignedCertificate(X509** ppCertificate, EVP_PKEY** ppKey)
+{
+    HRESULT hr = S_OK;
+    EVP_PKEY_CTX* pKeyContext = NULL;
+    EVP_PKEY* pKey = NULL;
+    X509* pCertificate = NULL;
+    X509_NAME* pName = NULL;
+
+    // P-256 - key generation is quick enough to do for every test run
+    pKeyContext = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, NULL);
+    ChkIfA(pKeyContext == NULL, E_FAIL);
+    ChkIfA(EVP_PKEY_keygen_init(pKeyContext) != 1, E_FAIL);
+    ChkIfA(EVP_PKEY_CTX_set_ec_paramgen_curve_nid(pKeyContext, NID_X9_62_prime256v1) != 1, E_FAIL);
+    ChkIfA(EVP_PKEY_keygen(pKeyContext, &pKey) != 1, E_FAIL);
+
+    pCertificate = X509_new();
+    ChkIfA(pCertificate == NULL, E_OUTOFMEMORY);
+    X509_set_version(pCertificate, 2);
+    ASN1_INTEGER_set(X509_get_serialNumber(pCertificate), 1);
+    X509_gmtime_adj(X509_getm_notBefore(pCertificate), 0);
+    X509_gmtime_adj(X509_getm_notAfter(pCertificate), 3600);
+    ChkIfA(X509_set_pubkey(pCertificate, pKey) != 1, E_FAIL);
+
+    pName = X509_get_subject_name(pCertificate);
+    X509_NAME_add_entry_by_txt(pName, "CN", MBSTRING_ASC, (const unsigned char*)"localhost", -1, -1, 0);
+    ChkIfA(X509_set_issuer_name(pCertificate, pName) != 1, E_FAIL);
+    ChkIfA(X509_sign(pCertificate, pKey, EVP_sha256()) == 0, E_FAIL);
+
+    *ppCertificate = pCertificate;
+    *ppKey = pKey;
+    pCertificate = NULL;
+    pKey = NULL;
+
+Cleanup:
+    X509_free(pCertificate);
+    EVP_PKEY_free(pKey);
+    EVP_PKEY_CTX_free(pKeyContext);
+    return hr;
+}
+
+HRESULT CTlsLoopback::Init()
+{
+    HRESULT hr = S_OK;
+    X509* pCertificate = NULL;
+    EVP_PKEY* pKey = NULL;
+    sockaddr_in addr = {};
+    int ret;
+
+    ChkA(CreateSelfSignedCertificate(&pCertificate, &pKey));
+
+    ChkA(CTlsContext::CreateInstanceNoInit(_spServerContext.GetPointerPointer()));
+    ChkA(_spServerContext->InitServer(pCertificate, pKey));
+
+    ChkA(CTlsContext::CreateInstanceNoInit(_spClientContext.GetPointerPointer()));
+    ChkA(_spClientContext->InitClient());
+
+    _sockListen = socket(AF_INET, SOCK_STREAM, 0);
+    ChkIfA(_sockListen == -1, ERRNOHR);
+
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0; // let the OS pick
+    ret = bind(_sockListen, (sockaddr*)&addr, sizeof(addr));
+    ChkIfA(ret == -1, ERRNOHR);
+
+    ret = listen(_sockListen, 128);
+    ChkIfA(ret == -1, ERRNOHR);
+
+Cleanup:
+    X509_free(pCertificate);
+    EVP_PKEY_free(pKey);
+    return hr;
+}
+
+HRESULT CTlsLoopback::Connect(int* pSockClient, int* pSockServer)
+{
+    HRESULT hr = S_OK;
+    sockaddr_in addr = {};
+    socklen_t addrlen = sizeof(addr);
+    int sockClient = -1;
+    int sockServer = -1;
+    int ret;
+    int one = 1;
+
+    ret = getsockname(_sockListen, (sockaddr*)&addr, &addrlen);
+    ChkIfA(ret == -1, ERRNOHR);
+
+    sockClient = socket(AF_INET, SOCK_STREAM, 0);
+    ChkIfA(sockClient == -1, ERRNOHR);
+
+    // completes right away on loopback, the listen socket's backlog does the rest
+    ret = connect(sockClient, (sockaddr*)&addr, addrlen);
+    ChkIfA(ret == -1, ERRNOHR);
+
+    sockServer = accept(_sockListen, NULL, NULL);
+    ChkIfA(sockServer == -1, ERRNOHR);
+
+    ChkIfA(fcntl(sockClient, F_SETFL, fcntl(sockClient, F_GETFL) | O_NONBLOCK) == -1, ERRNOHR);
+    ChkIfA(fcntl(sockServer, F_SETFL, fcntl(sockServer, F_GETFL) | O_NONBLOCK) == -1, ERRNOHR);
+
+    // small records going back and forth would otherwise stall on delayed acks
+    setsockopt(sockClient, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    setsockopt(sockServer, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    *pSockClient = sockClient;
+    *pSockServer = sockServer;
+    sockClient = -1;
+    sockServer = -1;
+
+Cleanup:
+    if (sockClient != -1)
+    {
+        close(sockClient);
+    }
+    if (sockServer != -1)
+    {
+        close(sockServer);
+    }
+    return hr;
+}
+
+HRESULT CTlsLoopback::Handshake(CTlsSession* pClient, int sockClient, CTlsSession* pServer, int sockServer, SSL_SESSION* pResume)
+{
+    HRESULT hr = S_OK;
+    HRESULT hrClient = S_FALSE;
+    HRESULT hrServer = S_FALSE;
+
+    ChkA(pClient->Attach(_spClientContext, sockClient, pResume));
+    ChkA(pServer->Attach(_spServerContext, sockServer));
+
+    // Loopback delivers each flight before the send call returns, so just
+    // alternate between the two sides until they both report completion
+    for (int count = 0; count < 1000; count++)
+    {
+        hrClient = pClient->Handshake();
+        ChkA(hrClient);
+        hrServer = pServer->Handshake();
+        ChkA(hrServer);
+
+        if ((hrClient == S_OK) && (hrServer == S_OK))
+        {
+            break;
+        }
+    }
+
+    ChkIfA(pClient->IsHandshakeComplete() == false, E_FAIL);
+    ChkIfA(pServer->IsHandshakeComplete() == false, E_FAIL);
+
+Cleanup:
+    return hr;
+}
+
+HRESULT CTlsLoopback::Transfer(CTlsSession* pFrom, CTlsSession* pTo, const uint8_t* pData, size_t size, uint8_t* pReceived)
+{
+    HRESULT hr = S_OK;
+    size_t sent = 0;
+    size_t received = 0;
+    size_t bytes = 0;
+
+    for (int count = 0; (received < size) && (count < 100000); count++)
+    {
+        if (sent < size)
+        {
+            hr = pFrom->Write(pData + sent, size - sent, &bytes);
+            ChkA(hr);
+            sent += (hr == S_OK) ? bytes : 0;
+        }
+
+        hr = pTo->Read(pReceived + received, size - received, &bytes);
+        ChkA(hr);
+        received += (hr == S_OK) ? bytes : 0;
+    }
+
+    hr = S_OK;
+    ChkIfA(received != size, E_FAIL);
+
+Cleanup:
+    return hr;
+}
+
+
+// ------------------------------------------------------------------
+
+
+HRESULT CTestTlsSession::Run()
+{
+    HRESULT hr = S_OK;
+    CTlsLoopback loopback;
+    SSL_SESSION* pSession = NULL;
+
+    ChkA(loopback.Init());
+    ChkA(TestHandshakeAndData(loopback, &pSession));
+    ChkA(TestResumption(loopback, pSession));
+    ChkA(TestPeerClose(loopback));
+
+Cleanup:
+    if (pSession)
+    {
+        SSL_SESSION_free(pSession);
+    }
+    return hr;
+}
+
+// full handshake, then a request and response in each direction, sized so that
+// the response is larger than one read
+HRESULT CTestTlsSession::TestHandshakeAndData(CTlsLoopback& loopback, SSL_SESSION** ppSession)
+{
+    HRESULT hr = S_OK;
+    int sockClient = -1;
+    int sockServer = -1;
+    CTlsSession client;
+    CTlsSession server;
+    uint8_t request[100];
+    uint8_t response[20000];
+    uint8_t received[20000];
+
+    for (size_t index = 0; index < sizeof(response); index++)
+    {
+        response[index] = (uint8_t)(index * 7);
+        if (index < sizeof(request))
+        {
+            request[index] = (uint8_t)index;
+        }
+    }
+
+    ChkA(loopback.Connect(&sockClient, &sockServer));
+    ChkA(loopback.Handshake(&client, sockClient, &server, sockServer, NULL));
+
+    ChkIfA(client.IsResumed(), E_FAIL);
+    ChkIfA(server.IsResumed(), E_FAIL);
+
+    ChkA(CTlsLoopback::Transfer(&client, &server, request, sizeof(request), received));
+    ChkIfA(memcmp(request, received, sizeof(request)) != 0, E_FAIL);
+
+    // nothing left over on either side
+    ChkIfA(server.HasPendingData(), E_FAIL);
+
+    ChkA(CTlsLoopback::Transfer(&server, &client, response, sizeof(response), received));
+    ChkIfA(memcmp(response, received, sizeof(response)) != 0, E_FAIL);
+
+    // the server's session ticket has been read by now
+    *ppSession = client.GetSession();
+    ChkIfA(*ppSession == NULL, E_FAIL);
+
+Cleanup:
+    client.Close();
+    server.Close();
+    if (sockClient != -1)
+    {
+        close(sockClient);
+    }
+    if (sockServer != -1)
+    {
+        close(sockServer);
+    }
+    return hr;
+}
+
+HRESULT CTestTlsSession::TestResumption(CTlsLoopback& loopback, SSL_SESSION* pSession)
+{
+    HRESULT hr = S_OK;
+    int sockClient = -1;
+    int sockServer = -1;
+    CTlsSession client;
+    CTlsSession server;
+    uint8_t request[20] = {1,2,3,4,5,6,7,8,9,10,11,12,13,14,15,16,17,18,19,20};
+    uint8_t received[20];
+
+    ChkA(loopback.Connect(&sockClient, &sockServer));
+    ChkA(loopback.Handshake(&client, sockClient, &server, sockServer, pSession));
+
+    // the ticket from the previous connection should have gotten us an abbreviated handshake
+    ChkIfA(client.IsResumed() == false, E_FAIL);
+    ChkIfA(server.IsResumed() == false, E_FAIL);
+
+    ChkA(CTlsLoopback::Transfer(&client, &server, request, sizeof(request), received));
+    ChkIfA(memcmp(request, received, sizeof(request)) != 0, E_FAIL);
+
+Cleanup:
+    client.Close();
+    server.Close();
+    if (sockClient != -1)
+    {
+        close(sockClient);
+    }
+    if (sockServer != -1)
+    {
+        close(sockServer);
+    }
+    return hr;
+}
+
+// a clean close (close_notify) and an abrupt one (no close_notify) both have to surface as a failed read
+HRESULT CTestTlsSession::TestPeerClose(CTlsLoopback& loopback)
+{
+    HRESULT hr = S_OK;
+    int sockClient = -1;
+    int sockServer = -1;
+    CTlsSession client;
+    CTlsSession server;
+    uint8_t buffer[100];
+    size_t bytes = 0;
+
+    for (int pass = 0; pass < 2; pass++)
+    {
+        bool fCleanClose = (pass == 0);
+
+        ChkA(loopback.Connect(&sockClient, &sockServer));
+        ChkA(loopback.Handshake(&client, sockClient, &server, sockServer, NULL));
+
+        // nothing to read yet
+        hr = server.Read(buffer, sizeof(buffer), &bytes);
+        ChkIfA(hr != S_FALSE, E_FAIL);
+        ChkIfA((server.GetWantedEvents() & IPOLLING_READ) == 0, E_FAIL);
+
+        if (fCleanClose)
+        {
+            client.Close();
+        }
+        close(sockClient);
+        sockClient = -1;
+
+        // a session ticket may be processed before the close shows up
+        hr = S_FALSE;
+        for (int count = 0; (hr == S_FALSE) && (count < 100); count++)
+        {
+            hr = server.Read(buffer, sizeof(buffer), &bytes);
+        }
+        ChkIfA(hr != E_FAIL, E_FAIL);
+        hr = S_OK;
+
+        client.Close();
+        server.Close();
+        close(sockServer);
+        sockServer = -1;
+    }
+
+Cleanup:
+    client.Close();
+    server.Close();
+    if (sockClient != -1)
+    {
+        close(sockClient);
+    }
+    if (sockServer != -1)
+    {
+        close(sockServer);
+    }
+    return hr;
+}
@@ -0,0 +1,68 @@
+/*
+   Copyright 2011 John Selbie
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef TEST_TLS_SESSION_H
+#define TEST_TLS_SESSION_H
+
+#include "unittest.h"
+#include "tlssession.h"
+
+
+// helpers shared with the TLS benchmark
+class CTlsLoopback
+{
+private:
+    int _sockListen;
+    CRefCountedPtr<CTlsContext> _spServerContext;
+    CRefCountedPtr<CTlsContext> _spClientContext;
+
+    static HRESULT CreateSelfSignedCertificate(X509** ppCertificate, EVP_PKEY** ppKey);
+
+    // disallow copy and assignment
+    CTlsLoopback(const CTlsLoopback&);
+    void operator=(const CTlsLoopback&);
+
+public:
+    CTlsLoopback();
+    ~CTlsLoopback();
+
+    // creates server and client contexts and a listening socket on 127.0.0.1
+    HRESULT Init();
+
+    // a connected pair of non-blocking TCP sockets, client side and server side
+    HRESULT Connect(int* pSockClient, int* pSockServer);
+
+    // attaches the two sessions to the sockets and runs both sides of the handshake to completion
+    HRESULT Handshake(CTlsSession* pClient, int sockClient, CTlsSession* pServer, int sockServer, SSL_SESSION* pResume);
+
+    // sends size bytes from one session and reads them all back out on the other
+    static HRESULT Transfer(CTlsSession* pFrom, CTlsSession* pTo, const uint8_t* pData, size_t size, uint8_t* pReceived);
+};
+
+
+class CTestTlsSession : public IUnitTest
+{
+private:
+    HRESULT TestHandshakeAndData(CTlsLoopback& loopback, SSL_SESSION** ppSession);
+    HRESULT TestResumption(CTlsLoopback& loopback, SSL_SESSION* pSession);
+    HRESULT TestPeerClose(CTlsLoopback& loopback);
+
+public:
+    virtual HRESULT Run();
+    UT_DECLARE_TEST_NAME("CTestTlsSession");
+};
+
+#endif